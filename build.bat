@@ -44,13 +44,13 @@ IF "%~1"=="" (
 
 IF %build_debug%==1 (
 
-REM Build shared dll, client, and server in Debug mode.
+REM Build shared dll, client, server, and benchmarks in Debug mode.
 
 echo.
 echo --- Debug build ---
 echo.
 
-msbuild "ppchat.sln" -nologo -nowarn:MSB8028 -property:Configuration=Debug -property:Platform=x64 -t:ppchat-shared:rebuild -t:ppchat-server:rebuild -t:ppchat-client:rebuild
+msbuild "ppchat.sln" -nologo -nowarn:MSB8028 -property:Configuration=Debug -property:Platform=x64 -t:ppchat-shared:rebuild -t:ppchat-server:rebuild -t:ppchat-client:rebuild -t:ppchat-bench:rebuild
 echo.
 
 cd build\Debug_x64\
@@ -65,6 +65,9 @@ copy /y ppchat-server\ppchat-server.pdb ppchat-server.pdb
 copy /y ppchat-client\ppchat-client.exe ppchat-client.exe
 copy /y ppchat-client\ppchat-client.pdb ppchat-client.pdb
 
+copy /y ppchat-bench\ppchat-bench.exe ppchat-bench.exe
+copy /y ppchat-bench\ppchat-bench.pdb ppchat-bench.pdb
+
 cd ..\..\
 echo.
 
@@ -72,13 +75,13 @@ echo.
 
 IF %build_release%==1 (
 
-REM Build shared dll, client, and server in Release mode.
+REM Build shared dll, client, server, and benchmarks in Release mode.
 
 echo.
 echo --- Release build ---
 echo.
 
-msbuild "ppchat.sln" -nologo -nowarn:MSB8028 -property:Configuration=Release -property:Platform=x64 -t:ppchat-shared:rebuild -t:ppchat-server:rebuild -t:ppchat-client:rebuild
+msbuild "ppchat.sln" -nologo -nowarn:MSB8028 -property:Configuration=Release -property:Platform=x64 -t:ppchat-shared:rebuild -t:ppchat-server:rebuild -t:ppchat-client:rebuild -t:ppchat-bench:rebuild
 echo.
 
 cd build\Release_x64\
@@ -90,6 +93,8 @@ copy /y ppchat-server\ppchat-server.exe ppchat-server.exe
 
 copy /y ppchat-client\ppchat-client.exe ppchat-client.exe
 
+copy /y ppchat-bench\ppchat-bench.exe ppchat-bench.exe
+
 cd ..\..\
 echo.
 
@@ -0,0 +1,4474 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../../ppchat-shared/include/ppchat_shared.h"
+#include "../../ppchat-shared/include/ppchat_framing.h"
+#include "../../ppchat-shared/include/ppchat_reactor.h"
+#include "../../ppchat-shared/include/ppchat_ring.h"
+#include "../../ppchat-shared/include/ppchat_checksum.h"
+#include "../../ppchat-shared/include/ppchat_transfer.h"
+#include "../../ppchat-shared/include/ppchat_pool.h"
+#include "../../ppchat-shared/include/ppchat_history.h"
+#include "../../ppchat-shared/include/ppchat_search.h"
+#include "../../ppchat-shared/include/ppchat_compression.h"
+#include "../../ppchat-shared/include/ppchat_byte_order.h"
+#include "../../ppchat-shared/include/ppchat_timer.h"
+#include "../../ppchat-shared/include/ppchat_rate_limit.h"
+#include "../../ppchat-shared/include/ppchat_registry.h"
+#include "../../ppchat-shared/include/ppchat_topics.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+
+char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
+
+// Benchmarks start their own servers on loopback, so they
+// never collide with a real server on PPCHAT_DEFAULT_PORT.
+const char *const BENCH_THREADS_SERVER_PORT = "1338";
+const char *const BENCH_REACTOR_SERVER_PORT = "1339";
+const char *const BENCH_ENGINES_SERVER_PORT = "1340";
+const char *const BENCH_FANOUT_SERVER_PORT = "1341";
+const char *const BENCH_ACCEPT_SERVER_PORT = "1342";
+const char *const BENCH_BACKPRESSURE_SERVER_PORT = "1343";
+const char *const BENCH_CONNECT_SERVER_PORT = "1336";
+const char *const BENCH_PROTOCOL_SERVER_PORT = "1360";
+
+// Has to resolve to both an IPv6 and an IPv4 address for the connect benchmark to race them.
+const char *const BENCH_CONNECT_SERVER_NAME = "localhost";
+
+// Upper bound of round trip times kept for percentiles, later round trips are only counted.
+const int BENCH_MAX_ROUND_TRIP_SAMPLES = 4 * 1024 * 1024;
+const char *const BENCH_SERVER_IP = "::1";
+
+uint64_t get_timestamp() {
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) counter.QuadPart;
+}
+
+double get_seconds_elapsed(uint64_t start_timestamp, uint64_t end_timestamp) {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return (double) (end_timestamp - start_timestamp) / (double) frequency.QuadPart;
+}
+
+int compare_uint64(const void *a, const void *b) {
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+	return (left > right) - (left < right);
+}
+
+// `samples` have to be sorted. Returns microseconds.
+double get_percentile_us(uint64_t *samples, int samples_count, double percentile) {
+	if (samples_count == 0)
+		return 0.0;
+
+	int index = (int) (percentile / 100.0 * (double) (samples_count - 1));
+	return get_seconds_elapsed(0, samples[index]) * 1000000.0;
+}
+
+int get_int_argument(int arguments_count, char *arguments[], int index, int default_value) {
+	if (index >= arguments_count)
+		return default_value;
+
+	int value = atoi(arguments[index]);
+	return (value > 0) ? value : default_value;
+}
+
+/* Thread-per-connection echo server, the model the server used before the reactor. */
+
+typedef struct ThreadedEchoServer {
+	Socket        listen_socket;
+	HANDLE        accept_thread;
+	volatile bool quit;
+	volatile LONG connection_threads_count;
+	volatile LONG failed_threads_count;
+} ThreadedEchoServer;
+
+typedef struct ThreadedEchoConnection {
+	ThreadedEchoServer *server;
+	Socket              socket;
+} ThreadedEchoConnection;
+
+DWORD CALLBACK threaded_echo_connection(void *context) {
+	ThreadedEchoConnection *connection = static_cast<ThreadedEchoConnection *>(context);
+
+	char receive_buffer[PPCHAT_RECEIVE_BUFFER_SIZE];
+	while (!connection->server->quit) {
+		int bytes_received = ppchat_receive(connection->socket, receive_buffer, sizeof(receive_buffer), 0);
+		if (bytes_received <= 0)
+			break;
+
+		int bytes_sent = ppchat_send(connection->socket, receive_buffer, bytes_received, 0);
+		if (bytes_sent == SOCKET_ERROR)
+			break;
+	}
+
+	ppchat_close_socket(&connection->socket);
+	InterlockedDecrement(&connection->server->connection_threads_count);
+	free(connection);
+
+	return EXIT_SUCCESS;
+}
+
+DWORD CALLBACK threaded_echo_accept(void *context) {
+	ThreadedEchoServer *server = static_cast<ThreadedEchoServer *>(context);
+
+	while (!server->quit) {
+		Socket client_socket = ppchat_accept(server->listen_socket, NULL, NULL);
+		if (client_socket.handle == INVALID_SOCKET)
+			continue;
+
+		ThreadedEchoConnection *connection = (ThreadedEchoConnection *) calloc(1, sizeof(*connection));
+		connection->server = server;
+		connection->socket = client_socket;
+
+		InterlockedIncrement(&server->connection_threads_count);
+		HANDLE connection_thread = CreateThread(NULL, 0, threaded_echo_connection, connection, NULL, NULL);
+		if (!connection_thread) {
+			// This is where thread-per-connection runs out of breath first.
+			InterlockedDecrement(&server->connection_threads_count);
+			InterlockedIncrement(&server->failed_threads_count);
+			ppchat_close_socket(&connection->socket);
+			free(connection);
+			continue;
+		}
+
+		CloseHandle(connection_thread);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+bool start_threaded_echo_server(ThreadedEchoServer *server, const char *port) {
+	memset(server, 0, sizeof(*server));
+
+	int error = 0;
+	server->listen_socket = ppchat_create_listen_socket(port, &error);
+	if (server->listen_socket.handle == INVALID_SOCKET) {
+		log_error("Couldn't create listen socket on port %s. Error: %d - %s", port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		return false;
+	}
+
+	server->accept_thread = CreateThread(NULL, 0, threaded_echo_accept, server, NULL, NULL);
+	return server->accept_thread != NULL;
+}
+
+void stop_threaded_echo_server(ThreadedEchoServer *server) {
+	server->quit = true;
+
+	// Closing the listen socket unblocks `accept`.
+	ppchat_close_socket(&server->listen_socket);
+	WaitForSingleObject(server->accept_thread, INFINITE);
+	CloseHandle(server->accept_thread);
+
+	// Connection threads exit once their clients disconnect.
+	for (int attempt = 0; attempt < 500 && server->connection_threads_count > 0; attempt += 1)
+		Sleep(10);
+}
+
+/* Reactor echo server. */
+
+void reactor_echo_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	(void) user_data;
+	ppchat_reactor_send(connection, data, size);
+}
+
+DWORD CALLBACK run_reactor(void *context) {
+	Reactor *reactor = static_cast<Reactor *>(context);
+	ppchat_reactor_run(reactor);
+	return EXIT_SUCCESS;
+}
+
+/* Load driver: keeps one message in flight on every connection and counts round trips. */
+
+typedef struct EchoLoadConnection {
+	int      bytes_received;   // Bytes of the current message echoed back so far.
+	uint64_t send_timestamp;
+} EchoLoadConnection;
+
+typedef struct EchoLoadDriver {
+	Reactor   reactor;
+	char     *message;
+	int       message_size;
+	uint64_t  round_trips_count;
+
+	uint64_t *round_trip_samples;   // QueryPerformanceCounter ticks.
+	int       round_trip_samples_count;
+} EchoLoadDriver;
+
+typedef struct EchoLoadResult {
+	int      connections_established;
+	uint64_t connections_held;
+	uint64_t round_trips_count;
+	double   seconds;
+	double   round_trip_p50_us;
+	double   round_trip_p99_us;
+} EchoLoadResult;
+
+void echo_load_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	(void) data;
+	EchoLoadDriver *driver = static_cast<EchoLoadDriver *>(user_data);
+	EchoLoadConnection *state = static_cast<EchoLoadConnection *>(connection->user_data);
+
+	state->bytes_received += size;
+	while (state->bytes_received >= driver->message_size) {
+		state->bytes_received -= driver->message_size;
+		driver->round_trips_count += 1;
+
+		uint64_t now = get_timestamp();
+		if (driver->round_trip_samples_count < BENCH_MAX_ROUND_TRIP_SAMPLES) {
+			driver->round_trip_samples[driver->round_trip_samples_count] = now - state->send_timestamp;
+			driver->round_trip_samples_count += 1;
+		}
+
+		state->send_timestamp = now;
+		ppchat_reactor_send(connection, driver->message, driver->message_size);
+	}
+}
+
+void echo_load_on_close(Connection *connection, int error, void *user_data) {
+	(void) error;
+	(void) user_data;
+	free(connection->user_data);
+	connection->user_data = NULL;
+}
+
+EchoLoadResult run_echo_load(const char *port, int connections_count, int seconds, int message_size) {
+	EchoLoadResult result = { };
+
+	EchoLoadDriver driver = { };
+	driver.message_size = message_size;
+	driver.message = (char *) malloc(message_size);
+	memset(driver.message, 'x', message_size);
+	driver.round_trip_samples = (uint64_t *) malloc(BENCH_MAX_ROUND_TRIP_SAMPLES * sizeof(uint64_t));
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_receive = echo_load_on_receive;
+	callbacks.on_close = echo_load_on_close;
+	callbacks.user_data = &driver;
+
+	// Driver always uses IOCP, sockets from `ppchat_connect` aren't created for registered I/O.
+	int error = 0;
+	if (!ppchat_reactor_create(&driver.reactor, NULL, &callbacks, &error)) {
+		log_error("Couldn't create driver reactor. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		free(driver.round_trip_samples);
+		free(driver.message);
+		return result;
+	}
+
+	for (int i = 0; i < connections_count; i += 1) {
+		Socket socket = ppchat_connect(BENCH_SERVER_IP, port, &error);
+		if (socket.handle == INVALID_SOCKET)
+			continue;
+
+		Connection *connection = ppchat_reactor_add_socket(&driver.reactor, socket, &error);
+		if (!connection)
+			continue;
+
+		EchoLoadConnection *state = (EchoLoadConnection *) calloc(1, sizeof(*state));
+		state->send_timestamp = get_timestamp();
+		connection->user_data = state;
+
+		result.connections_established += 1;
+		ppchat_reactor_send(connection, driver.message, driver.message_size);
+	}
+
+	uint64_t start_timestamp = get_timestamp();
+	HANDLE driver_thread = CreateThread(NULL, 0, run_reactor, &driver.reactor, NULL, NULL);
+	Sleep(seconds * 1000);
+	ppchat_reactor_stop(&driver.reactor);
+	WaitForSingleObject(driver_thread, INFINITE);
+	CloseHandle(driver_thread);
+	uint64_t end_timestamp = get_timestamp();
+
+	result.seconds = get_seconds_elapsed(start_timestamp, end_timestamp);
+	result.round_trips_count = driver.round_trips_count;
+	result.connections_held = driver.reactor.open_connections_count;
+
+	qsort(driver.round_trip_samples, driver.round_trip_samples_count, sizeof(uint64_t), compare_uint64);
+	result.round_trip_p50_us = get_percentile_us(driver.round_trip_samples, driver.round_trip_samples_count, 50.0);
+	result.round_trip_p99_us = get_percentile_us(driver.round_trip_samples, driver.round_trip_samples_count, 99.0);
+
+	ppchat_reactor_destroy(&driver.reactor);
+	free(driver.round_trip_samples);
+	free(driver.message);
+
+	return result;
+}
+
+void print_echo_load_result(const char *model, int connections_count, EchoLoadResult *result) {
+	log(
+		"%-24s %8d %12d %8llu %14.0f",
+		model,
+		connections_count,
+		result->connections_established,
+		result->connections_held,
+		(result->seconds > 0.0) ? (double) result->round_trips_count / result->seconds : 0.0
+	);
+}
+
+int bench_reactor(int arguments_count, char *arguments[]) {
+	int connections_count = get_int_argument(arguments_count, arguments, 0, 1000);
+	int seconds = get_int_argument(arguments_count, arguments, 1, 10);
+	int message_size = get_int_argument(arguments_count, arguments, 2, 64);
+
+	log("Echo load: %d connections, %d seconds per model, %d byte messages, one message in flight per connection.", connections_count, seconds, message_size);
+	log("%-24s %8s %12s %8s %14s", "Model", "Clients", "Established", "Held", "Messages/sec");
+
+	{
+		ThreadedEchoServer server;
+		if (start_threaded_echo_server(&server, BENCH_THREADS_SERVER_PORT)) {
+			EchoLoadResult result = run_echo_load(BENCH_THREADS_SERVER_PORT, connections_count, seconds, message_size);
+			print_echo_load_result("thread-per-connection", connections_count, &result);
+			if (server.failed_threads_count > 0)
+				log("%-24s %ld connection threads couldn't be created.", "", server.failed_threads_count);
+
+			stop_threaded_echo_server(&server);
+		}
+	}
+
+	{
+		ReactorCallbacks callbacks = { };
+		callbacks.on_receive = reactor_echo_on_receive;
+
+		Reactor server;
+		int error = 0;
+		if (!ppchat_reactor_create(&server, NULL, &callbacks, &error) || !ppchat_reactor_listen(&server, BENCH_REACTOR_SERVER_PORT, &error)) {
+			log_error("Couldn't start reactor server. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			return EXIT_FAILURE;
+		}
+
+		HANDLE server_thread = CreateThread(NULL, 0, run_reactor, &server, NULL, NULL);
+
+		EchoLoadResult result = run_echo_load(BENCH_REACTOR_SERVER_PORT, connections_count, seconds, message_size);
+		print_echo_load_result("reactor (IOCP)", connections_count, &result);
+
+		ppchat_reactor_stop(&server);
+		WaitForSingleObject(server_thread, INFINITE);
+		CloseHandle(server_thread);
+		ppchat_reactor_destroy(&server);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int bench_engines(int arguments_count, char *arguments[]) {
+	int connections_count = get_int_argument(arguments_count, arguments, 0, 1000);
+	int seconds = get_int_argument(arguments_count, arguments, 1, 10);
+	int message_size = get_int_argument(arguments_count, arguments, 2, 64);
+
+	log("Echo load: %d connections, %d seconds per engine, %d byte messages, one message in flight per connection.", connections_count, seconds, message_size);
+	log("%-8s %12s %14s %16s %12s %12s", "Engine", "Established", "Messages/sec", "Syscalls/message", "p50 RTT us", "p99 RTT us");
+
+	ReactorEngine engines[] = { REACTOR_ENGINE_IOCP, REACTOR_ENGINE_RIO };
+	for (int i = 0; i < (int) (sizeof(engines) / sizeof(engines[0])); i += 1) {
+		ReactorOptions options = { };
+		options.engine = engines[i];
+		options.max_connections = connections_count + PPCHAT_REACTOR_PENDING_ACCEPTS;
+
+		ReactorCallbacks callbacks = { };
+		callbacks.on_receive = reactor_echo_on_receive;
+
+		Reactor server;
+		int error = 0;
+		if (!ppchat_reactor_create(&server, &options, &callbacks, &error) || !ppchat_reactor_listen(&server, BENCH_ENGINES_SERVER_PORT, &error)) {
+			log_error("Couldn't start %s reactor server. Error: %d - %s", ppchat_reactor_engine_name(options.engine), error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			continue;
+		}
+
+		HANDLE server_thread = CreateThread(NULL, 0, run_reactor, &server, NULL, NULL);
+
+		EchoLoadResult result = run_echo_load(BENCH_ENGINES_SERVER_PORT, connections_count, seconds, message_size);
+		uint64_t server_system_calls = server.system_calls_count;
+
+		ppchat_reactor_stop(&server);
+		WaitForSingleObject(server_thread, INFINITE);
+		CloseHandle(server_thread);
+		ppchat_reactor_destroy(&server);
+
+		// Accepting connections is part of the count too, it gets amortized over a long enough run.
+		log(
+			"%-8s %12d %14.0f %16.2f %12.1f %12.1f",
+			ppchat_reactor_engine_name(options.engine),
+			result.connections_established,
+			(result.seconds > 0.0) ? (double) result.round_trips_count / result.seconds : 0.0,
+			(result.round_trips_count > 0) ? (double) server_system_calls / (double) result.round_trips_count : 0.0,
+			result.round_trip_p50_us,
+			result.round_trip_p99_us
+		);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Fan-out: one sender, every frame it sends is delivered to all other connections. */
+
+typedef enum FanoutMode {
+	FANOUT_MODE_COPY,   // Frame is copied into every receiver's send queue.
+	FANOUT_MODE_SHARED  // Frame is encoded once and every receiver references it.
+} FanoutMode;
+
+typedef struct FanoutServer {
+	Reactor      reactor;
+	FanoutMode   mode;
+
+	Connection **receivers;
+	int          receivers_count;
+	int          receivers_capacity;
+
+	Connection  *sender;
+	FrameDecoder sender_decoder;
+
+	// Bytes copied while encoding shared frames, on top of what the reactor copies.
+	uint64_t     encode_bytes_copied_count;
+	uint64_t     messages_count;
+} FanoutServer;
+
+bool fanout_server_on_open(Connection *connection, void *user_data) {
+	FanoutServer *server = static_cast<FanoutServer *>(user_data);
+
+	if (server->receivers_count == server->receivers_capacity) {
+		server->receivers_capacity = max(server->receivers_capacity * 2, 1024);
+		server->receivers = (Connection **) realloc(server->receivers, server->receivers_capacity * sizeof(Connection *));
+	}
+
+	server->receivers[server->receivers_count] = connection;
+	server->receivers_count += 1;
+	return true;
+}
+
+void fanout_server_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	FanoutServer *server = static_cast<FanoutServer *>(user_data);
+
+	// Whoever talks first is the sender, it doesn't receive its own messages.
+	if (!server->sender) {
+		server->sender = connection;
+		for (int i = 0; i < server->receivers_count; i += 1) {
+			if (server->receivers[i] == connection) {
+				server->receivers[i] = server->receivers[server->receivers_count - 1];
+				server->receivers_count -= 1;
+				break;
+			}
+		}
+	}
+
+	ppchat_frame_decoder_feed(&server->sender_decoder, data, size);
+
+	Frame frame;
+	while (ppchat_frame_decoder_next(&server->sender_decoder, &frame)) {
+		int payload_size = (int) frame.header.payload_size;
+		server->messages_count += 1;
+
+		if (server->mode == FANOUT_MODE_COPY) {
+			for (int i = 0; i < server->receivers_count; i += 1)
+				ppchat_reactor_send_frame(server->receivers[i], frame.header.type, frame.header.flags, frame.payload, payload_size);
+		} else {
+			SharedBuffer *buffer = ppchat_create_frame_buffer(frame.header.type, frame.header.flags, frame.payload, payload_size);
+			server->encode_bytes_copied_count += buffer->size;
+
+			for (int i = 0; i < server->receivers_count; i += 1)
+				ppchat_reactor_send_shared(server->receivers[i], buffer);
+
+			ppchat_shared_buffer_release(buffer);
+		}
+	}
+}
+
+typedef struct FanoutDriver {
+	Reactor     reactor;
+	Connection *sender;
+	char       *message;
+	int         message_size;
+	int         frame_size;
+	int         receivers_count;
+
+	uint64_t    bytes_received_count;
+	uint64_t    messages_sent_count;
+} FanoutDriver;
+
+// Messages that may be on their way at once. Enough to keep the server busy,
+// small enough that the sender can't run away from slow receivers.
+const int BENCH_FANOUT_WINDOW = 8;
+
+void fanout_driver_send_window(FanoutDriver *driver) {
+	uint64_t frames_received = driver->bytes_received_count / (uint64_t) driver->frame_size;
+	uint64_t messages_delivered = frames_received / (uint64_t) driver->receivers_count;
+
+	while (driver->messages_sent_count - messages_delivered < (uint64_t) BENCH_FANOUT_WINDOW) {
+		ppchat_reactor_send_frame(driver->sender, FRAME_TYPE_CHAT_MESSAGE, 0, driver->message, driver->message_size);
+		driver->messages_sent_count += 1;
+	}
+}
+
+void fanout_driver_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	(void) connection;
+	(void) data;
+	FanoutDriver *driver = static_cast<FanoutDriver *>(user_data);
+
+	driver->bytes_received_count += size;
+	fanout_driver_send_window(driver);
+}
+
+typedef struct FanoutResult {
+	bool     completed;
+	double   messages_per_second;
+	double   deliveries_per_second;
+	double   bytes_copied_per_message;
+} FanoutResult;
+
+FanoutResult run_fanout(ReactorEngine engine, FanoutMode mode, int receivers_count, int seconds, int message_size) {
+	FanoutResult result = { };
+
+	FanoutServer server = { };
+	server.mode = mode;
+	ppchat_frame_decoder_init(&server.sender_decoder, 0);
+
+	ReactorOptions options = { };
+	options.engine = engine;
+	options.max_connections = receivers_count + 1 + PPCHAT_REACTOR_PENDING_ACCEPTS;
+
+	ReactorCallbacks server_callbacks = { };
+	server_callbacks.on_open = fanout_server_on_open;
+	server_callbacks.on_receive = fanout_server_on_receive;
+	server_callbacks.user_data = &server;
+
+	int error = 0;
+	if (!ppchat_reactor_create(&server.reactor, &options, &server_callbacks, &error) || !ppchat_reactor_listen(&server.reactor, BENCH_FANOUT_SERVER_PORT, &error)) {
+		log_error("Couldn't start %s fan-out server. Error: %d - %s", ppchat_reactor_engine_name(engine), error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_frame_decoder_destroy(&server.sender_decoder);
+		return result;
+	}
+
+	HANDLE server_thread = CreateThread(NULL, 0, run_reactor, &server.reactor, NULL, NULL);
+
+	FanoutDriver driver = { };
+	driver.message_size = message_size;
+	driver.frame_size = PPCHAT_FRAME_HEADER_SIZE + message_size;
+	driver.message = (char *) malloc(message_size);
+	memset(driver.message, 'x', message_size);
+
+	ReactorCallbacks driver_callbacks = { };
+	driver_callbacks.on_receive = fanout_driver_on_receive;
+	driver_callbacks.user_data = &driver;
+	ppchat_reactor_create(&driver.reactor, NULL, &driver_callbacks, &error);
+
+	for (int i = 0; i < receivers_count + 1; i += 1) {
+		Socket socket = ppchat_connect(BENCH_SERVER_IP, BENCH_FANOUT_SERVER_PORT, &error);
+		if (socket.handle == INVALID_SOCKET)
+			break;
+
+		Connection *connection = ppchat_reactor_add_socket(&driver.reactor, socket, &error);
+		if (!connection)
+			break;
+
+		if (i == receivers_count)
+			driver.sender = connection;
+		else
+			driver.receivers_count += 1;
+	}
+
+	// Server has to know every receiver before the first message, otherwise
+	// some deliveries would never happen and the window would stall.
+	uint64_t expected_connections = (uint64_t) driver.receivers_count + 1;
+	for (int attempt = 0; attempt < 1000 && server.reactor.open_connections_count < expected_connections; attempt += 1)
+		Sleep(10);
+
+	if (driver.sender && driver.receivers_count == receivers_count && server.reactor.open_connections_count == expected_connections) {
+		// Driver isn't running yet, so it is fine to queue from this thread.
+		fanout_driver_send_window(&driver);
+
+		uint64_t start_timestamp = get_timestamp();
+		HANDLE driver_thread = CreateThread(NULL, 0, run_reactor, &driver.reactor, NULL, NULL);
+		Sleep(seconds * 1000);
+		ppchat_reactor_stop(&driver.reactor);
+		WaitForSingleObject(driver_thread, INFINITE);
+		CloseHandle(driver_thread);
+		double seconds_elapsed = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+		uint64_t frames_received = driver.bytes_received_count / (uint64_t) driver.frame_size;
+		uint64_t messages_delivered = frames_received / (uint64_t) receivers_count;
+
+		// Messages the server encoded but receivers didn't get in time are left out of both sides.
+		uint64_t bytes_copied = server.reactor.bytes_copied_count + server.encode_bytes_copied_count;
+
+		result.completed = true;
+		result.messages_per_second = (double) messages_delivered / seconds_elapsed;
+		result.deliveries_per_second = (double) frames_received / seconds_elapsed;
+		result.bytes_copied_per_message = (server.messages_count > 0) ? (double) bytes_copied / (double) server.messages_count : 0.0;
+	} else {
+		log_error("Only %d of %d receivers could connect to the fan-out server.", driver.receivers_count, receivers_count);
+	}
+
+	ppchat_reactor_destroy(&driver.reactor);
+	free(driver.message);
+
+	ppchat_reactor_stop(&server.reactor);
+	WaitForSingleObject(server_thread, INFINITE);
+	CloseHandle(server_thread);
+	ppchat_reactor_destroy(&server.reactor);
+	ppchat_frame_decoder_destroy(&server.sender_decoder);
+	free(server.receivers);
+
+	return result;
+}
+
+int bench_fanout(int arguments_count, char *arguments[]) {
+	int receivers_argument = get_int_argument(arguments_count, arguments, 0, 0);
+	int seconds = get_int_argument(arguments_count, arguments, 1, 10);
+	int message_size = get_int_argument(arguments_count, arguments, 2, 64);
+
+	int default_receivers[] = { 1000, 10000 };
+	int *receivers = (receivers_argument > 0) ? &receivers_argument : default_receivers;
+	int receivers_runs = (receivers_argument > 0) ? 1 : 2;
+
+	log("Fan-out: 1 sender, %d seconds per run, %d byte messages, up to %d messages in flight.", seconds, message_size, BENCH_FANOUT_WINDOW);
+	log("%-14s %10s %14s %16s %20s", "Mode", "Receivers", "Messages/sec", "Deliveries/sec", "Bytes copied/message");
+
+	struct {
+		const char   *name;
+		ReactorEngine engine;
+		FanoutMode    mode;
+	} modes[] = {
+		{ "copy (iocp)",   REACTOR_ENGINE_IOCP, FANOUT_MODE_COPY   },
+		{ "shared (iocp)", REACTOR_ENGINE_IOCP, FANOUT_MODE_SHARED },
+		{ "shared (rio)",  REACTOR_ENGINE_RIO,  FANOUT_MODE_SHARED },
+	};
+
+	for (int r = 0; r < receivers_runs; r += 1) {
+		for (int m = 0; m < (int) (sizeof(modes) / sizeof(modes[0])); m += 1) {
+			FanoutResult result = run_fanout(modes[m].engine, modes[m].mode, receivers[r], seconds, message_size);
+			if (!result.completed)
+				continue;
+
+			log(
+				"%-14s %10d %14.0f %16.0f %20.0f",
+				modes[m].name,
+				receivers[r],
+				result.messages_per_second,
+				result.deliveries_per_second,
+				result.bytes_copied_per_message
+			);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Ring queue throughput: producers push sequence numbers, one consumer drains and checks them. */
+
+// Baseline that works like the old InputQueue: a ring behind a critical section.
+typedef struct LockedRing {
+	CRITICAL_SECTION critical_section;
+	uint64_t        *items;
+	uint32_t         capacity;
+	uint32_t         first;
+	uint32_t         count;
+} LockedRing;
+
+bool locked_ring_enqueue(LockedRing *ring, uint64_t item) {
+	EnterCriticalSection(&ring->critical_section);
+	bool enqueued = ring->count < ring->capacity;
+	if (enqueued) {
+		ring->items[(ring->first + ring->count) % ring->capacity] = item;
+		ring->count += 1;
+	}
+	LeaveCriticalSection(&ring->critical_section);
+	return enqueued;
+}
+
+int locked_ring_dequeue_batch(LockedRing *ring, uint64_t *out_items, int max_items) {
+	EnterCriticalSection(&ring->critical_section);
+	int items_count = min((int) ring->count, max_items);
+	for (int i = 0; i < items_count; i += 1) {
+		out_items[i] = ring->items[ring->first];
+		ring->first = (ring->first + 1) % ring->capacity;
+	}
+	ring->count -= items_count;
+	LeaveCriticalSection(&ring->critical_section);
+	return items_count;
+}
+
+typedef enum RingBenchQueue {
+	RING_BENCH_QUEUE_LOCKED,
+	RING_BENCH_QUEUE_LOCK_FREE
+} RingBenchQueue;
+
+typedef struct RingBench {
+	RingBenchQueue queue;
+	RingQueue      ring;
+	LockedRing     locked_ring;
+	uint64_t       items_per_producer;
+	volatile LONG  start;
+} RingBench;
+
+typedef struct RingBenchProducer {
+	RingBench *bench;
+	uint64_t   id;
+	uint64_t   full_count;
+} RingBenchProducer;
+
+// Items carry the producer id in the top bits and a sequence number in the rest.
+const int RING_BENCH_PRODUCER_SHIFT = 48;
+
+DWORD CALLBACK run_ring_producer(void *context) {
+	RingBenchProducer *producer = static_cast<RingBenchProducer *>(context);
+	RingBench *bench = producer->bench;
+
+	while (!ReadAcquire(&bench->start))
+		YieldProcessor();
+
+	for (uint64_t i = 0; i < bench->items_per_producer; i += 1) {
+		uint64_t item = (producer->id << RING_BENCH_PRODUCER_SHIFT) | i;
+		for (;;) {
+			bool enqueued = (bench->queue == RING_BENCH_QUEUE_LOCKED)
+				? locked_ring_enqueue(&bench->locked_ring, item)
+				: ppchat_ring_enqueue(&bench->ring, &item);
+			if (enqueued)
+				break;
+
+			producer->full_count += 1;
+			YieldProcessor();
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+typedef struct RingBenchResult {
+	double   items_per_second;
+	uint64_t full_count;
+	bool     valid;
+} RingBenchResult;
+
+RingBenchResult run_ring_bench(RingBenchQueue queue, RingQueueMode mode, int producers_count, int batch_size, bool blocking, uint64_t items_per_producer) {
+	const uint32_t capacity = 1024;
+	RingBenchResult result = { };
+
+	RingBench bench = { };
+	bench.queue = queue;
+	bench.items_per_producer = items_per_producer;
+
+	if (queue == RING_BENCH_QUEUE_LOCKED) {
+		InitializeCriticalSectionAndSpinCount(&bench.locked_ring.critical_section, 500);
+		bench.locked_ring.capacity = capacity;
+		bench.locked_ring.items = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+	} else {
+		ppchat_ring_create(&bench.ring, mode, capacity, sizeof(uint64_t));
+	}
+
+	RingBenchProducer *producers = (RingBenchProducer *) calloc(producers_count, sizeof(*producers));
+	HANDLE *threads = (HANDLE *) calloc(producers_count, sizeof(*threads));
+	uint64_t *expected = (uint64_t *) calloc(producers_count, sizeof(*expected));
+	uint64_t *items = (uint64_t *) malloc(batch_size * sizeof(uint64_t));
+
+	for (int i = 0; i < producers_count; i += 1) {
+		producers[i].bench = &bench;
+		producers[i].id = (uint64_t) i;
+		threads[i] = CreateThread(NULL, 0, run_ring_producer, &producers[i], NULL, NULL);
+	}
+
+	uint64_t total_items = items_per_producer * (uint64_t) producers_count;
+	uint64_t received_items = 0;
+	result.valid = true;
+
+	uint64_t start_timestamp = get_timestamp();
+	WriteRelease(&bench.start, 1);
+
+	while (received_items < total_items) {
+		int items_count;
+		if (queue == RING_BENCH_QUEUE_LOCKED) {
+			items_count = locked_ring_dequeue_batch(&bench.locked_ring, items, batch_size);
+		} else {
+			if (blocking)
+				ppchat_ring_wait(&bench.ring, INFINITE);
+
+			items_count = ppchat_ring_dequeue_batch(&bench.ring, items, batch_size);
+		}
+
+		// Every producer's items have to come out complete and in order.
+		for (int i = 0; i < items_count; i += 1) {
+			uint64_t producer_id = items[i] >> RING_BENCH_PRODUCER_SHIFT;
+			uint64_t sequence = items[i] & ((1ull << RING_BENCH_PRODUCER_SHIFT) - 1);
+			if (producer_id >= (uint64_t) producers_count || sequence != expected[producer_id])
+				result.valid = false;
+			else
+				expected[producer_id] += 1;
+		}
+
+		received_items += items_count;
+		if (items_count == 0 && !blocking)
+			YieldProcessor();
+	}
+
+	double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	WaitForMultipleObjects((DWORD) producers_count, threads, TRUE, INFINITE);
+
+	result.items_per_second = (double) total_items / seconds;
+	for (int i = 0; i < producers_count; i += 1) {
+		result.full_count += producers[i].full_count;
+		CloseHandle(threads[i]);
+	}
+
+	if (queue == RING_BENCH_QUEUE_LOCKED) {
+		DeleteCriticalSection(&bench.locked_ring.critical_section);
+		free(bench.locked_ring.items);
+	} else {
+		ppchat_ring_destroy(&bench.ring);
+	}
+
+	free(items);
+	free(expected);
+	free(threads);
+	free(producers);
+
+	return result;
+}
+
+int bench_ring(int arguments_count, char *arguments[]) {
+	int millions_of_items = get_int_argument(arguments_count, arguments, 0, 10);
+	uint64_t total_items = (uint64_t) millions_of_items * 1000000;
+
+	log("Ring queue: %d million 8 byte items per run, 1024 slots, one consumer.", millions_of_items);
+	log("%-10s %-5s %9s %6s %9s %14s %12s %8s", "Queue", "Mode", "Producers", "Batch", "Blocking", "Items/sec", "Full spins", "Checked");
+
+	struct {
+		RingBenchQueue queue;
+		RingQueueMode  mode;
+		int            producers_count;
+		int            batch_size;
+		bool           blocking;
+	} runs[] = {
+		{ RING_BENCH_QUEUE_LOCKED,    RING_QUEUE_MODE_SPSC, 1, 1,  false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_SPSC, 1, 1,  false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_SPSC, 1, 64, false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_SPSC, 1, 64, true  },
+		{ RING_BENCH_QUEUE_LOCKED,    RING_QUEUE_MODE_MPSC, 4, 64, false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_MPSC, 1, 64, false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_MPSC, 2, 64, false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_MPSC, 4, 64, false },
+		{ RING_BENCH_QUEUE_LOCK_FREE, RING_QUEUE_MODE_MPSC, 4, 64, true  },
+	};
+
+	bool all_valid = true;
+	for (int i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i += 1) {
+		uint64_t items_per_producer = total_items / (uint64_t) runs[i].producers_count;
+		RingBenchResult result = run_ring_bench(runs[i].queue, runs[i].mode, runs[i].producers_count, runs[i].batch_size, runs[i].blocking, items_per_producer);
+		all_valid = all_valid && result.valid;
+
+		log(
+			"%-10s %-5s %9d %6d %9s %14.0f %12llu %8s",
+			(runs[i].queue == RING_BENCH_QUEUE_LOCKED) ? "locked" : "lock-free",
+			(runs[i].mode == RING_QUEUE_MODE_SPSC) ? "spsc" : "mpsc",
+			runs[i].producers_count,
+			runs[i].batch_size,
+			(runs[i].blocking) ? "yes" : "no",
+			result.items_per_second,
+			result.full_count,
+			(result.valid) ? "ok" : "FAILED"
+		);
+	}
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Logging: time spent inside a log call on the calling thread. */
+
+// What every `log()` used to do: local time looked up twice, the whole line
+// formatted on the spot and written out before returning.
+void log_synchronously_like_before(FILE *stream, const char *format, ...) {
+	tm log_time = get_current_local_time();
+	tm message_time = get_current_local_time();
+	(void) message_time;
+
+	char message[2048];
+	int prefix_length = snprintf(message, sizeof(message), "[%02d:%02d:%02d] ", log_time.tm_hour, log_time.tm_min, log_time.tm_sec);
+
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(message + prefix_length, sizeof(message) - prefix_length, format, arguments);
+	va_end(arguments);
+
+	fputs(message, stream);
+}
+
+typedef enum LogBenchPath {
+	LOG_BENCH_PATH_BEFORE,
+	LOG_BENCH_PATH_SYNCHRONOUS,
+	LOG_BENCH_PATH_ASYNCHRONOUS
+} LogBenchPath;
+
+typedef struct LogBench {
+	LogBenchPath  path;
+	FILE         *stream;
+	int           calls_per_thread;
+	int           burst_size;       // 0 logs back to back, otherwise the logging thread catches up between bursts, off the clock.
+	volatile LONG start;
+} LogBench;
+
+typedef struct LogBenchThread {
+	LogBench *bench;
+	uint64_t  call_ticks;
+} LogBenchThread;
+
+DWORD CALLBACK run_log_bench_thread(void *context) {
+	LogBenchThread *thread = static_cast<LogBenchThread *>(context);
+	LogBench *bench = thread->bench;
+
+	// Same line the server logs for every received message.
+	const char *ip = "192.168.100.200";
+	const char message[] = "Hello, how are you doing today?";
+	int message_size = 16;
+
+	while (!ReadAcquire(&bench->start))
+		YieldProcessor();
+
+	int calls_count = 0;
+	while (calls_count < bench->calls_per_thread) {
+		int burst_size = bench->calls_per_thread - calls_count;
+		if (bench->burst_size > 0)
+			burst_size = min(burst_size, bench->burst_size);
+
+		uint64_t start_timestamp = get_timestamp();
+		for (int i = 0; i < burst_size; i += 1) {
+			if (bench->path == LOG_BENCH_PATH_BEFORE)
+				log_synchronously_like_before(bench->stream, "Received %d bytes from '%s'. Message: \"%.*s\"\n", message_size, ip, message_size, message);
+			else
+				_ppchat_log(bench->stream, "", "", "\n", "Received %d bytes from '%s'. Message: \"%.*s\"", message_size, ip, message_size, message);
+		}
+		thread->call_ticks += get_timestamp() - start_timestamp;
+		calls_count += burst_size;
+
+		if (bench->burst_size > 0)
+			ppchat_log_flush();
+	}
+
+	return EXIT_SUCCESS;
+}
+
+typedef struct LogBenchResult {
+	double   nanoseconds_per_call;
+	double   lines_per_second;     // Until the last line is written out.
+	uint64_t stalls_count;
+} LogBenchResult;
+
+LogBenchResult run_log_bench(FILE *stream, LogBenchPath path, int threads_count, int burst_size, int calls_per_thread) {
+	LogBenchResult result = { };
+
+	LogBench bench = { };
+	bench.path = path;
+	bench.stream = stream;
+	bench.calls_per_thread = calls_per_thread;
+	bench.burst_size = burst_size;
+
+	if (path == LOG_BENCH_PATH_ASYNCHRONOUS && !ppchat_log_start())
+		log_warning("Couldn't start the logging thread, measuring the synchronous path instead.");
+
+	uint64_t stalls_count = ppchat_log_get_stalls_count();
+
+	LogBenchThread *threads = (LogBenchThread *) calloc(threads_count, sizeof(*threads));
+	HANDLE *handles = (HANDLE *) calloc(threads_count, sizeof(*handles));
+	for (int i = 0; i < threads_count; i += 1) {
+		threads[i].bench = &bench;
+		handles[i] = CreateThread(NULL, 0, run_log_bench_thread, &threads[i], NULL, NULL);
+	}
+
+	uint64_t start_timestamp = get_timestamp();
+	WriteRelease(&bench.start, 1);
+
+	WaitForMultipleObjects((DWORD) threads_count, handles, TRUE, INFINITE);
+	ppchat_log_flush();
+	fflush(stream);
+
+	double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	uint64_t total_calls = (uint64_t) calls_per_thread * threads_count;
+
+	uint64_t call_ticks = 0;
+	for (int i = 0; i < threads_count; i += 1) {
+		call_ticks += threads[i].call_ticks;
+		CloseHandle(handles[i]);
+	}
+
+	result.nanoseconds_per_call = get_seconds_elapsed(0, call_ticks) * 1000000000.0 / (double) total_calls;
+	result.lines_per_second = (double) total_calls / seconds;
+	result.stalls_count = ppchat_log_get_stalls_count() - stalls_count;
+
+	if (path == LOG_BENCH_PATH_ASYNCHRONOUS)
+		ppchat_log_stop();
+
+	free(handles);
+	free(threads);
+	return result;
+}
+
+int bench_log(int arguments_count, char *arguments[]) {
+	int calls_per_thread = get_int_argument(arguments_count, arguments, 0, 200000);
+
+	// Console output would measure the console, lines go nowhere instead.
+	FILE *stream = fopen("NUL", "w");
+	if (!stream) {
+		log_error("Couldn't open NUL device.");
+		return EXIT_FAILURE;
+	}
+
+	log("Logging: %d calls per thread of the server's per-message line, written to NUL.", calls_per_thread);
+	log("%-13s %8s %6s %10s %14s %10s", "Path", "Threads", "Burst", "ns/call", "Lines/sec", "Stalls");
+
+	struct {
+		LogBenchPath path;
+		int          threads_count;
+		int          burst_size;
+	} runs[] = {
+		{ LOG_BENCH_PATH_BEFORE,       1, 0   },
+		{ LOG_BENCH_PATH_SYNCHRONOUS,  1, 0   },
+		{ LOG_BENCH_PATH_ASYNCHRONOUS, 1, 128 },
+		{ LOG_BENCH_PATH_ASYNCHRONOUS, 1, 0   },
+		{ LOG_BENCH_PATH_BEFORE,       4, 0   },
+		{ LOG_BENCH_PATH_ASYNCHRONOUS, 4, 128 },
+		{ LOG_BENCH_PATH_ASYNCHRONOUS, 4, 0   },
+	};
+
+	const char *path_names[] = { "before", "synchronous", "asynchronous" };
+
+	for (int i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i += 1) {
+		LogBenchResult result = run_log_bench(stream, runs[i].path, runs[i].threads_count, runs[i].burst_size, calls_per_thread);
+
+		char burst[16];
+		if (runs[i].burst_size > 0)
+			snprintf(burst, sizeof(burst), "%d", runs[i].burst_size);
+		else
+			snprintf(burst, sizeof(burst), "-");
+
+		log(
+			"%-13s %8d %6s %10.1f %14.0f %10llu",
+			path_names[runs[i].path],
+			runs[i].threads_count,
+			burst,
+			result.nanoseconds_per_call,
+			result.lines_per_second,
+			result.stalls_count
+		);
+	}
+
+	fclose(stream);
+	return EXIT_SUCCESS;
+}
+
+/* CRC-32C: checksums of file chunks, the way they were commonly done before and the ones we use. */
+
+// One table lookup per byte, the textbook way.
+uint32_t crc32c_bytewise(uint32_t crc, const void *data, size_t size) {
+	static uint32_t table[256];
+	if (table[1] == 0) {
+		for (uint32_t byte = 0; byte < 256; byte += 1) {
+			uint32_t value = byte;
+			for (int bit = 0; bit < 8; bit += 1)
+				value = (value >> 1) ^ ((value & 1) ? 0x82F63B78 : 0);
+
+			table[byte] = value;
+		}
+	}
+
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint32_t state = ~crc;
+	for (size_t i = 0; i < size; i += 1)
+		state = (state >> 8) ^ table[(state ^ bytes[i]) & 0xFF];
+
+	return ~state;
+}
+
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const void *data, size_t size);
+
+int bench_crc(int arguments_count, char *arguments[]) {
+	int megabytes = get_int_argument(arguments_count, arguments, 0, 256);
+	size_t size = (size_t) megabytes * 1024 * 1024;
+
+	unsigned char *data = (unsigned char *) malloc(size);
+	if (!data) {
+		log_error("Couldn't allocate %d MB.", megabytes);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t random_state = 0x9E3779B97F4A7C15ull;
+	for (size_t i = 0; i < size; i += 1) {
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 7;
+		random_state ^= random_state << 17;
+		data[i] = (unsigned char) random_state;
+	}
+
+	// Chunks are checksummed one at a time, so measure at the chunk size.
+	size_t chunk_size = (size_t) PPCHAT_FILE_CHUNK_SIZE;
+	uint32_t expected_crc = crc32c_bytewise(0, data, size);
+
+	log("CRC-32C of %d MB in %d KB chunks. SSE4.2 is %s.", megabytes, PPCHAT_FILE_CHUNK_SIZE / 1024, (ppchat_crc32c_has_hardware_support()) ? "supported" : "not supported");
+	log("%-16s %10s %8s", "Implementation", "GB/s", "Checked");
+
+	struct {
+		const char    *name;
+		Crc32cFunction function;
+		bool           needs_hardware;
+	} runs[] = {
+		{ "bytewise",        crc32c_bytewise,         false },
+		{ "slicing-by-8",    ppchat_crc32c_software,  false },
+		{ "sse4.2",          ppchat_crc32c_hardware,  true  },
+	};
+
+	// Check value of the standard, then every implementation against the bytewise one.
+	bool all_valid = crc32c_bytewise(0, "123456789", 9) == 0xE3069283;
+	for (int i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i += 1) {
+		if (runs[i].needs_hardware && !ppchat_crc32c_has_hardware_support()) {
+			log("%-16s %10s %8s", runs[i].name, "-", "skipped");
+			continue;
+		}
+
+		uint32_t crc = 0;
+		uint64_t start_timestamp = get_timestamp();
+		for (size_t offset = 0; offset < size; offset += chunk_size)
+			crc = runs[i].function(crc, data + offset, min(chunk_size, size - offset));
+
+		double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+		// Odd sizes and offsets go through the unaligned head and tail.
+		bool valid = crc == expected_crc;
+		for (size_t length = 0; valid && length < 64; length += 1)
+			valid = runs[i].function(0, data + 3, length) == crc32c_bytewise(0, data + 3, length);
+
+		all_valid = all_valid && valid;
+		log("%-16s %10.2f %8s", runs[i].name, (double) size / seconds / 1e9, (valid) ? "ok" : "FAILED");
+	}
+
+	free(data);
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Pools: connections coming and going, malloc against the connection pool and the buffer slab. */
+
+typedef struct PoolChurnResult {
+	double nanoseconds_per_cycle;
+	bool   valid;
+} PoolChurnResult;
+
+void *allocate_bench_connection(ObjectPool *pool) {
+	if (!pool)
+		return calloc(1, sizeof(Connection));
+
+	void *connection = ppchat_object_pool_allocate(pool);
+	if (connection)
+		memset(connection, 0, sizeof(Connection));
+
+	return connection;
+}
+
+void free_bench_connection(ObjectPool *pool, void *connection) {
+	if (pool)
+		ppchat_object_pool_free(pool, connection);
+	else
+		free(connection);
+}
+
+char *allocate_bench_buffer(bool pooled) {
+	return (char *) ((pooled) ? ppchat_slab_allocate(PPCHAT_RECEIVE_BUFFER_SIZE, NULL) : malloc(PPCHAT_RECEIVE_BUFFER_SIZE));
+}
+
+void free_bench_buffer(bool pooled, char *buffer) {
+	if (pooled)
+		ppchat_slab_free(buffer, PPCHAT_RECEIVE_BUFFER_SIZE);
+	else
+		free(buffer);
+}
+
+// Keeps `live_count` connections with a receive buffer each and replaces a random
+// one every cycle, the way a busy server accepts and drops clients.
+PoolChurnResult run_pool_churn(bool pooled, int live_count, int cycles_count) {
+	PoolChurnResult result = { };
+
+	ObjectPool connection_pool;
+	ObjectPool *pool = NULL;
+	if (pooled) {
+		ppchat_object_pool_init(&connection_pool, sizeof(Connection), "bench connections");
+		pool = &connection_pool;
+	}
+
+	void **connections = (void **) calloc(live_count, sizeof(void *));
+	char **buffers = (char **) calloc(live_count, sizeof(char *));
+	uint64_t *stamps = (uint64_t *) calloc(live_count, sizeof(uint64_t));
+
+	bool valid = connections && buffers && stamps;
+	for (int i = 0; valid && i < live_count; i += 1) {
+		connections[i] = allocate_bench_connection(pool);
+		buffers[i] = allocate_bench_buffer(pooled);
+		valid = connections[i] && buffers[i];
+	}
+
+	// Every live block carries a stamp of its own, blocks handed out twice would overwrite each other's.
+	uint64_t random_state = 0x2545F4914F6CDD1Dull;
+	uint64_t start_timestamp = get_timestamp();
+	for (int cycle = 0; valid && cycle < cycles_count; cycle += 1) {
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 7;
+		random_state ^= random_state << 17;
+		int index = (int) (random_state % (uint64_t) live_count);
+
+		free_bench_connection(pool, connections[index]);
+		free_bench_buffer(pooled, buffers[index]);
+
+		connections[index] = allocate_bench_connection(pool);
+		buffers[index] = allocate_bench_buffer(pooled);
+		if (!connections[index] || !buffers[index]) {
+			valid = false;
+			break;
+		}
+
+		stamps[index] = random_state;
+		memcpy(connections[index], &random_state, sizeof(random_state));
+		memcpy(buffers[index] + PPCHAT_RECEIVE_BUFFER_SIZE - sizeof(random_state), &random_state, sizeof(random_state));
+	}
+	double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+	for (int i = 0; valid && i < live_count; i += 1) {
+		if (stamps[i] == 0)
+			continue;
+
+		uint64_t connection_stamp;
+		uint64_t buffer_stamp;
+		memcpy(&connection_stamp, connections[i], sizeof(connection_stamp));
+		memcpy(&buffer_stamp, buffers[i] + PPCHAT_RECEIVE_BUFFER_SIZE - sizeof(buffer_stamp), sizeof(buffer_stamp));
+		valid = connection_stamp == stamps[i] && buffer_stamp == stamps[i];
+
+		if (pooled)
+			valid = valid && ((uintptr_t) connections[i] % PPCHAT_CACHE_LINE_SIZE) == 0 && ((uintptr_t) buffers[i] % PPCHAT_CACHE_LINE_SIZE) == 0;
+	}
+
+	for (int i = 0; connections && buffers && i < live_count; i += 1) {
+		if (connections[i])
+			free_bench_connection(pool, connections[i]);
+
+		if (buffers[i])
+			free_bench_buffer(pooled, buffers[i]);
+	}
+
+	if (pool)
+		ppchat_object_pool_destroy(pool);
+
+	free(connections);
+	free(buffers);
+	free(stamps);
+
+	result.nanoseconds_per_cycle = seconds * 1e9 / (double) max(cycles_count, 1);
+	result.valid = valid;
+	return result;
+}
+
+int bench_pool(int arguments_count, char *arguments[]) {
+	int live_count = get_int_argument(arguments_count, arguments, 0, 10000);
+	int cycles_count = get_int_argument(arguments_count, arguments, 1, 10000000);
+	if (live_count <= 0 || cycles_count <= 0) {
+		log_error("Connections and cycles have to be positive.");
+		return EXIT_FAILURE;
+	}
+
+	log("%d connections alive, %d of them replaced one at a time.", live_count, cycles_count);
+	log("%-12s %18s %8s", "Allocator", "ns per connection", "Checked");
+
+	struct {
+		const char *name;
+		bool        pooled;
+	} runs[] = {
+		{ "malloc", false },
+		{ "pool/slab", true },
+	};
+
+	bool all_valid = true;
+	for (int i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i += 1) {
+		PoolChurnResult result = run_pool_churn(runs[i].pooled, live_count, cycles_count);
+		all_valid = all_valid && result.valid;
+		log("%-12s %18.1f %8s", runs[i].name, result.nanoseconds_per_cycle, (result.valid) ? "ok" : "FAILED");
+	}
+
+	// Idle connections used to hold their receive buffer, with zero byte receives they hold none.
+	ObjectPool connection_pool;
+	ppchat_object_pool_init(&connection_pool, sizeof(Connection), "bench connections");
+	log("Idle connection holds %d bytes of reactor memory, %d with its receive buffer.", connection_pool.block_size, connection_pool.block_size + PPCHAT_RECEIVE_BUFFER_SIZE);
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Accept: connections per second one listening reactor spreads over several. */
+
+const int BENCH_MAX_ACCEPT_REACTORS = 64;
+
+typedef struct AcceptLoad {
+	volatile bool quit;
+	volatile LONG served_count;
+	volatile LONG failed_count;
+} AcceptLoad;
+
+// Connects, has one byte echoed back by whichever reactor got the connection, and resets it.
+DWORD CALLBACK accept_load_client(void *context) {
+	AcceptLoad *load = static_cast<AcceptLoad *>(context);
+
+	while (!load->quit) {
+		int error = 0;
+		Socket socket = ppchat_connect(BENCH_SERVER_IP, BENCH_ACCEPT_SERVER_PORT, &error);
+		if (socket.handle == INVALID_SOCKET) {
+			InterlockedIncrement(&load->failed_count);
+			continue;
+		}
+
+		char byte = 1;
+		bool served = ppchat_send(socket, &byte, 1, 0) == 1 && ppchat_receive(socket, &byte, 1, 0) == 1;
+
+		// Reset instead of closing gracefully, so that closed connections don't pile up in TIME_WAIT.
+		linger reset = { };
+		reset.l_onoff = 1;
+		reset.l_linger = 0;
+		ppchat_set_socket_option(socket, SOL_SOCKET, SO_LINGER, (const char *) &reset, sizeof(reset));
+		ppchat_close_socket(&socket);
+
+		if (served)
+			InterlockedIncrement(&load->served_count);
+		else
+			InterlockedIncrement(&load->failed_count);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+typedef struct AcceptResult {
+	double   connections_per_second;
+	uint64_t min_shard_connections;
+	uint64_t max_shard_connections;
+	LONG     failed_count;
+	bool     valid;
+} AcceptResult;
+
+AcceptResult run_accept_load(int reactors_count, int clients_count, int seconds) {
+	AcceptResult result = { };
+
+	// Reactors carry cache line aligned members, so no plain malloc.
+	Reactor *reactors = (Reactor *) _aligned_malloc(reactors_count * sizeof(Reactor), PPCHAT_CACHE_LINE_SIZE);
+	HANDLE reactor_threads[BENCH_MAX_ACCEPT_REACTORS] = { };
+	Reactor *accept_targets[BENCH_MAX_ACCEPT_REACTORS];
+	if (!reactors)
+		return result;
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_receive = reactor_echo_on_receive;
+
+	int created_count = 0;
+	bool started = true;
+	for (int i = 0; started && i < reactors_count; i += 1) {
+		accept_targets[i] = &reactors[i];
+
+		ReactorOptions options = { };
+		if (i == 0 && reactors_count > 1) {
+			options.accept_targets = accept_targets;
+			options.accept_targets_count = reactors_count;
+		}
+
+		int error = 0;
+		started = ppchat_reactor_create(&reactors[i], &options, &callbacks, &error);
+		if (!started) {
+			log_error("Couldn't create reactor %d. Error: %d - %s", i, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			break;
+		}
+
+		created_count += 1;
+	}
+
+	int error = 0;
+	if (started && !ppchat_reactor_listen(&reactors[0], BENCH_ACCEPT_SERVER_PORT, &error)) {
+		log_error("Couldn't listen on port %s. Error: %d - %s", BENCH_ACCEPT_SERVER_PORT, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		started = false;
+	}
+
+	for (int i = 0; started && i < reactors_count; i += 1) {
+		reactor_threads[i] = CreateThread(NULL, 0, run_reactor, &reactors[i], NULL, NULL);
+		SetThreadAffinityMask(reactor_threads[i], (DWORD_PTR) 1 << i);
+	}
+
+	AcceptLoad load = { };
+	HANDLE *client_threads = (HANDLE *) calloc(clients_count, sizeof(HANDLE));
+	if (started && client_threads) {
+		for (int i = 0; i < clients_count; i += 1)
+			client_threads[i] = CreateThread(NULL, 0, accept_load_client, &load, NULL, NULL);
+
+		uint64_t start_timestamp = get_timestamp();
+		Sleep((DWORD) seconds * 1000);
+		load.quit = true;
+
+		for (int i = 0; i < clients_count; i += 1) {
+			if (client_threads[i]) {
+				WaitForSingleObject(client_threads[i], INFINITE);
+				CloseHandle(client_threads[i]);
+			}
+		}
+
+		double elapsed_seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+		result.connections_per_second = (double) load.served_count / elapsed_seconds;
+		result.failed_count = load.failed_count;
+	}
+
+	free(client_threads);
+
+	for (int i = 0; i < created_count; i += 1)
+		ppchat_reactor_stop(&reactors[i]);
+
+	for (int i = 0; i < reactors_count; i += 1) {
+		if (reactor_threads[i]) {
+			WaitForSingleObject(reactor_threads[i], INFINITE);
+			CloseHandle(reactor_threads[i]);
+		}
+	}
+
+	// Every served connection has been opened on some reactor, and with more than
+	// one every reactor has to have gotten its share.
+	uint64_t total_connections_count = 0;
+	result.min_shard_connections = UINT64_MAX;
+	for (int i = 0; i < created_count; i += 1) {
+		uint64_t connections_count = reactors[i].total_connections_count;
+		total_connections_count += connections_count;
+		result.min_shard_connections = min(result.min_shard_connections, connections_count);
+		result.max_shard_connections = max(result.max_shard_connections, connections_count);
+	}
+
+	result.valid = started && load.served_count > 0 && total_connections_count >= (uint64_t) load.served_count && result.min_shard_connections > 0;
+
+	for (int i = 0; i < created_count; i += 1)
+		ppchat_reactor_destroy(&reactors[i]);
+
+	_aligned_free(reactors);
+	return result;
+}
+
+int bench_accept(int arguments_count, char *arguments[]) {
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int cores_count = (int) system_info.dwNumberOfProcessors;
+
+	int reactors_count = get_int_argument(arguments_count, arguments, 0, cores_count);
+	int seconds = get_int_argument(arguments_count, arguments, 1, 5);
+	int clients_count = get_int_argument(arguments_count, arguments, 2, 2 * cores_count);
+	reactors_count = min(max(reactors_count, 1), BENCH_MAX_ACCEPT_REACTORS);
+
+	log("Accept load: %d client threads connecting, exchanging a byte and resetting, %d seconds per run.", clients_count, seconds);
+	log("%-9s %16s %14s %14s %10s %8s", "Reactors", "Connections/sec", "Min per shard", "Max per shard", "Failed", "Checked");
+
+	int runs[] = { 1, reactors_count };
+	int runs_count = (reactors_count > 1) ? 2 : 1;
+
+	bool all_valid = true;
+	for (int i = 0; i < runs_count; i += 1) {
+		AcceptResult result = run_accept_load(runs[i], clients_count, seconds);
+		all_valid = all_valid && result.valid;
+		log("%-9d %16.0f %14llu %14llu %10ld %8s", runs[i], result.connections_per_second, result.min_shard_connections, result.max_shard_connections, result.failed_count, (result.valid) ? "ok" : "FAILED");
+	}
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Backpressure: what a client that stops reading costs the server, with and without a send queue limit. */
+
+typedef struct BackpressureServer {
+	int           frames_count;
+	int           payload_size;
+	char         *payload;
+	volatile LONG flooded;
+} BackpressureServer;
+
+// Any byte from the client has the server queue every frame to it at once.
+void backpressure_server_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	(void) data;
+	(void) size;
+
+	BackpressureServer *server = static_cast<BackpressureServer *>(user_data);
+	for (int i = 0; i < server->frames_count; i += 1)
+		ppchat_reactor_send_frame(connection, FRAME_TYPE_CHAT_MESSAGE, 0, server->payload, server->payload_size);
+
+	InterlockedExchange(&server->flooded, TRUE);
+}
+
+typedef struct BackpressureResult {
+	uint64_t peak_queue_size;
+	uint64_t dropped_frames_count;
+	uint64_t received_size;
+	bool     disconnected;
+	bool     valid;
+} BackpressureResult;
+
+BackpressureResult run_backpressure(SlowConsumerPolicy policy, int send_queue_limit, int frames_count, int payload_size) {
+	BackpressureResult result = { };
+
+	BackpressureServer server = { };
+	server.frames_count = frames_count;
+	server.payload_size = payload_size;
+	server.payload = (char *) calloc(payload_size, 1);
+
+	// Reactors carry cache line aligned members, so no plain malloc.
+	Reactor *reactor = (Reactor *) _aligned_malloc(sizeof(Reactor), PPCHAT_CACHE_LINE_SIZE);
+	if (!server.payload || !reactor) {
+		free(server.payload);
+		_aligned_free(reactor);
+		return result;
+	}
+
+	ReactorOptions options = { };
+	options.send_queue_limit = send_queue_limit;
+	options.slow_consumer_policy = policy;
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_receive = backpressure_server_on_receive;
+	callbacks.user_data = &server;
+
+	int error = 0;
+	bool created = ppchat_reactor_create(reactor, &options, &callbacks, &error);
+	if (!created)
+		log_error("Couldn't create reactor. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+
+	bool started = created;
+	if (started && !ppchat_reactor_listen(reactor, BENCH_BACKPRESSURE_SERVER_PORT, &error)) {
+		log_error("Couldn't listen on port %s. Error: %d - %s", BENCH_BACKPRESSURE_SERVER_PORT, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		started = false;
+	}
+
+	HANDLE reactor_thread = (started) ? CreateThread(NULL, 0, run_reactor, reactor, NULL, NULL) : NULL;
+
+	Socket socket = { };
+	socket.handle = INVALID_SOCKET;
+	if (reactor_thread)
+		socket = ppchat_connect(BENCH_SERVER_IP, BENCH_BACKPRESSURE_SERVER_PORT, &error);
+
+	char byte = 1;
+	if (socket.handle != INVALID_SOCKET && ppchat_send(socket, &byte, 1, 0) == 1) {
+		// A stuck client wouldn't hang the benchmark.
+		DWORD receive_timeout_ms = 5000;
+		ppchat_set_socket_option(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *) &receive_timeout_ms, sizeof(receive_timeout_ms));
+
+		// Don't read anything until the server is done queueing.
+		while (!ReadAcquire(&server.flooded))
+			Sleep(1);
+
+		result.peak_queue_size = reactor->max_send_queue_size;
+		result.dropped_frames_count = reactor->dropped_frames_count;
+
+		int frame_size = PPCHAT_FRAME_HEADER_SIZE + payload_size;
+		uint64_t expected_size = (uint64_t) (frames_count - result.dropped_frames_count) * frame_size;
+
+		char receive_buffer[64 * 1024];
+		while (result.received_size < expected_size) {
+			int bytes_received = ppchat_receive(socket, receive_buffer, sizeof(receive_buffer), 0);
+			if (bytes_received <= 0) {
+				result.disconnected = true;
+				break;
+			}
+
+			result.received_size += bytes_received;
+		}
+
+		// Without a limit everything arrives. Dropping keeps the connection and every
+		// frame that was admitted, disconnecting cuts the slow client off.
+		if (policy == SLOW_CONSUMER_POLICY_DISCONNECT && send_queue_limit > 0)
+			result.valid = result.disconnected && reactor->slow_consumers_disconnected_count == 1;
+		else
+			result.valid = !result.disconnected && result.received_size == expected_size;
+
+		if (send_queue_limit > 0)
+			result.valid = result.valid && result.peak_queue_size <= (uint64_t) send_queue_limit;
+
+		if (send_queue_limit > 0 && policy == SLOW_CONSUMER_POLICY_DROP)
+			result.valid = result.valid && result.dropped_frames_count > 0;
+	} else if (reactor_thread) {
+		log_error("Couldn't connect to the backpressure server. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	}
+
+	if (socket.handle != INVALID_SOCKET)
+		ppchat_close_socket(&socket);
+
+	if (created)
+		ppchat_reactor_stop(reactor);
+
+	if (reactor_thread) {
+		WaitForSingleObject(reactor_thread, INFINITE);
+		CloseHandle(reactor_thread);
+	}
+
+	if (created)
+		ppchat_reactor_destroy(reactor);
+
+	_aligned_free(reactor);
+	free(server.payload);
+	return result;
+}
+
+int bench_backpressure(int arguments_count, char *arguments[]) {
+	int frames_count = get_int_argument(arguments_count, arguments, 0, 20000);
+	int payload_size = get_int_argument(arguments_count, arguments, 1, 1024);
+	int limit_kb = get_int_argument(arguments_count, arguments, 2, 1024);
+	frames_count = max(frames_count, 1);
+	payload_size = min(max(payload_size, 1), PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+
+	log("Backpressure: a client asks for %d frames of %d bytes and doesn't read until all of them are queued, %d KB send queue limit.", frames_count, payload_size, limit_kb);
+	log("%-11s %14s %16s %14s %13s %8s", "Policy", "Peak queue KB", "Dropped frames", "Received KB", "Disconnected", "Checked");
+
+	struct {
+		const char        *name;
+		SlowConsumerPolicy policy;
+		int                send_queue_limit;
+	} runs[] = {
+		{ "no limit",   SLOW_CONSUMER_POLICY_DROP,       0                },
+		{ "drop",       SLOW_CONSUMER_POLICY_DROP,       limit_kb * 1024  },
+		{ "disconnect", SLOW_CONSUMER_POLICY_DISCONNECT, limit_kb * 1024  },
+	};
+
+	bool all_valid = true;
+	for (int i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i += 1) {
+		BackpressureResult result = run_backpressure(runs[i].policy, runs[i].send_queue_limit, frames_count, payload_size);
+		all_valid = all_valid && result.valid;
+		log("%-11s %14llu %16llu %14llu %13s %8s", runs[i].name, result.peak_queue_size / 1024, result.dropped_frames_count, result.received_size / 1024, (result.disconnected) ? "yes" : "no", (result.valid) ? "ok" : "FAILED");
+	}
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* History: messages per second the history store takes and how long replays of it take. */
+
+const char *const BENCH_HISTORY_FOLDER = "bench_history";
+const int BENCH_HISTORY_REPLAY_COUNT = 100;
+const int BENCH_HISTORY_REPLAYS_COUNT = 1000;
+
+// Deletes the segments and search index runs of a previous run and the folder itself.
+void delete_bench_history(const char *folder) {
+	const char *const suffixes[] = { PPCHAT_HISTORY_SEGMENT_SUFFIX, PPCHAT_SEARCH_RUN_SUFFIX };
+	for (int i = 0; i < (int) (sizeof(suffixes) / sizeof(suffixes[0])); i += 1) {
+		char pattern[MAX_PATH];
+		snprintf(pattern, sizeof(pattern), "%s/*%s", folder, suffixes[i]);
+
+		WIN32_FIND_DATAA find_data;
+		HANDLE find = FindFirstFileA(pattern, &find_data);
+		if (find == INVALID_HANDLE_VALUE)
+			continue;
+
+		do {
+			char path[MAX_PATH];
+			snprintf(path, sizeof(path), "%s/%s", folder, find_data.cFileName);
+			DeleteFileA(path);
+		} while (FindNextFileA(find, &find_data));
+
+		FindClose(find);
+	}
+
+	RemoveDirectoryA(folder);
+}
+
+typedef struct HistoryWriter {
+	HistoryStore *store;
+	int           thread_index;
+	int           messages_count;
+	int           message_size;
+	uint64_t     *latencies;          // Ticks per append.
+	LONG          failed_count;
+} HistoryWriter;
+
+// Payload is "<thread>:<message index>" padded with dots, so that replays can be checked.
+int write_history_payload(char *payload, int message_size, int thread_index, int message_index) {
+	memset(payload, '.', message_size);
+	int written = snprintf(payload, message_size, "%d:%d", thread_index, message_index);
+	if (written < message_size)
+		payload[written] = '.';
+
+	return message_size;
+}
+
+DWORD CALLBACK run_history_writer(void *context) {
+	HistoryWriter *writer = static_cast<HistoryWriter *>(context);
+
+	char room[16];
+	snprintf(room, sizeof(room), "room%d", writer->thread_index);
+
+	char *payload = (char *) malloc(writer->message_size);
+	if (!payload)
+		return EXIT_FAILURE;
+
+	for (int i = 0; i < writer->messages_count; i += 1) {
+		int payload_size = write_history_payload(payload, writer->message_size, writer->thread_index, i);
+
+		uint64_t start_timestamp = get_timestamp();
+		if (ppchat_history_append(writer->store, room, payload, payload_size) == 0)
+			writer->failed_count += 1;
+
+		writer->latencies[i] = get_timestamp() - start_timestamp;
+	}
+
+	free(payload);
+	return EXIT_SUCCESS;
+}
+
+typedef struct ReplayCheck {
+	int  thread_index;
+	int  next_message_index;
+	char expected[64];
+	bool valid;
+} ReplayCheck;
+
+void check_replayed_record(const HistoryRecord *record, void *context) {
+	ReplayCheck *check = static_cast<ReplayCheck *>(context);
+	int expected_size = snprintf(check->expected, sizeof(check->expected), "%d:%d.", check->thread_index, check->next_message_index);
+	check->valid = check->valid && record->payload_size >= expected_size - 1 && memcmp(record->payload, check->expected, min(expected_size, record->payload_size)) == 0;
+	check->next_message_index += 1;
+}
+
+typedef struct HistoryBenchResult {
+	double   messages_per_second;
+	double   megabytes_per_second;
+	double   append_p50_us;
+	double   append_p99_us;
+	double   append_max_us;
+	double   replay_us;
+	uint64_t flushes_count;
+	double   max_flush_ms;
+	bool     valid;
+} HistoryBenchResult;
+
+HistoryBenchResult run_history_bench(int threads_count, int messages_count, int message_size) {
+	HistoryBenchResult result = { };
+	delete_bench_history(BENCH_HISTORY_FOLDER);
+
+	HistoryStore *store = (HistoryStore *) calloc(1, sizeof(HistoryStore));
+	HistoryWriter *writers = (HistoryWriter *) calloc(threads_count, sizeof(HistoryWriter));
+	HANDLE *threads = (HANDLE *) calloc(threads_count, sizeof(HANDLE));
+	uint64_t *latencies = (uint64_t *) calloc((size_t) threads_count * messages_count, sizeof(uint64_t));
+	if (!store || !writers || !threads || !latencies) {
+		free(store);
+		free(writers);
+		free(threads);
+		free(latencies);
+		return result;
+	}
+
+	HistoryOptions options = { };
+	options.folder = BENCH_HISTORY_FOLDER;
+
+	// Every message has to be kept to check them afterwards.
+	options.max_segments = PPCHAT_HISTORY_MAX_SEGMENTS;
+
+	int error = 0;
+	bool opened = ppchat_history_open(store, &options, &error);
+	if (!opened)
+		log_error("Couldn't open history in '%s'. Error: %d - %s", BENCH_HISTORY_FOLDER, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; opened && i < threads_count; i += 1) {
+		writers[i].store = store;
+		writers[i].thread_index = i;
+		writers[i].messages_count = messages_count;
+		writers[i].message_size = message_size;
+		writers[i].latencies = latencies + (size_t) i * messages_count;
+		threads[i] = CreateThread(NULL, 0, run_history_writer, &writers[i], NULL, NULL);
+	}
+
+	LONG failed_count = 0;
+	for (int i = 0; i < threads_count; i += 1) {
+		if (threads[i]) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+			failed_count += writers[i].failed_count;
+		}
+	}
+
+	double elapsed_seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	uint64_t total_messages_count = (uint64_t) threads_count * messages_count;
+
+	if (opened) {
+		result.messages_per_second = (double) total_messages_count / elapsed_seconds;
+		result.megabytes_per_second = result.messages_per_second * message_size / (1024.0 * 1024.0);
+
+		int samples_count = threads_count * messages_count;
+		qsort(latencies, samples_count, sizeof(uint64_t), compare_uint64);
+		result.append_p50_us = get_percentile_us(latencies, samples_count, 50.0);
+		result.append_p99_us = get_percentile_us(latencies, samples_count, 99.0);
+		result.append_max_us = get_percentile_us(latencies, samples_count, 100.0);
+
+		ReplayCheck check = { };
+		uint64_t replay_start_timestamp = get_timestamp();
+		for (int i = 0; i < BENCH_HISTORY_REPLAYS_COUNT; i += 1) {
+			check.next_message_index = messages_count - min(messages_count, BENCH_HISTORY_REPLAY_COUNT);
+			ppchat_history_read_last(store, "room0", BENCH_HISTORY_REPLAY_COUNT, check_replayed_record, &check);
+		}
+		result.replay_us = get_seconds_elapsed(replay_start_timestamp, get_timestamp()) * 1000000.0 / BENCH_HISTORY_REPLAYS_COUNT;
+
+		HistoryStats stats;
+		ppchat_history_get_stats(store, &stats);
+		result.flushes_count = stats.flushes_count;
+		result.max_flush_ms = (double) stats.max_flush_duration_ns / 1e6;
+
+		ppchat_history_close(store);
+	}
+
+	// Everything has to be there after opening the store again, the last messages of
+	// every room in order.
+	if (opened && failed_count == 0 && ppchat_history_open(store, &options, &error)) {
+		HistoryStats stats;
+		ppchat_history_get_stats(store, &stats);
+		result.valid = stats.last_sequence == total_messages_count && stats.rooms_count == (uint64_t) threads_count;
+
+		for (int i = 0; result.valid && i < threads_count; i += 1) {
+			char room[16];
+			snprintf(room, sizeof(room), "room%d", i);
+
+			ReplayCheck check = { };
+			check.thread_index = i;
+			check.next_message_index = messages_count - min(messages_count, BENCH_HISTORY_REPLAY_COUNT);
+			check.valid = true;
+			int replayed_count = ppchat_history_read_last(store, room, BENCH_HISTORY_REPLAY_COUNT, check_replayed_record, &check);
+			result.valid = check.valid && replayed_count == min(messages_count, BENCH_HISTORY_REPLAY_COUNT) && check.next_message_index == messages_count;
+		}
+
+		ppchat_history_close(store);
+	}
+
+	delete_bench_history(BENCH_HISTORY_FOLDER);
+	free(store);
+	free(writers);
+	free(threads);
+	free(latencies);
+	return result;
+}
+
+int bench_history(int arguments_count, char *arguments[]) {
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int cores_count = (int) system_info.dwNumberOfProcessors;
+
+	int messages_count = get_int_argument(arguments_count, arguments, 0, 200000);
+	int message_size = get_int_argument(arguments_count, arguments, 1, 64);
+	int threads_count = get_int_argument(arguments_count, arguments, 2, cores_count);
+	message_size = min(max(message_size, 16), PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+
+	log("History: %d messages of %d bytes per thread into mapped segments, flushed every %d ms, then replays of the last %d messages of a room.", messages_count, message_size, PPCHAT_HISTORY_DEFAULT_FLUSH_INTERVAL_MS, BENCH_HISTORY_REPLAY_COUNT);
+	log("%-8s %14s %8s %11s %11s %11s %10s %8s %13s %8s", "Threads", "Messages/sec", "MB/s", "Append p50", "Append p99", "Append max", "Replay us", "Flushes", "Max flush ms", "Checked");
+
+	int runs[] = { 1, threads_count };
+	int runs_count = (threads_count > 1) ? 2 : 1;
+
+	bool all_valid = true;
+	for (int i = 0; i < runs_count; i += 1) {
+		HistoryBenchResult result = run_history_bench(runs[i], messages_count, message_size);
+		all_valid = all_valid && result.valid;
+		log("%-8d %14.0f %8.1f %11.2f %11.2f %11.2f %10.1f %8llu %13.2f %8s", runs[i], result.messages_per_second, result.megabytes_per_second, result.append_p50_us, result.append_p99_us, result.append_max_us, result.replay_us, result.flushes_count, result.max_flush_ms, (result.valid) ? "ok" : "FAILED");
+	}
+
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Search: how fast the index follows the history and how long queries take over it. */
+
+const char *const BENCH_SEARCH_FOLDER = "bench_search";
+const int BENCH_SEARCH_ROOMS_COUNT = 8;
+const int BENCH_SEARCH_WORDS_PER_MESSAGE = 8;
+const int BENCH_SEARCH_VOCABULARY_SIZE = 50000;
+const int BENCH_SEARCH_COMMON_WORDS_COUNT = 50;
+const int BENCH_SEARCH_RESULTS_COUNT = 20;
+const int BENCH_SEARCH_INDEX_TIMEOUT_MS = 10 * 60 * 1000;
+
+typedef enum SearchBenchQuery {
+	SEARCH_BENCH_QUERY_COMMON,            // One word that is in a good part of the messages.
+	SEARCH_BENCH_QUERY_TWO_COMMON,        // Two of those, both have to be there.
+	SEARCH_BENCH_QUERY_RARE,              // One word that is in a handful of messages.
+	SEARCH_BENCH_QUERY_COMMON_IN_ROOM,    // Common word, only in one room.
+	SEARCH_BENCH_QUERIES_COUNT
+} SearchBenchQuery;
+
+const char *const SEARCH_BENCH_QUERY_NAMES[SEARCH_BENCH_QUERIES_COUNT] = { "common", "two common", "rare", "common in room" };
+
+uint32_t next_bench_random(uint32_t *state) {
+	// xorshift32, the same messages on every run.
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+// Half of the words come from a few common ones, the rest from the whole vocabulary.
+int write_search_payload(char *payload, int payload_capacity, uint32_t *random_state) {
+	int payload_size = 0;
+	for (int i = 0; i < BENCH_SEARCH_WORDS_PER_MESSAGE; i += 1) {
+		uint32_t random = next_bench_random(random_state);
+		int word = (random & 1) ? (int) (random >> 1) % BENCH_SEARCH_COMMON_WORDS_COUNT : (int) (random >> 1) % BENCH_SEARCH_VOCABULARY_SIZE;
+		payload_size += snprintf(payload + payload_size, payload_capacity - payload_size, (i == 0) ? "w%d" : " w%d", word);
+	}
+
+	return payload_size;
+}
+
+void make_search_bench_query(SearchBenchQuery query, uint32_t *random_state, char *out_query, int query_capacity, const char **out_room) {
+	static const char *const rooms[BENCH_SEARCH_ROOMS_COUNT] = { "room0", "room1", "room2", "room3", "room4", "room5", "room6", "room7" };
+
+	uint32_t random = next_bench_random(random_state);
+	int common = (int) (random % BENCH_SEARCH_COMMON_WORDS_COUNT);
+	int other_common = (common + 1 + (int) (random >> 8) % (BENCH_SEARCH_COMMON_WORDS_COUNT - 1)) % BENCH_SEARCH_COMMON_WORDS_COUNT;
+	int rare = BENCH_SEARCH_COMMON_WORDS_COUNT + (int) (random >> 4) % (BENCH_SEARCH_VOCABULARY_SIZE - BENCH_SEARCH_COMMON_WORDS_COUNT);
+
+	*out_room = NULL;
+	switch (query) {
+		case SEARCH_BENCH_QUERY_COMMON:         snprintf(out_query, query_capacity, "w%d", common); break;
+		case SEARCH_BENCH_QUERY_TWO_COMMON:     snprintf(out_query, query_capacity, "w%d W%d", common, other_common); break;
+		case SEARCH_BENCH_QUERY_RARE:           snprintf(out_query, query_capacity, "w%d", rare); break;
+		case SEARCH_BENCH_QUERY_COMMON_IN_ROOM: snprintf(out_query, query_capacity, "w%d", common); *out_room = rooms[(random >> 16) % BENCH_SEARCH_ROOMS_COUNT]; break;
+		default: out_query[0] = '\0';
+	}
+}
+
+// Finds the newest matches by reading through the whole history, to check the index against.
+typedef struct SearchScan {
+	char        words[2][16];
+	int         words_count;
+	const char *room;
+	uint64_t    matches[BENCH_SEARCH_RESULTS_COUNT];   // Ring of the last ones.
+	uint64_t    matches_count;
+} SearchScan;
+
+bool has_bench_word(const HistoryRecord *record, const char *word) {
+	int word_size = (int) strlen(word);
+	for (int start = 0; start < record->payload_size;) {
+		int end = start;
+		while (end < record->payload_size && record->payload[end] != ' ')
+			end += 1;
+
+		if (end - start == word_size && strncmp(record->payload + start, word, word_size) == 0)
+			return true;
+
+		start = end + 1;
+	}
+
+	return false;
+}
+
+void scan_search_record(const HistoryRecord *record, void *context) {
+	SearchScan *scan = static_cast<SearchScan *>(context);
+	if (scan->room && (record->room_size != (int) strlen(scan->room) || memcmp(record->room, scan->room, record->room_size) != 0))
+		return;
+
+	for (int i = 0; i < scan->words_count; i += 1) {
+		if (!has_bench_word(record, scan->words[i]))
+			return;
+	}
+
+	scan->matches[scan->matches_count % BENCH_SEARCH_RESULTS_COUNT] = record->sequence;
+	scan->matches_count += 1;
+}
+
+bool check_search_results(HistoryStore *history, const char *query, const char *room, const uint64_t *sequences, int sequences_count) {
+	SearchScan scan = { };
+	scan.room = room;
+	scan.words_count = sscanf(query, "%15s %15s", scan.words[0], scan.words[1]);
+
+	// Messages are all lowercase, queries aren't always.
+	for (int i = 0; i < scan.words_count; i += 1) {
+		for (char *c = scan.words[i]; *c; c += 1)
+			*c = (char) tolower((unsigned char) *c);
+	}
+
+	HistoryStats stats;
+	ppchat_history_get_stats(history, &stats);
+	for (uint64_t sequence = stats.first_sequence; sequence > 0 && sequence <= stats.last_sequence; sequence += PPCHAT_HISTORY_MAX_READ_COUNT)
+		ppchat_history_read_range(history, sequence, PPCHAT_HISTORY_MAX_READ_COUNT, scan_search_record, &scan);
+
+	int expected_count = (int) min(scan.matches_count, (uint64_t) BENCH_SEARCH_RESULTS_COUNT);
+	bool valid = sequences_count == expected_count;
+	for (int i = 0; valid && i < expected_count; i += 1)
+		valid = sequences[i] == scan.matches[(scan.matches_count - 1 - i) % BENCH_SEARCH_RESULTS_COUNT];
+
+	return valid;
+}
+
+typedef struct SearchBenchResult {
+	int      results_count;       // Of the last query.
+	double   p50_us;
+	double   p99_us;
+	double   max_us;
+	bool     valid;
+} SearchBenchResult;
+
+SearchBenchResult run_search_queries(SearchIndex *index, HistoryStore *history, SearchBenchQuery query, int queries_count) {
+	SearchBenchResult result = { };
+	uint64_t *latencies = (uint64_t *) calloc(queries_count, sizeof(uint64_t));
+	if (!latencies)
+		return result;
+
+	uint32_t random_state = 0x9E3779B9u + (uint32_t) query;
+	char query_text[64];
+	const char *room = NULL;
+	uint64_t sequences[BENCH_SEARCH_RESULTS_COUNT];
+	for (int i = 0; i < queries_count; i += 1) {
+		make_search_bench_query(query, &random_state, query_text, sizeof(query_text), &room);
+
+		uint64_t start_timestamp = get_timestamp();
+		result.results_count = ppchat_search_query(index, room, query_text, (int) strlen(query_text), sequences, BENCH_SEARCH_RESULTS_COUNT);
+		latencies[i] = get_timestamp() - start_timestamp;
+	}
+
+	qsort(latencies, queries_count, sizeof(uint64_t), compare_uint64);
+	result.p50_us = get_percentile_us(latencies, queries_count, 50.0);
+	result.p99_us = get_percentile_us(latencies, queries_count, 99.0);
+	result.max_us = get_percentile_us(latencies, queries_count, 100.0);
+
+	// The last query is checked against reading through the whole history.
+	result.valid = check_search_results(history, query_text, room, sequences, result.results_count);
+
+	free(latencies);
+	return result;
+}
+
+int bench_search(int arguments_count, char *arguments[]) {
+	int messages_count = get_int_argument(arguments_count, arguments, 0, 1000000);
+	int queries_count = get_int_argument(arguments_count, arguments, 1, 1000);
+	if (messages_count <= 0 || queries_count <= 0) {
+		log_error("Messages and queries have to be positive, got %d and %d.", messages_count, queries_count);
+		return EXIT_FAILURE;
+	}
+
+	delete_bench_history(BENCH_SEARCH_FOLDER);
+
+	HistoryStore *history = (HistoryStore *) calloc(1, sizeof(HistoryStore));
+	SearchIndex *index = (SearchIndex *) calloc(1, sizeof(SearchIndex));
+	if (!history || !index) {
+		free(history);
+		free(index);
+		return EXIT_FAILURE;
+	}
+
+	HistoryOptions history_options = { };
+	history_options.folder = BENCH_SEARCH_FOLDER;
+	history_options.max_segments = PPCHAT_HISTORY_MAX_SEGMENTS;
+
+	int error = 0;
+	if (!ppchat_history_open(history, &history_options, &error)) {
+		log_error("Couldn't open history in '%s'. Error: %d - %s", BENCH_SEARCH_FOLDER, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		free(history);
+		free(index);
+		return EXIT_FAILURE;
+	}
+
+	log("Search: %d messages of %d words in %d rooms, indexed from the history, then %d queries of each kind for the newest %d matches.", messages_count, BENCH_SEARCH_WORDS_PER_MESSAGE, BENCH_SEARCH_ROOMS_COUNT, queries_count, BENCH_SEARCH_RESULTS_COUNT);
+
+	uint32_t random_state = 0x12345678u;
+	char payload[256];
+	for (int i = 0; i < messages_count; i += 1) {
+		char room[16];
+		snprintf(room, sizeof(room), "room%d", i % BENCH_SEARCH_ROOMS_COUNT);
+		int payload_size = write_search_payload(payload, sizeof(payload), &random_state);
+		ppchat_history_append(history, room, payload, payload_size);
+	}
+
+	// The whole history is new to the index, it catches up in the background the way
+	// it would after a server start with no index.
+	SearchOptions search_options = { };
+	search_options.folder = BENCH_SEARCH_FOLDER;
+
+	uint64_t start_timestamp = get_timestamp();
+	bool indexed = ppchat_search_open(index, history, &search_options, &error) && ppchat_search_wait(index, (uint64_t) messages_count, BENCH_SEARCH_INDEX_TIMEOUT_MS);
+	double index_seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	if (!indexed) {
+		log_error("Couldn't index %d messages in '%s'. Error: %d - %s", messages_count, BENCH_SEARCH_FOLDER, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_search_close(index);
+		ppchat_history_close(history);
+		delete_bench_history(BENCH_SEARCH_FOLDER);
+		free(history);
+		free(index);
+		return EXIT_FAILURE;
+	}
+
+	// Writes the rest out and lets merges finish, so queries go through runs on disk.
+	ppchat_search_close(index);
+	start_timestamp = get_timestamp();
+	bool reopened = ppchat_search_open(index, history, &search_options, &error);
+	double reopen_ms = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1000.0;
+
+	HistoryStats history_stats;
+	SearchStats search_stats = { };
+	ppchat_history_get_stats(history, &history_stats);
+	if (reopened)
+		ppchat_search_get_stats(index, &search_stats);
+
+	log("Indexed %.0f messages/sec, index runs take %llu KB next to %llu KB of history, %llu runs, reopened in %.2f ms.", (double) messages_count / index_seconds, search_stats.runs_size / 1024, history_stats.segments_size / 1024, search_stats.runs_count, reopen_ms);
+	log("%-16s %8s %10s %10s %10s %8s", "Query", "Results", "p50 us", "p99 us", "Max us", "Checked");
+
+	bool all_valid = reopened && search_stats.indexed_sequence == (uint64_t) messages_count;
+	for (int i = 0; reopened && i < SEARCH_BENCH_QUERIES_COUNT; i += 1) {
+		SearchBenchResult result = run_search_queries(index, history, (SearchBenchQuery) i, queries_count);
+		all_valid = all_valid && result.valid;
+		log("%-16s %8d %10.1f %10.1f %10.1f %8s", SEARCH_BENCH_QUERY_NAMES[i], result.results_count, result.p50_us, result.p99_us, result.max_us, (result.valid) ? "ok" : "FAILED");
+	}
+
+	ppchat_search_close(index);
+	ppchat_history_close(history);
+	delete_bench_history(BENCH_SEARCH_FOLDER);
+	free(history);
+	free(index);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Compression: ratio against CPU time for chat messages, logs and data that doesn't compress. */
+
+const int BENCH_COMPRESS_MESSAGE_SIZE = 512;
+
+typedef enum CompressBenchData {
+	COMPRESS_BENCH_DATA_CHAT,      // Lines of "<sender>: <words>", the way messages go out to a room.
+	COMPRESS_BENCH_DATA_LOG,       // Server log lines, timestamps and numbers that keep changing.
+	COMPRESS_BENCH_DATA_RANDOM,    // Already compressed files, archives and media.
+	COMPRESS_BENCH_DATA_COUNT
+} CompressBenchData;
+
+const char *const COMPRESS_BENCH_DATA_NAMES[COMPRESS_BENCH_DATA_COUNT] = { "chat", "log", "random" };
+
+void fill_compress_bench_data(CompressBenchData kind, char *data, int size) {
+	static const char *const words[] = {
+		"the", "a", "is", "to", "and", "of", "in", "it", "you", "that", "for", "on", "was", "with", "lol",
+		"server", "room", "message", "file", "anyone", "here", "today", "meeting", "build", "broken", "fixed",
+		"thanks", "please", "check", "latest", "version", "deploy", "tomorrow", "sounds", "good", "what", "about",
+	};
+	const int words_count = (int) (sizeof(words) / sizeof(words[0]));
+
+	uint32_t random_state = 0x2545F491u + (uint32_t) kind;
+	int position = 0;
+	while (position < size) {
+		char line[256];
+		int line_size = 0;
+		uint32_t random = next_bench_random(&random_state);
+
+		if (kind == COMPRESS_BENCH_DATA_CHAT) {
+			line_size = snprintf(line, sizeof(line), "192.168.1.%u: ", 10 + random % 20);
+			int line_words_count = 3 + (int) (random >> 8) % 12;
+			for (int i = 0; i < line_words_count; i += 1)
+				line_size += snprintf(line + line_size, sizeof(line) - line_size, (i == 0) ? "%s" : " %s", words[next_bench_random(&random_state) % words_count]);
+
+			line_size += snprintf(line + line_size, sizeof(line) - line_size, "\n");
+		} else if (kind == COMPRESS_BENCH_DATA_LOG) {
+			uint32_t seconds = (uint32_t) position / 64;
+			line_size = snprintf(
+				line,
+				sizeof(line),
+				"[%02u:%02u:%02u] Sent message from '10.0.%u.%u' to %u members of room 'room%u' on shard %u.\n",
+				(seconds / 3600) % 24, (seconds / 60) % 60, seconds % 60, (random >> 4) % 256, (random >> 12) % 256, (random >> 20) % 500, random % 8, (random >> 28) % 8
+			);
+		} else {
+			line_size = (int) sizeof(line);
+			for (int i = 0; i < line_size; i += 1)
+				line[i] = (char) (next_bench_random(&random_state) >> 7);
+		}
+
+		int taken = min(line_size, size - position);
+		memcpy(data + position, line, taken);
+		position += taken;
+	}
+}
+
+typedef struct CompressBenchResult {
+	double ratio;                         // Bytes on the wire against bytes of data.
+	double compress_megabytes_per_second;
+	double decompress_megabytes_per_second;
+	double parallel_megabytes_per_second; // Compression on every thread, zero for messages.
+	bool   valid;
+} CompressBenchResult;
+
+typedef struct CompressBenchWorker {
+	const char   *data;
+	int           size;
+	int           block_size;
+	volatile LONG next_block;
+} CompressBenchWorker;
+
+DWORD CALLBACK run_compress_bench_worker(void *context) {
+	CompressBenchWorker *worker = static_cast<CompressBenchWorker *>(context);
+	char *compressed = (char *) malloc(worker->block_size);
+	if (!compressed)
+		return EXIT_FAILURE;
+
+	int blocks_count = (worker->size + worker->block_size - 1) / worker->block_size;
+	while (true) {
+		int block = (int) InterlockedIncrement(&worker->next_block) - 1;
+		if (block >= blocks_count)
+			break;
+
+		int offset = block * worker->block_size;
+		ppchat_compress_payload(worker->data + offset, min(worker->block_size, worker->size - offset), compressed);
+	}
+
+	free(compressed);
+	return EXIT_SUCCESS;
+}
+
+double run_parallel_compression(const char *data, int size, int block_size, int threads_count) {
+	CompressBenchWorker worker = { };
+	worker.data = data;
+	worker.size = size;
+	worker.block_size = block_size;
+
+	HANDLE *threads = (HANDLE *) calloc(threads_count, sizeof(HANDLE));
+	if (!threads)
+		return 0.0;
+
+	uint64_t start_timestamp = get_timestamp();
+	int started_count = 0;
+	for (int i = 0; i < threads_count; i += 1) {
+		threads[i] = CreateThread(NULL, 0, run_compress_bench_worker, &worker, 0, NULL);
+		if (threads[i])
+			started_count = i + 1;
+		else
+			break;
+	}
+
+	if (started_count > 0)
+		WaitForMultipleObjects(started_count, threads, TRUE, INFINITE);
+
+	double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	for (int i = 0; i < started_count; i += 1)
+		CloseHandle(threads[i]);
+
+	free(threads);
+	return (started_count > 0 && seconds > 0.0) ? (double) size / seconds / (1024.0 * 1024.0) : 0.0;
+}
+
+// Compresses the data block by block the way frames are, then decompresses it and compares.
+CompressBenchResult run_compress_bench(const char *data, int size, int block_size, int threads_count) {
+	CompressBenchResult result = { };
+
+	int blocks_count = (size + block_size - 1) / block_size;
+	char *compressed = (char *) malloc((size_t) blocks_count * block_size);
+	int *compressed_sizes = (int *) calloc(blocks_count, sizeof(int));
+	char *decompressed = (char *) malloc(size);
+	if (!compressed || !compressed_sizes || !decompressed) {
+		log_error("Couldn't allocate memory for %d blocks of %d bytes.", blocks_count, block_size);
+		free(compressed);
+		free(compressed_sizes);
+		free(decompressed);
+		return result;
+	}
+
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < blocks_count; i += 1) {
+		int offset = i * block_size;
+		compressed_sizes[i] = ppchat_compress_payload(data + offset, min(block_size, size - offset), compressed + (size_t) i * block_size);
+	}
+	double compress_seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+	// Blocks that didn't compress go as they are, and aren't decompressed either.
+	uint64_t wire_size = 0;
+	uint64_t decompressed_size = 0;
+	bool valid = true;
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < blocks_count; i += 1) {
+		int offset = i * block_size;
+		int size_of_block = min(block_size, size - offset);
+		if (compressed_sizes[i] == 0) {
+			wire_size += size_of_block;
+			memcpy(decompressed + offset, data + offset, size_of_block);
+			continue;
+		}
+
+		const char *payload = compressed + (size_t) i * block_size;
+		wire_size += compressed_sizes[i];
+		decompressed_size += size_of_block;
+		valid = ppchat_get_decompressed_size(payload, compressed_sizes[i], block_size) == size_of_block &&
+		        ppchat_decompress_payload(payload, compressed_sizes[i], decompressed + offset, size_of_block) &&
+		        valid;
+	}
+	double decompress_seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+	valid = valid && memcmp(data, decompressed, size) == 0;
+
+	// A block cut short or aimed at the wrong size must be refused, not read past.
+	for (int i = 0; valid && i < min(blocks_count, 64); i += 1) {
+		const char *payload = compressed + (size_t) i * block_size;
+		int size_of_block = min(block_size, size - i * block_size);
+		if (compressed_sizes[i] > PPCHAT_COMPRESSED_HEADER_SIZE + 1) {
+			valid = !ppchat_decompress_payload(payload, compressed_sizes[i] - 1, decompressed, size_of_block) &&
+			        !ppchat_decompress_payload(payload, compressed_sizes[i], decompressed, size_of_block - 1);
+		}
+	}
+
+	result.ratio = (double) wire_size / (double) size;
+	result.compress_megabytes_per_second = (compress_seconds > 0.0) ? (double) size / compress_seconds / (1024.0 * 1024.0) : 0.0;
+	result.decompress_megabytes_per_second = (decompress_seconds > 0.0 && decompressed_size > 0) ? (double) decompressed_size / decompress_seconds / (1024.0 * 1024.0) : 0.0;
+	if (block_size == PPCHAT_FILE_CHUNK_SIZE)
+		result.parallel_megabytes_per_second = run_parallel_compression(data, size, block_size, threads_count);
+
+	result.valid = valid;
+
+	free(compressed);
+	free(compressed_sizes);
+	free(decompressed);
+	return result;
+}
+
+int bench_compress(int arguments_count, char *arguments[]) {
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int cores_count = (int) system_info.dwNumberOfProcessors;
+
+	int megabytes = get_int_argument(arguments_count, arguments, 0, 64);
+	int threads_count = get_int_argument(arguments_count, arguments, 1, cores_count);
+	int size = max(megabytes, 1) * 1024 * 1024;
+	threads_count = max(threads_count, 1);
+
+	char *data = (char *) malloc(size);
+	if (!data) {
+		log_error("Couldn't allocate %d MB.", megabytes);
+		return EXIT_FAILURE;
+	}
+
+	log("Compression: %d MB of each kind of data in %d byte messages and %d KB file chunks, on one thread and on %d.", max(megabytes, 1), BENCH_COMPRESS_MESSAGE_SIZE, PPCHAT_FILE_CHUNK_SIZE / 1024, threads_count);
+	log("Ratio is bytes on the wire against bytes of data, blocks that don't get an eighth smaller are sent as they are.");
+	log("%-8s %-8s %8s %14s %16s %14s %8s", "Data", "Blocks", "Ratio", "Compress MB/s", "Decompress MB/s", "Parallel MB/s", "Checked");
+
+	int block_sizes[] = { BENCH_COMPRESS_MESSAGE_SIZE, PPCHAT_FILE_CHUNK_SIZE };
+
+	bool all_valid = true;
+	for (int kind = 0; kind < COMPRESS_BENCH_DATA_COUNT; kind += 1) {
+		fill_compress_bench_data((CompressBenchData) kind, data, size);
+
+		for (int i = 0; i < (int) (sizeof(block_sizes) / sizeof(block_sizes[0])); i += 1) {
+			CompressBenchResult result = run_compress_bench(data, size, block_sizes[i], threads_count);
+			all_valid = all_valid && result.valid;
+			log(
+				"%-8s %-8s %8.3f %14.0f %16.0f %14.0f %8s",
+				COMPRESS_BENCH_DATA_NAMES[kind],
+				(block_sizes[i] == PPCHAT_FILE_CHUNK_SIZE) ? "chunks" : "messages",
+				result.ratio,
+				result.compress_megabytes_per_second,
+				result.decompress_megabytes_per_second,
+				result.parallel_megabytes_per_second,
+				(result.valid) ? "ok" : "FAILED"
+			);
+		}
+	}
+
+	free(data);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Byte order: fields and structs converted one byte at a time, one bswap at a time and with shuffles. */
+
+// One byte per loop iteration, the way ppchat_hton_bytes used to do it.
+void swap_fields_bytewise(int field_size, const uint8_t *source, uint8_t *destination, size_t count) {
+	for (size_t i = 0; i < count; i += 1) {
+		uint8_t field[8];
+		memcpy(field, source + i * field_size, field_size);
+		for (int b = 0; b < field_size; b += 1)
+			destination[i * field_size + b] = field[field_size - 1 - b];
+	}
+}
+
+void swap_structs_bytewise(const ByteOrderLayout *layout, const uint8_t *source, uint8_t *destination, size_t count) {
+	for (size_t i = 0; i < count; i += 1) {
+		const uint8_t *source_struct = source + i * layout->struct_size;
+		uint8_t *destination_struct = destination + i * layout->struct_size;
+		memmove(destination_struct, source_struct, layout->struct_size);
+
+		for (int f = 0; f < layout->fields_count; f += 1)
+			swap_fields_bytewise(layout->fields[f].size, source_struct + layout->fields[f].offset, destination_struct + layout->fields[f].offset, 1);
+	}
+}
+
+// Odd counts at odd offsets, copied and in place, against the bytewise result.
+bool check_swap_fields(ByteOrderMethod method, int field_size, const uint8_t *data) {
+	uint8_t expected[1024];
+	uint8_t converted[1024 + 1];
+	for (size_t count = 0; count * field_size <= sizeof(expected); count += 1) {
+		swap_fields_bytewise(field_size, data + 1, expected, count);
+
+		ppchat_swap_bytes_with_method(method, field_size, data + 1, converted + 1, count);
+		if (memcmp(expected, converted + 1, count * field_size) != 0)
+			return false;
+
+		memcpy(converted + 1, data + 1, count * field_size);
+		ppchat_swap_bytes_with_method(method, field_size, converted + 1, converted + 1, count);
+		if (memcmp(expected, converted + 1, count * field_size) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool check_swap_structs(ByteOrderMethod method, const ByteOrderLayout *layout, const uint8_t *data) {
+	uint8_t expected[1024];
+	uint8_t converted[1024 + 1];
+	for (size_t count = 0; count * layout->struct_size <= sizeof(expected); count += 1) {
+		size_t size = count * layout->struct_size;
+		swap_structs_bytewise(layout, data + 1, expected, count);
+
+		ppchat_swap_struct_bytes_with_method(method, layout, data + 1, converted + 1, count);
+		if (memcmp(expected, converted + 1, size) != 0)
+			return false;
+
+		memcpy(converted + 1, data + 1, size);
+		ppchat_swap_struct_bytes_with_method(method, layout, converted + 1, converted + 1, count);
+		if (memcmp(expected, converted + 1, size) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+int bench_bytes(int arguments_count, char *arguments[]) {
+	int megabytes = max(get_int_argument(arguments_count, arguments, 0, 64), 1);
+	size_t size = (size_t) megabytes * 1024 * 1024;
+
+	uint8_t *source = (uint8_t *) malloc(size);
+	uint8_t *destination = (uint8_t *) malloc(size);
+	if (!source || !destination) {
+		log_error("Couldn't allocate %d MB twice.", megabytes);
+		free(source);
+		free(destination);
+		return EXIT_FAILURE;
+	}
+
+	uint32_t random_state = 0x9E3779B9u;
+	for (size_t i = 0; i < size; i += 1)
+		source[i] = (uint8_t) (next_bench_random(&random_state) >> 11);
+
+	// Memory bound past the caches, so convert a cache sized block many times as well.
+	const size_t cached_size = 64 * 1024;
+
+	ByteOrderMethod best_method = ppchat_byte_order_get_best_method();
+	log("Byte order conversion of %d MB and of a %d KB block that stays in cache. Best method is %s.", megabytes, (int) (cached_size / 1024), ppchat_byte_order_method_to_string(best_method));
+	log("%-14s %-10s %12s %12s %8s", "Fields", "Method", "GB/s", "Cached GB/s", "Checked");
+
+	ByteOrderField frame_header_fields[] = { { 0, 4 }, { 4, 2 }, { 6, 2 } };
+	ByteOrderField sized_fields[] = { { 0, 8 }, { 8, 4 } };
+	ByteOrderField record_fields[] = { { 0, 8 }, { 8, 8 }, { 16, 4 }, { 20, 2 }, { 22, 1 } };
+
+	struct {
+		const char           *name;
+		int                   field_size;     // Zero for structs.
+		int                   struct_size;
+		const ByteOrderField *fields;
+		int                   fields_count;
+	} runs[] = {
+		{ "uint16",      2, 0,  NULL,                0 },
+		{ "uint32",      4, 0,  NULL,                0 },
+		{ "uint64",      8, 0,  NULL,                0 },
+		{ "8B struct",   0, 8,  frame_header_fields, 3 },
+		{ "12B struct",  0, 12, sized_fields,        2 },
+		{ "24B struct",  0, 24, record_fields,       5 },
+	};
+
+	bool all_valid = true;
+	for (int r = 0; r < (int) (sizeof(runs) / sizeof(runs[0])); r += 1) {
+		ByteOrderLayout layout;
+		if (runs[r].field_size == 0 && !ppchat_byte_order_layout_init(&layout, runs[r].struct_size, runs[r].fields, runs[r].fields_count)) {
+			log("%-14s %-10s %12s %12s %8s", runs[r].name, "-", "-", "-", "FAILED");
+			all_valid = false;
+			continue;
+		}
+
+		int element_size = (runs[r].field_size != 0) ? runs[r].field_size : runs[r].struct_size;
+		size_t count = size / element_size;
+		size_t cached_count = cached_size / element_size;
+		int cached_repeats = (int) (size / cached_size);
+
+		// -1 is the bytewise loop everything is checked against.
+		for (int method = -1; method < BYTE_ORDER_METHOD_COUNT; method += 1) {
+			const char *method_name = (method < 0) ? "bytewise" : ppchat_byte_order_method_to_string((ByteOrderMethod) method);
+			if (method >= 0 && !ppchat_byte_order_is_method_supported((ByteOrderMethod) method)) {
+				log("%-14s %-10s %12s %12s %8s", runs[r].name, method_name, "-", "-", "skipped");
+				continue;
+			}
+
+			double seconds[2];
+			for (int pass = 0; pass < 2; pass += 1) {
+				size_t pass_count = (pass == 0) ? count : cached_count;
+				int repeats = (pass == 0) ? 1 : cached_repeats;
+
+				uint64_t start_timestamp = get_timestamp();
+				for (int repeat = 0; repeat < repeats; repeat += 1) {
+					if (method < 0 && runs[r].field_size != 0)
+						swap_fields_bytewise(runs[r].field_size, source, destination, pass_count);
+					else if (method < 0)
+						swap_structs_bytewise(&layout, source, destination, pass_count);
+					else if (runs[r].field_size != 0)
+						ppchat_swap_bytes_with_method((ByteOrderMethod) method, runs[r].field_size, source, destination, pass_count);
+					else
+						ppchat_swap_struct_bytes_with_method((ByteOrderMethod) method, &layout, source, destination, pass_count);
+				}
+
+				seconds[pass] = get_seconds_elapsed(start_timestamp, get_timestamp());
+			}
+
+			bool valid = true;
+			if (method >= 0 && runs[r].field_size != 0)
+				valid = check_swap_fields((ByteOrderMethod) method, runs[r].field_size, source);
+			else if (method >= 0)
+				valid = check_swap_structs((ByteOrderMethod) method, &layout, source);
+
+			all_valid = all_valid && valid;
+			log(
+				"%-14s %-10s %12.2f %12.2f %8s",
+				runs[r].name,
+				method_name,
+				(double) (count * element_size) / seconds[0] / 1e9,
+				(double) (cached_count * element_size) * cached_repeats / seconds[1] / 1e9,
+				(valid) ? "ok" : "FAILED"
+			);
+		}
+	}
+
+	// ppchat_hton_bytes and ppchat_ntoh_bytes go through ppchat_reverse_bytes now.
+	bool reverse_valid = true;
+	for (size_t length = 0; reverse_valid && length < 256; length += 1) {
+		uint8_t network[256];
+		uint8_t host[256];
+		ppchat_hton_bytes(source + 3, length, network, length);
+		ppchat_ntoh_bytes(network, length, host, length);
+		for (size_t i = 0; i < length; i += 1)
+			reverse_valid = reverse_valid && network[i] == source[3 + length - 1 - i];
+
+		reverse_valid = reverse_valid && memcmp(host, source + 3, length) == 0;
+	}
+
+	all_valid = all_valid && reverse_valid;
+	log("%-14s %-10s %12s %12s %8s", "reverse", ppchat_byte_order_method_to_string(best_method), "-", "-", (reverse_valid) ? "ok" : "FAILED");
+
+	free(source);
+	free(destination);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Schema: encoding and decoding fixed parts of payloads, written by hand against generated from a schema. */
+
+// The way these were written before there were schemas, a memcpy and a byte swap per field.
+void encode_frame_header_by_hand(const FrameHeader &header, char *out_buffer) {
+	uint32_t network_payload_size = ppchat_hton32(header.payload_size);
+	uint16_t network_type = ppchat_hton16(header.type);
+	uint16_t network_flags = ppchat_hton16(header.flags);
+	memcpy(out_buffer + 0, &network_payload_size, sizeof(network_payload_size));
+	memcpy(out_buffer + 4, &network_type, sizeof(network_type));
+	memcpy(out_buffer + 6, &network_flags, sizeof(network_flags));
+}
+
+FrameHeader decode_frame_header_by_hand(const char *buffer) {
+	uint32_t network_payload_size;
+	uint16_t network_type;
+	uint16_t network_flags;
+	memcpy(&network_payload_size, buffer + 0, sizeof(network_payload_size));
+	memcpy(&network_type, buffer + 4, sizeof(network_type));
+	memcpy(&network_flags, buffer + 6, sizeof(network_flags));
+
+	FrameHeader header;
+	header.payload_size = ppchat_ntoh32(network_payload_size);
+	header.type = ppchat_ntoh16(network_type);
+	header.flags = ppchat_ntoh16(network_flags);
+	return header;
+}
+
+void encode_file_begin_by_hand(const FileBeginHeader &header, char *out_buffer) {
+	uint64_t network_file_size = ppchat_hton64(header.file_size);
+	uint64_t network_file_id = ppchat_hton64(header.file_id);
+	memcpy(out_buffer + 0, &network_file_size, sizeof(network_file_size));
+	memcpy(out_buffer + 8, &network_file_id, sizeof(network_file_id));
+}
+
+FileBeginHeader decode_file_begin_by_hand(const char *buffer) {
+	uint64_t network_file_size;
+	uint64_t network_file_id;
+	memcpy(&network_file_size, buffer + 0, sizeof(network_file_size));
+	memcpy(&network_file_id, buffer + 8, sizeof(network_file_id));
+
+	FileBeginHeader header;
+	header.file_size = ppchat_ntoh64(network_file_size);
+	header.file_id = ppchat_ntoh64(network_file_id);
+	return header;
+}
+
+void encode_file_chunk_header_by_hand(const FileChunkHeader &header, char *out_buffer) {
+	uint32_t network_index = ppchat_hton32(header.index);
+	uint32_t network_crc = ppchat_hton32(header.crc);
+	memcpy(out_buffer + 0, &network_index, sizeof(network_index));
+	memcpy(out_buffer + 4, &network_crc, sizeof(network_crc));
+}
+
+FileChunkHeader decode_file_chunk_header_by_hand(const char *buffer) {
+	uint32_t network_index;
+	uint32_t network_crc;
+	memcpy(&network_index, buffer + 0, sizeof(network_index));
+	memcpy(&network_crc, buffer + 4, sizeof(network_crc));
+
+	FileChunkHeader header;
+	header.index = ppchat_ntoh32(network_index);
+	header.crc = ppchat_ntoh32(network_crc);
+	return header;
+}
+
+typedef struct SchemaBenchResult {
+	double hand_encode_ns;
+	double schema_encode_ns;
+	double hand_decode_ns;
+	double schema_decode_ns;
+	bool   valid;
+} SchemaBenchResult;
+
+// Encodes `count` messages into `buffer` and decodes them back, both ways. Valid if both
+// ways write the same bytes and every message comes back as it was.
+template <typename Schema>
+SchemaBenchResult run_schema_bench(const typename Schema::struct_type *messages, typename Schema::struct_type *decoded, int count, char *buffer, char *hand_buffer, void (*encode_by_hand)(const typename Schema::struct_type &, char *), typename Schema::struct_type (*decode_by_hand)(const char *)) {
+	typedef typename Schema::struct_type Message;
+	SchemaBenchResult result = { };
+
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < count; i += 1)
+		encode_by_hand(messages[i], hand_buffer + i * Schema::size);
+
+	result.hand_encode_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / count;
+
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < count; i += 1)
+		Schema::encode(messages[i], buffer + i * Schema::size);
+
+	result.schema_encode_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / count;
+	result.valid = memcmp(buffer, hand_buffer, (size_t) count * Schema::size) == 0;
+
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < count; i += 1)
+		decoded[i] = decode_by_hand(buffer + i * Schema::size);
+
+	result.hand_decode_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / count;
+	result.valid = result.valid && memcmp(decoded, messages, (size_t) count * sizeof(Message)) == 0;
+	memset(decoded, 0, (size_t) count * sizeof(Message));
+
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < count; i += 1)
+		decoded[i] = Schema::decode(buffer + i * Schema::size);
+
+	result.schema_decode_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / count;
+	result.valid = result.valid && memcmp(decoded, messages, (size_t) count * sizeof(Message)) == 0;
+
+	// A payload one byte short of the fixed part is refused.
+	Message rejected;
+	result.valid = result.valid && !Schema::decode(buffer, Schema::size - 1, &rejected) && Schema::decode(buffer, Schema::size, &rejected);
+	return result;
+}
+
+int bench_schema(int arguments_count, char *arguments[]) {
+	int millions = max(get_int_argument(arguments_count, arguments, 0, 10), 1);
+	int count = millions * 1000000;
+
+	// Big enough for the largest message and its decoded struct.
+	size_t message_size = sizeof(FileBeginHeader);
+	char *messages = (char *) malloc((size_t) count * message_size);
+	char *decoded = (char *) malloc((size_t) count * message_size);
+	char *buffer = (char *) malloc((size_t) count * message_size);
+	char *hand_buffer = (char *) malloc((size_t) count * message_size);
+	if (!messages || !decoded || !buffer || !hand_buffer) {
+		log_error("Couldn't allocate buffers for %d million messages.", millions);
+		free(messages);
+		free(decoded);
+		free(buffer);
+		free(hand_buffer);
+		return EXIT_FAILURE;
+	}
+
+	uint32_t random_state = 0x1B873593u;
+	FrameHeader *frame_headers = (FrameHeader *) messages;
+	FileBeginHeader *file_begins = (FileBeginHeader *) messages;
+	FileChunkHeader *chunk_headers = (FileChunkHeader *) messages;
+
+	log("Schema: ns per message to encode and decode %d million of each, by hand and from the schema.", millions);
+	log("%-14s %6s %12s %12s %12s %12s %8s", "Message", "Bytes", "Hand enc", "Schema enc", "Hand dec", "Schema dec", "Checked");
+
+	bool all_valid = true;
+	for (int kind = 0; kind < 3; kind += 1) {
+		const char *name = NULL;
+		int size = 0;
+		SchemaBenchResult result;
+
+		// Filled right before each run, the three kinds share the same memory.
+		if (kind == 0) {
+			for (int i = 0; i < count; i += 1) {
+				frame_headers[i].payload_size = next_bench_random(&random_state) % PPCHAT_FRAME_MAX_PAYLOAD_SIZE;
+				frame_headers[i].type = (uint16_t) (1 + next_bench_random(&random_state) % FRAME_TYPE_OPTIONS);
+				frame_headers[i].flags = (uint16_t) (next_bench_random(&random_state) & 0x7);
+			}
+
+			name = "frame header";
+			size = FrameHeaderSchema::size;
+			result = run_schema_bench<FrameHeaderSchema>(frame_headers, (FrameHeader *) decoded, count, buffer, hand_buffer, encode_frame_header_by_hand, decode_frame_header_by_hand);
+		} else if (kind == 1) {
+			for (int i = 0; i < count; i += 1) {
+				file_begins[i].file_size = ((uint64_t) next_bench_random(&random_state) << 32) | next_bench_random(&random_state);
+				file_begins[i].file_id = ((uint64_t) next_bench_random(&random_state) << 32) | next_bench_random(&random_state);
+			}
+
+			name = "file begin";
+			size = FileBeginHeaderSchema::size;
+			result = run_schema_bench<FileBeginHeaderSchema>(file_begins, (FileBeginHeader *) decoded, count, buffer, hand_buffer, encode_file_begin_by_hand, decode_file_begin_by_hand);
+		} else {
+			for (int i = 0; i < count; i += 1) {
+				chunk_headers[i].index = (uint32_t) i;
+				chunk_headers[i].crc = next_bench_random(&random_state);
+			}
+
+			name = "chunk header";
+			size = FileChunkHeaderSchema::size;
+			result = run_schema_bench<FileChunkHeaderSchema>(chunk_headers, (FileChunkHeader *) decoded, count, buffer, hand_buffer, encode_file_chunk_header_by_hand, decode_file_chunk_header_by_hand);
+		}
+
+		all_valid = all_valid && result.valid;
+		log(
+			"%-14s %6d %12.2f %12.2f %12.2f %12.2f %8s",
+			name,
+			size,
+			result.hand_encode_ns,
+			result.schema_encode_ns,
+			result.hand_decode_ns,
+			result.schema_decode_ns,
+			(result.valid) ? "ok" : "FAILED"
+		);
+	}
+
+	free(messages);
+	free(decoded);
+	free(buffer);
+	free(hand_buffer);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Timing wheel against a binary heap, both holding the timeouts of many connections. */
+
+const uint32_t BENCH_TIMER_TICK_MS = 50;
+const uint32_t BENCH_TIMER_MAX_DELAY_MS = 120 * 1000;
+
+// Min heap of expiries that knows where every timer is in it, so that timers can be
+// moved and removed, which is what a heap based timer queue needs for timeouts.
+typedef struct TimerHeap {
+	uint64_t *expiries;    // By heap position.
+	int      *timers;      // Timer at each heap position.
+	int      *positions;   // Heap position of each timer, -1 while not in the heap.
+	int       count;
+} TimerHeap;
+
+void timer_heap_swap(TimerHeap *heap, int a, int b) {
+	uint64_t expiry = heap->expiries[a];
+	heap->expiries[a] = heap->expiries[b];
+	heap->expiries[b] = expiry;
+
+	int timer = heap->timers[a];
+	heap->timers[a] = heap->timers[b];
+	heap->timers[b] = timer;
+
+	heap->positions[heap->timers[a]] = a;
+	heap->positions[heap->timers[b]] = b;
+}
+
+void timer_heap_sift(TimerHeap *heap, int position) {
+	while (position > 0 && heap->expiries[(position - 1) / 2] > heap->expiries[position]) {
+		timer_heap_swap(heap, position, (position - 1) / 2);
+		position = (position - 1) / 2;
+	}
+
+	while (true) {
+		int smallest = position;
+		int left = 2 * position + 1;
+		int right = left + 1;
+		if (left < heap->count && heap->expiries[left] < heap->expiries[smallest])
+			smallest = left;
+
+		if (right < heap->count && heap->expiries[right] < heap->expiries[smallest])
+			smallest = right;
+
+		if (smallest == position)
+			break;
+
+		timer_heap_swap(heap, position, smallest);
+		position = smallest;
+	}
+}
+
+// Adds the timer or moves it to the new expiry.
+void timer_heap_set(TimerHeap *heap, int timer, uint64_t expiry) {
+	int position = heap->positions[timer];
+	if (position < 0) {
+		position = heap->count;
+		heap->count += 1;
+		heap->timers[position] = timer;
+		heap->positions[timer] = position;
+	}
+
+	heap->expiries[position] = expiry;
+	timer_heap_sift(heap, position);
+}
+
+void timer_heap_remove(TimerHeap *heap, int timer) {
+	int position = heap->positions[timer];
+	if (position < 0)
+		return;
+
+	heap->count -= 1;
+	if (position != heap->count) {
+		timer_heap_swap(heap, position, heap->count);
+		timer_heap_sift(heap, position);
+	}
+
+	heap->positions[timer] = -1;
+}
+
+typedef struct BenchTimer {
+	Timer    timer;
+	uint64_t due_ms;
+	uint64_t fired_ms;
+	int      fired_count;
+	bool     cancelled;
+} BenchTimer;
+
+// Simulated clock both queues are advanced with.
+uint64_t g_bench_timer_now_ms = 0;
+
+void record_bench_timer(Timer *timer, void *argument) {
+	BenchTimer *bench_timer = (BenchTimer *) argument;
+	bench_timer->fired_ms = g_bench_timer_now_ms;
+	bench_timer->fired_count += 1;
+}
+
+typedef struct TimerBenchResult {
+	double arm_ns;
+	double rearm_ns;
+	double cancel_ns;
+	double advance_ms;   // All of the simulated time, tick by tick.
+	int    fired_count;
+	bool   valid;
+} TimerBenchResult;
+
+// Every timer that wasn't cancelled fired once, not before it was due and at most
+// `max_lateness_ms` after, and the cancelled ones never did.
+bool check_bench_timers(BenchTimer *timers, int timers_count, uint64_t max_lateness_ms, int *out_fired_count) {
+	int fired_count = 0;
+	bool valid = true;
+	for (int i = 0; i < timers_count; i += 1) {
+		BenchTimer *timer = &timers[i];
+		fired_count += timer->fired_count;
+
+		if (timer->cancelled)
+			valid = valid && timer->fired_count == 0;
+		else
+			valid = valid && timer->fired_count == 1 && timer->fired_ms >= timer->due_ms && timer->fired_ms <= timer->due_ms + max_lateness_ms;
+	}
+
+	*out_fired_count = fired_count;
+	return valid;
+}
+
+void reset_bench_timers(BenchTimer *timers, int timers_count) {
+	for (int i = 0; i < timers_count; i += 1) {
+		ppchat_timer_init(&timers[i].timer, record_bench_timer, &timers[i]);
+		timers[i].due_ms = 0;
+		timers[i].fired_ms = 0;
+		timers[i].fired_count = 0;
+		timers[i].cancelled = false;
+	}
+
+	g_bench_timer_now_ms = 0;
+}
+
+// `delays` has a delay for every timer for the arm and every re-arm. Every fourth timer is cancelled.
+TimerBenchResult run_wheel_bench(BenchTimer *timers, int timers_count, const uint32_t *delays, int rearms_count) {
+	TimerBenchResult result = { };
+	reset_bench_timers(timers, timers_count);
+
+	TimerWheel wheel;
+	ppchat_timer_wheel_init(&wheel, BENCH_TIMER_TICK_MS, 0);
+
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < timers_count; i += 1)
+		ppchat_timer_arm(&wheel, &timers[i].timer, delays[i]);
+
+	result.arm_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / timers_count;
+
+	start_timestamp = get_timestamp();
+	for (int rearm = 1; rearm <= rearms_count; rearm += 1) {
+		const uint32_t *rearm_delays = delays + (size_t) rearm * timers_count;
+		for (int i = 0; i < timers_count; i += 1)
+			ppchat_timer_arm(&wheel, &timers[i].timer, rearm_delays[i]);
+	}
+
+	result.rearm_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((double) timers_count * max(rearms_count, 1));
+
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < timers_count; i += 4)
+		ppchat_timer_cancel(&wheel, &timers[i].timer);
+
+	result.cancel_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((timers_count + 3) / 4);
+
+	const uint32_t *last_delays = delays + (size_t) rearms_count * timers_count;
+	for (int i = 0; i < timers_count; i += 1) {
+		timers[i].due_ms = last_delays[i];
+		timers[i].cancelled = (i % 4) == 0;
+	}
+
+	start_timestamp = get_timestamp();
+	for (uint64_t now_ms = 0; now_ms <= BENCH_TIMER_MAX_DELAY_MS + 2 * BENCH_TIMER_TICK_MS; now_ms += BENCH_TIMER_TICK_MS) {
+		g_bench_timer_now_ms = now_ms;
+		ppchat_timer_wheel_advance(&wheel, now_ms);
+	}
+
+	result.advance_ms = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e3;
+
+	// Arming counts from the last tick, so a timer can be up to two ticks late.
+	result.valid = check_bench_timers(timers, timers_count, 2 * BENCH_TIMER_TICK_MS, &result.fired_count) && wheel.armed_count == 0;
+	return result;
+}
+
+TimerBenchResult run_heap_bench(TimerHeap *heap, BenchTimer *timers, int timers_count, const uint32_t *delays, int rearms_count) {
+	TimerBenchResult result = { };
+	reset_bench_timers(timers, timers_count);
+
+	heap->count = 0;
+	for (int i = 0; i < timers_count; i += 1)
+		heap->positions[i] = -1;
+
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < timers_count; i += 1)
+		timer_heap_set(heap, i, delays[i]);
+
+	result.arm_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / timers_count;
+
+	start_timestamp = get_timestamp();
+	for (int rearm = 1; rearm <= rearms_count; rearm += 1) {
+		const uint32_t *rearm_delays = delays + (size_t) rearm * timers_count;
+		for (int i = 0; i < timers_count; i += 1)
+			timer_heap_set(heap, i, rearm_delays[i]);
+	}
+
+	result.rearm_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((double) timers_count * max(rearms_count, 1));
+
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < timers_count; i += 4)
+		timer_heap_remove(heap, i);
+
+	result.cancel_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((timers_count + 3) / 4);
+
+	const uint32_t *last_delays = delays + (size_t) rearms_count * timers_count;
+	for (int i = 0; i < timers_count; i += 1) {
+		timers[i].due_ms = last_delays[i];
+		timers[i].cancelled = (i % 4) == 0;
+	}
+
+	start_timestamp = get_timestamp();
+	for (uint64_t now_ms = 0; now_ms <= BENCH_TIMER_MAX_DELAY_MS + 2 * BENCH_TIMER_TICK_MS; now_ms += BENCH_TIMER_TICK_MS) {
+		g_bench_timer_now_ms = now_ms;
+		while (heap->count > 0 && heap->expiries[0] <= now_ms) {
+			int timer = heap->timers[0];
+			timer_heap_remove(heap, timer);
+			record_bench_timer(&timers[timer].timer, &timers[timer]);
+		}
+	}
+
+	result.advance_ms = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e3;
+	result.valid = check_bench_timers(timers, timers_count, BENCH_TIMER_TICK_MS, &result.fired_count) && heap->count == 0;
+	return result;
+}
+
+int bench_timers(int arguments_count, char *arguments[]) {
+	int timers_count = get_int_argument(arguments_count, arguments, 0, 100000);
+	int rearms_count = get_int_argument(arguments_count, arguments, 1, 10);
+
+	BenchTimer *timers = (BenchTimer *) malloc((size_t) timers_count * sizeof(BenchTimer));
+	uint32_t *delays = (uint32_t *) malloc((size_t) timers_count * (rearms_count + 1) * sizeof(uint32_t));
+
+	TimerHeap heap = { };
+	heap.expiries = (uint64_t *) malloc((size_t) timers_count * sizeof(uint64_t));
+	heap.timers = (int *) malloc((size_t) timers_count * sizeof(int));
+	heap.positions = (int *) malloc((size_t) timers_count * sizeof(int));
+
+	if (!timers || !delays || !heap.expiries || !heap.timers || !heap.positions) {
+		log_error("Couldn't allocate %d timers.", timers_count);
+		free(timers);
+		free(delays);
+		free(heap.expiries);
+		free(heap.timers);
+		free(heap.positions);
+		return EXIT_FAILURE;
+	}
+
+	// Idle timeouts of connections that are pushed back every time something arrives.
+	uint32_t random_state = 0x85EBCA6Bu;
+	for (size_t i = 0; i < (size_t) timers_count * (rearms_count + 1); i += 1)
+		delays[i] = 1 + next_bench_random(&random_state) % BENCH_TIMER_MAX_DELAY_MS;
+
+	log("Timers: %d timers armed, re-armed %d times and a quarter cancelled, then %u s of %u ms ticks.", timers_count, rearms_count, BENCH_TIMER_MAX_DELAY_MS / 1000, BENCH_TIMER_TICK_MS);
+	log("%-14s %10s %10s %10s %12s %10s %8s", "Queue", "Arm ns", "Re-arm ns", "Cancel ns", "Advance ms", "Fired", "Checked");
+
+	bool all_valid = true;
+	for (int kind = 0; kind < 2; kind += 1) {
+		TimerBenchResult result = (kind == 0)
+			? run_wheel_bench(timers, timers_count, delays, rearms_count)
+			: run_heap_bench(&heap, timers, timers_count, delays, rearms_count);
+
+		all_valid = all_valid && result.valid;
+		log(
+			"%-14s %10.2f %10.2f %10.2f %12.2f %10d %8s",
+			(kind == 0) ? "timing wheel" : "binary heap",
+			result.arm_ns,
+			result.rearm_ns,
+			result.cancel_ns,
+			result.advance_ms,
+			result.fired_count,
+			(result.valid) ? "ok" : "FAILED"
+		);
+	}
+
+	free(timers);
+	free(delays);
+	free(heap.expiries);
+	free(heap.timers);
+	free(heap.positions);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Per-address rate limits: cost of a check and whether the rate holds. */
+
+// Sends one message every millisecond for `seconds` from two addresses of the same /64,
+// and waits whenever it's told to. Returns how many messages got through.
+int run_rate_limit_flood(RateLimiter *limiter, int seconds) {
+	sockaddr_in6 first_address = { };
+	first_address.sin6_family = AF_INET6;
+	uint8_t *bytes = (uint8_t *) &first_address.sin6_addr;
+	bytes[0] = 0x20;
+	bytes[1] = 0x01;
+	bytes[15] = 1;
+
+	sockaddr_in6 second_address = first_address;
+	((uint8_t *) &second_address.sin6_addr)[15] = 2;
+
+	int allowed_count = 0;
+	uint64_t blocked_until_ms = 0;
+	for (uint64_t now_ms = 1; now_ms <= (uint64_t) seconds * 1000; now_ms += 1) {
+		if (now_ms < blocked_until_ms)
+			continue;
+
+		RateLimitEntry *entry = ppchat_rate_limiter_get(limiter, (now_ms & 1) ? &first_address : &second_address, now_ms);
+		uint32_t delay_ms = ppchat_rate_limiter_take(limiter, entry, RATE_LIMIT_KIND_MESSAGES, 1);
+		allowed_count += 1;
+		if (delay_ms > 0)
+			blocked_until_ms = now_ms + delay_ms;
+	}
+
+	return allowed_count;
+}
+
+// Checks `checks_count` messages from `addresses_count` IPv4 addresses in turn. Returns ns per check.
+double run_rate_limit_checks(RateLimiter *limiter, int addresses_count, int checks_count) {
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < checks_count; i += 1) {
+		uint32_t ip = ppchat_hton32((uint32_t) (0x0A000000 + i % addresses_count));
+
+		sockaddr_in6 address = { };
+		sockaddr_in *address_v4 = (sockaddr_in *) &address;
+		address_v4->sin_family = AF_INET;
+		memcpy(&address_v4->sin_addr, &ip, sizeof(ip));
+
+		RateLimitEntry *entry = ppchat_rate_limiter_get(limiter, &address, (uint64_t) i / 1000);
+		ppchat_rate_limiter_take(limiter, entry, RATE_LIMIT_KIND_MESSAGES, 1);
+	}
+
+	return get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / checks_count;
+}
+
+int bench_rate_limit(int arguments_count, char *arguments[]) {
+	int millions = get_int_argument(arguments_count, arguments, 0, 10);
+	int checks_count = millions * 1000000;
+
+	const uint32_t messages_per_second = 50;
+	const int flood_seconds = 60;
+
+	RateLimitOptions options = { };
+	options.limits[RATE_LIMIT_KIND_MESSAGES].per_second = messages_per_second;
+	options.limits[RATE_LIMIT_KIND_MESSAGES].burst = 2 * messages_per_second;
+
+	RateLimiter limiter;
+	if (!ppchat_rate_limiter_create(&limiter, &options)) {
+		log_error("Couldn't allocate rate limits.");
+		return EXIT_FAILURE;
+	}
+
+	// Everything that was allowed fits in the burst and the rate over the time, give or
+	// take the message that ran the bucket into debt.
+	int allowed_count = run_rate_limit_flood(&limiter, flood_seconds);
+	int expected_count = (int) (messages_per_second * flood_seconds + 2 * messages_per_second);
+	bool flood_valid = abs(allowed_count - expected_count) <= (int) messages_per_second / 10 + 1 && limiter.entries_count == 1;
+
+	log("Rate limit: %u messages per second, one message every ms for %d s from two addresses of one /64.", messages_per_second, flood_seconds);
+	log("Allowed %d messages, expected %d. %s", allowed_count, expected_count, (flood_valid) ? "ok" : "FAILED");
+
+	// What keying on the string would cost before even looking anything up.
+	sockaddr_in6 address = { };
+	address.sin6_family = AF_INET6;
+	char ip[INET6_ADDRSTRLEN];
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < 1000000; i += 1) {
+		((uint8_t *) &address.sin6_addr)[15] = (uint8_t) i;
+		ppchat_inet_ntop(AF_INET6, &address.sin6_addr, ip, sizeof(ip));
+	}
+
+	double ntop_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / 1000000;
+
+	log("%-34s %12s %12s %12s", "Addresses", "ns per check", "Tracked", "Evicted");
+
+	bool all_valid = flood_valid;
+	const int addresses_counts[] = { 1000, PPCHAT_RATE_LIMIT_DEFAULT_CAPACITY / 2, 1000000 };
+	for (int i = 0; i < (int) (sizeof(addresses_counts) / sizeof(addresses_counts[0])); i += 1) {
+		ppchat_rate_limiter_destroy(&limiter);
+		if (!ppchat_rate_limiter_create(&limiter, &options)) {
+			log_error("Couldn't allocate rate limits.");
+			return EXIT_FAILURE;
+		}
+
+		double check_ns = run_rate_limit_checks(&limiter, addresses_counts[i], checks_count);
+
+		// The table never holds more than it was made for, and a few addresses all fit.
+		bool fits = addresses_counts[i] <= PPCHAT_RATE_LIMIT_DEFAULT_CAPACITY / 16;
+		all_valid = all_valid && limiter.entries_count <= limiter.mask + 1 && (!fits || limiter.entries_count == (uint64_t) addresses_counts[i]);
+
+		char label[64];
+		snprintf(label, sizeof(label), "%d", addresses_counts[i]);
+		log("%-34s %12.2f %12llu %12llu", label, check_ns, limiter.entries_count, limiter.evicted_count);
+	}
+
+	log("%-34s %12.2f", "inet_ntop alone, for comparison", ntop_ns);
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+
+	ppchat_rate_limiter_destroy(&limiter);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Connection registry: handle lookups, churn and scanning a field of every connection. */
+
+// Roughly what a connection and its client take, with the activity time somewhere inside.
+typedef struct BenchConnectionRecord {
+	char     before[200];
+	uint64_t last_activity_ms;
+	char     after[312];
+} BenchConnectionRecord;
+
+int bench_registry(int arguments_count, char *arguments[]) {
+	int entries_count = get_int_argument(arguments_count, arguments, 0, 100000);
+	int millions = get_int_argument(arguments_count, arguments, 1, 10);
+	int operations_count = millions * 1000000;
+
+	ConnectionRegistry registry;
+	int registry_error = 0;
+	if (!ppchat_connection_registry_create(&registry, entries_count, 1, &registry_error)) {
+		log_error("Couldn't reserve a registry of %d entries. Error: %d - %s", entries_count, registry_error, get_error_description(registry_error, g_error_message, sizeof(g_error_message)));
+		return EXIT_FAILURE;
+	}
+
+	ConnectionHandle *handles = (ConnectionHandle *) malloc((size_t) entries_count * sizeof(ConnectionHandle));
+	ConnectionHandle *stale_handles = (ConnectionHandle *) calloc((size_t) entries_count, sizeof(ConnectionHandle));
+	BenchConnectionRecord *records = (BenchConnectionRecord *) calloc((size_t) entries_count, sizeof(BenchConnectionRecord));
+	if (!handles || !stale_handles || !records) {
+		log_error("Couldn't allocate %d entries.", entries_count);
+		free(handles);
+		free(stale_handles);
+		free(records);
+		ppchat_connection_registry_destroy(&registry);
+		return EXIT_FAILURE;
+	}
+
+	sockaddr_in6 address = { };
+	address.sin6_family = AF_INET6;
+	Socket socket = { };
+
+	// Objects are the index plus one, so that they can be checked.
+	bool all_valid = true;
+	uint64_t start_timestamp = get_timestamp();
+	for (int i = 0; i < entries_count; i += 1) {
+		handles[i] = ppchat_connection_registry_add(&registry, (void *) (uintptr_t) (i + 1), socket, &address, i);
+		all_valid = all_valid && handles[i] != PPCHAT_INVALID_CONNECTION_HANDLE;
+	}
+
+	double add_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / entries_count;
+	int peak_slots_count = registry.slots_count;
+	int peak_committed_count = registry.committed_count;
+
+	// Connections that leave and get replaced right away, with the handle of the one
+	// that left kept around to check later.
+	uint32_t random_state = 0x27D4EB2Fu;
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < operations_count; i += 1) {
+		int index = (int) (next_bench_random(&random_state) % (uint32_t) entries_count);
+		ppchat_connection_registry_remove(&registry, handles[index]);
+		stale_handles[index] = handles[index];
+		handles[index] = ppchat_connection_registry_add(&registry, (void *) (uintptr_t) (index + 1), socket, &address, i);
+	}
+
+	double churn_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / operations_count;
+
+	uintptr_t objects_sum = 0;
+	start_timestamp = get_timestamp();
+	for (int i = 0; i < operations_count; i += 1) {
+		int index = (int) (next_bench_random(&random_state) % (uint32_t) entries_count);
+		objects_sum += (uintptr_t) ppchat_connection_registry_get(&registry, handles[index]);
+	}
+
+	double lookup_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / operations_count;
+
+	// Oldest activity of all, from the packed array against from whole records.
+	for (int i = 0; i < registry.count; i += 1)
+		records[i].last_activity_ms = registry.last_activity_ms[i];
+
+	int scans_count = max(operations_count / entries_count, 1);
+	uint64_t oldest_packed = UINT64_MAX;
+	start_timestamp = get_timestamp();
+	for (int scan = 0; scan < scans_count; scan += 1) {
+		for (int i = 0; i < registry.count; i += 1)
+			oldest_packed = min(oldest_packed, registry.last_activity_ms[i] + scan);
+	}
+
+	double packed_scan_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((double) scans_count * entries_count);
+
+	uint64_t oldest_records = UINT64_MAX;
+	start_timestamp = get_timestamp();
+	for (int scan = 0; scan < scans_count; scan += 1) {
+		for (int i = 0; i < entries_count; i += 1)
+			oldest_records = min(oldest_records, records[i].last_activity_ms + scan);
+	}
+
+	double records_scan_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / ((double) scans_count * entries_count);
+
+	// Every live handle finds its own object, no replaced one finds anything, and the
+	// churn didn't take a single slot or page more than the peak.
+	uint64_t stale_lookups_before = registry.stale_lookups_count;
+	for (int i = 0; i < entries_count; i += 1) {
+		all_valid = all_valid && (uintptr_t) ppchat_connection_registry_get(&registry, handles[i]) == (uintptr_t) (i + 1);
+		if (stale_handles[i] != PPCHAT_INVALID_CONNECTION_HANDLE)
+			all_valid = all_valid && ppchat_connection_registry_find(&registry, stale_handles[i]) < 0;
+	}
+
+	// Sum of the objects looked up, which also keeps the lookups from being optimized away.
+	all_valid = all_valid
+		&& objects_sum > 0
+		&& registry.count == entries_count
+		&& registry.slots_count == peak_slots_count
+		&& registry.committed_count == peak_committed_count
+		&& registry.stale_lookups_count > stale_lookups_before
+		&& oldest_packed == oldest_records;
+
+	log("Registry: %d connections, %d million replaced, looked up by handle and scanned for the oldest activity.", entries_count, millions);
+	log("%-34s %12s", "Operation", "ns");
+	log("%-34s %12.2f", "add", add_ns);
+	log("%-34s %12.2f", "remove and add", churn_ns);
+	log("%-34s %12.2f", "look up by handle", lookup_ns);
+	log("%-34s %12.3f", "scan activity, packed", packed_scan_ns);
+	log("%-34s %12.3f", "scan activity, whole records", records_scan_ns);
+	log("Slots: %d at peak, %d after churn, %d committed.", peak_slots_count, registry.slots_count, registry.committed_count);
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+
+	free(handles);
+	free(stale_handles);
+	free(records);
+	ppchat_connection_registry_destroy(&registry);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Server processes: benchmarks of what the server does as a whole start it next to themselves. */
+
+typedef struct ServerProcess {
+	PROCESS_INFORMATION process;
+	HANDLE              input;   // Server's stdin, for `/quit`.
+} ServerProcess;
+
+// Server is built next to the benchmark, in a folder of its own, unless argument `index` names it.
+void get_server_path(int arguments_count, char *arguments[], int index, char *out_path, size_t out_path_size) {
+	if (arguments_count > index) {
+		snprintf(out_path, out_path_size, "%s", arguments[index]);
+		return;
+	}
+
+	DWORD path_length = GetModuleFileNameA(NULL, out_path, (DWORD) out_path_size);
+	char *folder_end = (path_length > 0) ? strrchr(out_path, '\\') : NULL;
+	if (folder_end)
+		*folder_end = '\0';
+
+	size_t folder_length = strlen(out_path);
+	snprintf(out_path + folder_length, out_path_size - folder_length, "\\..\\ppchat-server\\ppchat-server.exe");
+}
+
+bool start_server_process(char *command_line, ServerProcess *out_server) {
+	memset(out_server, 0, sizeof(*out_server));
+
+	SECURITY_ATTRIBUTES inheritable = { };
+	inheritable.nLength = sizeof(inheritable);
+	inheritable.bInheritHandle = TRUE;
+
+	HANDLE input_read = NULL;
+	if (!CreatePipe(&input_read, &out_server->input, &inheritable, 0))
+		return false;
+
+	SetHandleInformation(out_server->input, HANDLE_FLAG_INHERIT, 0);
+
+	// Servers log every message, nobody reads that here.
+	HANDLE null_output = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &inheritable, OPEN_EXISTING, 0, NULL);
+
+	STARTUPINFOA startup_info = { };
+	startup_info.cb = sizeof(startup_info);
+	startup_info.dwFlags = STARTF_USESTDHANDLES;
+	startup_info.hStdInput = input_read;
+	startup_info.hStdOutput = null_output;
+	startup_info.hStdError = null_output;
+
+	BOOL created = CreateProcessA(
+		/* Application name     */ NULL,
+		/* Command line         */ command_line,
+		/* Process attributes   */ NULL,
+		/* Thread attributes    */ NULL,
+		/* Inherit handles      */ TRUE,
+		/* Creation flags       */ CREATE_NO_WINDOW,
+		/* Environment          */ NULL,
+		/* Current directory    */ NULL,
+		/* Startup info         */ &startup_info,
+		/* Process information  */ &out_server->process
+	);
+
+	CloseHandle(input_read);
+	if (null_output != INVALID_HANDLE_VALUE)
+		CloseHandle(null_output);
+
+	if (!created) {
+		CloseHandle(out_server->input);
+		out_server->input = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void stop_server_process(ServerProcess *server) {
+	if (!server->process.hProcess)
+		return;
+
+	DWORD written = 0;
+	WriteFile(server->input, "/quit\n", 6, &written, NULL);
+	CloseHandle(server->input);
+
+	if (WaitForSingleObject(server->process.hProcess, 5000) != WAIT_OBJECT_0)
+		TerminateProcess(server->process.hProcess, EXIT_FAILURE);
+
+	CloseHandle(server->process.hThread);
+	CloseHandle(server->process.hProcess);
+	memset(server, 0, sizeof(*server));
+}
+
+// Returns once the server takes clients, false if it doesn't within a few seconds.
+bool wait_for_server(const char *port) {
+	for (int attempt = 0; attempt < 100; attempt += 1) {
+		int error = 0;
+		Socket socket = ppchat_connect(BENCH_SERVER_IP, port, &error);
+		if (socket.handle != INVALID_SOCKET) {
+			ppchat_close_socket(&socket);
+			return true;
+		}
+
+		Sleep(50);
+	}
+
+	return false;
+}
+
+/* Federation: clients of rooms spread over 1 to N server processes linked full mesh. */
+
+// Node `i` takes clients on the base port plus 2i and peers on the one after it.
+const int BENCH_FEDERATION_BASE_PORT = 1344;
+const int BENCH_FEDERATION_MAX_NODES = 8;
+const int BENCH_FEDERATION_ROOMS_COUNT = 8;
+const int BENCH_FEDERATION_MESSAGE_SIZE = 64;
+
+// Messages of a room on their way at once, the sender waits for a member on another
+// node to get them.
+const int BENCH_FEDERATION_WINDOW = 8;
+
+// Nodes dial the ones that weren't up yet again after two seconds, and rooms need a
+// moment to be subscribed to once their members have joined.
+const DWORD BENCH_FEDERATION_LINK_SETTLE_MS = 3000;
+const DWORD BENCH_FEDERATION_JOIN_SETTLE_MS = 500;
+const DWORD BENCH_FEDERATION_WARM_UP_MS = 1000;
+
+// Sender of a room whose window hasn't moved for this long sends another message anyway,
+// in case the first ones went out before the room was subscribed to.
+const uint32_t BENCH_FEDERATION_NUDGE_MS = 250;
+
+typedef struct FederationClient {
+	Connection  *connection;
+	FrameDecoder decoder;
+	int          room;
+	uint64_t     last_sequence;        // Zero until the first message.
+	uint64_t     received_count;
+	uint64_t     out_of_order_count;   // Gaps, repeats and messages older than the last one.
+} FederationClient;
+
+typedef struct FederationRoom {
+	FederationClient *sender;
+	FederationClient *watcher;          // On another node than the sender, if there is one.
+	uint64_t          sent_count;       // Sequence of the last message sent.
+	uint64_t          nudge_sequence;   // Watcher's last sequence when the nudge timer last ran.
+} FederationRoom;
+
+typedef struct FederationDriver {
+	Reactor           reactor;
+	FederationClient *clients;
+	int               clients_count;
+	FederationRoom    rooms[BENCH_FEDERATION_ROOMS_COUNT];
+	volatile uint64_t deliveries_count;
+} FederationDriver;
+
+typedef struct FederationResult {
+	bool   completed;
+	bool   valid;
+	double messages_per_second;
+	double deliveries_per_second;
+} FederationResult;
+
+bool start_federation_node(const char *server_path, int index, ServerProcess *out_node) {
+	// Every node links with the ones started before it, which makes one link per pair.
+	char command_line[2048];
+	int length = snprintf(
+		command_line,
+		sizeof(command_line),
+		"\"%s\" -port %d -peer_port %d -node %d -reactors 1 -no_history -idle_timeout 0 -handshake_timeout 0 -connection_rate 0 -message_rate 0 -byte_rate 0",
+		server_path,
+		BENCH_FEDERATION_BASE_PORT + 2 * index,
+		BENCH_FEDERATION_BASE_PORT + 2 * index + 1,
+		index + 1
+	);
+
+	for (int i = 0; i < index; i += 1)
+		length += snprintf(command_line + length, sizeof(command_line) - length, " -peer [::1]:%d", BENCH_FEDERATION_BASE_PORT + 2 * i + 1);
+
+	return start_server_process(command_line, out_node);
+}
+
+// Messages arrive as "<sender>: <sequence> xx...", notices of the server have no sequence.
+bool parse_federation_sequence(const char *payload, int size, uint64_t *out_sequence) {
+	for (int i = 0; i + 2 < size; i += 1) {
+		if (payload[i] != ':' || payload[i + 1] != ' ')
+			continue;
+
+		uint64_t sequence = 0;
+		int digits_count = 0;
+		for (int j = i + 2; j < size && payload[j] >= '0' && payload[j] <= '9'; j += 1) {
+			sequence = sequence * 10 + (uint64_t) (payload[j] - '0');
+			digits_count += 1;
+		}
+
+		*out_sequence = sequence;
+		return digits_count > 0;
+	}
+
+	return false;
+}
+
+void federation_send_next(FederationRoom *room) {
+	room->sent_count += 1;
+
+	char message[BENCH_FEDERATION_MESSAGE_SIZE];
+	memset(message, 'x', sizeof(message));
+	int digits_count = snprintf(message, sizeof(message), "%llu ", room->sent_count);
+	message[digits_count] = 'x';
+
+	ppchat_reactor_send_frame(room->sender->connection, FRAME_TYPE_CHAT_MESSAGE, 0, message, sizeof(message));
+}
+
+void federation_send_window(FederationRoom *room) {
+	while (room->sent_count - room->watcher->last_sequence < (uint64_t) BENCH_FEDERATION_WINDOW)
+		federation_send_next(room);
+}
+
+void federation_driver_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	FederationDriver *driver = static_cast<FederationDriver *>(user_data);
+	FederationClient *client = static_cast<FederationClient *>(connection->user_data);
+
+	ppchat_frame_decoder_feed(&client->decoder, data, size);
+
+	Frame frame;
+	uint64_t sequence = 0;
+	while (ppchat_frame_decoder_next(&client->decoder, &frame)) {
+		if (frame.header.type != FRAME_TYPE_CHAT_MESSAGE || !parse_federation_sequence(frame.payload, (int) frame.header.payload_size, &sequence))
+			continue;
+
+		// Members may miss the first messages of a room, never any after them.
+		if (client->last_sequence != 0 && sequence != client->last_sequence + 1)
+			client->out_of_order_count += 1;
+
+		client->last_sequence = max(client->last_sequence, sequence);
+		client->received_count += 1;
+		driver->deliveries_count += 1;
+	}
+
+	FederationRoom *room = &driver->rooms[client->room];
+	if (room->watcher == client)
+		federation_send_window(room);
+}
+
+void federation_driver_on_timer(Connection *connection, void *user_data) {
+	FederationDriver *driver = static_cast<FederationDriver *>(user_data);
+	FederationRoom *room = &driver->rooms[static_cast<FederationClient *>(connection->user_data)->room];
+
+	if (room->watcher->last_sequence == room->nudge_sequence)
+		federation_send_next(room);
+
+	room->nudge_sequence = room->watcher->last_sequence;
+	ppchat_reactor_set_timer(connection, BENCH_FEDERATION_NUDGE_MS);
+}
+
+FederationResult run_federation(const char *server_path, int nodes_count, int clients_per_node, int seconds) {
+	FederationResult result = { };
+
+	ServerProcess nodes[BENCH_FEDERATION_MAX_NODES] = { };
+	bool nodes_started = true;
+	for (int i = 0; i < nodes_count && nodes_started; i += 1) {
+		char port[16];
+		snprintf(port, sizeof(port), "%d", BENCH_FEDERATION_BASE_PORT + 2 * i);
+		nodes_started = start_federation_node(server_path, i, &nodes[i]) && wait_for_server(port);
+		if (!nodes_started)
+			log_error("Couldn't start node %d from '%s'.", i + 1, server_path);
+	}
+
+	FederationDriver driver = { };
+	driver.clients = (FederationClient *) calloc((size_t) nodes_count * clients_per_node, sizeof(FederationClient));
+
+	ReactorOptions options = { };
+	options.max_connections = nodes_count * clients_per_node + PPCHAT_REACTOR_PENDING_ACCEPTS;
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_receive = federation_driver_on_receive;
+	callbacks.on_timer = federation_driver_on_timer;
+	callbacks.user_data = &driver;
+
+	int error = 0;
+	bool driver_created = nodes_started && driver.clients && ppchat_reactor_create(&driver.reactor, &options, &callbacks, &error);
+	if (driver_created) {
+		Sleep(BENCH_FEDERATION_LINK_SETTLE_MS);
+
+		// Client `c` of every node is in room `c % rooms`. Room `r` is sent to by its first
+		// member on node `r % nodes` and watched by one on the node after that.
+		for (int node = 0; node < nodes_count; node += 1) {
+			char port[16];
+			snprintf(port, sizeof(port), "%d", BENCH_FEDERATION_BASE_PORT + 2 * node);
+
+			for (int c = 0; c < clients_per_node; c += 1) {
+				FederationClient *client = &driver.clients[driver.clients_count];
+				Socket socket = ppchat_connect(BENCH_SERVER_IP, port, &error);
+				if (socket.handle == INVALID_SOCKET)
+					break;
+
+				client->connection = ppchat_reactor_add_socket(&driver.reactor, socket, &error);
+				if (!client->connection)
+					break;
+
+				ppchat_frame_decoder_init(&client->decoder, 0);
+				client->room = c % BENCH_FEDERATION_ROOMS_COUNT;
+				client->connection->user_data = client;
+				driver.clients_count += 1;
+
+				char room_name[16];
+				int room_name_size = snprintf(room_name, sizeof(room_name), "room%d", client->room);
+				ppchat_reactor_send_frame(client->connection, FRAME_TYPE_JOIN_ROOM, 0, room_name, room_name_size);
+
+				FederationRoom *room = &driver.rooms[client->room];
+				if (c == client->room && node == client->room % nodes_count)
+					room->sender = client;
+				else if (c == client->room + BENCH_FEDERATION_ROOMS_COUNT && node == (client->room + 1) % nodes_count)
+					room->watcher = client;
+			}
+		}
+	}
+
+	if (driver_created && driver.clients_count == nodes_count * clients_per_node) {
+		Sleep(BENCH_FEDERATION_JOIN_SETTLE_MS);
+
+		// Driver isn't running yet, so it is fine to queue and set timers from this thread.
+		for (int r = 0; r < BENCH_FEDERATION_ROOMS_COUNT; r += 1) {
+			federation_send_window(&driver.rooms[r]);
+			ppchat_reactor_set_timer(driver.rooms[r].sender->connection, BENCH_FEDERATION_NUDGE_MS);
+		}
+
+		HANDLE driver_thread = CreateThread(NULL, 0, run_reactor, &driver.reactor, NULL, NULL);
+		Sleep(BENCH_FEDERATION_WARM_UP_MS);
+
+		// Counted on the driver's thread, read here while it runs.
+		uint64_t start_deliveries_count = driver.deliveries_count;
+		uint64_t start_sent_count = 0;
+		for (int r = 0; r < BENCH_FEDERATION_ROOMS_COUNT; r += 1)
+			start_sent_count += driver.rooms[r].sent_count;
+
+		uint64_t start_timestamp = get_timestamp();
+		Sleep(seconds * 1000);
+		uint64_t deliveries_count = driver.deliveries_count - start_deliveries_count;
+		double seconds_elapsed = get_seconds_elapsed(start_timestamp, get_timestamp());
+
+		ppchat_reactor_stop(&driver.reactor);
+		WaitForSingleObject(driver_thread, INFINITE);
+		CloseHandle(driver_thread);
+
+		uint64_t sent_count = 0;
+		for (int r = 0; r < BENCH_FEDERATION_ROOMS_COUNT; r += 1)
+			sent_count += driver.rooms[r].sent_count;
+
+		// Every member got messages, all of them in order, and no room stalled.
+		bool valid = sent_count - start_sent_count > (uint64_t) BENCH_FEDERATION_ROOMS_COUNT * BENCH_FEDERATION_WINDOW;
+		for (int i = 0; i < driver.clients_count; i += 1) {
+			FederationClient *client = &driver.clients[i];
+			if (client != driver.rooms[client->room].sender)
+				valid = valid && client->received_count > 0 && client->out_of_order_count == 0;
+		}
+
+		result.completed = true;
+		result.valid = valid;
+		result.messages_per_second = (double) (sent_count - start_sent_count) / seconds_elapsed;
+		result.deliveries_per_second = (double) deliveries_count / seconds_elapsed;
+	} else if (driver_created) {
+		log_error("Only %d of %d clients could connect to %d nodes.", driver.clients_count, nodes_count * clients_per_node, nodes_count);
+	}
+
+	if (driver_created)
+		ppchat_reactor_destroy(&driver.reactor);
+
+	for (int i = 0; i < driver.clients_count; i += 1)
+		ppchat_frame_decoder_destroy(&driver.clients[i].decoder);
+
+	free(driver.clients);
+
+	for (int i = 0; i < nodes_count; i += 1)
+		stop_server_process(&nodes[i]);
+
+	return result;
+}
+
+int bench_federation(int arguments_count, char *arguments[]) {
+	int max_nodes = clamp(1, BENCH_FEDERATION_MAX_NODES, get_int_argument(arguments_count, arguments, 0, 4));
+	int clients_per_node = get_int_argument(arguments_count, arguments, 1, 200);
+	int seconds = get_int_argument(arguments_count, arguments, 2, 5);
+
+	// Every room needs a sender and a watcher on each node.
+	clients_per_node = max(clients_per_node, 2 * BENCH_FEDERATION_ROOMS_COUNT);
+
+	char server_path[MAX_PATH];
+	get_server_path(arguments_count, arguments, 3, server_path, sizeof(server_path));
+
+	log("Federation: %d clients per node in %d rooms, %d seconds per run, %d messages of %d bytes in flight per room.", clients_per_node, BENCH_FEDERATION_ROOMS_COUNT, seconds, BENCH_FEDERATION_WINDOW, BENCH_FEDERATION_MESSAGE_SIZE);
+	log("%-6s %10s %14s %16s %22s", "Nodes", "Clients", "Messages/sec", "Deliveries/sec", "Deliveries/sec/node");
+
+	bool all_valid = true;
+	for (int nodes_count = 1; nodes_count <= max_nodes; nodes_count += 1) {
+		FederationResult result = run_federation(server_path, nodes_count, clients_per_node, seconds);
+		all_valid = all_valid && result.completed && result.valid;
+		if (!result.completed)
+			continue;
+
+		log(
+			"%-6d %10d %14.0f %16.0f %22.0f%s",
+			nodes_count,
+			nodes_count * clients_per_node,
+			result.messages_per_second,
+			result.deliveries_per_second,
+			result.deliveries_per_second / nodes_count,
+			(result.valid) ? "" : "  (lost or reordered messages)"
+		);
+	}
+
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Topic router: matching publishes against wildcard subscriptions, trie against scanning them all. */
+
+const int BENCH_TOPIC_PATTERN_SIZE = 16;
+const uint32_t BENCH_TOPIC_LEVEL_VALUES = 100;
+
+// Level by level, the way a router without the trie checks every subscription.
+bool bench_pattern_matches_topic(const char *pattern, const char *topic) {
+	while (true) {
+		if (pattern[0] == '#' && pattern[1] == '\0')
+			return true;
+
+		size_t pattern_level_size = strcspn(pattern, ".");
+		size_t topic_level_size = strcspn(topic, ".");
+		bool any_level = (pattern_level_size == 1 && pattern[0] == '*');
+		if (!any_level && (pattern_level_size != topic_level_size || memcmp(pattern, topic, topic_level_size) != 0))
+			return false;
+
+		pattern += pattern_level_size;
+		topic += topic_level_size;
+
+		// `#` matches no levels as well.
+		if (*topic == '\0')
+			return *pattern == '\0' || strcmp(pattern, ".#") == 0;
+
+		if (*pattern == '\0')
+			return false;
+
+		pattern += 1;
+		topic += 1;
+	}
+}
+
+// Mostly exact topics, then fewer and fewer subscriptions that match more and more of them.
+void write_bench_topic_pattern(uint32_t *random_state, char *out_pattern) {
+	uint32_t kind = next_bench_random(random_state) % 100;
+	uint32_t a = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	uint32_t b = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	uint32_t c = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	if (kind < 80) {
+		snprintf(out_pattern, BENCH_TOPIC_PATTERN_SIZE, "a%u.b%u.c%u", a, b, c);
+	} else if (kind < 95) {
+		snprintf(out_pattern, BENCH_TOPIC_PATTERN_SIZE, "a%u.b%u.*", a, b);
+	} else if (kind < 99) {
+		snprintf(out_pattern, BENCH_TOPIC_PATTERN_SIZE, "a%u.*.c%u", a, c);
+	} else {
+		snprintf(out_pattern, BENCH_TOPIC_PATTERN_SIZE, "a%u.#", a);
+	}
+}
+
+void write_bench_topic(uint32_t *random_state, char *out_topic) {
+	uint32_t a = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	uint32_t b = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	uint32_t c = next_bench_random(random_state) % BENCH_TOPIC_LEVEL_VALUES;
+	snprintf(out_topic, BENCH_TOPIC_PATTERN_SIZE, "a%u.b%u.c%u", a, b, c);
+}
+
+int bench_topics(int arguments_count, char *arguments[]) {
+	int max_subscribers = max(get_int_argument(arguments_count, arguments, 0, 1000000), 1);
+	int publishes_count = max(get_int_argument(arguments_count, arguments, 1, 1000000), 1);
+
+	char *patterns = (char *) malloc((size_t) max_subscribers * BENCH_TOPIC_PATTERN_SIZE);
+	uint8_t *expected = (uint8_t *) calloc((size_t) max_subscribers, sizeof(uint8_t));
+	if (!patterns || !expected) {
+		log_error("Couldn't allocate %d subscriptions.", max_subscribers);
+		free(patterns);
+		free(expected);
+		return EXIT_FAILURE;
+	}
+
+	// Smaller runs subscribe the first of the same patterns.
+	uint32_t random_state = 0x9E3779B9u;
+	for (int i = 0; i < max_subscribers; i += 1)
+		write_bench_topic_pattern(&random_state, patterns + (size_t) i * BENCH_TOPIC_PATTERN_SIZE);
+
+	log("Topics: 80%% exact, 15%% 'a.b.*', 4%% 'a.*.c' and 1%% 'a.#' subscriptions, %d publishes on %u topics.", publishes_count, BENCH_TOPIC_LEVEL_VALUES * BENCH_TOPIC_LEVEL_VALUES * BENCH_TOPIC_LEVEL_VALUES);
+	log("%-12s %12s %14s %14s %16s %14s %16s", "Subscribers", "Trie nodes", "Subscribe ns", "Trie ns", "Linear scan ns", "Recipients", "Unsubscribe ns");
+
+	bool all_valid = true;
+	const int subscribers_counts[] = { 1000, 10000, 100000, 1000000 };
+	for (int run = 0; run < (int) (sizeof(subscribers_counts) / sizeof(subscribers_counts[0])); run += 1) {
+		int subscribers_count = min(subscribers_counts[run], max_subscribers);
+		if (run > 0 && subscribers_count == min(subscribers_counts[run - 1], max_subscribers))
+			break;
+
+		TopicRouter router;
+		ppchat_topic_router_init(&router);
+		TopicRecipients recipients;
+		ppchat_topic_recipients_init(&recipients);
+
+		bool valid = true;
+		uint64_t start_timestamp = get_timestamp();
+		for (int i = 0; i < subscribers_count; i += 1) {
+			const char *pattern = patterns + (size_t) i * BENCH_TOPIC_PATTERN_SIZE;
+			valid = valid && ppchat_topic_router_subscribe(&router, pattern, (int) strlen(pattern), (uint32_t) i);
+		}
+
+		double subscribe_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / subscribers_count;
+		uint64_t nodes_count = router.nodes_count;
+
+		// Recipients are summed, which also keeps the matching from being optimized away.
+		char topic[BENCH_TOPIC_PATTERN_SIZE];
+		uint64_t recipients_sum = 0;
+		uint32_t topics_state = 0x85EBCA6Bu;
+		start_timestamp = get_timestamp();
+		for (int i = 0; i < publishes_count; i += 1) {
+			write_bench_topic(&topics_state, topic);
+			valid = valid && ppchat_topic_router_match(&router, topic, (int) strlen(topic), &recipients);
+			recipients_sum += recipients.count;
+		}
+
+		double trie_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / publishes_count;
+
+		// Scanning takes as long as there are subscriptions, so it gets fewer publishes.
+		int linear_publishes_count = min(publishes_count, max(20000000 / subscribers_count, 10));
+		uint64_t linear_recipients_sum = 0;
+		topics_state = 0x85EBCA6Bu;
+		start_timestamp = get_timestamp();
+		for (int i = 0; i < linear_publishes_count; i += 1) {
+			write_bench_topic(&topics_state, topic);
+			for (int j = 0; j < subscribers_count; j += 1)
+				linear_recipients_sum += bench_pattern_matches_topic(patterns + (size_t) j * BENCH_TOPIC_PATTERN_SIZE, topic);
+		}
+
+		double linear_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / linear_publishes_count;
+
+		// Trie finds exactly who the scan does, each of them once.
+		uint64_t checked_recipients_sum = 0;
+		topics_state = 0x85EBCA6Bu;
+		for (int i = 0; i < linear_publishes_count && valid; i += 1) {
+			write_bench_topic(&topics_state, topic);
+			int expected_count = 0;
+			for (int j = 0; j < subscribers_count; j += 1) {
+				expected[j] = bench_pattern_matches_topic(patterns + (size_t) j * BENCH_TOPIC_PATTERN_SIZE, topic);
+				expected_count += expected[j];
+			}
+
+			checked_recipients_sum += expected_count;
+
+			valid = ppchat_topic_router_match(&router, topic, (int) strlen(topic), &recipients) && recipients.count == expected_count;
+			for (int j = 0; j < recipients.count && valid; j += 1) {
+				valid = recipients.subscribers[j] < (uint32_t) subscribers_count && expected[recipients.subscribers[j]];
+				if (valid)
+					expected[recipients.subscribers[j]] = 0;
+			}
+		}
+
+		start_timestamp = get_timestamp();
+		for (int i = 0; i < subscribers_count; i += 1) {
+			const char *pattern = patterns + (size_t) i * BENCH_TOPIC_PATTERN_SIZE;
+			valid = ppchat_topic_router_unsubscribe(&router, pattern, (int) strlen(pattern), (uint32_t) i) && valid;
+		}
+
+		double unsubscribe_ns = get_seconds_elapsed(start_timestamp, get_timestamp()) * 1e9 / subscribers_count;
+
+		// Nothing is left behind but the root.
+		valid = valid
+			&& checked_recipients_sum == linear_recipients_sum
+			&& router.nodes_count == 1
+			&& router.subscriptions_count == 0;
+		all_valid = all_valid && valid;
+
+		log(
+			"%-12d %12llu %14.1f %14.1f %16.1f %14.1f %16.1f%s",
+			subscribers_count,
+			nodes_count,
+			subscribe_ns,
+			trie_ns,
+			linear_ns,
+			(double) recipients_sum / publishes_count,
+			unsubscribe_ns,
+			(valid) ? "" : "  (wrong recipients)"
+		);
+
+		ppchat_topic_recipients_destroy(&recipients);
+		ppchat_topic_router_destroy(&router);
+	}
+
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+
+	free(patterns);
+	free(expected);
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Connect: racing the addresses of a name against trying them one after another. */
+
+const int BENCH_CONNECT_MAX_CONNECTS = 1000;
+
+// What `ppchat_connect` did before, blocking connects in the order `getaddrinfo` gives.
+Socket connect_serially_like_before(const char *server_ip, const char *server_port, int *out_error) {
+	Socket socket;
+	socket.handle = INVALID_SOCKET;
+
+	addrinfo hints = { };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	addrinfo *addresses = NULL;
+	*out_error = ppchat_getaddrinfo(server_ip, server_port, &hints, &addresses);
+	if (*out_error != 0)
+		return socket;
+
+	for (addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+		socket = ppchat_create_socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (socket.handle == INVALID_SOCKET)
+			continue;
+
+		if (connect(socket.handle, address->ai_addr, (int) address->ai_addrlen) != SOCKET_ERROR)
+			break;
+
+		*out_error = get_last_socket_error();
+		ppchat_close_socket(&socket);
+	}
+
+	ppchat_freeaddrinfo(addresses);
+	return socket;
+}
+
+typedef Socket (*BenchConnectFunction)(const char *server_ip, const char *server_port, int *out_error);
+
+// Milliseconds of every connect, sorted. Returns how many of them failed.
+int run_connects(BenchConnectFunction connect_function, Socket listen_socket, int connects_count, uint64_t *out_durations) {
+	int failed_count = 0;
+	for (int i = 0; i < connects_count; i += 1) {
+		int error = 0;
+		uint64_t start_timestamp = get_timestamp();
+		Socket socket = connect_function(BENCH_CONNECT_SERVER_NAME, BENCH_CONNECT_SERVER_PORT, &error);
+		out_durations[i] = get_timestamp() - start_timestamp;
+
+		if (socket.handle == INVALID_SOCKET) {
+			failed_count += 1;
+			continue;
+		}
+
+		// Already queued, so the accept doesn't wait.
+		Socket accepted = ppchat_accept(listen_socket, NULL, NULL);
+		if (accepted.handle != INVALID_SOCKET)
+			ppchat_close_socket(&accepted);
+
+		ppchat_close_socket(&socket);
+	}
+
+	qsort(out_durations, connects_count, sizeof(uint64_t), compare_uint64);
+	return failed_count;
+}
+
+int bench_connect(int arguments_count, char *arguments[]) {
+	int connects_count = clamp(1, BENCH_CONNECT_MAX_CONNECTS, get_int_argument(arguments_count, arguments, 0, 10));
+
+	// Listening on IPv4 only, so the IPv6 address of the name is refused, which Windows
+	// only gives up on after retrying for about a second.
+	Socket listen_socket = ppchat_create_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in address = { };
+	address.sin_family = AF_INET;
+	address.sin_port = htons((uint16_t) atoi(BENCH_CONNECT_SERVER_PORT));
+	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+	if (listen_socket.handle == INVALID_SOCKET
+		|| ppchat_bind(listen_socket, (sockaddr *) &address, sizeof(address)) == SOCKET_ERROR
+		|| ppchat_listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
+		int error = get_last_socket_error();
+		log_error("Couldn't listen on 127.0.0.1:%s. Error: %d - %s", BENCH_CONNECT_SERVER_PORT, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		if (listen_socket.handle != INVALID_SOCKET)
+			ppchat_close_socket(&listen_socket);
+
+		return EXIT_FAILURE;
+	}
+
+	addrinfo hints = { };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *addresses = NULL;
+	int ipv6_count = 0;
+	int ipv4_count = 0;
+	if (ppchat_getaddrinfo(BENCH_CONNECT_SERVER_NAME, BENCH_CONNECT_SERVER_PORT, &hints, &addresses) == 0) {
+		for (addrinfo *resolved = addresses; resolved != NULL; resolved = resolved->ai_next) {
+			ipv6_count += (resolved->ai_family == AF_INET6);
+			ipv4_count += (resolved->ai_family == AF_INET);
+		}
+
+		ppchat_freeaddrinfo(addresses);
+	}
+
+	const struct {
+		const char          *name;
+		BenchConnectFunction connect_function;
+	} runs[] = {
+		{ "one after another, like before", connect_serially_like_before },
+		{ "happy eyeballs",                 ppchat_connect },
+	};
+
+	const int runs_count = (int) (sizeof(runs) / sizeof(runs[0]));
+	uint64_t durations[runs_count][BENCH_CONNECT_MAX_CONNECTS];
+	int failed_counts[runs_count];
+
+	log("Connect: '%s' resolves to %d IPv6 and %d IPv4 addresses, only IPv4 is listened on. %d connects each.", BENCH_CONNECT_SERVER_NAME, ipv6_count, ipv4_count, connects_count);
+	log("%-34s %12s %12s %12s", "Connect", "p50 ms", "max ms", "Failed");
+
+	for (int i = 0; i < runs_count; i += 1) {
+		failed_counts[i] = run_connects(runs[i].connect_function, listen_socket, connects_count, durations[i]);
+		log(
+			"%-34s %12.1f %12.1f %12d",
+			runs[i].name,
+			get_seconds_elapsed(0, durations[i][connects_count / 2]) * 1000.0,
+			get_seconds_elapsed(0, durations[i][connects_count - 1]) * 1000.0,
+			failed_counts[i]
+		);
+	}
+
+	ppchat_close_socket(&listen_socket);
+
+	// Every connect got through, and racing never waited on the refused address for long.
+	double happy_eyeballs_max_ms = get_seconds_elapsed(0, durations[1][connects_count - 1]) * 1000.0;
+	bool all_valid = failed_counts[0] == 0 && failed_counts[1] == 0 && happy_eyeballs_max_ms < PPCHAT_CONNECT_ATTEMPT_TIMEOUT_MS;
+
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Protocol: frames the server has to take apart carefully, sent to a server process the way they are hard to handle. */
+
+// Sizes of the file sent in pieces, which ends in a short chunk.
+const int BENCH_PROTOCOL_FILE_CHUNKS_COUNT = 4;
+const uint64_t BENCH_PROTOCOL_FILE_SIZE = (uint64_t) (BENCH_PROTOCOL_FILE_CHUNKS_COUNT - 1) * PPCHAT_FILE_CHUNK_SIZE + 12345;
+const char *const BENCH_PROTOCOL_FILE_NAME = "ppchat-bench-protocol.bin";
+
+// Long enough for the server to have read what was sent before on its own,
+// and for answers that never come.
+const DWORD BENCH_PROTOCOL_SPLIT_MS = 50;
+const DWORD BENCH_PROTOCOL_TIMEOUT_MS = 5000;
+
+typedef struct ProtocolClient {
+	Socket       socket;
+	FrameDecoder decoder;
+	char         buffer[PPCHAT_RECEIVE_BUFFER_SIZE];
+} ProtocolClient;
+
+bool connect_protocol_client(ProtocolClient *client) {
+	int error = 0;
+	ppchat_frame_decoder_init(&client->decoder, 0);
+	client->socket = ppchat_connect(BENCH_SERVER_IP, BENCH_PROTOCOL_SERVER_PORT, &error);
+	if (client->socket.handle == INVALID_SOCKET) {
+		log_error("Couldn't connect to the server. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		return false;
+	}
+
+	// Pieces leave the moment they are sent, and a receive gives up instead of hanging the checks.
+	BOOL no_delay = TRUE;
+	DWORD timeout_ms = BENCH_PROTOCOL_TIMEOUT_MS;
+	ppchat_set_socket_option(client->socket, IPPROTO_TCP, TCP_NODELAY, (const char *) &no_delay, sizeof(no_delay));
+	ppchat_set_socket_option(client->socket, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout_ms, sizeof(timeout_ms));
+	return true;
+}
+
+void close_protocol_client(ProtocolClient *client) {
+	if (client->socket.handle != INVALID_SOCKET)
+		ppchat_close_socket(&client->socket);
+
+	ppchat_frame_decoder_destroy(&client->decoder);
+}
+
+bool send_protocol_bytes(ProtocolClient *client, const char *data, int size) {
+	while (size > 0) {
+		int sent = ppchat_send(client->socket, (char *) data, size, 0);
+		if (sent <= 0)
+			return false;
+
+		data += sent;
+		size -= sent;
+	}
+
+	return true;
+}
+
+// Waits for the next frame of `type`, skipping the others, and copies as much of its payload
+// as fits. Returns the payload size, or -1 if the connection ended, the server sent something
+// malformed or nothing came in time.
+int receive_protocol_frame(ProtocolClient *client, uint16_t type, char *out_payload, int out_payload_capacity) {
+	while (true) {
+		Frame frame;
+		while (ppchat_frame_decoder_next(&client->decoder, &frame)) {
+			if (frame.header.type != type)
+				continue;
+
+			memcpy(out_payload, frame.payload, min((int) frame.piece_size, out_payload_capacity));
+			return (int) frame.header.payload_size;
+		}
+
+		if (client->decoder.error != FRAME_DECODER_ERROR_NONE)
+			return -1;
+
+		int received = ppchat_receive(client->socket, client->buffer, sizeof(client->buffer), 0);
+		if (received <= 0)
+			return -1;
+
+		ppchat_frame_decoder_feed(&client->decoder, client->buffer, received);
+	}
+}
+
+// True once the server has closed the connection, whatever it sent before that.
+bool wait_for_protocol_close(ProtocolClient *client) {
+	while (true) {
+		int received = ppchat_receive(client->socket, client->buffer, sizeof(client->buffer), 0);
+		if (received == 0)
+			return true;
+
+		if (received < 0)
+			return get_last_socket_error() != WSAETIMEDOUT;
+	}
+}
+
+// Sends a chat message the server has to disconnect for: streamed and read in two
+// pieces, or whole but larger than a frame other than a file chunk may be.
+bool check_refused_message(bool streamed, int payload_size) {
+	char *payload = (char *) malloc(payload_size);
+	ProtocolClient *client = (ProtocolClient *) calloc(1, sizeof(ProtocolClient));
+	if (!payload || !client) {
+		free(payload);
+		free(client);
+		return false;
+	}
+
+	memset(payload, 'x', payload_size);
+
+	bool valid = connect_protocol_client(client);
+	if (valid) {
+		char header[PPCHAT_FRAME_HEADER_SIZE];
+		ppchat_encode_frame_header(header, FRAME_TYPE_CHAT_MESSAGE, (streamed) ? FRAME_FLAG_STREAMED : 0, (uint32_t) payload_size);
+
+		// Sends fail once the server has closed, which is what is expected of it.
+		int half_size = payload_size / 2;
+		send_protocol_bytes(client, header, sizeof(header));
+		send_protocol_bytes(client, payload, half_size);
+		if (streamed)
+			Sleep(BENCH_PROTOCOL_SPLIT_MS);
+
+		send_protocol_bytes(client, payload + half_size, payload_size - half_size);
+		valid = wait_for_protocol_close(client);
+	}
+
+	close_protocol_client(client);
+	free(payload);
+	free(client);
+	return valid;
+}
+
+// Answers mean the server has opened the connection and put the client in the lobby.
+bool ping_protocol_client(ProtocolClient *client) {
+	char pong[1];
+	return ppchat_send_frame(client->socket, FRAME_TYPE_PING, 0, NULL, 0, NULL) && receive_protocol_frame(client, FRAME_TYPE_PONG, pong, 0) == 0;
+}
+
+// Two members of the lobby: a message that fits a frame with the sender's address in front
+// of it just so reaches the other member whole. One a byte longer only gets the sender a
+// notice, and neither of them is disconnected over it.
+bool check_message_at_limit() {
+	char *message = (char *) malloc(PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+	char *received = (char *) malloc(PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+	ProtocolClient *sender = (ProtocolClient *) calloc(1, sizeof(ProtocolClient));
+	ProtocolClient *member = (ProtocolClient *) calloc(1, sizeof(ProtocolClient));
+	if (!message || !received || !sender || !member) {
+		free(message);
+		free(received);
+		free(sender);
+		free(member);
+		return false;
+	}
+
+	memset(message, 'x', PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+
+	bool valid = connect_protocol_client(member) && connect_protocol_client(sender);
+	valid = valid && ping_protocol_client(member) && ping_protocol_client(sender);
+
+	// Address the server puts in front of the sender's messages, skipping its notices.
+	int received_size = -1;
+	valid = valid && ppchat_send_frame(sender->socket, FRAME_TYPE_CHAT_MESSAGE, 0, "hello", 5, NULL);
+	while (valid) {
+		received_size = receive_protocol_frame(member, FRAME_TYPE_CHAT_MESSAGE, received, PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+		valid = received_size >= 0;
+		if (received_size >= 5 && memcmp(received + received_size - 5, "hello", 5) == 0)
+			break;
+	}
+
+	int max_message_size = PPCHAT_FRAME_MAX_PAYLOAD_SIZE - (received_size - 5);
+	valid = valid && ppchat_send_frame(sender->socket, FRAME_TYPE_CHAT_MESSAGE, 0, message, max_message_size + 1, NULL);
+	valid = valid && receive_protocol_frame(sender, FRAME_TYPE_CHAT_MESSAGE, received, PPCHAT_FRAME_MAX_PAYLOAD_SIZE) >= 0;
+
+	valid = valid && ppchat_send_frame(sender->socket, FRAME_TYPE_CHAT_MESSAGE, 0, message, max_message_size, NULL);
+	valid = valid && receive_protocol_frame(member, FRAME_TYPE_CHAT_MESSAGE, received, PPCHAT_FRAME_MAX_PAYLOAD_SIZE) == PPCHAT_FRAME_MAX_PAYLOAD_SIZE;
+	valid = valid && memcmp(received + PPCHAT_FRAME_MAX_PAYLOAD_SIZE - max_message_size, message, max_message_size) == 0;
+
+	close_protocol_client(sender);
+	close_protocol_client(member);
+	free(message);
+	free(received);
+	free(sender);
+	free(member);
+	return valid;
+}
+
+// Sends the file with every FILE_DATA frame header on its own, so the server's read ends
+// right after it, and the chunk header and bytes after that in one go. The file has to
+// arrive intact, with no more copied than the reads the chunk headers came in.
+bool check_split_file_chunks(double *out_megabytes_per_second, uint64_t *out_copied_size) {
+	char path[MAX_PATH];
+	char state_path[MAX_PATH];
+	snprintf(path, sizeof(path), "received_files\\%s", BENCH_PROTOCOL_FILE_NAME);
+	snprintf(state_path, sizeof(state_path), "%s%s", path, PPCHAT_TRANSFER_STATE_SUFFIX);
+	DeleteFileA(path);
+	DeleteFileA(state_path);
+
+	char *data = (char *) malloc((size_t) BENCH_PROTOCOL_FILE_SIZE);
+	char *received_data = (char *) malloc((size_t) BENCH_PROTOCOL_FILE_SIZE);
+	ProtocolClient *client = (ProtocolClient *) calloc(1, sizeof(ProtocolClient));
+	if (!data || !received_data || !client) {
+		free(data);
+		free(received_data);
+		free(client);
+		return false;
+	}
+
+	uint32_t random_state = 0x9E3779B9;
+	for (uint64_t i = 0; i < BENCH_PROTOCOL_FILE_SIZE; i += 1)
+		data[i] = (char) next_bench_random(&random_state);
+
+	bool valid = connect_protocol_client(client);
+
+	char begin_payload[PPCHAT_FILE_BEGIN_MAX_SIZE];
+	int begin_payload_size = ppchat_encode_file_begin(begin_payload, BENCH_PROTOCOL_FILE_SIZE, get_timestamp(), BENCH_PROTOCOL_FILE_NAME);
+	valid = valid && ppchat_send_frame(client->socket, FRAME_TYPE_FILE_BEGIN, 0, begin_payload, begin_payload_size, NULL);
+
+	char resume_payload[FileResumeSchema::size];
+	valid = valid && receive_protocol_frame(client, FRAME_TYPE_FILE_RESUME, resume_payload, sizeof(resume_payload)) == (int) sizeof(resume_payload);
+	valid = valid && FileResumeSchema::decode(resume_payload).first_chunk == 0;
+
+	uint64_t start_timestamp = get_timestamp();
+	uint32_t chunks_count = ppchat_get_file_chunks_count(BENCH_PROTOCOL_FILE_SIZE);
+	for (uint32_t index = 0; index < chunks_count && valid; index += 1) {
+		char *chunk = data + (uint64_t) index * PPCHAT_FILE_CHUNK_SIZE;
+		int chunk_size = (int) ppchat_get_file_chunk_size(BENCH_PROTOCOL_FILE_SIZE, index);
+
+		FileChunkHeader chunk_header;
+		chunk_header.index = index;
+		chunk_header.crc = ppchat_crc32c(0, chunk, chunk_size);
+
+		char headers[PPCHAT_FRAME_HEADER_SIZE + PPCHAT_FILE_CHUNK_HEADER_SIZE];
+		ppchat_encode_frame_header(headers, FRAME_TYPE_FILE_DATA, FRAME_FLAG_STREAMED, (uint32_t) (PPCHAT_FILE_CHUNK_HEADER_SIZE + chunk_size));
+		ppchat_encode_file_chunk_header(headers + PPCHAT_FRAME_HEADER_SIZE, chunk_header);
+
+		valid = send_protocol_bytes(client, headers, PPCHAT_FRAME_HEADER_SIZE);
+		Sleep(BENCH_PROTOCOL_SPLIT_MS);
+		valid = valid && send_protocol_bytes(client, headers + PPCHAT_FRAME_HEADER_SIZE, PPCHAT_FILE_CHUNK_HEADER_SIZE);
+		valid = valid && send_protocol_bytes(client, chunk, chunk_size);
+	}
+
+	// Notice of the finished file says how much of it had to be copied.
+	char notice[512];
+	unsigned long long copied_size = BENCH_PROTOCOL_FILE_SIZE;
+	bool finished = false;
+	while (valid && !finished) {
+		int notice_size = receive_protocol_frame(client, FRAME_TYPE_CHAT_MESSAGE, notice, sizeof(notice) - 1);
+		valid = notice_size >= 0;
+		notice[max(0, min(notice_size, (int) sizeof(notice) - 1))] = '\0';
+
+		const char *copied = strstr(notice, "MB/s, ");
+		finished = copied && sscanf(copied, "MB/s, %llu", &copied_size) == 1;
+	}
+
+	double seconds = get_seconds_elapsed(start_timestamp, get_timestamp());
+	close_protocol_client(client);
+
+	// Server lets go of the file right after the notice.
+	FILE *file = NULL;
+	for (int attempt = 0; attempt < 40 && valid && !file; attempt += 1) {
+		file = fopen(path, "rb");
+		if (!file)
+			Sleep(BENCH_PROTOCOL_SPLIT_MS);
+	}
+
+	valid = valid && file && fread(received_data, 1, (size_t) BENCH_PROTOCOL_FILE_SIZE, file) == (size_t) BENCH_PROTOCOL_FILE_SIZE && fgetc(file) == EOF;
+	valid = valid && memcmp(received_data, data, (size_t) BENCH_PROTOCOL_FILE_SIZE) == 0;
+	if (file)
+		fclose(file);
+
+	// What shared a read with a chunk header went through the receive buffer, the rest
+	// has to have been received right into the file.
+	valid = valid && copied_size <= (unsigned long long) chunks_count * PPCHAT_RECEIVE_BUFFER_SIZE;
+
+	*out_megabytes_per_second = (double) BENCH_PROTOCOL_FILE_SIZE / seconds / (1024.0 * 1024.0);
+	*out_copied_size = copied_size;
+
+	DeleteFileA(path);
+	free(data);
+	free(received_data);
+	free(client);
+	return valid;
+}
+
+int bench_protocol(int arguments_count, char *arguments[]) {
+	char server_path[MAX_PATH];
+	get_server_path(arguments_count, arguments, 0, server_path, sizeof(server_path));
+
+	char command_line[2048];
+	snprintf(
+		command_line,
+		sizeof(command_line),
+		"\"%s\" -port %s -reactors 1 -no_history -idle_timeout 0 -handshake_timeout 0 -connection_rate 0 -message_rate 0 -byte_rate 0",
+		server_path,
+		BENCH_PROTOCOL_SERVER_PORT
+	);
+
+	ServerProcess server;
+	if (!start_server_process(command_line, &server) || !wait_for_server(BENCH_PROTOCOL_SERVER_PORT)) {
+		log_error("Couldn't start the server from '%s'.", server_path);
+		stop_server_process(&server);
+		return EXIT_FAILURE;
+	}
+
+	log("Protocol: frames sent in the pieces that are hard to handle, to the server at '%s'.", server_path);
+	log("%-44s %8s", "Check", "Result");
+
+	double megabytes_per_second = 0.0;
+	uint64_t copied_size = 0;
+	bool split_file_valid = check_split_file_chunks(&megabytes_per_second, &copied_size);
+	log("%-44s %8s", "file with frame headers read on their own", (split_file_valid) ? "ok" : "FAILED");
+
+	bool streamed_message_valid = check_refused_message(true, 1024);
+	log("%-44s %8s", "streamed message disconnected", (streamed_message_valid) ? "ok" : "FAILED");
+
+	bool large_message_valid = check_refused_message(false, PPCHAT_FRAME_MAX_PAYLOAD_SIZE + 1);
+	log("%-44s %8s", "message larger than a frame disconnected", (large_message_valid) ? "ok" : "FAILED");
+
+	bool message_at_limit_valid = check_message_at_limit();
+	log("%-44s %8s", "message at the limit with the sender's address", (message_at_limit_valid) ? "ok" : "FAILED");
+
+	stop_server_process(&server);
+
+	log("File of %llu bytes in %d chunks: %.1f MB/s, %llu bytes copied.", BENCH_PROTOCOL_FILE_SIZE, BENCH_PROTOCOL_FILE_CHUNKS_COUNT, megabytes_per_second, copied_size);
+
+	bool all_valid = split_file_valid && streamed_message_valid && large_message_valid && message_at_limit_valid;
+	log("Checks: %s", (all_valid) ? "ok" : "FAILED");
+	return (all_valid) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void print_usage() {
+	char usage_message[8192];
+	snprintf(
+		usage_message,
+		sizeof(usage_message),
+		"Usage: ppchat-bench <benchmark> [arguments]\n"
+		"\n"
+		"\tNote:\n"
+		"\t<arg> - Required argument.\n"
+		"\t[arg] - Optional argument.\n"
+		"\n"
+		"\treactor [connections] [seconds] [message size]  -  Echo round trips per second and connections\n"
+		"\t                                                   held by thread-per-connection and reactor servers.\n"
+		"\t                                                   Defaults: 1000 connections, 10 seconds, 64 bytes.\n"
+		"\tengines [connections] [seconds] [message size]  -  Echo throughput, server system calls per message\n"
+		"\t                                                   and round trip percentiles of IOCP and RIO engines.\n"
+		"\t                                                   Defaults: 1000 connections, 10 seconds, 64 bytes.\n"
+		"\tfanout [receivers] [seconds] [message size]     -  Messages per second one sender reaches all receivers with,\n"
+		"\t                                                   and bytes copied per message, copying vs sharing frames.\n"
+		"\t                                                   Defaults: 1000 and 10000 receivers, 10 seconds, 64 bytes.\n"
+		"\tring [millions of items]                        -  SPSC and MPSC ring queue throughput against a locked queue,\n"
+		"\t                                                   with single and batch dequeue, spinning and blocking consumer.\n"
+		"\t                                                   Default: 10 million items.\n"
+		"\tlog [calls per thread]                          -  Nanoseconds per log call: the old format-and-print path, synchronous\n"
+		"\t                                                   and asynchronous backend, in bursts and back to back.\n"
+		"\t                                                   Default: 1000000 calls.\n"
+		"\tcrc [megabytes]                                 -  CRC-32C throughput of file chunks: bytewise table, slicing-by-8\n"
+		"\t                                                   and SSE4.2 instruction. Default: 256 MB.\n"
+		"\tpool [connections] [cycles]                     -  Nanoseconds to replace a connection and its receive buffer,\n"
+		"\t                                                   malloc against the connection pool and the buffer slab.\n"
+		"\t                                                   Defaults: 10000 connections, 10000000 cycles.\n"
+		"\taccept [reactors] [seconds] [client threads]    -  Connections per second accepted and served by one reactor and by\n"
+		"\t                                                   one listening reactor handing them out to several, pinned to cores.\n"
+		"\t                                                   Defaults: one reactor per core, 5 seconds, two client threads per core.\n"
+		"\tbackpressure [frames] [frame size] [limit KB]   -  Peak send queue, dropped frames and what arrives when a client stops\n"
+		"\t                                                   reading: no limit, dropping and disconnecting over the limit.\n"
+		"\t                                                   Defaults: 20000 frames, 1024 bytes, 1024 KB.\n"
+		"\thistory [messages] [message size] [threads]     -  Messages per second appended to the history store and append latency,\n"
+		"\t                                                   one thread and several, and microseconds to replay 100 messages.\n"
+		"\t                                                   Defaults: 200000 messages per thread, 64 bytes, one thread per core.\n"
+		"\tsearch [messages] [queries]                     -  Messages per second the search index follows the history with, and\n"
+		"\t                                                   query latency for common, rare and room-limited words.\n"
+		"\t                                                   Defaults: 1000000 messages, 1000 queries of each kind.\n"
+		"\tcompress [megabytes] [threads]                  -  Compression ratio against compress and decompress MB/s for chat,\n"
+		"\t                                                   logs and random data, in messages and file chunks, one thread and several.\n"
+		"\t                                                   Defaults: 64 MB of each, one thread per core.\n"
+		"\tbytes [megabytes]                               -  Byte order conversion of 16, 32 and 64-bit fields and of structs:\n"
+		"\t                                                   a byte at a time, bswap, SSSE3 and AVX2 shuffles. Default: 64 MB.\n"
+		"\tschema [millions of messages]                   -  Nanoseconds to encode and decode frame headers and file messages,\n"
+		"\t                                                   written by hand against generated from their schemas. Default: 10 million.\n"
+		"\ttimers [timers] [re-arms]                       -  Nanoseconds to arm, push back and cancel connection timeouts and time to\n"
+		"\t                                                   run them out, timing wheel against a binary heap. Defaults: 100000, 10.\n"
+		"\tratelimit [millions of checks]                  -  Nanoseconds per rate limit check by address, few addresses and more than\n"
+		"\t                                                   the table holds, and whether a flood gets the rate. Default: 10 million.\n"
+		"\tregistry [connections] [millions of churns]     -  Nanoseconds to add, replace and look up connections by handle, and to scan\n"
+		"\t                                                   their activity packed against in whole records. Defaults: 100000, 10.\n"
+		"\tfederation [nodes] [clients] [seconds] [server] -  Deliveries per second of rooms spread over 1 to N server processes\n"
+		"\t                                                   linked full mesh, and whether every member got every message in order.\n"
+		"\t                                                   Defaults: 4 nodes, 200 clients per node, 5 seconds, built server.\n"
+		"\ttopics [subscribers] [publishes]                -  Nanoseconds to match a publish against 1 thousand to 1 million wildcard\n"
+		"\t                                                   subscriptions, trie against scanning them all. Defaults: 1000000, 1000000.\n"
+		"\tconnect [connects]                              -  Milliseconds to connect to a name whose IPv6 address is refused, trying its\n"
+		"\t                                                   addresses one after another against racing them. Default: 10 connects.\n"
+		"\tprotocol [server]                               -  Whether a server process handles frames that arrive in awkward pieces: file\n"
+		"\t                                                   chunks whose frame headers are read on their own, messages that are streamed\n"
+		"\t                                                   or too large, and ones that only just fit with the sender's address in front.\n"
+		"\t                                                   Reports file MB/s and bytes copied.\n"
+		"\t                                                   Default: built server."
+	);
+
+	log("%s", usage_message);
+}
+
+int main(int arguments_count, char *arguments[]) {
+	if (arguments_count < 2) {
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	const char *benchmark = arguments[1];
+	int benchmark_arguments_count = arguments_count - 2;
+	char **benchmark_arguments = arguments + 2;
+
+	if (strcmp(benchmark, "reactor") == 0)
+		return bench_reactor(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "engines") == 0)
+		return bench_engines(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "fanout") == 0)
+		return bench_fanout(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "ring") == 0)
+		return bench_ring(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "log") == 0)
+		return bench_log(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "crc") == 0)
+		return bench_crc(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "pool") == 0)
+		return bench_pool(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "accept") == 0)
+		return bench_accept(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "backpressure") == 0)
+		return bench_backpressure(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "history") == 0)
+		return bench_history(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "search") == 0)
+		return bench_search(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "compress") == 0)
+		return bench_compress(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "bytes") == 0)
+		return bench_bytes(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "schema") == 0)
+		return bench_schema(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "timers") == 0)
+		return bench_timers(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "ratelimit") == 0)
+		return bench_rate_limit(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "registry") == 0)
+		return bench_registry(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "federation") == 0)
+		return bench_federation(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "topics") == 0)
+		return bench_topics(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "connect") == 0)
+		return bench_connect(benchmark_arguments_count, benchmark_arguments);
+
+	if (strcmp(benchmark, "protocol") == 0)
+		return bench_protocol(benchmark_arguments_count, benchmark_arguments);
+
+	log("Unknown benchmark '%s'.", benchmark);
+	print_usage();
+	return EXIT_FAILURE;
+}
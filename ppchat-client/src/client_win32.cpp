@@ -1,12 +1,19 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "../../ppchat-shared/include/ppchat_shared.h"
+#include "../../ppchat-shared/include/ppchat_framing.h"
+#include "../../ppchat-shared/include/ppchat_ring.h"
+#include "../../ppchat-shared/include/ppchat_reactor.h"
+#include "../../ppchat-shared/include/ppchat_stats.h"
+#include "../../ppchat-shared/include/ppchat_transfer.h"
+#include "../../ppchat-shared/include/ppchat_compression.h"
 
 #include <stdlib.h>
 
 const char *DEFAULT_FILE_SAVE_FOLDER = "D:/Downloads/";
 
-InputQueue g_input_queue;
+// Console lines, queued as the keys come in or by the input thread, and handled by the main loop.
+RingQueue g_input_queue;
 Socket g_client_socket = { INVALID_SOCKET };
 
 char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
@@ -18,8 +25,56 @@ time_t g_start_time;
 
 bool g_quit = false;
 
-// Here `message` means a complete TCP message
-// that can consist of multiple packets.
+// Server answers the start of a file with the chunk to send from.
+const DWORD FILE_RESUME_TIMEOUT_MS = 10000;
+bool g_file_resume_received = false;
+uint32_t g_file_resume_chunk = 0;
+
+// Features the server has agreed on, once it answers the options sent on connect. Until
+// then everything goes out as it is.
+uint32_t g_server_features = 0;
+
+// The server is pinged once it has been quiet for the keepalive interval, and given up on
+// once it has been quiet for the keepalive timeout, so that a connection that died without
+// a word (a pulled cable, a sleeping laptop) doesn't look alive forever. The main loop
+// wakes up for it only when one of them is due.
+const DWORD CLIENT_KEEPALIVE_INTERVAL_MS = 20 * 1000;
+const DWORD CLIENT_KEEPALIVE_TIMEOUT_MS = 60 * 1000;
+
+uint64_t g_last_receive_timestamp = 0;
+bool g_pong_requested = false;
+uint64_t g_last_ping_timestamp = 0;
+
+// Everything but reading a redirected stdin happens in the main loop. It waits on the
+// console, the receive from the server and the wake event at once, and handles whatever
+// is ready as soon as it is. With nothing to do, it sleeps until the next keepalive check,
+// or for good while disconnected.
+typedef struct ServerReceive {
+	WSAOVERLAPPED overlapped;   // `hEvent` is set once the receive is done.
+	char          buffer[PPCHAT_RECEIVE_BUFFER_SIZE];
+	bool          pending;
+	FrameDecoder  decoder;
+} ServerReceive;
+
+ServerReceive g_server_receive = { };
+
+HANDLE g_console_input = NULL;   // NULL when stdin isn't a console, the input thread reads it then.
+HANDLE g_wake_event = NULL;      // Set by the input thread once it has queued a line.
+
+// Line being typed. The console is read key by key, so that waiting for Enter doesn't block the loop.
+char g_console_line[PPCHAT_INPUT_QUEUE_ITEM_SIZE];
+int g_console_line_size = 0;
+
+// Keystroke to wire latency, from when the loop woke up to the Enter key of a line to
+// when the message it sends is handed to the socket, in nanoseconds.
+uint64_t g_input_timestamp = 0;
+Histogram g_keystroke_to_wire = { };
+
+// Messages `/history` asks for when no count is given.
+const int CLIENT_DEFAULT_HISTORY_COUNT = 20;
+
+// Here `message` means a single frame, no matter
+// how many reads it took to receive it.
 uint64_t g_total_messages_received = 0;
 uint64_t g_total_messages_sent = 0;
 
@@ -36,103 +91,336 @@ DWORD WINAPI handle_incoming_console_input(void *data) {
 
 			g_quit = true;
 			log_error("Couldn't read from stdin.");
+			SetEvent(g_wake_event);
 			return EXIT_FAILURE;
 		}
 
-		EnterCriticalSection(&g_input_queue.critical_section);
-		queue_input(&g_input_queue, input_buffer);
-		LeaveCriticalSection(&g_input_queue.critical_section);
+		bool queued = ppchat_ring_enqueue(&g_input_queue, input_buffer);
+		if (!queued)
+			log_warning("Too many commands are waiting to be processed, input has been dropped.");
+
+		SetEvent(g_wake_event);
 	}
 
 	return EXIT_SUCCESS;
 }
 
-bool get_next_console_input(char **out_input) {
-	EnterCriticalSection(&g_input_queue.critical_section);
-	bool got_input = get_next_queue(&g_input_queue, out_input);
-	LeaveCriticalSection(&g_input_queue.critical_section);
+// Posts the next receive from the server, which the main loop waits for along with the console.
+bool start_server_receive(int *out_error) {
+	WSAResetEvent(g_server_receive.overlapped.hEvent);
+
+	WSABUF buffer;
+	buffer.buf = g_server_receive.buffer;
+	buffer.len = sizeof(g_server_receive.buffer);
+
+	DWORD flags = 0;
+	int receive_result = WSARecv(
+		/* Socket                 */ g_client_socket.handle,
+		/* Buffers                */ &buffer,
+		/* Buffers count          */ 1,
+		/* Bytes received         */ NULL,
+		/* Flags                  */ &flags,
+		/* Overlapped             */ &g_server_receive.overlapped,
+		/* Completion routine     */ NULL
+	);
+
+	// Done right away or not, the event is set once it is.
+	int error = (receive_result == SOCKET_ERROR) ? get_last_socket_error() : 0;
+	if (error != 0 && error != WSA_IO_PENDING) {
+		if (out_error)
+			*out_error = error;
+
+		return false;
+	}
 
-	return got_input;
+	g_server_receive.pending = true;
+	return true;
 }
 
-DWORD CALLBACK listen_for_incoming_network_data(void *context) {
-	SocketContext *ctx = static_cast<SocketContext *>(context);
+// Once the socket is closed, waits for the receive closing it has cancelled, so that the
+// next connection can reuse the buffer, and forgets about the server.
+void finish_server_receive() {
+	if (g_server_receive.pending)
+		WaitForSingleObject(g_server_receive.overlapped.hEvent, INFINITE);
 
-	if (ctx->socket->handle == INVALID_SOCKET)
-		return EXIT_FAILURE;
+	g_server_receive.pending = false;
+	ppchat_frame_decoder_destroy(&g_server_receive.decoder);
 
-	int bytes_received;
-	do {
-		char receive_buffer[PPCHAT_RECEIVE_BUFFER_SIZE];
-		size_t receive_buffer_size = sizeof(receive_buffer);
-		Socket socket = *ctx->socket;
-		bytes_received = ppchat_receive(*ctx->socket, receive_buffer, (int) (receive_buffer_size - 1), NULL);
-		if (bytes_received == SOCKET_ERROR) {
-		
-			/* An error occured while receiving network data. */
-		
-			int error = get_last_socket_error();
-			switch (error) {
-				case WSAECONNRESET: {
-					log("Connection with '%s' has been abruptly closed by remote peer.", ctx->client_ip);
-					break;
-				};
-				case WSAECONNABORTED: {
-					log("Connection with '%s' has been aborted by a local software problem.", ctx->client_ip);
-					break;
-				};
-				case WSAEINTR: {
-					// The socket has been shut down and any further operations
-					// are cancelled.
-					continue;
-				}
-				default: {
-					log_error("Couldn't receive network data. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-				};
-			}
+	memset(g_connected_server_ip, 0, sizeof(g_connected_server_ip));
+	memset(g_connected_server_port, 0, sizeof(g_connected_server_port));
+}
 
-			int disconnect_error;
-			bool disconnected = ppchat_disconnect(&socket, SD_SEND, &disconnect_error);
-			if (!disconnected) {
-				log_error("Couldn't disconnect from '%s'. Error: %d - %s", ctx->client_ip, disconnect_error, get_error_description(disconnect_error, g_error_message, sizeof(g_error_message)));
-			}
+void disconnect_after_receive() {
+	int disconnect_error;
+	bool disconnected = ppchat_disconnect(&g_client_socket, SD_SEND, &disconnect_error);
+	if (!disconnected) {
+		log_error("Couldn't disconnect from '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, disconnect_error, get_error_description(disconnect_error, g_error_message, sizeof(g_error_message)));
+	}
 
-		} else if (bytes_received == 0) {
-		
-			/* Connection was gratefully closed. */
-		
-			log("Connection with '%s' has been closed.", ctx->client_ip);
+	finish_server_receive();
+}
 
-			int disconnect_error;
-			bool disconnected = ppchat_disconnect(&socket, SD_SEND, &disconnect_error);
-			if (!disconnected) {
-				log_error("Couldn't disconnect from '%s'. Error: %d - %s", ctx->client_ip, disconnect_error, get_error_description(disconnect_error, g_error_message, sizeof(g_error_message)));
-			}
+void handle_server_frame(Frame *frame) {
+	int size = (int) frame->header.payload_size;
 
-		} else {
-		
-			/* Network data received. */
+	g_total_messages_received += 1;
+	g_total_message_bytes_received += size;
 
-			g_total_messages_received += 1;
-			g_total_message_bytes_received += bytes_received;
+	if (frame->header.type == FRAME_TYPE_OPTIONS && size == PPCHAT_OPTIONS_PAYLOAD_SIZE) {
+		ConnectionOptions options = ConnectionOptionsSchema::decode(frame->payload);
+		g_server_features = options.features;
+		return;
+	}
+
+	// Answered by `keep_connection_alive` before the loop goes back to waiting.
+	if (frame->header.type == FRAME_TYPE_PING) {
+		g_pong_requested = true;
+		return;
+	}
+
+	if (frame->header.type == FRAME_TYPE_PONG)
+		return;
+
+	if (frame->header.type == FRAME_TYPE_FILE_RESUME && size == FileResumeSchema::size) {
+		FileResume resume = FileResumeSchema::decode(frame->payload);
+		g_file_resume_chunk = resume.first_chunk;
+		g_file_resume_received = true;
+		return;
+	}
 
-			// Null-terminate string.
-			int last_character_index = clamp(0, (int) (receive_buffer_size - 1), bytes_received);
-			receive_buffer[last_character_index] = '\0';
+	// "<topic> <sender>: <message>".
+	if (frame->header.type == FRAME_TYPE_PUBLISH) {
+		const char *space = (const char *) memchr(frame->payload, ' ', size);
+		int topic_size = (space) ? (int) (space - frame->payload) : size;
+		int message_size = (space) ? size - topic_size - 1 : 0;
+		log("Received %d bytes on topic '%.*s'. Message: \"%.*s\"", message_size, topic_size, frame->payload, message_size, frame->payload + size - message_size);
+		return;
+	}
 
-			log("Received %d bytes from '%s'. Message: \"%s\"", bytes_received, ctx->client_ip, receive_buffer);
+	if (frame->header.type != FRAME_TYPE_CHAT_MESSAGE) {
+		log_warning("Received frame of unknown type %u from '%s', ignoring it.", frame->header.type, g_connected_server_ip);
+		return;
+	}
 
+	char *message = frame->payload;
+	int message_size = size;
+	if (frame->header.flags & FRAME_FLAG_COMPRESSED) {
+		message_size = ppchat_get_decompressed_size(frame->payload, size, PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+		message = (message_size > 0) ? (char *) malloc(message_size) : NULL;
+		if (!message || !ppchat_decompress_payload(frame->payload, size, message, message_size)) {
+			log_warning("Received a compressed message from '%s' that doesn't decompress, ignoring it.", g_connected_server_ip);
+			free(message);
+			return;
 		}
-	} while (bytes_received > 0 && !g_quit);
+	}
 
-	free(ctx);
+	if (frame->header.flags & FRAME_FLAG_HISTORY) {
+		log("History: \"%.*s\"", message_size, message);
+	} else {
+		log("Received %d bytes from '%s'. Message: \"%.*s\"", message_size, g_connected_server_ip, message_size, message);
+	}
 
-	return EXIT_SUCCESS;
+	if (message != frame->payload)
+		free(message);
 }
 
-void poll_console_input() {
-	char *input = NULL;
-	while (!g_quit && get_next_console_input(&input)) {
+// Called once the main loop sees the receive done.
+void handle_server_receive() {
+	g_server_receive.pending = false;
+
+	DWORD bytes_received = 0;
+	DWORD flags = 0;
+	if (!WSAGetOverlappedResult(g_client_socket.handle, &g_server_receive.overlapped, &bytes_received, FALSE, &flags)) {
+
+		/* An error occured while receiving network data. */
+
+		int error = get_last_socket_error();
+		switch (error) {
+			case WSAECONNRESET: {
+				log("Connection with '%s' has been abruptly closed by remote peer.", g_connected_server_ip);
+				break;
+			};
+			case WSAECONNABORTED: {
+				log("Connection with '%s' has been aborted by a local software problem.", g_connected_server_ip);
+				break;
+			};
+			default: {
+				log_error("Couldn't receive network data. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			};
+		}
+
+		disconnect_after_receive();
+		return;
+	}
+
+	if (bytes_received == 0) {
+
+		/* Connection was gratefully closed. */
+
+		log("Connection with '%s' has been closed.", g_connected_server_ip);
+		disconnect_after_receive();
+		return;
+	}
+
+	/* Network data received. */
+
+	g_last_receive_timestamp = ppchat_get_timestamp();
+
+	FrameDecoder *decoder = &g_server_receive.decoder;
+	ppchat_frame_decoder_feed(decoder, g_server_receive.buffer, (int) bytes_received);
+
+	Frame frame;
+	while (ppchat_frame_decoder_next(decoder, &frame))
+		handle_server_frame(&frame);
+
+	if (decoder->error != FRAME_DECODER_ERROR_NONE) {
+		log_error("Received malformed data from '%s': %s Disconnecting.", g_connected_server_ip, ppchat_frame_decoder_error_description(decoder->error));
+		disconnect_after_receive();
+		return;
+	}
+
+	int error = 0;
+	if (!start_server_receive(&error)) {
+		log_error("Couldn't receive from '%s'. Error: %d - %s", g_connected_server_ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		disconnect_after_receive();
+	}
+}
+
+// Handles receives until the server answers the start of a file, or gives up after `timeout_ms`.
+bool wait_for_file_resume(DWORD timeout_ms) {
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	while (!g_file_resume_received && g_server_receive.pending) {
+		uint64_t waited_ms = ppchat_timestamp_to_milliseconds(ppchat_get_timestamp() - start_timestamp);
+		if (waited_ms >= timeout_ms)
+			break;
+
+		if (WaitForSingleObject(g_server_receive.overlapped.hEvent, (DWORD) (timeout_ms - waited_ms)) != WAIT_OBJECT_0)
+			break;
+
+		handle_server_receive();
+	}
+
+	return g_file_resume_received;
+}
+
+bool is_compression_agreed() {
+	return (g_server_features & PPCHAT_FEATURE_COMPRESSION) != 0;
+}
+
+bool send_chat_message(const char *message, int message_size, int *out_error) {
+	if (is_compression_agreed())
+		return ppchat_send_frame_compressed(g_client_socket, FRAME_TYPE_CHAT_MESSAGE, 0, message, message_size, out_error);
+
+	return ppchat_send_frame(g_client_socket, FRAME_TYPE_CHAT_MESSAGE, 0, message, message_size, out_error);
+}
+
+// Answers pings and pings the server when it has been quiet. Main thread only, like every other send.
+void keep_connection_alive() {
+	if (g_client_socket.handle == INVALID_SOCKET)
+		return;
+
+	int error = 0;
+	if (g_pong_requested && !ppchat_send_frame(g_client_socket, FRAME_TYPE_PONG, 0, NULL, 0, &error))
+		log_warning("Couldn't answer a ping from '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+
+	g_pong_requested = false;
+
+	uint64_t now = ppchat_get_timestamp();
+	uint64_t quiet_ms = ppchat_timestamp_to_milliseconds(now - g_last_receive_timestamp);
+	if (quiet_ms >= CLIENT_KEEPALIVE_TIMEOUT_MS) {
+		log("Server '%s:%s' hasn't sent anything in %llu seconds. Disconnecting.", g_connected_server_ip, g_connected_server_port, quiet_ms / 1000);
+
+		// Closing the socket cancels the receive that would never be done.
+		ppchat_close_socket(&g_client_socket);
+		finish_server_receive();
+		return;
+	}
+
+	if (quiet_ms < CLIENT_KEEPALIVE_INTERVAL_MS)
+		return;
+
+	if (g_last_ping_timestamp != 0 && ppchat_timestamp_to_milliseconds(now - g_last_ping_timestamp) < CLIENT_KEEPALIVE_INTERVAL_MS)
+		return;
+
+	g_last_ping_timestamp = now;
+	if (!ppchat_send_frame(g_client_socket, FRAME_TYPE_PING, 0, NULL, 0, &error))
+		log_warning("Couldn't ping '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+}
+
+// Queues a line the way the input thread does, new line character included.
+void queue_input_line(const char *line) {
+	bool queued = ppchat_ring_enqueue(&g_input_queue, line);
+	if (!queued)
+		log_warning("Too many commands are waiting to be processed, input has been dropped.");
+}
+
+// Reads the key presses waiting in the console, echoing them, and queues every line that
+// Enter finishes. Only called once the console is signaled, so it never blocks.
+void read_console_keys() {
+	INPUT_RECORD records[64];
+	DWORD records_count = 0;
+	if (!ReadConsoleInputA(g_console_input, records, sizeof(records) / sizeof(records[0]), &records_count)) {
+		int error = GetLastError();
+		log_error("Couldn't read from the console. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		g_quit = true;
+		return;
+	}
+
+	for (DWORD i = 0; i < records_count; i += 1) {
+		if (records[i].EventType != KEY_EVENT || !records[i].Event.KeyEvent.bKeyDown)
+			continue;
+
+		char character = records[i].Event.KeyEvent.uChar.AsciiChar;
+		for (WORD repeat = 0; repeat < records[i].Event.KeyEvent.wRepeatCount; repeat += 1) {
+			if (character == '\r') {
+				fputc('\n', stdout);
+				g_console_line[g_console_line_size] = '\n';
+				g_console_line[g_console_line_size + 1] = '\0';
+				queue_input_line(g_console_line);
+				g_console_line_size = 0;
+			} else if (character == '\b') {
+				if (g_console_line_size > 0) {
+					g_console_line_size -= 1;
+					fputs("\b \b", stdout);
+				}
+			} else if ((unsigned char) character >= ' ' && g_console_line_size < PPCHAT_INPUT_QUEUE_ITEM_SIZE - 2) {
+				// Room is left for the new line and the null character.
+				g_console_line[g_console_line_size] = character;
+				g_console_line_size += 1;
+				fputc(character, stdout);
+			}
+		}
+	}
+
+	fflush(stdout);
+}
+
+// Until the next keepalive check is due, INFINITE while disconnected.
+DWORD get_keepalive_wait_ms() {
+	if (g_client_socket.handle == INVALID_SOCKET)
+		return INFINITE;
+
+	if (g_pong_requested)
+		return 0;
+
+	uint64_t now = ppchat_get_timestamp();
+	int64_t quiet_ms = (int64_t) ppchat_timestamp_to_milliseconds(now - g_last_receive_timestamp);
+	int64_t ping_wait_ms = (int64_t) CLIENT_KEEPALIVE_INTERVAL_MS - quiet_ms;
+	if (g_last_ping_timestamp != 0)
+		ping_wait_ms = max(ping_wait_ms, (int64_t) CLIENT_KEEPALIVE_INTERVAL_MS - (int64_t) ppchat_timestamp_to_milliseconds(now - g_last_ping_timestamp));
+
+	int64_t wait_ms = min(ping_wait_ms, (int64_t) CLIENT_KEEPALIVE_TIMEOUT_MS - quiet_ms);
+	return (DWORD) max(wait_ms, (int64_t) 0);
+}
+
+// Keystroke to wire latency of a message or a publish that just went out.
+void record_keystroke_to_wire() {
+	ppchat_histogram_record(&g_keystroke_to_wire, ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - g_input_timestamp));
+}
+
+void handle_console_inputs(char inputs[][PPCHAT_INPUT_QUEUE_ITEM_SIZE], int inputs_count) {
+	for (int input_index = 0; !g_quit && input_index < inputs_count; input_index += 1) {
+		char *input = inputs[input_index];
 
 		size_t input_length = strlen(input);
 		if (input_length < 2)
@@ -176,19 +464,26 @@ void poll_console_input() {
 					memcpy(g_connected_server_ip, server_ip, strlen(server_ip));
 					memcpy(g_connected_server_port, server_port, strlen(server_port));
 
-					SocketContext *listen_context = (SocketContext *) calloc(1, sizeof(*listen_context));
-					listen_context->socket = &g_client_socket;
-					memcpy(listen_context->client_ip, server_ip, strlen(server_ip));
-
-					DWORD input_thread_id;
-					HANDLE input_thread = CreateThread(
-						/* Thread attributes   */ NULL,
-						/* Stack size          */ 0,
-						/* Calling procedure   */ listen_for_incoming_network_data,
-						/* Procedure argument  */ listen_context,
-						/* Creation flags      */ NULL,
-						/* Thread ID           */ &input_thread_id
-					);
+					g_last_receive_timestamp = ppchat_get_timestamp();
+					g_pong_requested = false;
+					g_last_ping_timestamp = 0;
+
+					// Servers that don't know about options ignore them, and never answer.
+					g_server_features = 0;
+					ConnectionOptions options;
+					options.features = PPCHAT_FEATURE_COMPRESSION;
+					char options_payload[PPCHAT_OPTIONS_PAYLOAD_SIZE];
+					ConnectionOptionsSchema::encode(options, options_payload);
+					int options_error = 0;
+					if (!ppchat_send_frame(g_client_socket, FRAME_TYPE_OPTIONS, 0, options_payload, sizeof(options_payload), &options_error))
+						log_warning("Couldn't send options to '%s:%s'. Error: %d - %s", server_ip, server_port, options_error, get_error_description(options_error, g_error_message, sizeof(g_error_message)));
+
+					ppchat_frame_decoder_init(&g_server_receive.decoder, 0);
+					int receive_error = 0;
+					if (!start_server_receive(&receive_error)) {
+						log_error("Couldn't receive from '%s:%s'. Error: %d - %s", server_ip, server_port, receive_error, get_error_description(receive_error, g_error_message, sizeof(g_error_message)));
+						disconnect_after_receive();
+					}
 				} else {
 					if (connection_error == 0) {
 						log("Couldn't connect to server '%s:%s'.", server_ip, server_port);
@@ -210,20 +505,205 @@ void poll_console_input() {
 				}
 
 				char *message = &input[6];
-				int bytes_sent = ppchat_send(g_client_socket, message, (int) strlen(message), NULL);
-				if (bytes_sent == SOCKET_ERROR) {
-					int error = get_last_socket_error();
+				int bytes_sent = (int) strlen(message);
+				int error = 0;
+				bool sent = send_chat_message(message, bytes_sent, &error);
+				if (!sent) {
 					exit_with_error("Couldn't send message to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
 				} else {
+					record_keystroke_to_wire();
 					g_total_messages_sent += 1;
 					g_total_message_bytes_sent += bytes_sent;
 
 					log("Sent message: \"%s\" (%d bytes).", message, bytes_sent);
 				}
 
+			} else if (strcmp(command, "/join") == 0) {
+
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				char *room_name = strtok_s(NULL, " ", &next_input_token);
+				if (!room_name) {
+					log("You didn't provide a room name. Use: \"/join <room>\".");
+					continue;
+				}
+
+				int error = 0;
+				bool sent = ppchat_send_frame(g_client_socket, FRAME_TYPE_JOIN_ROOM, 0, room_name, (int) strlen(room_name), &error);
+				if (!sent) {
+					exit_with_error("Couldn't send join request to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+				}
+
+			} else if (strcmp(command, "/history") == 0) {
+
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				char *count_argument = strtok_s(NULL, " ", &next_input_token);
+				int count = (count_argument) ? atoi(count_argument) : CLIENT_DEFAULT_HISTORY_COUNT;
+				if (count <= 0) {
+					log("Number of messages has to be positive. Use: \"/history [count]\".");
+					continue;
+				}
+
+				HistoryRequest request;
+				request.count = (uint32_t) count;
+				char request_payload[HistoryRequestSchema::size];
+				HistoryRequestSchema::encode(request, request_payload);
+				int error = 0;
+				bool sent = ppchat_send_frame(g_client_socket, FRAME_TYPE_HISTORY, 0, request_payload, sizeof(request_payload), &error);
+				if (!sent) {
+					exit_with_error("Couldn't send history request to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+				}
+
+			} else if (strcmp(command, "/search") == 0) {
+
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				// Everything after the command, the server looks for every word of it.
+				char *query = next_input_token;
+				while (query && isspace((unsigned char) *query))
+					query += 1;
+
+				if (!query || *query == '\0') {
+					log("You didn't provide any words to search for. Use: \"/search <words>\".");
+					continue;
+				}
+
+				int error = 0;
+				bool sent = ppchat_send_frame(g_client_socket, FRAME_TYPE_SEARCH, 0, query, (int) strlen(query), &error);
+				if (!sent) {
+					exit_with_error("Couldn't send search request to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+				}
+
+			} else if (strcmp(command, "/subscribe") == 0 ||
+			           strcmp(command, "/unsubscribe") == 0) {
+
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				bool subscribe = (strcmp(command, "/subscribe") == 0);
+				char *pattern = strtok_s(NULL, " ", &next_input_token);
+				if (!pattern) {
+					log("You didn't provide a topic pattern. Use: \"%s <pattern>\".", command);
+					continue;
+				}
+
+				int error = 0;
+				bool sent = ppchat_send_frame(g_client_socket, (subscribe) ? FRAME_TYPE_SUBSCRIBE : FRAME_TYPE_UNSUBSCRIBE, 0, pattern, (int) strlen(pattern), &error);
+				if (!sent) {
+					exit_with_error("Couldn't send %s request to '%s:%s'. Error: %d - %s", command + 1, g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+				}
+
+			} else if (strcmp(command, "/publish") == 0) {
+
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				// Everything after the command, "<topic> <message>".
+				char *publication = next_input_token;
+				while (publication && isspace((unsigned char) *publication))
+					publication += 1;
+
+				if (!publication || !strchr(publication, ' ')) {
+					log("You didn't provide a topic and a message. Use: \"/publish <topic> <message>\".");
+					continue;
+				}
+
+				int error = 0;
+				bool sent = ppchat_send_frame(g_client_socket, FRAME_TYPE_PUBLISH, 0, publication, (int) strlen(publication), &error);
+				if (!sent) {
+					exit_with_error("Couldn't send message to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+				}
+
+				record_keystroke_to_wire();
+
 			} else if (strcmp(command, "/send_file") == 0) {
 
-				log_error("Not implemented yet.");
+				if (g_client_socket.handle == INVALID_SOCKET) {
+					log("You are not connected to any server.");
+					continue;
+				}
+
+				// Everything after the command, paths can have spaces in them.
+				char *file_path = next_input_token;
+				while (file_path && isspace((unsigned char) *file_path))
+					file_path += 1;
+
+				if (!file_path || *file_path == '\0') {
+					log("You didn't provide a file path. Use: \"/send_file <filepath>\".");
+					continue;
+				}
+
+				FileSource source;
+				int error = 0;
+				if (!ppchat_file_source_open(&source, file_path, &error)) {
+					log_error("Couldn't open file '%s'. Error: %d - %s", file_path, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+					continue;
+				}
+
+				// Sent right from the system file cache, the console waits until it is done.
+				uint64_t start_timestamp = ppchat_get_timestamp();
+				uint64_t start_cpu_time = ppchat_get_process_cpu_time();
+
+				g_file_resume_received = false;
+				if (!ppchat_send_file_begin(g_client_socket, &source, &error)) {
+					log_error("Couldn't send file '%s' to '%s:%s'. Error: %d - %s", file_path, g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+					ppchat_file_source_close(&source);
+					continue;
+				}
+
+				if (!wait_for_file_resume(FILE_RESUME_TIMEOUT_MS)) {
+					log_error("Server '%s:%s' didn't accept file '%s'.", g_connected_server_ip, g_connected_server_port, file_path);
+					ppchat_file_source_close(&source);
+					continue;
+				}
+
+				uint32_t first_chunk = g_file_resume_chunk;
+				if (first_chunk > 0)
+					log("Server has %u of %u chunks of '%s' already, resuming.", min(first_chunk, source.chunks_count), source.chunks_count, source.name);
+
+				bool sent = ppchat_send_file_chunks(g_client_socket, &source, first_chunk, is_compression_agreed(), &error);
+
+				double seconds = (double) (ppchat_get_timestamp() - start_timestamp) / (double) ppchat_get_timestamp_frequency();
+				double cpu_seconds = (double) (ppchat_get_process_cpu_time() - start_cpu_time) / 1e9;
+
+				uint64_t first_offset = min((uint64_t) first_chunk * PPCHAT_FILE_CHUNK_SIZE, source.size);
+				uint64_t sent_size = source.size - first_offset;
+
+				if (!sent) {
+					log_error("Couldn't send file '%s' to '%s:%s'. Error: %d - %s", file_path, g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+					log("Connect again and send the same file to resume it.");
+				} else {
+					g_total_messages_sent += 1;
+					g_total_message_bytes_sent += source.sent_size;
+
+					log(
+						"Sent file '%s' (%llu of %llu bytes, %llu on the wire, %u chunks compressed) in %.2f s: %.1f MB/s, CPU %.1f%%.",
+						file_path,
+						sent_size,
+						source.size,
+						source.sent_size,
+						source.compressed_chunks_count,
+						seconds,
+						(seconds > 0.0) ? (double) sent_size / seconds / (1024.0 * 1024.0) : 0.0,
+						(seconds > 0.0) ? 100.0 * cpu_seconds / seconds : 0.0
+					);
+				}
+
+				ppchat_file_source_close(&source);
 
 			} else if (strcmp(command, "/disconnect") == 0) {
 
@@ -240,8 +720,7 @@ void poll_console_input() {
 				}
 
 				log("Disconnected from '%s:%s'.", g_connected_server_ip, g_connected_server_port);
-				memset(g_connected_server_ip, 0, sizeof(g_connected_server_ip));
-				memset(g_connected_server_port, 0, sizeof(g_connected_server_port));
+				finish_server_receive();
 
 			} else if (strcmp(command, "/shutdown") == 0 ||
 			           strcmp(command, "/quit") == 0) {
@@ -270,9 +749,10 @@ void poll_console_input() {
 					snprintf(
 						connection_string,
 						sizeof(connection_string),
-						"Currently connected to server '%s:%s'.",
+						"Currently connected to server '%s:%s', compression is %s.",
 						g_connected_server_ip,
-						g_connected_server_port
+						g_connected_server_port,
+						(is_compression_agreed()) ? "on" : "off"
 					);
 				} else {
 					strcpy(connection_string, "Corrently not connected to any server.");
@@ -290,6 +770,10 @@ void poll_console_input() {
 					"\tBytes:\n"
 					"\t\t   received: %llu\n"
 					"\t\t       sent: %llu\n"
+					"\tKeystroke to wire, of %llu messages:\n"
+					"\t\t        p50: %.1f us\n"
+					"\t\t        p99: %.1f us\n"
+					"\t\t        max: %.1f us\n"
 					"%s",
 					start_time_string,
 					running_time_string,
@@ -297,6 +781,10 @@ void poll_console_input() {
 					g_total_messages_sent,
 					g_total_message_bytes_received,
 					g_total_message_bytes_sent,
+					g_keystroke_to_wire.total_count,
+					(double) ppchat_histogram_get_percentile(&g_keystroke_to_wire, 50.0) / 1000.0,
+					(double) ppchat_histogram_get_percentile(&g_keystroke_to_wire, 99.0) / 1000.0,
+					(double) g_keystroke_to_wire.max_value / 1000.0,
 					connection_string
 				);
 
@@ -317,7 +805,16 @@ void poll_console_input() {
 					"\t/shutdown, /quit       -  Shuts down the client.\n"
 					"\t/status                -  Prints runtime information.\n"
 					"\t/connect <ip> [port]   -  Connects to specified server.\n"
-					"\t/send <message>        -  Sends message to connected server.\n"
+					"\t/send <message>        -  Sends message to everyone in your room.\n"
+					"\t/join <room>           -  Leaves current room and joins (or creates) another one.\n"
+					"\t                          Everyone starts in room 'lobby'.\n"
+					"\t/history [count]       -  Shows the last messages of your room (default 20).\n"
+					"\t/search <words>        -  Shows the newest messages of your room that have every word in them.\n"
+					"\t/subscribe <pattern>   -  Subscribes to topics like 'ops.alerts.disk'. Any level of the pattern\n"
+					"\t                          can be '*' for any one level, and the last one '#' for any levels.\n"
+					"\t/unsubscribe <pattern> -  Unsubscribes from a pattern you subscribed to.\n"
+					"\t/publish <topic> <message>\n"
+					"\t                       -  Sends message to everyone subscribed to a pattern the topic matches.\n"
 					"\t/send_file <filepath>  -  Sends file to connected server.\n"
 					"\t/disconenct            -  Disconnects from connected server.\n"
 					"\t/help                  -  Prints help message."
@@ -340,11 +837,16 @@ void poll_console_input() {
 				continue;
 			}
 
-			int bytes_sent = ppchat_send(g_client_socket, input, (int) input_length, NULL);
-			if (bytes_sent == SOCKET_ERROR) {
-				int error = get_last_socket_error();
+			int bytes_sent = (int) strlen(input);
+			int error = 0;
+			bool sent = send_chat_message(input, bytes_sent, &error);
+			if (!sent) {
 				exit_with_error("Couldn't send message to '%s:%s'. Error: %d - %s", g_connected_server_ip, g_connected_server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
 			} else {
+				record_keystroke_to_wire();
+				g_total_messages_sent += 1;
+				g_total_message_bytes_sent += bytes_sent;
+
 				log("Sent message: \"%s\" (%d bytes).", input, bytes_sent);
 			}
 
@@ -352,19 +854,537 @@ void poll_console_input() {
 	}
 }
 
-int main(int arguments_count, char *arguments[]) {
-	g_input_queue = create_input_queue(PPCHAT_INPUT_QUEUE_MAX_ITEMS, PPCHAT_INPUT_QUEUE_ITEM_SIZE);
-
-	DWORD input_thread_id;
-	HANDLE input_thread = CreateThread(
-		/* Thread attributes   */ NULL,
-		/* Stack size          */ 0,
-		/* Calling procedure   */ handle_incoming_console_input,
-		/* Procedure argument  */ NULL,
-		/* Creation flags      */ NULL,
-		/* Thread ID           */ &input_thread_id
+// Handles every line queued so far, a batch at a time. Lines that came in together (a paste,
+// a piped burst) only set the wake event once, so none of them can be left for later.
+void poll_console_input() {
+	const int max_inputs_count = 8;
+	char inputs[max_inputs_count][PPCHAT_INPUT_QUEUE_ITEM_SIZE];
+	int inputs_count = max_inputs_count;
+	while (!g_quit && inputs_count == max_inputs_count) {
+		inputs_count = ppchat_ring_dequeue_batch(&g_input_queue, inputs, max_inputs_count);
+		handle_console_inputs(inputs, inputs_count);
+	}
+}
+
+/* Load generator: headless mode that drives the server and measures round trips through echo back. */
+
+// Goes in front of every message, the rest of it is filler.
+typedef struct LoadMessageHeader {
+	uint32_t magic;
+	uint32_t connection_index;
+	uint64_t sequence;
+	uint64_t scheduled_timestamp;   // When the message was due, `ppchat_get_timestamp` ticks.
+	uint64_t sent_timestamp;        // When it actually went out.
+} LoadMessageHeader;
+
+const uint32_t LOAD_MESSAGE_MAGIC = 0x4C484350; // "PCHL"
+const int LOAD_DEFAULT_CONNECTIONS_COUNT = 10;
+const int LOAD_DEFAULT_MESSAGE_SIZE = 64;
+const int LOAD_DEFAULT_SECONDS = 10;
+const int LOAD_DRAIN_SECONDS = 2;
+
+typedef enum LoadMode {
+	LOAD_MODE_CLOSED_LOOP,   // One message in flight per connection, next one goes right after the echo.
+	LOAD_MODE_FIXED_RATE,    // One message in flight per connection, but no sooner than the schedule allows.
+	LOAD_MODE_OPEN_LOOP      // Messages go out on schedule, whether earlier ones came back or not.
+} LoadMode;
+
+typedef struct LoadOptions {
+	const char *server_ip;
+	const char *server_port;
+	int         connections_count;
+	int         message_size;
+	int         messages_per_second;   // All connections together. 0 - as fast as echoes come back.
+	bool        open_loop;
+	int         seconds;
+} LoadOptions;
+
+typedef struct LoadConnection {
+	Socket          socket;
+	int             index;
+
+	// Sender thread only.
+	uint64_t        next_send_timestamp;
+	uint64_t        sent_count;
+	bool            send_failed;
+
+	// Reactor thread only, besides `echoed_count` that the sender polls.
+	FrameDecoder    decoder;
+	volatile LONG64 echoed_count;
+	volatile bool   closed;
+} LoadConnection;
+
+typedef struct LoadGenerator {
+	LoadOptions     options;
+	LoadMode        mode;
+	Reactor         reactor;
+	LoadConnection *connections;
+	int             connections_count;
+
+	// Ticks between two messages of the same connection, 0 in closed loop.
+	uint64_t        send_interval;
+	uint64_t        stop_timestamp;
+
+	// Written by the reactor thread, read once it has stopped.
+	uint64_t        unexpected_frames_count;
+	Histogram       measured_round_trips;    // From the actual send, nanoseconds.
+	Histogram       corrected_round_trips;   // Accounting for messages the server's stalls held back.
+} LoadGenerator;
+
+const char *get_load_mode_name(LoadMode mode) {
+	switch (mode) {
+		case LOAD_MODE_CLOSED_LOOP: return "closed loop";
+		case LOAD_MODE_FIXED_RATE:  return "fixed rate";
+		case LOAD_MODE_OPEN_LOOP:   return "open loop";
+	}
+
+	return "unknown";
+}
+
+void record_load_round_trip(LoadGenerator *generator, LoadMessageHeader *header, uint64_t now) {
+	uint64_t measured = ppchat_timestamp_to_nanoseconds(now - header->sent_timestamp);
+	ppchat_histogram_record(&generator->measured_round_trips, measured);
+
+	switch (generator->mode) {
+		case LOAD_MODE_CLOSED_LOOP: {
+			// Nothing was promised about when messages go out, so there is nothing to correct.
+			ppchat_histogram_record(&generator->corrected_round_trips, measured);
+		} break;
+		case LOAD_MODE_FIXED_RATE: {
+			uint64_t interval = ppchat_timestamp_to_nanoseconds(generator->send_interval);
+			ppchat_histogram_record_corrected(&generator->corrected_round_trips, measured, interval);
+		} break;
+		case LOAD_MODE_OPEN_LOOP: {
+			// Waiting to be sent is part of the latency a user would see.
+			uint64_t corrected = ppchat_timestamp_to_nanoseconds(now - header->scheduled_timestamp);
+			ppchat_histogram_record(&generator->corrected_round_trips, corrected);
+		} break;
+	}
+}
+
+void load_on_receive(Connection *connection, char *data, int size, void *user_data) {
+	LoadGenerator *generator = static_cast<LoadGenerator *>(user_data);
+	LoadConnection *state = static_cast<LoadConnection *>(connection->user_data);
+	uint64_t now = ppchat_get_timestamp();
+
+	ppchat_frame_decoder_feed(&state->decoder, data, size);
+
+	Frame frame;
+	while (ppchat_frame_decoder_next(&state->decoder, &frame)) {
+		// Echoed payload is "<our address>: <message>", our message is at the end.
+		int payload_size = (int) frame.header.payload_size;
+		if (frame.header.type != FRAME_TYPE_CHAT_MESSAGE || payload_size < generator->options.message_size) {
+			generator->unexpected_frames_count += 1;
+			continue;
+		}
+
+		LoadMessageHeader header;
+		memcpy(&header, frame.payload + payload_size - generator->options.message_size, sizeof(header));
+		if (header.magic != LOAD_MESSAGE_MAGIC || header.connection_index != (uint32_t) state->index) {
+			// Server notices, like the one for joining a room.
+			generator->unexpected_frames_count += 1;
+			continue;
+		}
+
+		record_load_round_trip(generator, &header, now);
+		WriteRelease64(&state->echoed_count, state->echoed_count + 1);
+	}
+
+	if (state->decoder.error != FRAME_DECODER_ERROR_NONE) {
+		log_error("Received malformed data on load connection %d: %s", state->index, ppchat_frame_decoder_error_description(state->decoder.error));
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+	}
+}
+
+void load_on_close(Connection *connection, int error, void *user_data) {
+	(void) error;
+	(void) user_data;
+
+	// States are freed by `run_load_generator` after the reactor is gone.
+	LoadConnection *state = static_cast<LoadConnection *>(connection->user_data);
+	if (state)
+		state->closed = true;
+}
+
+DWORD CALLBACK run_load_reactor(void *context) {
+	Reactor *reactor = static_cast<Reactor *>(context);
+	ppchat_reactor_run(reactor);
+	return EXIT_SUCCESS;
+}
+
+bool send_load_message(LoadGenerator *generator, LoadConnection *state, char *message, uint64_t scheduled_timestamp) {
+	LoadMessageHeader header;
+	header.magic = LOAD_MESSAGE_MAGIC;
+	header.connection_index = (uint32_t) state->index;
+	header.sequence = state->sent_count;
+	header.scheduled_timestamp = scheduled_timestamp;
+	header.sent_timestamp = ppchat_get_timestamp();
+	memcpy(message, &header, sizeof(header));
+
+	// Sends are blocking. In open loop a full send buffer holds the schedule back,
+	// which then shows up in the latencies measured from it.
+	int error = 0;
+	if (!ppchat_send_frame(state->socket, FRAME_TYPE_CHAT_MESSAGE, 0, message, generator->options.message_size, &error)) {
+		log_error("Couldn't send on load connection %d. Error: %d - %s", state->index, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		state->send_failed = true;
+		return false;
+	}
+
+	state->sent_count += 1;
+	return true;
+}
+
+// Runs on the calling thread until the duration is over. Receives are left to the reactor thread.
+void send_load_messages(LoadGenerator *generator) {
+	char *message = (char *) malloc(generator->options.message_size);
+	memset(message, 'x', generator->options.message_size);
+
+	uint64_t one_millisecond = ppchat_get_timestamp_frequency() / 1000;
+
+	for (;;) {
+		uint64_t now = ppchat_get_timestamp();
+		if (now >= generator->stop_timestamp)
+			break;
+
+		bool sent_any = false;
+		uint64_t earliest_send_timestamp = generator->stop_timestamp;
+
+		for (int i = 0; i < generator->connections_count; i += 1) {
+			LoadConnection *state = &generator->connections[i];
+			if (state->send_failed || state->closed)
+				continue;
+
+			bool in_flight = state->sent_count != (uint64_t) ReadAcquire64(&state->echoed_count);
+			if (in_flight && generator->mode != LOAD_MODE_OPEN_LOOP)
+				continue;
+
+			if (generator->mode == LOAD_MODE_CLOSED_LOOP) {
+				sent_any = send_load_message(generator, state, message, now) || sent_any;
+				continue;
+			}
+
+			if (now < state->next_send_timestamp) {
+				earliest_send_timestamp = min(earliest_send_timestamp, state->next_send_timestamp);
+				continue;
+			}
+
+			uint64_t scheduled_timestamp = state->next_send_timestamp;
+			sent_any = send_load_message(generator, state, message, scheduled_timestamp) || sent_any;
+
+			// Open loop keeps to the schedule no matter what. Fixed rate doesn't try
+			// to catch up after a late echo, the correction accounts for that instead.
+			state->next_send_timestamp += generator->send_interval;
+			if (generator->mode == LOAD_MODE_FIXED_RATE)
+				state->next_send_timestamp = max(state->next_send_timestamp, now);
+
+			now = ppchat_get_timestamp();
+		}
+
+		if (sent_any)
+			continue;
+
+		// Sleep has a coarse granularity, only use it when there is time to spare.
+		if (generator->mode != LOAD_MODE_CLOSED_LOOP && earliest_send_timestamp - now > 2 * one_millisecond)
+			Sleep(1);
+		else
+			SwitchToThread();
+	}
+
+	free(message);
+}
+
+int run_load_generator(LoadOptions *options) {
+	if (options->message_size < (int) sizeof(LoadMessageHeader) || options->message_size > PPCHAT_FRAME_MAX_PAYLOAD_SIZE / 2) {
+		log_error("Message size has to be %d to %d bytes.", (int) sizeof(LoadMessageHeader), PPCHAT_FRAME_MAX_PAYLOAD_SIZE / 2);
+		return EXIT_FAILURE;
+	}
+
+	if (options->connections_count <= 0 || options->seconds <= 0 || options->messages_per_second < 0) {
+		log_error("Connections count and duration have to be positive, rate can't be negative.");
+		return EXIT_FAILURE;
+	}
+
+	LoadGenerator *generator = (LoadGenerator *) calloc(1, sizeof(*generator));
+	LoadConnection *connections = (LoadConnection *) calloc(options->connections_count, sizeof(*connections));
+	if (!generator || !connections) {
+		log_error("Couldn't allocate memory for %d load connections.", options->connections_count);
+		free(connections);
+		free(generator);
+		return EXIT_FAILURE;
+	}
+
+	generator->options = *options;
+	generator->connections = connections;
+	if (options->messages_per_second == 0)
+		generator->mode = LOAD_MODE_CLOSED_LOOP;
+	else
+		generator->mode = (options->open_loop) ? LOAD_MODE_OPEN_LOOP : LOAD_MODE_FIXED_RATE;
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_receive = load_on_receive;
+	callbacks.on_close = load_on_close;
+	callbacks.user_data = generator;
+
+	// Sockets from `ppchat_connect` aren't created for registered I/O, so IOCP it is.
+	int error = 0;
+	if (!ppchat_reactor_create(&generator->reactor, NULL, &callbacks, &error)) {
+		log_error("Couldn't create reactor. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		free(connections);
+		free(generator);
+		return EXIT_FAILURE;
+	}
+
+	// Every connection gets a room of its own, so the server echoes
+	// its messages back to it and to nobody else.
+	DWORD process_id = GetCurrentProcessId();
+	for (int i = 0; i < options->connections_count; i += 1) {
+		Socket socket = ppchat_connect(options->server_ip, options->server_port, &error);
+		if (socket.handle == INVALID_SOCKET) {
+			log_error("Couldn't connect load connection %d to %s:%s. Error: %d - %s", i, options->server_ip, options->server_port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			continue;
+		}
+
+		char room_name[64];
+		int room_name_size = snprintf(room_name, sizeof(room_name), "load-%lu-%d", process_id, i);
+		if (!ppchat_send_frame(socket, FRAME_TYPE_JOIN_ROOM, 0, room_name, room_name_size, &error)) {
+			log_error("Couldn't join a room on load connection %d. Error: %d - %s", i, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			ppchat_close_socket(&socket);
+			continue;
+		}
+
+		LoadConnection *state = &connections[generator->connections_count];
+		state->socket = socket;
+		state->index = generator->connections_count;
+		ppchat_frame_decoder_init(&state->decoder, 0);
+
+		Connection *connection = ppchat_reactor_add_socket(&generator->reactor, socket, &error);
+		if (!connection) {
+			// Reactor has closed the socket, so the server drops this member of its room.
+			log_error("Couldn't add load connection %d to reactor. Error: %d - %s", i, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			ppchat_frame_decoder_destroy(&state->decoder);
+			continue;
+		}
+
+		connection->user_data = state;
+		generator->connections_count += 1;
+	}
+
+	if (generator->connections_count == 0) {
+		log_error("No load connections could be established.");
+		ppchat_reactor_destroy(&generator->reactor);
+		free(connections);
+		free(generator);
+		return EXIT_FAILURE;
+	}
+
+	char rate_string[64];
+	if (generator->mode == LOAD_MODE_CLOSED_LOOP)
+		snprintf(rate_string, sizeof(rate_string), "as fast as echoes come back");
+	else
+		snprintf(rate_string, sizeof(rate_string), "%d messages/sec", options->messages_per_second);
+
+	log(
+		"Load: %d of %d connections to %s:%s, %d byte messages, %s, %s, %d seconds. Needs echo back enabled on the server.",
+		generator->connections_count,
+		options->connections_count,
+		options->server_ip,
+		options->server_port,
+		options->message_size,
+		get_load_mode_name(generator->mode),
+		rate_string,
+		options->seconds
+	);
+
+	uint64_t frequency = ppchat_get_timestamp_frequency();
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	generator->stop_timestamp = start_timestamp + (uint64_t) options->seconds * frequency;
+
+	// Spread connections over the interval instead of sending in bursts.
+	if (generator->mode != LOAD_MODE_CLOSED_LOOP) {
+		generator->send_interval = frequency * (uint64_t) generator->connections_count / (uint64_t) options->messages_per_second;
+		for (int i = 0; i < generator->connections_count; i += 1)
+			connections[i].next_send_timestamp = start_timestamp + generator->send_interval * (uint64_t) i / (uint64_t) generator->connections_count;
+	}
+
+	HANDLE reactor_thread = CreateThread(NULL, 0, run_load_reactor, &generator->reactor, NULL, NULL);
+	if (!reactor_thread) {
+		error = GetLastError();
+		log_error("Couldn't create reactor thread. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_destroy(&generator->reactor);
+		free(connections);
+		free(generator);
+		return EXIT_FAILURE;
+	}
+
+	send_load_messages(generator);
+	uint64_t sending_end_timestamp = ppchat_get_timestamp();
+
+	// Give the last messages a chance to come back.
+	uint64_t drain_end_timestamp = sending_end_timestamp + LOAD_DRAIN_SECONDS * frequency;
+	for (;;) {
+		uint64_t sent_count = 0;
+		uint64_t echoed_count = 0;
+		for (int i = 0; i < generator->connections_count; i += 1) {
+			sent_count += connections[i].sent_count;
+			echoed_count += (uint64_t) ReadAcquire64(&connections[i].echoed_count);
+		}
+
+		if (echoed_count >= sent_count || ppchat_get_timestamp() >= drain_end_timestamp)
+			break;
+
+		Sleep(1);
+	}
+
+	ppchat_reactor_stop(&generator->reactor);
+	WaitForSingleObject(reactor_thread, INFINITE);
+	CloseHandle(reactor_thread);
+
+	uint64_t sent_count = 0;
+	uint64_t echoed_count = 0;
+	int failed_connections_count = 0;
+	for (int i = 0; i < generator->connections_count; i += 1) {
+		sent_count += connections[i].sent_count;
+		echoed_count += (uint64_t) connections[i].echoed_count;
+		if (connections[i].send_failed || connections[i].closed)
+			failed_connections_count += 1;
+	}
+
+	double seconds = (double) (sending_end_timestamp - start_timestamp) / (double) frequency;
+	double bytes_per_message = (double) (PPCHAT_FRAME_HEADER_SIZE + options->message_size);
+
+	log(
+		"Sent %llu messages (%.0f/sec, %.2f MB/s), %llu echoed back, %llu missing, %d connections lost.",
+		sent_count,
+		(double) sent_count / seconds,
+		(double) sent_count * bytes_per_message / seconds / (1024.0 * 1024.0),
+		echoed_count,
+		sent_count - min(echoed_count, sent_count),
+		failed_connections_count
 	);
 
+	if (sent_count > 0 && echoed_count == 0)
+		log_warning("Nothing was echoed back. Type '/echo_back' on the server to enable echo back.");
+
+	log("%-24s %10s %10s %10s %10s %10s", "Round trip, us", "p50", "p99", "p99.9", "max", "samples");
+
+	struct {
+		const char *name;
+		Histogram  *histogram;
+	} distributions[] = {
+		{ "measured",  &generator->measured_round_trips  },
+		{ "corrected", &generator->corrected_round_trips },
+	};
+
+	for (int i = 0; i < (int) (sizeof(distributions) / sizeof(distributions[0])); i += 1) {
+		Histogram *histogram = distributions[i].histogram;
+		log(
+			"%-24s %10.1f %10.1f %10.1f %10.1f %10llu",
+			distributions[i].name,
+			(double) ppchat_histogram_get_percentile(histogram, 50.0) / 1000.0,
+			(double) ppchat_histogram_get_percentile(histogram, 99.0) / 1000.0,
+			(double) ppchat_histogram_get_percentile(histogram, 99.9) / 1000.0,
+			(double) histogram->max_value / 1000.0,
+			histogram->total_count
+		);
+	}
+
+	ppchat_reactor_destroy(&generator->reactor);
+	for (int i = 0; i < generator->connections_count; i += 1)
+		ppchat_frame_decoder_destroy(&connections[i].decoder);
+
+	free(connections);
+	free(generator);
+
+	return (echoed_count > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Usage: ppchat-client [-load <server ip> [-port <port>] [-connections <count>] [-size <bytes>]
+//                                          [-rate <messages per second>] [-open_loop] [-duration <seconds>]]
+bool parse_load_options(int arguments_count, char *arguments[], LoadOptions *out_options) {
+	LoadOptions options = { };
+	options.server_port = PPCHAT_DEFAULT_PORT;
+	options.connections_count = LOAD_DEFAULT_CONNECTIONS_COUNT;
+	options.message_size = LOAD_DEFAULT_MESSAGE_SIZE;
+	options.seconds = LOAD_DEFAULT_SECONDS;
+
+	for (int i = 1; i < arguments_count; i += 1) {
+		const char *argument = arguments[i];
+		bool has_value = i + 1 < arguments_count;
+
+		if (strcmp(argument, "-load") == 0 && has_value) {
+			options.server_ip = arguments[++i];
+		} else if (strcmp(argument, "-port") == 0 && has_value) {
+			options.server_port = arguments[++i];
+		} else if (strcmp(argument, "-connections") == 0 && has_value) {
+			options.connections_count = atoi(arguments[++i]);
+		} else if (strcmp(argument, "-size") == 0 && has_value) {
+			options.message_size = atoi(arguments[++i]);
+		} else if (strcmp(argument, "-rate") == 0 && has_value) {
+			options.messages_per_second = atoi(arguments[++i]);
+		} else if (strcmp(argument, "-duration") == 0 && has_value) {
+			options.seconds = atoi(arguments[++i]);
+		} else if (strcmp(argument, "-open_loop") == 0) {
+			options.open_loop = true;
+		} else {
+			log_error("Unknown argument '%s'.", argument);
+			return false;
+		}
+	}
+
+	*out_options = options;
+	return true;
+}
+
+int main(int arguments_count, char *arguments[]) {
+	if (arguments_count > 1) {
+		LoadOptions load_options;
+		if (!parse_load_options(arguments_count, arguments, &load_options) || !load_options.server_ip) {
+			log_error(
+				"Usage: ppchat-client [-load <server ip> [-port <port>] [-connections <count>] [-size <bytes>]\n"
+				"                     [-rate <messages per second>] [-open_loop] [-duration <seconds>]]\n"
+				"Without a rate connections send as fast as echoes come back. With a rate they keep one message\n"
+				"in flight, unless '-open_loop' is given. Defaults: %d connections, %d bytes, %d seconds.",
+				LOAD_DEFAULT_CONNECTIONS_COUNT,
+				LOAD_DEFAULT_MESSAGE_SIZE,
+				LOAD_DEFAULT_SECONDS
+			);
+			return EXIT_FAILURE;
+		}
+
+		return run_load_generator(&load_options);
+	}
+
+	if (!ppchat_ring_create(&g_input_queue, RING_QUEUE_MODE_SPSC, PPCHAT_INPUT_QUEUE_MAX_ITEMS, PPCHAT_INPUT_QUEUE_ITEM_SIZE))
+		exit_with_error("Couldn't allocate input queue.");
+
+	g_wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	g_server_receive.overlapped.hEvent = WSACreateEvent();
+	if (!g_wake_event || g_server_receive.overlapped.hEvent == WSA_INVALID_EVENT) {
+		int error = GetLastError();
+		exit_with_error("Couldn't create events of the main loop. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	}
+
+	// Key presses are only read as they come in when stdin is a console, anything else
+	// (a pipe, a file) can't be waited on and gets a thread that reads it line by line.
+	HANDLE standard_input = GetStdHandle(STD_INPUT_HANDLE);
+	DWORD console_mode = 0;
+	bool is_console = GetConsoleMode(standard_input, &console_mode) != 0;
+	if (is_console) {
+		// Ctrl+C still works, mouse and window events don't wake the loop up for nothing.
+		g_console_input = standard_input;
+		SetConsoleMode(g_console_input, ENABLE_PROCESSED_INPUT);
+	} else {
+		DWORD input_thread_id;
+		HANDLE input_thread = CreateThread(
+			/* Thread attributes   */ NULL,
+			/* Stack size          */ 0,
+			/* Calling procedure   */ handle_incoming_console_input,
+			/* Procedure argument  */ NULL,
+			/* Creation flags      */ NULL,
+			/* Thread ID           */ &input_thread_id
+		);
+	}
+
 	g_start_time = time(NULL);
 
 	// Print startup message.
@@ -378,14 +1398,44 @@ int main(int arguments_count, char *arguments[]) {
 	}
 
 	while (!g_quit) {
+		HANDLE events[3];
+		DWORD events_count = 0;
+		events[events_count++] = g_wake_event;
+		if (g_console_input)
+			events[events_count++] = g_console_input;
+		if (g_server_receive.pending)
+			events[events_count++] = g_server_receive.overlapped.hEvent;
+
+		DWORD wait_result = WaitForMultipleObjects(events_count, events, FALSE, get_keepalive_wait_ms());
+		if (wait_result == WAIT_FAILED) {
+			int error = GetLastError();
+			exit_with_error("Couldn't wait for input. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+
+		// Whatever else got ready in the meantime is handled right away too, input first.
+		g_input_timestamp = ppchat_get_timestamp();
+		if (g_console_input && WaitForSingleObject(g_console_input, 0) == WAIT_OBJECT_0)
+			read_console_keys();
+
 		poll_console_input();
-		Sleep(10);
+
+		if (g_server_receive.pending && WaitForSingleObject(g_server_receive.overlapped.hEvent, 0) == WAIT_OBJECT_0)
+			handle_server_receive();
+
+		keep_connection_alive();
 	}
 
-	if (g_client_socket.handle != INVALID_SOCKET)
+	if (g_client_socket.handle != INVALID_SOCKET) {
 		ppchat_close_socket(&g_client_socket);
+		finish_server_receive();
+	}
+
+	if (is_console)
+		SetConsoleMode(g_console_input, console_mode);
 
-	destroy_input_queue(&g_input_queue);
+	ppchat_ring_destroy(&g_input_queue);
+	WSACloseEvent(g_server_receive.overlapped.hEvent);
+	CloseHandle(g_wake_event);
 
 	log("Client have been shut down.");
 
@@ -1,8 +1,22 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "../../ppchat-shared/include/ppchat_shared.h"
+#include "../../ppchat-shared/include/ppchat_framing.h"
+#include "../../ppchat-shared/include/ppchat_reactor.h"
+#include "../../ppchat-shared/include/ppchat_stats.h"
+#include "../../ppchat-shared/include/ppchat_transfer.h"
+#include "../../ppchat-shared/include/ppchat_checksum.h"
+#include "../../ppchat-shared/include/ppchat_pool.h"
+#include "../../ppchat-shared/include/ppchat_history.h"
+#include "../../ppchat-shared/include/ppchat_search.h"
+#include "../../ppchat-shared/include/ppchat_compression.h"
+#include "../../ppchat-shared/include/ppchat_rate_limit.h"
+#include "../../ppchat-shared/include/ppchat_registry.h"
+#include "../../ppchat-shared/include/ppchat_federation.h"
+#include "../../ppchat-shared/include/ppchat_topics.h"
 
 #include <stdlib.h>
+#include <stdarg.h>
 
 char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
 
@@ -10,201 +24,2418 @@ bool g_quit = false;
 bool g_echo_back = false;
 time_t g_start_time;
 
-// Here `message` means a complete TCP message
-// that can consist of multiple packets.
-uint64_t g_total_messages_received = 0;
-uint64_t g_total_messages_sent = 0;
-uint64_t g_total_messages_echoed_back = 0;
+// Features the server agrees to when clients ask for them, see ppchat_compression.h.
+uint32_t g_features = PPCHAT_FEATURE_COMPRESSION;
+
+// Here `message` means a single frame, no matter
+// how many reads it took to receive it.
+typedef enum ServerCounter {
+	SERVER_COUNTER_MESSAGES_RECEIVED,
+	SERVER_COUNTER_MESSAGES_SENT,
+	SERVER_COUNTER_MESSAGES_ECHOED_BACK,
+	SERVER_COUNTER_MESSAGE_BYTES_RECEIVED,
+	SERVER_COUNTER_MESSAGE_BYTES_SENT,
+	SERVER_COUNTER_MESSAGE_BYTES_ECHOED_BACK,
+	SERVER_COUNTER_FRAMES_COMPRESSED,          // Encoded once, no matter how many members they went to.
+	SERVER_COUNTER_FRAMES_DECOMPRESSED,
+	SERVER_COUNTER_COMPRESSION_SAVED_BYTES,    // Both ways, for every member a compressed frame went to.
+	SERVER_COUNTER_HEARTBEATS_SENT,
+	SERVER_COUNTER_IDLE_TIMEOUTS,
+	SERVER_COUNTER_HANDSHAKE_TIMEOUTS,
+	SERVER_COUNTER_CONNECTIONS_THROTTLED,      // Times a connection went over its address's message or byte rate.
+	SERVER_COUNTER_THROTTLED_MILLISECONDS,     // Receives held back for, all connections together.
+	SERVER_COUNTER_PEER_MESSAGES_RELAYED,      // Once for every peer a message went to.
+	SERVER_COUNTER_PEER_BATCHES_SENT,
+	SERVER_COUNTER_PEER_MESSAGES_RECEIVED,
+	SERVER_COUNTER_PEER_DUPLICATES_DROPPED
+} ServerCounter;
+
+typedef enum ServerHistogram {
+	SERVER_HISTOGRAM_MESSAGE_SIZE,              // Payload bytes.
+	SERVER_HISTOGRAM_RECEIVE_TO_SEND_LATENCY,   // Nanoseconds from dequeuing the receive to queuing the sends.
+	SERVER_HISTOGRAM_CONNECTION_THROUGHPUT,     // Bytes per second both ways, recorded when a connection closes.
+	SERVER_HISTOGRAM_SEARCH_LATENCY             // Nanoseconds a search query took.
+} ServerHistogram;
+
+// Connections shorter than this tell little about throughput.
+const uint64_t THROUGHPUT_MIN_CONNECTION_SECONDS = 1;
+
+// Only used by the main thread to print `/status`.
+Histogram g_status_histogram;
+
+// Files sent by clients end up here, relative to the working directory.
+const char *const FILE_SAVE_FOLDER = "received_files";
+
+// Messages of every room are kept here, relative to the working directory.
+const char *const HISTORY_FOLDER = "history";
+
+HistoryStore g_history;
+bool g_history_enabled = true;
+
+// Indexes the history as it grows, kept with it and only there when it is.
+SearchIndex g_search;
+
+// Messages a search sends back, newest ones.
+const int SERVER_SEARCH_RESULTS_COUNT = 20;
+
+// Queries longer than that are cut.
+const int SERVER_SEARCH_QUERY_MAX_SIZE = 256;
+
+const int ROOM_NAME_MAX_SIZE = 64;
+const char *const DEFAULT_ROOM_NAME = "lobby";
+
+typedef struct Room {
+	char          name[ROOM_NAME_MAX_SIZE];
+	Connection  **members;
+	int           members_count;
+	int           members_capacity;
+	struct Room  *next;
+} Room;
+
+typedef struct FileReceive {
+	FileSink        sink;
+	TransferState   state;
+	char            name[PPCHAT_FILE_NAME_MAX_SIZE + 1];
+
+	// Chunk being received. Its header can come split over several reads.
+	char            chunk_header_bytes[PPCHAT_FILE_CHUNK_HEADER_SIZE];
+	int             chunk_header_size;
+	FileChunkHeader chunk_header;
+
+	// Of this connection only, a resumed transfer got the rest before.
+	uint64_t        received_size;
+	uint64_t        start_timestamp;
+	uint64_t        start_cpu_time;    // Of the reactor thread, which does all the receiving.
+} FileReceive;
+
+// Most topic patterns a client can be subscribed to at once.
+const int SERVER_MAX_TOPIC_SUBSCRIPTIONS = 32;
+
+typedef struct Client {
+	FrameDecoder decoder;
+	Room        *room;
+	int          room_member_index;
+
+	// Set while a file sent by the client is being received.
+	FileReceive *file;
+
+	// Agreed on with FRAME_TYPE_OPTIONS, none until the client asks.
+	uint32_t     features;
+
+	// Set once the first frame arrives. Until then the connection's timer is the
+	// handshake deadline, from then on it checks whether the client is still there.
+	bool         greeted;
+
+	// Set while receives are held back because the client's address went over its rate.
+	// The connection's timer runs out when it's allowed to send again.
+	bool         throttled;
+
+	// In the registry of the client's shard.
+	ConnectionHandle handle;
+
+	// Topic patterns the client subscribed to, so that it's unsubscribed when it leaves.
+	char        *topic_patterns[SERVER_MAX_TOPIC_SUBSCRIPTIONS];
+	int          topic_patterns_count;
+
+	// For throughput, bytes on the wire including frame headers.
+	uint64_t     open_timestamp;
+	uint64_t     bytes_received;
+	uint64_t     bytes_sent;
+} Client;
+
+// Clients come and go with connections, pooled the same way.
+ObjectPool g_client_pool;
+
+const int SERVER_MAX_SHARDS = 64;
+
+// Most bytes a client can have waiting to be sent before messages to it get dropped.
+const int SERVER_DEFAULT_SEND_QUEUE_LIMIT = 1024 * 1024;
+
+// Clients are disconnected if they don't send their first frame (which is the options
+// they ask for) within the handshake timeout, or don't send anything at all within the
+// idle timeout. A client that has been quiet for a third of the idle timeout is pinged,
+// so that a live one answers in time even if its user doesn't type. Zero disables either.
+const int SERVER_DEFAULT_HANDSHAKE_TIMEOUT_MS = 10 * 1000;
+const int SERVER_DEFAULT_IDLE_TIMEOUT_MS = 60 * 1000;
+
+int g_handshake_timeout_ms = SERVER_DEFAULT_HANDSHAKE_TIMEOUT_MS;
+int g_idle_timeout_ms = SERVER_DEFAULT_IDLE_TIMEOUT_MS;
+
+// What one address may do per second, see ppchat_rate_limit.h. Connections over the rate
+// are turned away when they're accepted. Clients that send more messages or bytes than
+// that are slowed down instead: the server stops reading from them until their address
+// is within the rate again. Bursts can be twice the rate. Zero means no limit.
+const uint32_t SERVER_DEFAULT_CONNECTIONS_PER_SECOND = 10;
+const uint32_t SERVER_DEFAULT_MESSAGES_PER_SECOND = 50;
+const uint32_t SERVER_DEFAULT_BYTES_PER_SECOND = 4 * 1024 * 1024;
+
+// An address that keeps going over its rate is logged at most this often.
+const uint64_t SERVER_RATE_LIMIT_LOG_INTERVAL_MS = 10 * 1000;
+
+// Most clients of a shard `/who` lists, the ones that have been quiet the longest.
+const int SERVER_WHO_MAX_LISTED = 20;
+
+// A reactor and everything that only its thread touches. Every shard keeps rooms
+// of its own with the members it serves, a room exists on each shard it has members on.
+//
+// Rates are counted per shard as well. The first shard accepts every connection, so
+// connection rates are for the whole server, message and byte rates for the shard that
+// serves the connection.
+//
+// Clients are found by the handles of their shard's registry, which is tagged with the
+// shard's index. Any thread can hold on to a handle and post it to the shard to reach the
+// client, and a client that has gone away in the meantime is simply not found.
+//
+// Topic subscriptions are kept per shard as well, by the registry slots of the clients.
+typedef struct Shard {
+	Reactor            reactor;
+	HANDLE             thread;
+	int                index;
+	Room              *rooms;
+	uint64_t           rooms_count;
+	RateLimiter        rate_limiter;
+	ConnectionRegistry registry;
+	TopicRouter        topics;
+	TopicRecipients    topic_recipients;   // Of the last message published, reused.
+} Shard;
+
+Shard g_shards[SERVER_MAX_SHARDS];
+int g_shards_count = 0;
+
+// Message that has to reach members of a room on another shard.
+typedef struct RoomMessage {
+	SharedBuffer *frame;
+	SharedBuffer *compressed_frame;   // NULL if the message isn't sent compressed.
+	int           payload_size;
+	char          room_name[ROOM_NAME_MAX_SIZE];
+} RoomMessage;
+
+// Nodes a node can be linked with and keeps track of the messages of, see ppchat_federation.h.
+// Rooms know the peers subscribed to them by a bit per peer slot.
+const int SERVER_FEDERATION_MAX_PEERS = 64;
+const int SERVER_FEDERATION_MAX_ORIGINS = 64;
+
+// Links this node makes that drop or can't be made are tried again this often.
+const DWORD SERVER_FEDERATION_REDIAL_INTERVAL_MS = 2000;
+
+// A peer that falls this far behind loses messages rather than make the node hold them.
+const int SERVER_FEDERATION_SEND_QUEUE_LIMIT = 16 * 1024 * 1024;
+
+const int SERVER_PEER_HOST_MAX_SIZE = 256;
+const int SERVER_PEER_PORT_MAX_SIZE = 16;
+
+// Node given with `-peer`, which this one keeps a link to.
+typedef struct PeerAddress {
+	char          host[SERVER_PEER_HOST_MAX_SIZE];
+	char          port[SERVER_PEER_PORT_MAX_SIZE];
+
+	// Set while the link is up or being made, the dialer leaves the address alone then.
+	volatile LONG linked;
+
+	// Only the dialer's, so that a node that is down is reported once.
+	bool          unreachable_reported;
+} PeerAddress;
+
+// Link with another node, whichever of the two made it.
+typedef struct Peer {
+	Connection   *connection;   // NULL while the slot is free.
+	PeerAddress  *address;      // NULL unless this node made the link.
+	FrameDecoder  decoder;
+	uint32_t      node_id;      // Zero until its hello arrives.
+
+	// Messages gathered for the peer during this round of the loop, with room for the
+	// frame header in front. NULL if there are none.
+	SharedBuffer *batch;
+} Peer;
+
+// Room as far as federation is concerned: whether this node has members in it, and
+// which peers have.
+typedef struct FederatedRoom {
+	char                  name[ROOM_NAME_MAX_SIZE];
+	int                   local_shards_count;   // Shards the room exists on here.
+	uint64_t              subscribed_peers;
+	struct FederatedRoom *next;
+} FederatedRoom;
+
+// Peer links have a reactor and a thread of their own, so shards only ever post to it,
+// and everything below but the addresses is only touched by that thread.
+typedef struct Federation {
+	bool           enabled;
+	Reactor        reactor;
+	HANDLE         thread;
+	HANDLE         dialer_thread;
+	HANDLE         stop_event;   // Wakes the dialer up to quit.
+
+	uint32_t       node_id;
+	uint64_t       next_sequence;
+
+	PeerAddress    addresses[SERVER_FEDERATION_MAX_PEERS];
+	int            addresses_count;
+
+	// Set while a link the dialer made is being added, for `on_open` to pick up.
+	PeerAddress   *dialed_address;
+
+	Peer           peers[SERVER_FEDERATION_MAX_PEERS];
+	int            linked_peers_count;
+
+	FederatedRoom *rooms;
+	OriginWindow   origins[SERVER_FEDERATION_MAX_ORIGINS];
+	int            origins_count;
+} Federation;
+
+Federation g_federation;
+
+// Copies a room name that came from a peer, which isn't null terminated.
+bool copy_peer_room_name(const char *name, int name_size, char *out_name) {
+	if (name_size <= 0 || name_size >= ROOM_NAME_MAX_SIZE)
+		return false;
+
+	memcpy(out_name, name, name_size);
+	out_name[name_size] = '\0';
+	return true;
+}
+
+FederatedRoom *find_federated_room(const char *name) {
+	for (FederatedRoom *room = g_federation.rooms; room; room = room->next) {
+		if (strcmp(room->name, name) == 0)
+			return room;
+	}
+
+	return NULL;
+}
+
+FederatedRoom *find_or_create_federated_room(const char *name) {
+	FederatedRoom *room = find_federated_room(name);
+	if (room)
+		return room;
+
+	room = (FederatedRoom *) calloc(1, sizeof(*room));
+	if (!room)
+		return NULL;
+
+	strncpy(room->name, name, sizeof(room->name) - 1);
+	room->next = g_federation.rooms;
+	g_federation.rooms = room;
+	return room;
+}
+
+// Rooms are kept while anybody, here or on a peer, has members in them.
+void release_federated_room(FederatedRoom *room) {
+	if (room->local_shards_count > 0 || room->subscribed_peers != 0)
+		return;
+
+	FederatedRoom **link = &g_federation.rooms;
+	while (*link != room)
+		link = &(*link)->next;
+
+	*link = room->next;
+	free(room);
+}
+
+void send_subscription(Peer *peer, const char *room_name, bool subscribe) {
+	uint16_t type = (subscribe) ? FRAME_TYPE_PEER_SUBSCRIBE : FRAME_TYPE_PEER_UNSUBSCRIBE;
+	ppchat_reactor_send_frame(peer->connection, type, 0, room_name, (int) strlen(room_name));
+}
+
+// Tells every linked peer whether this node has members in the room now.
+void send_subscription_to_peers(const char *room_name, bool subscribe) {
+	for (int i = 0; i < SERVER_FEDERATION_MAX_PEERS; i += 1) {
+		Peer *peer = &g_federation.peers[i];
+		if (peer->connection && peer->connection->state == CONNECTION_STATE_OPEN)
+			send_subscription(peer, room_name, subscribe);
+	}
+}
+
+// Room was created (`value` of 1) or destroyed (0) on a shard. Posted by the shard with
+// a copy of the name.
+void federation_room_changed(Reactor *reactor, void *argument, uint64_t value) {
+	char *room_name = static_cast<char *>(argument);
+
+	if (!reactor->stopped) {
+		if (value) {
+			FederatedRoom *room = find_or_create_federated_room(room_name);
+			if (!room) {
+				log_error("Couldn't allocate memory for room '%s', peers won't send its messages here.", room_name);
+			} else {
+				room->local_shards_count += 1;
+				if (room->local_shards_count == 1)
+					send_subscription_to_peers(room_name, true);
+			}
+		} else {
+			FederatedRoom *room = find_federated_room(room_name);
+			if (room) {
+				room->local_shards_count -= 1;
+				if (room->local_shards_count == 0) {
+					send_subscription_to_peers(room_name, false);
+					release_federated_room(room);
+				}
+			}
+		}
+	}
+
+	ppchat_slab_free(room_name, ROOM_NAME_MAX_SIZE);
+}
+
+void notify_federation_of_room(const char *room_name, bool created) {
+	if (!g_federation.enabled)
+		return;
+
+	char *name = (char *) ppchat_slab_allocate(ROOM_NAME_MAX_SIZE, NULL);
+	if (!name) {
+		log_error("Couldn't allocate memory to tell peers about room '%s'.", room_name);
+		return;
+	}
+
+	strcpy(name, room_name);
+	if (!ppchat_reactor_post(&g_federation.reactor, federation_room_changed, name, (created) ? 1 : 0)) {
+		log_error("Mailbox of the federation is full, peers won't hear that room '%s' was %s here.", room_name, (created) ? "created" : "left");
+		ppchat_slab_free(name, ROOM_NAME_MAX_SIZE);
+	}
+}
+
+// Sends what has been gathered for the peer in a single frame.
+void flush_peer_batch(Peer *peer) {
+	SharedBuffer *batch = peer->batch;
+	if (!batch)
+		return;
+
+	peer->batch = NULL;
+	ppchat_encode_frame_header(batch->data, FRAME_TYPE_PEER_BATCH, 0, (uint32_t) (batch->size - PPCHAT_FRAME_HEADER_SIZE));
+	if (ppchat_reactor_send_shared(peer->connection, batch))
+		ppchat_stats_add(SERVER_COUNTER_PEER_BATCHES_SENT, 1);
+
+	ppchat_shared_buffer_release(batch);
+}
+
+bool append_to_peer_batch(Peer *peer, const char *room_name, uint64_t sequence, const char *payload, int payload_size) {
+	int room_name_size = (int) strlen(room_name);
+	int message_size = ppchat_peer_message_size(room_name_size, payload_size);
+	if (peer->batch && peer->batch->size + message_size > PPCHAT_PEER_BATCH_MAX_SIZE)
+		flush_peer_batch(peer);
+
+	if (!peer->batch) {
+		peer->batch = ppchat_shared_buffer_create(max(PPCHAT_PEER_BATCH_MAX_SIZE, PPCHAT_FRAME_HEADER_SIZE + message_size));
+		if (!peer->batch)
+			return false;
+
+		peer->batch->size = PPCHAT_FRAME_HEADER_SIZE;
+	}
+
+	char *end = ppchat_encode_peer_message(peer->batch->data + peer->batch->size, g_federation.node_id, sequence, room_name, room_name_size, payload, payload_size);
+	peer->batch->size = (int) (end - peer->batch->data);
+	return true;
+}
+
+// Adds a message sent on this node to the batches of the peers that have members in its
+// room. Posted by the shard it was sent on.
+void federation_relay_message(Reactor *reactor, void *argument, uint64_t value) {
+	(void) value;
+
+	RoomMessage *message = static_cast<RoomMessage *>(argument);
+	FederatedRoom *room = (reactor->stopped) ? NULL : find_federated_room(message->room_name);
+	if (room && room->subscribed_peers != 0) {
+		uint64_t sequence = g_federation.next_sequence;
+		g_federation.next_sequence += 1;
+
+		const char *payload = message->frame->data + PPCHAT_FRAME_HEADER_SIZE;
+		for (int i = 0; i < SERVER_FEDERATION_MAX_PEERS; i += 1) {
+			if ((room->subscribed_peers & ((uint64_t) 1 << i)) == 0)
+				continue;
+
+			if (append_to_peer_batch(&g_federation.peers[i], message->room_name, sequence, payload, message->payload_size))
+				ppchat_stats_add(SERVER_COUNTER_PEER_MESSAGES_RELAYED, 1);
+			else
+				log_error("Couldn't allocate a batch for node %u, it misses a message of room '%s'.", g_federation.peers[i].node_id, message->room_name);
+		}
+	}
+
+	ppchat_shared_buffer_release(message->frame);
+	ppchat_slab_free(message, sizeof(*message));
+}
+
+// Hands a message sent on this node to the federation, which passes it on to the peers
+// that have members in its room.
+void relay_to_peers(const char *room_name, SharedBuffer *frame, int payload_size) {
+	if (!g_federation.enabled)
+		return;
+
+	RoomMessage *message = (RoomMessage *) ppchat_slab_allocate(sizeof(RoomMessage), NULL);
+	if (!message) {
+		log_error("Couldn't allocate memory to relay a message of room '%s' to peers.", room_name);
+		return;
+	}
+
+	// Peers get the plain payload and compress it for their own members.
+	message->frame = frame;
+	message->compressed_frame = NULL;
+	message->payload_size = payload_size;
+	strcpy(message->room_name, room_name);
+
+	ppchat_shared_buffer_retain(frame);
+	if (!ppchat_reactor_post(&g_federation.reactor, federation_relay_message, message, 0)) {
+		log_warning("Mailbox of the federation is full, peers miss a message of room '%s'.", room_name);
+		ppchat_shared_buffer_release(frame);
+		ppchat_slab_free(message, sizeof(*message));
+	}
+}
+
+Shard *get_shard(Connection *connection) {
+	return static_cast<Shard *>(connection->reactor->callbacks.user_data);
+}
+
+Room *find_room(Shard *shard, const char *name) {
+	for (Room *room = shard->rooms; room; room = room->next) {
+		if (strcmp(room->name, name) == 0)
+			return room;
+	}
+
+	return NULL;
+}
+
+Room *find_or_create_room(Shard *shard, const char *name) {
+	Room *room = find_room(shard, name);
+	if (room)
+		return room;
+
+	room = (Room *) calloc(1, sizeof(*room));
+	if (!room)
+		return NULL;
+
+	strncpy(room->name, name, sizeof(room->name) - 1);
+	room->next = shard->rooms;
+	shard->rooms = room;
+	shard->rooms_count += 1;
+
+	notify_federation_of_room(room->name, true);
+	return room;
+}
+
+void destroy_room(Shard *shard, Room *room) {
+	Room **link = &shard->rooms;
+	while (*link != room)
+		link = &(*link)->next;
+
+	*link = room->next;
+	shard->rooms_count -= 1;
+
+	notify_federation_of_room(room->name, false);
+	free(room->members);
+	free(room);
+}
+
+void leave_room(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	Room *room = client->room;
+	if (!room)
+		return;
+
+	// Swap the last member into the freed spot, membership order doesn't matter.
+	int index = client->room_member_index;
+	Connection *last_member = room->members[room->members_count - 1];
+	room->members[index] = last_member;
+	static_cast<Client *>(last_member->user_data)->room_member_index = index;
+	room->members_count -= 1;
+
+	client->room = NULL;
+	client->room_member_index = -1;
+
+	if (room->members_count == 0)
+		destroy_room(get_shard(connection), room);
+}
+
+bool join_room(Connection *connection, const char *name) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (client->room && strcmp(client->room->name, name) == 0)
+		return true;
+
+	leave_room(connection);
+
+	Room *room = find_or_create_room(get_shard(connection), name);
+	if (!room)
+		return false;
+
+	if (room->members_count == room->members_capacity) {
+		int new_capacity = max(room->members_capacity * 2, 16);
+		Connection **new_members = (Connection **) realloc(room->members, new_capacity * sizeof(*new_members));
+		if (!new_members) {
+			if (room->members_count == 0)
+				destroy_room(get_shard(connection), room);
+
+			return false;
+		}
+
+		room->members = new_members;
+		room->members_capacity = new_capacity;
+	}
+
+	client->room = room;
+	client->room_member_index = room->members_count;
+	room->members[room->members_count] = connection;
+	room->members_count += 1;
+	return true;
+}
+
+void send_notice(Connection *connection, const char *format, ...) {
+	char notice[512];
+
+	va_list arguments;
+	va_start(arguments, format);
+	int notice_size = vsnprintf(notice, sizeof(notice), format, arguments);
+	va_end(arguments);
+
+	if (notice_size < 0)
+		return;
+
+	notice_size = min(notice_size, (int) sizeof(notice) - 1);
+	ppchat_reactor_send_frame(connection, FRAME_TYPE_CHAT_MESSAGE, 0, notice, notice_size);
+}
+
+bool on_connection_open(Connection *connection, void *user_data) {
+	(void) user_data;
+
+	Client *client = (Client *) ppchat_object_pool_allocate(&g_client_pool);
+	if (!client) {
+		log_error("Couldn't allocate memory for client '%s'.", connection->ip);
+		return false;
+	}
+
+	Shard *shard = get_shard(connection);
+	uint64_t now_ms = ppchat_timestamp_to_milliseconds(connection->reactor->dispatch_timestamp);
+	ConnectionHandle handle = ppchat_connection_registry_add(&shard->registry, connection, connection->socket, &connection->address, now_ms);
+	if (handle == PPCHAT_INVALID_CONNECTION_HANDLE) {
+		log_error("Shard %d has no room for client '%s' in its registry.", shard->index, connection->ip);
+		ppchat_object_pool_free(&g_client_pool, client);
+		return false;
+	}
+
+	memset(client, 0, sizeof(*client));
+	ppchat_frame_decoder_init(&client->decoder, PPCHAT_FILE_DATA_MAX_PAYLOAD_SIZE);
+	client->room_member_index = -1;
+	client->handle = handle;
+	client->open_timestamp = ppchat_get_timestamp();
+	connection->user_data = client;
+
+	if (g_handshake_timeout_ms > 0)
+		ppchat_reactor_set_timer(connection, (uint32_t) g_handshake_timeout_ms);
+
+	if (!join_room(connection, DEFAULT_ROOM_NAME)) {
+		log_error("Couldn't add client '%s' to room '%s'.", connection->ip, DEFAULT_ROOM_NAME);
+		ppchat_connection_registry_remove(&shard->registry, handle);
+		ppchat_frame_decoder_destroy(&client->decoder);
+		ppchat_object_pool_free(&g_client_pool, client);
+		connection->user_data = NULL;
+		return false;
+	}
+
+	log("New connection from client '%s', handle %llx.", connection->ip, handle);
+	return true;
+}
+
+// Queues the frame on every member of the room this shard serves, but `sender`. Members
+// that have agreed on compression get `compressed_frame` instead, unless it is NULL.
+int send_to_room_members(Room *room, SharedBuffer *frame, SharedBuffer *compressed_frame, Connection *sender) {
+	int recipients_count = 0;
+	int compressed_count = 0;
+	for (int i = 0; i < room->members_count; i += 1) {
+		Connection *member = room->members[i];
+		if (member == sender && !g_echo_back)
+			continue;
+
+		Client *client = static_cast<Client *>(member->user_data);
+		SharedBuffer *member_frame = (compressed_frame && (client->features & PPCHAT_FEATURE_COMPRESSION)) ? compressed_frame : frame;
+		if (ppchat_reactor_send_shared(member, member_frame)) {
+			client->bytes_sent += member_frame->size;
+			recipients_count += 1;
+			if (member_frame == compressed_frame)
+				compressed_count += 1;
+		}
+	}
+
+	if (compressed_count > 0)
+		ppchat_stats_add(SERVER_COUNTER_COMPRESSION_SAVED_BYTES, (uint64_t) compressed_count * (frame->size - compressed_frame->size));
+
+	return recipients_count;
+}
+
+void deliver_room_message(Reactor *reactor, void *argument, uint64_t value) {
+	(void) value;
+
+	RoomMessage *message = static_cast<RoomMessage *>(argument);
+	Shard *shard = static_cast<Shard *>(reactor->callbacks.user_data);
+
+	Room *room = (reactor->stopped) ? NULL : find_room(shard, message->room_name);
+	if (room) {
+		int recipients_count = send_to_room_members(room, message->frame, message->compressed_frame, NULL);
+		ppchat_stats_add(SERVER_COUNTER_MESSAGES_SENT, recipients_count);
+		ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_SENT, (uint64_t) recipients_count * message->payload_size);
+	}
+
+	ppchat_shared_buffer_release(message->frame);
+	if (message->compressed_frame)
+		ppchat_shared_buffer_release(message->compressed_frame);
+
+	ppchat_slab_free(message, sizeof(*message));
+}
+
+// Hands the frame to every other shard, which queue it on their members of the room.
+// `shard` can be NULL, which hands it to every shard. Returns how many it was handed to.
+int forward_to_other_shards(Shard *shard, const char *room_name, SharedBuffer *frame, SharedBuffer *compressed_frame, int payload_size) {
+	int forwarded_count = 0;
+	for (int i = 0; i < g_shards_count; i += 1) {
+		if (&g_shards[i] == shard)
+			continue;
+
+		RoomMessage *message = (RoomMessage *) ppchat_slab_allocate(sizeof(RoomMessage), NULL);
+		if (!message) {
+			log_error("Couldn't allocate memory to forward a message to shard %d.", i);
+			continue;
+		}
+
+		message->frame = frame;
+		message->compressed_frame = compressed_frame;
+		message->payload_size = payload_size;
+		strcpy(message->room_name, room_name);
+
+		ppchat_shared_buffer_retain(frame);
+		if (compressed_frame)
+			ppchat_shared_buffer_retain(compressed_frame);
+
+		if (!ppchat_reactor_post(&g_shards[i].reactor, deliver_room_message, message, 0)) {
+			log_warning("Mailbox of shard %d is full, dropping a message for room '%s' there.", i, room_name);
+			ppchat_shared_buffer_release(frame);
+			if (compressed_frame)
+				ppchat_shared_buffer_release(compressed_frame);
+
+			ppchat_slab_free(message, sizeof(*message));
+			continue;
+		}
+
+		forwarded_count += 1;
+	}
+
+	return forwarded_count;
+}
+
+// Encodes the message once and queues that same buffer on every member of the sender's room,
+// other shards included. Messages long enough to be worth it are compressed once too, for
+// the members that have agreed on it.
+void broadcast_message(Connection *sender, const char *message, int message_size) {
+	Client *client = static_cast<Client *>(sender->user_data);
+	Room *room = client->room;
+
+	int sender_size = (int) strlen(sender->ip);
+	int payload_size = sender_size + 2 + message_size;
+
+	// Members would take a frame over the limit for a protocol error and disconnect.
+	int max_message_size = PPCHAT_FRAME_MAX_PAYLOAD_SIZE - sender_size - 2;
+	if (message_size > max_message_size) {
+		log_warning("Client '%s' sent a message of %d bytes, only %d fit a frame with its address.", sender->ip, message_size, max_message_size);
+		send_notice(sender, "Message is too long, it can be %d bytes at most.", max_message_size);
+		return;
+	}
+
+	SharedBuffer *frame = ppchat_create_frame_buffer(FRAME_TYPE_CHAT_MESSAGE, 0, NULL, payload_size);
+	if (!frame) {
+		log_error("Couldn't allocate %d bytes for a message from '%s'.", payload_size, sender->ip);
+		return;
+	}
+
+	// Payload is "<sender>: <message>".
+	char *payload = frame->data + PPCHAT_FRAME_HEADER_SIZE;
+	memcpy(payload, sender->ip, sender_size);
+	memcpy(payload + sender_size, ": ", 2);
+	memcpy(payload + sender_size + 2, message, message_size);
+
+	SharedBuffer *compressed_frame = NULL;
+	if (g_features & PPCHAT_FEATURE_COMPRESSION) {
+		compressed_frame = ppchat_create_compressed_frame_buffer(FRAME_TYPE_CHAT_MESSAGE, 0, payload, payload_size);
+		if (compressed_frame)
+			ppchat_stats_add(SERVER_COUNTER_FRAMES_COMPRESSED, 1);
+	}
+
+	int recipients_count = send_to_room_members(room, frame, compressed_frame, sender);
+
+	Shard *shard = get_shard(sender);
+	int forwarded_count = (g_shards_count > 1) ? forward_to_other_shards(shard, room->name, frame, compressed_frame, payload_size) : 0;
+	relay_to_peers(room->name, frame, payload_size);
+
+	ppchat_stats_add(SERVER_COUNTER_MESSAGES_SENT, recipients_count);
+	ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_SENT, (uint64_t) recipients_count * payload_size);
+
+	if (g_echo_back) {
+		ppchat_stats_add(SERVER_COUNTER_MESSAGES_ECHOED_BACK, 1);
+		ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_ECHOED_BACK, payload_size);
+	}
+
+	uint64_t latency_ticks = ppchat_get_timestamp() - sender->reactor->dispatch_timestamp;
+	ppchat_stats_record(SERVER_HISTOGRAM_RECEIVE_TO_SEND_LATENCY, ppchat_timestamp_to_nanoseconds(latency_ticks));
+
+	// Stored once the live sends are queued, so that they don't wait for it.
+	if (g_history_enabled && ppchat_history_append(&g_history, room->name, payload, payload_size) == 0)
+		log_warning("Couldn't store message from '%s' in the history of room '%s'.", sender->ip, room->name);
+
+	// Members and other shards hold their own references now.
+	ppchat_shared_buffer_release(frame);
+	if (compressed_frame)
+		ppchat_shared_buffer_release(compressed_frame);
+
+	if (g_shards_count > 1) {
+		log("Sent message from '%s' to %d members of room '%s' on shard %d, forwarded to %d other shards.", sender->ip, recipients_count, room->name, shard->index, forwarded_count);
+	} else {
+		log("Sent message from '%s' to %d members of room '%s'.", sender->ip, recipients_count, room->name);
+	}
+}
+
+void handle_join_room(Connection *connection, const char *name, int name_size) {
+	char room_name[ROOM_NAME_MAX_SIZE];
+	if (name_size <= 0 || name_size >= (int) sizeof(room_name)) {
+		send_notice(connection, "Room name has to be 1 to %d characters long.", (int) sizeof(room_name) - 1);
+		return;
+	}
+
+	for (int i = 0; i < name_size; i += 1) {
+		if (!isgraph((unsigned char) name[i])) {
+			send_notice(connection, "Room name can't contain spaces or control characters.");
+			return;
+		}
+	}
+
+	memcpy(room_name, name, name_size);
+	room_name[name_size] = '\0';
+
+	if (!join_room(connection, room_name)) {
+		log_error("Couldn't add client '%s' to room '%s'.", connection->ip, room_name);
+		send_notice(connection, "Couldn't join room '%s'.", room_name);
+
+		// Client must never be left without a room.
+		join_room(connection, DEFAULT_ROOM_NAME);
+		return;
+	}
+
+	Client *client = static_cast<Client *>(connection->user_data);
+	log("Client '%s' has joined room '%s'.", connection->ip, room_name);
+	send_notice(connection, "You have joined room '%s' (%d members).", room_name, client->room->members_count);
+}
+
+// Sends the frame compressed if the client has agreed on it and it is worth it.
+bool send_frame(Connection *connection, uint16_t type, uint16_t flags, const char *payload, int payload_size) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (!(client->features & PPCHAT_FEATURE_COMPRESSION))
+		return ppchat_reactor_send_frame(connection, type, flags, payload, payload_size);
+
+	SharedBuffer *frame = ppchat_create_compressed_frame_buffer(type, flags, payload, payload_size);
+	if (!frame)
+		return ppchat_reactor_send_frame(connection, type, flags, payload, payload_size);
+
+	ppchat_stats_add(SERVER_COUNTER_FRAMES_COMPRESSED, 1);
+	ppchat_stats_add(SERVER_COUNTER_COMPRESSION_SAVED_BYTES, PPCHAT_FRAME_HEADER_SIZE + payload_size - frame->size);
+
+	bool queued = ppchat_reactor_send_shared(connection, frame);
+	ppchat_shared_buffer_release(frame);
+	return queued;
+}
+
+void send_history_record(const HistoryRecord *record, void *context) {
+	Connection *connection = static_cast<Connection *>(context);
+	send_frame(connection, FRAME_TYPE_CHAT_MESSAGE, FRAME_FLAG_HISTORY, record->payload, record->payload_size);
+}
+
+// Replays the last messages of the client's room, right from the mapped history segments.
+void handle_history_request(Connection *connection, const char *payload, int payload_size) {
+	if (payload_size != HistoryRequestSchema::size) {
+		log_error("Client '%s' sent a malformed history request. Disconnecting.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	if (!g_history_enabled) {
+		send_notice(connection, "This server doesn't keep history.");
+		return;
+	}
+
+	HistoryRequest request = HistoryRequestSchema::decode(payload);
+	int count = (int) min(request.count, (uint32_t) PPCHAT_HISTORY_MAX_READ_COUNT);
+
+	Client *client = static_cast<Client *>(connection->user_data);
+	int replayed_count = ppchat_history_read_last(&g_history, client->room->name, count, send_history_record, connection);
+	log("Replayed %d messages of room '%s' to '%s'.", replayed_count, client->room->name, connection->ip);
+}
+
+void print_search_result(const HistoryRecord *record, void *context) {
+	log("[%.*s] %.*s", record->room_size, record->room, record->payload_size, record->payload);
+}
+
+// Sends the newest messages of the client's room that have every word of the query in them.
+void handle_search_request(Connection *connection, const char *payload, int payload_size) {
+	if (!g_history_enabled) {
+		send_notice(connection, "This server doesn't keep history.");
+		return;
+	}
+
+	Client *client = static_cast<Client *>(connection->user_data);
+	int query_size = min(payload_size, SERVER_SEARCH_QUERY_MAX_SIZE);
+
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	uint64_t sequences[SERVER_SEARCH_RESULTS_COUNT];
+	int found_count = ppchat_search_query(&g_search, client->room->name, payload, query_size, sequences, SERVER_SEARCH_RESULTS_COUNT);
+	ppchat_stats_record(SERVER_HISTOGRAM_SEARCH_LATENCY, ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp));
+
+	// Oldest first, like the rest of the chat. Messages the history has dropped
+	// since the index saw them are skipped.
+	int sent_count = 0;
+	for (int i = found_count - 1; i >= 0; i -= 1) {
+		if (ppchat_history_read(&g_history, sequences[i], send_history_record, connection))
+			sent_count += 1;
+	}
+
+	send_notice(connection, "Found %d message%s matching '%.*s'.", sent_count, (sent_count == 1) ? "" : "s", query_size, payload);
+}
+
+// Index of the pattern among the ones the client subscribed to, -1 if it's not there.
+int find_topic_pattern(Client *client, const char *pattern, int pattern_size) {
+	for (int i = 0; i < client->topic_patterns_count; i += 1) {
+		if ((int) strlen(client->topic_patterns[i]) == pattern_size && memcmp(client->topic_patterns[i], pattern, pattern_size) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+void handle_subscribe(Connection *connection, const char *pattern, int pattern_size) {
+	if (!ppchat_topic_pattern_is_valid(pattern, pattern_size)) {
+		send_notice(connection, "Topic patterns are up to %d characters of dot separated levels, any of which can be '*' and the last one '#'.", PPCHAT_TOPIC_MAX_SIZE);
+		return;
+	}
+
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (find_topic_pattern(client, pattern, pattern_size) >= 0) {
+		send_notice(connection, "You are subscribed to '%.*s' already.", pattern_size, pattern);
+		return;
+	}
+
+	if (client->topic_patterns_count == SERVER_MAX_TOPIC_SUBSCRIPTIONS) {
+		send_notice(connection, "You can be subscribed to %d topic patterns at most.", SERVER_MAX_TOPIC_SUBSCRIPTIONS);
+		return;
+	}
+
+	// Subscribers are slots of the shard's registry, which the client keeps until it leaves.
+	Shard *shard = get_shard(connection);
+	char *pattern_copy = (char *) malloc(pattern_size + 1);
+	if (!pattern_copy || !ppchat_topic_router_subscribe(&shard->topics, pattern, pattern_size, ppchat_connection_handle_slot(client->handle))) {
+		log_error("Couldn't allocate memory to subscribe client '%s' to '%.*s'.", connection->ip, pattern_size, pattern);
+		send_notice(connection, "Couldn't subscribe to '%.*s'.", pattern_size, pattern);
+		free(pattern_copy);
+		return;
+	}
+
+	memcpy(pattern_copy, pattern, pattern_size);
+	pattern_copy[pattern_size] = '\0';
+	client->topic_patterns[client->topic_patterns_count] = pattern_copy;
+	client->topic_patterns_count += 1;
+
+	send_notice(connection, "You have subscribed to '%s'.", pattern_copy);
+}
+
+void unsubscribe_from_topic(Connection *connection, int index) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	char *pattern = client->topic_patterns[index];
+	ppchat_topic_router_unsubscribe(&get_shard(connection)->topics, pattern, (int) strlen(pattern), ppchat_connection_handle_slot(client->handle));
+	free(pattern);
+
+	client->topic_patterns_count -= 1;
+	client->topic_patterns[index] = client->topic_patterns[client->topic_patterns_count];
+}
+
+void handle_unsubscribe(Connection *connection, const char *pattern, int pattern_size) {
+	int index = find_topic_pattern(static_cast<Client *>(connection->user_data), pattern, pattern_size);
+	if (index < 0) {
+		send_notice(connection, "You aren't subscribed to '%.*s'.", pattern_size, pattern);
+		return;
+	}
+
+	unsubscribe_from_topic(connection, index);
+	send_notice(connection, "You have unsubscribed from '%.*s'.", pattern_size, pattern);
+}
+
+// Queues the frame on every client of the shard that subscribed to a pattern its topic
+// matches, once no matter how many of them. Returns how many it was queued on.
+int send_to_topic_subscribers(Shard *shard, SharedBuffer *frame, Connection *sender) {
+	// Payload starts with the topic, up to the first space.
+	const char *topic = frame->data + PPCHAT_FRAME_HEADER_SIZE;
+	int topic_size = (int) ((const char *) memchr(topic, ' ', frame->size - PPCHAT_FRAME_HEADER_SIZE) - topic);
+
+	TopicRecipients *recipients = &shard->topic_recipients;
+	if (!ppchat_topic_router_match(&shard->topics, topic, topic_size, recipients))
+		log_error("Couldn't allocate memory for every subscriber of topic '%.*s' on shard %d, some of them miss a message.", topic_size, topic, shard->index);
+
+	int recipients_count = 0;
+	for (int i = 0; i < recipients->count; i += 1) {
+		Connection *subscriber = static_cast<Connection *>(ppchat_connection_registry_get_slot(&shard->registry, recipients->subscribers[i]));
+		if (!subscriber || subscriber->state != CONNECTION_STATE_OPEN || (subscriber == sender && !g_echo_back))
+			continue;
+
+		if (ppchat_reactor_send_shared(subscriber, frame)) {
+			static_cast<Client *>(subscriber->user_data)->bytes_sent += frame->size;
+			recipients_count += 1;
+		}
+	}
+
+	int payload_size = frame->size - PPCHAT_FRAME_HEADER_SIZE;
+	ppchat_stats_add(SERVER_COUNTER_MESSAGES_SENT, recipients_count);
+	ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_SENT, (uint64_t) recipients_count * payload_size);
+	return recipients_count;
+}
+
+// Posted with a reference to the frame by the shard it was published on.
+void deliver_topic_message(Reactor *reactor, void *argument, uint64_t value) {
+	(void) value;
+
+	SharedBuffer *frame = static_cast<SharedBuffer *>(argument);
+	if (!reactor->stopped)
+		send_to_topic_subscribers(static_cast<Shard *>(reactor->callbacks.user_data), frame, NULL);
+
+	ppchat_shared_buffer_release(frame);
+}
+
+// Every shard matches the topic against its own subscribers, this one right away and the
+// others once the frame gets to them.
+void handle_publish(Connection *connection, const char *payload, int payload_size) {
+	const char *space = (const char *) memchr(payload, ' ', payload_size);
+	int topic_size = (space) ? (int) (space - payload) : payload_size;
+	int message_size = payload_size - topic_size - 1;
+	if (!ppchat_topic_is_valid(payload, topic_size) || message_size <= 0) {
+		send_notice(connection, "Publish as '<topic> <message>', topics are up to %d characters of dot separated levels.", PPCHAT_TOPIC_MAX_SIZE);
+		return;
+	}
+
+	// Payload is "<topic> <sender>: <message>", which subscribers have to be able to take.
+	int sender_size = (int) strlen(connection->ip);
+	int frame_payload_size = topic_size + 1 + sender_size + 2 + message_size;
+	if (frame_payload_size > PPCHAT_FRAME_MAX_PAYLOAD_SIZE) {
+		send_notice(connection, "Message is too long, it can be %d bytes at most on this topic.", PPCHAT_FRAME_MAX_PAYLOAD_SIZE - topic_size - 1 - sender_size - 2);
+		return;
+	}
+	SharedBuffer *frame = ppchat_create_frame_buffer(FRAME_TYPE_PUBLISH, 0, NULL, frame_payload_size);
+	if (!frame) {
+		log_error("Couldn't allocate %d bytes for a message from '%s' on topic '%.*s'.", frame_payload_size, connection->ip, topic_size, payload);
+		return;
+	}
+
+	char *position = frame->data + PPCHAT_FRAME_HEADER_SIZE;
+	memcpy(position, payload, topic_size + 1);
+	position += topic_size + 1;
+	memcpy(position, connection->ip, sender_size);
+	position += sender_size;
+	memcpy(position, ": ", 2);
+	memcpy(position + 2, space + 1, message_size);
+
+	Shard *shard = get_shard(connection);
+	int recipients_count = send_to_topic_subscribers(shard, frame, connection);
+
+	for (int i = 0; i < g_shards_count; i += 1) {
+		if (&g_shards[i] == shard)
+			continue;
+
+		ppchat_shared_buffer_retain(frame);
+		if (!ppchat_reactor_post(&g_shards[i].reactor, deliver_topic_message, frame, 0)) {
+			log_warning("Mailbox of shard %d is full, dropping a message on topic '%.*s' there.", i, topic_size, payload);
+			ppchat_shared_buffer_release(frame);
+		}
+	}
+
+	ppchat_shared_buffer_release(frame);
+
+	log("Published message from '%s' on topic '%.*s' to %d subscribers of shard %d.", connection->ip, topic_size, payload, recipients_count, shard->index);
+}
+
+void close_file_receive(Connection *connection, bool finished) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+
+	ppchat_file_sink_close(&file->sink);
+	ppchat_transfer_state_close(&file->state, finished);
+	free(file);
+	client->file = NULL;
+}
+
+void finish_file_receive(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+
+	double seconds = (double) (ppchat_get_timestamp() - file->start_timestamp) / (double) ppchat_get_timestamp_frequency();
+	double cpu_seconds = (double) (ppchat_get_thread_cpu_time() - file->start_cpu_time) / 1e9;
+	double megabytes_per_second = (seconds > 0.0) ? (double) file->received_size / seconds / (1024.0 * 1024.0) : 0.0;
+	double cpu_percent = (seconds > 0.0) ? 100.0 * cpu_seconds / seconds : 0.0;
+
+	log(
+		"Received file '%s' (%llu bytes, %llu of them now) from '%s' in %.2f s: %.1f MB/s, reactor thread CPU %.1f%%, %llu bytes copied.",
+		file->name,
+		file->sink.size,
+		file->received_size,
+		connection->ip,
+		seconds,
+		megabytes_per_second,
+		cpu_percent,
+		file->sink.copied_size
+	);
+	send_notice(connection, "File '%s' (%llu bytes) has been received at %.1f MB/s, %llu bytes copied.", file->name, file->sink.size, megabytes_per_second, file->sink.copied_size);
+
+	close_file_receive(connection, true);
+}
+
+// Whatever has been verified so far stays on disk, sending the file again resumes it.
+void abort_file_receive(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+	if (!file)
+		return;
+
+	log_warning("File '%s' from '%s' is incomplete, %u of %u chunks are kept for it to be resumed.", file->name, connection->ip, file->state.received_chunks_count, file->state.chunks_count);
+	close_file_receive(connection, false);
+}
+
+void handle_file_begin(Connection *connection, const char *payload, int payload_size) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (client->file) {
+		log_error("Client '%s' started another file before finishing '%s'. Disconnecting.", connection->ip, client->file->name);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	FileReceive *file = (FileReceive *) calloc(1, sizeof(*file));
+	if (!file) {
+		log_error("Couldn't allocate memory for a file from '%s'. Disconnecting.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_NOT_ENOUGH_MEMORY);
+		return;
+	}
+
+	uint64_t file_size;
+	uint64_t file_id;
+	if (!ppchat_decode_file_begin(payload, payload_size, &file_size, &file_id, file->name)) {
+		log_error("Client '%s' sent a file with a malformed header or name. Disconnecting.", connection->ip);
+		free(file);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	char path[MAX_PATH];
+	char state_path[MAX_PATH];
+	snprintf(path, sizeof(path), "%s/%s", FILE_SAVE_FOLDER, file->name);
+	snprintf(state_path, sizeof(state_path), "%s%s", path, PPCHAT_TRANSFER_STATE_SUFFIX);
+
+	// State without the file it describes is worthless.
+	if (GetFileAttributesA(path) == INVALID_FILE_ATTRIBUTES)
+		DeleteFileA(state_path);
+
+	bool resumed = false;
+	int error = 0;
+	bool opened = ppchat_transfer_state_open(&file->state, state_path, file_size, file_id, &resumed, &error) &&
+	              ppchat_file_sink_open(&file->sink, path, file_size, resumed, &error);
+	if (!opened) {
+		log_error("Couldn't open file '%s' of %llu bytes for '%s'. Error: %d - %s", path, file_size, connection->ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		send_notice(connection, "Couldn't save file '%s'.", file->name);
+		ppchat_transfer_state_close(&file->state, false);
+		free(file);
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	file->start_timestamp = ppchat_get_timestamp();
+	file->start_cpu_time = ppchat_get_thread_cpu_time();
+	client->file = file;
+
+	uint32_t first_chunk = ppchat_transfer_state_get_first_missing_chunk(&file->state);
+	if (resumed) {
+		log("Resuming file '%s' (%llu bytes) from '%s' at chunk %u of %u.", file->name, file_size, connection->ip, first_chunk, file->state.chunks_count);
+	} else {
+		log("Receiving file '%s' (%llu bytes) from '%s'.", file->name, file_size, connection->ip);
+	}
+
+	FileResume resume;
+	resume.first_chunk = first_chunk;
+	char resume_payload[FileResumeSchema::size];
+	FileResumeSchema::encode(resume, resume_payload);
+	ppchat_reactor_send_frame(connection, FRAME_TYPE_FILE_RESUME, 0, resume_payload, sizeof(resume_payload));
+
+	if (file->state.received_chunks_count == file->state.chunks_count)
+		finish_file_receive(connection);
+}
+
+// Checks the chunk that has just been written against its checksum.
+void complete_file_chunk(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+	FileChunkHeader *chunk = &file->chunk_header;
+	file->chunk_header_size = 0;
+
+	uint64_t offset = (uint64_t) chunk->index * PPCHAT_FILE_CHUNK_SIZE;
+	int size = (int) ppchat_get_file_chunk_size(file->sink.size, chunk->index);
+
+	int error = 0;
+	char *data = ppchat_file_sink_view(&file->sink, offset, size, &error);
+	if (!data) {
+		log_error("Couldn't map chunk %u of file '%s'. Error: %d - %s", chunk->index, file->name, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	uint32_t crc = ppchat_crc32c(0, data, size);
+	if (crc != chunk->crc) {
+		// Not marked, so it is sent again when the transfer is resumed.
+		log_error("Chunk %u of file '%s' from '%s' is corrupted (CRC-32C %08X, expected %08X). Disconnecting.", chunk->index, file->name, connection->ip, crc, chunk->crc);
+		send_notice(connection, "Chunk %u of file '%s' is corrupted, send the file again to resume it.", chunk->index, file->name);
+		ppchat_reactor_close(connection, ERROR_CRC);
+		return;
+	}
+
+	if (!ppchat_transfer_state_mark_chunk(&file->state, chunk->index, &error)) {
+		log_error("Couldn't save the state of file '%s'. Error: %d - %s", file->name, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	if (file->state.received_chunks_count == file->state.chunks_count)
+		finish_file_receive(connection);
+}
+
+// Takes what this piece has of the chunk header. Returns false on a protocol error.
+bool take_file_chunk_header(Connection *connection, Frame *frame, char **data, int *size) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+
+	int taken = min(*size, PPCHAT_FILE_CHUNK_HEADER_SIZE - file->chunk_header_size);
+	memcpy(file->chunk_header_bytes + file->chunk_header_size, *data, taken);
+	file->chunk_header_size += taken;
+	*data += taken;
+	*size -= taken;
+
+	if (file->chunk_header_size < PPCHAT_FILE_CHUNK_HEADER_SIZE)
+		return true;
+
+	FileChunkHeader chunk = ppchat_decode_file_chunk_header(file->chunk_header_bytes);
+	uint32_t expected_payload_size = PPCHAT_FILE_CHUNK_HEADER_SIZE + ppchat_get_file_chunk_size(file->sink.size, chunk.index);
+	if (chunk.index >= file->state.chunks_count || frame->header.payload_size != expected_payload_size) {
+		log_error("Client '%s' sent chunk %u of %u bytes for file '%s', which doesn't have it. Disconnecting.", connection->ip, chunk.index, frame->header.payload_size, file->name);
+		return false;
+	}
+
+	file->chunk_header = chunk;
+	ppchat_file_sink_seek(&file->sink, (uint64_t) chunk.index * PPCHAT_FILE_CHUNK_SIZE);
+	return true;
+}
+
+// Chunks that come compressed are whole frames, decompressed right into the file's mapped pages.
+void handle_compressed_file_data(Connection *connection, Frame *frame) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+
+	const char *data = frame->payload;
+	int size = (int) frame->header.payload_size;
+	if (frame->piece_size != frame->header.payload_size || size < PPCHAT_FILE_CHUNK_HEADER_SIZE) {
+		log_error("Client '%s' sent a malformed compressed chunk for file '%s'. Disconnecting.", connection->ip, file->name);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	FileChunkHeader chunk = ppchat_decode_file_chunk_header(data);
+	const char *compressed = data + PPCHAT_FILE_CHUNK_HEADER_SIZE;
+	int compressed_size = size - PPCHAT_FILE_CHUNK_HEADER_SIZE;
+
+	int chunk_size = (chunk.index < file->state.chunks_count) ? (int) ppchat_get_file_chunk_size(file->sink.size, chunk.index) : -1;
+	if (chunk_size < 0 || ppchat_get_decompressed_size(compressed, compressed_size, PPCHAT_FILE_CHUNK_SIZE) != chunk_size) {
+		log_error("Client '%s' sent compressed chunk %u for file '%s', which doesn't have it. Disconnecting.", connection->ip, chunk.index, file->name);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	int error = 0;
+	char *destination = ppchat_file_sink_view(&file->sink, (uint64_t) chunk.index * PPCHAT_FILE_CHUNK_SIZE, chunk_size, &error);
+	if (!destination) {
+		log_error("Couldn't map chunk %u of file '%s'. Error: %d - %s", chunk.index, file->name, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	if (!ppchat_decompress_payload(compressed, compressed_size, destination, chunk_size)) {
+		log_error("Chunk %u of file '%s' from '%s' doesn't decompress. Disconnecting.", chunk.index, file->name, connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	ppchat_stats_add(SERVER_COUNTER_FRAMES_DECOMPRESSED, 1);
+	// A peer may flag a chunk compressed that came out no smaller, which saved nothing.
+	if (chunk_size > compressed_size)
+		ppchat_stats_add(SERVER_COUNTER_COMPRESSION_SAVED_BYTES, (uint64_t) (chunk_size - compressed_size));
+
+	file->chunk_header = chunk;
+	file->received_size += chunk_size;
+	complete_file_chunk(connection);
+}
+
+void handle_file_data(Connection *connection, Frame *frame) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FileReceive *file = client->file;
+	if (!file) {
+		log_error("Client '%s' sent file data without starting a file. Disconnecting.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	if (frame->header.flags & FRAME_FLAG_COMPRESSED) {
+		handle_compressed_file_data(connection, frame);
+		return;
+	}
+
+	char *data = frame->payload;
+	int size = (int) frame->piece_size;
+
+	if (frame->piece_offset == 0)
+		file->chunk_header_size = 0;
+
+	if (file->chunk_header_size < PPCHAT_FILE_CHUNK_HEADER_SIZE && !take_file_chunk_header(connection, frame, &data, &size)) {
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	int error = 0;
+	if (size > 0 && !ppchat_file_sink_write(&file->sink, data, size, &error)) {
+		log_error("Couldn't write file '%s' from '%s'. Error: %d - %s", file->name, connection->ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	file->received_size += size;
+
+	if (frame->piece_offset + frame->piece_size == frame->header.payload_size)
+		complete_file_chunk(connection);
+}
+
+// While a streamed chunk of the file is still on its way, have the reactor receive it
+// right into the file's mapped pages, where `ppchat_file_sink_write` then finds it.
+void receive_next_file_data_in_place(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	FrameDecoder *decoder = &client->decoder;
+	if (!client->file || decoder->streamed_remaining == 0 || decoder->streamed_header.type != FRAME_TYPE_FILE_DATA)
+		return;
+
+	// Header of the chunk goes through the regular receive buffer. A read that ended right after
+	// the frame header hasn't handed out any of it yet, whatever is left from the last chunk.
+	if (decoder->streamed_offset < PPCHAT_FILE_CHUNK_HEADER_SIZE)
+		return;
+
+	int destination_size = 0;
+	int error = 0;
+	char *destination = ppchat_file_sink_get_destination(&client->file->sink, &destination_size, &error);
+	if (!destination)
+		return; // Whatever went wrong is reported once the data arrives.
+
+	// Never past the chunk, the next frame header must not land in the file.
+	int size = (int) min((uint32_t) destination_size, decoder->streamed_remaining);
+	ppchat_reactor_receive_into(connection, destination, size);
+}
+
+// Answers with the features both sides support, the client can count on them from then on.
+void handle_options(Connection *connection, const char *payload, int payload_size) {
+	if (payload_size != PPCHAT_OPTIONS_PAYLOAD_SIZE) {
+		log_error("Client '%s' sent malformed options. Disconnecting.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	ConnectionOptions options = ConnectionOptionsSchema::decode(payload);
+	Client *client = static_cast<Client *>(connection->user_data);
+	client->features = options.features & g_features;
+
+	ConnectionOptions agreed_options;
+	agreed_options.features = client->features;
+	char options_payload[PPCHAT_OPTIONS_PAYLOAD_SIZE];
+	ConnectionOptionsSchema::encode(agreed_options, options_payload);
+	ppchat_reactor_send_frame(connection, FRAME_TYPE_OPTIONS, 0, options_payload, sizeof(options_payload));
+
+	log("Client '%s' has %s compression.", connection->ip, (client->features & PPCHAT_FEATURE_COMPRESSION) ? "agreed on" : "not agreed on");
+}
+
+// Decompresses the payload into a slab block, which the caller frees once the frame is handled.
+bool decompress_frame(Connection *connection, Frame *frame, Frame *out_frame) {
+	int size = ppchat_get_decompressed_size(frame->payload, (int) frame->header.payload_size, PPCHAT_FRAME_MAX_PAYLOAD_SIZE);
+	if (frame->piece_size != frame->header.payload_size || size < 0) {
+		log_error("Client '%s' sent a malformed compressed frame. Disconnecting.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return false;
+	}
+
+	char *payload = (char *) ppchat_slab_allocate(size, NULL);
+	if (!payload) {
+		log_error("Couldn't allocate %d bytes to decompress a frame from '%s'.", size, connection->ip);
+		ppchat_reactor_close(connection, ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	if (!ppchat_decompress_payload(frame->payload, (int) frame->header.payload_size, payload, size)) {
+		log_error("Client '%s' sent a compressed frame that doesn't decompress. Disconnecting.", connection->ip);
+		ppchat_slab_free(payload, size);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return false;
+	}
+
+	ppchat_stats_add(SERVER_COUNTER_FRAMES_DECOMPRESSED, 1);
+	if (size > (int) frame->header.payload_size)
+		ppchat_stats_add(SERVER_COUNTER_COMPRESSION_SAVED_BYTES, (uint64_t) (size - (int) frame->header.payload_size));
+
+	*out_frame = *frame;
+	out_frame->header.flags &= ~FRAME_FLAG_COMPRESSED;
+	out_frame->header.payload_size = (uint32_t) size;
+	out_frame->payload = payload;
+	out_frame->piece_offset = 0;
+	out_frame->piece_size = (uint32_t) size;
+	return true;
+}
+
+// Copies what `/who` shows of the client into its shard's registry.
+void update_client_entry(Connection *connection) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	ConnectionRegistry *registry = &get_shard(connection)->registry;
+
+	int entry = ppchat_connection_registry_find(registry, client->handle);
+	if (entry < 0)
+		return;
+
+	registry->states[entry] = (uint8_t) connection->state;
+	registry->queue_sizes[entry] = (uint32_t) connection->send_queue_size;
+	registry->last_activity_ms[entry] = ppchat_timestamp_to_milliseconds(connection->last_receive_timestamp);
+}
 
-uint64_t g_total_message_bytes_received = 0;
-uint64_t g_total_message_bytes_sent = 0;
-uint64_t g_total_message_bytes_echoed_back = 0;
+int get_heartbeat_interval_ms() {
+	return max(g_idle_timeout_ms / 3, 1);
+}
+
+void on_connection_timer(Connection *connection, void *user_data) {
+	(void) user_data;
+	Client *client = static_cast<Client *>(connection->user_data);
+	update_client_entry(connection);
+
+	if (client->throttled) {
+		client->throttled = false;
+		ppchat_reactor_throttle_receive(connection, false);
+	}
 
-DWORD CALLBACK listen_for_incoming_network_data(void *context) {
-	SocketContext *ctx = static_cast<SocketContext *>(context);
+	if (!client->greeted) {
+		if (g_handshake_timeout_ms == 0)
+			return;
 
-	// Store the socket handle value locally for now.
-	// Socket socket = *ctx->socket;
+		// Throttling took the timer over for a while, the deadline still counts from the open.
+		uint64_t waited_ms = ppchat_timestamp_to_milliseconds(connection->reactor->dispatch_timestamp - client->open_timestamp);
+		if (waited_ms < (uint64_t) g_handshake_timeout_ms) {
+			ppchat_reactor_set_timer(connection, (uint32_t) (g_handshake_timeout_ms - waited_ms));
+			return;
+		}
 
-	if (ctx->socket->handle == INVALID_SOCKET) {
-		log_error("Couldn't listen for incoming network data because connection socket was invalid.");
-		return EXIT_FAILURE;
+		log("Client '%s' hasn't sent anything in %d ms since it connected. Disconnecting.", connection->ip, g_handshake_timeout_ms);
+		ppchat_stats_add(SERVER_COUNTER_HANDSHAKE_TIMEOUTS, 1);
+		ppchat_reactor_close(connection, WSAETIMEDOUT);
+		return;
 	}
 
-	char receive_buffer[PPCHAT_RECEIVE_BUFFER_SIZE + 1];
-	size_t receive_buffer_size = sizeof(receive_buffer);
-	int bytes_received = 0;
-	do {
-		memset(receive_buffer, 0, receive_buffer_size);
-		bytes_received = ppchat_receive(*ctx->socket, receive_buffer, receive_buffer_size - 1, NULL);
-		if (bytes_received == SOCKET_ERROR) {
+	if (g_idle_timeout_ms == 0)
+		return;
+
+	// Receives don't touch the timer, it's cheaper to find out how long the client has been
+	// quiet once the timer runs out than to push it back on every receive.
+	uint64_t quiet_ms = ppchat_timestamp_to_milliseconds(connection->reactor->dispatch_timestamp - connection->last_receive_timestamp);
+	if (quiet_ms >= (uint64_t) g_idle_timeout_ms) {
+		log("Client '%s' hasn't sent anything in %llu ms. Disconnecting.", connection->ip, quiet_ms);
+		ppchat_stats_add(SERVER_COUNTER_IDLE_TIMEOUTS, 1);
+		ppchat_reactor_close(connection, WSAETIMEDOUT);
+		return;
+	}
+
+	uint64_t heartbeat_interval_ms = (uint64_t) get_heartbeat_interval_ms();
+	uint64_t delay_ms = heartbeat_interval_ms - quiet_ms % heartbeat_interval_ms;
+	if (quiet_ms >= heartbeat_interval_ms) {
+		ppchat_reactor_send_frame(connection, FRAME_TYPE_PING, 0, NULL, 0);
+		ppchat_stats_add(SERVER_COUNTER_HEARTBEATS_SENT, 1);
+	}
 
-			/* An error occured while receiving network data. */
+	ppchat_reactor_set_timer(connection, (uint32_t) min(delay_ms, g_idle_timeout_ms - quiet_ms));
+}
 
-			int error = get_last_socket_error();
-			switch (error) {
-				case WSAECONNRESET: {
-					log("Connection with '%s' has been abruptly closed by remote peer.", ctx->client_ip);
-					break;
-				};
-				case WSAECONNABORTED: {
-					log("Connection with '%s' has been aborted by a local software problem.", ctx->client_ip);
-					break;
-				};
-				default: {
-					log_error("Couldn't receive network data. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-				};
-			}
+void handle_frame(Connection *connection, Frame *frame) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (!client->greeted) {
+		client->greeted = true;
+		if (g_idle_timeout_ms > 0)
+			ppchat_reactor_set_timer(connection, (uint32_t) get_heartbeat_interval_ms());
+		else
+			ppchat_reactor_cancel_timer(connection);
+	}
+
+	// Decoder takes frames as large as a file chunk and hands out streamed ones in pieces,
+	// which only file chunks may be. Everything else is handled whole.
+	if (frame->header.type != FRAME_TYPE_FILE_DATA && (frame->piece_size != frame->header.payload_size || frame->header.payload_size > (uint32_t) PPCHAT_FRAME_MAX_PAYLOAD_SIZE)) {
+		log_error("Client '%s' sent a frame of type %u and %u bytes that is streamed or too large. Disconnecting.", connection->ip, frame->header.type, frame->header.payload_size);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	// File chunks are decompressed straight into the file instead.
+	if ((frame->header.flags & FRAME_FLAG_COMPRESSED) && frame->header.type != FRAME_TYPE_FILE_DATA) {
+		Frame decompressed_frame;
+		if (decompress_frame(connection, frame, &decompressed_frame)) {
+			handle_frame(connection, &decompressed_frame);
+			ppchat_slab_free(decompressed_frame.payload, (int) decompressed_frame.header.payload_size);
+		}
+
+		return;
+	}
+
+	int size = (int) frame->piece_size;
+	char *data = frame->payload;
+
+	// Streamed frames come in pieces, count each frame once.
+	if (frame->piece_offset == 0) {
+		ppchat_stats_add(SERVER_COUNTER_MESSAGES_RECEIVED, 1);
+		ppchat_stats_record(SERVER_HISTOGRAM_MESSAGE_SIZE, frame->header.payload_size);
+	}
+
+	ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_RECEIVED, size);
+
+	switch (frame->header.type) {
+		case FRAME_TYPE_CHAT_MESSAGE: {
+			log("Received %d bytes from '%s'. Message: \"%.*s\"", size, connection->ip, size, data);
+			broadcast_message(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_JOIN_ROOM: {
+			handle_join_room(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_FILE_BEGIN: {
+			handle_file_begin(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_FILE_DATA: {
+			handle_file_data(connection, frame);
+			break;
+		};
+		case FRAME_TYPE_HISTORY: {
+			handle_history_request(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_SEARCH: {
+			handle_search_request(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_OPTIONS: {
+			handle_options(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_SUBSCRIBE: {
+			handle_subscribe(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_UNSUBSCRIBE: {
+			handle_unsubscribe(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_PUBLISH: {
+			handle_publish(connection, data, size);
+			break;
+		};
+		case FRAME_TYPE_PING: {
+			ppchat_reactor_send_frame(connection, FRAME_TYPE_PONG, 0, NULL, 0);
+			break;
+		};
+		case FRAME_TYPE_PONG: {
+			// Receiving it is all it takes.
+			break;
+		};
+		default: {
+			log_warning("Received frame of unknown type %u from '%s', ignoring it.", frame->header.type, connection->ip);
+		};
+	}
+}
+
+// Stops reading from the client for `delay_ms`, its timer picks it up again.
+void throttle_client(Connection *connection, RateLimitEntry *entry, RateLimitKind kind, uint32_t delay_ms, uint64_t now_ms) {
+	Client *client = static_cast<Client *>(connection->user_data);
+	client->throttled = true;
+	ppchat_reactor_throttle_receive(connection, true);
+	ppchat_reactor_set_timer(connection, delay_ms);
+
+	ppchat_stats_add(SERVER_COUNTER_CONNECTIONS_THROTTLED, 1);
+	ppchat_stats_add(SERVER_COUNTER_THROTTLED_MILLISECONDS, delay_ms);
+
+	if (now_ms - entry->last_throttled_ms >= SERVER_RATE_LIMIT_LOG_INTERVAL_MS) {
+		log_warning("Client '%s' sends too many %s, reading from it again in %u ms.", connection->ip, ppchat_rate_limit_kind_to_string(kind), delay_ms);
+		entry->last_throttled_ms = now_ms;
+	}
+}
+
+void on_connection_receive(Connection *connection, char *data, int size, void *user_data) {
+	Shard *shard = static_cast<Shard *>(user_data);
+	Client *client = static_cast<Client *>(connection->user_data);
+	client->bytes_received += size;
+
+	ppchat_frame_decoder_feed(&client->decoder, data, size);
+
+	// File chunks only count as bytes, there are lots of them and they come in pieces.
+	uint32_t messages_count = 0;
+	Frame frame;
+	while (connection->state == CONNECTION_STATE_OPEN && ppchat_frame_decoder_next(&client->decoder, &frame)) {
+		if (frame.piece_offset == 0 && frame.header.type != FRAME_TYPE_FILE_DATA)
+			messages_count += 1;
+
+		handle_frame(connection, &frame);
+	}
+
+	// Whatever has arrived is handled either way, the rates decide when to read more.
+	if (connection->state == CONNECTION_STATE_OPEN) {
+		uint64_t now_ms = ppchat_timestamp_to_milliseconds(connection->reactor->dispatch_timestamp);
+		RateLimitEntry *entry = ppchat_rate_limiter_get(&shard->rate_limiter, &connection->address, now_ms);
+
+		RateLimitKind kind = RATE_LIMIT_KIND_BYTES;
+		uint32_t delay_ms = ppchat_rate_limiter_take(&shard->rate_limiter, entry, RATE_LIMIT_KIND_BYTES, (uint32_t) size);
+		uint32_t messages_delay_ms = ppchat_rate_limiter_take(&shard->rate_limiter, entry, RATE_LIMIT_KIND_MESSAGES, messages_count);
+		if (messages_delay_ms > delay_ms) {
+			kind = RATE_LIMIT_KIND_MESSAGES;
+			delay_ms = messages_delay_ms;
+		}
+
+		if (delay_ms > 0)
+			throttle_client(connection, entry, kind, delay_ms, now_ms);
+	}
+
+	if (client->decoder.error != FRAME_DECODER_ERROR_NONE) {
+		log_error("Dropping client '%s' because of malformed data: %s", connection->ip, ppchat_frame_decoder_error_description(client->decoder.error));
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	if (connection->state == CONNECTION_STATE_OPEN)
+		receive_next_file_data_in_place(connection);
+
+	update_client_entry(connection);
+}
+
+void on_connection_close(Connection *connection, int error, void *user_data) {
+	(void) user_data;
+
+	switch (error) {
+		case 0: {
+			log("Connection with '%s' has been closed.", connection->ip);
+			break;
+		};
+		case WSAECONNRESET: {
+			log("Connection with '%s' has been abruptly closed by remote peer.", connection->ip);
+			break;
+		};
+		case WSAECONNABORTED: {
+			log("Connection with '%s' has been aborted by a local software problem.", connection->ip);
+			break;
+		};
+		case WSAETIMEDOUT: {
+			log("Connection with '%s' has timed out.", connection->ip);
+			break;
+		};
+		default: {
+			log_error("Connection with '%s' has been closed because of an error. Error: %d - %s", connection->ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		};
+	}
+
+	Client *client = static_cast<Client *>(connection->user_data);
+	if (client) {
+		uint64_t lifetime_ticks = ppchat_get_timestamp() - client->open_timestamp;
+		double lifetime_seconds = (double) lifetime_ticks / (double) ppchat_get_timestamp_frequency();
+		if (lifetime_seconds >= THROUGHPUT_MIN_CONNECTION_SECONDS) {
+			double bytes_per_second = (double) (client->bytes_received + client->bytes_sent) / lifetime_seconds;
+			ppchat_stats_record(SERVER_HISTOGRAM_CONNECTION_THROUGHPUT, (uint64_t) bytes_per_second);
+		}
+
+		// Receives into the file's pages are all done by now.
+		abort_file_receive(connection);
+		leave_room(connection);
+		while (client->topic_patterns_count > 0)
+			unsubscribe_from_topic(connection, client->topic_patterns_count - 1);
+
+		ppchat_connection_registry_remove(&get_shard(connection)->registry, client->handle);
+		ppchat_frame_decoder_destroy(&client->decoder);
+		ppchat_object_pool_free(&g_client_pool, client);
+		connection->user_data = NULL;
+	}
+}
+
+bool on_connection_accept(const sockaddr_in6 *address, void *user_data) {
+	Shard *shard = static_cast<Shard *>(user_data);
+	uint64_t now_ms = ppchat_timestamp_to_milliseconds(shard->reactor.dispatch_timestamp);
+
+	RateLimitEntry *entry = ppchat_rate_limiter_get(&shard->rate_limiter, address, now_ms);
+	uint32_t delay_ms = ppchat_rate_limiter_take(&shard->rate_limiter, entry, RATE_LIMIT_KIND_CONNECTIONS, 1);
+	if (delay_ms == 0)
+		return true;
+
+	if (now_ms - entry->last_throttled_ms >= SERVER_RATE_LIMIT_LOG_INTERVAL_MS) {
+		const void *ip_address = &address->sin6_addr;
+		if (address->sin6_family == AF_INET)
+			ip_address = &((const sockaddr_in *) address)->sin_addr;
+
+		char ip[INET6_ADDRSTRLEN];
+		if (ppchat_inet_ntop(address->sin6_family, ip_address, ip, sizeof(ip)) != ip)
+			strcpy(ip, "unknown");
+
+		log_warning("Too many connections from '%s', turning them away for %u ms.", ip, delay_ms);
+		entry->last_throttled_ms = now_ms;
+	}
+
+	return false;
+}
+
+// Logs how many clients the shard serves and the ones that have been quiet the longest.
+// Posted by `/who`.
+void list_clients(Reactor *reactor, void *argument, uint64_t value) {
+	(void) argument;
+	(void) value;
+
+	if (reactor->stopped)
+		return;
+
+	Shard *shard = static_cast<Shard *>(reactor->callbacks.user_data);
+	ConnectionRegistry *registry = &shard->registry;
+	uint64_t now_ms = ppchat_timestamp_to_milliseconds(ppchat_get_timestamp());
+
+	// Entries quiet the longest, oldest activity first. Only activity times are scanned.
+	int listed[SERVER_WHO_MAX_LISTED];
+	int listed_count = 0;
+	for (int entry = 0; entry < registry->count; entry += 1) {
+		uint64_t activity_ms = registry->last_activity_ms[entry];
+		if (listed_count == SERVER_WHO_MAX_LISTED && activity_ms >= registry->last_activity_ms[listed[listed_count - 1]])
+			continue;
 
-			ppchat_close_socket(ctx->socket);
-			
-		} else if (bytes_received == 0) {
+		// Once the list is full, the last one falls off.
+		int position = min(listed_count, SERVER_WHO_MAX_LISTED - 1);
+		while (position > 0 && registry->last_activity_ms[listed[position - 1]] > activity_ms) {
+			listed[position] = listed[position - 1];
+			position -= 1;
+		}
+
+		listed[position] = entry;
+		listed_count = min(listed_count + 1, SERVER_WHO_MAX_LISTED);
+	}
+
+	char message[4096];
+	int length = snprintf(message, sizeof(message), "Shard %d serves %d client%s.", shard->index, registry->count, (registry->count == 1) ? "" : "s");
+	for (int i = 0; i < listed_count && length < (int) sizeof(message); i += 1) {
+		int entry = listed[i];
+		Connection *connection = static_cast<Connection *>(registry->objects[entry]);
+		Client *client = static_cast<Client *>(connection->user_data);
+
+		char ip[INET6_ADDRSTRLEN];
+		ppchat_connection_registry_format_address(registry, entry, ip, sizeof(ip));
+
+		uint64_t quiet_ms = (now_ms > registry->last_activity_ms[entry]) ? now_ms - registry->last_activity_ms[entry] : 0;
+		length += snprintf(
+			message + length,
+			sizeof(message) - length,
+			"\n\t%016llx  %-39s  %-16s  %-7s  quiet %8.1f s  queued %6u KB",
+			registry->handles[entry],
+			ip,
+			(client->room) ? client->room->name : "-",
+			(registry->states[entry] == CONNECTION_STATE_OPEN) ? "open" : "closing",
+			(double) quiet_ms / 1000.0,
+			registry->queue_sizes[entry] / 1024
+		);
+	}
+
+	log("%s", message);
+}
 
-			/* Connection was gratefully closed. */
+// Disconnects the client of the handle, if it's still there. Posted by `/kick`.
+void kick_client(Reactor *reactor, void *argument, uint64_t value) {
+	(void) argument;
 
-			log("Connection with '%s' has been closed.", ctx->client_ip);
+	if (reactor->stopped)
+		return;
 
-			int disconnect_error;
-			bool disconnected = ppchat_disconnect(ctx->socket, SD_SEND, &disconnect_error);
-			if (!disconnected) {
-				log_error("Couldn't disconnect from '%s'. Error: %d - %s", ctx->client_ip, disconnect_error, get_error_description(disconnect_error, g_error_message, sizeof(g_error_message)));
+	Shard *shard = static_cast<Shard *>(reactor->callbacks.user_data);
+	ConnectionHandle handle = value;
+
+	Connection *connection = static_cast<Connection *>(ppchat_connection_registry_get(&shard->registry, handle));
+	if (!connection) {
+		log("There is no client with handle %llx, it might have disconnected already.", handle);
+		return;
+	}
+
+	if (connection->state != CONNECTION_STATE_OPEN) {
+		log("Client '%s' with handle %llx is disconnecting already.", connection->ip, handle);
+		return;
+	}
+
+	log("Disconnecting client '%s' with handle %llx.", connection->ip, handle);
+	ppchat_reactor_close(connection, 0);
+	update_client_entry(connection);
+}
+
+// Sends the frame to every client of the shard. Posted by `/announce` with a reference
+// to the frame for every shard.
+void announce_to_clients(Reactor *reactor, void *argument, uint64_t value) {
+	(void) value;
+
+	SharedBuffer *frame = static_cast<SharedBuffer *>(argument);
+	if (!reactor->stopped) {
+		ConnectionRegistry *registry = &static_cast<Shard *>(reactor->callbacks.user_data)->registry;
+
+		int recipients_count = 0;
+		for (int entry = 0; entry < registry->count; entry += 1) {
+			Connection *connection = static_cast<Connection *>(registry->objects[entry]);
+			if (connection->state == CONNECTION_STATE_OPEN && ppchat_reactor_send_shared(connection, frame)) {
+				static_cast<Client *>(connection->user_data)->bytes_sent += frame->size;
+				recipients_count += 1;
 			}
+		}
 
-		} else {
+		ppchat_stats_add(SERVER_COUNTER_MESSAGES_SENT, recipients_count);
+		ppchat_stats_add(SERVER_COUNTER_MESSAGE_BYTES_SENT, (uint64_t) recipients_count * (frame->size - PPCHAT_FRAME_HEADER_SIZE));
+	}
+
+	ppchat_shared_buffer_release(frame);
+}
+
+// Delivers a message that came from a peer to its room's members on every shard and stores
+// it in the history here as well. It never goes any further, the node it was sent on
+// relays it to every node that has members in the room.
+void deliver_peer_message(const char *room_name, const char *payload, int payload_size) {
+	SharedBuffer *frame = ppchat_create_frame_buffer(FRAME_TYPE_CHAT_MESSAGE, 0, payload, payload_size);
+	if (!frame) {
+		log_error("Couldn't allocate %d bytes for a message of room '%s' from a peer.", payload_size, room_name);
+		return;
+	}
+
+	SharedBuffer *compressed_frame = NULL;
+	if (g_features & PPCHAT_FEATURE_COMPRESSION) {
+		compressed_frame = ppchat_create_compressed_frame_buffer(FRAME_TYPE_CHAT_MESSAGE, 0, payload, payload_size);
+		if (compressed_frame)
+			ppchat_stats_add(SERVER_COUNTER_FRAMES_COMPRESSED, 1);
+	}
+
+	forward_to_other_shards(NULL, room_name, frame, compressed_frame, payload_size);
+
+	if (g_history_enabled && ppchat_history_append(&g_history, room_name, payload, payload_size) == 0)
+		log_warning("Couldn't store message from a peer in the history of room '%s'.", room_name);
+
+	ppchat_shared_buffer_release(frame);
+	if (compressed_frame)
+		ppchat_shared_buffer_release(compressed_frame);
+}
+
+// Returns false if the message with the origin ID has been seen before.
+bool accept_origin(uint32_t node_id, uint64_t sequence) {
+	for (int i = 0; i < g_federation.origins_count; i += 1) {
+		if (g_federation.origins[i].node_id == node_id)
+			return ppchat_origin_window_accept(&g_federation.origins[i], sequence);
+	}
+
+	// Duplicates of nodes past the limit can't be told apart, better deliver them than
+	// lose messages.
+	if (g_federation.origins_count == SERVER_FEDERATION_MAX_ORIGINS)
+		return true;
+
+	OriginWindow *window = &g_federation.origins[g_federation.origins_count];
+	g_federation.origins_count += 1;
+	window->node_id = node_id;
+	window->newest_sequence = sequence;
+	window->seen_mask = 1;
+	return true;
+}
 
-			/* Network data received. */
+void handle_peer_batch(Peer *peer, const char *payload, int payload_size) {
+	const char *cursor = payload;
+	const char *end = payload + payload_size;
 
-			g_total_messages_received += 1;
-			g_total_message_bytes_received += bytes_received;
+	PeerMessage message;
+	while (ppchat_decode_peer_message(&cursor, end, &message)) {
+		ppchat_stats_add(SERVER_COUNTER_PEER_MESSAGES_RECEIVED, 1);
 
-			// Null-terminate string.
-			int last_character_index = clamp(0, receive_buffer_size - 1, bytes_received);
-			receive_buffer[last_character_index] = '\0';
+		if (message.header.origin_node_id == g_federation.node_id || !accept_origin(message.header.origin_node_id, message.header.origin_sequence)) {
+			ppchat_stats_add(SERVER_COUNTER_PEER_DUPLICATES_DROPPED, 1);
+			continue;
+		}
+
+		char room_name[ROOM_NAME_MAX_SIZE];
+		if (!copy_peer_room_name(message.room_name, message.header.room_name_size, room_name)) {
+			log_warning("Node %u sent a message with a room name of %u bytes, dropping it.", peer->node_id, message.header.room_name_size);
+			continue;
+		}
+
+		// Messages sent before the peer heard that the room is gone from here.
+		FederatedRoom *room = find_federated_room(room_name);
+		if (!room || room->local_shards_count == 0)
+			continue;
+
+		deliver_peer_message(room_name, message.payload, (int) message.header.payload_size);
+	}
+
+	if (cursor != end) {
+		log_error("Dropping link with node %u at '%s' because of a malformed batch.", peer->node_id, peer->connection->ip);
+		ppchat_reactor_close(peer->connection, ERROR_INVALID_DATA);
+	}
+}
+
+void handle_peer_frame(Peer *peer, Frame *frame) {
+	Connection *connection = peer->connection;
+	int payload_size = (int) frame->header.payload_size;
+
+	if (peer->node_id == 0 && frame->header.type != FRAME_TYPE_PEER_HELLO) {
+		log_error("Dropping link with '%s', it didn't say hello first.", connection->ip);
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+		return;
+	}
+
+	switch (frame->header.type) {
+		case FRAME_TYPE_PEER_HELLO: {
+			PeerHello hello;
+			if (!PeerHelloSchema::decode(frame->payload, payload_size, &hello) || hello.node_id == 0) {
+				log_error("Dropping link with '%s' because of a malformed hello.", connection->ip);
+				ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+				return;
+			}
+
+			if (hello.node_id == g_federation.node_id) {
+				log_error("Dropping link with '%s', it's this node or one with the same ID %u.", connection->ip, hello.node_id);
+				ppchat_reactor_close(connection, 0);
+				return;
+			}
 
-			log("Received %d bytes from '%s'. Message: \"%s\"", bytes_received, ctx->client_ip, receive_buffer);
+			peer->node_id = hello.node_id;
+			log("Linked with node %u at '%s'.", peer->node_id, connection->ip);
+			break;
+		};
+		case FRAME_TYPE_PEER_SUBSCRIBE:
+		case FRAME_TYPE_PEER_UNSUBSCRIBE: {
+			char room_name[ROOM_NAME_MAX_SIZE];
+			if (!copy_peer_room_name(frame->payload, payload_size, room_name)) {
+				log_warning("Node %u sent a subscription with a room name of %d bytes, ignoring it.", peer->node_id, payload_size);
+				break;
+			}
 
-			if (g_echo_back) {
-				int bytes_sent = ppchat_send(*ctx->socket, receive_buffer, bytes_received, 0);
-				if (bytes_sent == SOCKET_ERROR) {
-					int error = get_last_socket_error();
-					log_error("Couldn't send message to '%s'. Error: %d - %s", ctx->client_ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-					ppchat_close_socket(ctx->socket);
+			uint64_t peer_bit = (uint64_t) 1 << (peer - g_federation.peers);
+			if (frame->header.type == FRAME_TYPE_PEER_SUBSCRIBE) {
+				FederatedRoom *room = find_or_create_federated_room(room_name);
+				if (room)
+					room->subscribed_peers |= peer_bit;
+				else
+					log_error("Couldn't allocate memory for room '%s', node %u won't get its messages.", room_name, peer->node_id);
+			} else {
+				FederatedRoom *room = find_federated_room(room_name);
+				if (room) {
+					room->subscribed_peers &= ~peer_bit;
+					release_federated_room(room);
 				}
+			}
+			break;
+		};
+		case FRAME_TYPE_PEER_BATCH: {
+			handle_peer_batch(peer, frame->payload, payload_size);
+			break;
+		};
+		default: {
+			log_warning("Node %u sent a frame of unknown type %u, ignoring it.", peer->node_id, frame->header.type);
+		};
+	}
+}
+
+bool on_peer_open(Connection *connection, void *user_data) {
+	(void) user_data;
+
+	Peer *peer = NULL;
+	for (int i = 0; i < SERVER_FEDERATION_MAX_PEERS && !peer; i += 1) {
+		if (!g_federation.peers[i].connection)
+			peer = &g_federation.peers[i];
+	}
+
+	if (!peer) {
+		log_error("Turning away node at '%s', this one is linked with %d already.", connection->ip, SERVER_FEDERATION_MAX_PEERS);
+		return false;
+	}
+
+	// Message that is as large as a member's frame allows goes in a batch of its own, along with its room.
+	memset(peer, 0, sizeof(*peer));
+	ppchat_frame_decoder_init(&peer->decoder, ppchat_peer_message_size(ROOM_NAME_MAX_SIZE - 1, PPCHAT_FRAME_MAX_PAYLOAD_SIZE));
+	peer->connection = connection;
+	peer->address = g_federation.dialed_address;
+	g_federation.dialed_address = NULL;
+	g_federation.linked_peers_count += 1;
+	connection->user_data = peer;
+
+	// Both sides say hello and tell the rooms they have members in, whoever made the link.
+	PeerHello hello;
+	hello.node_id = g_federation.node_id;
+
+	char hello_payload[PeerHelloSchema::size];
+	PeerHelloSchema::encode(hello, hello_payload);
+	ppchat_reactor_send_frame(connection, FRAME_TYPE_PEER_HELLO, 0, hello_payload, sizeof(hello_payload));
+
+	for (FederatedRoom *room = g_federation.rooms; room; room = room->next) {
+		if (room->local_shards_count > 0)
+			send_subscription(peer, room->name, true);
+	}
+
+	return true;
+}
+
+void on_peer_receive(Connection *connection, char *data, int size, void *user_data) {
+	(void) user_data;
+
+	Peer *peer = static_cast<Peer *>(connection->user_data);
+	ppchat_frame_decoder_feed(&peer->decoder, data, size);
+
+	Frame frame;
+	while (connection->state == CONNECTION_STATE_OPEN && ppchat_frame_decoder_next(&peer->decoder, &frame))
+		handle_peer_frame(peer, &frame);
+
+	if (peer->decoder.error != FRAME_DECODER_ERROR_NONE) {
+		log_error("Dropping link with node %u at '%s' because of malformed data: %s", peer->node_id, connection->ip, ppchat_frame_decoder_error_description(peer->decoder.error));
+		ppchat_reactor_close(connection, ERROR_INVALID_DATA);
+	}
+}
+
+void on_peer_close(Connection *connection, int error, void *user_data) {
+	(void) user_data;
+
+	Peer *peer = static_cast<Peer *>(connection->user_data);
+	if (!peer)
+		return;
+
+	if (error == 0) {
+		log("Link with node %u at '%s' has been closed.", peer->node_id, connection->ip);
+	} else {
+		log_warning("Link with node %u at '%s' has been closed. Error: %d - %s", peer->node_id, connection->ip, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	}
+
+	// Rooms it had members in don't get its messages anymore.
+	uint64_t peer_bit = (uint64_t) 1 << (peer - g_federation.peers);
+	FederatedRoom *room = g_federation.rooms;
+	while (room) {
+		FederatedRoom *next = room->next;
+		room->subscribed_peers &= ~peer_bit;
+		release_federated_room(room);
+		room = next;
+	}
+
+	if (peer->batch)
+		ppchat_shared_buffer_release(peer->batch);
+
+	// Dialer makes the link again.
+	if (peer->address)
+		InterlockedExchange(&peer->address->linked, 0);
+
+	ppchat_frame_decoder_destroy(&peer->decoder);
+	memset(peer, 0, sizeof(*peer));
+	g_federation.linked_peers_count -= 1;
+	connection->user_data = NULL;
+}
+
+// Whatever the round gathered for the peers goes out now, a batch per peer.
+void on_federation_round_end(Reactor *reactor, void *user_data) {
+	(void) reactor;
+	(void) user_data;
+
+	for (int i = 0; i < SERVER_FEDERATION_MAX_PEERS; i += 1) {
+		if (g_federation.peers[i].batch)
+			flush_peer_batch(&g_federation.peers[i]);
+	}
+}
+
+// Takes over a link the dialer has made. Posted by the dialer with the socket.
+void add_peer_link(Reactor *reactor, void *argument, uint64_t value) {
+	PeerAddress *address = static_cast<PeerAddress *>(argument);
+
+	Socket socket;
+	socket.handle = (SOCKET) value;
+	if (reactor->stopped) {
+		ppchat_close_socket(&socket);
+		return;
+	}
 
-				g_total_messages_sent += 1;
-				g_total_message_bytes_sent += bytes_sent;
+	g_federation.dialed_address = address;
 
-				g_total_messages_echoed_back += 1;
-				g_total_message_bytes_echoed_back += bytes_sent;
+	int error = 0;
+	Connection *connection = ppchat_reactor_add_socket(reactor, socket, &error);
+
+	// No peer took the address, the link is gone already.
+	if (g_federation.dialed_address) {
+		g_federation.dialed_address = NULL;
+		InterlockedExchange(&address->linked, 0);
+	}
+
+	if (!connection)
+		log_warning("Couldn't take over the link with node at '%s:%s'. Error: %d - %s", address->host, address->port, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+}
+
+// Connecting blocks, so links to the `-peer` nodes are made on a thread of their own and
+// handed over to the federation. Nodes that are down are tried again until they're up.
+DWORD CALLBACK run_peer_dialer(void *context) {
+	(void) context;
+
+	do {
+		for (int i = 0; i < g_federation.addresses_count; i += 1) {
+			PeerAddress *address = &g_federation.addresses[i];
+			if (InterlockedCompareExchange(&address->linked, 1, 0) != 0)
+				continue;
+
+			int error = 0;
+			Socket socket = ppchat_connect(address->host, address->port, &error);
+			if (socket.handle == INVALID_SOCKET) {
+				if (!address->unreachable_reported) {
+					log_warning("Couldn't link with node at '%s:%s', trying again every %lu ms. Error: %d - %s", address->host, address->port, SERVER_FEDERATION_REDIAL_INTERVAL_MS, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+					address->unreachable_reported = true;
+				}
 
-				log("Sent %d bytes to '%s'. Message: \"%s\"", bytes_sent, ctx->client_ip, receive_buffer);
+				InterlockedExchange(&address->linked, 0);
+				continue;
 			}
 
+			address->unreachable_reported = false;
+			if (!ppchat_reactor_post(&g_federation.reactor, add_peer_link, address, (uint64_t) socket.handle)) {
+				ppchat_close_socket(&socket);
+				InterlockedExchange(&address->linked, 0);
+			}
 		}
-	} while (bytes_received > 0 && !g_quit);
+	} while (WaitForSingleObject(g_federation.stop_event, SERVER_FEDERATION_REDIAL_INTERVAL_MS) == WAIT_TIMEOUT);
+
+	return EXIT_SUCCESS;
 }
 
-DWORD CALLBACK listen_for_incoming_connections(void *context) {
-	(void)context;
+// Takes "<host>:<port>", IPv6 hosts in brackets.
+bool parse_peer_address(const char *text, PeerAddress *out_address) {
+	const char *separator = strrchr(text, ':');
+	if (!separator || separator == text || separator[1] == '\0')
+		return false;
+
+	const char *host = text;
+	int host_size = (int) (separator - text);
+	if (host[0] == '[' && host[host_size - 1] == ']') {
+		host += 1;
+		host_size -= 2;
+	}
 
-	addrinfo hints = { };
+	int port_size = (int) strlen(separator + 1);
+	if (host_size <= 0 || host_size >= SERVER_PEER_HOST_MAX_SIZE || port_size >= SERVER_PEER_PORT_MAX_SIZE)
+		return false;
 
-	// ai - address info.
-	hints.ai_family = AF_INET6;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+	memset(out_address, 0, sizeof(*out_address));
+	memcpy(out_address->host, host, host_size);
+	memcpy(out_address->port, separator + 1, port_size);
+	return true;
+}
 
-	// MSDN: "Setting the AI_PASSIVE flag indicates the caller intends to
-	// use the returned socket address structure in a call to the bind function."
-	hints.ai_flags = AI_PASSIVE;
+DWORD CALLBACK run_reactor(void *context) {
+	Reactor *reactor = static_cast<Reactor *>(context);
+	ppchat_reactor_run(reactor);
+	return EXIT_SUCCESS;
+}
 
-	addrinfo *server;
-	int server_address_info_result = ppchat_getaddrinfo(
-		/* Node name (IP)      */ NULL,
-		/* Service name (port) */ PPCHAT_DEFAULT_PORT,
-		/* Address info hints  */ &hints,
-		/* Result array        */ &server  // Iteration through array of results is done by result->ai_next.
-	);
-	if (server_address_info_result != 0) {
-		exit_with_error("Couldn't get server address info. Error: %d - %s", server_address_info_result, get_error_description(server_address_info_result, g_error_message, sizeof(g_error_message)));
+int main(int arguments_count, char *arguments[]) {
+	// Lines are formatted and printed by a background thread, so logging from
+	// the reactor thread doesn't hold up network I/O.
+	if (ppchat_log_start())
+		atexit(ppchat_log_stop);
+	else
+		log_warning("Couldn't start the logging thread, logging synchronously.");
+
+	ReactorOptions options = { };
+	options.engine = REACTOR_ENGINE_IOCP;
+
+	// Most chat connections sit idle most of the time.
+	options.release_idle_receive_buffers = true;
+
+	// A client that stops reading loses messages instead of making the server hold them.
+	options.send_queue_limit = SERVER_DEFAULT_SEND_QUEUE_LIMIT;
+	options.slow_consumer_policy = SLOW_CONSUMER_POLICY_DROP;
+
+	bool large_pages = false;
+	int reactors_count = 1;
+	int history_flush_interval_ms = PPCHAT_HISTORY_DEFAULT_FLUSH_INTERVAL_MS;
+	bool pin_reactors = false;
+
+	RateLimitOptions rate_limit_options = { };
+	rate_limit_options.limits[RATE_LIMIT_KIND_CONNECTIONS].per_second = SERVER_DEFAULT_CONNECTIONS_PER_SECOND;
+	rate_limit_options.limits[RATE_LIMIT_KIND_MESSAGES].per_second = SERVER_DEFAULT_MESSAGES_PER_SECOND;
+	rate_limit_options.limits[RATE_LIMIT_KIND_BYTES].per_second = SERVER_DEFAULT_BYTES_PER_SECOND;
+
+	const char *port = PPCHAT_DEFAULT_PORT;
+	const char *peer_port = NULL;
+
+	// Usage: ppchat-server [-engine <iocp|rio>] [-reactors <count>] [-pin] [-large_pages] [-send_queue_limit <KB>] [-slow_consumer <drop|disconnect>] [-history_flush <ms>] [-handshake_timeout <ms>] [-idle_timeout <ms>] [-connection_rate <per second>] [-message_rate <per second>] [-byte_rate <KB per second>] [-no_history] [-no_compression] [-port <port>] [-node <ID>] [-peer_port <port>] [-peer <host>:<port>]...
+	for (int i = 1; i < arguments_count; i += 1) {
+		if (strcmp(arguments[i], "-engine") == 0 && i + 1 < arguments_count) {
+			i += 1;
+			if (!ppchat_reactor_engine_from_name(arguments[i], &options.engine))
+				exit_with_error("Unknown reactor engine '%s'. Use 'iocp' or 'rio'.", arguments[i]);
+		} else if (strcmp(arguments[i], "-reactors") == 0 && i + 1 < arguments_count) {
+			// Zero means one per CPU core.
+			i += 1;
+			reactors_count = atoi(arguments[i]);
+		} else if (strcmp(arguments[i], "-pin") == 0) {
+			pin_reactors = true;
+		} else if (strcmp(arguments[i], "-large_pages") == 0) {
+			large_pages = true;
+		} else if (strcmp(arguments[i], "-send_queue_limit") == 0 && i + 1 < arguments_count) {
+			// Zero means no limit.
+			i += 1;
+			options.send_queue_limit = max(atoi(arguments[i]), 0) * 1024;
+		} else if (strcmp(arguments[i], "-slow_consumer") == 0 && i + 1 < arguments_count) {
+			i += 1;
+			if (strcmp(arguments[i], "drop") == 0)
+				options.slow_consumer_policy = SLOW_CONSUMER_POLICY_DROP;
+			else if (strcmp(arguments[i], "disconnect") == 0)
+				options.slow_consumer_policy = SLOW_CONSUMER_POLICY_DISCONNECT;
+			else
+				exit_with_error("Unknown slow consumer policy '%s'. Use 'drop' or 'disconnect'.", arguments[i]);
+		} else if (strcmp(arguments[i], "-history_flush") == 0 && i + 1 < arguments_count) {
+			// How much history a crash can lose, in milliseconds.
+			i += 1;
+			history_flush_interval_ms = max(atoi(arguments[i]), 1);
+		} else if (strcmp(arguments[i], "-handshake_timeout") == 0 && i + 1 < arguments_count) {
+			// Zero means no deadline.
+			i += 1;
+			g_handshake_timeout_ms = max(atoi(arguments[i]), 0);
+		} else if (strcmp(arguments[i], "-idle_timeout") == 0 && i + 1 < arguments_count) {
+			// Zero means neither heartbeats nor idle timeouts.
+			i += 1;
+			g_idle_timeout_ms = max(atoi(arguments[i]), 0);
+		} else if (strcmp(arguments[i], "-connection_rate") == 0 && i + 1 < arguments_count) {
+			// Rates of zero mean no limit.
+			i += 1;
+			rate_limit_options.limits[RATE_LIMIT_KIND_CONNECTIONS].per_second = (uint32_t) max(atoi(arguments[i]), 0);
+		} else if (strcmp(arguments[i], "-message_rate") == 0 && i + 1 < arguments_count) {
+			i += 1;
+			rate_limit_options.limits[RATE_LIMIT_KIND_MESSAGES].per_second = (uint32_t) max(atoi(arguments[i]), 0);
+		} else if (strcmp(arguments[i], "-byte_rate") == 0 && i + 1 < arguments_count) {
+			i += 1;
+			rate_limit_options.limits[RATE_LIMIT_KIND_BYTES].per_second = (uint32_t) max(atoi(arguments[i]), 0) * 1024;
+		} else if (strcmp(arguments[i], "-no_history") == 0) {
+			g_history_enabled = false;
+		} else if (strcmp(arguments[i], "-no_compression") == 0) {
+			g_features &= ~PPCHAT_FEATURE_COMPRESSION;
+		} else if (strcmp(arguments[i], "-port") == 0 && i + 1 < arguments_count) {
+			// Clients connect to it.
+			i += 1;
+			port = arguments[i];
+		} else if (strcmp(arguments[i], "-node") == 0 && i + 1 < arguments_count) {
+			// Has to be unique among the linked nodes, a random one is picked otherwise.
+			i += 1;
+			g_federation.node_id = (uint32_t) strtoul(arguments[i], NULL, 10);
+		} else if (strcmp(arguments[i], "-peer_port") == 0 && i + 1 < arguments_count) {
+			// Other nodes link with this one on it.
+			i += 1;
+			peer_port = arguments[i];
+		} else if (strcmp(arguments[i], "-peer") == 0 && i + 1 < arguments_count) {
+			// Node this one links with, can be given several times.
+			i += 1;
+			if (g_federation.addresses_count == SERVER_FEDERATION_MAX_PEERS)
+				exit_with_error("Too many peers, a node can be linked with %d at most.", SERVER_FEDERATION_MAX_PEERS);
+
+			if (!parse_peer_address(arguments[i], &g_federation.addresses[g_federation.addresses_count]))
+				exit_with_error("Peer '%s' isn't '<host>:<port>'.", arguments[i]);
+
+			g_federation.addresses_count += 1;
+		} else {
+			exit_with_error("Unknown argument '%s'. Usage: ppchat-server [-engine <iocp|rio>] [-reactors <count>] [-pin] [-large_pages] [-send_queue_limit <KB>] [-slow_consumer <drop|disconnect>] [-history_flush <ms>] [-handshake_timeout <ms>] [-idle_timeout <ms>] [-connection_rate <per second>] [-message_rate <per second>] [-byte_rate <KB per second>] [-no_history] [-no_compression] [-port <port>] [-node <ID>] [-peer_port <port>] [-peer <host>:<port>]...", arguments[i]);
+		}
 	}
 
-	Socket listen_socket = ppchat_create_socket(server->ai_family, server->ai_socktype, server->ai_protocol);
-	if (listen_socket.handle == INVALID_SOCKET) {
-		int error = get_last_socket_error();
-		exit_with_error("Couldn't create listen socket. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	if (reactors_count <= 0) {
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		reactors_count = (int) system_info.dwNumberOfProcessors;
 	}
 
-	// MSDN: "IPV6_V6ONLY - When this value is zero, a socket created for the AF_INET6 address family
-	// can be used to send and receive packets to and from an IPv6 address or an IPv4 address.
-	// Note that the ability to interact with an IPv4 address requires the use of IPv4 mapped addresses."
-	DWORD ipv6_only = 0;
-	int ipv6_only_set_result = ppchat_set_socket_option(listen_socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &ipv6_only, sizeof(ipv6_only));
-	if (ipv6_only_set_result == SOCKET_ERROR) {
-		int error = get_last_socket_error();
-		log_error("Couldn't turn off IPV6_V6ONLY. This means that no connection to IPv4 address can be made. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	// Affinity masks only reach the first 64 processors of a processor group anyway.
+	reactors_count = min(reactors_count, SERVER_MAX_SHARDS);
+
+	if (large_pages && !ppchat_pool_enable_large_pages())
+		log_warning("Couldn't enable large pages, the account needs the 'Lock pages in memory' privilege. Using regular pages.");
+
+	ppchat_object_pool_init(&g_client_pool, sizeof(Client), "clients");
+
+	if (g_history_enabled) {
+		HistoryOptions history_options = { };
+		history_options.folder = HISTORY_FOLDER;
+		history_options.flush_interval_ms = history_flush_interval_ms;
+
+		int history_error = 0;
+		if (!ppchat_history_open(&g_history, &history_options, &history_error)) {
+			exit_with_error("Couldn't open history in folder '%s'. Error: %d - %s", HISTORY_FOLDER, history_error, get_error_description(history_error, g_error_message, sizeof(g_error_message)));
+		}
+
+		HistoryStats history_stats;
+		ppchat_history_get_stats(&g_history, &history_stats);
+		log("History has %llu messages of %llu rooms in %llu segments.", (history_stats.first_sequence > 0) ? history_stats.last_sequence - history_stats.first_sequence + 1 : 0, history_stats.rooms_count, history_stats.segments_count);
+
+		// Search index runs are only mapped once a query needs them, so this doesn't wait
+		// for anything. Messages the index doesn't have yet are indexed in the background.
+		SearchOptions search_options = { };
+		search_options.folder = HISTORY_FOLDER;
+
+		int search_error = 0;
+		if (!ppchat_search_open(&g_search, &g_history, &search_options, &search_error)) {
+			exit_with_error("Couldn't open search index in folder '%s'. Error: %d - %s", HISTORY_FOLDER, search_error, get_error_description(search_error, g_error_message, sizeof(g_error_message)));
+		}
 	}
 
-	int bind_result = ppchat_bind(listen_socket, server->ai_addr, (int) server->ai_addrlen);
-	if (bind_result == SOCKET_ERROR) {
-		int error = get_last_socket_error();
-		exit_with_error("Couldn't bind listen socket. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	if (!CreateDirectoryA(FILE_SAVE_FOLDER, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		int error = GetLastError();
+		log_warning("Couldn't create folder '%s' for received files. Error: %d - %s", FILE_SAVE_FOLDER, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
 	}
 
-	ppchat_freeaddrinfo(server);
+	for (int kind = 0; kind < RATE_LIMIT_KIND_COUNT; kind += 1)
+		rate_limit_options.limits[kind].burst = 2 * rate_limit_options.limits[kind].per_second;
+
+	ReactorCallbacks callbacks = { };
+	callbacks.on_accept = on_connection_accept;
+	callbacks.on_open = on_connection_open;
+	callbacks.on_receive = on_connection_receive;
+	callbacks.on_close = on_connection_close;
+	callbacks.on_timer = on_connection_timer;
+
+	// The first reactor listens and hands accepted connections out to all of them, itself included.
+	Reactor *accept_targets[SERVER_MAX_SHARDS];
+	for (int i = 0; i < reactors_count; i += 1)
+		accept_targets[i] = &g_shards[i].reactor;
+
+	g_shards_count = reactors_count;
+	for (int i = 0; i < g_shards_count; i += 1) {
+		Shard *shard = &g_shards[i];
+		shard->index = i;
+
+		ReactorOptions shard_options = options;
+		if (i == 0 && g_shards_count > 1) {
+			shard_options.accept_targets = accept_targets;
+			shard_options.accept_targets_count = g_shards_count;
+		}
 
-	int listen_result = ppchat_listen(listen_socket, SOMAXCONN);
-	if (listen_result == SOCKET_ERROR) {
-		int error = get_last_socket_error();
-		exit_with_error("Couldn't listen on listen socket. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-	}
+		callbacks.user_data = shard;
 
-	while (!g_quit) {
-		sockaddr_in6 client_address = { };
-		int client_address_size = sizeof(client_address);
-		Socket client_socket = ppchat_accept(listen_socket, (sockaddr *) &client_address, &client_address_size);
-		if (client_socket.handle == INVALID_SOCKET) {
-			int error = get_last_socket_error();
-			exit_with_error("Couldn't accept client connection. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		if (!ppchat_rate_limiter_create(&shard->rate_limiter, &rate_limit_options))
+			exit_with_error("Couldn't allocate rate limits.");
+
+		ppchat_topic_router_init(&shard->topics);
+		ppchat_topic_recipients_init(&shard->topic_recipients);
+
+		// Shard index is the registry's tag, which is how a handle finds its way back.
+		int registry_error = 0;
+		if (!ppchat_connection_registry_create(&shard->registry, 0, (uint8_t) i, &registry_error)) {
+			exit_with_error("Couldn't reserve memory for the client registry. Error: %d - %s", registry_error, get_error_description(registry_error, g_error_message, sizeof(g_error_message)));
 		}
 
-		char client_ip[INET6_ADDRSTRLEN] = { };
-		const char *client_ip_result = ppchat_inet_ntop(AF_INET6, &client_address.sin6_addr, client_ip, sizeof(client_ip));
-		if (client_ip_result != client_ip) {
-			int error = get_last_socket_error();
-			exit_with_error("Couldn't convert client network address to text form. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		int reactor_error = 0;
+		bool reactor_created = ppchat_reactor_create(&shard->reactor, &shard_options, &callbacks, &reactor_error);
+		if (!reactor_created) {
+			exit_with_error("Couldn't create %s reactor. Error: %d - %s", ppchat_reactor_engine_name(options.engine), reactor_error, get_error_description(reactor_error, g_error_message, sizeof(g_error_message)));
 		}
+	}
+
+	int listen_error = 0;
+	bool listening = ppchat_reactor_listen(&g_shards[0].reactor, port, &listen_error);
+	if (!listening) {
+		exit_with_error("Couldn't listen on port %s. Error: %d - %s", port, listen_error, get_error_description(listen_error, g_error_message, sizeof(g_error_message)));
+	}
 
-		log("New connection from client '%s'.", client_ip);
+	// Rooms of the shards only tell the federation about themselves once it's there, so
+	// it's set up before any shard runs.
+	g_federation.enabled = (peer_port || g_federation.addresses_count > 0);
+	if (g_federation.enabled) {
+		while (g_federation.node_id == 0)
+			g_federation.node_id = (uint32_t) (ppchat_get_timestamp() * 2654435761u) ^ GetCurrentProcessId();
+
+		// Sequences of a node that restarts go on past the ones it sent before.
+		g_federation.next_sequence = (uint64_t) time(NULL) << 20;
+
+		ReactorOptions federation_options = { };
+		federation_options.engine = REACTOR_ENGINE_IOCP;
+		federation_options.send_queue_limit = SERVER_FEDERATION_SEND_QUEUE_LIMIT;
+		federation_options.slow_consumer_policy = SLOW_CONSUMER_POLICY_DROP;
+
+		ReactorCallbacks federation_callbacks = { };
+		federation_callbacks.on_open = on_peer_open;
+		federation_callbacks.on_receive = on_peer_receive;
+		federation_callbacks.on_close = on_peer_close;
+		federation_callbacks.on_round_end = on_federation_round_end;
+
+		int reactor_error = 0;
+		if (!ppchat_reactor_create(&g_federation.reactor, &federation_options, &federation_callbacks, &reactor_error)) {
+			exit_with_error("Couldn't create the federation reactor. Error: %d - %s", reactor_error, get_error_description(reactor_error, g_error_message, sizeof(g_error_message)));
+		}
 
-		SocketContext listen_context;
-		listen_context.socket = &client_socket;
-		memcpy(listen_context.client_ip, client_ip, sizeof(client_ip));
+		if (peer_port && !ppchat_reactor_listen(&g_federation.reactor, peer_port, &listen_error)) {
+			exit_with_error("Couldn't listen for peers on port %s. Error: %d - %s", peer_port, listen_error, get_error_description(listen_error, g_error_message, sizeof(g_error_message)));
+		}
 
-		DWORD listen_thread_id;
-		HANDLE listen_thread = CreateThread(
+		DWORD federation_thread_id;
+		g_federation.thread = CreateThread(
 			/* Thread attributes   */ NULL,
 			/* Stack size          */ 0,
-			/* Calling procedure   */ listen_for_incoming_network_data,
-			/* Procedure argument  */ &listen_context,
+			/* Calling procedure   */ run_reactor,
+			/* Procedure argument  */ &g_federation.reactor,
 			/* Creation flags      */ NULL,
-			/* Thread ID           */ &listen_thread_id
+			/* Thread ID           */ &federation_thread_id
 		);
+		if (!g_federation.thread) {
+			int error = GetLastError();
+			exit_with_error("Couldn't create federation thread. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+
+		if (g_federation.addresses_count > 0) {
+			g_federation.stop_event = CreateEventA(
+				/* Event attributes */ NULL,
+				/* Manual reset     */ TRUE,
+				/* Initial state    */ FALSE,
+				/* Name             */ NULL
+			);
+
+			DWORD dialer_thread_id;
+			if (g_federation.stop_event) {
+				g_federation.dialer_thread = CreateThread(
+					/* Thread attributes   */ NULL,
+					/* Stack size          */ 0,
+					/* Calling procedure   */ run_peer_dialer,
+					/* Procedure argument  */ NULL,
+					/* Creation flags      */ NULL,
+					/* Thread ID           */ &dialer_thread_id
+				);
+			}
+
+			if (!g_federation.dialer_thread) {
+				int error = GetLastError();
+				exit_with_error("Couldn't create peer dialer thread. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			}
+		}
+
+		log("Node %u links with %d peer%s%s%s.", g_federation.node_id, g_federation.addresses_count, (g_federation.addresses_count == 1) ? "" : "s", (peer_port) ? " and takes links on port " : "", (peer_port) ? peer_port : "");
 	}
 
-	return EXIT_SUCCESS;
-}
+	// All network I/O of a shard runs on its single thread, no matter how many clients it serves.
+	for (int i = 0; i < g_shards_count; i += 1) {
+		Shard *shard = &g_shards[i];
 
-int main(int arguments_count, char *arguments[]) {
-	DWORD listen_thread_id;
-	HANDLE listen_thread = CreateThread(
-		/* Thread attributes   */ NULL,
-		/* Stack size          */ 0,
-		/* Calling procedure   */ listen_for_incoming_connections,
-		/* Procedure argument  */ NULL,
-		/* Creation flags      */ NULL,
-		/* Thread ID           */ &listen_thread_id
-	);
+		DWORD reactor_thread_id;
+		shard->thread = CreateThread(
+			/* Thread attributes   */ NULL,
+			/* Stack size          */ 0,
+			/* Calling procedure   */ run_reactor,
+			/* Procedure argument  */ &shard->reactor,
+			/* Creation flags      */ NULL,
+			/* Thread ID           */ &reactor_thread_id
+		);
+		if (!shard->thread) {
+			int error = GetLastError();
+			exit_with_error("Couldn't create reactor thread. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+
+		if (pin_reactors && !SetThreadAffinityMask(shard->thread, (DWORD_PTR) 1 << i)) {
+			int error = GetLastError();
+			log_warning("Couldn't pin reactor %d to its CPU core. Error: %d - %s", i, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+	}
 
 	g_start_time = time(NULL);
 
@@ -214,7 +2445,7 @@ int main(int arguments_count, char *arguments[]) {
 		size_t written = 0;
 		tm *internal_time_structure = localtime(&g_start_time);
 		tm time_structure = *internal_time_structure;
-		log("Server have been started at %s.", ppchat_get_date_and_time(time, sizeof(time), &time_structure, &written));
+		log("Server have been started at %s using %s reactor engine on %d reactor%s%s.", ppchat_get_date_and_time(time, sizeof(time), &time_structure, &written), ppchat_reactor_engine_name(options.engine), g_shards_count, (g_shards_count == 1) ? "" : "s", (pin_reactors) ? " pinned to CPU cores" : "");
 	}
 
 	while (!g_quit) {
@@ -264,12 +2495,102 @@ int main(int arguments_count, char *arguments[]) {
 				tm time_structure = *internal_time_structure;
 				ppchat_get_date_and_time(start_time_string, sizeof(start_time_string), &time_structure, &written);
 
-				char status_message[2048];
-				snprintf(
+				// Counters of other threads, read without synchronization. Rooms with members
+				// on several shards are counted once per shard.
+				uint64_t system_calls_count = 0;
+				uint64_t open_connections_count = 0;
+				uint64_t total_connections_count = 0;
+				uint64_t handed_over_connections_count = 0;
+				uint64_t rooms_count = 0;
+				uint64_t topic_subscriptions_count = 0;
+				uint64_t topic_nodes_count = 0;
+				uint64_t queued_bytes_count = 0;
+				uint64_t max_send_queue_size = 0;
+				uint64_t congested_connections_count = 0;
+				uint64_t dropped_frames_count = 0;
+				uint64_t dropped_bytes_count = 0;
+				uint64_t slow_consumers_disconnected_count = 0;
+				uint64_t armed_timers_count = 0;
+				uint64_t fired_timers_count = 0;
+				uint64_t refused_connections_count = 0;
+				uint64_t rate_limit_addresses_count = 0;
+				uint64_t rate_limit_evicted_count = 0;
+				SlabStats connection_pools = { };
+				for (int i = 0; i < g_shards_count; i += 1) {
+					Reactor *reactor = &g_shards[i].reactor;
+					system_calls_count += reactor->system_calls_count;
+					open_connections_count += reactor->open_connections_count;
+					total_connections_count += reactor->total_connections_count;
+					handed_over_connections_count += reactor->handed_over_connections_count;
+					rooms_count += g_shards[i].rooms_count;
+					topic_subscriptions_count += g_shards[i].topics.subscriptions_count;
+					topic_nodes_count += g_shards[i].topics.nodes_count;
+					queued_bytes_count += reactor->queued_bytes_count;
+					max_send_queue_size = max(max_send_queue_size, reactor->max_send_queue_size);
+					congested_connections_count += reactor->congested_connections_count;
+					dropped_frames_count += reactor->dropped_frames_count;
+					dropped_bytes_count += reactor->dropped_bytes_count;
+					slow_consumers_disconnected_count += reactor->slow_consumers_disconnected_count;
+					armed_timers_count += reactor->timers.armed_count;
+					fired_timers_count += reactor->timers.fired_count;
+					refused_connections_count += reactor->refused_connections_count;
+					rate_limit_addresses_count += g_shards[i].rate_limiter.entries_count;
+					rate_limit_evicted_count += g_shards[i].rate_limiter.evicted_count;
+
+					SlabStats pool_stats;
+					ppchat_object_pool_get_stats(&reactor->connection_pool, &pool_stats);
+					connection_pools.reserved_size += pool_stats.reserved_size;
+					connection_pools.used_size += pool_stats.used_size;
+					connection_pools.large_page_slabs_count += pool_stats.large_page_slabs_count;
+				}
+
+				HistoryStats history = { };
+				SearchStats search = { };
+				if (g_history_enabled) {
+					ppchat_history_get_stats(&g_history, &history);
+					ppchat_search_get_stats(&g_search, &search);
+				}
+
+				SlabStats client_pool;
+				SlabStats slabs;
+				ppchat_object_pool_get_stats(&g_client_pool, &client_pool);
+				ppchat_slab_get_stats(&slabs);
+
+				// Read without synchronization as well.
+				char federation_status[256];
+				if (g_federation.enabled) {
+					snprintf(
+						federation_status,
+						sizeof(federation_status),
+						"node %u, %d peers linked\n"
+						"\t\t    relayed: %llu messages in %llu batches\n"
+						"\t\t   received: %llu messages, %llu duplicates dropped",
+						g_federation.node_id,
+						g_federation.linked_peers_count,
+						ppchat_stats_get_counter(SERVER_COUNTER_PEER_MESSAGES_RELAYED),
+						ppchat_stats_get_counter(SERVER_COUNTER_PEER_BATCHES_SENT),
+						ppchat_stats_get_counter(SERVER_COUNTER_PEER_MESSAGES_RECEIVED),
+						ppchat_stats_get_counter(SERVER_COUNTER_PEER_DUPLICATES_DROPPED)
+					);
+				} else {
+					snprintf(federation_status, sizeof(federation_status), "disabled");
+				}
+
+				char status_message[4096];
+				int status_length = snprintf(
 					status_message,
 					sizeof(status_message),
 					"Server have been started at %s and is running for %s.\n"
 					"Network info:\n"
+					"\tReactor engine: %s\n"
+					"\tReactors: %d\n"
+					"\tSystem calls: %llu\n"
+					"\tConnections:\n"
+					"\t\t       open: %llu\n"
+					"\t\t      total: %llu\n"
+					"\t\thanded over: %llu\n"
+					"\tRooms: %llu\n"
+					"\tTopics: %llu subscriptions in %llu trie nodes\n"
 					"\tMessages:\n"
 					"\t\t   received: %llu\n"
 					"\t\t       sent: %llu\n"
@@ -278,18 +2599,143 @@ int main(int arguments_count, char *arguments[]) {
 					"\t\t   received: %llu\n"
 					"\t\t       sent: %llu\n"
 					"\t\techoed back: %llu\n"
-					"Echo back is %s.",
+					"\tCompression:\n"
+					"\t\t  compressed: %llu frames\n"
+					"\t\tdecompressed: %llu frames\n"
+					"\t\t       saved: %llu KB\n"
+					"\tTimers:\n"
+					"\t\t      armed: %llu\n"
+					"\t\t      fired: %llu\n"
+					"\t\t heartbeats: %llu\n"
+					"\t\tidle closed: %llu\n"
+					"\t\t  handshake: %llu timed out\n"
+					"\tRate limits:\n"
+					"\t\t    refused: %llu connections\n"
+					"\t\t  throttled: %llu times, %llu s in total\n"
+					"\t\t  addresses: %llu tracked, %llu evicted\n"
+					"\tOutbound queues:\n"
+					"\t\t      queued: %llu KB\n"
+					"\t\t  peak queue: %llu KB\n"
+					"\t\t   congested: %llu\n"
+					"\t\t     dropped: %llu frames, %llu KB\n"
+					"\t\tdisconnected: %llu\n"
+					"\tFederation: %s\n"
+					"History:\n"
+					"\tMessages: %llu to %llu, %llu stored since start, %llu failed\n"
+					"\tSegments: %llu, %llu KB\n"
+					"\tDurable up to: %llu, %llu flushes, longest %.2f ms\n"
+					"\tSearch index: up to %llu, %llu terms in memory (%llu KB)\n"
+					"\tIndex runs: %llu, %llu KB, %llu written, %llu merges, longest %.2f ms\n"
+					"\tSearches: %llu, longest %.2f ms\n"
+					"Memory:\n"
+					"\tConnection pools: %llu KB reserved, %llu KB used\n"
+					"\tBuffer slabs: %llu KB reserved, %llu KB used\n"
+					"\tLarge page slabs: %llu\n"
+					"Echo back is %s.\n"
+					"Compression is %s.\n"
+					"Distributions:                        p50        p90        p99      p99.9        max    samples\n",
 					start_time_string,
 					running_time_string,
-					g_total_messages_received,
-					g_total_messages_sent,
-					g_total_messages_echoed_back,
-					g_total_message_bytes_received,
-					g_total_message_bytes_sent,
-					g_total_message_bytes_echoed_back,
-					(g_echo_back) ? "enabled" : "disabled"
+					ppchat_reactor_engine_name(options.engine),
+					g_shards_count,
+					system_calls_count,
+					open_connections_count,
+					total_connections_count,
+					handed_over_connections_count,
+					rooms_count,
+					topic_subscriptions_count,
+					topic_nodes_count,
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGES_RECEIVED),
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGES_SENT),
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGES_ECHOED_BACK),
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGE_BYTES_RECEIVED),
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGE_BYTES_SENT),
+					ppchat_stats_get_counter(SERVER_COUNTER_MESSAGE_BYTES_ECHOED_BACK),
+					ppchat_stats_get_counter(SERVER_COUNTER_FRAMES_COMPRESSED),
+					ppchat_stats_get_counter(SERVER_COUNTER_FRAMES_DECOMPRESSED),
+					ppchat_stats_get_counter(SERVER_COUNTER_COMPRESSION_SAVED_BYTES) / 1024,
+					armed_timers_count,
+					fired_timers_count,
+					ppchat_stats_get_counter(SERVER_COUNTER_HEARTBEATS_SENT),
+					ppchat_stats_get_counter(SERVER_COUNTER_IDLE_TIMEOUTS),
+					ppchat_stats_get_counter(SERVER_COUNTER_HANDSHAKE_TIMEOUTS),
+					refused_connections_count,
+					ppchat_stats_get_counter(SERVER_COUNTER_CONNECTIONS_THROTTLED),
+					ppchat_stats_get_counter(SERVER_COUNTER_THROTTLED_MILLISECONDS) / 1000,
+					rate_limit_addresses_count,
+					rate_limit_evicted_count,
+					queued_bytes_count / 1024,
+					max_send_queue_size / 1024,
+					congested_connections_count,
+					dropped_frames_count,
+					dropped_bytes_count / 1024,
+					slow_consumers_disconnected_count,
+					federation_status,
+					history.first_sequence,
+					history.last_sequence,
+					history.appended_count,
+					history.failed_appends_count,
+					history.segments_count,
+					history.segments_size / 1024,
+					history.durable_sequence,
+					history.flushes_count,
+					(double) history.max_flush_duration_ns / 1e6,
+					search.indexed_sequence,
+					search.memtable_terms_count,
+					search.memtable_size / 1024,
+					search.runs_count,
+					search.runs_size / 1024,
+					search.persisted_runs_count,
+					search.merges_count,
+					(double) search.max_merge_duration_ns / 1e6,
+					search.queries_count,
+					(double) search.max_query_duration_ns / 1e6,
+					(connection_pools.reserved_size + client_pool.reserved_size) / 1024,
+					(connection_pools.used_size + client_pool.used_size) / 1024,
+					slabs.reserved_size / 1024,
+					slabs.used_size / 1024,
+					connection_pools.large_page_slabs_count + client_pool.large_page_slabs_count + slabs.large_page_slabs_count,
+					(g_echo_back) ? "enabled" : "disabled",
+					(g_features & PPCHAT_FEATURE_COMPRESSION) ? "enabled" : "disabled"
 				);
 
+				struct {
+					ServerHistogram histogram;
+					const char     *name;
+					double          unit_divisor;
+				} distributions[] = {
+					{ SERVER_HISTOGRAM_MESSAGE_SIZE,            "Message size, bytes",          1.0    },
+					{ SERVER_HISTOGRAM_RECEIVE_TO_SEND_LATENCY, "Receive to send, us",          1000.0 },
+					{ SERVER_HISTOGRAM_CONNECTION_THROUGHPUT,   "Connection throughput, KB/s",  1024.0 },
+					{ SERVER_HISTOGRAM_SEARCH_LATENCY,          "Search, us",                   1000.0 },
+				};
+
+				for (int i = 0; i < (int) (sizeof(distributions) / sizeof(distributions[0])); i += 1) {
+					ppchat_stats_get_histogram(distributions[i].histogram, &g_status_histogram);
+
+					double divisor = distributions[i].unit_divisor;
+					status_length += snprintf(
+						status_message + status_length,
+						sizeof(status_message) - status_length,
+						"\t%-30s %10.1f %10.1f %10.1f %10.1f %10.1f %10llu\n",
+						distributions[i].name,
+						(double) ppchat_histogram_get_percentile(&g_status_histogram, 50.0) / divisor,
+						(double) ppchat_histogram_get_percentile(&g_status_histogram, 90.0) / divisor,
+						(double) ppchat_histogram_get_percentile(&g_status_histogram, 99.0) / divisor,
+						(double) ppchat_histogram_get_percentile(&g_status_histogram, 99.9) / divisor,
+						(double) g_status_histogram.max_value / divisor,
+						g_status_histogram.total_count
+					);
+
+					if (status_length >= (int) sizeof(status_message))
+						break;
+				}
+
+				// Drop the last new line, `log()` adds its own.
+				status_length = min(status_length, (int) sizeof(status_message) - 1);
+				if (status_length > 0 && status_message[status_length - 1] == '\n')
+					status_message[status_length - 1] = '\0';
+
 				log("%s", status_message);
 
 			} else if (strcmp(input_buffer, "/echo_back") == 0) {
@@ -297,6 +2743,71 @@ int main(int arguments_count, char *arguments[]) {
 				g_echo_back = !g_echo_back;
 				log("Echo back has been %s.", (g_echo_back) ? "enabled" : "disabled");
 
+			} else if (strcmp(input_buffer, "/who") == 0) {
+
+				// Every shard lists its own clients on its own thread.
+				for (int i = 0; i < g_shards_count; i += 1) {
+					if (!ppchat_reactor_post(&g_shards[i].reactor, list_clients, NULL, 0))
+						log_warning("Mailbox of shard %d is full, try again.", i);
+				}
+
+			} else if (strncmp(input_buffer, "/kick ", 6) == 0) {
+
+				char *handle_end = NULL;
+				ConnectionHandle handle = strtoull(&input_buffer[6], &handle_end, 16);
+				int shard_index = ppchat_connection_handle_tag(handle);
+				if (handle_end == &input_buffer[6] || *handle_end != '\0' || handle == PPCHAT_INVALID_CONNECTION_HANDLE || shard_index >= g_shards_count) {
+					log("'%s' isn't a client handle. Type '/who' to see them.", &input_buffer[6]);
+					continue;
+				}
+
+				if (!ppchat_reactor_post(&g_shards[shard_index].reactor, kick_client, NULL, handle))
+					log_warning("Mailbox of shard %d is full, try again.", shard_index);
+
+			} else if (strncmp(input_buffer, "/announce ", 10) == 0) {
+
+				// Payload is "server: <message>", like messages of clients.
+				const char *announcement = &input_buffer[10];
+				int announcement_size = (int) strlen(announcement);
+				int payload_size = 8 + announcement_size;
+
+				SharedBuffer *frame = ppchat_create_frame_buffer(FRAME_TYPE_CHAT_MESSAGE, 0, NULL, payload_size);
+				if (!frame) {
+					log_error("Couldn't allocate %d bytes for the announcement.", payload_size);
+					continue;
+				}
+
+				memcpy(frame->data + PPCHAT_FRAME_HEADER_SIZE, "server: ", 8);
+				memcpy(frame->data + PPCHAT_FRAME_HEADER_SIZE + 8, announcement, announcement_size);
+
+				for (int i = 0; i < g_shards_count; i += 1) {
+					ppchat_shared_buffer_retain(frame);
+					if (!ppchat_reactor_post(&g_shards[i].reactor, announce_to_clients, frame, 0)) {
+						log_warning("Mailbox of shard %d is full, its clients miss the announcement.", i);
+						ppchat_shared_buffer_release(frame);
+					}
+				}
+
+				ppchat_shared_buffer_release(frame);
+
+			} else if (strncmp(input_buffer, "/search ", 8) == 0) {
+
+				if (!g_history_enabled) {
+					log("History is disabled, there is nothing to search.");
+					continue;
+				}
+
+				const char *query = &input_buffer[8];
+				uint64_t start_timestamp = ppchat_get_timestamp();
+				uint64_t sequences[SERVER_SEARCH_RESULTS_COUNT];
+				int found_count = ppchat_search_query(&g_search, NULL, query, (int) strlen(query), sequences, SERVER_SEARCH_RESULTS_COUNT);
+				uint64_t duration_ns = ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp);
+
+				for (int i = found_count - 1; i >= 0; i -= 1)
+					ppchat_history_read(&g_history, sequences[i], print_search_result, NULL);
+
+				log("Found %d message%s matching '%s' in %.2f ms.", found_count, (found_count == 1) ? "" : "s", query, (double) duration_ns / 1e6);
+
 			} else if (strcmp(input_buffer, "/help") == 0) {
 
 				char help_message[2048];
@@ -312,7 +2823,11 @@ int main(int arguments_count, char *arguments[]) {
 					"\t/shutdown, /quit   -  Shuts down the server.\n"
 					"\t/status            -  Prints runtime information.\n"
 					"\t/echo_back         -  Enables or disables message echo back.\n"
-					"\t                      Received messages will be sent back.\n"
+					"\t                      Senders will receive their own messages too.\n"
+					"\t/who               -  Lists how many clients every reactor serves and the ones quiet the longest.\n"
+					"\t/kick <handle>     -  Disconnects the client with the handle '/who' lists.\n"
+					"\t/announce <text>   -  Sends a message from the server to every client.\n"
+					"\t/search <words>    -  Prints the newest messages of any room that have every word in them.\n"
 					"\t/help              -  Prints help message."
 				);
 
@@ -327,6 +2842,49 @@ int main(int arguments_count, char *arguments[]) {
 		}
 	}
 
+	if (g_federation.dialer_thread) {
+		SetEvent(g_federation.stop_event);
+		WaitForSingleObject(g_federation.dialer_thread, INFINITE);
+		CloseHandle(g_federation.dialer_thread);
+		CloseHandle(g_federation.stop_event);
+	}
+
+	// Every reactor has to stop before any is destroyed, they still post mail to each other until then.
+	for (int i = 0; i < g_shards_count; i += 1)
+		ppchat_reactor_stop(&g_shards[i].reactor);
+
+	if (g_federation.enabled)
+		ppchat_reactor_stop(&g_federation.reactor);
+
+	for (int i = 0; i < g_shards_count; i += 1) {
+		WaitForSingleObject(g_shards[i].thread, INFINITE);
+		CloseHandle(g_shards[i].thread);
+	}
+
+	if (g_federation.enabled) {
+		WaitForSingleObject(g_federation.thread, INFINITE);
+		CloseHandle(g_federation.thread);
+	}
+
+	for (int i = 0; i < g_shards_count; i += 1) {
+		ppchat_reactor_destroy(&g_shards[i].reactor);
+		ppchat_rate_limiter_destroy(&g_shards[i].rate_limiter);
+		ppchat_connection_registry_destroy(&g_shards[i].registry);
+		ppchat_topic_router_destroy(&g_shards[i].topics);
+		ppchat_topic_recipients_destroy(&g_shards[i].topic_recipients);
+	}
+
+	// Last, shards closing their clients leave rooms and tell it so.
+	if (g_federation.enabled)
+		ppchat_reactor_destroy(&g_federation.reactor);
+
+	// Reactors are done appending, whatever is left gets flushed. The index reads
+	// the history until it stops.
+	if (g_history_enabled) {
+		ppchat_search_close(&g_search);
+		ppchat_history_close(&g_history);
+	}
+
 	log("Server have been shut down.");
 
 	return EXIT_SUCCESS;
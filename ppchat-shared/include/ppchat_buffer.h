@@ -0,0 +1,33 @@
+#ifndef PPCHAT_BUFFER_H
+#define PPCHAT_BUFFER_H
+
+#include "ppchat_shared.h"
+
+// Reference counted byte buffer. Whoever fills it owns the only reference and can
+// write into it; once it is handed out to more than one owner it must be treated
+// as immutable. This lets one encoded message be queued on any number of
+// connections without copying it for every one of them.
+//
+// Reference counting is atomic, so buffers can be shared between threads.
+// Buffers come from the slab allocator (see ppchat_pool.h).
+typedef struct SharedBuffer {
+	volatile LONG references;
+	int           capacity;
+	int           size;
+	char          data[1]; // Actually `capacity` bytes long.
+} SharedBuffer;
+
+extern "C" {
+
+// Creates a buffer with a single reference and `size` of zero. Capacity is rounded up
+// to fill the slab block. Returns NULL if out of memory.
+PPCHAT_API SharedBuffer *ppchat_shared_buffer_create(int capacity);
+
+PPCHAT_API void ppchat_shared_buffer_retain(SharedBuffer *buffer);
+
+// Frees the buffer once the last reference is released.
+PPCHAT_API void ppchat_shared_buffer_release(SharedBuffer *buffer);
+
+}
+
+#endif /* PPCHAT_BUFFER_H */
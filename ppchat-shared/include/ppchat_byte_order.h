@@ -0,0 +1,79 @@
+#ifndef PPCHAT_BYTE_ORDER_H
+#define PPCHAT_BYTE_ORDER_H
+
+#include "ppchat_shared.h"
+
+// Byte order conversion of many fields in one call.
+//
+// Network order is big endian and we only run on little endian, so converting either
+// way reverses the bytes of every field. `ppchat_hton32` and friends do that for one
+// value; the functions here do it for arrays of 16, 32 and 64-bit fields and for
+// arrays of structs, with SSSE3 or AVX2 byte shuffles that swap 16 or 32 bytes per
+// instruction. The fastest method the CPU supports is picked at runtime, the scalar
+// one (a bswap per field) runs anywhere.
+//
+// `source` and `destination` can be the same to convert in place, otherwise they must
+// not overlap. Neither has to be aligned.
+
+typedef enum ByteOrderMethod {
+	BYTE_ORDER_METHOD_SCALAR,
+	BYTE_ORDER_METHOD_SSSE3,
+	BYTE_ORDER_METHOD_AVX2,
+
+	BYTE_ORDER_METHOD_COUNT
+} ByteOrderMethod;
+
+// Fields of a struct converted with `ppchat_swap_struct_bytes`, at most this many.
+const int PPCHAT_BYTE_ORDER_MAX_FIELDS = 16;
+
+// Structs up to this size are converted with one shuffle each.
+const int PPCHAT_BYTE_ORDER_SHUFFLE_SIZE = 16;
+
+typedef struct ByteOrderField {
+	uint16_t offset;
+	uint16_t size;   // 1, 2, 4 or 8. Single bytes are only copied.
+} ByteOrderField;
+
+// What `ppchat_byte_order_layout_init` makes of a struct's fields.
+// Bytes that no field covers, like padding, are copied as they are.
+typedef struct ByteOrderLayout {
+	int            struct_size;
+	int            fields_count;
+	ByteOrderField fields[PPCHAT_BYTE_ORDER_MAX_FIELDS];
+
+	// Index of the source byte every destination byte comes from, for a whole
+	// vector of structs when `struct_size` divides it, for one struct otherwise.
+	uint8_t        shuffle[PPCHAT_BYTE_ORDER_SHUFFLE_SIZE];
+	int            structs_per_shuffle;   // 0 if the struct is too big to shuffle.
+} ByteOrderLayout;
+
+extern "C" {
+
+// Fastest method the CPU and OS support.
+PPCHAT_API ByteOrderMethod ppchat_byte_order_get_best_method();
+PPCHAT_API bool ppchat_byte_order_is_method_supported(ByteOrderMethod method);
+PPCHAT_API const char *ppchat_byte_order_method_to_string(ByteOrderMethod method);
+
+// Reverse the bytes of each of `count` fields.
+PPCHAT_API void ppchat_swap_bytes_16(const void *source, void *destination, size_t count);
+PPCHAT_API void ppchat_swap_bytes_32(const void *source, void *destination, size_t count);
+PPCHAT_API void ppchat_swap_bytes_64(const void *source, void *destination, size_t count);
+
+// Same with a given method, which must be supported, meant for tests and benchmarks.
+// `field_size` is 2, 4 or 8.
+PPCHAT_API void ppchat_swap_bytes_with_method(ByteOrderMethod method, int field_size, const void *source, void *destination, size_t count);
+
+// Writes `size` bytes of `source` to `destination` back to front. They must not overlap.
+PPCHAT_API void ppchat_reverse_bytes(const void *source, void *destination, size_t size);
+
+// Describes a struct of `struct_size` bytes with the fields to convert.
+// Returns false if a field has a bad size, sticks out of the struct or overlaps another.
+PPCHAT_API bool ppchat_byte_order_layout_init(ByteOrderLayout *layout, int struct_size, const ByteOrderField *fields, int fields_count);
+
+// Converts `count` structs laid out one after another.
+PPCHAT_API void ppchat_swap_struct_bytes(const ByteOrderLayout *layout, const void *source, void *destination, size_t count);
+PPCHAT_API void ppchat_swap_struct_bytes_with_method(ByteOrderMethod method, const ByteOrderLayout *layout, const void *source, void *destination, size_t count);
+
+}
+
+#endif /* PPCHAT_BYTE_ORDER_H */
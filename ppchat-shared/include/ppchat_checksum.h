@@ -0,0 +1,27 @@
+#ifndef PPCHAT_CHECKSUM_H
+#define PPCHAT_CHECKSUM_H
+
+#include "ppchat_shared.h"
+
+// CRC-32C (Castagnoli polynomial), the one iSCSI, SCTP and ext4 use, because
+// x86 has an instruction for it since SSE4.2. Without SSE4.2 it is computed
+// with slicing-by-8 tables, eight bytes per step instead of one.
+//
+// Checksums can be continued: pass what the preceding bytes returned as `crc`,
+// zero to start a new one.
+
+extern "C" {
+
+// Picks the fastest implementation the CPU supports.
+PPCHAT_API uint32_t ppchat_crc32c(uint32_t crc, const void *data, size_t size);
+
+PPCHAT_API bool ppchat_crc32c_has_hardware_support();
+
+// Both give the same results, meant for tests and benchmarks.
+// The hardware one must only be called if `ppchat_crc32c_has_hardware_support`.
+PPCHAT_API uint32_t ppchat_crc32c_hardware(uint32_t crc, const void *data, size_t size);
+PPCHAT_API uint32_t ppchat_crc32c_software(uint32_t crc, const void *data, size_t size);
+
+}
+
+#endif /* PPCHAT_CHECKSUM_H */
@@ -0,0 +1,89 @@
+#ifndef PPCHAT_COMPRESSION_H
+#define PPCHAT_COMPRESSION_H
+
+#include "ppchat_shared.h"
+#include "ppchat_framing.h"
+#include "ppchat_buffer.h"
+
+// Compression of frame payloads.
+//
+// The codec writes the LZ4 block format: a series of sequences, each a run of literal
+// bytes followed by a copy of up to 64 KB back, which decodes with little more than
+// memcpy. Matches are found through a single hash table of 4-byte sequences, no chains,
+// so compression runs at hundreds of megabytes per second and never looks at a byte
+// twice on data that doesn't compress.
+//
+// Peers agree on it per connection: the client sends FRAME_TYPE_OPTIONS with the features
+// it supports and the server answers with the ones both of them do. Until then, and with
+// peers that don't know about it, everything goes over the wire as it is. A compressed
+// frame has FRAME_FLAG_COMPRESSED and this payload:
+//
+//     | uncompressed size uint32 | LZ4 block |
+//
+// except for FILE_DATA, which keeps its chunk header in front, uncompressed (see
+// ppchat_transfer.h). Payloads shorter than PPCHAT_COMPRESSION_MIN_SIZE aren't worth
+// the trouble, and payloads that don't come out at least an eighth smaller are sent
+// as they are, so a receiver never spends time decompressing for nothing.
+
+const uint32_t PPCHAT_FEATURE_COMPRESSION = 0x00000001;
+
+const int PPCHAT_COMPRESSION_MIN_SIZE = 256;
+
+// Fixed part of a compressed payload, the LZ4 block follows it.
+typedef struct CompressedPayloadHeader {
+	uint32_t uncompressed_size;
+} CompressedPayloadHeader;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(CompressedPayloadHeader, uncompressed_size)
+> CompressedPayloadHeaderSchema;
+
+const int PPCHAT_COMPRESSED_HEADER_SIZE = CompressedPayloadHeaderSchema::size;
+
+// Payload of FRAME_TYPE_OPTIONS.
+typedef struct ConnectionOptions {
+	uint32_t features;
+} ConnectionOptions;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(ConnectionOptions, features)
+> ConnectionOptionsSchema;
+
+const int PPCHAT_OPTIONS_PAYLOAD_SIZE = ConnectionOptionsSchema::size;
+
+extern "C" {
+
+// Most bytes `ppchat_compress` can write for `size` bytes of input.
+PPCHAT_API int ppchat_compress_bound(int size);
+
+// Writes `source` as an LZ4 block to `destination`. Returns its size, or zero if it
+// doesn't fit into `destination_capacity`. Any thread can compress.
+PPCHAT_API int ppchat_compress(const char *source, int source_size, char *destination, int destination_capacity);
+
+// Decodes an LZ4 block that has to come out exactly `destination_size` bytes long.
+// Every length and offset is checked, so a malformed block returns false instead of
+// reading or writing out of bounds.
+PPCHAT_API bool ppchat_decompress(const char *source, int source_size, char *destination, int destination_size);
+
+// Writes the payload of a compressed frame for `payload` to `out_payload`, which has to
+// hold `payload_size` bytes. Returns its size, or zero if the payload should be sent as it is.
+PPCHAT_API int ppchat_compress_payload(const char *payload, int payload_size, char *out_payload);
+
+// Size the payload of a compressed frame decompresses to, -1 if it is malformed or would
+// be bigger than `max_size`.
+PPCHAT_API int ppchat_get_decompressed_size(const char *payload, int payload_size, int max_size);
+
+// `out_payload` has to hold the size `ppchat_get_decompressed_size` returned.
+PPCHAT_API bool ppchat_decompress_payload(const char *payload, int payload_size, char *out_payload, int out_payload_size);
+
+// Encodes a compressed frame into a new shared buffer, like `ppchat_create_frame_buffer`.
+// Returns NULL if the payload should be sent as it is, or if out of memory.
+PPCHAT_API SharedBuffer *ppchat_create_compressed_frame_buffer(uint16_t type, uint16_t flags, const char *payload, int payload_size);
+
+// Sends the frame compressed when it is worth it, and as it is otherwise.
+// Returns false and sets `out_error` on failure.
+PPCHAT_API bool ppchat_send_frame_compressed(Socket socket, uint16_t type, uint16_t flags, const char *payload, int payload_size, int *out_error);
+
+}
+
+#endif /* PPCHAT_COMPRESSION_H */
@@ -0,0 +1,88 @@
+#ifndef PPCHAT_FEDERATION_H
+#define PPCHAT_FEDERATION_H
+
+#include "ppchat_shared.h"
+#include "ppchat_framing.h"
+
+// Federation of servers.
+//
+// Servers (nodes) link to each other over persistent peer connections and pass room
+// messages on to the nodes that have members in the room. A link starts with both sides
+// sending FRAME_TYPE_PEER_HELLO with their node ID, then FRAME_TYPE_PEER_SUBSCRIBE for
+// every room they have members in. From then on a node subscribes to a room when its
+// first member joins and unsubscribes when the last one leaves, so a node only ever gets
+// messages of rooms it serves.
+//
+// Messages go out in FRAME_TYPE_PEER_BATCH frames, as many as gather during one round of
+// the sending node's loop, and each of them carries its origin ID: the node it was sent
+// on and a sequence number of that node. A node delivers a message to its own members
+// only the first time it sees its origin ID, which keeps messages from being delivered
+// twice when two nodes are linked both ways.
+//
+// Nodes are meant to be linked full mesh. A message goes from the node it was sent on
+// straight to every node that has members in its room, and no further.
+
+// Batches are flushed once they'd grow past this, whatever the loop is up to.
+const int PPCHAT_PEER_BATCH_MAX_SIZE = 64 * 1024;
+
+// Origin IDs this far behind the newest of their node count as seen.
+const int PPCHAT_ORIGIN_WINDOW_SIZE = 64;
+
+// Payload of FRAME_TYPE_PEER_HELLO.
+typedef struct PeerHello {
+	uint32_t node_id;
+} PeerHello;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(PeerHello, node_id)
+> PeerHelloSchema;
+
+// Fixed part of every message in a batch. The room name and the payload (which is what
+// clients get, "<sender>: <message>") follow it.
+typedef struct PeerMessageHeader {
+	uint32_t origin_node_id;
+	uint64_t origin_sequence;
+	uint16_t room_name_size;
+	uint32_t payload_size;
+} PeerMessageHeader;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(PeerMessageHeader, origin_node_id),
+	PPCHAT_WIRE_FIELD(PeerMessageHeader, origin_sequence),
+	PPCHAT_WIRE_FIELD(PeerMessageHeader, room_name_size),
+	PPCHAT_WIRE_FIELD(PeerMessageHeader, payload_size)
+> PeerMessageHeaderSchema;
+
+typedef struct PeerMessage {
+	PeerMessageHeader header;
+	const char       *room_name;   // Not null terminated.
+	const char       *payload;
+} PeerMessage;
+
+// Origin IDs of one node that have been seen: the newest sequence and a bit for each of
+// the PPCHAT_ORIGIN_WINDOW_SIZE before it.
+typedef struct OriginWindow {
+	uint32_t node_id;
+	uint64_t newest_sequence;
+	uint64_t seen_mask;      // Bit N stands for `newest_sequence - N`.
+} OriginWindow;
+
+extern "C" {
+
+// Bytes a message takes in a batch.
+PPCHAT_API int ppchat_peer_message_size(int room_name_size, int payload_size);
+
+// Writes `ppchat_peer_message_size` bytes. Returns where the next message goes.
+PPCHAT_API char *ppchat_encode_peer_message(char *out_buffer, uint32_t origin_node_id, uint64_t origin_sequence, const char *room_name, int room_name_size, const char *payload, int payload_size);
+
+// Takes the next message of a batch payload at `*cursor` and moves the cursor past it.
+// Returns false at the end of the batch, or if the rest of it is malformed, which
+// `*cursor` short of `end` tells apart.
+PPCHAT_API bool ppchat_decode_peer_message(const char **cursor, const char *end, PeerMessage *out_message);
+
+// Returns true if the sequence hasn't been seen before and marks it as seen.
+PPCHAT_API bool ppchat_origin_window_accept(OriginWindow *window, uint64_t sequence);
+
+}
+
+#endif /* PPCHAT_FEDERATION_H */
@@ -0,0 +1,172 @@
+#ifndef PPCHAT_FRAMING_H
+#define PPCHAT_FRAMING_H
+
+#include "ppchat_shared.h"
+#include "ppchat_buffer.h"
+#include "ppchat_schema.h"
+
+// TCP is a byte stream, a single `recv` can return half of a message or several
+// messages glued together. Every message on the wire is therefore prefixed with
+// a fixed size header that says how long it is:
+//
+//     +----------------+------------+-------------+-----------------+
+//     | payload size   | type       | flags       | payload         |
+//     | uint32         | uint16     | uint16      | payload size    |
+//     +----------------+------------+-------------+-----------------+
+//
+// All header fields are in network byte order.
+
+const int PPCHAT_FRAME_HEADER_SIZE = 8;
+
+// Frames that claim to be bigger than this are treated as a protocol error,
+// so that a broken or hostile peer can't make us allocate gigabytes.
+const int PPCHAT_FRAME_MAX_PAYLOAD_SIZE = 1024 * 1024;
+
+typedef enum FrameType {
+	FRAME_TYPE_CHAT_MESSAGE = 1,
+	FRAME_TYPE_JOIN_ROOM    = 2,
+	FRAME_TYPE_FILE_BEGIN   = 3,   // See ppchat_transfer.h.
+	FRAME_TYPE_FILE_DATA    = 4,
+	FRAME_TYPE_FILE_RESUME  = 5,
+	FRAME_TYPE_HISTORY      = 6,   // Asks for the last messages of the room: count uint32.
+	FRAME_TYPE_SEARCH       = 7,   // Asks for messages of the room that have every word of the payload in them.
+	FRAME_TYPE_OPTIONS      = 8,   // Features the sender supports: features uint32. See ppchat_compression.h.
+	FRAME_TYPE_PING         = 9,   // Asks the peer to answer with FRAME_TYPE_PONG, sent by either side when the other one has been quiet.
+	FRAME_TYPE_PONG         = 10,  // No payload. Only shows the sender is still there.
+
+	// Between servers only, see ppchat_federation.h.
+	FRAME_TYPE_PEER_HELLO       = 11,  // First frame of a server on a peer link: node ID uint32.
+	FRAME_TYPE_PEER_SUBSCRIBE   = 12,  // Sender has members in the room named by the payload.
+	FRAME_TYPE_PEER_UNSUBSCRIBE = 13,  // Sender has no members left in the room named by the payload.
+	FRAME_TYPE_PEER_BATCH       = 14,  // Room messages one after another, each a PeerMessageHeader, room name and payload.
+
+	// Topics, see ppchat_topics.h.
+	FRAME_TYPE_SUBSCRIBE        = 15,  // Subscribes to the topic pattern of the payload.
+	FRAME_TYPE_UNSUBSCRIBE      = 16,
+	FRAME_TYPE_PUBLISH          = 17   // "<topic> <message>", and "<topic> <sender>: <message>" on the way to subscribers.
+} FrameType;
+
+// Payload of a frame with this flag is handed out in pieces as soon as they arrive,
+// instead of being collected in the decoder's buffer first. Meant for bulk data
+// that can go straight from the receive buffer to wherever it belongs.
+const uint16_t FRAME_FLAG_STREAMED = 0x0001;
+
+// Chat message that was sent before, replayed from the history.
+const uint16_t FRAME_FLAG_HISTORY = 0x0002;
+
+// Payload is compressed, only sent to peers that have agreed to it (see ppchat_compression.h).
+const uint16_t FRAME_FLAG_COMPRESSED = 0x0004;
+
+typedef struct FrameHeader {
+	uint32_t payload_size;
+	uint16_t type;
+	uint16_t flags;
+} FrameHeader;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(FrameHeader, payload_size),
+	PPCHAT_WIRE_FIELD(FrameHeader, type),
+	PPCHAT_WIRE_FIELD(FrameHeader, flags)
+> FrameHeaderSchema;
+
+static_assert(FrameHeaderSchema::size == PPCHAT_FRAME_HEADER_SIZE, "Frame header schema doesn't match its size.");
+
+// Payload of FRAME_TYPE_HISTORY.
+typedef struct HistoryRequest {
+	uint32_t count;
+} HistoryRequest;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(HistoryRequest, count)
+> HistoryRequestSchema;
+
+// Chat messages, room names and search queries are text, the whole payload, with no fixed part.
+
+typedef struct Frame {
+	FrameHeader header;
+
+	// View into the data that was fed to the decoder, or into the decoder's
+	// own buffer when the frame straddled two reads. Only valid until
+	// the next `ppchat_frame_decoder_next` or `ppchat_frame_decoder_feed` call.
+	char       *payload;
+
+	// Streamed frames come out in pieces: `payload` holds `piece_size` bytes that start
+	// `piece_offset` bytes into the frame's payload. Other frames are a single piece.
+	uint32_t    piece_offset;
+	uint32_t    piece_size;
+} Frame;
+
+typedef enum FrameDecoderError {
+	FRAME_DECODER_ERROR_NONE,
+	FRAME_DECODER_ERROR_PAYLOAD_TOO_LARGE,
+	FRAME_DECODER_ERROR_OUT_OF_MEMORY
+} FrameDecoderError;
+
+// Streaming decoder. Feed it whatever `recv` returned and pull complete frames out:
+//
+//     ppchat_frame_decoder_feed(&decoder, data, size);
+//     Frame frame;
+//     while (ppchat_frame_decoder_next(&decoder, &frame))
+//         handle(&frame);
+//     if (decoder.error != FRAME_DECODER_ERROR_NONE)
+//         close_connection();
+//
+// Frames that lie completely inside the fed data are handed out without copying.
+// Only the tail of a read that holds an incomplete frame is copied aside,
+// and the rest of that frame is appended to it from the following reads.
+// Streamed frames (FRAME_FLAG_STREAMED) are never copied, only their headers are.
+typedef struct FrameDecoder {
+	// Data of the current `feed` call that hasn't been decoded yet.
+	char             *data;
+	int               data_size;
+	int               data_offset;
+
+	// Incomplete frame carried over between reads (header included).
+	char             *partial_buffer;
+	int               partial_buffer_capacity;
+	int               partial_buffer_size;
+
+	// Set when the frame in the partial buffer has been handed out,
+	// so it is dropped on the next call.
+	bool              partial_frame_returned;
+
+	// Streamed frame being handed out, `streamed_remaining` of its payload bytes are still to come.
+	FrameHeader       streamed_header;
+	uint32_t          streamed_offset;
+	uint32_t          streamed_remaining;
+
+	int               max_payload_size;
+	FrameDecoderError error;
+} FrameDecoder;
+
+extern "C" {
+
+// `max_payload_size` of zero means PPCHAT_FRAME_MAX_PAYLOAD_SIZE.
+PPCHAT_API void ppchat_frame_decoder_init(FrameDecoder *decoder, int max_payload_size);
+PPCHAT_API void ppchat_frame_decoder_destroy(FrameDecoder *decoder);
+
+// `data` has to stay valid until `ppchat_frame_decoder_next` returns false.
+PPCHAT_API void ppchat_frame_decoder_feed(FrameDecoder *decoder, char *data, int size);
+
+// Returns false once fed data holds no more complete frames or on error
+// (see `decoder->error`). A decoder that failed stays failed.
+PPCHAT_API bool ppchat_frame_decoder_next(FrameDecoder *decoder, Frame *out_frame);
+
+PPCHAT_API const char *ppchat_frame_decoder_error_description(FrameDecoderError error);
+
+// Writes PPCHAT_FRAME_HEADER_SIZE bytes into `out_buffer`.
+PPCHAT_API void ppchat_encode_frame_header(char *out_buffer, uint16_t type, uint16_t flags, uint32_t payload_size);
+PPCHAT_API FrameHeader ppchat_decode_frame_header(const char *buffer);
+
+// Encodes a whole frame into a new shared buffer, ready to be queued on many connections.
+// `payload` can be NULL, in which case the payload bytes are left for the caller
+// to fill in at `buffer->data + PPCHAT_FRAME_HEADER_SIZE` before sharing the buffer.
+PPCHAT_API SharedBuffer *ppchat_create_frame_buffer(uint16_t type, uint16_t flags, const char *payload, int payload_size);
+
+// Sends the header and the payload with a single gathering send on a blocking socket.
+// Returns false and sets `out_error` on failure.
+PPCHAT_API bool ppchat_send_frame(Socket socket, uint16_t type, uint16_t flags, const char *payload, int payload_size, int *out_error);
+
+}
+
+#endif /* PPCHAT_FRAMING_H */
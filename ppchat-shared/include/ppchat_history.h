@@ -0,0 +1,189 @@
+#ifndef PPCHAT_HISTORY_H
+#define PPCHAT_HISTORY_H
+
+#include "ppchat_shared.h"
+
+// Message history store.
+//
+// Messages are appended to segment files in a folder of their own. A segment is sized
+// up front, mapped whole and written in place: appending a message is a copy into the
+// mapped pages, with no system call. Segments are never modified after that, once one
+// is full the next one is started, and when there are more than `max_segments` the
+// oldest one is deleted.
+//
+//     segment: | magic uint32 | version uint32 | first sequence uint64 | padding to 64 bytes |
+//              | record | record | ... | zeros until the end of the file |
+//
+//     record:  | sequence uint64 | timestamp uint64 | previous in room uint64 |
+//              | payload size uint32 | room size uint16 | padding uint16 | crc32c uint32 | padding uint32 |
+//              | room | payload | padding to 8 bytes |
+//
+// Sequence numbers start at 1 and go up by one per message across all segments and
+// rooms. Timestamps are FILETIME and never go backwards. Every record links to the
+// previous message of its room, so the last messages of a room are found without
+// looking at any others. CRC-32C covers the header up to itself, the room and the
+// payload, a record that doesn't match it (torn by a crash) ends the history.
+//
+// Writes aren't made durable one by one: a background thread flushes whatever has been
+// appended since the last time, every `flush_interval_ms`, as one group commit. A crash
+// loses at most that much.
+//
+// Every segment keeps a sparse index in memory, one entry per PPCHAT_HISTORY_INDEX_INTERVAL
+// bytes of records, to find records by sequence number or by time. Indexes and the last
+// message of every room are rebuilt by reading the segments through once when the store
+// is opened.
+
+const int PPCHAT_HISTORY_DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+const int PPCHAT_HISTORY_DEFAULT_MAX_SEGMENTS = 16;
+const int PPCHAT_HISTORY_DEFAULT_FLUSH_INTERVAL_MS = 1000;
+const int PPCHAT_HISTORY_MAX_SEGMENTS = 1024;
+
+const int PPCHAT_HISTORY_SEGMENT_HEADER_SIZE = 64;
+const int PPCHAT_HISTORY_RECORD_HEADER_SIZE = 40;
+const int PPCHAT_HISTORY_INDEX_INTERVAL = 4096;
+
+// Room names longer than that are cut, so that every room name fits a server room.
+const int PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE = 63;
+
+// Most messages `ppchat_history_read_last` goes back.
+const int PPCHAT_HISTORY_MAX_READ_COUNT = 1000;
+
+// Suffix of segment files, which are named after the first sequence number in them.
+const char *const PPCHAT_HISTORY_SEGMENT_SUFFIX = ".segment";
+
+typedef struct HistoryOptions {
+	const char *folder;               // Created if it doesn't exist.
+	int         segment_size;         // Zero means PPCHAT_HISTORY_DEFAULT_SEGMENT_SIZE.
+	int         max_segments;         // Zero means PPCHAT_HISTORY_DEFAULT_MAX_SEGMENTS.
+	int         flush_interval_ms;    // Zero means PPCHAT_HISTORY_DEFAULT_FLUSH_INTERVAL_MS.
+} HistoryOptions;
+
+typedef struct HistoryIndexEntry {
+	uint64_t sequence;
+	uint64_t timestamp;
+	uint32_t offset;
+} HistoryIndexEntry;
+
+typedef struct HistorySegment {
+	HANDLE             file;
+	HANDLE             mapping;
+	char              *view;
+	char               path[MAX_PATH];
+	uint64_t           first_sequence;
+	uint64_t           last_sequence;     // Zero while the segment is empty.
+	uint64_t           last_timestamp;
+	uint32_t           size;              // Bytes in use, header included.
+	uint32_t           capacity;
+
+	// Only touched by whoever flushes.
+	uint32_t           flushed_size;
+
+	HistoryIndexEntry *index;
+	int                index_count;
+	int                index_capacity;
+} HistorySegment;
+
+typedef struct HistoryRoom {
+	char                name[PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE + 1];
+	uint64_t            last_sequence;
+	struct HistoryRoom *next;
+} HistoryRoom;
+
+const int PPCHAT_HISTORY_ROOM_BUCKETS_COUNT = 256;
+
+typedef struct HistoryStore {
+	char             folder[MAX_PATH];
+	int              segment_size;
+	int              max_segments;
+	int              flush_interval_ms;
+
+	// Appends take it exclusively, reads shared. Appends are only a copy, so the
+	// lock is never held over I/O other than starting a new segment.
+	SRWLOCK          lock;
+	HistorySegment **segments;            // Oldest first, the last one is appended to.
+	int              segments_count;
+	uint64_t         next_sequence;
+	uint64_t         last_timestamp;
+	HistoryRoom     *rooms[PPCHAT_HISTORY_ROOM_BUCKETS_COUNT];
+
+	// Dropped from `segments`, deleted by the flushing thread where no reader can see them.
+	HistorySegment **retired_segments;
+	int              retired_segments_count;
+
+	// Taken by whoever flushes, so that segments are flushed by one thread at a time.
+	SRWLOCK          flush_lock;
+	HANDLE           flush_thread;
+	HANDLE           stop_event;
+
+	// Statistics.
+	uint64_t         appended_count;
+	uint64_t         appended_bytes_count;
+	uint64_t         failed_appends_count;
+	uint64_t         durable_sequence;     // Every message up to this one is on disk.
+	uint64_t         flushes_count;
+	uint64_t         max_flush_duration_ns;
+} HistoryStore;
+
+typedef struct HistoryRecord {
+	uint64_t    sequence;
+	uint64_t    timestamp;            // FILETIME.
+	const char *room;                 // Not null terminated.
+	int         room_size;
+	const char *payload;              // Points right into the mapped segment.
+	int         payload_size;
+} HistoryRecord;
+
+// Called with the store locked for reading, so records must not be kept after it returns.
+typedef void (*HistoryReader)(const HistoryRecord *record, void *context);
+
+typedef struct HistoryStats {
+	uint64_t first_sequence;          // Zero while the history is empty.
+	uint64_t last_sequence;
+	uint64_t durable_sequence;
+	uint64_t segments_count;
+	uint64_t segments_size;           // Bytes in use over all segments.
+	uint64_t rooms_count;
+	uint64_t appended_count;          // Since the store was opened.
+	uint64_t appended_bytes_count;
+	uint64_t failed_appends_count;
+	uint64_t flushes_count;
+	uint64_t max_flush_duration_ns;
+} HistoryStats;
+
+extern "C" {
+
+// Opens the history in `options->folder`, picks up where it ends and starts the
+// flushing thread. Segments that aren't history segments are ignored.
+PPCHAT_API bool ppchat_history_open(HistoryStore *store, const HistoryOptions *options, int *out_error);
+
+// Stops the flushing thread, flushes what's left and unmaps every segment.
+PPCHAT_API void ppchat_history_close(HistoryStore *store);
+
+// Copies the message into the current segment, starting a new one if it doesn't fit.
+// Any thread can append. Returns the sequence number of the message, or zero if the
+// message is too big for a segment or a new segment couldn't be created.
+PPCHAT_API uint64_t ppchat_history_append(HistoryStore *store, const char *room, const char *payload, int payload_size);
+
+// Hands the last `count` messages of the room (at most PPCHAT_HISTORY_MAX_READ_COUNT)
+// to `reader`, oldest first. Returns how many there were.
+PPCHAT_API int ppchat_history_read_last(HistoryStore *store, const char *room, int count, HistoryReader reader, void *context);
+
+// Hands the message with this sequence number to `reader`. Returns false if it isn't kept.
+PPCHAT_API bool ppchat_history_read(HistoryStore *store, uint64_t sequence, HistoryReader reader, void *context);
+
+// Hands up to `count` messages from `first_sequence` on to `reader`, oldest first, and
+// returns how many there were. Starts at the first message kept if that one isn't.
+PPCHAT_API int ppchat_history_read_range(HistoryStore *store, uint64_t first_sequence, int count, HistoryReader reader, void *context);
+
+// Sequence number of the first message at or after `timestamp` (FILETIME), zero if there is none.
+PPCHAT_API uint64_t ppchat_history_find_time(HistoryStore *store, uint64_t timestamp);
+
+// Makes everything appended so far durable. The flushing thread calls it every
+// `flush_interval_ms`, and deletes segments that have been dropped.
+PPCHAT_API void ppchat_history_flush(HistoryStore *store);
+
+PPCHAT_API void ppchat_history_get_stats(HistoryStore *store, HistoryStats *out_stats);
+
+}
+
+#endif /* PPCHAT_HISTORY_H */
@@ -0,0 +1,197 @@
+#ifndef PPCHAT_LOG_H
+#define PPCHAT_LOG_H
+
+#include "ppchat_shared.h"
+
+#include <string.h>
+#include <type_traits>
+
+// Asynchronous logging backend behind the `log()` family of macros.
+//
+// Until `ppchat_log_start` is called, or after `ppchat_log_stop`, every call formats
+// and prints right away, same as before (but the "[hh:mm:ss] " prefix is only
+// rebuilt once a second). While the logger is running, a call does no formatting
+// at all: it copies the format pointer and the raw arguments into a fixed size
+// binary record in the calling thread's own SPSC ring, and a background thread
+// formats the records, prints them and flushes the streams.
+//
+// Lines of one thread always come out in order. Lines of different threads are
+// only ordered up to the flush interval. Records that don't fit (very long string
+// arguments) are printed synchronously after everything queued before them.
+
+const int PPCHAT_LOG_RECORD_SIZE = 512;
+const int PPCHAT_LOG_RECORD_ARGUMENTS_SIZE = PPCHAT_LOG_RECORD_SIZE - 40;
+const int PPCHAT_LOG_RING_CAPACITY = 256;    // Records per thread.
+const int PPCHAT_LOG_MAX_THREADS = 64;       // Any threads after that log synchronously.
+const DWORD PPCHAT_LOG_FLUSH_INTERVAL_MS = 10;
+
+typedef enum LogArgumentType {
+	LOG_ARGUMENT_INT32,     // int32_t, anything 4 bytes or less. Goes through varargs as int.
+	LOG_ARGUMENT_INT64,     // int64_t.
+	LOG_ARGUMENT_DOUBLE,    // double.
+	LOG_ARGUMENT_POINTER,   // void *.
+	LOG_ARGUMENT_STRING     // void * of the original, uint16_t length, characters and the null character.
+} LogArgumentType;
+
+// Arguments are packed back to back, each one is a type byte followed by its value.
+typedef struct LogRecord {
+	FILE       *stream;
+	const char *prefix;
+	const char *format;
+	uint64_t    timestamp;          // FILETIME, set by `ppchat_log_begin_record`.
+	uint16_t    arguments_size;
+	uint16_t    arguments_count;
+	char        arguments[PPCHAT_LOG_RECORD_ARGUMENTS_SIZE];
+} LogRecord;
+
+static_assert(sizeof(LogRecord) == PPCHAT_LOG_RECORD_SIZE, "Log record has to fill its ring slot exactly.");
+
+extern "C" {
+
+// Starts the background thread. Returns false if it couldn't be created, logging stays synchronous then.
+PPCHAT_API bool ppchat_log_start();
+
+// Prints everything queued so far and stops the background thread. Meant for shutdown,
+// when other threads are done logging. Per-thread rings are kept for a later start.
+PPCHAT_API void ppchat_log_stop();
+
+// Blocks until everything that has been queued by any thread so far is printed and flushed.
+PPCHAT_API void ppchat_log_flush();
+
+// Number of times a thread found its ring full and had to wait for the background thread.
+PPCHAT_API uint64_t ppchat_log_get_stalls_count();
+
+// Used by `ppchat_log_write`.
+//
+// Returns an empty record in the calling thread's ring, or NULL if the logger is not
+// running. The record only becomes visible after `ppchat_log_commit_record`.
+PPCHAT_API LogRecord *ppchat_log_begin_record();
+PPCHAT_API void ppchat_log_commit_record();
+
+// Formats and prints the line right away.
+PPCHAT_API void ppchat_log_write_now(FILE *stream, const char *prefix, const char *format, ...);
+
+// Finds out how many characters of the string argument at `argument_index` are going
+// to be printed, so that "%.*s" of a buffer without the null character is safe to copy.
+// Returns -1 if there is no precision. `previous_integer` is the argument before it.
+PPCHAT_API int ppchat_log_get_string_precision(const char *format, int argument_index, int64_t previous_integer);
+
+}
+
+typedef struct LogRecordWriter {
+	LogRecord *record;
+	int64_t    previous_integer;
+	bool       overflowed;
+} LogRecordWriter;
+
+inline char *log_record_reserve(LogRecordWriter *writer, LogArgumentType type, int size) {
+	LogRecord *record = writer->record;
+	if (writer->overflowed || record->arguments_size + 1 + size > PPCHAT_LOG_RECORD_ARGUMENTS_SIZE) {
+		writer->overflowed = true;
+		return NULL;
+	}
+
+	char *argument = record->arguments + record->arguments_size;
+	argument[0] = (char) type;
+	record->arguments_size += (uint16_t) (1 + size);
+	record->arguments_count += 1;
+	return argument + 1;
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+log_record_push(LogRecordWriter *writer, T argument) {
+	int64_t value = (int64_t) argument;
+	writer->previous_integer = value;
+
+	// Keep the width the argument would have had in a varargs call.
+	if (sizeof(T) <= sizeof(int32_t)) {
+		int32_t narrow_value = (int32_t) value;
+		char *destination = log_record_reserve(writer, LOG_ARGUMENT_INT32, sizeof(narrow_value));
+		if (destination)
+			memcpy(destination, &narrow_value, sizeof(narrow_value));
+	} else {
+		char *destination = log_record_reserve(writer, LOG_ARGUMENT_INT64, sizeof(value));
+		if (destination)
+			memcpy(destination, &value, sizeof(value));
+	}
+}
+
+inline void log_record_push(LogRecordWriter *writer, double argument) {
+	char *destination = log_record_reserve(writer, LOG_ARGUMENT_DOUBLE, sizeof(argument));
+	if (destination)
+		memcpy(destination, &argument, sizeof(argument));
+}
+
+inline void log_record_push(LogRecordWriter *writer, float argument) {
+	log_record_push(writer, (double) argument);
+}
+
+template <typename T>
+inline void log_record_push(LogRecordWriter *writer, T *argument) {
+	const void *pointer = argument;
+	char *destination = log_record_reserve(writer, LOG_ARGUMENT_POINTER, sizeof(pointer));
+	if (destination)
+		memcpy(destination, &pointer, sizeof(pointer));
+}
+
+// Strings have to be copied, the caller is free to reuse the memory as soon as we return.
+inline void log_record_push(LogRecordWriter *writer, const char *argument) {
+	size_t length = 0;
+	if (argument) {
+		int precision = ppchat_log_get_string_precision(writer->record->format, writer->record->arguments_count, writer->previous_integer);
+		length = (precision >= 0) ? strnlen(argument, (size_t) precision) : strlen(argument);
+	}
+
+	if (length > (size_t) PPCHAT_LOG_RECORD_ARGUMENTS_SIZE) {
+		writer->overflowed = true;
+		return;
+	}
+
+	uint16_t stored_length = (uint16_t) length;
+	char *destination = log_record_reserve(writer, LOG_ARGUMENT_STRING, (int) (sizeof(argument) + sizeof(stored_length) + length + 1));
+	if (!destination)
+		return;
+
+	memcpy(destination, &argument, sizeof(argument));
+	destination += sizeof(argument);
+	memcpy(destination, &stored_length, sizeof(stored_length));
+	destination += sizeof(stored_length);
+	if (length > 0)
+		memcpy(destination, argument, length);
+
+	destination[length] = '\0';
+}
+
+inline void log_record_push(LogRecordWriter *writer, char *argument) {
+	log_record_push(writer, (const char *) argument);
+}
+
+// Called by the `log()` macros, see `_ppchat_log` in ppchat_shared.h.
+template <typename... Arguments>
+inline void ppchat_log_write(FILE *stream, const char *prefix, const char *format, Arguments... arguments) {
+	LogRecord *record = ppchat_log_begin_record();
+	if (record) {
+		record->stream = stream;
+		record->prefix = prefix;
+		record->format = format;
+		record->arguments_size = 0;
+		record->arguments_count = 0;
+
+		LogRecordWriter writer = { record, 0, false };
+		int expand[] = { 0, (log_record_push(&writer, arguments), 0)... };
+		(void) expand;
+
+		if (!writer.overflowed) {
+			ppchat_log_commit_record();
+			return;
+		}
+
+		// Doesn't fit, let whatever was queued before it come out first.
+		ppchat_log_flush();
+	}
+
+	ppchat_log_write_now(stream, prefix, format, arguments...);
+}
+
+#endif /* PPCHAT_LOG_H */
@@ -0,0 +1,89 @@
+#ifndef PPCHAT_POOL_H
+#define PPCHAT_POOL_H
+
+#include "ppchat_shared.h"
+
+// Object pool.
+//
+// Hands out blocks of a single size, rounded up to whole cache lines, carved out of
+// slabs that are taken from the system with VirtualAlloc and kept until the pool is
+// destroyed. Freed blocks go on an interlocked singly linked list, so any thread can
+// allocate and free without a lock, and once the pool has grown to the peak number of
+// blocks in use it never asks the system for memory again. Blocks are not zeroed,
+// neither when allocated nor when freed.
+//
+// With large pages enabled (see `ppchat_pool_enable_large_pages`) slabs that grow
+// after that are backed by large pages, which spares TLB misses on hot buffers.
+// Large page slabs are at least GetLargePageMinimum() (2 MB on x64) big.
+
+// Slabs are at least this big and hold at least this many blocks.
+const int PPCHAT_POOL_MIN_SLAB_SIZE = 64 * 1024;
+const int PPCHAT_POOL_MIN_SLAB_BLOCKS = 16;
+
+typedef struct PoolSlab {
+	struct PoolSlab *next;
+	size_t           size;
+} PoolSlab;
+
+typedef struct ObjectPool {
+	SLIST_HEADER free_blocks;
+	int          block_size;
+	const char  *name;
+
+	// Only taken to add a slab.
+	SRWLOCK      slabs_lock;
+	PoolSlab    *slabs;
+	uint64_t     reserved_size;
+	uint64_t     blocks_count;
+	uint64_t     large_page_slabs_count;
+
+	volatile LONG64 used_blocks_count;
+} ObjectPool;
+
+// Slab allocator: a pool per power of two size class, from 64 bytes to 64 KB.
+// Bigger blocks come from malloc.
+const int PPCHAT_SLAB_MIN_BLOCK_SIZE_BITS = 6;
+const int PPCHAT_SLAB_MAX_BLOCK_SIZE_BITS = 16;
+const int PPCHAT_SLAB_MIN_BLOCK_SIZE = 1 << PPCHAT_SLAB_MIN_BLOCK_SIZE_BITS;
+const int PPCHAT_SLAB_MAX_BLOCK_SIZE = 1 << PPCHAT_SLAB_MAX_BLOCK_SIZE_BITS;
+const int PPCHAT_SLAB_CLASSES_COUNT = PPCHAT_SLAB_MAX_BLOCK_SIZE_BITS - PPCHAT_SLAB_MIN_BLOCK_SIZE_BITS + 1;
+
+typedef struct SlabStats {
+	uint64_t reserved_size;      // Taken from the system, whether in use or not.
+	uint64_t used_size;          // Handed out blocks, whole blocks.
+	uint64_t large_page_slabs_count;
+} SlabStats;
+
+extern "C" {
+
+// Enables the "Lock pages in memory" privilege the process needs to allocate large
+// pages and makes slabs grown from now on use them. Returns false if the account
+// doesn't have the privilege, slabs keep using regular pages then.
+PPCHAT_API bool ppchat_pool_enable_large_pages();
+
+// `name` is only used in messages and has to outlive the pool.
+PPCHAT_API void ppchat_object_pool_init(ObjectPool *pool, int block_size, const char *name);
+
+// Gives every slab back to the system. Blocks still in use become invalid.
+PPCHAT_API void ppchat_object_pool_destroy(ObjectPool *pool);
+
+// Returns a cache line aligned block of at least `block_size` bytes with undefined
+// contents, or NULL if the pool couldn't grow.
+PPCHAT_API void *ppchat_object_pool_allocate(ObjectPool *pool);
+
+PPCHAT_API void ppchat_object_pool_free(ObjectPool *pool, void *block);
+
+PPCHAT_API void ppchat_object_pool_get_stats(ObjectPool *pool, SlabStats *out_stats);
+
+// Process wide slab allocator. Callers have to free blocks with the size they
+// allocated them with. `out_capacity` (can be NULL) receives the usable size of
+// the block, which is `size` rounded up to its size class.
+PPCHAT_API void *ppchat_slab_allocate(int size, int *out_capacity);
+PPCHAT_API void ppchat_slab_free(void *block, int size);
+
+// Sums up all size classes. Blocks that came from malloc aren't counted.
+PPCHAT_API void ppchat_slab_get_stats(SlabStats *out_stats);
+
+}
+
+#endif /* PPCHAT_POOL_H */
@@ -0,0 +1,97 @@
+#ifndef PPCHAT_RATE_LIMIT_H
+#define PPCHAT_RATE_LIMIT_H
+
+#include "ppchat_shared.h"
+
+// Per-address rate limits.
+//
+// Every address has a token bucket for connections, one for messages and one for bytes.
+// A bucket holds up to `burst` tokens and refills at `per_second`. Taking tokens is
+// allowed to run it into debt, down to minus a burst, and the caller gets back how long
+// the address has to wait until the debt is paid off. That's what lets the server slow a
+// client down instead of dropping it: it stops reading from the connection for that long
+// and TCP flow control pushes back on the client.
+//
+// Addresses are kept in an open addressing table of fixed size, keyed on the binary
+// address rather than its string. IPv4 addresses are keyed as their mapped IPv6 ones,
+// and IPv6 addresses by their prefix only, since a single host usually has a whole /64
+// to pick addresses from. A lookup probes at most PPCHAT_RATE_LIMIT_MAX_PROBES slots.
+// When all of them belong to other addresses, the one that was seen least recently is
+// evicted and its buckets forgotten. So a check costs the same no matter how many
+// addresses show up, and the table never allocates after it's created.
+//
+// Not thread safe, it belongs to whoever checks against it.
+
+const int PPCHAT_RATE_LIMIT_MAX_PROBES = 8;
+const int PPCHAT_RATE_LIMIT_DEFAULT_CAPACITY = 16 * 1024;
+const int PPCHAT_RATE_LIMIT_DEFAULT_IPV6_PREFIX_BITS = 64;
+
+typedef enum RateLimitKind {
+	RATE_LIMIT_KIND_CONNECTIONS,
+	RATE_LIMIT_KIND_MESSAGES,
+	RATE_LIMIT_KIND_BYTES,
+
+	RATE_LIMIT_KIND_COUNT
+} RateLimitKind;
+
+typedef struct RateLimit {
+	uint32_t per_second;   // Zero means no limit.
+	uint32_t burst;        // Zero means a second's worth.
+} RateLimit;
+
+typedef struct RateLimitOptions {
+	RateLimit limits[RATE_LIMIT_KIND_COUNT];
+
+	// Addresses tracked at once, rounded up to a power of two. Zero means
+	// PPCHAT_RATE_LIMIT_DEFAULT_CAPACITY.
+	int       capacity;
+
+	// Zero means PPCHAT_RATE_LIMIT_DEFAULT_IPV6_PREFIX_BITS.
+	int       ipv6_prefix_bits;
+} RateLimitOptions;
+
+typedef struct RateLimitEntry {
+	uint8_t  key[16];
+	bool     used;
+	uint64_t last_seen_ms;
+
+	// Thousandths of a token, negative while in debt.
+	int64_t  tokens[RATE_LIMIT_KIND_COUNT];
+
+	// Left to the caller, e.g. to only log when an address starts being throttled.
+	uint64_t last_throttled_ms;
+} RateLimitEntry;
+
+typedef struct RateLimiter {
+	RateLimit       limits[RATE_LIMIT_KIND_COUNT];
+	uint64_t        refill_ms[RATE_LIMIT_KIND_COUNT];   // Time an empty bucket takes to fill up.
+	int             ipv6_prefix_bits;
+
+	RateLimitEntry *entries;
+	uint32_t        mask;
+	uint64_t        seed;
+
+	uint64_t        entries_count;
+	uint64_t        evicted_count;
+	uint64_t        throttled_count;   // Takes that left a bucket in debt.
+} RateLimiter;
+
+extern "C" {
+
+// Returns false if out of memory.
+PPCHAT_API bool ppchat_rate_limiter_create(RateLimiter *limiter, const RateLimitOptions *options);
+PPCHAT_API void ppchat_rate_limiter_destroy(RateLimiter *limiter);
+
+// Entry of the address with its buckets refilled up to `now_ms`, taken over from another
+// address if it wasn't there. Valid until the next call.
+PPCHAT_API RateLimitEntry *ppchat_rate_limiter_get(RateLimiter *limiter, const sockaddr_in6 *address, uint64_t now_ms);
+
+// Takes `amount` tokens from a bucket of the entry. Returns zero if the address is within
+// its rate, otherwise milliseconds until the bucket is out of debt.
+PPCHAT_API uint32_t ppchat_rate_limiter_take(RateLimiter *limiter, RateLimitEntry *entry, RateLimitKind kind, uint32_t amount);
+
+PPCHAT_API const char *ppchat_rate_limit_kind_to_string(RateLimitKind kind);
+
+}
+
+#endif /* PPCHAT_RATE_LIMIT_H */
@@ -0,0 +1,418 @@
+#ifndef PPCHAT_REACTOR_H
+#define PPCHAT_REACTOR_H
+
+#include "ppchat_shared.h"
+#include "ppchat_framing.h"
+#include "ppchat_pool.h"
+#include "ppchat_ring.h"
+#include "ppchat_timer.h"
+
+#include <mswsock.h>
+
+// Reactor is a single threaded event loop built on top of an I/O completion port.
+// Every socket it owns is associated with the port, all receives and sends are
+// overlapped, and one `ppchat_reactor_run` loop dequeues their completions in batches.
+// This replaces the thread-per-connection model where every client had its own
+// stack blocked in `recv`.
+//
+// The reactor can drive sockets with one of two engines:
+//
+//     IOCP - Plain overlapped WSARecv/WSASend, one completion packet per operation.
+//     RIO  - Registered I/O. All receive and send buffers live in one region that is
+//            registered with the kernel once, requests posted while handling a batch
+//            are deferred and committed together, and completions are dequeued from
+//            a user mode completion queue without a system call per operation.
+//
+// Connections come from a pool of the reactor and their buffers from the slab allocator,
+// so once the pools have grown to the peak number of connections, accepting and serving
+// them doesn't allocate.
+//
+// Every connection has a timer on the reactor's timing wheel (see ppchat_timer.h) that
+// calls `on_timer` once it runs out, which is what idle timeouts and heartbeats are built
+// on. The loop only wakes up for timers when some are armed, and then at most once a tick.
+//
+// A server can run a reactor per CPU core. Windows has no SO_REUSEPORT to spread
+// connections over several listen sockets, so one reactor listens and hands accepted
+// sockets out round robin to all of them (see `ReactorOptions.accept_targets`).
+// A connection stays on the reactor it was handed to for its whole lifetime, and
+// reactors talk to each other through their mailboxes (see `ppchat_reactor_post`).
+//
+// All `ppchat_reactor_*` functions except `ppchat_reactor_stop` and `ppchat_reactor_post`
+// have to be called from the thread that runs the reactor (or before it starts running).
+
+// How many completions are dequeued with a single GetQueuedCompletionStatusEx call.
+const int PPCHAT_REACTOR_MAX_COMPLETIONS = 64;
+
+// How many AcceptEx operations are kept posted on the listen socket at all times.
+const int PPCHAT_REACTOR_PENDING_ACCEPTS = 16;
+
+// Default limit of simultaneous connections for the RIO engine. Every connection
+// owns a fixed slice of the registered buffer region, so the region is sized up front.
+const int PPCHAT_RIO_DEFAULT_MAX_CONNECTIONS = 4096;
+
+// Size of the registered slice every RIO connection sends from.
+const int PPCHAT_RIO_SEND_SLICE_SIZE = 4096;
+
+// How many mails a reactor's mailbox holds before `ppchat_reactor_post` fails.
+const int PPCHAT_REACTOR_MAILBOX_CAPACITY = 4096;
+
+// Most segments a single WSASend gathers from the outbound queue.
+const int PPCHAT_REACTOR_MAX_SEND_BUFFERS = 16;
+
+// Outbound backpressure. A connection with more than the high watermark of bytes queued
+// is congested: the reactor stops receiving from it until the queue drains below the
+// low watermark, so a peer that doesn't read what it's sent can't keep sending either.
+const int PPCHAT_REACTOR_DEFAULT_SEND_HIGH_WATERMARK = 256 * 1024;
+const int PPCHAT_REACTOR_DEFAULT_SEND_LOW_WATERMARK = 64 * 1024;
+
+// Resolution of connection timers.
+const int PPCHAT_REACTOR_DEFAULT_TIMER_TICK_MS = 50;
+
+// MSDN: "The number of bytes reserved for the local address information.
+// This value must be at least 16 bytes more than the maximum address length
+// for the transport protocol in use."
+const int PPCHAT_ACCEPT_ADDRESS_SIZE = sizeof(sockaddr_in6) + 16;
+
+struct Reactor;
+struct Connection;
+
+typedef enum ReactorEngine {
+	REACTOR_ENGINE_IOCP,
+	REACTOR_ENGINE_RIO
+} ReactorEngine;
+
+// What happens to sends that would take a connection's queue over `send_queue_limit`.
+typedef enum SlowConsumerPolicy {
+	SLOW_CONSUMER_POLICY_DROP,         // The frame is dropped, the connection stays.
+	SLOW_CONSUMER_POLICY_DISCONNECT    // The connection is closed with WSAENOBUFS.
+} SlowConsumerPolicy;
+
+typedef struct ReactorOptions {
+	ReactorEngine      engine;
+
+	// RIO only: upper bound of simultaneous connections, zero means
+	// PPCHAT_RIO_DEFAULT_MAX_CONNECTIONS.
+	int                max_connections;
+
+	// IOCP only: connections wait for data with a zero byte receive and only take a
+	// receive buffer once something has arrived, so idle connections hold none.
+	// Costs an extra completion for reads that don't fill the whole buffer.
+	bool               release_idle_receive_buffers;
+
+	// Reactors that connections accepted by this one are handed out to, round robin.
+	// Can include this reactor itself. All of them have to use the same engine.
+	// Empty means every connection stays on this reactor.
+	struct Reactor   **accept_targets;
+	int                accept_targets_count;
+
+	// Zero means PPCHAT_REACTOR_DEFAULT_SEND_HIGH_WATERMARK and _LOW_WATERMARK.
+	int                send_high_watermark;
+	int                send_low_watermark;
+
+	// Most bytes a connection can have queued, zero means no limit. Sends are refused
+	// whole, so that peers never see a frame cut short.
+	int                send_queue_limit;
+	SlowConsumerPolicy slow_consumer_policy;
+
+	// Zero means PPCHAT_REACTOR_DEFAULT_TIMER_TICK_MS.
+	int                timer_tick_ms;
+} ReactorOptions;
+
+// Part of a shared buffer that is queued to be sent.
+typedef struct OutboundSegment {
+	SharedBuffer *buffer;
+	int           offset;
+	int           size;
+
+	// Set for buffers the reactor allocated itself to collect copied bytes.
+	// Nobody else references them, so further sends can be appended in place.
+	bool          appendable;
+} OutboundSegment;
+
+typedef enum IoOperationType {
+	IO_OPERATION_ACCEPT,
+	IO_OPERATION_RECEIVE,
+	IO_OPERATION_SEND
+} IoOperationType;
+
+typedef struct IoOperation {
+	// Has to be the first member because completions hand back
+	// the OVERLAPPED pointer and we cast it to the operation.
+	OVERLAPPED        overlapped;
+	IoOperationType   type;
+	struct Connection *connection;
+} IoOperation;
+
+// Connection lifetime:
+//
+//     ACCEPTING -> OPEN -> CLOSING -> (released)
+//
+// Connections added with `ppchat_reactor_add_socket` start right in OPEN state.
+// A CLOSING connection has its socket closed already, but it stays alive
+// until the kernel gives back every operation that was posted on it.
+typedef enum ConnectionState {
+	CONNECTION_STATE_ACCEPTING,
+	CONNECTION_STATE_OPEN,
+	CONNECTION_STATE_CLOSING
+} ConnectionState;
+
+typedef struct Connection {
+	Socket            socket;
+	ConnectionState   state;
+	struct Reactor   *reactor;
+
+	sockaddr_in6      address;
+	char              ip[INET6_ADDRSTRLEN];
+
+	// Number of posted operations the kernel still owns.
+	// The connection can only be released once this drops to zero.
+	int               pending_operations;
+
+	// Error that caused the connection to close, zero on graceful close.
+	int               close_error;
+
+	// Set once the connection reaches OPEN state, so that connections
+	// which never got past ACCEPTING don't report `on_close`.
+	bool              opened;
+
+	// Armed with `ppchat_reactor_set_timer`, cancelled when the connection closes.
+	Timer             timer;
+
+	// `dispatch_timestamp` of the last receive that brought bytes, or of the open.
+	uint64_t          last_receive_timestamp;
+
+	IoOperation       accept_operation;
+	char              accept_buffer[2 * PPCHAT_ACCEPT_ADDRESS_SIZE];
+
+	IoOperation       receive_operation;
+	char             *receive_buffer; // Points into the registered region with RIO engine, slab block otherwise.
+	int               receive_buffer_size;
+	int               receive_posted_size;  // Of the receive in flight, zero while waiting for data.
+	bool              receive_ready;        // Data is known to be waiting, skip the zero byte receive.
+
+	// Set by `ppchat_reactor_receive_into` for the next receive only, IOCP engine only.
+	char             *receive_target;
+	int               receive_target_size;
+	char             *received_into;      // Buffer of the receive in flight.
+
+	// Outbound bytes are a ring of segments. The send in flight gathers the first
+	// `send_queue_in_flight` of them, everything after that can still change.
+	IoOperation       send_operation;
+	bool              sending;
+	OutboundSegment  *send_queue;
+	int               send_queue_capacity;
+	int               send_queue_first;
+	int               send_queue_count;
+	int               send_queue_in_flight;
+	int               send_queue_size;        // Bytes, those in flight included.
+	bool              send_congested;         // Went over the high watermark and hasn't drained below the low one yet.
+	bool              receive_paused;         // No receive is posted because of congestion or throttling.
+	bool              receive_throttled;      // Set with `ppchat_reactor_throttle_receive`.
+	uint64_t          dropped_frames_count;
+
+	// RIO engine only.
+	RIO_RQ            rio_request_queue;
+	int               rio_slot;               // Index of the registered region slice, -1 if none.
+	bool              rio_receive_deferred;   // Receive was posted with RIO_MSG_DEFER and isn't committed yet.
+	bool              rio_send_deferred;      // Same for send.
+	bool              rio_commit_pending;     // Connection is in reactor's commit list.
+	struct Connection *rio_next_commit;
+
+	void             *user_data;
+
+	struct Connection *previous;
+	struct Connection *next;
+} Connection;
+
+typedef struct ReactorCallbacks {
+	// Called on the listening reactor for every accepted socket, before it's handed out.
+	// Returning false closes the socket right away, nothing else hears about it then.
+	bool (*on_accept)(const sockaddr_in6 *address, void *user_data);
+
+	// Called once a connection is accepted or added.
+	// Returning false closes the connection right away.
+	bool (*on_open)(Connection *connection, void *user_data);
+
+	// Called for every completed receive. `data` is only valid during the call.
+	void (*on_receive)(Connection *connection, char *data, int size, void *user_data);
+
+	// Called exactly once per opened connection, right before it is released.
+	// `error` is zero when the connection was closed gracefully.
+	void (*on_close)(Connection *connection, int error, void *user_data);
+
+	// Called when the timer set with `ppchat_reactor_set_timer` runs out, only while
+	// the connection is open.
+	void (*on_timer)(Connection *connection, void *user_data);
+
+	// Called once every completion, mail and timer of a round of the loop has been
+	// handled, so that whatever gathered during the round can go out together.
+	void (*on_round_end)(struct Reactor *reactor, void *user_data);
+
+	void *user_data;
+} ReactorCallbacks;
+
+// Runs on the thread of the reactor the mail was posted to. Mail that is still in the
+// mailbox when the reactor is destroyed is handled with `reactor->stopped` set, so that
+// handlers can release whatever they carry.
+typedef void (*ReactorMailHandler)(struct Reactor *reactor, void *argument, uint64_t value);
+
+typedef struct ReactorMail {
+	ReactorMailHandler handler;
+	void              *argument;
+	uint64_t           value;
+} ReactorMail;
+
+typedef struct ConnectionList {
+	Connection *first;
+	Connection *last;
+} ConnectionList;
+
+typedef struct Reactor {
+	ReactorEngine             engine;
+	HANDLE                    completion_port;
+	ReactorCallbacks          callbacks;
+
+	Socket                    listen_socket;
+	LPFN_ACCEPTEX             accept_ex;
+	LPFN_GETACCEPTEXSOCKADDRS get_accept_ex_sockaddrs;
+
+	// Accepting and open connections.
+	ConnectionList            connections;
+
+	// Connections that wait for their pending operations to complete.
+	ConnectionList            closing_connections;
+
+	uint64_t                  open_connections_count;
+	uint64_t                  total_connections_count;
+
+	// Calls that enter the kernel to post, commit, or wait for I/O.
+	uint64_t                  system_calls_count;
+
+	// Outbound bytes copied by the reactor, as opposed to referenced from shared buffers.
+	uint64_t                  bytes_copied_count;
+
+	ObjectPool                connection_pool;
+	bool                      release_idle_receive_buffers;
+
+	struct Reactor          **accept_targets;
+	int                       accept_targets_count;
+	int                       next_accept_target;
+
+	// Connections accepted here and handed over to another reactor.
+	uint64_t                  handed_over_connections_count;
+
+	// Accepted sockets `on_accept` turned away.
+	uint64_t                  refused_connections_count;
+
+	int                       send_high_watermark;
+	int                       send_low_watermark;
+	int                       send_queue_limit;
+	SlowConsumerPolicy        slow_consumer_policy;
+
+	// Outbound queues of all connections.
+	uint64_t                  queued_bytes_count;
+	uint64_t                  max_send_queue_size;     // Deepest queue any connection ever had.
+	uint64_t                  congested_connections_count;
+	uint64_t                  dropped_frames_count;
+	uint64_t                  dropped_bytes_count;
+	uint64_t                  slow_consumers_disconnected_count;
+
+	// Mail from other threads. Producers only post a completion packet to wake the
+	// reactor up when `mailbox_signaled` wasn't set yet, so a burst of mail costs one.
+	RingQueue                 mailbox;
+	volatile LONG             mailbox_signaled;
+
+	// `ppchat_get_timestamp` of when the batch being dispatched was dequeued,
+	// lets callbacks tell how long an event has been waiting for them.
+	uint64_t                  dispatch_timestamp;
+
+	// Timers of all connections, advanced at the start of every batch.
+	TimerWheel                timers;
+
+	// RIO engine only.
+	RIO_EXTENSION_FUNCTION_TABLE rio;
+	RIO_CQ                    rio_completion_queue;
+	OVERLAPPED                rio_notify_overlapped;
+	RIO_BUFFERID              rio_buffer_id;
+	char                     *rio_buffer;
+	int                       rio_slot_size;
+	int                       rio_slots_count;
+	int                      *rio_free_slots;
+	int                       rio_free_slots_count;
+	Connection               *rio_commit_list;
+
+	// Set while completions of a batch are being handled. RIO requests posted
+	// during that time are deferred and committed once the batch is done.
+	bool                      dispatching;
+
+	volatile bool             stopped;
+} Reactor;
+
+extern "C" {
+
+// `options` can be NULL, which creates an IOCP reactor.
+PPCHAT_API bool ppchat_reactor_create(Reactor *reactor, ReactorOptions *options, ReactorCallbacks *callbacks, int *out_error);
+
+PPCHAT_API const char *ppchat_reactor_engine_name(ReactorEngine engine);
+
+// Parses engine name ("iocp" or "rio"). Returns false on unknown name.
+PPCHAT_API bool ppchat_reactor_engine_from_name(const char *name, ReactorEngine *out_engine);
+
+// Starts accepting connections on the specified port.
+PPCHAT_API bool ppchat_reactor_listen(Reactor *reactor, const char *port, int *out_error);
+
+// Hands an already connected socket over to the reactor, which closes it if this fails.
+// RIO engine requires the socket to be created with WSA_FLAG_REGISTERED_IO.
+PPCHAT_API Connection *ppchat_reactor_add_socket(Reactor *reactor, Socket socket, int *out_error);
+
+// Dequeues and dispatches completions until `ppchat_reactor_stop` is called.
+PPCHAT_API void ppchat_reactor_run(Reactor *reactor);
+
+// Makes `ppchat_reactor_run` return. Can be called from any thread.
+PPCHAT_API void ppchat_reactor_stop(Reactor *reactor);
+
+// Queues `handler` to be called on the reactor's thread. Can be called from any thread.
+// Returns false if the mailbox is full, the handler is not called then.
+PPCHAT_API bool ppchat_reactor_post(Reactor *reactor, ReactorMailHandler handler, void *argument, uint64_t value);
+
+// Makes the next receive put at most `size` bytes right into `buffer` instead of the
+// connection's own receive buffer, `on_receive` then gets a pointer into it. Lets bulk
+// data land where it belongs without being copied there afterwards. Meant to be called
+// from `on_receive`. Returns false with the RIO engine, which only receives into the
+// registered region.
+PPCHAT_API bool ppchat_reactor_receive_into(Connection *connection, char *buffer, int size);
+
+// Stops posting receives on the connection until it's called again with `throttled` set
+// to false. Bytes keep piling up in the socket's receive buffer meanwhile, and once that
+// is full TCP makes the peer wait too. A receive that is already posted still completes.
+PPCHAT_API void ppchat_reactor_throttle_receive(Connection *connection, bool throttled);
+
+// Sends below return false when the connection is closed or the bytes were refused
+// because of `send_queue_limit`.
+
+// Queues bytes to be sent. Bytes are copied, so `data` can be reused right away.
+PPCHAT_API bool ppchat_reactor_send(Connection *connection, const char *data, int size);
+
+// Queues a frame with the header prepended (see ppchat_framing.h).
+PPCHAT_API bool ppchat_reactor_send_frame(Connection *connection, uint16_t type, uint16_t flags, const char *payload, int payload_size);
+
+// Queues the whole buffer without copying it. The connection keeps its own reference
+// until the bytes are sent, so the caller can release theirs right away.
+// The RIO engine still copies the bytes into the registered send slice.
+PPCHAT_API bool ppchat_reactor_send_shared(Connection *connection, SharedBuffer *buffer);
+
+// Makes `on_timer` get called for the connection once `delay_ms` have passed, replacing
+// the timer that was set before. Setting it is a few pointer writes, so it's fine to push
+// a timeout back on every receive.
+PPCHAT_API void ppchat_reactor_set_timer(Connection *connection, uint32_t delay_ms);
+PPCHAT_API void ppchat_reactor_cancel_timer(Connection *connection);
+
+// Closes connection socket. `on_close` is called once all pending operations complete.
+PPCHAT_API void ppchat_reactor_close(Connection *connection, int error);
+
+// Closes every connection, waits for all of them to be released and frees the reactor.
+PPCHAT_API void ppchat_reactor_destroy(Reactor *reactor);
+
+}
+
+#endif /* PPCHAT_REACTOR_H */
@@ -0,0 +1,107 @@
+#ifndef PPCHAT_REGISTRY_H
+#define PPCHAT_REGISTRY_H
+
+#include "ppchat_shared.h"
+
+// Registry of connections, a slot map.
+//
+// Every connection that is added gets a 64-bit handle made of the index of its slot and
+// the generation the slot was at. Removing the connection bumps the generation, so its
+// handles stop resolving right away even once the slot is reused. A handle can be kept,
+// passed to another thread or typed in by hand and never finds the wrong connection.
+// Looking one up is two array reads and a compare.
+//
+// Entries are packed in a structure of arrays: the i-th connection has its handle in
+// `handles[i]`, its socket in `sockets[i]` and so on, and removing one moves the last
+// one into its place. Scanning a field of every connection, like finding the ones that
+// have been quiet the longest, only touches that field's cache lines.
+//
+// Every array is reserved for `max_entries` up front and committed as the registry
+// grows, so nothing ever moves, freed slots are reused first, and any amount of churn
+// neither fragments the registry nor grows it past its peak.
+//
+// Handles carry the registry's tag as well, which tells several registries (one per
+// reactor, say) which of them a handle belongs to.
+//
+// Not thread safe, it belongs to whoever adds to it.
+
+typedef uint64_t ConnectionHandle;
+
+// No registry ever hands it out.
+const ConnectionHandle PPCHAT_INVALID_CONNECTION_HANDLE = 0;
+
+// Slot index takes the low 24 bits of a handle, the tag the 8 above them and the
+// generation the upper 32.
+const int PPCHAT_REGISTRY_SLOT_BITS = 24;
+const int PPCHAT_REGISTRY_MAX_ENTRIES = 1 << PPCHAT_REGISTRY_SLOT_BITS;
+const int PPCHAT_REGISTRY_DEFAULT_MAX_ENTRIES = 1 << 20;
+
+typedef struct ConnectionRegistry {
+	// By entry, `count` of them. Fields the owner keeps up to date are marked.
+	ConnectionHandle *handles;
+	Socket           *sockets;
+	uint8_t          *states;            // Owner's, ConnectionState for reactor connections.
+	uint32_t         *queue_sizes;       // Owner's, bytes waiting to be sent.
+	uint64_t         *last_activity_ms;  // Owner's, starts at the time it was added.
+	sockaddr_in6     *addresses;
+	void            **objects;
+	int               count;
+
+	// By slot. Generations are odd while the slot is in use. `slot_entries` holds the
+	// entry of a slot in use, and the next free slot of a free one.
+	uint32_t         *generations;
+	uint32_t         *slot_entries;
+	int               slots_count;
+	int               first_free_slot;   // -1 if every slot is in use.
+
+	int               committed_count;   // Entries and slots the arrays have memory for.
+	int               max_entries;
+	uint8_t           tag;
+	char             *memory;
+
+	uint64_t          added_count;
+	uint64_t          removed_count;
+	uint64_t          stale_lookups_count;   // Lookups of handles of removed connections.
+} ConnectionRegistry;
+
+// Tag of the registry a handle came from.
+inline uint8_t ppchat_connection_handle_tag(ConnectionHandle handle) {
+	return (uint8_t) (handle >> PPCHAT_REGISTRY_SLOT_BITS);
+}
+
+inline uint32_t ppchat_connection_handle_slot(ConnectionHandle handle) {
+	return (uint32_t) (handle & (PPCHAT_REGISTRY_MAX_ENTRIES - 1));
+}
+
+extern "C" {
+
+// Zero `max_entries` means PPCHAT_REGISTRY_DEFAULT_MAX_ENTRIES, more than
+// PPCHAT_REGISTRY_MAX_ENTRIES are capped to it. Only reserves memory.
+PPCHAT_API bool ppchat_connection_registry_create(ConnectionRegistry *registry, int max_entries, uint8_t tag, int *out_error);
+PPCHAT_API void ppchat_connection_registry_destroy(ConnectionRegistry *registry);
+
+// Returns PPCHAT_INVALID_CONNECTION_HANDLE if the registry is full or couldn't commit
+// memory for more entries.
+PPCHAT_API ConnectionHandle ppchat_connection_registry_add(ConnectionRegistry *registry, void *object, Socket socket, const sockaddr_in6 *address, uint64_t now_ms);
+
+// Returns false if the handle doesn't resolve.
+PPCHAT_API bool ppchat_connection_registry_remove(ConnectionRegistry *registry, ConnectionHandle handle);
+
+// Entry of the handle, -1 if it doesn't resolve (removed, or from another registry).
+// Only valid until something is removed.
+PPCHAT_API int ppchat_connection_registry_find(ConnectionRegistry *registry, ConnectionHandle handle);
+
+// Object the handle was added with, NULL if it doesn't resolve.
+PPCHAT_API void *ppchat_connection_registry_get(ConnectionRegistry *registry, ConnectionHandle handle);
+
+// Object in the slot, NULL if the slot is free. Slots don't tell connections that left
+// from the ones that took their place, only keep them where they go away with the
+// connection, like subscriptions to topics.
+PPCHAT_API void *ppchat_connection_registry_get_slot(ConnectionRegistry *registry, uint32_t slot);
+
+// Formats the address of an entry, which is only ever done to show it.
+PPCHAT_API const char *ppchat_connection_registry_format_address(ConnectionRegistry *registry, int entry, char *out_buffer, size_t out_buffer_size);
+
+}
+
+#endif /* PPCHAT_REGISTRY_H */
@@ -0,0 +1,83 @@
+#ifndef PPCHAT_RING_H
+#define PPCHAT_RING_H
+
+#include "ppchat_shared.h"
+
+// Bounded lock-free ring queue of fixed size items, copied in and out by value.
+//
+//     SPSC - One producer thread, one consumer thread. Enqueue and dequeue are
+//            a copy plus a single release store, no interlocked instructions.
+//     MPSC - Any number of producer threads, one consumer thread. Producers claim
+//            slots with a compare-exchange and publish them through a per-slot
+//            sequence number, so a slow producer never blocks the others.
+//
+// Producer and consumer indices live on separate cache lines, so the two sides
+// don't invalidate each other's lines on every operation. The consumer can either
+// poll, or block in `ppchat_ring_wait` until a producer publishes something.
+
+typedef enum RingQueueMode {
+	RING_QUEUE_MODE_SPSC,
+	RING_QUEUE_MODE_MPSC
+} RingQueueMode;
+
+typedef struct RingQueue {
+	// Read only after creation.
+	RingQueueMode  mode;
+	uint32_t       capacity;     // Power of two.
+	uint32_t       mask;
+	uint32_t       item_size;
+	uint32_t       slot_size;    // MPSC slots carry a sequence number in front of the item.
+	char          *slots;
+
+	// Written by producers.
+	alignas(PPCHAT_CACHE_LINE_SIZE)
+	volatile LONG64 tail;
+	LONG64          cached_head; // SPSC only, producer's last look at `head`.
+
+	// Written by the consumer.
+	alignas(PPCHAT_CACHE_LINE_SIZE)
+	volatile LONG64 head;
+	LONG64          cached_tail; // SPSC only, consumer's last look at `tail`.
+
+	// Blocking wait. Producers only touch `wake_sequence` while the consumer is waiting.
+	alignas(PPCHAT_CACHE_LINE_SIZE)
+	volatile LONG   consumer_waiting;
+	volatile LONG   wake_sequence;
+} RingQueue;
+
+extern "C" {
+
+// `capacity` is rounded up to a power of two, two at least. Returns false if out of memory.
+PPCHAT_API bool ppchat_ring_create(RingQueue *ring, RingQueueMode mode, uint32_t capacity, uint32_t item_size);
+PPCHAT_API void ppchat_ring_destroy(RingQueue *ring);
+
+// Copies `item_size` bytes from `item`. Returns false if the ring is full.
+PPCHAT_API bool ppchat_ring_enqueue(RingQueue *ring, const void *item);
+
+// SPSC only. Returns the next free slot so the item can be built in place instead of
+// copied, or NULL if the ring is full. Nothing is visible to the consumer until
+// `ppchat_ring_end_enqueue`, and a slot that is never ended is simply reused.
+PPCHAT_API void *ppchat_ring_begin_enqueue(RingQueue *ring);
+PPCHAT_API void ppchat_ring_end_enqueue(RingQueue *ring);
+
+// Copies the oldest item to `out_item`. Consumer thread only. Returns false if the ring is empty.
+PPCHAT_API bool ppchat_ring_dequeue(RingQueue *ring, void *out_item);
+
+// Copies up to `max_items` oldest items to `out_items` back to back and returns how many.
+// Consumer thread only.
+PPCHAT_API int ppchat_ring_dequeue_batch(RingQueue *ring, void *out_items, int max_items);
+
+// Blocks the consumer until the ring has items, `ppchat_ring_wake` is called,
+// or `timeout_ms` passes (INFINITE is allowed). Returns true if the ring has items.
+PPCHAT_API bool ppchat_ring_wait(RingQueue *ring, DWORD timeout_ms);
+
+// Wakes the consumer up from `ppchat_ring_wait` even though nothing was enqueued,
+// e.g. to let it notice a shutdown. Can be called from any thread.
+PPCHAT_API void ppchat_ring_wake(RingQueue *ring);
+
+// Approximate, only exact when called by the consumer with producers idle.
+PPCHAT_API bool ppchat_ring_is_empty(RingQueue *ring);
+
+}
+
+#endif /* PPCHAT_RING_H */
@@ -0,0 +1,155 @@
+#ifndef PPCHAT_SCHEMA_H
+#define PPCHAT_SCHEMA_H
+
+#include "ppchat_shared.h"
+
+// Wire schemas of the fixed-size parts of payloads.
+//
+// A message is a plain struct plus a schema that lists which of its members go on the
+// wire and in which order:
+//
+//     typedef WireSchema<
+//         PPCHAT_WIRE_FIELD(FileChunkHeader, index),
+//         PPCHAT_WIRE_FIELD(FileChunkHeader, crc)
+//     > FileChunkHeaderSchema;
+//
+//     FileChunkHeaderSchema::encode(header, out_buffer);
+//     FileChunkHeader header = FileChunkHeaderSchema::decode(buffer);
+//
+// Offsets and the size are worked out at compile time, fields are packed one after
+// another in network byte order. Everything is inlined, so encoding is a byte swap and
+// a store per field at a constant offset, and decoding a load and a byte swap, without
+// any loop or branch. Whatever comes after the fixed part (names, message text, file
+// bytes) is up to the caller, at `Schema::size` bytes into the payload.
+//
+// Members can be unsigned and signed integers, float, double, and char arrays, which go
+// as they are.
+
+template <typename T>
+struct WireValue;
+
+template <>
+struct WireValue<uint8_t> {
+	static const int size = 1;
+	static void store(char *out, uint8_t value)     { *out = (char) value; }
+	static void load(const char *in, uint8_t *out)  { *out = (uint8_t) *in; }
+};
+
+template <>
+struct WireValue<uint16_t> {
+	static const int size = 2;
+	static void store(char *out, uint16_t value)    { value = ppchat_hton16(value); memcpy(out, &value, sizeof(value)); }
+	static void load(const char *in, uint16_t *out) { uint16_t value; memcpy(&value, in, sizeof(value)); *out = ppchat_ntoh16(value); }
+};
+
+template <>
+struct WireValue<uint32_t> {
+	static const int size = 4;
+	static void store(char *out, uint32_t value)    { value = ppchat_hton32(value); memcpy(out, &value, sizeof(value)); }
+	static void load(const char *in, uint32_t *out) { uint32_t value; memcpy(&value, in, sizeof(value)); *out = ppchat_ntoh32(value); }
+};
+
+template <>
+struct WireValue<uint64_t> {
+	static const int size = 8;
+	static void store(char *out, uint64_t value)    { value = ppchat_hton64(value); memcpy(out, &value, sizeof(value)); }
+	static void load(const char *in, uint64_t *out) { uint64_t value; memcpy(&value, in, sizeof(value)); *out = ppchat_ntoh64(value); }
+};
+
+// Signed integers and floating point numbers go as the unsigned integer of the same size
+// with the same bits.
+template <typename T, typename Bits>
+struct WireValueAsBits {
+	static const int size = sizeof(Bits);
+	static void store(char *out, T value)    { Bits bits; memcpy(&bits, &value, sizeof(bits)); WireValue<Bits>::store(out, bits); }
+	static void load(const char *in, T *out) { Bits bits; WireValue<Bits>::load(in, &bits); memcpy(out, &bits, sizeof(bits)); }
+};
+
+template <> struct WireValue<int8_t>  : WireValueAsBits<int8_t, uint8_t>   { };
+template <> struct WireValue<int16_t> : WireValueAsBits<int16_t, uint16_t> { };
+template <> struct WireValue<int32_t> : WireValueAsBits<int32_t, uint32_t> { };
+template <> struct WireValue<int64_t> : WireValueAsBits<int64_t, uint64_t> { };
+template <> struct WireValue<float>   : WireValueAsBits<float, uint32_t>   { };
+template <> struct WireValue<double>  : WireValueAsBits<double, uint64_t>  { };
+
+template <int N>
+struct WireValue<char[N]> {
+	static const int size = N;
+	static void store(char *out, const char (&value)[N]) { memcpy(out, value, N); }
+	static void load(const char *in, char (*out)[N])     { memcpy(*out, in, N); }
+};
+
+// One member of `Struct`, declared with PPCHAT_WIRE_FIELD.
+template <typename Struct, typename T, T Struct::*Member>
+struct WireField {
+	typedef Struct struct_type;
+	static const int size = WireValue<T>::size;
+
+	static void store(char *out, const Struct &value) { WireValue<T>::store(out, value.*Member); }
+	static void load(const char *in, Struct *out)     { WireValue<T>::load(in, &(out->*Member)); }
+};
+
+#define PPCHAT_WIRE_FIELD(Struct, member) WireField<Struct, decltype(Struct::member), &Struct::member>
+
+// Fields placed from `Offset` on. Recursion unrolls into one store or load per field.
+template <int Offset, typename... Fields>
+struct WireLayout;
+
+template <int Offset>
+struct WireLayout<Offset> {
+	static const int end = Offset;
+
+	template <typename Struct> static void store(char *, const Struct &) { }
+	template <typename Struct> static void load(const char *, Struct *)  { }
+};
+
+template <int Offset, typename Field, typename... Rest>
+struct WireLayout<Offset, Field, Rest...> {
+	typedef WireLayout<Offset + Field::size, Rest...> rest_layout;
+	static const int end = rest_layout::end;
+
+	template <typename Struct>
+	static void store(char *out, const Struct &value) {
+		Field::store(out + Offset, value);
+		rest_layout::store(out, value);
+	}
+
+	template <typename Struct>
+	static void load(const char *in, Struct *out) {
+		Field::load(in + Offset, out);
+		rest_layout::load(in, out);
+	}
+};
+
+template <typename Field, typename... Fields>
+struct WireSchema {
+	typedef typename Field::struct_type struct_type;
+	typedef WireLayout<0, Field, Fields...> layout;
+
+	// Bytes the fixed part takes on the wire.
+	static const int size = layout::end;
+
+	// Writes `size` bytes. Returns where whatever follows the fixed part goes.
+	static char *encode(const struct_type &value, char *out_buffer) {
+		layout::store(out_buffer, value);
+		return out_buffer + size;
+	}
+
+	// Reads `size` bytes, which the caller has checked are there.
+	static struct_type decode(const char *buffer) {
+		struct_type value = { };
+		layout::load(buffer, &value);
+		return value;
+	}
+
+	// Returns false if the payload is too short for the fixed part.
+	static bool decode(const char *payload, int payload_size, struct_type *out_value) {
+		if (payload_size < size)
+			return false;
+
+		layout::load(payload, out_value);
+		return true;
+	}
+};
+
+#endif /* PPCHAT_SCHEMA_H */
@@ -0,0 +1,178 @@
+#ifndef PPCHAT_SEARCH_H
+#define PPCHAT_SEARCH_H
+
+#include "ppchat_shared.h"
+#include "ppchat_history.h"
+
+// Full text search over the message history.
+//
+// An inverted index maps every word to the sequence numbers of the messages it is in
+// (its posting list). A background thread follows the history and adds new messages
+// to an index in memory, so messages can be found a moment after they are appended
+// without anything being added to the path a message takes through the server. Once
+// the index in memory grows past `memtable_size`, or has been around for
+// `persist_interval_ms`, it is written out next to the history segments as a run file
+// and a new one is started. Runs are never modified: when there are more than
+// `max_runs` of them, the two neighbouring runs that are smallest together are merged
+// into one, and runs that only point at messages the history has dropped are deleted.
+//
+//     run:       | magic uint32 | version uint32 | terms count uint32 | padding uint32 |
+//                | first sequence uint64 | last sequence uint64 | postings count uint64 |
+//                | term | term | ... sorted by term bytes |
+//                | term bytes | postings |
+//
+//     term:      | postings offset uint64 | last sequence uint64 |
+//                | postings size uint32 | postings count uint32 | term offset uint32 | term size uint32 |
+//
+//     postings:  | varint | varint | ...
+//
+// Posting lists hold the difference from the previous sequence number (the first one
+// from zero) as a LEB128 varint, so a word that comes up in most messages takes about
+// a byte per message. Run files are named after the first and last sequence numbers
+// they cover, and every run covers sequence numbers after the ones of the runs before
+// it, so a query goes through the index from the newest messages back and stops once
+// it has enough of them.
+//
+// Words are runs of ASCII letters and digits and of any bytes above 127 (which keeps
+// UTF-8 words whole), lowercased, at least PPCHAT_SEARCH_MIN_WORD_SIZE long and cut to
+// PPCHAT_SEARCH_MAX_WORD_SIZE. The room of every message is indexed as a term of its
+// own, so that queries limited to a room are answered from the index too.
+//
+// Opening the index only lists run files, they are mapped by the first query that needs
+// them. Whatever was in memory when the server stopped is indexed again from the history.
+
+const int PPCHAT_SEARCH_DEFAULT_MEMTABLE_SIZE = 16 * 1024 * 1024;
+const int PPCHAT_SEARCH_DEFAULT_MAX_RUNS = 8;
+const int PPCHAT_SEARCH_DEFAULT_PERSIST_INTERVAL_MS = 60 * 1000;
+
+// How often the indexing thread looks for new messages, and how many it takes at a time.
+const int PPCHAT_SEARCH_FOLLOW_INTERVAL_MS = 50;
+const int PPCHAT_SEARCH_FOLLOW_BATCH_SIZE = 256;
+
+const int PPCHAT_SEARCH_MAX_RUNS = 64;
+const int PPCHAT_SEARCH_MIN_WORD_SIZE = 2;
+const int PPCHAT_SEARCH_MAX_WORD_SIZE = 32;
+const int PPCHAT_SEARCH_MAX_QUERY_TERMS = 8;
+const int PPCHAT_SEARCH_MAX_RESULTS = 100;
+
+// Room terms are the room name after a byte words can't start with.
+const int PPCHAT_SEARCH_MAX_TERM_SIZE = 1 + PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE;
+const int PPCHAT_SEARCH_TERM_BUCKETS_COUNT = 16384;
+
+const int PPCHAT_SEARCH_RUN_HEADER_SIZE = 40;
+const int PPCHAT_SEARCH_RUN_TERM_SIZE = 32;
+
+// Suffix of run files, which are kept in the history folder.
+const char *const PPCHAT_SEARCH_RUN_SUFFIX = ".index";
+
+typedef struct SearchOptions {
+	const char *folder;               // History folder.
+	int         memtable_size;        // Zero means PPCHAT_SEARCH_DEFAULT_MEMTABLE_SIZE.
+	int         max_runs;             // Zero means PPCHAT_SEARCH_DEFAULT_MAX_RUNS.
+	int         persist_interval_ms;  // Zero means PPCHAT_SEARCH_DEFAULT_PERSIST_INTERVAL_MS.
+} SearchOptions;
+
+typedef struct SearchTerm {
+	struct SearchTerm *next;
+	uint64_t           last_sequence;
+	uint8_t           *postings;          // Varints, as in a run.
+	uint32_t           postings_size;
+	uint32_t           postings_capacity;
+	uint32_t           postings_count;
+	uint32_t           term_size;
+	char               term[PPCHAT_SEARCH_MAX_TERM_SIZE];
+} SearchTerm;
+
+// Index in memory, only ever written by the indexing thread.
+typedef struct SearchMemtable {
+	SearchTerm **buckets;
+	uint64_t     terms_count;
+	uint64_t     postings_count;
+	uint64_t     size;                    // Bytes taken by terms and postings.
+	uint64_t     first_sequence;          // Zero while the memtable is empty.
+	uint64_t     last_sequence;
+	uint64_t     start_timestamp;         // When the first message went in.
+} SearchMemtable;
+
+typedef struct SearchRun {
+	char          path[MAX_PATH];
+	uint64_t      first_sequence;
+	uint64_t      last_sequence;
+	uint64_t      file_size;
+
+	// Mapped by the first query that reads the run. Runs that turn out not to be
+	// readable are kept with no terms, so queries don't try them again.
+	SRWLOCK       map_lock;
+	bool          mapped;
+	HANDLE        file;
+	HANDLE        mapping;
+	const char   *view;
+	uint32_t      terms_count;
+} SearchRun;
+
+typedef struct SearchIndex {
+	char            folder[MAX_PATH];
+	HistoryStore   *history;
+	uint64_t        memtable_size;
+	int             max_runs;
+	int             persist_interval_ms;
+
+	// Taken exclusively by the indexing thread to add messages and to swap the memtable
+	// or runs, shared by queries while they read them. Runs are written and merged
+	// without it, so queries only ever wait for a batch of messages to be added.
+	SRWLOCK         lock;
+	SearchMemtable *memtable;
+	SearchRun      *runs[PPCHAT_SEARCH_MAX_RUNS];   // Oldest first.
+	int             runs_count;
+	uint64_t        indexed_sequence;               // Every message up to this one is in the index.
+
+	HANDLE          thread;
+	HANDLE          stop_event;
+
+	// Statistics.
+	volatile LONG64 queries_count;
+	volatile LONG64 max_query_duration_ns;
+	uint64_t        indexed_count;                  // Since the index was opened.
+	uint64_t        persisted_runs_count;
+	uint64_t        merges_count;
+	uint64_t        max_merge_duration_ns;
+} SearchIndex;
+
+typedef struct SearchStats {
+	uint64_t indexed_sequence;
+	uint64_t indexed_count;
+	uint64_t memtable_terms_count;
+	uint64_t memtable_size;
+	uint64_t runs_count;
+	uint64_t runs_size;
+	uint64_t persisted_runs_count;
+	uint64_t merges_count;
+	uint64_t max_merge_duration_ns;
+	uint64_t queries_count;
+	uint64_t max_query_duration_ns;
+} SearchStats;
+
+extern "C" {
+
+// Lists the runs in `options->folder` and starts the indexing thread, which picks up
+// from the history right after the last message in them. `history` has to stay open
+// until the index is closed.
+PPCHAT_API bool ppchat_search_open(SearchIndex *index, HistoryStore *history, const SearchOptions *options, int *out_error);
+
+// Stops the indexing thread, writes the memtable out as a run and unmaps every run.
+PPCHAT_API void ppchat_search_close(SearchIndex *index);
+
+// Finds the messages that have every word of `query` in them, in `room` unless it is
+// NULL, and writes up to `max_results` (at most PPCHAT_SEARCH_MAX_RESULTS) sequence
+// numbers, newest first. Any thread can query. Returns how many there were, zero if
+// `query` has no words.
+PPCHAT_API int ppchat_search_query(SearchIndex *index, const char *room, const char *query, int query_size, uint64_t *out_sequences, int max_results);
+
+// Blocks until every message up to `sequence` is in the index, or `timeout_ms` passes.
+PPCHAT_API bool ppchat_search_wait(SearchIndex *index, uint64_t sequence, int timeout_ms);
+
+PPCHAT_API void ppchat_search_get_stats(SearchIndex *index, SearchStats *out_stats);
+
+}
+
+#endif /* PPCHAT_SEARCH_H */
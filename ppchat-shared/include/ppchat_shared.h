@@ -30,14 +30,14 @@
 // _ppchat_log(FILE *stream, const char *prefix, const char *timestamp_suffix, const char *suffix, const char *format, ...)
 // WARNING: prefix, timestamp_suffix, and suffix parameters must not contain
 // any formatting specifiers as it would break the macro!
+//
+// The "[hh:mm:ss] " timestamp goes between `prefix` and the rest. Whether the line
+// is printed right away or by the logging thread is up to ppchat_log.h.
 #define _ppchat_log(stream, prefix, timestamp_suffix, suffix, format, ...) { \
-    tm __my_log_time = get_current_local_time();                             \
-    log_message(                                                             \
+    ppchat_log_write(                                                        \
         stream,                                                              \
-        prefix "[%02d:%02d:%02d] " timestamp_suffix format suffix,           \
-        __my_log_time.tm_hour,                                               \
-        __my_log_time.tm_min,                                                \
-        __my_log_time.tm_sec,                                                \
+        prefix,                                                              \
+        timestamp_suffix format suffix,                                      \
         __VA_ARGS__                                                          \
     );                                                                       \
 }
@@ -62,20 +62,19 @@
     exit_process_with_error();         \
 }
 
-const char *PPCHAT_DEFAULT_PORT = "1337";
+const char *const PPCHAT_DEFAULT_PORT = "1337";
 const int PPCHAT_RECEIVE_BUFFER_SIZE = 4096;
 const int PPCHAT_INPUT_QUEUE_ITEM_SIZE = 256;
-const int PPCHAT_INPUT_QUEUE_MAX_ITEMS = 4;
+const int PPCHAT_INPUT_QUEUE_MAX_ITEMS = 64;
 const int PPCHAT_ERROR_MESSAGE_BUFFER_SIZE = 256;
+const int PPCHAT_CACHE_LINE_SIZE = 64;
 
-typedef struct InputQueue {
-	CRITICAL_SECTION critical_section;
-	size_t           max_items;
-	size_t           item_size;
-	unsigned int     items_count;
-	unsigned int     front_item_index;
-	char            *buffer;
-} InputQueue;
+// See `ppchat_connect`.
+const DWORD PPCHAT_CONNECT_ATTEMPT_DELAY_MS = 250;
+const DWORD PPCHAT_CONNECT_ATTEMPT_TIMEOUT_MS = 5000;
+const DWORD PPCHAT_CONNECT_TIMEOUT_MS = 15000;
+const int PPCHAT_CONNECT_MAX_ADDRESSES = 64;
+const int PPCHAT_CONNECT_MAX_ATTEMPTS = 16;   // At once, a select() set holds 64 at most.
 
 typedef struct Socket {
 	union {
@@ -102,23 +101,20 @@ inline uint16_t ppchat_ntoh16(uint16_t network_value) { return ntohs(network_val
 inline uint32_t ppchat_ntoh32(uint32_t network_value) { return ntohl(network_value); }
 inline uint64_t ppchat_ntoh64(uint64_t network_value) { return ntohll(network_value); }
 inline float    ppchat_ntohf(float network_value)     { return ntohf(network_value); }
-inline double   ppchat_ntohf(double network_value)    { return ntohd(network_value); }
+inline double   ppchat_ntohd(double network_value)    { return ntohd(network_value); }
 
 extern "C" {
 
 PPCHAT_API char *ppchat_ipv4_binary_to_string(uint32_t ipv4_binary, char *out_ipv4_string, size_t out_ipv4_string_size, bool network_byte_order);
 
 // Host-to-Network byte order conversion of arbitraty size.
+// Arrays and structs of many fields go through ppchat_byte_order.h instead.
+// Here and in ppchat_ntoh_bytes, an output shorter than the input gets its most significant bytes.
 PPCHAT_API void *ppchat_hton_bytes(void *host_bytes, size_t host_bytes_count, void *out_network_bytes, size_t out_network_bytes_count);
 
 // Network-to-Host byte order conversion of arbitrary size.
 PPCHAT_API void *ppchat_ntoh_bytes(void *network_bytes, size_t network_bytes_count, void *out_host_bytes, size_t out_host_bytes_count);
 
-PPCHAT_API InputQueue create_input_queue(size_t max_items, size_t item_size);
-PPCHAT_API bool get_next_queue(InputQueue *queue, char **out_queue);
-PPCHAT_API bool queue_input(InputQueue *queue, char *input);
-PPCHAT_API void destroy_input_queue(InputQueue *queue);
-
 PPCHAT_API tm get_current_local_time();
 PPCHAT_API void log_message(FILE *stream, const char *format, ...);
 
@@ -127,12 +123,35 @@ PPCHAT_API char *get_error_description(int error, char *out_message, size_t mess
 
 PPCHAT_API void exit_process_with_error();
 
+// QueryPerformanceCounter ticks, `ppchat_get_timestamp_frequency` of them per second.
+PPCHAT_API uint64_t ppchat_get_timestamp();
+PPCHAT_API uint64_t ppchat_get_timestamp_frequency();
+PPCHAT_API uint64_t ppchat_timestamp_to_nanoseconds(uint64_t ticks);
+PPCHAT_API uint64_t ppchat_timestamp_to_milliseconds(uint64_t ticks);
+
+// User and kernel time together, in nanoseconds. Only as precise as the scheduler tick.
+PPCHAT_API uint64_t ppchat_get_process_cpu_time();
+PPCHAT_API uint64_t ppchat_get_thread_cpu_time();
+
 PPCHAT_API int clamp(int min_value, int max_value, int value);
 
 PPCHAT_API Socket ppchat_create_socket(int address_family, int socket_type, int protocol);
 PPCHAT_API int ppchat_bind(Socket socket, const sockaddr *address_name, int address_name_length);
 PPCHAT_API int ppchat_listen(Socket socket, int max_connections);
 PPCHAT_API Socket ppchat_accept(Socket socket, sockaddr *address, int *address_length);
+
+// Creates an IPv6 (dual stack) TCP socket bound to all local addresses
+// on the specified port and puts it into listening state.
+// Returns INVALID_SOCKET and sets `out_error` on failure.
+PPCHAT_API Socket ppchat_create_listen_socket(const char *port, int *out_error);
+
+// Resolves `ip` and connects to whichever of its addresses answers first. Attempts race
+// each other the Happy Eyeballs way (RFC 8305): IPv6 and IPv4 addresses take turns, each
+// attempt gets PPCHAT_CONNECT_ATTEMPT_DELAY_MS of head start on the next one (which starts
+// right away if it fails instead), and gives up after PPCHAT_CONNECT_ATTEMPT_TIMEOUT_MS.
+// So an address that never answers costs the delay, not the system's connect timeout.
+// Returns a blocking socket, or INVALID_SOCKET and sets `out_error` on failure, which is
+// WSAETIMEDOUT once PPCHAT_CONNECT_TIMEOUT_MS have passed.
 PPCHAT_API Socket ppchat_connect(const char *ip, const char *port, int *out_error);
 PPCHAT_API bool ppchat_disconnect(Socket *socket, int disconnect_method, int *out_error);
 PPCHAT_API int ppchat_set_socket_option(Socket socket, int level, int option, const char *option_value, int option_length);
@@ -156,4 +175,7 @@ PPCHAT_API size_t ppchat_append_time_span_to_string(char *out_buffer, size_t out
 
 }
 
+// Needs everything above, and the `log()` macros need it.
+#include "ppchat_log.h"
+
 #endif /* PPCHAT_SHARED_H */
@@ -0,0 +1,72 @@
+#ifndef PPCHAT_STATS_H
+#define PPCHAT_STATS_H
+
+#include "ppchat_shared.h"
+
+// Histogram with log-linear buckets, in the manner of HdrHistogram: values below 64
+// are counted exactly, and every power of two above that is split into 32 equal
+// buckets, so any value is off by at most 1/32 (~3%) across the whole uint64_t range.
+//
+// A histogram has a single writer. Other threads may read it at any time and see
+// every bucket either before or after an update, but not a torn one.
+
+const int PPCHAT_HISTOGRAM_SUB_BUCKETS_BITS = 5;
+const int PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT = 1 << PPCHAT_HISTOGRAM_SUB_BUCKETS_BITS;
+const int PPCHAT_HISTOGRAM_BUCKETS_COUNT = (64 - PPCHAT_HISTOGRAM_SUB_BUCKETS_BITS + 1) * PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT;
+
+typedef struct Histogram {
+	uint64_t total_count;
+	uint64_t max_value;
+	uint64_t counts[PPCHAT_HISTOGRAM_BUCKETS_COUNT];
+} Histogram;
+
+// Statistics sharded per thread.
+//
+// Every thread that adds to a counter or records into a histogram gets a shard of
+// its own, on its own cache lines, and updates it with plain stores. Reading sums
+// up all the shards, so writers never contend with each other or with readers.
+// Counter and histogram ids are up to the caller.
+
+const int PPCHAT_STATS_MAX_COUNTERS = 16;
+const int PPCHAT_STATS_MAX_HISTOGRAMS = 4;
+const int PPCHAT_STATS_MAX_THREADS = 64;   // Any threads after that share one interlocked shard.
+
+typedef struct StatsShard {
+	alignas(PPCHAT_CACHE_LINE_SIZE)
+	uint64_t  counters[PPCHAT_STATS_MAX_COUNTERS];
+	Histogram histograms[PPCHAT_STATS_MAX_HISTOGRAMS];
+	bool      shared;
+} StatsShard;
+
+extern "C" {
+
+PPCHAT_API void ppchat_histogram_reset(Histogram *histogram);
+PPCHAT_API void ppchat_histogram_record(Histogram *histogram, uint64_t value);
+
+// Corrects for coordinated omission the way HdrHistogram does: when `value` is longer
+// than `expected_interval` between samples, the samples that the stall kept from being
+// taken are recorded as well, each one interval shorter than the previous.
+PPCHAT_API void ppchat_histogram_record_corrected(Histogram *histogram, uint64_t value, uint64_t expected_interval);
+
+// Adds all values of `histogram` to `out_histogram`.
+PPCHAT_API void ppchat_histogram_merge(Histogram *out_histogram, Histogram *histogram);
+
+// Smallest value that `percentile` percent (0 - 100) of recorded values are less or equal to,
+// rounded up to the end of its bucket. Zero if nothing has been recorded.
+PPCHAT_API uint64_t ppchat_histogram_get_percentile(Histogram *histogram, double percentile);
+
+PPCHAT_API int ppchat_histogram_get_bucket(uint64_t value);
+PPCHAT_API uint64_t ppchat_histogram_get_bucket_max_value(int bucket);
+
+PPCHAT_API void ppchat_stats_add(int counter, uint64_t value);
+PPCHAT_API void ppchat_stats_record(int histogram, uint64_t value);
+
+// Sums the counter over all threads.
+PPCHAT_API uint64_t ppchat_stats_get_counter(int counter);
+
+// Merges the histogram of all threads into `out_histogram`, which is reset first.
+PPCHAT_API void ppchat_stats_get_histogram(int histogram, Histogram *out_histogram);
+
+}
+
+#endif /* PPCHAT_STATS_H */
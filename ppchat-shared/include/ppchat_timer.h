@@ -0,0 +1,87 @@
+#ifndef PPCHAT_TIMER_H
+#define PPCHAT_TIMER_H
+
+#include "ppchat_shared.h"
+
+// Hashed hierarchical timing wheel.
+//
+// Time is cut into ticks of `tick_ms`. The wheel has four levels of 64 slots, a slot of
+// level N spans 64^N ticks, so the levels cover 64, 4096, 262144 and 16777216 ticks
+// (about 46 hours with 10 ms ticks). A timer goes to the slot of the lowest level its
+// expiry fits in, and whenever the lowest level wraps around, the next slot of the level
+// above is emptied into the levels below it. A timer is moved at most once per level on
+// its way down, no matter how many timers there are.
+//
+// Timers are embedded in whatever they time and linked into the slot lists, so arming
+// and cancelling is a few pointer writes and never allocates. There is no per-timer
+// work while time passes, only per tick, and a tick with nothing in it costs a bit test.
+//
+// Timers further out than the wheel covers wait in the top level and are moved
+// along with it until they are due.
+//
+// The wheel is not thread safe, it belongs to whoever advances it.
+
+const int PPCHAT_TIMER_WHEEL_LEVELS = 4;
+const int PPCHAT_TIMER_WHEEL_SLOT_BITS = 6;
+const int PPCHAT_TIMER_WHEEL_SLOTS = 1 << PPCHAT_TIMER_WHEEL_SLOT_BITS;
+
+struct Timer;
+
+// Called from `ppchat_timer_wheel_advance` once the timer is due. The timer is not armed
+// anymore by then and can be armed again right from the callback.
+typedef void (*TimerCallback)(struct Timer *timer, void *argument);
+
+typedef struct Timer {
+	struct Timer  *previous;
+	struct Timer  *next;
+	struct Timer **slot;          // Head of the list the timer is in, NULL while not armed.
+	uint64_t       expiry_tick;
+	TimerCallback  callback;
+	void          *argument;
+} Timer;
+
+typedef struct TimerWheel {
+	uint32_t  tick_ms;
+	uint64_t  start_ms;           // Time of tick zero.
+	uint64_t  current_tick;       // Last tick that was processed.
+	uint64_t  armed_count;
+
+	Timer    *slots[PPCHAT_TIMER_WHEEL_LEVELS][PPCHAT_TIMER_WHEEL_SLOTS];
+
+	// Bit per slot that has timers, so finding the next one doesn't scan the lists.
+	uint64_t  occupied_slots[PPCHAT_TIMER_WHEEL_LEVELS];
+
+	uint64_t  fired_count;
+	uint64_t  cascaded_count;     // Times a timer was moved down a level.
+} TimerWheel;
+
+extern "C" {
+
+// `now_ms` is the current time on whatever clock the wheel is advanced with,
+// usually `ppchat_timestamp_to_milliseconds(ppchat_get_timestamp())`.
+PPCHAT_API void ppchat_timer_wheel_init(TimerWheel *wheel, uint32_t tick_ms, uint64_t now_ms);
+
+PPCHAT_API void ppchat_timer_init(Timer *timer, TimerCallback callback, void *argument);
+
+// Makes the timer fire once `delay_ms` have passed since the wheel was last advanced,
+// rounded up to whole ticks, so never early but up to a tick late. A timer that is armed
+// already is moved to the new expiry.
+PPCHAT_API void ppchat_timer_arm(TimerWheel *wheel, Timer *timer, uint32_t delay_ms);
+
+// Does nothing if the timer isn't armed.
+PPCHAT_API void ppchat_timer_cancel(TimerWheel *wheel, Timer *timer);
+
+PPCHAT_API bool ppchat_timer_is_armed(Timer *timer);
+
+// Processes every tick up to `now_ms` and fires timers that are due, in expiry order
+// between ticks. Returns how many fired.
+PPCHAT_API int ppchat_timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms);
+
+// Milliseconds from `now_ms` until the wheel needs to be advanced again, INFINITE if no
+// timer is armed. Can be early when the next timer waits in an upper level, in which
+// case advancing just moves it down.
+PPCHAT_API DWORD ppchat_timer_wheel_get_timeout(TimerWheel *wheel, uint64_t now_ms);
+
+}
+
+#endif /* PPCHAT_TIMER_H */
@@ -0,0 +1,97 @@
+#ifndef PPCHAT_TOPICS_H
+#define PPCHAT_TOPICS_H
+
+#include "ppchat_shared.h"
+
+// Topic router, for publish and subscribe next to rooms.
+//
+// Topics are dot separated levels, like `ops.alerts.disk`. Subscriptions are patterns
+// of them, where a level can also be `*`, which matches any single level, and the last
+// level can be `#`, which matches any number of levels, none included: `ops.#` matches
+// `ops`, `ops.alerts` and `ops.alerts.disk`.
+//
+// Patterns are kept in a trie by level. Levels that no pattern branches off at are kept
+// on a single edge, so `ops.alerts.disk` alone is one node under the root, and it's split
+// once `ops.builds` comes along. Wildcards get edges of their own. Matching a topic walks
+// the trie once, down the literal edge and the `*` edge at every level, so what it costs
+// depends on how deep the topic is and how many patterns with wildcards it meets, not on
+// how many subscribers there are.
+//
+// Subscribers are numbers the caller picks, meant to be the slots of a registry (see
+// ppchat_registry.h). Matches are collected in a TopicRecipients, which has a bit for
+// every subscriber, so one that subscribed to several matching patterns is in there once.
+//
+// Not thread safe, it belongs to whoever subscribes to it.
+
+// Longest topic or pattern, in bytes.
+const int PPCHAT_TOPIC_MAX_SIZE = 128;
+
+typedef struct TopicSubscribers {
+	uint32_t *items;
+	int       count;
+	int       capacity;
+} TopicSubscribers;
+
+typedef struct TopicNode {
+	// Literal levels of the edge into the node, dot separated. Empty for the root and
+	// for the nodes under `*` edges.
+	char              *label;
+	int                label_size;
+	int                first_level_size;
+
+	// Literal edges, sorted by their first level, which no two of them share.
+	struct TopicNode **children;
+	int                children_count;
+	int                children_capacity;
+	struct TopicNode  *any_child;          // `*` edge.
+
+	TopicSubscribers   subscribers;        // Of patterns that end here.
+	TopicSubscribers   rest_subscribers;   // Of patterns that end here with `#`.
+} TopicNode;
+
+typedef struct TopicRouter {
+	TopicNode root;
+	uint64_t  nodes_count;           // Root included.
+	uint64_t  subscriptions_count;
+} TopicRouter;
+
+// Subscribers a topic matched, each of them once.
+typedef struct TopicRecipients {
+	uint32_t *subscribers;
+	int       count;
+	int       capacity;
+
+	// Bit per subscriber, only the bits of `subscribers` are ever set.
+	uint64_t *seen;
+	int       seen_words_count;
+} TopicRecipients;
+
+extern "C" {
+
+PPCHAT_API void ppchat_topic_router_init(TopicRouter *router);
+PPCHAT_API void ppchat_topic_router_destroy(TopicRouter *router);
+
+// Topics are 1 to PPCHAT_TOPIC_MAX_SIZE bytes of printable characters but spaces, `*` and
+// `#`, with no empty levels.
+PPCHAT_API bool ppchat_topic_is_valid(const char *topic, int topic_size);
+
+// Same as topics, but levels can be `*`, and the last one `#`.
+PPCHAT_API bool ppchat_topic_pattern_is_valid(const char *pattern, int pattern_size);
+
+// Pattern has to be valid. Subscribing to the same pattern twice takes unsubscribing twice.
+// Returns false if out of memory.
+PPCHAT_API bool ppchat_topic_router_subscribe(TopicRouter *router, const char *pattern, int pattern_size, uint32_t subscriber);
+
+// Returns false if the subscriber isn't subscribed to the pattern.
+PPCHAT_API bool ppchat_topic_router_unsubscribe(TopicRouter *router, const char *pattern, int pattern_size, uint32_t subscriber);
+
+// Replaces what `recipients` held with the subscribers of patterns the topic matches,
+// which has to be valid. Returns false if out of memory, with some of them collected.
+PPCHAT_API bool ppchat_topic_router_match(TopicRouter *router, const char *topic, int topic_size, TopicRecipients *recipients);
+
+PPCHAT_API void ppchat_topic_recipients_init(TopicRecipients *recipients);
+PPCHAT_API void ppchat_topic_recipients_destroy(TopicRecipients *recipients);
+
+}
+
+#endif /* PPCHAT_TOPICS_H */
@@ -0,0 +1,202 @@
+#ifndef PPCHAT_TRANSFER_H
+#define PPCHAT_TRANSFER_H
+
+#include "ppchat_shared.h"
+#include "ppchat_framing.h"
+
+// File transfer.
+//
+// A file is split into chunks of PPCHAT_FILE_CHUNK_SIZE (the last one can be shorter),
+// and every chunk carries its index and CRC-32C, so the receiver can tell which ones
+// it has for sure. A transfer goes like this:
+//
+//     sender:   FILE_BEGIN   | file size uint64 | file id uint64 | name            |
+//     receiver: FILE_RESUME  | first chunk to send uint32                          |
+//     sender:   FILE_DATA    | chunk index uint32 | crc32c uint32 | chunk bytes    |  (FRAME_FLAG_STREAMED)
+//               ...one FILE_DATA frame per chunk, from that chunk to the last one.
+//
+// File id tells versions of a file with the same name and size apart (the sender uses
+// the last write time). The receiver keeps a bitmap of verified chunks on disk next to
+// the partial file, so when the connection drops, sending the same file again picks up
+// at the first chunk it is missing instead of starting over.
+//
+// File bytes never pass through buffers of our own. The sender maps the file to compute
+// checksums and hands chunks to TransmitFile, which sends them right from the system
+// file cache. The receiver maps a window of the destination file, sized up front, and
+// has the reactor receive straight into it (see `ppchat_reactor_receive_into`).
+//
+// When the peers have agreed on compression (see ppchat_compression.h), chunks that
+// compress go out in a frame of their own instead, whole rather than streamed, and are
+// decompressed right into the mapped destination:
+//
+//     sender:   FILE_DATA    | chunk index uint32 | crc32c uint32 | uncompressed size uint32 | LZ4 block |  (FRAME_FLAG_COMPRESSED)
+//
+// CRC-32C is always that of the chunk bytes themselves. Chunks are compressed by worker
+// threads a few chunks ahead of the one being sent, so the socket is kept busy while
+// they work, and chunks that don't compress are still sent from the file cache.
+
+const int PPCHAT_FILE_CHUNK_SIZE = 1024 * 1024;
+const int PPCHAT_FILE_CHUNK_HEADER_SIZE = 8;
+const int PPCHAT_FILE_NAME_MAX_SIZE = 255;
+const int PPCHAT_FILE_BEGIN_MAX_SIZE = 2 * sizeof(uint64_t) + PPCHAT_FILE_NAME_MAX_SIZE;
+
+// FILE_DATA frames are a chunk with its header, a bit more than PPCHAT_FRAME_MAX_PAYLOAD_SIZE,
+// so receivers have to let their frame decoder take that much.
+const int PPCHAT_FILE_DATA_MAX_PAYLOAD_SIZE = PPCHAT_FILE_CHUNK_HEADER_SIZE + PPCHAT_FILE_CHUNK_SIZE;
+
+// Most threads that compress chunks of a file being sent.
+const int PPCHAT_FILE_MAX_COMPRESSION_THREADS = 8;
+
+// How much of a file is mapped at a time, so that multi-gigabyte files don't take as
+// much address space. Multiple of both the allocation granularity and the chunk size.
+const int PPCHAT_FILE_WINDOW_SIZE = 64 * 1024 * 1024;
+
+// Suffix of the file that keeps the bitmap of a partially received file.
+const char *const PPCHAT_TRANSFER_STATE_SUFFIX = ".transfer";
+
+// Fixed part of FILE_BEGIN, the name follows it.
+typedef struct FileBeginHeader {
+	uint64_t file_size;
+	uint64_t file_id;
+} FileBeginHeader;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(FileBeginHeader, file_size),
+	PPCHAT_WIRE_FIELD(FileBeginHeader, file_id)
+> FileBeginHeaderSchema;
+
+typedef struct FileResume {
+	uint32_t first_chunk;
+} FileResume;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(FileResume, first_chunk)
+> FileResumeSchema;
+
+typedef struct FileChunkHeader {
+	uint32_t index;
+	uint32_t crc;
+} FileChunkHeader;
+
+typedef WireSchema<
+	PPCHAT_WIRE_FIELD(FileChunkHeader, index),
+	PPCHAT_WIRE_FIELD(FileChunkHeader, crc)
+> FileChunkHeaderSchema;
+
+static_assert(FileChunkHeaderSchema::size == PPCHAT_FILE_CHUNK_HEADER_SIZE, "File chunk header schema doesn't match its size.");
+static_assert(FileBeginHeaderSchema::size + PPCHAT_FILE_NAME_MAX_SIZE == PPCHAT_FILE_BEGIN_MAX_SIZE, "File begin schema doesn't match its size.");
+
+// Sending side of a transfer.
+typedef struct FileSource {
+	HANDLE      file;
+	HANDLE      mapping;
+	const char *name;           // Points into the path it was opened with.
+	uint64_t    size;
+	uint64_t    id;
+	uint32_t    chunks_count;
+
+	char       *window;
+	uint64_t    window_offset;
+	int         window_size;
+
+	// Of the last `ppchat_send_file_chunks`, chunk bytes on the wire and how many chunks went compressed.
+	uint64_t    sent_size;
+	uint32_t    compressed_chunks_count;
+} FileSource;
+
+// Receiving side of a transfer: the destination file, written in place through a mapped window.
+typedef struct FileSink {
+	HANDLE   file;
+	HANDLE   mapping;
+	uint64_t size;
+	uint64_t position;          // Where the next byte goes.
+
+	// Bytes that didn't arrive right into the window and had to be copied there.
+	uint64_t copied_size;
+
+	char    *window;
+	uint64_t window_offset;
+	int      window_size;
+} FileSink;
+
+// Which chunks of a file have been received and verified, kept in a file of its own:
+//
+//     | magic uint32 | version uint32 | file size uint64 | file id uint64 |
+//     | chunk size uint32 | chunks count uint32 | bitmap, one bit per chunk |
+typedef struct TransferState {
+	HANDLE   file;
+	char     path[MAX_PATH];
+	uint64_t file_size;
+	uint64_t file_id;
+	uint32_t chunks_count;
+	uint32_t received_chunks_count;
+	uint8_t *bitmap;
+} TransferState;
+
+extern "C" {
+
+PPCHAT_API uint32_t ppchat_get_file_chunks_count(uint64_t file_size);
+PPCHAT_API uint32_t ppchat_get_file_chunk_size(uint64_t file_size, uint32_t chunk_index);
+
+// Writes the FILE_BEGIN payload, `out_payload` has to hold PPCHAT_FILE_BEGIN_MAX_SIZE bytes.
+// Returns the payload size, or -1 if the name is empty or too long.
+PPCHAT_API int ppchat_encode_file_begin(char *out_payload, uint64_t file_size, uint64_t file_id, const char *name);
+
+// Returns false if the payload is malformed, or the name isn't a plain file name
+// (path separators, reserved characters, "." and ".."). `out_name` has to hold
+// PPCHAT_FILE_NAME_MAX_SIZE + 1 characters.
+PPCHAT_API bool ppchat_decode_file_begin(const char *payload, int payload_size, uint64_t *out_file_size, uint64_t *out_file_id, char *out_name);
+
+PPCHAT_API void ppchat_encode_file_chunk_header(char *out_buffer, FileChunkHeader header);
+PPCHAT_API FileChunkHeader ppchat_decode_file_chunk_header(const char *buffer);
+
+// Opens the file at `path` for sending, named after the last component of the path.
+PPCHAT_API bool ppchat_file_source_open(FileSource *source, const char *path, int *out_error);
+PPCHAT_API void ppchat_file_source_close(FileSource *source);
+
+PPCHAT_API bool ppchat_send_file_begin(Socket socket, FileSource *source, int *out_error);
+
+// Sends chunks from `first_chunk` to the last one over a blocking socket, compressing the
+// ones that get smaller when `compress` is set. Returns false and sets `out_error` on failure.
+PPCHAT_API bool ppchat_send_file_chunks(Socket socket, FileSource *source, uint32_t first_chunk, bool compress, int *out_error);
+
+// Opens the destination file sized to `size` bytes. Existing contents are kept when
+// `keep_contents` is set, for a transfer that is being resumed, and dropped otherwise.
+PPCHAT_API bool ppchat_file_sink_open(FileSink *sink, const char *path, uint64_t size, bool keep_contents, int *out_error);
+
+PPCHAT_API void ppchat_file_sink_seek(FileSink *sink, uint64_t position);
+
+// Where the next byte goes and how many bytes after it are mapped, never past the end
+// of the file. Moves the window once the position leaves it. Returns NULL and sets
+// `out_error` if it couldn't be mapped, or with zero error at the end of the file.
+PPCHAT_API char *ppchat_file_sink_get_destination(FileSink *sink, int *out_size, int *out_error);
+
+// Writes the next `size` bytes of the file at the current position. Bytes that have been
+// received right into the destination are only accounted for. Returns false and sets
+// `out_error` if they don't fit into the file or the window couldn't be mapped.
+PPCHAT_API bool ppchat_file_sink_write(FileSink *sink, const char *data, int size, int *out_error);
+
+// Maps `size` bytes of the file at `offset` to read them, as long as they don't cross
+// a window boundary (chunks never do). Returns NULL and sets `out_error` on failure.
+PPCHAT_API char *ppchat_file_sink_view(FileSink *sink, uint64_t offset, int size, int *out_error);
+
+PPCHAT_API void ppchat_file_sink_close(FileSink *sink);
+
+// Loads the state at `path` if it describes the same file, otherwise starts a new one.
+// `out_resumed` tells which of the two happened.
+PPCHAT_API bool ppchat_transfer_state_open(TransferState *state, const char *path, uint64_t file_size, uint64_t file_id, bool *out_resumed, int *out_error);
+
+PPCHAT_API bool ppchat_transfer_state_has_chunk(TransferState *state, uint32_t chunk_index);
+
+// Marks the chunk as received and writes that through to the state file.
+PPCHAT_API bool ppchat_transfer_state_mark_chunk(TransferState *state, uint32_t chunk_index, int *out_error);
+
+// Index of the first chunk that hasn't been received, `chunks_count` if there is none.
+PPCHAT_API uint32_t ppchat_transfer_state_get_first_missing_chunk(TransferState *state);
+
+// Closes the state file. Finished transfers don't need their state, it is deleted.
+PPCHAT_API void ppchat_transfer_state_close(TransferState *state, bool delete_file);
+
+}
+
+#endif /* PPCHAT_TRANSFER_H */
@@ -0,0 +1,34 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_buffer.h"
+#include "../include/ppchat_pool.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+
+SharedBuffer *ppchat_shared_buffer_create(int capacity) {
+	assert(capacity >= 0);
+
+	int block_size = 0;
+	SharedBuffer *buffer = (SharedBuffer *) ppchat_slab_allocate((int) offsetof(SharedBuffer, data) + max(capacity, 1), &block_size);
+	if (!buffer)
+		return NULL;
+
+	// Whatever is left of the size class is usable too.
+	buffer->references = 1;
+	buffer->capacity = block_size - (int) offsetof(SharedBuffer, data);
+	buffer->size = 0;
+	return buffer;
+}
+
+void ppchat_shared_buffer_retain(SharedBuffer *buffer) {
+	assert(buffer->references > 0);
+	InterlockedIncrement(&buffer->references);
+}
+
+void ppchat_shared_buffer_release(SharedBuffer *buffer) {
+	assert(buffer->references > 0);
+	if (InterlockedDecrement(&buffer->references) == 0)
+		ppchat_slab_free(buffer, (int) offsetof(SharedBuffer, data) + buffer->capacity);
+}
@@ -0,0 +1,310 @@
+#include "../include/ppchat_byte_order.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+// `_mm_shuffle_epi8` masks: byte `i` of the result is byte `mask[i]` of the input.
+static const uint8_t SWAP_16_SHUFFLE[16]  = { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+static const uint8_t SWAP_32_SHUFFLE[16]  = { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+static const uint8_t SWAP_64_SHUFFLE[16]  = { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 };
+static const uint8_t REVERSE_SHUFFLE[16]  = { 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 };
+
+static const uint8_t *get_swap_shuffle(int field_size) {
+	switch (field_size) {
+		case 2: return SWAP_16_SHUFFLE;
+		case 4: return SWAP_32_SHUFFLE;
+		case 8: return SWAP_64_SHUFFLE;
+	}
+
+	return NULL;
+}
+
+static ByteOrderMethod detect_best_method() {
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+
+	__cpuid(info, 1);
+	bool has_ssse3 = (info[2] & (1 << 9)) != 0;     // ECX bit 9 - SSSE3.
+	bool has_osxsave = (info[2] & (1 << 27)) != 0;  // ECX bit 27 - OS saves extended state.
+	bool has_avx = (info[2] & (1 << 28)) != 0;      // ECX bit 28 - AVX.
+	if (!has_ssse3)
+		return BYTE_ORDER_METHOD_SCALAR;
+
+	// AVX2 also needs the OS to save the upper halves of YMM registers on context switches.
+	if (max_leaf >= 7 && has_osxsave && has_avx && (_xgetbv(0) & 0x6) == 0x6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) // EBX bit 5 - AVX2.
+			return BYTE_ORDER_METHOD_AVX2;
+	}
+
+	return BYTE_ORDER_METHOD_SSSE3;
+}
+
+ByteOrderMethod ppchat_byte_order_get_best_method() {
+	// Initialization of function statics is thread safe.
+	static const ByteOrderMethod method = detect_best_method();
+	return method;
+}
+
+bool ppchat_byte_order_is_method_supported(ByteOrderMethod method) {
+	return method >= 0 && method <= ppchat_byte_order_get_best_method();
+}
+
+const char *ppchat_byte_order_method_to_string(ByteOrderMethod method) {
+	switch (method) {
+		case BYTE_ORDER_METHOD_SCALAR: return "scalar";
+		case BYTE_ORDER_METHOD_SSSE3:  return "ssse3";
+		case BYTE_ORDER_METHOD_AVX2:   return "avx2";
+		case BYTE_ORDER_METHOD_COUNT:  break;
+	}
+
+	return "unknown";
+}
+
+static void swap_fields_scalar(int field_size, const uint8_t *source, uint8_t *destination, size_t count) {
+	// memcpy for loads and stores that are allowed to be unaligned, it becomes a plain mov.
+	switch (field_size) {
+		case 2:
+			for (size_t i = 0; i < count; i += 1) {
+				uint16_t value;
+				memcpy(&value, source + i * 2, sizeof(value));
+				value = _byteswap_ushort(value);
+				memcpy(destination + i * 2, &value, sizeof(value));
+			}
+			break;
+
+		case 4:
+			for (size_t i = 0; i < count; i += 1) {
+				uint32_t value;
+				memcpy(&value, source + i * 4, sizeof(value));
+				value = _byteswap_ulong(value);
+				memcpy(destination + i * 4, &value, sizeof(value));
+			}
+			break;
+
+		case 8:
+			for (size_t i = 0; i < count; i += 1) {
+				uint64_t value;
+				memcpy(&value, source + i * 8, sizeof(value));
+				value = _byteswap_uint64(value);
+				memcpy(destination + i * 8, &value, sizeof(value));
+			}
+			break;
+	}
+}
+
+// Returns how many of the bytes it converted, whole vectors only.
+static size_t swap_fields_ssse3(int field_size, const uint8_t *source, uint8_t *destination, size_t size) {
+	__m128i shuffle = _mm_loadu_si128((const __m128i *) get_swap_shuffle(field_size));
+
+	size_t offset = 0;
+	for (; offset + 64 <= size; offset += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (source + offset + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *) (source + offset + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (source + offset + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *) (source + offset + 48));
+		_mm_storeu_si128((__m128i *) (destination + offset + 0), _mm_shuffle_epi8(a, shuffle));
+		_mm_storeu_si128((__m128i *) (destination + offset + 16), _mm_shuffle_epi8(b, shuffle));
+		_mm_storeu_si128((__m128i *) (destination + offset + 32), _mm_shuffle_epi8(c, shuffle));
+		_mm_storeu_si128((__m128i *) (destination + offset + 48), _mm_shuffle_epi8(d, shuffle));
+	}
+
+	for (; offset + 16 <= size; offset += 16) {
+		__m128i value = _mm_loadu_si128((const __m128i *) (source + offset));
+		_mm_storeu_si128((__m128i *) (destination + offset), _mm_shuffle_epi8(value, shuffle));
+	}
+
+	return offset;
+}
+
+static size_t swap_fields_avx2(int field_size, const uint8_t *source, uint8_t *destination, size_t size) {
+	// The shuffle works within each 16-byte half, and fields never straddle them.
+	__m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) get_swap_shuffle(field_size)));
+
+	size_t offset = 0;
+	for (; offset + 128 <= size; offset += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (source + offset + 0));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (source + offset + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *) (source + offset + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *) (source + offset + 96));
+		_mm256_storeu_si256((__m256i *) (destination + offset + 0), _mm256_shuffle_epi8(a, shuffle));
+		_mm256_storeu_si256((__m256i *) (destination + offset + 32), _mm256_shuffle_epi8(b, shuffle));
+		_mm256_storeu_si256((__m256i *) (destination + offset + 64), _mm256_shuffle_epi8(c, shuffle));
+		_mm256_storeu_si256((__m256i *) (destination + offset + 96), _mm256_shuffle_epi8(d, shuffle));
+	}
+
+	for (; offset + 32 <= size; offset += 32) {
+		__m256i value = _mm256_loadu_si256((const __m256i *) (source + offset));
+		_mm256_storeu_si256((__m256i *) (destination + offset), _mm256_shuffle_epi8(value, shuffle));
+	}
+
+	return offset;
+}
+
+void ppchat_swap_bytes_with_method(ByteOrderMethod method, int field_size, const void *source, void *destination, size_t count) {
+	if (!get_swap_shuffle(field_size))
+		return;
+
+	const uint8_t *source_bytes = (const uint8_t *) source;
+	uint8_t *destination_bytes = (uint8_t *) destination;
+	size_t size = count * (size_t) field_size;
+
+	size_t converted_size = 0;
+	if (method == BYTE_ORDER_METHOD_AVX2) {
+		// Every other unaligned 32-byte store splits a cache line, which costs more than
+		// AVX2 saves, so the fields before the first aligned address go one at a time.
+		size_t head_size = (32 - ((uintptr_t) destination_bytes & 31)) & 31;
+		if (head_size % field_size == 0 && head_size < size) {
+			swap_fields_scalar(field_size, source_bytes, destination_bytes, head_size / field_size);
+			converted_size = head_size;
+		}
+
+		converted_size += swap_fields_avx2(field_size, source_bytes + converted_size, destination_bytes + converted_size, size - converted_size);
+	}
+
+	// Whatever AVX2 left over still fills a 16-byte vector.
+	if (method >= BYTE_ORDER_METHOD_SSSE3)
+		converted_size += swap_fields_ssse3(field_size, source_bytes + converted_size, destination_bytes + converted_size, size - converted_size);
+
+	swap_fields_scalar(field_size, source_bytes + converted_size, destination_bytes + converted_size, (size - converted_size) / field_size);
+}
+
+void ppchat_swap_bytes_16(const void *source, void *destination, size_t count) {
+	ppchat_swap_bytes_with_method(ppchat_byte_order_get_best_method(), 2, source, destination, count);
+}
+
+void ppchat_swap_bytes_32(const void *source, void *destination, size_t count) {
+	ppchat_swap_bytes_with_method(ppchat_byte_order_get_best_method(), 4, source, destination, count);
+}
+
+void ppchat_swap_bytes_64(const void *source, void *destination, size_t count) {
+	ppchat_swap_bytes_with_method(ppchat_byte_order_get_best_method(), 8, source, destination, count);
+}
+
+void ppchat_reverse_bytes(const void *source, void *destination, size_t size) {
+	const uint8_t *source_bytes = (const uint8_t *) source;
+	uint8_t *destination_bytes = (uint8_t *) destination;
+
+	// The front of the destination comes from the back of the source.
+	size_t offset = 0;
+	if (ppchat_byte_order_get_best_method() >= BYTE_ORDER_METHOD_SSSE3) {
+		__m128i shuffle = _mm_loadu_si128((const __m128i *) REVERSE_SHUFFLE);
+		for (; offset + 16 <= size; offset += 16) {
+			__m128i value = _mm_loadu_si128((const __m128i *) (source_bytes + size - offset - 16));
+			_mm_storeu_si128((__m128i *) (destination_bytes + offset), _mm_shuffle_epi8(value, shuffle));
+		}
+	}
+
+	for (; offset < size; offset += 1)
+		destination_bytes[offset] = source_bytes[size - offset - 1];
+}
+
+bool ppchat_byte_order_layout_init(ByteOrderLayout *layout, int struct_size, const ByteOrderField *fields, int fields_count) {
+	if (struct_size <= 0 || struct_size > UINT16_MAX || fields_count < 0 || fields_count > PPCHAT_BYTE_ORDER_MAX_FIELDS)
+		return false;
+
+	for (int i = 0; i < fields_count; i += 1) {
+		int size = fields[i].size;
+		if ((size != 1 && size != 2 && size != 4 && size != 8) || fields[i].offset + size > struct_size)
+			return false;
+
+		for (int j = 0; j < i; j += 1) {
+			bool apart = fields[i].offset + size <= fields[j].offset || fields[j].offset + fields[j].size <= fields[i].offset;
+			if (!apart)
+				return false;
+		}
+	}
+
+	*layout = { };
+	layout->struct_size = struct_size;
+	layout->fields_count = fields_count;
+	memcpy(layout->fields, fields, fields_count * sizeof(ByteOrderField));
+
+	for (int i = 0; i < PPCHAT_BYTE_ORDER_SHUFFLE_SIZE; i += 1)
+		layout->shuffle[i] = (uint8_t) i;
+
+	if (struct_size > PPCHAT_BYTE_ORDER_SHUFFLE_SIZE)
+		return true;
+
+	// A struct of 2, 4, 8 or 16 bytes fills a vector exactly, any other size is
+	// shuffled one at a time with the rest of the vector staying as it is.
+	layout->structs_per_shuffle = (PPCHAT_BYTE_ORDER_SHUFFLE_SIZE % struct_size == 0) ? PPCHAT_BYTE_ORDER_SHUFFLE_SIZE / struct_size : 1;
+	for (int s = 0; s < layout->structs_per_shuffle; s += 1) {
+		for (int i = 0; i < fields_count; i += 1) {
+			int start = s * struct_size + fields[i].offset;
+			for (int k = 0; k < fields[i].size; k += 1)
+				layout->shuffle[start + k] = (uint8_t) (start + fields[i].size - 1 - k);
+		}
+	}
+
+	return true;
+}
+
+static void swap_structs_scalar(const ByteOrderLayout *layout, const uint8_t *source, uint8_t *destination, size_t count) {
+	for (size_t i = 0; i < count; i += 1) {
+		const uint8_t *source_struct = source + i * layout->struct_size;
+		uint8_t *destination_struct = destination + i * layout->struct_size;
+		if (source_struct != destination_struct)
+			memcpy(destination_struct, source_struct, layout->struct_size);
+
+		for (int f = 0; f < layout->fields_count; f += 1) {
+			ByteOrderField field = layout->fields[f];
+			if (field.size > 1)
+				swap_fields_scalar(field.size, destination_struct + field.offset, destination_struct + field.offset, 1);
+		}
+	}
+}
+
+// Returns how many structs it converted.
+static size_t swap_structs_ssse3(const ByteOrderLayout *layout, const uint8_t *source, uint8_t *destination, size_t count) {
+	__m128i shuffle = _mm_loadu_si128((const __m128i *) layout->shuffle);
+	size_t step = (size_t) layout->structs_per_shuffle * layout->struct_size;
+	size_t size = count * layout->struct_size;
+
+	// A struct shorter than the vector carries the start of the next one along,
+	// unchanged, and the next step converts it from the source.
+	size_t offset = 0;
+	for (; offset + PPCHAT_BYTE_ORDER_SHUFFLE_SIZE <= size; offset += step) {
+		__m128i value = _mm_loadu_si128((const __m128i *) (source + offset));
+		_mm_storeu_si128((__m128i *) (destination + offset), _mm_shuffle_epi8(value, shuffle));
+	}
+
+	return offset / layout->struct_size;
+}
+
+static size_t swap_structs_avx2(const ByteOrderLayout *layout, const uint8_t *source, uint8_t *destination, size_t count) {
+	__m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) layout->shuffle));
+	size_t size = count * layout->struct_size;
+
+	size_t offset = 0;
+	for (; offset + 32 <= size; offset += 32) {
+		__m256i value = _mm256_loadu_si256((const __m256i *) (source + offset));
+		_mm256_storeu_si256((__m256i *) (destination + offset), _mm256_shuffle_epi8(value, shuffle));
+	}
+
+	return offset / layout->struct_size;
+}
+
+void ppchat_swap_struct_bytes_with_method(ByteOrderMethod method, const ByteOrderLayout *layout, const void *source, void *destination, size_t count) {
+	const uint8_t *source_bytes = (const uint8_t *) source;
+	uint8_t *destination_bytes = (uint8_t *) destination;
+
+	size_t converted_count = 0;
+
+	// Only structs that tile the vector can use both halves of a YMM register.
+	if (method == BYTE_ORDER_METHOD_AVX2 && layout->structs_per_shuffle > 1)
+		converted_count = swap_structs_avx2(layout, source_bytes, destination_bytes, count);
+
+	if (method >= BYTE_ORDER_METHOD_SSSE3 && layout->structs_per_shuffle > 0) {
+		size_t offset = converted_count * layout->struct_size;
+		converted_count += swap_structs_ssse3(layout, source_bytes + offset, destination_bytes + offset, count - converted_count);
+	}
+
+	size_t offset = converted_count * layout->struct_size;
+	swap_structs_scalar(layout, source_bytes + offset, destination_bytes + offset, count - converted_count);
+}
+
+void ppchat_swap_struct_bytes(const ByteOrderLayout *layout, const void *source, void *destination, size_t count) {
+	ppchat_swap_struct_bytes_with_method(ppchat_byte_order_get_best_method(), layout, source, destination, count);
+}
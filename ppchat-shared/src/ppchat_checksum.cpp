@@ -0,0 +1,127 @@
+#include "../include/ppchat_checksum.h"
+
+#include <intrin.h>
+#include <nmmintrin.h>
+
+// Reversed 0x1EDC6F41.
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+typedef struct Crc32cTables {
+	// `tables[k][byte]` is the CRC of `byte` followed by `k` zero bytes.
+	uint32_t tables[8][256];
+} Crc32cTables;
+
+static Crc32cTables build_crc32c_tables() {
+	Crc32cTables result;
+
+	for (uint32_t byte = 0; byte < 256; byte += 1) {
+		uint32_t crc = byte;
+		for (int bit = 0; bit < 8; bit += 1)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+
+		result.tables[0][byte] = crc;
+	}
+
+	for (uint32_t byte = 0; byte < 256; byte += 1) {
+		for (int k = 1; k < 8; k += 1) {
+			uint32_t previous = result.tables[k - 1][byte];
+			result.tables[k][byte] = (previous >> 8) ^ result.tables[0][previous & 0xFF];
+		}
+	}
+
+	return result;
+}
+
+static const Crc32cTables *get_crc32c_tables() {
+	// Initialization of function statics is thread safe.
+	static const Crc32cTables tables = build_crc32c_tables();
+	return &tables;
+}
+
+bool ppchat_crc32c_has_hardware_support() {
+	static const bool supported = [] {
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0; // ECX bit 20 - SSE4.2.
+	}();
+
+	return supported;
+}
+
+uint32_t ppchat_crc32c_hardware(uint32_t crc, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint64_t state = ~crc;
+
+	// Unaligned head, so the main loop reads whole aligned words.
+	while (size > 0 && ((uintptr_t) bytes & 7) != 0) {
+		state = _mm_crc32_u8((uint32_t) state, *bytes);
+		bytes += 1;
+		size -= 1;
+	}
+
+	while (size >= 32) {
+		const uint64_t *words = (const uint64_t *) bytes;
+		state = _mm_crc32_u64(state, words[0]);
+		state = _mm_crc32_u64(state, words[1]);
+		state = _mm_crc32_u64(state, words[2]);
+		state = _mm_crc32_u64(state, words[3]);
+		bytes += 32;
+		size -= 32;
+	}
+
+	while (size >= 8) {
+		state = _mm_crc32_u64(state, *(const uint64_t *) bytes);
+		bytes += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		state = _mm_crc32_u8((uint32_t) state, *bytes);
+		bytes += 1;
+		size -= 1;
+	}
+
+	return ~(uint32_t) state;
+}
+
+uint32_t ppchat_crc32c_software(uint32_t crc, const void *data, size_t size) {
+	const uint32_t (*tables)[256] = get_crc32c_tables()->tables;
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint32_t state = ~crc;
+
+	// Eight independent lookups per step. Little endian only, like the rest of us.
+	while (size >= 8) {
+		uint32_t low;
+		uint32_t high;
+		memcpy(&low, bytes, sizeof(low));
+		memcpy(&high, bytes + 4, sizeof(high));
+		low ^= state;
+
+		state = tables[7][low & 0xFF]          ^
+		        tables[6][(low >> 8) & 0xFF]   ^
+		        tables[5][(low >> 16) & 0xFF]  ^
+		        tables[4][low >> 24]           ^
+		        tables[3][high & 0xFF]         ^
+		        tables[2][(high >> 8) & 0xFF]  ^
+		        tables[1][(high >> 16) & 0xFF] ^
+		        tables[0][high >> 24];
+
+		bytes += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		state = (state >> 8) ^ tables[0][(state ^ *bytes) & 0xFF];
+		bytes += 1;
+		size -= 1;
+	}
+
+	return ~state;
+}
+
+uint32_t ppchat_crc32c(uint32_t crc, const void *data, size_t size) {
+	if (ppchat_crc32c_has_hardware_support())
+		return ppchat_crc32c_hardware(crc, data, size);
+
+	return ppchat_crc32c_software(crc, data, size);
+}
@@ -0,0 +1,327 @@
+#include "../include/ppchat_compression.h"
+#include "../include/ppchat_pool.h"
+
+#include <intrin.h>
+
+// Shortest match a sequence can copy, and the most bytes back it can copy from.
+static const int LZ4_MIN_MATCH = 4;
+static const int LZ4_MAX_OFFSET = 65535;
+
+// Format rules the reference decoder relies on to copy eight bytes at a time: the last
+// five bytes are always literals, and the last match starts at least twelve bytes
+// before the end.
+static const int LZ4_LAST_LITERALS = 5;
+static const int LZ4_MATCH_FIND_LIMIT = 12;
+
+// Token holds lengths up to 14 itself, 15 says that bytes of 255 and one below it follow.
+static const int LZ4_TOKEN_LENGTH_MASK = 15;
+
+static const int COMPRESSION_HASH_BITS = 12;
+static const int COMPRESSION_HASH_SIZE = 1 << COMPRESSION_HASH_BITS;
+
+// Misses in a row before the search starts skipping bytes, so that data that doesn't
+// compress goes through quickly.
+static const int COMPRESSION_SKIP_TRIGGER_BITS = 6;
+
+static inline uint32_t read_32(const uint8_t *position) {
+	uint32_t value;
+	memcpy(&value, position, sizeof(value));
+	return value;
+}
+
+static inline uint64_t read_64(const uint8_t *position) {
+	uint64_t value;
+	memcpy(&value, position, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash_sequence(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - COMPRESSION_HASH_BITS);
+}
+
+// Returns where the bytes at `position` stop matching the ones at `match`, not past `limit`.
+static const uint8_t *extend_match(const uint8_t *position, const uint8_t *match, const uint8_t *limit) {
+	while (position + sizeof(uint64_t) <= limit) {
+		uint64_t difference = read_64(position) ^ read_64(match);
+		if (difference != 0) {
+			// Little endian, so the first byte that differs is the lowest one.
+			unsigned long first_different_bit;
+			_BitScanForward64(&first_different_bit, difference);
+			return position + (first_different_bit >> 3);
+		}
+
+		position += sizeof(uint64_t);
+		match += sizeof(uint64_t);
+	}
+
+	while (position < limit && *position == *match) {
+		position += 1;
+		match += 1;
+	}
+
+	return position;
+}
+
+static uint8_t *write_length(uint8_t *output, size_t length) {
+	while (length >= 255) {
+		*output++ = 255;
+		length -= 255;
+	}
+
+	*output++ = (uint8_t) length;
+	return output;
+}
+
+// Bytes that follow the token to hold a length.
+static size_t get_length_size(size_t length) {
+	return (length >= LZ4_TOKEN_LENGTH_MASK) ? (length - LZ4_TOKEN_LENGTH_MASK) / 255 + 1 : 0;
+}
+
+int ppchat_compress_bound(int size) {
+	return size + size / 255 + 16;
+}
+
+int ppchat_compress(const char *source, int source_size, char *destination, int destination_capacity) {
+	const uint8_t *input = (const uint8_t *) source;
+	const uint8_t *input_end = input + source_size;
+	uint8_t *output = (uint8_t *) destination;
+	uint8_t *output_end = output + destination_capacity;
+
+	const uint8_t *anchor = input;
+
+	if (source_size > LZ4_MATCH_FIND_LIMIT) {
+		const uint8_t *match_find_limit = input_end - LZ4_MATCH_FIND_LIMIT;
+		const uint8_t *match_limit = input_end - LZ4_LAST_LITERALS;
+
+		// Positions relative to `input`, zero for the ones nothing has been seen at yet,
+		// which is as good a guess as any since every candidate is compared anyway.
+		uint32_t table[COMPRESSION_HASH_SIZE];
+		memset(table, 0, sizeof(table));
+
+		const uint8_t *position = input + 1;
+		int misses_count = 0;
+		while (position <= match_find_limit) {
+			uint32_t sequence = read_32(position);
+			uint32_t hash = hash_sequence(sequence);
+			const uint8_t *match = input + table[hash];
+			table[hash] = (uint32_t) (position - input);
+
+			if (match >= position || position - match > LZ4_MAX_OFFSET || read_32(match) != sequence) {
+				position += 1 + (misses_count >> COMPRESSION_SKIP_TRIGGER_BITS);
+				misses_count += 1;
+				continue;
+			}
+
+			misses_count = 0;
+
+			// Bytes just before it may match as well.
+			while (position > anchor && match > input && position[-1] == match[-1]) {
+				position -= 1;
+				match -= 1;
+			}
+
+			const uint8_t *match_end = extend_match(position + LZ4_MIN_MATCH, match + LZ4_MIN_MATCH, match_limit);
+
+			size_t literals_size = (size_t) (position - anchor);
+			size_t match_size = (size_t) (match_end - position) - LZ4_MIN_MATCH;
+			size_t sequence_size = 1 + get_length_size(literals_size) + literals_size + 2 + get_length_size(match_size);
+			if (sequence_size > (size_t) (output_end - output))
+				return 0;
+
+			uint8_t *token = output++;
+			if (literals_size >= LZ4_TOKEN_LENGTH_MASK) {
+				*token = LZ4_TOKEN_LENGTH_MASK << 4;
+				output = write_length(output, literals_size - LZ4_TOKEN_LENGTH_MASK);
+			} else {
+				*token = (uint8_t) (literals_size << 4);
+			}
+
+			memcpy(output, anchor, literals_size);
+			output += literals_size;
+
+			uint16_t offset = (uint16_t) (position - match);
+			output[0] = (uint8_t) offset;
+			output[1] = (uint8_t) (offset >> 8);
+			output += 2;
+
+			if (match_size >= LZ4_TOKEN_LENGTH_MASK) {
+				*token |= LZ4_TOKEN_LENGTH_MASK;
+				output = write_length(output, match_size - LZ4_TOKEN_LENGTH_MASK);
+			} else {
+				*token |= (uint8_t) match_size;
+			}
+
+			anchor = match_end;
+			position = match_end;
+
+			// Remember a position inside the match too, repeats tend to come back.
+			if (position <= match_find_limit)
+				table[hash_sequence(read_32(position - 2))] = (uint32_t) (position - 2 - input);
+		}
+	}
+
+	// Whatever is left goes out as literals of the last sequence.
+	size_t literals_size = (size_t) (input_end - anchor);
+	if (1 + get_length_size(literals_size) + literals_size > (size_t) (output_end - output))
+		return 0;
+
+	if (literals_size >= LZ4_TOKEN_LENGTH_MASK) {
+		*output++ = LZ4_TOKEN_LENGTH_MASK << 4;
+		output = write_length(output, literals_size - LZ4_TOKEN_LENGTH_MASK);
+	} else {
+		*output++ = (uint8_t) (literals_size << 4);
+	}
+
+	memcpy(output, anchor, literals_size);
+	output += literals_size;
+
+	return (int) (output - (uint8_t *) destination);
+}
+
+// Adds the bytes that follow a length of 15 in the token. Returns false if the input ends first.
+static bool read_length(const uint8_t **input, const uint8_t *input_end, size_t *length) {
+	uint8_t byte;
+	do {
+		if (*input >= input_end)
+			return false;
+
+		byte = **input;
+		*input += 1;
+		*length += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+bool ppchat_decompress(const char *source, int source_size, char *destination, int destination_size) {
+	const uint8_t *input = (const uint8_t *) source;
+	const uint8_t *input_end = input + source_size;
+	uint8_t *output = (uint8_t *) destination;
+	uint8_t *output_end = output + destination_size;
+
+	while (input < input_end) {
+		uint8_t token = *input++;
+
+		size_t literals_size = token >> 4;
+		if (literals_size == LZ4_TOKEN_LENGTH_MASK && !read_length(&input, input_end, &literals_size))
+			return false;
+
+		if (literals_size > (size_t) (input_end - input) || literals_size > (size_t) (output_end - output))
+			return false;
+
+		memcpy(output, input, literals_size);
+		input += literals_size;
+		output += literals_size;
+
+		// Only the last sequence has no match.
+		if (input == input_end)
+			break;
+
+		if (input_end - input < 2)
+			return false;
+
+		size_t offset = (size_t) input[0] | ((size_t) input[1] << 8);
+		input += 2;
+		if (offset == 0 || offset > (size_t) (output - (uint8_t *) destination))
+			return false;
+
+		size_t match_size = token & LZ4_TOKEN_LENGTH_MASK;
+		if (match_size == LZ4_TOKEN_LENGTH_MASK && !read_length(&input, input_end, &match_size))
+			return false;
+
+		match_size += LZ4_MIN_MATCH;
+		if (match_size > (size_t) (output_end - output))
+			return false;
+
+		const uint8_t *match = output - offset;
+		uint8_t *match_output_end = output + match_size;
+		if (offset >= sizeof(uint64_t) && (size_t) (output_end - output) >= match_size + sizeof(uint64_t)) {
+			// Eight bytes at a time never overlap this far back, and may run past the
+			// match into bytes that are written over next anyway.
+			while (output < match_output_end) {
+				memcpy(output, match, sizeof(uint64_t));
+				output += sizeof(uint64_t);
+				match += sizeof(uint64_t);
+			}
+		} else {
+			// Close matches repeat the bytes they are still copying, one at a time.
+			while (output < match_output_end)
+				*output++ = *match++;
+		}
+
+		output = match_output_end;
+	}
+
+	return output == output_end;
+}
+
+// Compressed payloads have to save at least this much to be sent.
+static int get_compressed_capacity(int payload_size) {
+	return payload_size - payload_size / 8 - PPCHAT_COMPRESSED_HEADER_SIZE;
+}
+
+int ppchat_compress_payload(const char *payload, int payload_size, char *out_payload) {
+	if (payload_size < PPCHAT_COMPRESSION_MIN_SIZE)
+		return 0;
+
+	int compressed_size = ppchat_compress(payload, payload_size, out_payload + PPCHAT_COMPRESSED_HEADER_SIZE, get_compressed_capacity(payload_size));
+	if (compressed_size == 0)
+		return 0;
+
+	CompressedPayloadHeader header;
+	header.uncompressed_size = (uint32_t) payload_size;
+	CompressedPayloadHeaderSchema::encode(header, out_payload);
+	return PPCHAT_COMPRESSED_HEADER_SIZE + compressed_size;
+}
+
+int ppchat_get_decompressed_size(const char *payload, int payload_size, int max_size) {
+	if (payload_size <= PPCHAT_COMPRESSED_HEADER_SIZE)
+		return -1;
+
+	CompressedPayloadHeader header = CompressedPayloadHeaderSchema::decode(payload);
+	if (header.uncompressed_size == 0 || header.uncompressed_size > (uint32_t) max_size)
+		return -1;
+
+	return (int) header.uncompressed_size;
+}
+
+bool ppchat_decompress_payload(const char *payload, int payload_size, char *out_payload, int out_payload_size) {
+	return ppchat_decompress(payload + PPCHAT_COMPRESSED_HEADER_SIZE, payload_size - PPCHAT_COMPRESSED_HEADER_SIZE, out_payload, out_payload_size);
+}
+
+SharedBuffer *ppchat_create_compressed_frame_buffer(uint16_t type, uint16_t flags, const char *payload, int payload_size) {
+	if (payload_size < PPCHAT_COMPRESSION_MIN_SIZE)
+		return NULL;
+
+	SharedBuffer *buffer = ppchat_shared_buffer_create(PPCHAT_FRAME_HEADER_SIZE + payload_size);
+	if (!buffer)
+		return NULL;
+
+	int compressed_size = ppchat_compress_payload(payload, payload_size, buffer->data + PPCHAT_FRAME_HEADER_SIZE);
+	if (compressed_size == 0) {
+		ppchat_shared_buffer_release(buffer);
+		return NULL;
+	}
+
+	ppchat_encode_frame_header(buffer->data, type, flags | FRAME_FLAG_COMPRESSED, (uint32_t) compressed_size);
+	buffer->size = PPCHAT_FRAME_HEADER_SIZE + compressed_size;
+	return buffer;
+}
+
+bool ppchat_send_frame_compressed(Socket socket, uint16_t type, uint16_t flags, const char *payload, int payload_size, int *out_error) {
+	if (payload_size < PPCHAT_COMPRESSION_MIN_SIZE)
+		return ppchat_send_frame(socket, type, flags, payload, payload_size, out_error);
+
+	int capacity = 0;
+	char *compressed = (char *) ppchat_slab_allocate(payload_size, &capacity);
+	int compressed_size = (compressed) ? ppchat_compress_payload(payload, payload_size, compressed) : 0;
+
+	bool sent;
+	if (compressed_size > 0)
+		sent = ppchat_send_frame(socket, type, flags | FRAME_FLAG_COMPRESSED, compressed, compressed_size, out_error);
+	else
+		sent = ppchat_send_frame(socket, type, flags, payload, payload_size, out_error);
+
+	ppchat_slab_free(compressed, payload_size);
+	return sent;
+}
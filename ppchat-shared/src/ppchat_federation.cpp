@@ -0,0 +1,61 @@
+#include "../include/ppchat_federation.h"
+
+int ppchat_peer_message_size(int room_name_size, int payload_size) {
+	return PeerMessageHeaderSchema::size + room_name_size + payload_size;
+}
+
+char *ppchat_encode_peer_message(char *out_buffer, uint32_t origin_node_id, uint64_t origin_sequence, const char *room_name, int room_name_size, const char *payload, int payload_size) {
+	PeerMessageHeader header;
+	header.origin_node_id = origin_node_id;
+	header.origin_sequence = origin_sequence;
+	header.room_name_size = (uint16_t) room_name_size;
+	header.payload_size = (uint32_t) payload_size;
+
+	char *position = PeerMessageHeaderSchema::encode(header, out_buffer);
+	memcpy(position, room_name, room_name_size);
+	position += room_name_size;
+	memcpy(position, payload, payload_size);
+	return position + payload_size;
+}
+
+bool ppchat_decode_peer_message(const char **cursor, const char *end, PeerMessage *out_message) {
+	const char *position = *cursor;
+	if (!PeerMessageHeaderSchema::decode(position, (int) (end - position), &out_message->header))
+		return false;
+
+	position += PeerMessageHeaderSchema::size;
+
+	// Compared one by one, so that sizes near the limits can't overflow the sum.
+	size_t remaining = (size_t) (end - position);
+	size_t room_name_size = out_message->header.room_name_size;
+	size_t payload_size = out_message->header.payload_size;
+	if (room_name_size > remaining || payload_size > remaining - room_name_size)
+		return false;
+
+	out_message->room_name = position;
+	out_message->payload = position + room_name_size;
+	*cursor = position + room_name_size + payload_size;
+	return true;
+}
+
+bool ppchat_origin_window_accept(OriginWindow *window, uint64_t sequence) {
+	if (sequence > window->newest_sequence) {
+		uint64_t shift = sequence - window->newest_sequence;
+		window->seen_mask = (shift < PPCHAT_ORIGIN_WINDOW_SIZE) ? (window->seen_mask << shift) | 1 : 1;
+		window->newest_sequence = sequence;
+		return true;
+	}
+
+	// Too far behind to tell, which only a node that restarted with lower sequences
+	// could cause.
+	uint64_t distance = window->newest_sequence - sequence;
+	if (distance >= PPCHAT_ORIGIN_WINDOW_SIZE)
+		return false;
+
+	uint64_t bit = 1ull << distance;
+	if (window->seen_mask & bit)
+		return false;
+
+	window->seen_mask |= bit;
+	return true;
+}
@@ -0,0 +1,280 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_framing.h"
+#include "../include/ppchat_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+static bool reserve_partial_buffer(FrameDecoder *decoder, int required_capacity) {
+	if (required_capacity <= decoder->partial_buffer_capacity)
+		return true;
+
+	int new_capacity = max(decoder->partial_buffer_capacity * 2, PPCHAT_RECEIVE_BUFFER_SIZE);
+	if (new_capacity < required_capacity)
+		new_capacity = required_capacity;
+
+	char *new_buffer = (char *) ppchat_slab_allocate(new_capacity, &new_capacity);
+	if (!new_buffer) {
+		decoder->error = FRAME_DECODER_ERROR_OUT_OF_MEMORY;
+		return false;
+	}
+
+	if (decoder->partial_buffer_size > 0)
+		memcpy(new_buffer, decoder->partial_buffer, decoder->partial_buffer_size);
+
+	ppchat_slab_free(decoder->partial_buffer, decoder->partial_buffer_capacity);
+	decoder->partial_buffer = new_buffer;
+	decoder->partial_buffer_capacity = new_capacity;
+	return true;
+}
+
+// Partial buffer goes back to the slab as soon as it is empty, so that
+// connections between frames hold none.
+static void release_partial_buffer(FrameDecoder *decoder) {
+	ppchat_slab_free(decoder->partial_buffer, decoder->partial_buffer_capacity);
+	decoder->partial_buffer = NULL;
+	decoder->partial_buffer_capacity = 0;
+	decoder->partial_buffer_size = 0;
+}
+
+// Moves up to `count` bytes of fed data into the partial buffer.
+static void take_into_partial_buffer(FrameDecoder *decoder, int count) {
+	int available = decoder->data_size - decoder->data_offset;
+	int taken = min(count, available);
+
+	memcpy(decoder->partial_buffer + decoder->partial_buffer_size, decoder->data + decoder->data_offset, taken);
+	decoder->partial_buffer_size += taken;
+	decoder->data_offset += taken;
+}
+
+static bool is_payload_size_valid(FrameDecoder *decoder, FrameHeader *header) {
+	if (header->payload_size > (uint32_t) decoder->max_payload_size) {
+		decoder->error = FRAME_DECODER_ERROR_PAYLOAD_TOO_LARGE;
+		return false;
+	}
+
+	return true;
+}
+
+static bool is_streamed(FrameHeader *header) {
+	return (header->flags & FRAME_FLAG_STREAMED) && header->payload_size > 0;
+}
+
+// Hands out as much of the streamed frame's payload as the fed data has.
+static bool next_streamed_piece(FrameDecoder *decoder, Frame *out_frame) {
+	int available = decoder->data_size - decoder->data_offset;
+	if (available == 0)
+		return false;
+
+	uint32_t piece_size = min((uint32_t) available, decoder->streamed_remaining);
+
+	out_frame->header = decoder->streamed_header;
+	out_frame->payload = decoder->data + decoder->data_offset;
+	out_frame->piece_offset = decoder->streamed_offset;
+	out_frame->piece_size = piece_size;
+
+	decoder->data_offset += (int) piece_size;
+	decoder->streamed_offset += piece_size;
+	decoder->streamed_remaining -= piece_size;
+	return true;
+}
+
+static bool begin_streamed_frame(FrameDecoder *decoder, FrameHeader *header, Frame *out_frame) {
+	decoder->streamed_header = *header;
+	decoder->streamed_offset = 0;
+	decoder->streamed_remaining = header->payload_size;
+	return next_streamed_piece(decoder, out_frame);
+}
+
+// Continues the frame carried over from previous reads.
+static bool complete_partial_frame(FrameDecoder *decoder, Frame *out_frame) {
+	if (decoder->partial_buffer_size < PPCHAT_FRAME_HEADER_SIZE) {
+		take_into_partial_buffer(decoder, PPCHAT_FRAME_HEADER_SIZE - decoder->partial_buffer_size);
+		if (decoder->partial_buffer_size < PPCHAT_FRAME_HEADER_SIZE)
+			return false;
+	}
+
+	FrameHeader header = ppchat_decode_frame_header(decoder->partial_buffer);
+	if (!is_payload_size_valid(decoder, &header))
+		return false;
+
+	if (is_streamed(&header)) {
+		release_partial_buffer(decoder);
+		return begin_streamed_frame(decoder, &header, out_frame);
+	}
+
+	int frame_size = PPCHAT_FRAME_HEADER_SIZE + (int) header.payload_size;
+	if (!reserve_partial_buffer(decoder, frame_size))
+		return false;
+
+	take_into_partial_buffer(decoder, frame_size - decoder->partial_buffer_size);
+	if (decoder->partial_buffer_size < frame_size)
+		return false;
+
+	out_frame->header = header;
+	out_frame->payload = decoder->partial_buffer + PPCHAT_FRAME_HEADER_SIZE;
+	out_frame->piece_offset = 0;
+	out_frame->piece_size = header.payload_size;
+	decoder->partial_frame_returned = true;
+	return true;
+}
+
+void ppchat_frame_decoder_init(FrameDecoder *decoder, int max_payload_size) {
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->max_payload_size = (max_payload_size > 0) ? max_payload_size : PPCHAT_FRAME_MAX_PAYLOAD_SIZE;
+}
+
+void ppchat_frame_decoder_destroy(FrameDecoder *decoder) {
+	release_partial_buffer(decoder);
+	memset(decoder, 0, sizeof(*decoder));
+}
+
+void ppchat_frame_decoder_feed(FrameDecoder *decoder, char *data, int size) {
+	// Whatever was left of the previous data has been moved to the partial buffer.
+	assert(decoder->data_offset == decoder->data_size || decoder->error != FRAME_DECODER_ERROR_NONE);
+
+	decoder->data = data;
+	decoder->data_size = size;
+	decoder->data_offset = 0;
+}
+
+bool ppchat_frame_decoder_next(FrameDecoder *decoder, Frame *out_frame) {
+	if (decoder->error != FRAME_DECODER_ERROR_NONE)
+		return false;
+
+	if (decoder->partial_frame_returned) {
+		release_partial_buffer(decoder);
+		decoder->partial_frame_returned = false;
+	}
+
+	if (decoder->streamed_remaining > 0)
+		return next_streamed_piece(decoder, out_frame);
+
+	if (decoder->partial_buffer_size > 0)
+		return complete_partial_frame(decoder, out_frame);
+
+	int available = decoder->data_size - decoder->data_offset;
+	if (available == 0)
+		return false;
+
+	char *frame_start = decoder->data + decoder->data_offset;
+
+	int required_size = PPCHAT_FRAME_HEADER_SIZE;
+	if (available >= PPCHAT_FRAME_HEADER_SIZE) {
+		FrameHeader header = ppchat_decode_frame_header(frame_start);
+		if (!is_payload_size_valid(decoder, &header))
+			return false;
+
+		if (is_streamed(&header)) {
+			decoder->data_offset += PPCHAT_FRAME_HEADER_SIZE;
+			return begin_streamed_frame(decoder, &header, out_frame);
+		}
+
+		required_size += (int) header.payload_size;
+		if (available >= required_size) {
+			// Whole frame is right here, hand out a view.
+			out_frame->header = header;
+			out_frame->payload = frame_start + PPCHAT_FRAME_HEADER_SIZE;
+			out_frame->piece_offset = 0;
+			out_frame->piece_size = header.payload_size;
+			decoder->data_offset += required_size;
+			return true;
+		}
+	}
+
+	// Frame straddles the end of this read, the only case that copies.
+	if (!reserve_partial_buffer(decoder, required_size))
+		return false;
+
+	take_into_partial_buffer(decoder, available);
+	return false;
+}
+
+const char *ppchat_frame_decoder_error_description(FrameDecoderError error) {
+	switch (error) {
+		case FRAME_DECODER_ERROR_NONE:              return "No error.";
+		case FRAME_DECODER_ERROR_PAYLOAD_TOO_LARGE: return "Frame payload size exceeds the limit.";
+		case FRAME_DECODER_ERROR_OUT_OF_MEMORY:     return "Couldn't allocate memory for a partial frame.";
+	}
+
+	return "Unknown error.";
+}
+
+void ppchat_encode_frame_header(char *out_buffer, uint16_t type, uint16_t flags, uint32_t payload_size) {
+	FrameHeader header;
+	header.payload_size = payload_size;
+	header.type = type;
+	header.flags = flags;
+	FrameHeaderSchema::encode(header, out_buffer);
+}
+
+FrameHeader ppchat_decode_frame_header(const char *buffer) {
+	// Header can start at any offset of the receive buffer, the schema doesn't mind.
+	return FrameHeaderSchema::decode(buffer);
+}
+
+SharedBuffer *ppchat_create_frame_buffer(uint16_t type, uint16_t flags, const char *payload, int payload_size) {
+	SharedBuffer *buffer = ppchat_shared_buffer_create(PPCHAT_FRAME_HEADER_SIZE + payload_size);
+	if (!buffer)
+		return NULL;
+
+	ppchat_encode_frame_header(buffer->data, type, flags, (uint32_t) payload_size);
+	if (payload && payload_size > 0)
+		memcpy(buffer->data + PPCHAT_FRAME_HEADER_SIZE, payload, payload_size);
+
+	buffer->size = PPCHAT_FRAME_HEADER_SIZE + payload_size;
+	return buffer;
+}
+
+bool ppchat_send_frame(Socket socket, uint16_t type, uint16_t flags, const char *payload, int payload_size, int *out_error) {
+	char header[PPCHAT_FRAME_HEADER_SIZE];
+	ppchat_encode_frame_header(header, type, flags, (uint32_t) payload_size);
+
+	WSABUF buffers[2];
+	buffers[0].buf = header;
+	buffers[0].len = sizeof(header);
+	buffers[1].buf = (char *) payload;
+	buffers[1].len = (ULONG) payload_size;
+
+	DWORD bytes_sent = 0;
+	int send_result = WSASend(
+		/* Socket                 */ socket.handle,
+		/* Buffers                */ buffers,
+		/* Buffers count          */ (payload_size > 0) ? 2 : 1,
+		/* Bytes sent             */ &bytes_sent,
+		/* Flags                  */ 0,
+		/* Overlapped             */ NULL,
+		/* Completion routine     */ NULL
+	);
+	if (send_result == SOCKET_ERROR) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		return false;
+	}
+
+	// Blocking sends normally take everything, but finish the rest just in case.
+	int total_size = PPCHAT_FRAME_HEADER_SIZE + payload_size;
+	while ((int) bytes_sent < total_size) {
+		int sent;
+		if ((int) bytes_sent < PPCHAT_FRAME_HEADER_SIZE)
+			sent = ppchat_send(socket, header + bytes_sent, PPCHAT_FRAME_HEADER_SIZE - (int) bytes_sent, 0);
+		else
+			sent = ppchat_send(socket, (char *) payload + (bytes_sent - PPCHAT_FRAME_HEADER_SIZE), total_size - (int) bytes_sent, 0);
+
+		if (sent == SOCKET_ERROR) {
+			if (out_error)
+				*out_error = get_last_socket_error();
+
+			return false;
+		}
+
+		bytes_sent += (DWORD) sent;
+	}
+
+	if (out_error)
+		*out_error = 0;
+
+	return true;
+}
@@ -0,0 +1,768 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_history.h"
+#include "../include/ppchat_checksum.h"
+#include "../include/ppchat_framing.h"
+
+#include <stdlib.h>
+
+static char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
+
+static const uint32_t HISTORY_SEGMENT_MAGIC = 0x48484350; // "PCHH"
+static const uint32_t HISTORY_SEGMENT_VERSION = 1;
+
+typedef struct HistorySegmentHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t first_sequence;
+} HistorySegmentHeader;
+
+typedef struct HistoryRecordHeader {
+	uint64_t sequence;
+	uint64_t timestamp;
+	uint64_t previous_in_room;
+	uint32_t payload_size;
+	uint16_t room_size;
+	uint16_t padding;
+	uint32_t crc;
+	uint32_t padding_after_crc;
+} HistoryRecordHeader;
+
+static_assert(sizeof(HistoryRecordHeader) == PPCHAT_HISTORY_RECORD_HEADER_SIZE, "Record header has to match the documented layout.");
+
+// CRC covers the header up to the checksum itself.
+static const int HISTORY_RECORD_CRC_OFFSET = (int) offsetof(HistoryRecordHeader, crc);
+
+static uint32_t get_record_size(int room_size, int payload_size) {
+	uint32_t size = (uint32_t) (PPCHAT_HISTORY_RECORD_HEADER_SIZE + room_size + payload_size);
+	return (size + 7) & ~7u;
+}
+
+static uint32_t get_record_crc(const char *record, const HistoryRecordHeader *header) {
+	uint32_t crc = ppchat_crc32c(0, record, HISTORY_RECORD_CRC_OFFSET);
+	return ppchat_crc32c(crc, record + PPCHAT_HISTORY_RECORD_HEADER_SIZE, (size_t) header->room_size + header->payload_size);
+}
+
+static uint64_t get_history_timestamp() {
+	FILETIME file_time;
+	GetSystemTimeAsFileTime(&file_time);
+	return ((uint64_t) file_time.dwHighDateTime << 32) | file_time.dwLowDateTime;
+}
+
+// FNV-1a, room names are short.
+static uint32_t hash_room_name(const char *name, int name_size) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < name_size; i += 1) {
+		hash ^= (uint8_t) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static HistoryRoom *find_history_room(HistoryStore *store, const char *name, int name_size, bool create) {
+	HistoryRoom **bucket = &store->rooms[hash_room_name(name, name_size) % PPCHAT_HISTORY_ROOM_BUCKETS_COUNT];
+	for (HistoryRoom *room = *bucket; room; room = room->next) {
+		if ((int) strlen(room->name) == name_size && memcmp(room->name, name, name_size) == 0)
+			return room;
+	}
+
+	if (!create)
+		return NULL;
+
+	HistoryRoom *room = (HistoryRoom *) calloc(1, sizeof(*room));
+	if (!room)
+		return NULL;
+
+	memcpy(room->name, name, name_size);
+	room->next = *bucket;
+	*bucket = room;
+	return room;
+}
+
+static void add_index_entry(HistorySegment *segment, const HistoryRecordHeader *header, uint32_t offset) {
+	if (segment->index_count > 0 && offset - segment->index[segment->index_count - 1].offset < (uint32_t) PPCHAT_HISTORY_INDEX_INTERVAL)
+		return;
+
+	if (segment->index_count == segment->index_capacity) {
+		int new_capacity = max(segment->index_capacity * 2, 64);
+		HistoryIndexEntry *new_index = (HistoryIndexEntry *) realloc(segment->index, new_capacity * sizeof(*new_index));
+
+		// Lookups scan forward from the entry before, just further.
+		if (!new_index)
+			return;
+
+		segment->index = new_index;
+		segment->index_capacity = new_capacity;
+	}
+
+	HistoryIndexEntry *entry = &segment->index[segment->index_count];
+	entry->sequence = header->sequence;
+	entry->timestamp = header->timestamp;
+	entry->offset = offset;
+	segment->index_count += 1;
+}
+
+static void close_segment(HistorySegment *segment, bool delete_file) {
+	if (segment->view)
+		UnmapViewOfFile(segment->view);
+
+	if (segment->mapping)
+		CloseHandle(segment->mapping);
+
+	if (segment->file != INVALID_HANDLE_VALUE)
+		CloseHandle(segment->file);
+
+	if (delete_file)
+		DeleteFileA(segment->path);
+
+	free(segment->index);
+	free(segment);
+}
+
+// Opens an existing segment file, or creates one of `capacity` bytes when `create` is set.
+static HistorySegment *open_segment(const char *path, bool create, uint32_t capacity, int *out_error) {
+	HistorySegment *segment = (HistorySegment *) calloc(1, sizeof(*segment));
+	if (!segment) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+
+	strncpy(segment->path, path, sizeof(segment->path) - 1);
+	segment->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, (create) ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (segment->file == INVALID_HANDLE_VALUE) {
+		*out_error = GetLastError();
+		close_segment(segment, false);
+		return NULL;
+	}
+
+	LARGE_INTEGER file_size;
+	if (create) {
+		// Sized up front, so the disk can't run out in the middle of a segment.
+		file_size.QuadPart = capacity;
+		if (!SetFilePointerEx(segment->file, file_size, NULL, FILE_BEGIN) || !SetEndOfFile(segment->file)) {
+			*out_error = GetLastError();
+			close_segment(segment, true);
+			return NULL;
+		}
+	} else if (!GetFileSizeEx(segment->file, &file_size)) {
+		*out_error = GetLastError();
+		close_segment(segment, false);
+		return NULL;
+	}
+
+	if (file_size.QuadPart < PPCHAT_HISTORY_SEGMENT_HEADER_SIZE || file_size.QuadPart > MAXDWORD) {
+		*out_error = ERROR_INVALID_DATA;
+		close_segment(segment, false);
+		return NULL;
+	}
+
+	segment->capacity = (uint32_t) file_size.QuadPart;
+	segment->mapping = CreateFileMappingA(segment->file, NULL, PAGE_READWRITE, 0, segment->capacity, NULL);
+	if (segment->mapping)
+		segment->view = (char *) MapViewOfFile(segment->mapping, FILE_MAP_WRITE, 0, 0, segment->capacity);
+
+	if (!segment->view) {
+		*out_error = GetLastError();
+		close_segment(segment, create);
+		return NULL;
+	}
+
+	*out_error = 0;
+	return segment;
+}
+
+static HistorySegment *create_segment(HistoryStore *store, uint64_t first_sequence, int *out_error) {
+	char path[MAX_PATH];
+	snprintf(path, sizeof(path), "%s/%020llu%s", store->folder, first_sequence, PPCHAT_HISTORY_SEGMENT_SUFFIX);
+
+	HistorySegment *segment = open_segment(path, true, (uint32_t) store->segment_size, out_error);
+	if (!segment)
+		return NULL;
+
+	HistorySegmentHeader header = { };
+	header.magic = HISTORY_SEGMENT_MAGIC;
+	header.version = HISTORY_SEGMENT_VERSION;
+	header.first_sequence = first_sequence;
+	memcpy(segment->view, &header, sizeof(header));
+
+	segment->first_sequence = first_sequence;
+	segment->size = PPCHAT_HISTORY_SEGMENT_HEADER_SIZE;
+	return segment;
+}
+
+// Reads the records of a segment that has just been opened. Stops at the end of the
+// records or at the first one that is torn, and zeroes whatever follows the latter so
+// that later appends can't run into a stale record.
+static void scan_segment(HistoryStore *store, HistorySegment *segment) {
+	uint32_t offset = PPCHAT_HISTORY_SEGMENT_HEADER_SIZE;
+	uint64_t expected_sequence = segment->first_sequence;
+	bool torn = false;
+
+	while (offset + PPCHAT_HISTORY_RECORD_HEADER_SIZE <= segment->capacity) {
+		const char *record = segment->view + offset;
+		HistoryRecordHeader header;
+		memcpy(&header, record, sizeof(header));
+		if (header.sequence == 0)
+			break;
+
+		uint32_t record_size = get_record_size(header.room_size, (int) min(header.payload_size, segment->capacity));
+		torn = header.sequence != expected_sequence ||
+		       header.room_size > PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE ||
+		       header.payload_size > segment->capacity ||
+		       record_size > segment->capacity - offset ||
+		       header.crc != get_record_crc(record, &header);
+		if (torn)
+			break;
+
+		add_index_entry(segment, &header, offset);
+
+		HistoryRoom *room = find_history_room(store, record + PPCHAT_HISTORY_RECORD_HEADER_SIZE, header.room_size, true);
+		if (room)
+			room->last_sequence = header.sequence;
+
+		segment->last_sequence = header.sequence;
+		segment->last_timestamp = header.timestamp;
+		store->last_timestamp = max(store->last_timestamp, header.timestamp);
+
+		offset += record_size;
+		expected_sequence += 1;
+	}
+
+	if (torn) {
+		log_warning("History segment '%s' ends with a torn record after message %llu, dropping the rest of it.", segment->path, segment->last_sequence);
+		memset(segment->view + offset, 0, segment->capacity - offset);
+	}
+
+	segment->size = offset;
+	segment->flushed_size = offset;
+}
+
+static int compare_segments(const void *a, const void *b) {
+	uint64_t first = (*(HistorySegment *const *) a)->first_sequence;
+	uint64_t second = (*(HistorySegment *const *) b)->first_sequence;
+	return (first > second) - (first < second);
+}
+
+// Opens every segment in the folder, oldest first.
+static bool load_segments(HistoryStore *store, int *out_error) {
+	char pattern[MAX_PATH];
+	snprintf(pattern, sizeof(pattern), "%s/*%s", store->folder, PPCHAT_HISTORY_SEGMENT_SUFFIX);
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE) {
+		int error = GetLastError();
+		*out_error = (error == ERROR_FILE_NOT_FOUND) ? 0 : error;
+		return error == ERROR_FILE_NOT_FOUND;
+	}
+
+	do {
+		if (store->segments_count == PPCHAT_HISTORY_MAX_SEGMENTS) {
+			log_warning("History folder '%s' has more than %d segments, the rest are ignored.", store->folder, PPCHAT_HISTORY_MAX_SEGMENTS);
+			break;
+		}
+
+		char path[MAX_PATH];
+		snprintf(path, sizeof(path), "%s/%s", store->folder, find_data.cFileName);
+
+		int error = 0;
+		HistorySegment *segment = open_segment(path, false, 0, &error);
+		if (!segment) {
+			log_warning("Couldn't open history segment '%s', ignoring it. Error: %d - %s", path, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			continue;
+		}
+
+		HistorySegmentHeader header;
+		memcpy(&header, segment->view, sizeof(header));
+		if (header.magic != HISTORY_SEGMENT_MAGIC || header.version != HISTORY_SEGMENT_VERSION || header.first_sequence == 0) {
+			log_warning("File '%s' isn't a history segment, ignoring it.", path);
+			close_segment(segment, false);
+			continue;
+		}
+
+		segment->first_sequence = header.first_sequence;
+		store->segments[store->segments_count] = segment;
+		store->segments_count += 1;
+	} while (FindNextFileA(find, &find_data));
+
+	FindClose(find);
+
+	// Rooms have to see their messages in order.
+	qsort(store->segments, store->segments_count, sizeof(HistorySegment *), compare_segments);
+	for (int i = 0; i < store->segments_count; i += 1)
+		scan_segment(store, store->segments[i]);
+
+	*out_error = 0;
+	return true;
+}
+
+static DWORD CALLBACK run_history_flush_thread(void *context) {
+	HistoryStore *store = static_cast<HistoryStore *>(context);
+	while (WaitForSingleObject(store->stop_event, (DWORD) store->flush_interval_ms) == WAIT_TIMEOUT)
+		ppchat_history_flush(store);
+
+	return EXIT_SUCCESS;
+}
+
+static void free_history(HistoryStore *store) {
+	for (int i = 0; i < store->segments_count; i += 1)
+		close_segment(store->segments[i], false);
+
+	for (int i = 0; i < store->retired_segments_count; i += 1)
+		close_segment(store->retired_segments[i], true);
+
+	for (int i = 0; i < PPCHAT_HISTORY_ROOM_BUCKETS_COUNT; i += 1) {
+		HistoryRoom *room = store->rooms[i];
+		while (room) {
+			HistoryRoom *next = room->next;
+			free(room);
+			room = next;
+		}
+	}
+
+	free(store->segments);
+	free(store->retired_segments);
+	memset(store, 0, sizeof(*store));
+}
+
+bool ppchat_history_open(HistoryStore *store, const HistoryOptions *options, int *out_error) {
+	memset(store, 0, sizeof(*store));
+	InitializeSRWLock(&store->lock);
+	InitializeSRWLock(&store->flush_lock);
+
+	strncpy(store->folder, options->folder, sizeof(store->folder) - 1);
+	store->segment_size = (options->segment_size > 0) ? options->segment_size : PPCHAT_HISTORY_DEFAULT_SEGMENT_SIZE;
+	store->max_segments = (options->max_segments > 0) ? min(options->max_segments, PPCHAT_HISTORY_MAX_SEGMENTS) : PPCHAT_HISTORY_DEFAULT_MAX_SEGMENTS;
+	store->flush_interval_ms = (options->flush_interval_ms > 0) ? options->flush_interval_ms : PPCHAT_HISTORY_DEFAULT_FLUSH_INTERVAL_MS;
+
+	// Segment has to fit at least one message of the biggest size frames allow.
+	store->segment_size = max(store->segment_size, PPCHAT_HISTORY_SEGMENT_HEADER_SIZE + (int) get_record_size(PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE, PPCHAT_FRAME_MAX_PAYLOAD_SIZE));
+
+	if (!CreateDirectoryA(store->folder, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	store->segments = (HistorySegment **) calloc(PPCHAT_HISTORY_MAX_SEGMENTS, sizeof(HistorySegment *));
+	store->retired_segments = (HistorySegment **) calloc(PPCHAT_HISTORY_MAX_SEGMENTS, sizeof(HistorySegment *));
+	if (!store->segments || !store->retired_segments) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		free_history(store);
+		return false;
+	}
+
+	if (!load_segments(store, out_error)) {
+		free_history(store);
+		return false;
+	}
+
+	store->next_sequence = 1;
+	if (store->segments_count > 0) {
+		HistorySegment *last = store->segments[store->segments_count - 1];
+		store->next_sequence = (last->last_sequence > 0) ? last->last_sequence + 1 : last->first_sequence;
+	}
+
+	store->durable_sequence = store->next_sequence - 1;
+
+	store->stop_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (store->stop_event) {
+		store->flush_thread = CreateThread(
+			/* Thread attributes   */ NULL,
+			/* Stack size          */ 0,
+			/* Calling procedure   */ run_history_flush_thread,
+			/* Procedure argument  */ store,
+			/* Creation flags      */ NULL,
+			/* Thread ID           */ NULL
+		);
+	}
+
+	if (!store->flush_thread) {
+		*out_error = GetLastError();
+		if (store->stop_event)
+			CloseHandle(store->stop_event);
+
+		free_history(store);
+		return false;
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+void ppchat_history_close(HistoryStore *store) {
+	if (!store->flush_thread)
+		return;
+
+	SetEvent(store->stop_event);
+	WaitForSingleObject(store->flush_thread, INFINITE);
+	CloseHandle(store->flush_thread);
+	CloseHandle(store->stop_event);
+
+	ppchat_history_flush(store);
+	free_history(store);
+}
+
+// Starts the segment the next message goes into, dropping the oldest one if there are
+// too many. Called with the store locked exclusively.
+static HistorySegment *start_next_segment(HistoryStore *store) {
+	if (store->segments_count >= store->max_segments && store->retired_segments_count < PPCHAT_HISTORY_MAX_SEGMENTS) {
+		store->retired_segments[store->retired_segments_count] = store->segments[0];
+		store->retired_segments_count += 1;
+
+		store->segments_count -= 1;
+		memmove(store->segments, store->segments + 1, store->segments_count * sizeof(HistorySegment *));
+	}
+
+	if (store->segments_count == PPCHAT_HISTORY_MAX_SEGMENTS)
+		return NULL;
+
+	int error = 0;
+	HistorySegment *segment = create_segment(store, store->next_sequence, &error);
+	if (!segment) {
+		log_error("Couldn't create history segment in '%s'. Error: %d - %s", store->folder, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		return NULL;
+	}
+
+	store->segments[store->segments_count] = segment;
+	store->segments_count += 1;
+	return segment;
+}
+
+uint64_t ppchat_history_append(HistoryStore *store, const char *room, const char *payload, int payload_size) {
+	int room_size = (int) min(strlen(room), (size_t) PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE);
+	uint32_t record_size = get_record_size(room_size, max(payload_size, 0));
+	bool fits = payload_size >= 0 && record_size <= (uint32_t) (store->segment_size - PPCHAT_HISTORY_SEGMENT_HEADER_SIZE);
+
+	AcquireSRWLockExclusive(&store->lock);
+
+	HistorySegment *segment = (store->segments_count > 0) ? store->segments[store->segments_count - 1] : NULL;
+	if (fits && (!segment || record_size > segment->capacity - segment->size))
+		segment = start_next_segment(store);
+
+	HistoryRoom *history_room = (fits && segment) ? find_history_room(store, room, room_size, true) : NULL;
+	if (!history_room) {
+		store->failed_appends_count += 1;
+		ReleaseSRWLockExclusive(&store->lock);
+		return 0;
+	}
+
+	HistoryRecordHeader header = { };
+	header.sequence = store->next_sequence;
+	header.timestamp = max(get_history_timestamp(), store->last_timestamp);
+	header.previous_in_room = history_room->last_sequence;
+	header.payload_size = (uint32_t) payload_size;
+	header.room_size = (uint16_t) room_size;
+
+	uint32_t offset = segment->size;
+	char *record = segment->view + offset;
+	memcpy(record, &header, sizeof(header));
+	memcpy(record + PPCHAT_HISTORY_RECORD_HEADER_SIZE, room, room_size);
+	memcpy(record + PPCHAT_HISTORY_RECORD_HEADER_SIZE + room_size, payload, payload_size);
+
+	header.crc = get_record_crc(record, &header);
+	memcpy(record + HISTORY_RECORD_CRC_OFFSET, &header.crc, sizeof(header.crc));
+
+	add_index_entry(segment, &header, offset);
+	segment->size += record_size;
+	segment->last_sequence = header.sequence;
+	segment->last_timestamp = header.timestamp;
+
+	history_room->last_sequence = header.sequence;
+	store->next_sequence += 1;
+	store->last_timestamp = header.timestamp;
+	store->appended_count += 1;
+	store->appended_bytes_count += record_size;
+
+	ReleaseSRWLockExclusive(&store->lock);
+	return header.sequence;
+}
+
+static HistorySegment *find_segment(HistoryStore *store, uint64_t sequence) {
+	// Last segment that starts at or before the sequence.
+	int low = 0;
+	int high = store->segments_count - 1;
+	int found = -1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		if (store->segments[middle]->first_sequence <= sequence) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	if (found < 0)
+		return NULL;
+
+	HistorySegment *segment = store->segments[found];
+	return (segment->last_sequence >= sequence) ? segment : NULL;
+}
+
+// Record with this sequence number, found from the index entry before it.
+static const char *find_record(HistoryStore *store, uint64_t sequence) {
+	HistorySegment *segment = find_segment(store, sequence);
+	if (!segment)
+		return NULL;
+
+	uint32_t offset = PPCHAT_HISTORY_SEGMENT_HEADER_SIZE;
+	int low = 0;
+	int high = segment->index_count - 1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		if (segment->index[middle].sequence <= sequence) {
+			offset = segment->index[middle].offset;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	while (offset < segment->size) {
+		const char *record = segment->view + offset;
+		HistoryRecordHeader header;
+		memcpy(&header, record, sizeof(header));
+		if (header.sequence == sequence)
+			return record;
+
+		offset += get_record_size(header.room_size, header.payload_size);
+	}
+
+	return NULL;
+}
+
+static void decode_record(const char *record, HistoryRecord *out_record, uint64_t *out_previous_in_room) {
+	HistoryRecordHeader header;
+	memcpy(&header, record, sizeof(header));
+
+	out_record->sequence = header.sequence;
+	out_record->timestamp = header.timestamp;
+	out_record->room = record + PPCHAT_HISTORY_RECORD_HEADER_SIZE;
+	out_record->room_size = header.room_size;
+	out_record->payload = out_record->room + header.room_size;
+	out_record->payload_size = (int) header.payload_size;
+
+	if (out_previous_in_room)
+		*out_previous_in_room = header.previous_in_room;
+}
+
+int ppchat_history_read_last(HistoryStore *store, const char *room, int count, HistoryReader reader, void *context) {
+	count = min(count, PPCHAT_HISTORY_MAX_READ_COUNT);
+	if (count <= 0)
+		return 0;
+
+	const char *records[PPCHAT_HISTORY_MAX_READ_COUNT];
+	int records_count = 0;
+	int room_size = (int) min(strlen(room), (size_t) PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE);
+
+	AcquireSRWLockShared(&store->lock);
+
+	// Newest first, following the links between messages of the room,
+	// until one of them is in a segment that has been dropped.
+	HistoryRoom *history_room = find_history_room(store, room, room_size, false);
+	uint64_t sequence = (history_room) ? history_room->last_sequence : 0;
+	while (sequence != 0 && records_count < count) {
+		const char *record = find_record(store, sequence);
+		if (!record)
+			break;
+
+		HistoryRecord decoded;
+		decode_record(record, &decoded, &sequence);
+		records[records_count] = record;
+		records_count += 1;
+	}
+
+	for (int i = records_count - 1; i >= 0; i -= 1) {
+		HistoryRecord decoded;
+		decode_record(records[i], &decoded, NULL);
+		reader(&decoded, context);
+	}
+
+	ReleaseSRWLockShared(&store->lock);
+	return records_count;
+}
+
+bool ppchat_history_read(HistoryStore *store, uint64_t sequence, HistoryReader reader, void *context) {
+	AcquireSRWLockShared(&store->lock);
+
+	const char *record = find_record(store, sequence);
+	if (record) {
+		HistoryRecord decoded;
+		decode_record(record, &decoded, NULL);
+		reader(&decoded, context);
+	}
+
+	ReleaseSRWLockShared(&store->lock);
+	return record != NULL;
+}
+
+int ppchat_history_read_range(HistoryStore *store, uint64_t first_sequence, int count, HistoryReader reader, void *context) {
+	int read_count = 0;
+
+	AcquireSRWLockShared(&store->lock);
+
+	// Segments hold consecutive messages, so after the first record it's only walking forward.
+	if (store->segments_count > 0)
+		first_sequence = max(first_sequence, store->segments[0]->first_sequence);
+
+	HistorySegment *segment = find_segment(store, first_sequence);
+	const char *record = (segment) ? find_record(store, first_sequence) : NULL;
+	int segment_index = 0;
+	while (segment_index < store->segments_count && store->segments[segment_index] != segment)
+		segment_index += 1;
+
+	while (record && read_count < count) {
+		HistoryRecord decoded;
+		decode_record(record, &decoded, NULL);
+		reader(&decoded, context);
+		read_count += 1;
+
+		record += get_record_size(decoded.room_size, decoded.payload_size);
+		if (record >= segment->view + segment->size) {
+			segment_index += 1;
+			segment = (segment_index < store->segments_count) ? store->segments[segment_index] : NULL;
+			record = (segment && segment->last_sequence > 0) ? segment->view + PPCHAT_HISTORY_SEGMENT_HEADER_SIZE : NULL;
+		}
+	}
+
+	ReleaseSRWLockShared(&store->lock);
+	return read_count;
+}
+
+uint64_t ppchat_history_find_time(HistoryStore *store, uint64_t timestamp) {
+	uint64_t sequence = 0;
+
+	AcquireSRWLockShared(&store->lock);
+
+	for (int i = 0; i < store->segments_count && sequence == 0; i += 1) {
+		HistorySegment *segment = store->segments[i];
+		if (segment->last_sequence == 0 || segment->last_timestamp < timestamp)
+			continue;
+
+		// Last index entry before the time, the record is somewhere after it.
+		uint32_t offset = PPCHAT_HISTORY_SEGMENT_HEADER_SIZE;
+		int low = 0;
+		int high = segment->index_count - 1;
+		while (low <= high) {
+			int middle = (low + high) / 2;
+			if (segment->index[middle].timestamp < timestamp) {
+				offset = segment->index[middle].offset;
+				low = middle + 1;
+			} else {
+				high = middle - 1;
+			}
+		}
+
+		while (offset < segment->size) {
+			HistoryRecordHeader header;
+			memcpy(&header, segment->view + offset, sizeof(header));
+			if (header.timestamp >= timestamp) {
+				sequence = header.sequence;
+				break;
+			}
+
+			offset += get_record_size(header.room_size, header.payload_size);
+		}
+	}
+
+	ReleaseSRWLockShared(&store->lock);
+	return sequence;
+}
+
+typedef struct DirtySegment {
+	HistorySegment *segment;
+	uint32_t        size;
+} DirtySegment;
+
+void ppchat_history_flush(HistoryStore *store) {
+	AcquireSRWLockExclusive(&store->flush_lock);
+	uint64_t start_timestamp = ppchat_get_timestamp();
+
+	// Only what is needed to flush is taken under the lock, appends go on meanwhile.
+	// Segments are only ever unmapped by whoever holds the flush lock, so their pages
+	// stay valid even if an append drops one of them in the meantime.
+	DirtySegment dirty_segments[PPCHAT_HISTORY_MAX_SEGMENTS];
+	int dirty_segments_count = 0;
+	HistorySegment *retired_segments[PPCHAT_HISTORY_MAX_SEGMENTS];
+	int retired_segments_count = 0;
+
+	AcquireSRWLockExclusive(&store->lock);
+
+	for (int i = 0; i < store->segments_count; i += 1) {
+		HistorySegment *segment = store->segments[i];
+		if (segment->flushed_size < segment->size) {
+			dirty_segments[dirty_segments_count].segment = segment;
+			dirty_segments[dirty_segments_count].size = segment->size;
+			dirty_segments_count += 1;
+		}
+	}
+
+	uint64_t last_sequence = store->next_sequence - 1;
+
+	retired_segments_count = store->retired_segments_count;
+	memcpy(retired_segments, store->retired_segments, retired_segments_count * sizeof(HistorySegment *));
+	store->retired_segments_count = 0;
+
+	ReleaseSRWLockExclusive(&store->lock);
+
+	bool flushed = true;
+	for (int i = 0; i < dirty_segments_count; i += 1) {
+		HistorySegment *segment = dirty_segments[i].segment;
+		uint32_t size = dirty_segments[i].size;
+
+		// Writes the dirty pages out, then waits for the disk to have them.
+		if (!FlushViewOfFile(segment->view + segment->flushed_size, size - segment->flushed_size) || !FlushFileBuffers(segment->file)) {
+			int error = GetLastError();
+			log_error("Couldn't flush history segment '%s'. Error: %d - %s", segment->path, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			flushed = false;
+			continue;
+		}
+
+		segment->flushed_size = size;
+	}
+
+	for (int i = 0; i < retired_segments_count; i += 1)
+		close_segment(retired_segments[i], true);
+
+	if (dirty_segments_count > 0 && flushed) {
+		uint64_t duration_ns = ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp);
+		store->durable_sequence = last_sequence;
+		store->flushes_count += 1;
+		store->max_flush_duration_ns = max(store->max_flush_duration_ns, duration_ns);
+	}
+
+	ReleaseSRWLockExclusive(&store->flush_lock);
+}
+
+void ppchat_history_get_stats(HistoryStore *store, HistoryStats *out_stats) {
+	memset(out_stats, 0, sizeof(*out_stats));
+
+	AcquireSRWLockShared(&store->lock);
+
+	for (int i = 0; i < store->segments_count; i += 1) {
+		HistorySegment *segment = store->segments[i];
+		if (out_stats->first_sequence == 0 && segment->last_sequence > 0)
+			out_stats->first_sequence = segment->first_sequence;
+
+		out_stats->segments_size += segment->size;
+	}
+
+	for (int i = 0; i < PPCHAT_HISTORY_ROOM_BUCKETS_COUNT; i += 1) {
+		for (HistoryRoom *room = store->rooms[i]; room; room = room->next)
+			out_stats->rooms_count += 1;
+	}
+
+	out_stats->last_sequence = store->next_sequence - 1;
+	out_stats->segments_count = store->segments_count;
+	out_stats->appended_count = store->appended_count;
+	out_stats->appended_bytes_count = store->appended_bytes_count;
+	out_stats->failed_appends_count = store->failed_appends_count;
+
+	ReleaseSRWLockShared(&store->lock);
+
+	// Written by whoever flushes, read without synchronization.
+	out_stats->durable_sequence = store->durable_sequence;
+	out_stats->flushes_count = store->flushes_count;
+	out_stats->max_flush_duration_ns = store->max_flush_duration_ns;
+}
@@ -0,0 +1,563 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_log.h"
+#include "../include/ppchat_ring.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <assert.h>
+
+// WaitOnAddress and WakeByAddressSingle live there.
+#pragma comment (lib, "Synchronization.lib")
+
+typedef struct LogThreadRing {
+	RingQueue       ring;
+	volatile LONG64 committed_count; // Written by the owning thread.
+	volatile LONG64 printed_count;   // Written by the logging thread.
+} LogThreadRing;
+
+typedef struct LogTimestamp {
+	int64_t second;
+	char    text[16];
+} LogTimestamp;
+
+static struct {
+	volatile LONG   running;
+	volatile LONG   stopping;
+	volatile LONG   wake_sequence;
+	HANDLE          thread;
+	DWORD           thread_id;
+	volatile LONG64 stalls_count;
+
+	// Rings are only ever added, and stay alive until the process exits,
+	// since threads keep pointers to theirs.
+	SRWLOCK         rings_lock;
+	LogThreadRing  *rings[PPCHAT_LOG_MAX_THREADS];
+	volatile LONG   rings_count;
+} g_logger = { 0, 0, 0, NULL, 0, 0, SRWLOCK_INIT };
+
+static thread_local LogThreadRing *g_thread_log_ring;
+static thread_local bool g_thread_log_ring_unavailable;
+
+// Only the timestamp prefix of the synchronous path, each thread keeps its own.
+static thread_local LogTimestamp g_thread_log_timestamp = { -1 };
+
+// FILETIME counts 100 ns intervals since 1601, time_t counts seconds since 1970.
+const int64_t LOG_FILETIME_TICKS_PER_SECOND = 10000000;
+const int64_t LOG_FILETIME_UNIX_EPOCH_SECONDS = 11644473600;
+
+static uint64_t get_log_timestamp() {
+	// Reads the time the kernel keeps in shared memory, no system call.
+	FILETIME file_time;
+	GetSystemTimeAsFileTime(&file_time);
+	return ((uint64_t) file_time.dwHighDateTime << 32) | file_time.dwLowDateTime;
+}
+
+// Rebuilds "[hh:mm:ss] " only when the second changes.
+static const char *format_log_timestamp(LogTimestamp *cache, uint64_t timestamp) {
+	int64_t second = (int64_t) (timestamp / LOG_FILETIME_TICKS_PER_SECOND);
+	if (second != cache->second) {
+		time_t unix_time = (time_t) (second - LOG_FILETIME_UNIX_EPOCH_SECONDS);
+		tm local_time = { };
+		localtime_s(&local_time, &unix_time);
+
+		snprintf(cache->text, sizeof(cache->text), "[%02d:%02d:%02d] ", local_time.tm_hour, local_time.tm_min, local_time.tm_sec);
+		cache->second = second;
+	}
+
+	return cache->text;
+}
+
+static void wake_logging_thread() {
+	InterlockedIncrement(&g_logger.wake_sequence);
+	WakeByAddressSingle((PVOID) &g_logger.wake_sequence);
+}
+
+// One "%..." conversion specification of a format string.
+typedef struct FormatSpecification {
+	const char *end;             // Just past the conversion character.
+	int         stars_count;     // '*' width and precision take an int argument each.
+	int         precision;       // -1 if none or '*'.
+	bool        star_precision;
+	char        conversion;      // 0 if the specification is broken.
+} FormatSpecification;
+
+static void parse_format_specification(const char *percent, FormatSpecification *out_specification) {
+	FormatSpecification specification = { };
+	specification.precision = -1;
+
+	const char *cursor = percent + 1;
+	while (*cursor && strchr("-+ #0", *cursor))
+		cursor += 1;
+
+	if (*cursor == '*') {
+		specification.stars_count += 1;
+		cursor += 1;
+	} else {
+		while (*cursor >= '0' && *cursor <= '9')
+			cursor += 1;
+	}
+
+	if (*cursor == '.') {
+		cursor += 1;
+		if (*cursor == '*') {
+			specification.stars_count += 1;
+			specification.star_precision = true;
+			cursor += 1;
+		} else {
+			specification.precision = 0;
+			while (*cursor >= '0' && *cursor <= '9') {
+				specification.precision = specification.precision * 10 + (*cursor - '0');
+				cursor += 1;
+			}
+		}
+	}
+
+	// Length modifiers, including the Microsoft specific "I", "I32" and "I64".
+	if (strncmp(cursor, "I64", 3) == 0 || strncmp(cursor, "I32", 3) == 0) {
+		cursor += 3;
+	} else {
+		while (*cursor && strchr("hljztLIw", *cursor))
+			cursor += 1;
+	}
+
+	if (*cursor && strchr("diouxXcCeEfFgGaAsSpn%", *cursor)) {
+		specification.conversion = *cursor;
+		cursor += 1;
+	}
+
+	specification.end = cursor;
+	*out_specification = specification;
+}
+
+int ppchat_log_get_string_precision(const char *format, int argument_index, int64_t previous_integer) {
+	int index = 0;
+	const char *cursor = format;
+	while ((cursor = strchr(cursor, '%')) != NULL) {
+		FormatSpecification specification;
+		parse_format_specification(cursor, &specification);
+		if (specification.conversion == 0)
+			return -1;
+
+		cursor = specification.end;
+		if (specification.conversion == '%')
+			continue;
+
+		index += specification.stars_count;
+		if (index == argument_index) {
+			if (specification.conversion != 's')
+				return -1;
+
+			if (specification.star_precision)
+				return (previous_integer >= 0) ? (int) min(previous_integer, (int64_t) INT_MAX) : -1;
+
+			return specification.precision;
+		}
+
+		index += 1;
+		if (index > argument_index)
+			return -1;
+	}
+
+	return -1;
+}
+
+typedef struct LogArgument {
+	LogArgumentType type;
+	int64_t         integer;
+	double          floating;
+	const void     *pointer;
+	const char     *string;   // Copy inside the record, `pointer` is the original.
+} LogArgument;
+
+typedef struct LogArgumentReader {
+	const char *cursor;
+	const char *end;
+} LogArgumentReader;
+
+static bool read_log_argument(LogArgumentReader *reader, LogArgument *out_argument) {
+	if (reader->cursor >= reader->end)
+		return false;
+
+	LogArgument argument = { };
+	argument.type = (LogArgumentType) *reader->cursor;
+	reader->cursor += 1;
+
+	switch (argument.type) {
+		case LOG_ARGUMENT_INT32: {
+			int32_t value;
+			memcpy(&value, reader->cursor, sizeof(value));
+			argument.integer = value;
+			reader->cursor += sizeof(value);
+		} break;
+		case LOG_ARGUMENT_INT64: {
+			memcpy(&argument.integer, reader->cursor, sizeof(argument.integer));
+			reader->cursor += sizeof(argument.integer);
+		} break;
+		case LOG_ARGUMENT_DOUBLE: {
+			memcpy(&argument.floating, reader->cursor, sizeof(argument.floating));
+			reader->cursor += sizeof(argument.floating);
+		} break;
+		case LOG_ARGUMENT_POINTER: {
+			memcpy(&argument.pointer, reader->cursor, sizeof(argument.pointer));
+			reader->cursor += sizeof(argument.pointer);
+		} break;
+		case LOG_ARGUMENT_STRING: {
+			uint16_t length;
+			memcpy(&argument.pointer, reader->cursor, sizeof(argument.pointer));
+			memcpy(&length, reader->cursor + sizeof(argument.pointer), sizeof(length));
+			argument.string = reader->cursor + sizeof(argument.pointer) + sizeof(length);
+			reader->cursor = argument.string + length + 1;
+		} break;
+		default: {
+			return false;
+		};
+	}
+
+	*out_argument = argument;
+	return true;
+}
+
+// Passes the '*' values in front of the argument, like the original call did.
+template <typename T>
+static int format_log_value(char *out_buffer, size_t out_buffer_size, const char *specification, int stars_count, int *stars, T value) {
+	switch (stars_count) {
+		case 0:  return snprintf(out_buffer, out_buffer_size, specification, value);
+		case 1:  return snprintf(out_buffer, out_buffer_size, specification, stars[0], value);
+		default: return snprintf(out_buffer, out_buffer_size, specification, stars[0], stars[1], value);
+	}
+}
+
+static int format_log_argument(char *out_buffer, size_t out_buffer_size, const char *specification, FormatSpecification *parsed, int *stars, LogArgument *argument) {
+	int stars_count = parsed->stars_count;
+	switch (parsed->conversion) {
+		case 's': {
+			if (argument->type == LOG_ARGUMENT_STRING)
+				return format_log_value(out_buffer, out_buffer_size, specification, stars_count, stars, (argument->pointer) ? argument->string : "(null)");
+
+			return snprintf(out_buffer, out_buffer_size, "(not a string)");
+		};
+		case 'p': {
+			return format_log_value(out_buffer, out_buffer_size, specification, stars_count, stars, argument->pointer);
+		};
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+			double value = (argument->type == LOG_ARGUMENT_DOUBLE) ? argument->floating : (double) argument->integer;
+			return format_log_value(out_buffer, out_buffer_size, specification, stars_count, stars, value);
+		};
+		case 'n': {
+			return 0;
+		};
+	}
+
+	// Integer conversions get the value in the width it was passed with.
+	if (argument->type == LOG_ARGUMENT_INT32)
+		return format_log_value(out_buffer, out_buffer_size, specification, stars_count, stars, (int32_t) argument->integer);
+
+	if (argument->type == LOG_ARGUMENT_INT64)
+		return format_log_value(out_buffer, out_buffer_size, specification, stars_count, stars, (long long) argument->integer);
+
+	return snprintf(out_buffer, out_buffer_size, "(not an integer)");
+}
+
+static void append_to_log_line(char *out_buffer, int out_buffer_size, int *length, const char *text, int text_length) {
+	int copied = min(text_length, out_buffer_size - 1 - *length);
+	memcpy(out_buffer + *length, text, copied);
+	*length += copied;
+}
+
+// Same output `vsnprintf` would produce for the original call. Returns the length written.
+static int format_log_record(LogRecord *record, char *out_buffer, int out_buffer_size) {
+	int length = 0;
+	LogArgumentReader reader = { record->arguments, record->arguments + record->arguments_size };
+
+	const char *cursor = record->format;
+	while (*cursor && length < out_buffer_size - 1) {
+		const char *percent = strchr(cursor, '%');
+		if (!percent) {
+			append_to_log_line(out_buffer, out_buffer_size, &length, cursor, (int) strlen(cursor));
+			break;
+		}
+
+		append_to_log_line(out_buffer, out_buffer_size, &length, cursor, (int) (percent - cursor));
+
+		FormatSpecification parsed;
+		parse_format_specification(percent, &parsed);
+		if (parsed.conversion == 0) {
+			append_to_log_line(out_buffer, out_buffer_size, &length, percent, (int) strlen(percent));
+			break;
+		}
+
+		cursor = parsed.end;
+		if (parsed.conversion == '%') {
+			append_to_log_line(out_buffer, out_buffer_size, &length, "%", 1);
+			continue;
+		}
+
+		int stars[2] = { };
+		LogArgument argument = { };
+		for (int i = 0; i < parsed.stars_count; i += 1) {
+			if (read_log_argument(&reader, &argument))
+				stars[i] = (int) argument.integer;
+		}
+
+		if (!read_log_argument(&reader, &argument)) {
+			append_to_log_line(out_buffer, out_buffer_size, &length, "(missing)", 9);
+			continue;
+		}
+
+		char specification[32];
+		int specification_length = (int) (parsed.end - percent);
+		if (specification_length >= (int) sizeof(specification)) {
+			append_to_log_line(out_buffer, out_buffer_size, &length, "(bad format)", 12);
+			continue;
+		}
+
+		memcpy(specification, percent, specification_length);
+		specification[specification_length] = '\0';
+
+		int written = format_log_argument(out_buffer + length, out_buffer_size - length, specification, &parsed, stars, &argument);
+		if (written > 0)
+			length += min(written, out_buffer_size - 1 - length);
+	}
+
+	out_buffer[length] = '\0';
+	return length;
+}
+
+static void print_log_record(LogRecord *record, LogTimestamp *timestamp) {
+	char line[4096];
+	int length = snprintf(line, sizeof(line), "%s%s", record->prefix, format_log_timestamp(timestamp, record->timestamp));
+
+	// A byte is kept for the new line a record too long for the line gets cut off with,
+	// so that the next record doesn't go on the same line.
+	length += format_log_record(record, line + length, (int) sizeof(line) - length - 1);
+	if (length == 0 || line[length - 1] != '\n') {
+		line[length] = '\n';
+		line[length + 1] = '\0';
+	}
+
+	fputs(line, record->stream);
+}
+
+// Prints whatever all threads have committed so far.
+static void drain_log_rings(LogTimestamp *timestamp) {
+	const int batch_size = 16;
+	LogRecord records[batch_size];
+
+	FILE *streams[8];
+	int streams_count = 0;
+
+	LONG rings_count = ReadAcquire(&g_logger.rings_count);
+	for (LONG i = 0; i < rings_count; i += 1) {
+		LogThreadRing *thread_ring = g_logger.rings[i];
+
+		int printed_count = 0;
+		for (;;) {
+			int records_count = ppchat_ring_dequeue_batch(&thread_ring->ring, records, batch_size);
+			for (int j = 0; j < records_count; j += 1) {
+				print_log_record(&records[j], timestamp);
+
+				bool known_stream = false;
+				for (int k = 0; k < streams_count; k += 1)
+					known_stream = known_stream || (streams[k] == records[j].stream);
+
+				if (!known_stream && streams_count < (int) (sizeof(streams) / sizeof(streams[0])))
+					streams[streams_count++] = records[j].stream;
+				else if (!known_stream)
+					fflush(records[j].stream);
+			}
+
+			printed_count += records_count;
+			if (records_count < batch_size)
+				break;
+		}
+
+		// Flushed before we report them as printed, `ppchat_log_flush` relies on that.
+		for (int k = 0; k < streams_count; k += 1)
+			fflush(streams[k]);
+
+		if (printed_count > 0)
+			WriteRelease64(&thread_ring->printed_count, thread_ring->printed_count + printed_count);
+	}
+}
+
+static DWORD CALLBACK run_logging_thread(void *context) {
+	LogTimestamp timestamp = { -1 };
+
+	for (;;) {
+		// Sampled before draining, so a wake that comes in meanwhile isn't missed.
+		LONG observed_sequence = ReadAcquire(&g_logger.wake_sequence);
+		bool stopping = ReadAcquire(&g_logger.stopping) != 0;
+
+		drain_log_rings(&timestamp);
+		if (stopping)
+			break;
+
+		WaitOnAddress(&g_logger.wake_sequence, &observed_sequence, sizeof(observed_sequence), PPCHAT_LOG_FLUSH_INTERVAL_MS);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static LogThreadRing *register_thread_log_ring() {
+	if (g_thread_log_ring_unavailable)
+		return NULL;
+
+	LogThreadRing *thread_ring = (LogThreadRing *) _aligned_malloc(sizeof(LogThreadRing), PPCHAT_CACHE_LINE_SIZE);
+	if (!thread_ring) {
+		g_thread_log_ring_unavailable = true;
+		return NULL;
+	}
+
+	memset(thread_ring, 0, sizeof(*thread_ring));
+	if (!ppchat_ring_create(&thread_ring->ring, RING_QUEUE_MODE_SPSC, PPCHAT_LOG_RING_CAPACITY, sizeof(LogRecord))) {
+		_aligned_free(thread_ring);
+		g_thread_log_ring_unavailable = true;
+		return NULL;
+	}
+
+	bool registered = false;
+	AcquireSRWLockExclusive(&g_logger.rings_lock);
+	if (g_logger.rings_count < PPCHAT_LOG_MAX_THREADS) {
+		g_logger.rings[g_logger.rings_count] = thread_ring;
+		WriteRelease(&g_logger.rings_count, g_logger.rings_count + 1);
+		registered = true;
+	}
+	ReleaseSRWLockExclusive(&g_logger.rings_lock);
+
+	if (!registered) {
+		ppchat_ring_destroy(&thread_ring->ring);
+		_aligned_free(thread_ring);
+		g_thread_log_ring_unavailable = true;
+		return NULL;
+	}
+
+	g_thread_log_ring = thread_ring;
+	return thread_ring;
+}
+
+bool ppchat_log_start() {
+	if (ReadAcquire(&g_logger.running))
+		return true;
+
+	WriteRelease(&g_logger.stopping, 0);
+	g_logger.thread = CreateThread(
+		/* Thread attributes   */ NULL,
+		/* Stack size          */ 0,
+		/* Calling procedure   */ run_logging_thread,
+		/* Procedure argument  */ NULL,
+		/* Creation flags      */ NULL,
+		/* Thread ID           */ &g_logger.thread_id
+	);
+	if (!g_logger.thread)
+		return false;
+
+	WriteRelease(&g_logger.running, 1);
+	return true;
+}
+
+void ppchat_log_stop() {
+	if (!ReadAcquire(&g_logger.running))
+		return;
+
+	// New lines go the synchronous way from now on, the thread prints what's queued and quits.
+	WriteRelease(&g_logger.running, 0);
+	WriteRelease(&g_logger.stopping, 1);
+	wake_logging_thread();
+
+	WaitForSingleObject(g_logger.thread, INFINITE);
+	CloseHandle(g_logger.thread);
+	g_logger.thread = NULL;
+	g_logger.thread_id = 0;
+}
+
+void ppchat_log_flush() {
+	if (!ReadAcquire(&g_logger.running) || GetCurrentThreadId() == g_logger.thread_id)
+		return;
+
+	wake_logging_thread();
+
+	LONG rings_count = ReadAcquire(&g_logger.rings_count);
+	for (LONG i = 0; i < rings_count; i += 1) {
+		LogThreadRing *thread_ring = g_logger.rings[i];
+		LONG64 committed_count = ReadAcquire64(&thread_ring->committed_count);
+		while (ReadAcquire64(&thread_ring->printed_count) < committed_count) {
+			if (!ReadAcquire(&g_logger.running))
+				return;
+
+			wake_logging_thread();
+			SwitchToThread();
+		}
+	}
+}
+
+uint64_t ppchat_log_get_stalls_count() {
+	return (uint64_t) ReadNoFence64(&g_logger.stalls_count);
+}
+
+LogRecord *ppchat_log_begin_record() {
+	if (!ReadNoFence(&g_logger.running))
+		return NULL;
+
+	LogThreadRing *thread_ring = g_thread_log_ring;
+	if (!thread_ring) {
+		thread_ring = register_thread_log_ring();
+		if (!thread_ring)
+			return NULL;
+	}
+
+	for (;;) {
+		LogRecord *record = (LogRecord *) ppchat_ring_begin_enqueue(&thread_ring->ring);
+		if (record) {
+			record->timestamp = get_log_timestamp();
+			return record;
+		}
+
+		// The logging thread is behind. Wait for it rather than lose the line.
+		InterlockedIncrement64(&g_logger.stalls_count);
+		if (!ReadAcquire(&g_logger.running))
+			return NULL;
+
+		wake_logging_thread();
+		SwitchToThread();
+	}
+}
+
+void ppchat_log_commit_record() {
+	LogThreadRing *thread_ring = g_thread_log_ring;
+	assert(thread_ring);
+
+	ppchat_ring_end_enqueue(&thread_ring->ring);
+	WriteRelease64(&thread_ring->committed_count, thread_ring->committed_count + 1);
+}
+
+void ppchat_log_write_now(FILE *stream, const char *prefix, const char *format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+
+	char message[2048];
+	size_t message_size = sizeof(message);
+	int prefix_length = snprintf(message, message_size, "%s%s", prefix, format_log_timestamp(&g_thread_log_timestamp, get_log_timestamp()));
+
+	va_list arguments_copy;
+	va_copy(arguments_copy, arguments);
+	int written = vsnprintf(message + prefix_length, message_size - prefix_length, format, arguments_copy);
+	va_end(arguments_copy);
+
+	// Long lines like `/status` output get a buffer of their own instead of being trimmed.
+	char *long_message = NULL;
+	if (written >= (int) (message_size - prefix_length)) {
+		long_message = (char *) malloc(prefix_length + written + 1);
+		if (long_message) {
+			memcpy(long_message, message, prefix_length);
+			vsnprintf(long_message + prefix_length, written + 1, format, arguments);
+		} else {
+			fprintf(stderr, "WARNING: Console print exceeds %lld characters limit! The rest is trimmed. (format was: \"%s\")\n", message_size, format);
+		}
+	}
+
+	fputs((long_message) ? long_message : message, stream);
+	free(long_message);
+	va_end(arguments);
+}
@@ -0,0 +1,238 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+// Slab header takes a whole cache line so that blocks after it stay aligned.
+static const int POOL_SLAB_HEADER_SIZE = PPCHAT_CACHE_LINE_SIZE;
+
+// Regular pages are handed out in chunks of the allocation granularity anyway.
+static const size_t POOL_SLAB_GRANULARITY = 64 * 1024;
+
+static volatile LONG g_large_pages_enabled = FALSE;
+
+static size_t round_up(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+bool ppchat_pool_enable_large_pages() {
+	if (GetLargePageMinimum() == 0)
+		return false;
+
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+
+	TOKEN_PRIVILEGES privileges = { };
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	// AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED when
+	// the account doesn't have the privilege to begin with.
+	bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+
+	CloseHandle(token);
+
+	if (enabled)
+		InterlockedExchange(&g_large_pages_enabled, TRUE);
+
+	return enabled;
+}
+
+void ppchat_object_pool_init(ObjectPool *pool, int block_size, const char *name) {
+	assert(block_size > 0);
+
+	memset(pool, 0, sizeof(*pool));
+	InitializeSListHead(&pool->free_blocks);
+	InitializeSRWLock(&pool->slabs_lock);
+
+	// Free blocks hold the list entry, which has to be 16 byte aligned.
+	pool->block_size = (int) round_up((size_t) max(block_size, (int) sizeof(SLIST_ENTRY)), PPCHAT_CACHE_LINE_SIZE);
+	pool->name = name;
+}
+
+void ppchat_object_pool_destroy(ObjectPool *pool) {
+	PoolSlab *slab = pool->slabs;
+	while (slab) {
+		PoolSlab *next = slab->next;
+		VirtualFree(slab, 0, MEM_RELEASE);
+		slab = next;
+	}
+
+	pool->slabs = NULL;
+	pool->reserved_size = 0;
+	pool->blocks_count = 0;
+	pool->large_page_slabs_count = 0;
+	pool->used_blocks_count = 0;
+	InitializeSListHead(&pool->free_blocks);
+}
+
+static PoolSlab *allocate_slab(ObjectPool *pool, bool *out_large_pages) {
+	size_t blocks_size = max((size_t) PPCHAT_POOL_MIN_SLAB_SIZE, (size_t) PPCHAT_POOL_MIN_SLAB_BLOCKS * pool->block_size);
+	size_t slab_size = POOL_SLAB_HEADER_SIZE + blocks_size;
+
+	*out_large_pages = false;
+	if (ReadAcquire(&g_large_pages_enabled)) {
+		size_t large_page_size = GetLargePageMinimum();
+		size_t large_slab_size = round_up(slab_size, large_page_size);
+		void *slab = VirtualAlloc(NULL, large_slab_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (slab) {
+			*out_large_pages = true;
+			((PoolSlab *) slab)->size = large_slab_size;
+			return (PoolSlab *) slab;
+		}
+
+		// Physical memory is too fragmented for a large page, fall back to regular ones.
+	}
+
+	slab_size = round_up(slab_size, POOL_SLAB_GRANULARITY);
+	PoolSlab *slab = (PoolSlab *) VirtualAlloc(NULL, slab_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (slab)
+		slab->size = slab_size;
+
+	return slab;
+}
+
+// Adds a slab and returns one of its blocks, the rest go on the free list.
+static void *grow_pool(ObjectPool *pool) {
+	AcquireSRWLockExclusive(&pool->slabs_lock);
+
+	// Another thread could've grown the pool while this one waited for the lock.
+	void *block = InterlockedPopEntrySList(&pool->free_blocks);
+	if (block) {
+		ReleaseSRWLockExclusive(&pool->slabs_lock);
+		return block;
+	}
+
+	bool large_pages = false;
+	PoolSlab *slab = allocate_slab(pool, &large_pages);
+	if (!slab) {
+		ReleaseSRWLockExclusive(&pool->slabs_lock);
+		log_error("Couldn't grow pool '%s' of %d byte blocks.", pool->name, pool->block_size);
+		return NULL;
+	}
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	char *blocks = (char *) slab + POOL_SLAB_HEADER_SIZE;
+	size_t blocks_count = (slab->size - POOL_SLAB_HEADER_SIZE) / pool->block_size;
+
+	// Push in reverse so that blocks are handed out in address order.
+	for (size_t i = blocks_count - 1; i > 0; i -= 1)
+		InterlockedPushEntrySList(&pool->free_blocks, (PSLIST_ENTRY) (blocks + i * pool->block_size));
+
+	pool->reserved_size += slab->size;
+	pool->blocks_count += blocks_count;
+	if (large_pages)
+		pool->large_page_slabs_count += 1;
+
+	ReleaseSRWLockExclusive(&pool->slabs_lock);
+
+	return blocks;
+}
+
+void *ppchat_object_pool_allocate(ObjectPool *pool) {
+	void *block = InterlockedPopEntrySList(&pool->free_blocks);
+	if (!block) {
+		block = grow_pool(pool);
+		if (!block)
+			return NULL;
+	}
+
+	InterlockedIncrement64(&pool->used_blocks_count);
+	return block;
+}
+
+void ppchat_object_pool_free(ObjectPool *pool, void *block) {
+	if (!block)
+		return;
+
+	InterlockedDecrement64(&pool->used_blocks_count);
+	InterlockedPushEntrySList(&pool->free_blocks, (PSLIST_ENTRY) block);
+}
+
+void ppchat_object_pool_get_stats(ObjectPool *pool, SlabStats *out_stats) {
+	AcquireSRWLockShared(&pool->slabs_lock);
+	out_stats->reserved_size = pool->reserved_size;
+	out_stats->large_page_slabs_count = pool->large_page_slabs_count;
+	ReleaseSRWLockShared(&pool->slabs_lock);
+
+	out_stats->used_size = (uint64_t) max(ReadNoFence64(&pool->used_blocks_count), (LONG64) 0) * pool->block_size;
+}
+
+static const char *const SLAB_CLASS_NAMES[PPCHAT_SLAB_CLASSES_COUNT] = {
+	"slab 64", "slab 128", "slab 256", "slab 512", "slab 1K", "slab 2K",
+	"slab 4K", "slab 8K", "slab 16K", "slab 32K", "slab 64K"
+};
+
+static bool init_slab_classes(ObjectPool *classes) {
+	for (int i = 0; i < PPCHAT_SLAB_CLASSES_COUNT; i += 1)
+		ppchat_object_pool_init(&classes[i], PPCHAT_SLAB_MIN_BLOCK_SIZE << i, SLAB_CLASS_NAMES[i]);
+
+	return true;
+}
+
+static ObjectPool *get_slab_classes() {
+	// Initialized once by whichever thread gets here first, the others wait for it.
+	static ObjectPool classes[PPCHAT_SLAB_CLASSES_COUNT];
+	static bool initialized = init_slab_classes(classes);
+	(void) initialized;
+
+	return classes;
+}
+
+static int get_slab_class(int size) {
+	if (size <= PPCHAT_SLAB_MIN_BLOCK_SIZE)
+		return 0;
+
+	unsigned long most_significant_bit;
+	_BitScanReverse(&most_significant_bit, (unsigned long) (size - 1));
+	return (int) most_significant_bit + 1 - PPCHAT_SLAB_MIN_BLOCK_SIZE_BITS;
+}
+
+void *ppchat_slab_allocate(int size, int *out_capacity) {
+	assert(size >= 0);
+
+	if (size > PPCHAT_SLAB_MAX_BLOCK_SIZE) {
+		if (out_capacity)
+			*out_capacity = size;
+
+		return malloc(size);
+	}
+
+	int slab_class = get_slab_class(size);
+	if (out_capacity)
+		*out_capacity = PPCHAT_SLAB_MIN_BLOCK_SIZE << slab_class;
+
+	return ppchat_object_pool_allocate(&get_slab_classes()[slab_class]);
+}
+
+void ppchat_slab_free(void *block, int size) {
+	if (!block)
+		return;
+
+	if (size > PPCHAT_SLAB_MAX_BLOCK_SIZE) {
+		free(block);
+		return;
+	}
+
+	ppchat_object_pool_free(&get_slab_classes()[get_slab_class(size)], block);
+}
+
+void ppchat_slab_get_stats(SlabStats *out_stats) {
+	memset(out_stats, 0, sizeof(*out_stats));
+
+	ObjectPool *classes = get_slab_classes();
+	for (int i = 0; i < PPCHAT_SLAB_CLASSES_COUNT; i += 1) {
+		SlabStats class_stats;
+		ppchat_object_pool_get_stats(&classes[i], &class_stats);
+		out_stats->reserved_size += class_stats.reserved_size;
+		out_stats->used_size += class_stats.used_size;
+		out_stats->large_page_slabs_count += class_stats.large_page_slabs_count;
+	}
+}
@@ -0,0 +1,170 @@
+#include "../include/ppchat_rate_limit.h"
+
+#include <stdlib.h>
+
+// Tokens are kept in thousandths, so that a bucket refilling at `per_second` tokens a
+// second gains exactly `per_second` of them every millisecond.
+static const int64_t RATE_LIMIT_TOKEN_SCALE = 1000;
+
+static int64_t get_burst_tokens(const RateLimit *limit) {
+	uint32_t burst = (limit->burst > 0) ? limit->burst : limit->per_second;
+	return (int64_t) burst * RATE_LIMIT_TOKEN_SCALE;
+}
+
+// IPv4 as its mapped IPv6 address, IPv6 cut to the prefix.
+static void make_key(RateLimiter *limiter, const sockaddr_in6 *address, uint8_t *out_key) {
+	memset(out_key, 0, 16);
+
+	if (address->sin6_family == AF_INET) {
+		const sockaddr_in *address_v4 = (const sockaddr_in *) address;
+		out_key[10] = 0xFF;
+		out_key[11] = 0xFF;
+		memcpy(out_key + 12, &address_v4->sin_addr, 4);
+		return;
+	}
+
+	const uint8_t *bytes = (const uint8_t *) &address->sin6_addr;
+
+	// Mapped IPv4 addresses that came over a dual stack socket are whole addresses.
+	static const uint8_t mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+	int prefix_bits = (memcmp(bytes, mapped_prefix, sizeof(mapped_prefix)) == 0) ? 128 : limiter->ipv6_prefix_bits;
+
+	int whole_bytes = prefix_bits / 8;
+	memcpy(out_key, bytes, whole_bytes);
+	if (prefix_bits % 8 != 0)
+		out_key[whole_bytes] = bytes[whole_bytes] & (uint8_t) (0xFF << (8 - prefix_bits % 8));
+}
+
+// Every bit of the input ends up in every bit of the output, the low ones included,
+// which are the ones that pick the slot.
+static uint64_t mix_bits(uint64_t value) {
+	value ^= value >> 33;
+	value *= 0xFF51AFD7ED558CCDull;
+	value ^= value >> 33;
+	value *= 0xC4CEB9FE1A85EC53ull;
+	return value ^ (value >> 33);
+}
+
+static uint64_t hash_key(RateLimiter *limiter, const uint8_t *key) {
+	uint64_t high;
+	uint64_t low;
+	memcpy(&high, key, sizeof(high));
+	memcpy(&low, key + 8, sizeof(low));
+
+	// Seeded per process, so that nobody can pick addresses that all land in one place.
+	return mix_bits(mix_bits(high ^ limiter->seed) ^ low);
+}
+
+static void refill_entry(RateLimiter *limiter, RateLimitEntry *entry, uint64_t now_ms) {
+	if (now_ms <= entry->last_seen_ms)
+		return;
+
+	uint64_t elapsed_ms = now_ms - entry->last_seen_ms;
+	entry->last_seen_ms = now_ms;
+
+	for (int kind = 0; kind < RATE_LIMIT_KIND_COUNT; kind += 1) {
+		const RateLimit *limit = &limiter->limits[kind];
+		if (limit->per_second == 0)
+			continue;
+
+		// Past the time it takes to fill up the bucket is full anyway, which also keeps
+		// the multiplication from overflowing.
+		uint64_t refill_ms = min(elapsed_ms, limiter->refill_ms[kind]);
+		int64_t tokens = entry->tokens[kind] + (int64_t) (refill_ms * limit->per_second);
+		entry->tokens[kind] = min(tokens, get_burst_tokens(limit));
+	}
+}
+
+bool ppchat_rate_limiter_create(RateLimiter *limiter, const RateLimitOptions *options) {
+	memset(limiter, 0, sizeof(*limiter));
+
+	int capacity = (options->capacity > 0) ? options->capacity : PPCHAT_RATE_LIMIT_DEFAULT_CAPACITY;
+	uint32_t slots_count = PPCHAT_RATE_LIMIT_MAX_PROBES;
+	while (slots_count < (uint32_t) capacity)
+		slots_count *= 2;
+
+	limiter->entries = (RateLimitEntry *) calloc(slots_count, sizeof(RateLimitEntry));
+	if (!limiter->entries)
+		return false;
+
+	limiter->mask = slots_count - 1;
+	limiter->ipv6_prefix_bits = (options->ipv6_prefix_bits > 0) ? min(options->ipv6_prefix_bits, 128) : PPCHAT_RATE_LIMIT_DEFAULT_IPV6_PREFIX_BITS;
+	limiter->seed = ppchat_get_timestamp() * 0xFF51AFD7ED558CCDull;
+
+	for (int kind = 0; kind < RATE_LIMIT_KIND_COUNT; kind += 1) {
+		limiter->limits[kind] = options->limits[kind];
+
+		uint32_t per_second = limiter->limits[kind].per_second;
+		if (per_second > 0)
+			limiter->refill_ms[kind] = (uint64_t) (2 * get_burst_tokens(&limiter->limits[kind]) + per_second - 1) / per_second;
+	}
+
+	return true;
+}
+
+void ppchat_rate_limiter_destroy(RateLimiter *limiter) {
+	free(limiter->entries);
+	limiter->entries = NULL;
+}
+
+RateLimitEntry *ppchat_rate_limiter_get(RateLimiter *limiter, const sockaddr_in6 *address, uint64_t now_ms) {
+	uint8_t key[16];
+	make_key(limiter, address, key);
+
+	// Nothing is ever removed, only taken over, so an address is always within
+	// the probes of its slot and the first free slot means it isn't there.
+	uint32_t slot = (uint32_t) hash_key(limiter, key) & limiter->mask;
+	RateLimitEntry *victim = NULL;
+	for (int probe = 0; probe < PPCHAT_RATE_LIMIT_MAX_PROBES; probe += 1) {
+		RateLimitEntry *entry = &limiter->entries[(slot + probe) & limiter->mask];
+		if (!entry->used) {
+			victim = entry;
+			limiter->entries_count += 1;
+			break;
+		}
+
+		if (memcmp(entry->key, key, sizeof(key)) == 0) {
+			refill_entry(limiter, entry, now_ms);
+			return entry;
+		}
+
+		if (!victim || entry->last_seen_ms < victim->last_seen_ms)
+			victim = entry;
+	}
+
+	if (victim->used)
+		limiter->evicted_count += 1;
+
+	memset(victim, 0, sizeof(*victim));
+	memcpy(victim->key, key, sizeof(key));
+	victim->used = true;
+	victim->last_seen_ms = now_ms;
+	for (int kind = 0; kind < RATE_LIMIT_KIND_COUNT; kind += 1)
+		victim->tokens[kind] = get_burst_tokens(&limiter->limits[kind]);
+
+	return victim;
+}
+
+uint32_t ppchat_rate_limiter_take(RateLimiter *limiter, RateLimitEntry *entry, RateLimitKind kind, uint32_t amount) {
+	const RateLimit *limit = &limiter->limits[kind];
+	if (limit->per_second == 0)
+		return 0;
+
+	// Debt is capped, or a single burst could keep an address waiting for ages.
+	int64_t tokens = entry->tokens[kind] - (int64_t) amount * RATE_LIMIT_TOKEN_SCALE;
+	entry->tokens[kind] = max(tokens, -get_burst_tokens(limit));
+	if (entry->tokens[kind] >= 0)
+		return 0;
+
+	limiter->throttled_count += 1;
+	return (uint32_t) ((-entry->tokens[kind] + limit->per_second - 1) / limit->per_second);
+}
+
+const char *ppchat_rate_limit_kind_to_string(RateLimitKind kind) {
+	switch (kind) {
+		case RATE_LIMIT_KIND_CONNECTIONS: return "connections";
+		case RATE_LIMIT_KIND_MESSAGES:    return "messages";
+		case RATE_LIMIT_KIND_BYTES:       return "bytes";
+		default:                          return "unknown";
+	}
+}
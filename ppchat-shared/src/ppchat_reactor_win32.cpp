@@ -0,0 +1,1465 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_reactor.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+
+// Completion key of the packet `ppchat_reactor_stop` posts to wake the loop up.
+// Socket completions are always posted with key 0.
+static const ULONG_PTR REACTOR_STOP_KEY = 1;
+
+// Completion key of the packet RIO posts once its completion queue has entries.
+static const ULONG_PTR REACTOR_RIO_KEY = 2;
+
+// Completion key of the packet `ppchat_reactor_post` posts once there is mail.
+static const ULONG_PTR REACTOR_MAILBOX_KEY = 3;
+
+// Most mails handled per wake up, so that mail can't starve socket completions.
+static const int REACTOR_MAX_MAILS_PER_BATCH = 256;
+
+static char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
+
+static void connection_list_push(ConnectionList *list, Connection *connection) {
+	connection->previous = list->last;
+	connection->next = NULL;
+
+	if (list->last)
+		list->last->next = connection;
+	else
+		list->first = connection;
+
+	list->last = connection;
+}
+
+static void connection_list_remove(ConnectionList *list, Connection *connection) {
+	if (connection->previous)
+		connection->previous->next = connection->next;
+	else
+		list->first = connection->next;
+
+	if (connection->next)
+		connection->next->previous = connection->previous;
+	else
+		list->last = connection->previous;
+
+	connection->previous = NULL;
+	connection->next = NULL;
+}
+
+static void fire_connection_timer(Timer *timer, void *argument) {
+	Connection *connection = (Connection *) argument;
+	Reactor *reactor = connection->reactor;
+
+	if (connection->state == CONNECTION_STATE_OPEN && reactor->callbacks.on_timer)
+		reactor->callbacks.on_timer(connection, reactor->callbacks.user_data);
+}
+
+static Connection *create_connection(Reactor *reactor) {
+	Connection *connection = (Connection *) ppchat_object_pool_allocate(&reactor->connection_pool);
+	if (!connection)
+		return NULL;
+
+	memset(connection, 0, sizeof(*connection));
+	connection->socket.handle = INVALID_SOCKET;
+	connection->state = CONNECTION_STATE_ACCEPTING;
+	connection->reactor = reactor;
+	connection->rio_slot = -1;
+	ppchat_timer_init(&connection->timer, fire_connection_timer, connection);
+
+	connection->accept_operation.type = IO_OPERATION_ACCEPT;
+	connection->accept_operation.connection = connection;
+	connection->receive_operation.type = IO_OPERATION_RECEIVE;
+	connection->receive_operation.connection = connection;
+	connection->send_operation.type = IO_OPERATION_SEND;
+	connection->send_operation.connection = connection;
+
+	connection_list_push(&reactor->connections, connection);
+	return connection;
+}
+
+static void release_connection(Reactor *reactor, Connection *connection) {
+	assert(connection->state == CONNECTION_STATE_CLOSING);
+	assert(connection->pending_operations == 0);
+
+	connection_list_remove(&reactor->closing_connections, connection);
+
+	if (connection->rio_slot >= 0) {
+		// Receive buffer is a slice of the registered region, just give the slice back.
+		reactor->rio_free_slots[reactor->rio_free_slots_count] = connection->rio_slot;
+		reactor->rio_free_slots_count += 1;
+	} else {
+		ppchat_slab_free(connection->receive_buffer, connection->receive_buffer_size);
+	}
+
+	for (int i = 0; i < connection->send_queue_count; i += 1) {
+		int index = (connection->send_queue_first + i) % connection->send_queue_capacity;
+		ppchat_shared_buffer_release(connection->send_queue[index].buffer);
+	}
+
+	reactor->queued_bytes_count -= connection->send_queue_size;
+	if (connection->send_congested)
+		reactor->congested_connections_count -= 1;
+
+	ppchat_slab_free(connection->send_queue, connection->send_queue_capacity * (int) sizeof(OutboundSegment));
+	ppchat_object_pool_free(&reactor->connection_pool, connection);
+}
+
+// Releases closing connections that have no operations posted anymore.
+// Runs after every batch of completions so that callbacks never
+// see a connection freed from under them.
+static void release_closed_connections(Reactor *reactor) {
+	bool released_any;
+	do {
+		released_any = false;
+
+		Connection *connection = reactor->closing_connections.first;
+		while (connection) {
+			Connection *next = connection->next;
+
+			if (connection->pending_operations == 0) {
+				// `on_close` can close other connections, which appends them to the list,
+				// hence the outer loop.
+				if (connection->opened && reactor->callbacks.on_close)
+					reactor->callbacks.on_close(connection, connection->close_error, reactor->callbacks.user_data);
+
+				release_connection(reactor, connection);
+				released_any = true;
+			}
+
+			connection = next;
+		}
+	} while (released_any && reactor->closing_connections.first);
+}
+
+static int get_operation_error(Reactor *reactor, IoOperation *operation) {
+	// `Internal` holds the status code of the finished operation, zero is a success.
+	if (operation->overlapped.Internal == 0)
+		return 0;
+
+	// AcceptEx is posted on the listen socket, everything else on the connection socket.
+	Socket socket = (operation->type == IO_OPERATION_ACCEPT) ? reactor->listen_socket : operation->connection->socket;
+
+	DWORD bytes_transferred = 0;
+	DWORD flags = 0;
+	BOOL succeeded = WSAGetOverlappedResult(socket.handle, &operation->overlapped, &bytes_transferred, FALSE, &flags);
+	if (succeeded)
+		return 0;
+
+	int error = get_last_socket_error();
+	return (error != 0) ? error : WSA_OPERATION_ABORTED;
+}
+
+static bool associate_with_completion_port(Reactor *reactor, Socket socket, int *out_error) {
+	HANDLE completion_port = CreateIoCompletionPort(
+		/* File handle           */ (HANDLE) socket.handle,
+		/* Existing port         */ reactor->completion_port,
+		/* Completion key        */ 0,
+		/* Concurrent threads    */ 0 // Ignored when associating with an existing port.
+	);
+	if (completion_port != reactor->completion_port) {
+		if (out_error)
+			*out_error = GetLastError();
+
+		return false;
+	}
+
+	return true;
+}
+
+static OutboundSegment *get_queued_segment(Connection *connection, int index) {
+	assert(index < connection->send_queue_count);
+	return &connection->send_queue[(connection->send_queue_first + index) % connection->send_queue_capacity];
+}
+
+static RIO_BUF get_rio_buffer(Reactor *reactor, char *data, int size) {
+	RIO_BUF buffer;
+	buffer.BufferId = reactor->rio_buffer_id;
+	buffer.Offset = (ULONG) (data - reactor->rio_buffer);
+	buffer.Length = (ULONG) size;
+	return buffer;
+}
+
+static void defer_rio_commit(Reactor *reactor, Connection *connection) {
+	if (connection->rio_commit_pending)
+		return;
+
+	connection->rio_commit_pending = true;
+	connection->rio_next_commit = reactor->rio_commit_list;
+	reactor->rio_commit_list = connection;
+}
+
+// Hands requests deferred on this connection over to the kernel.
+static int commit_rio_requests_of(Reactor *reactor, Connection *connection) {
+	int error = 0;
+
+	if (connection->rio_receive_deferred) {
+		connection->rio_receive_deferred = false;
+		reactor->system_calls_count += 1;
+		if (!reactor->rio.RIOReceive(connection->rio_request_queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL))
+			error = get_last_socket_error();
+	}
+
+	if (connection->rio_send_deferred) {
+		connection->rio_send_deferred = false;
+		reactor->system_calls_count += 1;
+		if (!reactor->rio.RIOSend(connection->rio_request_queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL))
+			error = get_last_socket_error();
+	}
+
+	return error;
+}
+
+static void commit_rio_requests(Reactor *reactor) {
+	Connection *connection = reactor->rio_commit_list;
+	reactor->rio_commit_list = NULL;
+
+	while (connection) {
+		Connection *next = connection->rio_next_commit;
+		connection->rio_commit_pending = false;
+		connection->rio_next_commit = NULL;
+
+		// Closing connections have committed their requests in `ppchat_reactor_close`.
+		if (connection->state == CONNECTION_STATE_OPEN) {
+			int error = commit_rio_requests_of(reactor, connection);
+			if (error != 0)
+				ppchat_reactor_close(connection, error);
+		}
+
+		connection = next;
+	}
+}
+
+static bool post_rio_receive(Reactor *reactor, Connection *connection) {
+	RIO_BUF buffer = get_rio_buffer(reactor, connection->receive_buffer, connection->receive_buffer_size);
+	connection->receive_posted_size = connection->receive_buffer_size;
+
+	// Requests posted while a batch is handled are committed all at once after it.
+	DWORD flags = (reactor->dispatching) ? RIO_MSG_DEFER : 0;
+	BOOL posted = reactor->rio.RIOReceive(connection->rio_request_queue, &buffer, 1, flags, &connection->receive_operation);
+	if (!posted) {
+		ppchat_reactor_close(connection, get_last_socket_error());
+		return false;
+	}
+
+	if (flags & RIO_MSG_DEFER) {
+		connection->rio_receive_deferred = true;
+		defer_rio_commit(reactor, connection);
+	} else {
+		reactor->system_calls_count += 1;
+	}
+
+	connection->pending_operations += 1;
+	return true;
+}
+
+static bool post_rio_send(Reactor *reactor, Connection *connection) {
+	// RIO can only send from registered memory, so the bytes are staged
+	// in the send slice that follows the receive slice of this connection.
+	char *send_slice = reactor->rio_buffer + connection->rio_slot * reactor->rio_slot_size + PPCHAT_RECEIVE_BUFFER_SIZE;
+
+	int chunk_size = 0;
+	int segments_count = 0;
+	while (segments_count < connection->send_queue_count && chunk_size < PPCHAT_RIO_SEND_SLICE_SIZE) {
+		OutboundSegment *segment = get_queued_segment(connection, segments_count);
+		int copied_size = min(segment->size, PPCHAT_RIO_SEND_SLICE_SIZE - chunk_size);
+		memcpy(send_slice + chunk_size, segment->buffer->data + segment->offset, copied_size);
+
+		chunk_size += copied_size;
+		segments_count += 1;
+	}
+
+	reactor->bytes_copied_count += chunk_size;
+	connection->send_queue_in_flight = segments_count;
+
+	RIO_BUF buffer = get_rio_buffer(reactor, send_slice, chunk_size);
+
+	DWORD flags = (reactor->dispatching) ? RIO_MSG_DEFER : 0;
+	BOOL posted = reactor->rio.RIOSend(connection->rio_request_queue, &buffer, 1, flags, &connection->send_operation);
+	if (!posted) {
+		ppchat_reactor_close(connection, get_last_socket_error());
+		return false;
+	}
+
+	if (flags & RIO_MSG_DEFER) {
+		connection->rio_send_deferred = true;
+		defer_rio_commit(reactor, connection);
+	} else {
+		reactor->system_calls_count += 1;
+	}
+
+	connection->pending_operations += 1;
+	return true;
+}
+
+static bool post_receive(Connection *connection) {
+	Reactor *reactor = connection->reactor;
+	if (reactor->engine == REACTOR_ENGINE_RIO)
+		return post_rio_receive(reactor, connection);
+
+	WSABUF buffer = { };
+	if (connection->receive_target) {
+		buffer.buf = connection->receive_target;
+		buffer.len = (ULONG) connection->receive_target_size;
+		connection->receive_target = NULL;
+		connection->receive_target_size = 0;
+	} else if (reactor->release_idle_receive_buffers && !connection->receive_ready) {
+		// Nothing is known to be waiting. A zero byte receive completes once something
+		// arrives, the buffer goes back to the slab until then.
+		ppchat_slab_free(connection->receive_buffer, connection->receive_buffer_size);
+		connection->receive_buffer = NULL;
+	} else {
+		if (!connection->receive_buffer) {
+			connection->receive_buffer = (char *) ppchat_slab_allocate(connection->receive_buffer_size, NULL);
+			if (!connection->receive_buffer) {
+				log_error("Couldn't allocate receive buffer for connection '%s'.", connection->ip);
+				ppchat_reactor_close(connection, WSAENOBUFS);
+				return false;
+			}
+		}
+
+		buffer.buf = connection->receive_buffer;
+		buffer.len = (ULONG) connection->receive_buffer_size;
+	}
+
+	connection->receive_ready = false;
+	connection->received_into = buffer.buf;
+	connection->receive_posted_size = (int) buffer.len;
+
+	memset(&connection->receive_operation.overlapped, 0, sizeof(connection->receive_operation.overlapped));
+
+	DWORD flags = 0;
+	reactor->system_calls_count += 1;
+	int receive_result = WSARecv(
+		/* Socket                 */ connection->socket.handle,
+		/* Buffers                */ &buffer,
+		/* Buffers count          */ 1,
+		/* Bytes received         */ NULL, // Reported by the completion.
+		/* Flags                  */ &flags,
+		/* Overlapped             */ &connection->receive_operation.overlapped,
+		/* Completion routine     */ NULL
+	);
+	if (receive_result == SOCKET_ERROR) {
+		int error = get_last_socket_error();
+		if (error != WSA_IO_PENDING) {
+			ppchat_reactor_close(connection, error);
+			return false;
+		}
+	}
+
+	connection->pending_operations += 1;
+	return true;
+}
+
+static bool post_send(Connection *connection) {
+	Reactor *reactor = connection->reactor;
+	if (reactor->engine == REACTOR_ENGINE_RIO)
+		return post_rio_send(reactor, connection);
+
+	// Gather straight from the queued buffers, nothing is copied.
+	WSABUF buffers[PPCHAT_REACTOR_MAX_SEND_BUFFERS];
+	int buffers_count = min(connection->send_queue_count, PPCHAT_REACTOR_MAX_SEND_BUFFERS);
+	for (int i = 0; i < buffers_count; i += 1) {
+		OutboundSegment *segment = get_queued_segment(connection, i);
+		buffers[i].buf = segment->buffer->data + segment->offset;
+		buffers[i].len = (ULONG) segment->size;
+	}
+
+	connection->send_queue_in_flight = buffers_count;
+
+	memset(&connection->send_operation.overlapped, 0, sizeof(connection->send_operation.overlapped));
+
+	reactor->system_calls_count += 1;
+	int send_result = WSASend(
+		/* Socket                 */ connection->socket.handle,
+		/* Buffers                */ buffers,
+		/* Buffers count          */ (DWORD) buffers_count,
+		/* Bytes sent             */ NULL, // Reported by the completion.
+		/* Flags                  */ 0,
+		/* Overlapped             */ &connection->send_operation.overlapped,
+		/* Completion routine     */ NULL
+	);
+	if (send_result == SOCKET_ERROR) {
+		int error = get_last_socket_error();
+		if (error != WSA_IO_PENDING) {
+			ppchat_reactor_close(connection, error);
+			return false;
+		}
+	}
+
+	connection->pending_operations += 1;
+	return true;
+}
+
+static void continue_receiving(Connection *connection) {
+	if (connection->send_congested || connection->receive_throttled) {
+		// Picked up again once the peer has read enough of what it's been sent,
+		// or once it's not throttled anymore.
+		connection->receive_paused = true;
+		return;
+	}
+
+	post_receive(connection);
+}
+
+static void start_send(Connection *connection) {
+	assert(!connection->sending);
+	assert(connection->send_queue_count > 0);
+
+	connection->sending = true;
+	post_send(connection);
+}
+
+// Drops sent bytes from the front of the queue.
+static void consume_sent_bytes(Connection *connection, int bytes_sent) {
+	Reactor *reactor = connection->reactor;
+	connection->send_queue_size -= bytes_sent;
+	reactor->queued_bytes_count -= bytes_sent;
+
+	while (bytes_sent > 0) {
+		OutboundSegment *segment = get_queued_segment(connection, 0);
+		if (bytes_sent < segment->size) {
+			segment->offset += bytes_sent;
+			segment->size -= bytes_sent;
+			break;
+		}
+
+		bytes_sent -= segment->size;
+		ppchat_shared_buffer_release(segment->buffer);
+		segment->buffer = NULL;
+
+		connection->send_queue_first = (connection->send_queue_first + 1) % connection->send_queue_capacity;
+		connection->send_queue_count -= 1;
+	}
+
+	connection->send_queue_in_flight = 0;
+}
+
+static bool post_accept(Reactor *reactor, Connection *connection, int *out_error) {
+	// RIO requests can only be posted on sockets created with WSA_FLAG_REGISTERED_IO.
+	DWORD socket_flags = WSA_FLAG_OVERLAPPED;
+	if (reactor->engine == REACTOR_ENGINE_RIO)
+		socket_flags |= WSA_FLAG_REGISTERED_IO;
+
+	// Unlike `accept`, AcceptEx wants the socket for the future connection up front.
+	connection->socket.handle = WSASocketW(
+		/* Address family */ AF_INET6,
+		/* Socket type    */ SOCK_STREAM,
+		/* Protocol       */ IPPROTO_TCP,
+		/* Protocol info  */ NULL,
+		/* Socket group   */ NULL,
+		/* Flags          */ socket_flags
+	);
+	if (connection->socket.handle == INVALID_SOCKET) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		return false;
+	}
+
+	memset(&connection->accept_operation.overlapped, 0, sizeof(connection->accept_operation.overlapped));
+
+	DWORD bytes_received = 0;
+	reactor->system_calls_count += 1;
+	BOOL accepted = reactor->accept_ex(
+		/* Listen socket          */ reactor->listen_socket.handle,
+		/* Accept socket          */ connection->socket.handle,
+		/* Output buffer          */ connection->accept_buffer,
+		/* Receive data length    */ 0, // Complete as soon as the connection is established, don't wait for data.
+		/* Local address length   */ PPCHAT_ACCEPT_ADDRESS_SIZE,
+		/* Remote address length  */ PPCHAT_ACCEPT_ADDRESS_SIZE,
+		/* Bytes received         */ &bytes_received,
+		/* Overlapped             */ &connection->accept_operation.overlapped
+	);
+	if (!accepted) {
+		int error = get_last_socket_error();
+		if (error != WSA_IO_PENDING) {
+			if (out_error)
+				*out_error = error;
+
+			return false;
+		}
+	}
+
+	connection->pending_operations += 1;
+	return true;
+}
+
+static void post_new_accept(Reactor *reactor) {
+	Connection *connection = create_connection(reactor);
+	if (!connection) {
+		log_error("Couldn't allocate memory for a new connection.");
+		return;
+	}
+
+	int error = 0;
+	if (!post_accept(reactor, connection, &error)) {
+		log_error("Couldn't post accept operation. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+	}
+}
+
+static bool prepare_iocp_connection(Reactor *reactor, Connection *connection) {
+	int error = 0;
+	if (!associate_with_completion_port(reactor, connection->socket, &error)) {
+		log_error("Couldn't associate connection socket with completion port. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return false;
+	}
+
+	// Receive buffer is taken from the slab right before the first receive that needs it.
+	connection->receive_buffer_size = PPCHAT_RECEIVE_BUFFER_SIZE;
+	return true;
+}
+
+static bool prepare_rio_connection(Reactor *reactor, Connection *connection) {
+	if (reactor->rio_free_slots_count == 0) {
+		log_warning("Connection limit of %d reached, dropping new connection.", reactor->rio_slots_count);
+		ppchat_reactor_close(connection, WSAENOBUFS);
+		return false;
+	}
+
+	reactor->rio_free_slots_count -= 1;
+	connection->rio_slot = reactor->rio_free_slots[reactor->rio_free_slots_count];
+	connection->receive_buffer = reactor->rio_buffer + connection->rio_slot * reactor->rio_slot_size;
+	connection->receive_buffer_size = PPCHAT_RECEIVE_BUFFER_SIZE;
+
+	// At most one receive and one send are outstanding per connection,
+	// which is what the completion queue is sized for.
+	connection->rio_request_queue = reactor->rio.RIOCreateRequestQueue(
+		/* Socket                      */ connection->socket.handle,
+		/* Max outstanding receives    */ 1,
+		/* Max receive data buffers    */ 1,
+		/* Max outstanding sends       */ 1,
+		/* Max send data buffers       */ 1,
+		/* Receive completion queue    */ reactor->rio_completion_queue,
+		/* Send completion queue       */ reactor->rio_completion_queue,
+		/* Socket context              */ connection
+	);
+	if (connection->rio_request_queue == RIO_INVALID_RQ) {
+		int error = get_last_socket_error();
+		log_error("Couldn't create RIO request queue. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		ppchat_reactor_close(connection, error);
+		return false;
+	}
+
+	return true;
+}
+
+static void open_connection(Reactor *reactor, Connection *connection) {
+	bool prepared = (reactor->engine == REACTOR_ENGINE_RIO)
+		? prepare_rio_connection(reactor, connection)
+		: prepare_iocp_connection(reactor, connection);
+	if (!prepared)
+		return;
+
+	const void *address = &connection->address.sin6_addr;
+	if (connection->address.sin6_family == AF_INET)
+		address = &((sockaddr_in *) &connection->address)->sin_addr;
+
+	const char *ip_result = ppchat_inet_ntop(connection->address.sin6_family, address, connection->ip, sizeof(connection->ip));
+	if (ip_result != connection->ip)
+		strcpy(connection->ip, "unknown");
+
+	connection->state = CONNECTION_STATE_OPEN;
+	connection->opened = true;
+	connection->last_receive_timestamp = ppchat_get_timestamp();
+	reactor->open_connections_count += 1;
+	reactor->total_connections_count += 1;
+
+	if (reactor->callbacks.on_open) {
+		bool keep_open = reactor->callbacks.on_open(connection, reactor->callbacks.user_data);
+		if (!keep_open) {
+			ppchat_reactor_close(connection, 0);
+			return;
+		}
+	}
+
+	// `on_open` could've sent something that already failed and closed the connection.
+	if (connection->state == CONNECTION_STATE_OPEN)
+		continue_receiving(connection);
+}
+
+static Reactor *pick_accept_target(Reactor *reactor) {
+	if (reactor->accept_targets_count == 0)
+		return reactor;
+
+	Reactor *target = reactor->accept_targets[reactor->next_accept_target];
+	reactor->next_accept_target = (reactor->next_accept_target + 1) % reactor->accept_targets_count;
+	return target;
+}
+
+static void adopt_accepted_socket(Reactor *reactor, void *argument, uint64_t value) {
+	(void) argument;
+
+	Socket socket;
+	socket.handle = value;
+
+	if (reactor->stopped) {
+		ppchat_close_socket(&socket);
+		return;
+	}
+
+	// Closes the socket itself if the connection couldn't be opened.
+	int error = 0;
+	Connection *connection = ppchat_reactor_add_socket(reactor, socket, &error);
+	if (!connection)
+		log_error("Couldn't take over an accepted connection. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+}
+
+// Gives the accepted socket to another reactor, which opens the connection on its own
+// thread. The socket isn't associated with any completion port yet, so it's free to go.
+static bool hand_over_connection(Reactor *reactor, Connection *connection, Reactor *target) {
+	if (!ppchat_reactor_post(target, adopt_accepted_socket, NULL, connection->socket.handle)) {
+		// Target is swamped, better serve the connection here than drop it.
+		return false;
+	}
+
+	// The socket belongs to the target now, only release what is left here.
+	connection->socket.handle = INVALID_SOCKET;
+	ppchat_reactor_close(connection, 0);
+	reactor->handed_over_connections_count += 1;
+	return true;
+}
+
+static void handle_accept(Reactor *reactor, Connection *connection, int error) {
+	if (connection->state != CONNECTION_STATE_ACCEPTING)
+		return;
+
+	if (error != 0) {
+		// A failed accept (e.g. client reset the connection before we got to it)
+		// only consumes this accept socket, the listen socket is still fine.
+		ppchat_reactor_close(connection, error);
+		if (!reactor->stopped)
+			post_new_accept(reactor);
+
+		return;
+	}
+
+	// MSDN: "When the AcceptEx function returns, the socket sAcceptSocket is in the default state
+	// for a connected socket. The socket sAcceptSocket does not inherit the properties of the socket
+	// associated with sListenSocket parameter until SO_UPDATE_ACCEPT_CONTEXT is set on the socket."
+	SOCKET listen_handle = reactor->listen_socket.handle;
+	ppchat_set_socket_option(connection->socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (const char *) &listen_handle, sizeof(listen_handle));
+
+	sockaddr *local_address = NULL;
+	sockaddr *remote_address = NULL;
+	int local_address_size = 0;
+	int remote_address_size = 0;
+	reactor->get_accept_ex_sockaddrs(
+		/* Output buffer          */ connection->accept_buffer,
+		/* Receive data length    */ 0,
+		/* Local address length   */ PPCHAT_ACCEPT_ADDRESS_SIZE,
+		/* Remote address length  */ PPCHAT_ACCEPT_ADDRESS_SIZE,
+		/* Local address          */ &local_address,
+		/* Local address size     */ &local_address_size,
+		/* Remote address         */ &remote_address,
+		/* Remote address size    */ &remote_address_size
+	);
+	if (remote_address) {
+		size_t address_size = min((size_t) remote_address_size, sizeof(connection->address));
+		memcpy(&connection->address, remote_address, address_size);
+	}
+
+	// Keep the amount of posted accepts constant.
+	post_new_accept(reactor);
+
+	if (reactor->callbacks.on_accept && !reactor->callbacks.on_accept(&connection->address, reactor->callbacks.user_data)) {
+		reactor->refused_connections_count += 1;
+		ppchat_reactor_close(connection, WSAECONNREFUSED);
+		return;
+	}
+
+	Reactor *target = pick_accept_target(reactor);
+	if (target != reactor && hand_over_connection(reactor, connection, target))
+		return;
+
+	open_connection(reactor, connection);
+}
+
+static void handle_receive(Reactor *reactor, Connection *connection, int error, DWORD bytes_received) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return;
+
+	if (error != 0) {
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	if (bytes_received == 0) {
+		if (connection->receive_posted_size == 0) {
+			// Zero byte receive is done waiting: there are bytes to read, or the end of the stream.
+			connection->receive_ready = true;
+			continue_receiving(connection);
+			return;
+		}
+
+		// Connection was gracefully closed by remote peer.
+		ppchat_reactor_close(connection, 0);
+		return;
+	}
+
+	// RIO engine always receives into its slice of the registered region.
+	char *data = (reactor->engine == REACTOR_ENGINE_RIO) ? connection->receive_buffer : connection->received_into;
+
+	connection->last_receive_timestamp = reactor->dispatch_timestamp;
+
+	// A full buffer most likely left more bytes behind, read them right away.
+	bool filled_buffer = (int) bytes_received == connection->receive_posted_size;
+
+	if (reactor->callbacks.on_receive)
+		reactor->callbacks.on_receive(connection, data, (int) bytes_received, reactor->callbacks.user_data);
+
+	if (connection->state == CONNECTION_STATE_OPEN) {
+		connection->receive_ready = filled_buffer;
+		continue_receiving(connection);
+	}
+}
+
+static void handle_send(Reactor *reactor, Connection *connection, int error, DWORD bytes_sent) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return;
+
+	if (error != 0) {
+		ppchat_reactor_close(connection, error);
+		return;
+	}
+
+	consume_sent_bytes(connection, (int) bytes_sent);
+
+	if (connection->send_congested && connection->send_queue_size <= reactor->send_low_watermark) {
+		connection->send_congested = false;
+		reactor->congested_connections_count -= 1;
+
+		if (connection->receive_paused && !connection->receive_throttled) {
+			connection->receive_paused = false;
+			if (!post_receive(connection))
+				return;
+		}
+	}
+
+	// Whatever is left, be it the rest of a partial send or
+	// something queued in the meantime, goes out right away.
+	connection->sending = false;
+	if (connection->send_queue_count > 0)
+		start_send(connection);
+}
+
+static void handle_completion(Reactor *reactor, IoOperation *operation, int error, DWORD bytes_transferred) {
+	Connection *connection = operation->connection;
+	assert(connection->pending_operations > 0);
+	connection->pending_operations -= 1;
+
+	switch (operation->type) {
+		case IO_OPERATION_ACCEPT: {
+			handle_accept(reactor, connection, error);
+			break;
+		};
+		case IO_OPERATION_RECEIVE: {
+			handle_receive(reactor, connection, error, bytes_transferred);
+			break;
+		};
+		case IO_OPERATION_SEND: {
+			handle_send(reactor, connection, error, bytes_transferred);
+			break;
+		};
+	}
+}
+
+// Drains the RIO completion queue. No system calls are made until
+// the notification is re-armed at the end.
+static void dequeue_rio_completions(Reactor *reactor) {
+	RIORESULT results[PPCHAT_REACTOR_MAX_COMPLETIONS];
+
+	ULONG results_count;
+	do {
+		results_count = reactor->rio.RIODequeueCompletion(reactor->rio_completion_queue, results, PPCHAT_REACTOR_MAX_COMPLETIONS);
+		if (results_count == RIO_CORRUPT_CQ) {
+			log_error("RIO completion queue is corrupted.");
+			return;
+		}
+
+		for (ULONG i = 0; i < results_count; i += 1) {
+			RIORESULT *result = &results[i];
+			IoOperation *operation = (IoOperation *) (ULONG_PTR) result->RequestContext;
+			handle_completion(reactor, operation, (int) result->Status, result->BytesTransferred);
+		}
+	} while (results_count == (ULONG) PPCHAT_REACTOR_MAX_COMPLETIONS);
+
+	// Next completion will post a packet to the completion port again.
+	reactor->system_calls_count += 1;
+	reactor->rio.RIONotify(reactor->rio_completion_queue);
+}
+
+static void handle_mail(Reactor *reactor) {
+	// Clear the flag before draining: whatever is posted after this point either
+	// gets drained below or sees the flag cleared and wakes the reactor up again.
+	InterlockedExchange(&reactor->mailbox_signaled, 0);
+
+	ReactorMail mails[64];
+	int handled_count = 0;
+	while (handled_count < REACTOR_MAX_MAILS_PER_BATCH) {
+		int mails_count = ppchat_ring_dequeue_batch(&reactor->mailbox, mails, (int) (sizeof(mails) / sizeof(mails[0])));
+		if (mails_count == 0)
+			return;
+
+		for (int i = 0; i < mails_count; i += 1)
+			mails[i].handler(reactor, mails[i].argument, mails[i].value);
+
+		handled_count += mails_count;
+	}
+
+	// Left the rest for the next wake up.
+	if (InterlockedExchange(&reactor->mailbox_signaled, 1) == 0)
+		PostQueuedCompletionStatus(reactor->completion_port, 0, REACTOR_MAILBOX_KEY, NULL);
+}
+
+static void dispatch_completions(Reactor *reactor, OVERLAPPED_ENTRY *entries, ULONG entries_count) {
+	reactor->dispatching = true;
+	reactor->dispatch_timestamp = ppchat_get_timestamp();
+
+	// Before the completions, so that timers they set count from now.
+	ppchat_timer_wheel_advance(&reactor->timers, ppchat_timestamp_to_milliseconds(reactor->dispatch_timestamp));
+
+	for (ULONG i = 0; i < entries_count; i += 1) {
+		OVERLAPPED_ENTRY *entry = &entries[i];
+		if (entry->lpCompletionKey == REACTOR_STOP_KEY)
+			continue;
+
+		if (entry->lpCompletionKey == REACTOR_RIO_KEY) {
+			dequeue_rio_completions(reactor);
+			continue;
+		}
+
+		if (entry->lpCompletionKey == REACTOR_MAILBOX_KEY) {
+			handle_mail(reactor);
+			continue;
+		}
+
+		IoOperation *operation = (IoOperation *) entry->lpOverlapped;
+		int error = get_operation_error(reactor, operation);
+		handle_completion(reactor, operation, error, entry->dwNumberOfBytesTransferred);
+	}
+
+	// Still part of the batch, so that what it sends is committed along with the rest.
+	if (reactor->callbacks.on_round_end)
+		reactor->callbacks.on_round_end(reactor, reactor->callbacks.user_data);
+
+	reactor->dispatching = false;
+
+	commit_rio_requests(reactor);
+	release_closed_connections(reactor);
+
+	// `on_close` callbacks run outside of the batch, so whatever they sent was posted right away.
+	assert(reactor->rio_commit_list == NULL);
+}
+
+static bool create_rio_engine(Reactor *reactor, int max_connections, int *out_error) {
+	// RIO functions are Microsoft specific extensions and have to be retrieved
+	// at runtime through any socket created with WSA_FLAG_REGISTERED_IO.
+	Socket socket;
+	socket.handle = WSASocketW(AF_INET6, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
+	if (socket.handle == INVALID_SOCKET) {
+		*out_error = get_last_socket_error();
+		return false;
+	}
+
+	GUID rio_guid = WSAID_MULTIPLE_RIO;
+	DWORD bytes_returned = 0;
+	reactor->rio.cbSize = sizeof(reactor->rio);
+	int ioctl_result = WSAIoctl(
+		/* Socket              */ socket.handle,
+		/* Control code        */ SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER,
+		/* Input buffer        */ &rio_guid,
+		/* Input buffer size   */ sizeof(rio_guid),
+		/* Output buffer       */ &reactor->rio,
+		/* Output buffer size  */ sizeof(reactor->rio),
+		/* Bytes returned      */ &bytes_returned,
+		/* Overlapped          */ NULL,
+		/* Completion routine  */ NULL
+	);
+	if (ioctl_result == SOCKET_ERROR) {
+		*out_error = get_last_socket_error();
+		ppchat_close_socket(&socket);
+		return false;
+	}
+
+	ppchat_close_socket(&socket);
+
+	// One registered region for every buffer the reactor will ever touch,
+	// so the kernel pins and maps it once instead of on every request.
+	reactor->rio_slots_count = (max_connections > 0) ? max_connections : PPCHAT_RIO_DEFAULT_MAX_CONNECTIONS;
+	reactor->rio_slot_size = PPCHAT_RECEIVE_BUFFER_SIZE + PPCHAT_RIO_SEND_SLICE_SIZE;
+
+	size_t region_size = (size_t) reactor->rio_slots_count * reactor->rio_slot_size;
+	reactor->rio_buffer = (char *) VirtualAlloc(NULL, region_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	reactor->rio_free_slots = (int *) malloc(reactor->rio_slots_count * sizeof(int));
+	if (!reactor->rio_buffer || !reactor->rio_free_slots) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+
+	// Hand out low slots first.
+	for (int i = 0; i < reactor->rio_slots_count; i += 1)
+		reactor->rio_free_slots[i] = reactor->rio_slots_count - 1 - i;
+
+	reactor->rio_free_slots_count = reactor->rio_slots_count;
+
+	reactor->rio_buffer_id = reactor->rio.RIORegisterBuffer(reactor->rio_buffer, (DWORD) region_size);
+	if (reactor->rio_buffer_id == RIO_INVALID_BUFFERID) {
+		*out_error = get_last_socket_error();
+		return false;
+	}
+
+	RIO_NOTIFICATION_COMPLETION notification = { };
+	notification.Type = RIO_IOCP_COMPLETION;
+	notification.Iocp.IocpHandle = reactor->completion_port;
+	notification.Iocp.CompletionKey = (PVOID) REACTOR_RIO_KEY;
+	notification.Iocp.Overlapped = &reactor->rio_notify_overlapped;
+
+	// Every connection has at most one receive and one send outstanding.
+	reactor->rio_completion_queue = reactor->rio.RIOCreateCompletionQueue((DWORD) reactor->rio_slots_count * 2, &notification);
+	if (reactor->rio_completion_queue == RIO_INVALID_CQ) {
+		*out_error = get_last_socket_error();
+		return false;
+	}
+
+	reactor->rio.RIONotify(reactor->rio_completion_queue);
+	return true;
+}
+
+static void destroy_rio_engine(Reactor *reactor) {
+	if (reactor->rio_completion_queue != RIO_INVALID_CQ)
+		reactor->rio.RIOCloseCompletionQueue(reactor->rio_completion_queue);
+
+	if (reactor->rio_buffer_id != RIO_INVALID_BUFFERID && reactor->rio_buffer_id != NULL)
+		reactor->rio.RIODeregisterBuffer(reactor->rio_buffer_id);
+
+	if (reactor->rio_buffer)
+		VirtualFree(reactor->rio_buffer, 0, MEM_RELEASE);
+
+	free(reactor->rio_free_slots);
+
+	reactor->rio_completion_queue = RIO_INVALID_CQ;
+	reactor->rio_buffer_id = NULL;
+	reactor->rio_buffer = NULL;
+	reactor->rio_free_slots = NULL;
+}
+
+const char *ppchat_reactor_engine_name(ReactorEngine engine) {
+	switch (engine) {
+		case REACTOR_ENGINE_IOCP: return "iocp";
+		case REACTOR_ENGINE_RIO:  return "rio";
+	}
+
+	return "unknown";
+}
+
+bool ppchat_reactor_engine_from_name(const char *name, ReactorEngine *out_engine) {
+	if (strcmp(name, "iocp") == 0) {
+		*out_engine = REACTOR_ENGINE_IOCP;
+		return true;
+	}
+
+	if (strcmp(name, "rio") == 0) {
+		*out_engine = REACTOR_ENGINE_RIO;
+		return true;
+	}
+
+	return false;
+}
+
+bool ppchat_reactor_create(Reactor *reactor, ReactorOptions *options, ReactorCallbacks *callbacks, int *out_error) {
+	memset(reactor, 0, sizeof(*reactor));
+	reactor->listen_socket.handle = INVALID_SOCKET;
+
+	if (options)
+		reactor->engine = options->engine;
+
+	if (callbacks)
+		reactor->callbacks = *callbacks;
+
+	if (options)
+		reactor->release_idle_receive_buffers = options->release_idle_receive_buffers && reactor->engine == REACTOR_ENGINE_IOCP;
+
+	reactor->send_high_watermark = PPCHAT_REACTOR_DEFAULT_SEND_HIGH_WATERMARK;
+	reactor->send_low_watermark = PPCHAT_REACTOR_DEFAULT_SEND_LOW_WATERMARK;
+	if (options) {
+		if (options->send_high_watermark > 0)
+			reactor->send_high_watermark = options->send_high_watermark;
+
+		if (options->send_low_watermark > 0)
+			reactor->send_low_watermark = options->send_low_watermark;
+
+		reactor->send_low_watermark = min(reactor->send_low_watermark, reactor->send_high_watermark);
+		reactor->send_queue_limit = max(options->send_queue_limit, 0);
+		reactor->slow_consumer_policy = options->slow_consumer_policy;
+	}
+
+	if (options && options->accept_targets_count > 0) {
+		reactor->accept_targets = options->accept_targets;
+		reactor->accept_targets_count = options->accept_targets_count;
+	}
+
+	ppchat_object_pool_init(&reactor->connection_pool, sizeof(Connection), "connections");
+
+	int timer_tick_ms = (options && options->timer_tick_ms > 0) ? options->timer_tick_ms : PPCHAT_REACTOR_DEFAULT_TIMER_TICK_MS;
+	ppchat_timer_wheel_init(&reactor->timers, (uint32_t) timer_tick_ms, ppchat_timestamp_to_milliseconds(ppchat_get_timestamp()));
+
+	if (!ppchat_ring_create(&reactor->mailbox, RING_QUEUE_MODE_MPSC, PPCHAT_REACTOR_MAILBOX_CAPACITY, sizeof(ReactorMail))) {
+		if (out_error)
+			*out_error = ERROR_NOT_ENOUGH_MEMORY;
+
+		return false;
+	}
+
+	reactor->completion_port = CreateIoCompletionPort(
+		/* File handle           */ INVALID_HANDLE_VALUE,
+		/* Existing port         */ NULL,
+		/* Completion key        */ 0,
+		/* Concurrent threads    */ 1 // Only the reactor thread ever waits on the port.
+	);
+	if (!reactor->completion_port) {
+		if (out_error)
+			*out_error = GetLastError();
+
+		ppchat_ring_destroy(&reactor->mailbox);
+		return false;
+	}
+
+	if (reactor->engine == REACTOR_ENGINE_RIO) {
+		int error = 0;
+		int max_connections = (options) ? options->max_connections : 0;
+		if (!create_rio_engine(reactor, max_connections, &error)) {
+			if (out_error)
+				*out_error = error;
+
+			destroy_rio_engine(reactor);
+			CloseHandle(reactor->completion_port);
+			reactor->completion_port = NULL;
+			ppchat_ring_destroy(&reactor->mailbox);
+			return false;
+		}
+	}
+
+	if (out_error)
+		*out_error = 0;
+
+	return true;
+}
+
+bool ppchat_reactor_listen(Reactor *reactor, const char *port, int *out_error) {
+	int error = 0;
+	Socket listen_socket = ppchat_create_listen_socket(port, &error);
+	if (listen_socket.handle == INVALID_SOCKET) {
+		if (out_error)
+			*out_error = error;
+
+		return false;
+	}
+
+	// AcceptEx and GetAcceptExSockaddrs are Microsoft specific extensions
+	// and their pointers have to be retrieved at runtime.
+	GUID accept_ex_guid = WSAID_ACCEPTEX;
+	GUID get_accept_ex_sockaddrs_guid = WSAID_GETACCEPTEXSOCKADDRS;
+	DWORD bytes_returned = 0;
+
+	int accept_ex_result = WSAIoctl(
+		/* Socket              */ listen_socket.handle,
+		/* Control code        */ SIO_GET_EXTENSION_FUNCTION_POINTER,
+		/* Input buffer        */ &accept_ex_guid,
+		/* Input buffer size   */ sizeof(accept_ex_guid),
+		/* Output buffer       */ &reactor->accept_ex,
+		/* Output buffer size  */ sizeof(reactor->accept_ex),
+		/* Bytes returned      */ &bytes_returned,
+		/* Overlapped          */ NULL,
+		/* Completion routine  */ NULL
+	);
+	int get_accept_ex_sockaddrs_result = WSAIoctl(
+		/* Socket              */ listen_socket.handle,
+		/* Control code        */ SIO_GET_EXTENSION_FUNCTION_POINTER,
+		/* Input buffer        */ &get_accept_ex_sockaddrs_guid,
+		/* Input buffer size   */ sizeof(get_accept_ex_sockaddrs_guid),
+		/* Output buffer       */ &reactor->get_accept_ex_sockaddrs,
+		/* Output buffer size  */ sizeof(reactor->get_accept_ex_sockaddrs),
+		/* Bytes returned      */ &bytes_returned,
+		/* Overlapped          */ NULL,
+		/* Completion routine  */ NULL
+	);
+	if (accept_ex_result == SOCKET_ERROR || get_accept_ex_sockaddrs_result == SOCKET_ERROR) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		ppchat_close_socket(&listen_socket);
+		return false;
+	}
+
+	if (!associate_with_completion_port(reactor, listen_socket, &error)) {
+		if (out_error)
+			*out_error = error;
+
+		ppchat_close_socket(&listen_socket);
+		return false;
+	}
+
+	reactor->listen_socket = listen_socket;
+
+	for (int i = 0; i < PPCHAT_REACTOR_PENDING_ACCEPTS; i += 1)
+		post_new_accept(reactor);
+
+	if (out_error)
+		*out_error = 0;
+
+	return true;
+}
+
+Connection *ppchat_reactor_add_socket(Reactor *reactor, Socket socket, int *out_error) {
+	Connection *connection = create_connection(reactor);
+	if (!connection) {
+		// Connections that fail to open close their sockets, so callers never have to.
+		ppchat_close_socket(&socket);
+		if (out_error)
+			*out_error = ERROR_NOT_ENOUGH_MEMORY;
+
+		return NULL;
+	}
+
+	connection->socket = socket;
+
+	int address_size = sizeof(connection->address);
+	getpeername(socket.handle, (sockaddr *) &connection->address, &address_size);
+
+	open_connection(reactor, connection);
+	if (connection->state != CONNECTION_STATE_OPEN) {
+		if (out_error)
+			*out_error = connection->close_error;
+
+		return NULL;
+	}
+
+	if (out_error)
+		*out_error = 0;
+
+	return connection;
+}
+
+void ppchat_reactor_run(Reactor *reactor) {
+	OVERLAPPED_ENTRY entries[PPCHAT_REACTOR_MAX_COMPLETIONS];
+
+	while (!reactor->stopped) {
+		DWORD timeout = ppchat_timer_wheel_get_timeout(&reactor->timers, ppchat_timestamp_to_milliseconds(ppchat_get_timestamp()));
+
+		ULONG entries_count = 0;
+		reactor->system_calls_count += 1;
+		BOOL dequeued = GetQueuedCompletionStatusEx(
+			/* Completion port  */ reactor->completion_port,
+			/* Entries          */ entries,
+			/* Entries count    */ PPCHAT_REACTOR_MAX_COMPLETIONS,
+			/* Entries removed  */ &entries_count,
+			/* Timeout          */ timeout,
+			/* Alertable        */ FALSE
+		);
+		if (!dequeued) {
+			int error = GetLastError();
+			if (error == WAIT_TIMEOUT) {
+				// Only timers are due.
+				dispatch_completions(reactor, entries, 0);
+				continue;
+			}
+
+			log_error("Couldn't dequeue completion status. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+			break;
+		}
+
+		dispatch_completions(reactor, entries, entries_count);
+	}
+}
+
+void ppchat_reactor_stop(Reactor *reactor) {
+	reactor->stopped = true;
+	PostQueuedCompletionStatus(reactor->completion_port, 0, REACTOR_STOP_KEY, NULL);
+}
+
+bool ppchat_reactor_post(Reactor *reactor, ReactorMailHandler handler, void *argument, uint64_t value) {
+	ReactorMail mail;
+	mail.handler = handler;
+	mail.argument = argument;
+	mail.value = value;
+	if (!ppchat_ring_enqueue(&reactor->mailbox, &mail))
+		return false;
+
+	if (InterlockedExchange(&reactor->mailbox_signaled, 1) == 0)
+		PostQueuedCompletionStatus(reactor->completion_port, 0, REACTOR_MAILBOX_KEY, NULL);
+
+	return true;
+}
+
+// Refuses sends that would take the queue over the limit, see SlowConsumerPolicy.
+static bool admit_outbound_bytes(Connection *connection, int size) {
+	Reactor *reactor = connection->reactor;
+	if (reactor->send_queue_limit == 0 || connection->send_queue_size + size <= reactor->send_queue_limit)
+		return true;
+
+	if (reactor->slow_consumer_policy == SLOW_CONSUMER_POLICY_DISCONNECT) {
+		log_warning("Connection '%s' has %d bytes queued and doesn't keep up, disconnecting it.", connection->ip, connection->send_queue_size);
+		reactor->slow_consumers_disconnected_count += 1;
+		ppchat_reactor_close(connection, WSAENOBUFS);
+		return false;
+	}
+
+	connection->dropped_frames_count += 1;
+	reactor->dropped_frames_count += 1;
+	reactor->dropped_bytes_count += size;
+	return false;
+}
+
+static void account_queued_bytes(Connection *connection, int size) {
+	Reactor *reactor = connection->reactor;
+	connection->send_queue_size += size;
+	reactor->queued_bytes_count += size;
+	reactor->max_send_queue_size = max(reactor->max_send_queue_size, (uint64_t) connection->send_queue_size);
+
+	if (!connection->send_congested && connection->send_queue_size > reactor->send_high_watermark) {
+		connection->send_congested = true;
+		reactor->congested_connections_count += 1;
+	}
+}
+
+static bool push_segment(Connection *connection, OutboundSegment *segment) {
+	if (connection->send_queue_count == connection->send_queue_capacity) {
+		int new_capacity = max(connection->send_queue_capacity * 2, PPCHAT_REACTOR_MAX_SEND_BUFFERS);
+		OutboundSegment *new_queue = (OutboundSegment *) ppchat_slab_allocate(new_capacity * (int) sizeof(*new_queue), NULL);
+		if (!new_queue)
+			return false;
+
+		// Unwrap the ring while moving it.
+		for (int i = 0; i < connection->send_queue_count; i += 1)
+			new_queue[i] = *get_queued_segment(connection, i);
+
+		ppchat_slab_free(connection->send_queue, connection->send_queue_capacity * (int) sizeof(OutboundSegment));
+		connection->send_queue = new_queue;
+		connection->send_queue_capacity = new_capacity;
+		connection->send_queue_first = 0;
+	}
+
+	int index = (connection->send_queue_first + connection->send_queue_count) % connection->send_queue_capacity;
+	connection->send_queue[index] = *segment;
+	connection->send_queue_count += 1;
+	return true;
+}
+
+// Makes room for `size` more bytes at the end of the queue and returns where they go.
+// Small sends are collected in one reactor owned buffer as long as it isn't being sent,
+// so they leave together with a single send.
+static char *reserve_outbound_bytes(Connection *connection, int size) {
+	if (!admit_outbound_bytes(connection, size))
+		return NULL;
+
+	if (connection->send_queue_count > connection->send_queue_in_flight) {
+		OutboundSegment *last = get_queued_segment(connection, connection->send_queue_count - 1);
+		SharedBuffer *buffer = last->buffer;
+		if (last->appendable && buffer->capacity - buffer->size >= size) {
+			char *destination = buffer->data + buffer->size;
+			buffer->size += size;
+			last->size += size;
+			account_queued_bytes(connection, size);
+			return destination;
+		}
+	}
+
+	// Sized to fill a slab block of the receive buffer size, header included.
+	int capacity = max(size, PPCHAT_RECEIVE_BUFFER_SIZE - (int) offsetof(SharedBuffer, data));
+	SharedBuffer *buffer = ppchat_shared_buffer_create(capacity);
+	if (!buffer) {
+		log_error("Couldn't allocate %d bytes of send buffer for connection '%s'.", capacity, connection->ip);
+		ppchat_reactor_close(connection, WSAENOBUFS);
+		return NULL;
+	}
+
+	buffer->size = size;
+
+	OutboundSegment segment = { };
+	segment.buffer = buffer;
+	segment.size = size;
+	segment.appendable = true;
+	if (!push_segment(connection, &segment)) {
+		ppchat_shared_buffer_release(buffer);
+		log_error("Couldn't grow send queue of connection '%s'.", connection->ip);
+		ppchat_reactor_close(connection, WSAENOBUFS);
+		return NULL;
+	}
+
+	account_queued_bytes(connection, size);
+	return buffer->data;
+}
+
+bool ppchat_reactor_receive_into(Connection *connection, char *buffer, int size) {
+	if (connection->reactor->engine == REACTOR_ENGINE_RIO || size <= 0)
+		return false;
+
+	connection->receive_target = buffer;
+	connection->receive_target_size = size;
+	return true;
+}
+
+void ppchat_reactor_throttle_receive(Connection *connection, bool throttled) {
+	connection->receive_throttled = throttled;
+	if (throttled || connection->state != CONNECTION_STATE_OPEN)
+		return;
+
+	if (connection->receive_paused && !connection->send_congested) {
+		connection->receive_paused = false;
+		post_receive(connection);
+	}
+}
+
+bool ppchat_reactor_send(Connection *connection, const char *data, int size) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return false;
+
+	if (size <= 0)
+		return true;
+
+	char *destination = reserve_outbound_bytes(connection, size);
+	if (!destination)
+		return false;
+
+	memcpy(destination, data, size);
+	connection->reactor->bytes_copied_count += size;
+
+	if (!connection->sending)
+		start_send(connection);
+
+	return true;
+}
+
+bool ppchat_reactor_send_frame(Connection *connection, uint16_t type, uint16_t flags, const char *payload, int payload_size) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return false;
+
+	// Header and payload go into the queue back to back, so they leave with one send.
+	char *destination = reserve_outbound_bytes(connection, PPCHAT_FRAME_HEADER_SIZE + payload_size);
+	if (!destination)
+		return false;
+
+	ppchat_encode_frame_header(destination, type, flags, (uint32_t) payload_size);
+	if (payload_size > 0)
+		memcpy(destination + PPCHAT_FRAME_HEADER_SIZE, payload, payload_size);
+
+	connection->reactor->bytes_copied_count += PPCHAT_FRAME_HEADER_SIZE + payload_size;
+
+	if (!connection->sending)
+		start_send(connection);
+
+	return true;
+}
+
+bool ppchat_reactor_send_shared(Connection *connection, SharedBuffer *buffer) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return false;
+
+	if (buffer->size <= 0)
+		return true;
+
+	if (!admit_outbound_bytes(connection, buffer->size))
+		return false;
+
+	OutboundSegment segment = { };
+	segment.buffer = buffer;
+	segment.size = buffer->size;
+	if (!push_segment(connection, &segment)) {
+		log_error("Couldn't grow send queue of connection '%s'.", connection->ip);
+		ppchat_reactor_close(connection, WSAENOBUFS);
+		return false;
+	}
+
+	ppchat_shared_buffer_retain(buffer);
+	account_queued_bytes(connection, buffer->size);
+
+	if (!connection->sending)
+		start_send(connection);
+
+	return true;
+}
+
+void ppchat_reactor_set_timer(Connection *connection, uint32_t delay_ms) {
+	if (connection->state != CONNECTION_STATE_OPEN)
+		return;
+
+	ppchat_timer_arm(&connection->reactor->timers, &connection->timer, delay_ms);
+}
+
+void ppchat_reactor_cancel_timer(Connection *connection) {
+	ppchat_timer_cancel(&connection->reactor->timers, &connection->timer);
+}
+
+void ppchat_reactor_close(Connection *connection, int error) {
+	if (connection->state == CONNECTION_STATE_CLOSING)
+		return;
+
+	Reactor *reactor = connection->reactor;
+	if (connection->state == CONNECTION_STATE_OPEN)
+		reactor->open_connections_count -= 1;
+
+	connection->state = CONNECTION_STATE_CLOSING;
+	connection->close_error = error;
+
+	ppchat_timer_cancel(&reactor->timers, &connection->timer);
+
+	// Deferred requests have to reach the kernel before the socket is closed,
+	// otherwise they would never complete and the connection would never be released.
+	if (connection->rio_receive_deferred || connection->rio_send_deferred)
+		commit_rio_requests_of(reactor, connection);
+
+	// Closing the socket cancels everything that is still posted on it,
+	// cancelled operations complete with WSA_OPERATION_ABORTED.
+	if (connection->socket.handle != INVALID_SOCKET)
+		ppchat_close_socket(&connection->socket);
+
+	connection_list_remove(&reactor->connections, connection);
+	connection_list_push(&reactor->closing_connections, connection);
+}
+
+void ppchat_reactor_destroy(Reactor *reactor) {
+	reactor->stopped = true;
+
+	if (reactor->listen_socket.handle != INVALID_SOCKET)
+		ppchat_close_socket(&reactor->listen_socket);
+
+	while (reactor->connections.first)
+		ppchat_reactor_close(reactor->connections.first, 0);
+
+	release_closed_connections(reactor);
+
+	// Handlers see the reactor stopped and only release what their mail carries.
+	ReactorMail mail;
+	while (ppchat_ring_dequeue(&reactor->mailbox, &mail))
+		mail.handler(reactor, mail.argument, mail.value);
+
+	// Wait for the cancelled operations, they still point into connection memory.
+	const DWORD drain_timeout_ms = 5000;
+	OVERLAPPED_ENTRY entries[PPCHAT_REACTOR_MAX_COMPLETIONS];
+	while (reactor->closing_connections.first) {
+		ULONG entries_count = 0;
+		BOOL dequeued = GetQueuedCompletionStatusEx(reactor->completion_port, entries, PPCHAT_REACTOR_MAX_COMPLETIONS, &entries_count, drain_timeout_ms, FALSE);
+		if (!dequeued) {
+			log_warning("Timed out waiting for cancelled socket operations, leaking remaining connections.");
+			break;
+		}
+
+		dispatch_completions(reactor, entries, entries_count);
+	}
+
+	if (reactor->engine == REACTOR_ENGINE_RIO)
+		destroy_rio_engine(reactor);
+
+	// Leaked connections can still be written to by the kernel, so is their pool.
+	if (!reactor->closing_connections.first)
+		ppchat_object_pool_destroy(&reactor->connection_pool);
+
+	ppchat_ring_destroy(&reactor->mailbox);
+
+	CloseHandle(reactor->completion_port);
+	reactor->completion_port = NULL;
+}
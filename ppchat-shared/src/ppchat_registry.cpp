@@ -0,0 +1,211 @@
+#include "../include/ppchat_registry.h"
+
+// Entries and slots the arrays get memory for at a time.
+static const int REGISTRY_COMMIT_ENTRIES = 4096;
+
+static const size_t REGISTRY_PAGE_SIZE = 4096;
+
+static const uint64_t REGISTRY_SLOT_MASK = PPCHAT_REGISTRY_MAX_ENTRIES - 1;
+
+// Every array gets a range of the reservation to itself, all of them in the order below.
+static const size_t REGISTRY_ELEMENT_SIZES[] = {
+	sizeof(ConnectionHandle),
+	sizeof(Socket),
+	sizeof(uint8_t),
+	sizeof(uint32_t),
+	sizeof(uint64_t),
+	sizeof(sockaddr_in6),
+	sizeof(void *),
+	sizeof(uint32_t),
+	sizeof(uint32_t),
+};
+
+static const int REGISTRY_ARRAYS_COUNT = (int) (sizeof(REGISTRY_ELEMENT_SIZES) / sizeof(REGISTRY_ELEMENT_SIZES[0]));
+
+static size_t get_array_range_size(int max_entries, int array) {
+	size_t size = (size_t) max_entries * REGISTRY_ELEMENT_SIZES[array];
+	return (size + REGISTRY_PAGE_SIZE - 1) / REGISTRY_PAGE_SIZE * REGISTRY_PAGE_SIZE;
+}
+
+static void **get_array_pointer(ConnectionRegistry *registry, int array) {
+	void **pointers[] = {
+		(void **) &registry->handles,
+		(void **) &registry->sockets,
+		(void **) &registry->states,
+		(void **) &registry->queue_sizes,
+		(void **) &registry->last_activity_ms,
+		(void **) &registry->addresses,
+		(void **) &registry->objects,
+		(void **) &registry->generations,
+		(void **) &registry->slot_entries,
+	};
+
+	return pointers[array];
+}
+
+// Commits memory for another REGISTRY_COMMIT_ENTRIES entries and slots in every array.
+static bool grow(ConnectionRegistry *registry) {
+	if (registry->committed_count >= registry->max_entries)
+		return false;
+
+	int new_count = min(registry->committed_count + REGISTRY_COMMIT_ENTRIES, registry->max_entries);
+	for (int array = 0; array < REGISTRY_ARRAYS_COUNT; array += 1) {
+		char *base = (char *) *get_array_pointer(registry, array);
+		size_t size = (size_t) new_count * REGISTRY_ELEMENT_SIZES[array];
+
+		// Pages that are committed already stay as they are.
+		if (!VirtualAlloc(base, size, MEM_COMMIT, PAGE_READWRITE))
+			return false;
+	}
+
+	registry->committed_count = new_count;
+	return true;
+}
+
+bool ppchat_connection_registry_create(ConnectionRegistry *registry, int max_entries, uint8_t tag, int *out_error) {
+	memset(registry, 0, sizeof(*registry));
+
+	registry->max_entries = (max_entries > 0) ? min(max_entries, PPCHAT_REGISTRY_MAX_ENTRIES) : PPCHAT_REGISTRY_DEFAULT_MAX_ENTRIES;
+	registry->tag = tag;
+	registry->first_free_slot = -1;
+
+	size_t reserved_size = 0;
+	for (int array = 0; array < REGISTRY_ARRAYS_COUNT; array += 1)
+		reserved_size += get_array_range_size(registry->max_entries, array);
+
+	registry->memory = (char *) VirtualAlloc(NULL, reserved_size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!registry->memory) {
+		if (out_error)
+			*out_error = GetLastError();
+
+		return false;
+	}
+
+	char *range = registry->memory;
+	for (int array = 0; array < REGISTRY_ARRAYS_COUNT; array += 1) {
+		*get_array_pointer(registry, array) = range;
+		range += get_array_range_size(registry->max_entries, array);
+	}
+
+	return true;
+}
+
+void ppchat_connection_registry_destroy(ConnectionRegistry *registry) {
+	if (registry->memory)
+		VirtualFree(registry->memory, 0, MEM_RELEASE);
+
+	memset(registry, 0, sizeof(*registry));
+	registry->first_free_slot = -1;
+}
+
+ConnectionHandle ppchat_connection_registry_add(ConnectionRegistry *registry, void *object, Socket socket, const sockaddr_in6 *address, uint64_t now_ms) {
+	int slot = registry->first_free_slot;
+	if (slot < 0) {
+		if (registry->slots_count == registry->committed_count && !grow(registry))
+			return PPCHAT_INVALID_CONNECTION_HANDLE;
+
+		slot = registry->slots_count;
+		registry->slots_count += 1;
+		registry->generations[slot] = 0;
+	} else {
+		registry->first_free_slot = (int) registry->slot_entries[slot] - 1;
+	}
+
+	// Odd from now on, which also keeps handles from ever being zero.
+	registry->generations[slot] += 1;
+
+	int entry = registry->count;
+	registry->count += 1;
+	registry->slot_entries[slot] = (uint32_t) entry;
+
+	ConnectionHandle handle = ((ConnectionHandle) registry->generations[slot] << 32) | ((ConnectionHandle) registry->tag << PPCHAT_REGISTRY_SLOT_BITS) | (ConnectionHandle) slot;
+	registry->handles[entry] = handle;
+	registry->sockets[entry] = socket;
+	registry->states[entry] = 0;
+	registry->queue_sizes[entry] = 0;
+	registry->last_activity_ms[entry] = now_ms;
+	registry->addresses[entry] = *address;
+	registry->objects[entry] = object;
+
+	registry->added_count += 1;
+	return handle;
+}
+
+// Slot of the handle if it's in use by the connection the handle was made for, -1 otherwise.
+static int resolve(ConnectionRegistry *registry, ConnectionHandle handle) {
+	if (ppchat_connection_handle_tag(handle) != registry->tag)
+		return -1;
+
+	uint64_t slot = handle & REGISTRY_SLOT_MASK;
+	if (slot >= (uint64_t) registry->slots_count)
+		return -1;
+
+	uint32_t generation = (uint32_t) (handle >> 32);
+	if (registry->generations[slot] != generation || (generation & 1) == 0) {
+		registry->stale_lookups_count += 1;
+		return -1;
+	}
+
+	return (int) slot;
+}
+
+bool ppchat_connection_registry_remove(ConnectionRegistry *registry, ConnectionHandle handle) {
+	int slot = resolve(registry, handle);
+	if (slot < 0)
+		return false;
+
+	// Last entry takes the place of the removed one, so entries stay packed.
+	int entry = (int) registry->slot_entries[slot];
+	int last_entry = registry->count - 1;
+	if (entry != last_entry) {
+		registry->handles[entry] = registry->handles[last_entry];
+		registry->sockets[entry] = registry->sockets[last_entry];
+		registry->states[entry] = registry->states[last_entry];
+		registry->queue_sizes[entry] = registry->queue_sizes[last_entry];
+		registry->last_activity_ms[entry] = registry->last_activity_ms[last_entry];
+		registry->addresses[entry] = registry->addresses[last_entry];
+		registry->objects[entry] = registry->objects[last_entry];
+		registry->slot_entries[registry->handles[entry] & REGISTRY_SLOT_MASK] = (uint32_t) entry;
+	}
+
+	registry->count -= 1;
+
+	// Even from now on, so that no handle resolves to the slot until it's handed out again.
+	// Free slots keep the next free one plus one, so that zero can end the list.
+	registry->generations[slot] += 1;
+	registry->slot_entries[slot] = (uint32_t) (registry->first_free_slot + 1);
+	registry->first_free_slot = slot;
+
+	registry->removed_count += 1;
+	return true;
+}
+
+int ppchat_connection_registry_find(ConnectionRegistry *registry, ConnectionHandle handle) {
+	int slot = resolve(registry, handle);
+	return (slot >= 0) ? (int) registry->slot_entries[slot] : -1;
+}
+
+void *ppchat_connection_registry_get(ConnectionRegistry *registry, ConnectionHandle handle) {
+	int entry = ppchat_connection_registry_find(registry, handle);
+	return (entry >= 0) ? registry->objects[entry] : NULL;
+}
+
+void *ppchat_connection_registry_get_slot(ConnectionRegistry *registry, uint32_t slot) {
+	if (slot >= (uint32_t) registry->slots_count || (registry->generations[slot] & 1) == 0)
+		return NULL;
+
+	return registry->objects[registry->slot_entries[slot]];
+}
+
+const char *ppchat_connection_registry_format_address(ConnectionRegistry *registry, int entry, char *out_buffer, size_t out_buffer_size) {
+	const sockaddr_in6 *address = &registry->addresses[entry];
+
+	const void *ip_address = &address->sin6_addr;
+	if (address->sin6_family == AF_INET)
+		ip_address = &((const sockaddr_in *) address)->sin_addr;
+
+	if (ppchat_inet_ntop(address->sin6_family, ip_address, out_buffer, out_buffer_size) != out_buffer)
+		snprintf(out_buffer, out_buffer_size, "unknown");
+
+	return out_buffer;
+}
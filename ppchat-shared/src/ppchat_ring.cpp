@@ -0,0 +1,209 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_ring.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+// WaitOnAddress and WakeByAddressSingle live there.
+#pragma comment (lib, "Synchronization.lib")
+
+// MPSC slot layout: sequence number followed by the item.
+//
+// Sequence of slot `i` tells whose turn it is:
+//     == position          - free, producer that claims `position` can write it;
+//     == position + 1      - holds the item of `position`, consumer can read it;
+//     == position + capacity - consumed, free for the next lap.
+static volatile LONG64 *get_slot_sequence(RingQueue *ring, LONG64 position) {
+	return (volatile LONG64 *) (ring->slots + (position & ring->mask) * ring->slot_size);
+}
+
+static char *get_slot_item(RingQueue *ring, LONG64 position) {
+	char *slot = ring->slots + (position & ring->mask) * ring->slot_size;
+	return (ring->mode == RING_QUEUE_MODE_MPSC) ? slot + sizeof(LONG64) : slot;
+}
+
+static void notify_consumer(RingQueue *ring) {
+	// The item has to be published before we look at the flag. Pairs with
+	// the full barrier of InterlockedExchange in `ppchat_ring_wait`, so either
+	// we see the consumer waiting or the consumer sees the item.
+	MemoryBarrier();
+	if (ReadNoFence(&ring->consumer_waiting)) {
+		InterlockedIncrement(&ring->wake_sequence);
+		WakeByAddressSingle((PVOID) &ring->wake_sequence);
+	}
+}
+
+bool ppchat_ring_create(RingQueue *ring, RingQueueMode mode, uint32_t capacity, uint32_t item_size) {
+	memset(ring, 0, sizeof(*ring));
+
+	// MPSC slot sequences tell "holds the item of p" (p + 1) from "free for p + 1" only
+	// with two slots or more.
+	uint32_t rounded_capacity = 2;
+	while (rounded_capacity < capacity)
+		rounded_capacity <<= 1;
+
+	ring->mode = mode;
+	ring->capacity = rounded_capacity;
+	ring->mask = rounded_capacity - 1;
+	ring->item_size = item_size;
+
+	// Keep sequence numbers 8 byte aligned.
+	uint32_t slot_size = item_size;
+	if (mode == RING_QUEUE_MODE_MPSC)
+		slot_size = (uint32_t) (sizeof(LONG64) + ((item_size + 7) & ~7u));
+
+	ring->slot_size = slot_size;
+	ring->slots = (char *) _aligned_malloc((size_t) rounded_capacity * slot_size, PPCHAT_CACHE_LINE_SIZE);
+	if (!ring->slots)
+		return false;
+
+	if (mode == RING_QUEUE_MODE_MPSC) {
+		for (uint32_t i = 0; i < rounded_capacity; i += 1)
+			*get_slot_sequence(ring, i) = i;
+	}
+
+	return true;
+}
+
+void ppchat_ring_destroy(RingQueue *ring) {
+	_aligned_free(ring->slots);
+	memset(ring, 0, sizeof(*ring));
+}
+
+void *ppchat_ring_begin_enqueue(RingQueue *ring) {
+	assert(ring->mode == RING_QUEUE_MODE_SPSC);
+
+	// Only this thread writes `tail`, no need for ordering on our own read.
+	LONG64 tail = ring->tail;
+	if (tail - ring->cached_head >= (LONG64) ring->capacity) {
+		// Looks full, but the consumer may have moved on since we last checked.
+		ring->cached_head = ReadAcquire64(&ring->head);
+		if (tail - ring->cached_head >= (LONG64) ring->capacity)
+			return NULL;
+	}
+
+	return get_slot_item(ring, tail);
+}
+
+void ppchat_ring_end_enqueue(RingQueue *ring) {
+	WriteRelease64(&ring->tail, ring->tail + 1);
+	notify_consumer(ring);
+}
+
+static bool enqueue_spsc(RingQueue *ring, const void *item) {
+	void *slot = ppchat_ring_begin_enqueue(ring);
+	if (!slot)
+		return false;
+
+	memcpy(slot, item, ring->item_size);
+	WriteRelease64(&ring->tail, ring->tail + 1);
+	return true;
+}
+
+static bool enqueue_mpsc(RingQueue *ring, const void *item) {
+	LONG64 position = ReadNoFence64(&ring->tail);
+	for (;;) {
+		LONG64 sequence = ReadAcquire64(get_slot_sequence(ring, position));
+		LONG64 difference = sequence - position;
+
+		if (difference == 0) {
+			LONG64 observed = InterlockedCompareExchange64(&ring->tail, position + 1, position);
+			if (observed == position)
+				break;
+
+			// Another producer took it, retry with the position it left.
+			position = observed;
+		} else if (difference < 0) {
+			// Slot still holds an item from the previous lap.
+			return false;
+		} else {
+			position = ReadNoFence64(&ring->tail);
+		}
+	}
+
+	memcpy(get_slot_item(ring, position), item, ring->item_size);
+	WriteRelease64(get_slot_sequence(ring, position), position + 1);
+	return true;
+}
+
+bool ppchat_ring_enqueue(RingQueue *ring, const void *item) {
+	bool enqueued = (ring->mode == RING_QUEUE_MODE_MPSC) ? enqueue_mpsc(ring, item) : enqueue_spsc(ring, item);
+	if (enqueued)
+		notify_consumer(ring);
+
+	return enqueued;
+}
+
+bool ppchat_ring_dequeue(RingQueue *ring, void *out_item) {
+	return ppchat_ring_dequeue_batch(ring, out_item, 1) == 1;
+}
+
+int ppchat_ring_dequeue_batch(RingQueue *ring, void *out_items, int max_items) {
+	char *destination = (char *) out_items;
+	LONG64 head = ring->head;
+
+	if (ring->mode == RING_QUEUE_MODE_SPSC) {
+		if (head + max_items > ring->cached_tail)
+			ring->cached_tail = ReadAcquire64(&ring->tail);
+
+		int items_count = (int) min((LONG64) max_items, ring->cached_tail - head);
+		for (int i = 0; i < items_count; i += 1) {
+			memcpy(destination, get_slot_item(ring, head + i), ring->item_size);
+			destination += ring->item_size;
+		}
+
+		// One release store hands the whole batch of slots back to the producer.
+		if (items_count > 0)
+			WriteRelease64(&ring->head, head + items_count);
+
+		return items_count;
+	}
+
+	int items_count = 0;
+	while (items_count < max_items) {
+		volatile LONG64 *sequence = get_slot_sequence(ring, head);
+		if (ReadAcquire64(sequence) != head + 1)
+			break;
+
+		memcpy(destination, get_slot_item(ring, head), ring->item_size);
+		destination += ring->item_size;
+
+		WriteRelease64(sequence, head + ring->capacity);
+		head += 1;
+		items_count += 1;
+	}
+
+	// Only the consumer reads `head` in MPSC mode, producers go by slot sequences.
+	ring->head = head;
+	return items_count;
+}
+
+bool ppchat_ring_is_empty(RingQueue *ring) {
+	LONG64 head = ReadNoFence64(&ring->head);
+	if (ring->mode == RING_QUEUE_MODE_SPSC)
+		return ReadAcquire64(&ring->tail) == head;
+
+	return ReadAcquire64(get_slot_sequence(ring, head)) != head + 1;
+}
+
+bool ppchat_ring_wait(RingQueue *ring, DWORD timeout_ms) {
+	if (!ppchat_ring_is_empty(ring))
+		return true;
+
+	// Sample the sequence before announcing ourselves, so a wake that happens
+	// between here and WaitOnAddress makes it return right away.
+	LONG observed_sequence = ReadAcquire(&ring->wake_sequence);
+	InterlockedExchange(&ring->consumer_waiting, 1);
+
+	if (ppchat_ring_is_empty(ring))
+		WaitOnAddress(&ring->wake_sequence, &observed_sequence, sizeof(observed_sequence), timeout_ms);
+
+	InterlockedExchange(&ring->consumer_waiting, 0);
+	return !ppchat_ring_is_empty(ring);
+}
+
+void ppchat_ring_wake(RingQueue *ring) {
+	InterlockedIncrement(&ring->wake_sequence);
+	WakeByAddressSingle((PVOID) &ring->wake_sequence);
+}
@@ -0,0 +1,1159 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_search.h"
+
+#include <stdlib.h>
+
+static char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
+
+static const uint32_t SEARCH_RUN_MAGIC = 0x49484350; // "PCHI"
+static const uint32_t SEARCH_RUN_VERSION = 1;
+
+// Can't be part of a word, so room terms never match a word.
+static const char SEARCH_ROOM_TERM_PREFIX = '#';
+
+static const char *const SEARCH_TEMPORARY_SUFFIX = ".tmp";
+
+// LEB128 takes up to 10 bytes for a uint64_t.
+static const int SEARCH_MAX_VARINT_SIZE = 10;
+
+typedef struct SearchRunHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t terms_count;
+	uint32_t padding;
+	uint64_t first_sequence;
+	uint64_t last_sequence;
+	uint64_t postings_count;
+} SearchRunHeader;
+
+typedef struct SearchRunTerm {
+	uint64_t postings_offset;
+	uint64_t last_sequence;
+	uint32_t postings_size;
+	uint32_t postings_count;
+	uint32_t term_offset;
+	uint32_t term_size;
+} SearchRunTerm;
+
+static_assert(sizeof(SearchRunHeader) == PPCHAT_SEARCH_RUN_HEADER_SIZE, "Run header has to match the documented layout.");
+static_assert(sizeof(SearchRunTerm) == PPCHAT_SEARCH_RUN_TERM_SIZE, "Run term has to match the documented layout.");
+
+typedef struct QueryTerm {
+	char term[PPCHAT_SEARCH_MAX_TERM_SIZE];
+	int  term_size;
+} QueryTerm;
+
+typedef struct PostingList {
+	const uint8_t *postings;
+	uint64_t       postings_size;
+	uint32_t       postings_count;
+} PostingList;
+
+static int encode_varint(uint64_t value, uint8_t *out_bytes) {
+	int size = 0;
+	while (value >= 0x80) {
+		out_bytes[size] = (uint8_t) (value | 0x80);
+		value >>= 7;
+		size += 1;
+	}
+
+	out_bytes[size] = (uint8_t) value;
+	return size + 1;
+}
+
+// Returns the number of bytes read, zero if the varint runs past `size`.
+static int decode_varint(const uint8_t *bytes, uint64_t size, uint64_t *out_value) {
+	uint64_t value = 0;
+	int shift = 0;
+	for (uint64_t i = 0; i < size && i < (uint64_t) SEARCH_MAX_VARINT_SIZE; i += 1) {
+		value |= (uint64_t) (bytes[i] & 0x7F) << shift;
+		if ((bytes[i] & 0x80) == 0) {
+			*out_value = value;
+			return (int) i + 1;
+		}
+
+		shift += 7;
+	}
+
+	return 0;
+}
+
+static bool is_word_byte(uint8_t byte) {
+	return (byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || byte >= 0x80;
+}
+
+// Finds the next word at or after `*offset`, lowercased into `out_word`. Returns its
+// size, or zero once there are no more words.
+static int next_word(const char *text, int text_size, int *offset, char *out_word) {
+	while (*offset < text_size) {
+		while (*offset < text_size && !is_word_byte((uint8_t) text[*offset]))
+			*offset += 1;
+
+		int start = *offset;
+		while (*offset < text_size && is_word_byte((uint8_t) text[*offset]))
+			*offset += 1;
+
+		int size = *offset - start;
+		if (size < PPCHAT_SEARCH_MIN_WORD_SIZE)
+			continue;
+
+		size = min(size, PPCHAT_SEARCH_MAX_WORD_SIZE);
+		for (int i = 0; i < size; i += 1) {
+			char c = text[start + i];
+			out_word[i] = (c >= 'A' && c <= 'Z') ? (char) (c - 'A' + 'a') : c;
+		}
+
+		return size;
+	}
+
+	return 0;
+}
+
+static int make_room_term(const char *room, int room_size, char *out_term) {
+	room_size = min(room_size, PPCHAT_HISTORY_ROOM_NAME_MAX_SIZE);
+	out_term[0] = SEARCH_ROOM_TERM_PREFIX;
+	memcpy(out_term + 1, room, room_size);
+	return 1 + room_size;
+}
+
+static int compare_terms(const char *a, int a_size, const char *b, int b_size) {
+	int result = memcmp(a, b, min(a_size, b_size));
+	return (result != 0) ? result : a_size - b_size;
+}
+
+// FNV-1a.
+static uint32_t hash_term(const char *term, int term_size) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < term_size; i += 1) {
+		hash ^= (uint8_t) term[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static SearchMemtable *create_memtable() {
+	SearchMemtable *memtable = (SearchMemtable *) calloc(1, sizeof(*memtable));
+	if (!memtable)
+		return NULL;
+
+	memtable->buckets = (SearchTerm **) calloc(PPCHAT_SEARCH_TERM_BUCKETS_COUNT, sizeof(SearchTerm *));
+	if (!memtable->buckets) {
+		free(memtable);
+		return NULL;
+	}
+
+	return memtable;
+}
+
+static void free_memtable(SearchMemtable *memtable) {
+	if (!memtable)
+		return;
+
+	for (int i = 0; i < PPCHAT_SEARCH_TERM_BUCKETS_COUNT; i += 1) {
+		SearchTerm *term = memtable->buckets[i];
+		while (term) {
+			SearchTerm *next = term->next;
+			free(term->postings);
+			free(term);
+			term = next;
+		}
+	}
+
+	free(memtable->buckets);
+	free(memtable);
+}
+
+static SearchTerm *find_term(SearchMemtable *memtable, const char *term, int term_size, bool create) {
+	SearchTerm **bucket = &memtable->buckets[hash_term(term, term_size) % PPCHAT_SEARCH_TERM_BUCKETS_COUNT];
+	for (SearchTerm *found = *bucket; found; found = found->next) {
+		if ((int) found->term_size == term_size && memcmp(found->term, term, term_size) == 0)
+			return found;
+	}
+
+	if (!create)
+		return NULL;
+
+	SearchTerm *created = (SearchTerm *) calloc(1, sizeof(*created));
+	if (!created)
+		return NULL;
+
+	memcpy(created->term, term, term_size);
+	created->term_size = (uint32_t) term_size;
+	created->next = *bucket;
+	*bucket = created;
+
+	memtable->terms_count += 1;
+	memtable->size += sizeof(*created);
+	return created;
+}
+
+static void add_posting(SearchMemtable *memtable, const char *term, int term_size, uint64_t sequence) {
+	SearchTerm *found = find_term(memtable, term, term_size, true);
+
+	// Words that come up more than once in a message are only indexed once.
+	if (!found || found->last_sequence == sequence)
+		return;
+
+	if (found->postings_size + SEARCH_MAX_VARINT_SIZE > found->postings_capacity) {
+		uint32_t capacity = max(found->postings_capacity * 2, (uint32_t) 16);
+		uint8_t *postings = (uint8_t *) realloc(found->postings, capacity);
+		if (!postings)
+			return;
+
+		memtable->size += capacity - found->postings_capacity;
+		found->postings = postings;
+		found->postings_capacity = capacity;
+	}
+
+	found->postings_size += encode_varint(sequence - found->last_sequence, found->postings + found->postings_size);
+	found->postings_count += 1;
+	found->last_sequence = sequence;
+	memtable->postings_count += 1;
+}
+
+// Reads new messages from the history. Called with the index locked exclusively.
+static void index_record(const HistoryRecord *record, void *context) {
+	SearchIndex *index = static_cast<SearchIndex *>(context);
+	SearchMemtable *memtable = index->memtable;
+
+	char term[PPCHAT_SEARCH_MAX_TERM_SIZE];
+	int offset = 0;
+	int word_size;
+	while ((word_size = next_word(record->payload, record->payload_size, &offset, term)) > 0)
+		add_posting(memtable, term, word_size, record->sequence);
+
+	add_posting(memtable, term, make_room_term(record->room, record->room_size, term), record->sequence);
+
+	if (memtable->first_sequence == 0) {
+		memtable->first_sequence = record->sequence;
+		memtable->start_timestamp = ppchat_get_timestamp();
+	}
+
+	memtable->last_sequence = record->sequence;
+	index->indexed_sequence = record->sequence;
+	index->indexed_count += 1;
+}
+
+static SearchRun *create_run(const char *path, uint64_t first_sequence, uint64_t last_sequence, uint64_t file_size) {
+	SearchRun *run = (SearchRun *) calloc(1, sizeof(*run));
+	if (!run)
+		return NULL;
+
+	strncpy(run->path, path, sizeof(run->path) - 1);
+	run->first_sequence = first_sequence;
+	run->last_sequence = last_sequence;
+	run->file_size = file_size;
+	run->file = INVALID_HANDLE_VALUE;
+	InitializeSRWLock(&run->map_lock);
+	return run;
+}
+
+static void close_run(SearchRun *run, bool delete_file) {
+	if (run->view)
+		UnmapViewOfFile(run->view);
+
+	if (run->mapping)
+		CloseHandle(run->mapping);
+
+	if (run->file != INVALID_HANDLE_VALUE)
+		CloseHandle(run->file);
+
+	if (delete_file)
+		DeleteFileA(run->path);
+
+	free(run);
+}
+
+// Directory entries are checked when the run is mapped, so they can be used as they are.
+static SearchRunTerm get_run_term(const SearchRun *run, uint32_t term_index) {
+	SearchRunTerm term;
+	memcpy(&term, run->view + PPCHAT_SEARCH_RUN_HEADER_SIZE + (uint64_t) term_index * PPCHAT_SEARCH_RUN_TERM_SIZE, sizeof(term));
+	return term;
+}
+
+static bool check_run(const SearchRun *run, uint32_t terms_count) {
+	uint64_t terms_end = PPCHAT_SEARCH_RUN_HEADER_SIZE + (uint64_t) terms_count * PPCHAT_SEARCH_RUN_TERM_SIZE;
+	if (terms_end > run->file_size)
+		return false;
+
+	for (uint32_t i = 0; i < terms_count; i += 1) {
+		SearchRunTerm term = get_run_term(run, i);
+		bool valid = term.term_size > 0 && term.term_size <= (uint32_t) PPCHAT_SEARCH_MAX_TERM_SIZE &&
+		             term.term_offset >= terms_end && (uint64_t) term.term_offset + term.term_size <= run->file_size &&
+		             term.postings_offset >= terms_end && term.postings_offset <= run->file_size &&
+		             term.postings_size <= run->file_size - term.postings_offset;
+		if (!valid)
+			return false;
+	}
+
+	return true;
+}
+
+// Maps the run if no one has yet. Returns false if it can't be read.
+static bool map_run(SearchRun *run) {
+	AcquireSRWLockShared(&run->map_lock);
+	bool mapped = run->mapped;
+	uint32_t terms_count = run->terms_count;
+	ReleaseSRWLockShared(&run->map_lock);
+
+	if (mapped)
+		return terms_count > 0;
+
+	AcquireSRWLockExclusive(&run->map_lock);
+
+	if (!run->mapped) {
+		run->mapped = true;
+
+		int error = 0;
+		run->file = CreateFileA(run->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (run->file != INVALID_HANDLE_VALUE && run->file_size >= PPCHAT_SEARCH_RUN_HEADER_SIZE) {
+			run->mapping = CreateFileMappingA(run->file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (run->mapping)
+				run->view = (const char *) MapViewOfFile(run->mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+
+		if (!run->view)
+			error = (run->file_size < PPCHAT_SEARCH_RUN_HEADER_SIZE) ? ERROR_INVALID_DATA : GetLastError();
+
+		SearchRunHeader header = { };
+		if (run->view)
+			memcpy(&header, run->view, sizeof(header));
+
+		bool valid = run->view && header.magic == SEARCH_RUN_MAGIC && header.version == SEARCH_RUN_VERSION &&
+		             header.first_sequence == run->first_sequence && header.last_sequence == run->last_sequence &&
+		             check_run(run, header.terms_count);
+		if (valid) {
+			run->terms_count = header.terms_count;
+		} else if (run->view) {
+			log_warning("Search index run '%s' is damaged, messages %llu to %llu can't be found.", run->path, run->first_sequence, run->last_sequence);
+		} else {
+			log_warning("Couldn't map search index run '%s', messages %llu to %llu can't be found. Error: %d - %s", run->path, run->first_sequence, run->last_sequence, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+	}
+
+	mapped = run->terms_count > 0;
+	ReleaseSRWLockExclusive(&run->map_lock);
+	return mapped;
+}
+
+static bool find_run_term(const SearchRun *run, const char *term, int term_size, SearchRunTerm *out_term) {
+	int64_t low = 0;
+	int64_t high = (int64_t) run->terms_count - 1;
+	while (low <= high) {
+		int64_t middle = (low + high) / 2;
+		SearchRunTerm found = get_run_term(run, (uint32_t) middle);
+		int result = compare_terms(run->view + found.term_offset, (int) found.term_size, term, term_size);
+		if (result == 0) {
+			*out_term = found;
+			return true;
+		}
+
+		if (result < 0)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+
+	return false;
+}
+
+// Run files are written to a temporary file, which is only renamed once it is on disk,
+// so a crash never leaves half a run behind under a run name.
+typedef struct RunWriter {
+	char     path[MAX_PATH];
+	char     temporary_path[MAX_PATH];
+	HANDLE   file;
+	HANDLE   mapping;
+	char    *view;
+	uint64_t file_size;
+	uint64_t first_sequence;
+	uint64_t last_sequence;
+	uint32_t terms_count;           // Written so far.
+	uint64_t term_bytes_end;
+	uint64_t postings_end;
+} RunWriter;
+
+static void abort_run(RunWriter *writer) {
+	if (writer->view)
+		UnmapViewOfFile(writer->view);
+
+	if (writer->mapping)
+		CloseHandle(writer->mapping);
+
+	if (writer->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(writer->file);
+		DeleteFileA(writer->temporary_path);
+	}
+}
+
+static bool begin_run(SearchIndex *index, RunWriter *writer, const SearchRunHeader *header, uint64_t term_bytes_size, uint64_t postings_size, int *out_error) {
+	memset(writer, 0, sizeof(*writer));
+	snprintf(writer->path, sizeof(writer->path), "%s/%020llu-%020llu%s", index->folder, header->first_sequence, header->last_sequence, PPCHAT_SEARCH_RUN_SUFFIX);
+	snprintf(writer->temporary_path, sizeof(writer->temporary_path), "%s%s", writer->path, SEARCH_TEMPORARY_SUFFIX);
+
+	uint64_t terms_end = PPCHAT_SEARCH_RUN_HEADER_SIZE + (uint64_t) header->terms_count * PPCHAT_SEARCH_RUN_TERM_SIZE;
+	writer->file_size = terms_end + term_bytes_size + postings_size;
+	writer->first_sequence = header->first_sequence;
+	writer->last_sequence = header->last_sequence;
+	writer->term_bytes_end = terms_end;
+	writer->postings_end = terms_end + term_bytes_size;
+
+	writer->file = CreateFileA(writer->temporary_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (writer->file == INVALID_HANDLE_VALUE) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	file_size.QuadPart = (LONGLONG) writer->file_size;
+	bool mapped = SetFilePointerEx(writer->file, file_size, NULL, FILE_BEGIN) && SetEndOfFile(writer->file);
+	if (mapped) {
+		writer->mapping = CreateFileMappingA(writer->file, NULL, PAGE_READWRITE, 0, 0, NULL);
+		if (writer->mapping)
+			writer->view = (char *) MapViewOfFile(writer->mapping, FILE_MAP_WRITE, 0, 0, 0);
+	}
+
+	if (!writer->view) {
+		*out_error = GetLastError();
+		abort_run(writer);
+		return false;
+	}
+
+	memcpy(writer->view, header, sizeof(*header));
+	*out_error = 0;
+	return true;
+}
+
+static void write_run_postings(RunWriter *writer, const void *postings, uint64_t size) {
+	memcpy(writer->view + writer->postings_end, postings, size);
+	writer->postings_end += size;
+}
+
+// Adds a term whose postings were written since `postings_offset`. Terms go in sorted.
+static void write_run_term(RunWriter *writer, const char *term, int term_size, uint64_t postings_offset, uint64_t last_sequence, uint32_t postings_count) {
+	SearchRunTerm entry = { };
+	entry.postings_offset = postings_offset;
+	entry.last_sequence = last_sequence;
+	entry.postings_size = (uint32_t) (writer->postings_end - postings_offset);
+	entry.postings_count = postings_count;
+	entry.term_offset = (uint32_t) writer->term_bytes_end;
+	entry.term_size = (uint32_t) term_size;
+
+	memcpy(writer->view + PPCHAT_SEARCH_RUN_HEADER_SIZE + (uint64_t) writer->terms_count * PPCHAT_SEARCH_RUN_TERM_SIZE, &entry, sizeof(entry));
+	memcpy(writer->view + writer->term_bytes_end, term, term_size);
+	writer->term_bytes_end += term_size;
+	writer->terms_count += 1;
+}
+
+static SearchRun *finish_run(RunWriter *writer, int *out_error) {
+	bool written = FlushViewOfFile(writer->view, 0) != FALSE;
+	UnmapViewOfFile(writer->view);
+	CloseHandle(writer->mapping);
+	writer->view = NULL;
+	writer->mapping = NULL;
+
+	written = written && FlushFileBuffers(writer->file);
+	if (!written) {
+		*out_error = GetLastError();
+		abort_run(writer);
+		return NULL;
+	}
+
+	CloseHandle(writer->file);
+	writer->file = INVALID_HANDLE_VALUE;
+
+	SearchRun *run = create_run(writer->path, writer->first_sequence, writer->last_sequence, writer->file_size);
+	if (!run || !MoveFileExA(writer->temporary_path, writer->path, MOVEFILE_REPLACE_EXISTING)) {
+		*out_error = (run) ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+		DeleteFileA(writer->temporary_path);
+		free(run);
+		return NULL;
+	}
+
+	*out_error = 0;
+	return run;
+}
+
+static int compare_memtable_terms(const void *a, const void *b) {
+	const SearchTerm *first = *(const SearchTerm *const *) a;
+	const SearchTerm *second = *(const SearchTerm *const *) b;
+	return compare_terms(first->term, (int) first->term_size, second->term, (int) second->term_size);
+}
+
+// Adds a run, which has to cover sequence numbers after every other run's. Called by the indexing thread.
+static void add_run(SearchIndex *index, SearchRun *run, SearchMemtable *memtable) {
+	AcquireSRWLockExclusive(&index->lock);
+
+	SearchMemtable *previous = index->memtable;
+	index->runs[index->runs_count] = run;
+	index->runs_count += 1;
+	index->memtable = memtable;
+
+	ReleaseSRWLockExclusive(&index->lock);
+	free_memtable(previous);
+}
+
+// Writes the memtable out as a run and starts a new one. Called by the indexing thread.
+static bool persist_memtable(SearchIndex *index) {
+	SearchMemtable *memtable = index->memtable;
+	if (memtable->postings_count == 0 || index->runs_count == PPCHAT_SEARCH_MAX_RUNS)
+		return false;
+
+	SearchMemtable *next_memtable = create_memtable();
+	SearchTerm **terms = (SearchTerm **) malloc(memtable->terms_count * sizeof(SearchTerm *));
+	if (!next_memtable || !terms) {
+		log_error("Couldn't allocate memory to write search index run to '%s'.", index->folder);
+		free_memtable(next_memtable);
+		free(terms);
+		return false;
+	}
+
+	uint64_t terms_count = 0;
+	uint64_t term_bytes_size = 0;
+	uint64_t postings_size = 0;
+	for (int i = 0; i < PPCHAT_SEARCH_TERM_BUCKETS_COUNT; i += 1) {
+		for (SearchTerm *term = memtable->buckets[i]; term; term = term->next) {
+			if (term->postings_count == 0)
+				continue;
+
+			terms[terms_count] = term;
+			terms_count += 1;
+			term_bytes_size += term->term_size;
+			postings_size += term->postings_size;
+		}
+	}
+
+	qsort(terms, terms_count, sizeof(SearchTerm *), compare_memtable_terms);
+
+	SearchRunHeader header = { };
+	header.magic = SEARCH_RUN_MAGIC;
+	header.version = SEARCH_RUN_VERSION;
+	header.terms_count = (uint32_t) terms_count;
+	header.first_sequence = memtable->first_sequence;
+	header.last_sequence = memtable->last_sequence;
+	header.postings_count = memtable->postings_count;
+
+	int error = 0;
+	RunWriter writer;
+	SearchRun *run = NULL;
+	if (begin_run(index, &writer, &header, term_bytes_size, postings_size, &error)) {
+		for (uint64_t i = 0; i < terms_count; i += 1) {
+			SearchTerm *term = terms[i];
+			uint64_t postings_offset = writer.postings_end;
+			write_run_postings(&writer, term->postings, term->postings_size);
+			write_run_term(&writer, term->term, (int) term->term_size, postings_offset, term->last_sequence, term->postings_count);
+		}
+
+		run = finish_run(&writer, &error);
+	}
+
+	free(terms);
+
+	if (!run) {
+		log_error("Couldn't write search index run to '%s'. Error: %d - %s", index->folder, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		free_memtable(next_memtable);
+		return false;
+	}
+
+	add_run(index, run, next_memtable);
+	index->persisted_runs_count += 1;
+	return true;
+}
+
+typedef struct MergeSizes {
+	uint64_t terms_count;
+	uint64_t term_bytes_size;
+	uint64_t postings_size;
+	uint64_t postings_count;
+} MergeSizes;
+
+// Goes through the terms of two neighbouring runs in order. Without a writer it only
+// adds up how big the merged run is going to be.
+static void merge_run_terms(const SearchRun *older, const SearchRun *newer, RunWriter *writer, MergeSizes *sizes) {
+	memset(sizes, 0, sizeof(*sizes));
+
+	uint32_t older_index = 0;
+	uint32_t newer_index = 0;
+	while (older_index < older->terms_count || newer_index < newer->terms_count) {
+		SearchRunTerm older_term = { };
+		SearchRunTerm newer_term = { };
+		if (older_index < older->terms_count)
+			older_term = get_run_term(older, older_index);
+
+		if (newer_index < newer->terms_count)
+			newer_term = get_run_term(newer, newer_index);
+
+		int result;
+		if (older_index == older->terms_count)
+			result = 1;
+		else if (newer_index == newer->terms_count)
+			result = -1;
+		else
+			result = compare_terms(older->view + older_term.term_offset, (int) older_term.term_size, newer->view + newer_term.term_offset, (int) newer_term.term_size);
+
+		const char *term = (result <= 0) ? older->view + older_term.term_offset : newer->view + newer_term.term_offset;
+		int term_size = (int) ((result <= 0) ? older_term.term_size : newer_term.term_size);
+		uint64_t postings_offset = (writer) ? writer->postings_end : 0;
+		uint64_t postings_size = 0;
+		uint64_t last_sequence = 0;
+		uint32_t postings_count = 0;
+
+		if (result <= 0) {
+			const uint8_t *postings = (const uint8_t *) older->view + older_term.postings_offset;
+			if (writer)
+				write_run_postings(writer, postings, older_term.postings_size);
+
+			postings_size += older_term.postings_size;
+			postings_count += older_term.postings_count;
+			last_sequence = older_term.last_sequence;
+			older_index += 1;
+		}
+
+		if (result >= 0) {
+			const uint8_t *postings = (const uint8_t *) newer->view + newer_term.postings_offset;
+			uint64_t size = newer_term.postings_size;
+
+			// The first varint of the newer list counts from zero, it has to count
+			// from the last sequence number of the older list instead.
+			uint64_t first_sequence = 0;
+			int first_size = (result == 0) ? decode_varint(postings, size, &first_sequence) : 0;
+			if (first_size > 0) {
+				uint8_t varint[SEARCH_MAX_VARINT_SIZE];
+				int varint_size = encode_varint(first_sequence - last_sequence, varint);
+				if (writer)
+					write_run_postings(writer, varint, varint_size);
+
+				postings_size += varint_size;
+				postings += first_size;
+				size -= first_size;
+			}
+
+			if (writer)
+				write_run_postings(writer, postings, size);
+
+			postings_size += size;
+			postings_count += newer_term.postings_count;
+			last_sequence = newer_term.last_sequence;
+			newer_index += 1;
+		}
+
+		if (writer)
+			write_run_term(writer, term, term_size, postings_offset, last_sequence, postings_count);
+
+		sizes->terms_count += 1;
+		sizes->term_bytes_size += term_size;
+		sizes->postings_size += postings_size;
+		sizes->postings_count += postings_count;
+	}
+}
+
+// Replaces runs `first` and `first + 1` with one run. Called by the indexing thread.
+static bool merge_runs(SearchIndex *index, int first) {
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	SearchRun *older = index->runs[first];
+	SearchRun *newer = index->runs[first + 1];
+
+	// Unreadable runs merge as if they were empty.
+	map_run(older);
+	map_run(newer);
+
+	MergeSizes sizes;
+	merge_run_terms(older, newer, NULL, &sizes);
+
+	SearchRunHeader header = { };
+	header.magic = SEARCH_RUN_MAGIC;
+	header.version = SEARCH_RUN_VERSION;
+	header.terms_count = (uint32_t) sizes.terms_count;
+	header.first_sequence = older->first_sequence;
+	header.last_sequence = newer->last_sequence;
+	header.postings_count = sizes.postings_count;
+
+	int error = 0;
+	RunWriter writer;
+	SearchRun *run = NULL;
+	if (begin_run(index, &writer, &header, sizes.term_bytes_size, sizes.postings_size, &error)) {
+		merge_run_terms(older, newer, &writer, &sizes);
+		run = finish_run(&writer, &error);
+	}
+
+	if (!run) {
+		log_error("Couldn't merge search index runs '%s' and '%s'. Error: %d - %s", older->path, newer->path, error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		return false;
+	}
+
+	AcquireSRWLockExclusive(&index->lock);
+	index->runs[first] = run;
+	index->runs_count -= 1;
+	memmove(index->runs + first + 1, index->runs + first + 2, (index->runs_count - first - 1) * sizeof(SearchRun *));
+	ReleaseSRWLockExclusive(&index->lock);
+
+	// Queries hold the lock while they read runs, so no one can be reading these anymore.
+	close_run(older, true);
+	close_run(newer, true);
+
+	uint64_t duration_ns = ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp);
+	index->merges_count += 1;
+	index->max_merge_duration_ns = max(index->max_merge_duration_ns, duration_ns);
+	return true;
+}
+
+// Merges the neighbouring runs that are smallest together until there are few enough.
+static void compact_runs(SearchIndex *index) {
+	while (index->runs_count > index->max_runs && WaitForSingleObject(index->stop_event, 0) == WAIT_TIMEOUT) {
+		int first = 0;
+		for (int i = 1; i + 1 < index->runs_count; i += 1) {
+			uint64_t size = index->runs[i]->file_size + index->runs[i + 1]->file_size;
+			if (size < index->runs[first]->file_size + index->runs[first + 1]->file_size)
+				first = i;
+		}
+
+		if (!merge_runs(index, first))
+			break;
+	}
+}
+
+// Deletes runs that only point at messages the history doesn't have anymore.
+static void drop_forgotten_runs(SearchIndex *index) {
+	HistoryStats history_stats;
+	ppchat_history_get_stats(index->history, &history_stats);
+
+	int dropped_count = 0;
+	while (dropped_count < index->runs_count && index->runs[dropped_count]->last_sequence < history_stats.first_sequence)
+		dropped_count += 1;
+
+	if (dropped_count == 0)
+		return;
+
+	SearchRun *dropped[PPCHAT_SEARCH_MAX_RUNS];
+	memcpy(dropped, index->runs, dropped_count * sizeof(SearchRun *));
+
+	AcquireSRWLockExclusive(&index->lock);
+	index->runs_count -= dropped_count;
+	memmove(index->runs, index->runs + dropped_count, index->runs_count * sizeof(SearchRun *));
+	ReleaseSRWLockExclusive(&index->lock);
+
+	for (int i = 0; i < dropped_count; i += 1)
+		close_run(dropped[i], true);
+}
+
+static bool is_stopping(SearchIndex *index) {
+	return WaitForSingleObject(index->stop_event, 0) != WAIT_TIMEOUT;
+}
+
+// Indexes whatever the history has gained since the last time.
+static void follow_history(SearchIndex *index) {
+	int read_count = PPCHAT_SEARCH_FOLLOW_BATCH_SIZE;
+	while (read_count == PPCHAT_SEARCH_FOLLOW_BATCH_SIZE && !is_stopping(index)) {
+		AcquireSRWLockExclusive(&index->lock);
+		read_count = ppchat_history_read_range(index->history, index->indexed_sequence + 1, PPCHAT_SEARCH_FOLLOW_BATCH_SIZE, index_record, index);
+		ReleaseSRWLockExclusive(&index->lock);
+
+		// Catching up on a long history keeps merging as it goes.
+		if (index->memtable->size >= index->memtable_size && persist_memtable(index))
+			compact_runs(index);
+	}
+}
+
+static DWORD CALLBACK run_search_thread(void *context) {
+	SearchIndex *index = static_cast<SearchIndex *>(context);
+	while (WaitForSingleObject(index->stop_event, (DWORD) PPCHAT_SEARCH_FOLLOW_INTERVAL_MS) == WAIT_TIMEOUT) {
+		follow_history(index);
+
+		SearchMemtable *memtable = index->memtable;
+		if (memtable->postings_count > 0) {
+			uint64_t age_ns = ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - memtable->start_timestamp);
+			if (age_ns >= (uint64_t) index->persist_interval_ms * 1000000)
+				persist_memtable(index);
+		}
+
+		drop_forgotten_runs(index);
+		compact_runs(index);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int compare_runs(const void *a, const void *b) {
+	const SearchRun *first = *(const SearchRun *const *) a;
+	const SearchRun *second = *(const SearchRun *const *) b;
+	if (first->first_sequence != second->first_sequence)
+		return (first->first_sequence > second->first_sequence) - (first->first_sequence < second->first_sequence);
+
+	// Wider runs first, so that the runs a merge replaced come after the merged one.
+	return (first->last_sequence < second->last_sequence) - (first->last_sequence > second->last_sequence);
+}
+
+static void delete_temporary_runs(SearchIndex *index) {
+	char pattern[MAX_PATH];
+	snprintf(pattern, sizeof(pattern), "%s/*%s%s", index->folder, PPCHAT_SEARCH_RUN_SUFFIX, SEARCH_TEMPORARY_SUFFIX);
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		char path[MAX_PATH];
+		snprintf(path, sizeof(path), "%s/%s", index->folder, find_data.cFileName);
+		DeleteFileA(path);
+	} while (FindNextFileA(find, &find_data));
+
+	FindClose(find);
+}
+
+// Lists the runs in the folder without opening them. Runs left behind by a merge that
+// didn't get to delete them, and runs the history has nothing for, are deleted.
+static bool load_runs(SearchIndex *index, int *out_error) {
+	delete_temporary_runs(index);
+
+	char pattern[MAX_PATH];
+	snprintf(pattern, sizeof(pattern), "%s/*%s", index->folder, PPCHAT_SEARCH_RUN_SUFFIX);
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE) {
+		int error = GetLastError();
+		*out_error = (error == ERROR_FILE_NOT_FOUND) ? 0 : error;
+		return error == ERROR_FILE_NOT_FOUND;
+	}
+
+	SearchRun *found[PPCHAT_SEARCH_MAX_RUNS];
+	int found_count = 0;
+	do {
+		if (found_count == PPCHAT_SEARCH_MAX_RUNS) {
+			log_warning("History folder '%s' has more than %d search index runs, the rest are ignored.", index->folder, PPCHAT_SEARCH_MAX_RUNS);
+			break;
+		}
+
+		uint64_t first_sequence = 0;
+		uint64_t last_sequence = 0;
+		char suffix[16] = { };
+		int fields_count = sscanf(find_data.cFileName, "%llu-%llu%15s", &first_sequence, &last_sequence, suffix);
+		if (fields_count != 3 || strcmp(suffix, PPCHAT_SEARCH_RUN_SUFFIX) != 0 || first_sequence == 0 || first_sequence > last_sequence) {
+			log_warning("File '%s' in '%s' isn't a search index run, ignoring it.", find_data.cFileName, index->folder);
+			continue;
+		}
+
+		char path[MAX_PATH];
+		snprintf(path, sizeof(path), "%s/%s", index->folder, find_data.cFileName);
+
+		uint64_t file_size = ((uint64_t) find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+		SearchRun *run = create_run(path, first_sequence, last_sequence, file_size);
+		if (!run) {
+			FindClose(find);
+			for (int i = 0; i < found_count; i += 1)
+				close_run(found[i], false);
+
+			*out_error = ERROR_NOT_ENOUGH_MEMORY;
+			return false;
+		}
+
+		found[found_count] = run;
+		found_count += 1;
+	} while (FindNextFileA(find, &find_data));
+
+	FindClose(find);
+
+	qsort(found, found_count, sizeof(SearchRun *), compare_runs);
+
+	HistoryStats history_stats;
+	ppchat_history_get_stats(index->history, &history_stats);
+
+	for (int i = 0; i < found_count; i += 1) {
+		SearchRun *run = found[i];
+		SearchRun *previous = (index->runs_count > 0) ? index->runs[index->runs_count - 1] : NULL;
+
+		// Runs past the end of the history are from a history that has since been deleted.
+		bool stale = run->last_sequence > history_stats.last_sequence ||
+		             (previous && run->first_sequence <= previous->last_sequence);
+		if (stale) {
+			close_run(run, true);
+			continue;
+		}
+
+		index->runs[index->runs_count] = run;
+		index->runs_count += 1;
+		index->indexed_sequence = run->last_sequence;
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+static void free_search(SearchIndex *index) {
+	for (int i = 0; i < index->runs_count; i += 1)
+		close_run(index->runs[i], false);
+
+	free_memtable(index->memtable);
+	memset(index, 0, sizeof(*index));
+}
+
+bool ppchat_search_open(SearchIndex *index, HistoryStore *history, const SearchOptions *options, int *out_error) {
+	memset(index, 0, sizeof(*index));
+	InitializeSRWLock(&index->lock);
+
+	strncpy(index->folder, options->folder, sizeof(index->folder) - 1);
+	index->history = history;
+	index->memtable_size = (options->memtable_size > 0) ? options->memtable_size : PPCHAT_SEARCH_DEFAULT_MEMTABLE_SIZE;
+	index->persist_interval_ms = (options->persist_interval_ms > 0) ? options->persist_interval_ms : PPCHAT_SEARCH_DEFAULT_PERSIST_INTERVAL_MS;
+
+	// There always has to be room for one more run than that, for the memtable.
+	index->max_runs = (options->max_runs > 0) ? min(options->max_runs, PPCHAT_SEARCH_MAX_RUNS - 1) : PPCHAT_SEARCH_DEFAULT_MAX_RUNS;
+	index->max_runs = max(index->max_runs, 1);
+
+	index->memtable = create_memtable();
+	if (!index->memtable) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+
+	if (!load_runs(index, out_error)) {
+		free_search(index);
+		return false;
+	}
+
+	index->stop_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (index->stop_event) {
+		index->thread = CreateThread(
+			/* Thread attributes   */ NULL,
+			/* Stack size          */ 0,
+			/* Calling procedure   */ run_search_thread,
+			/* Procedure argument  */ index,
+			/* Creation flags      */ NULL,
+			/* Thread ID           */ NULL
+		);
+	}
+
+	if (!index->thread) {
+		*out_error = GetLastError();
+		if (index->stop_event)
+			CloseHandle(index->stop_event);
+
+		free_search(index);
+		return false;
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+void ppchat_search_close(SearchIndex *index) {
+	if (!index->thread)
+		return;
+
+	SetEvent(index->stop_event);
+	WaitForSingleObject(index->thread, INFINITE);
+	CloseHandle(index->thread);
+	CloseHandle(index->stop_event);
+
+	// Spares indexing these messages again on the next start.
+	persist_memtable(index);
+	free_search(index);
+}
+
+// Keeps the sequence numbers in `candidates` that are in the posting list too, walking
+// the list as far as the last candidate. Returns how many are left.
+static uint32_t filter_candidates(uint64_t *candidates, uint32_t candidates_count, const PostingList *list) {
+	uint32_t kept_count = 0;
+	uint64_t offset = 0;
+	uint64_t sequence = 0;
+	for (uint32_t i = 0; i < candidates_count; i += 1) {
+		while (sequence < candidates[i]) {
+			uint64_t delta;
+			int size = decode_varint(list->postings + offset, list->postings_size - offset, &delta);
+			if (size == 0)
+				return kept_count;
+
+			offset += size;
+			sequence += delta;
+		}
+
+		if (sequence == candidates[i]) {
+			candidates[kept_count] = candidates[i];
+			kept_count += 1;
+		}
+	}
+
+	return kept_count;
+}
+
+// Intersects the posting lists of every term, shortest first, and adds the newest
+// matches to the results. Returns the number of results.
+static int intersect_postings(PostingList *lists, int lists_count, uint64_t *out_sequences, int results_count, int max_results) {
+	for (int i = 1; i < lists_count; i += 1) {
+		PostingList list = lists[i];
+		int j = i - 1;
+		while (j >= 0 && lists[j].postings_count > list.postings_count) {
+			lists[j + 1] = lists[j];
+			j -= 1;
+		}
+
+		lists[j + 1] = list;
+	}
+
+	uint64_t *candidates = (uint64_t *) malloc(max(lists[0].postings_count, (uint32_t) 1) * sizeof(uint64_t));
+	if (!candidates) {
+		log_error("Couldn't allocate memory for %u search candidates.", lists[0].postings_count);
+		return results_count;
+	}
+
+	uint32_t candidates_count = 0;
+	uint64_t offset = 0;
+	uint64_t sequence = 0;
+	while (candidates_count < lists[0].postings_count) {
+		uint64_t delta;
+		int size = decode_varint(lists[0].postings + offset, lists[0].postings_size - offset, &delta);
+		if (size == 0)
+			break;
+
+		offset += size;
+		sequence += delta;
+		candidates[candidates_count] = sequence;
+		candidates_count += 1;
+	}
+
+	for (int i = 1; i < lists_count && candidates_count > 0; i += 1)
+		candidates_count = filter_candidates(candidates, candidates_count, &lists[i]);
+
+	for (int64_t i = (int64_t) candidates_count - 1; i >= 0 && results_count < max_results; i -= 1) {
+		out_sequences[results_count] = candidates[i];
+		results_count += 1;
+	}
+
+	free(candidates);
+	return results_count;
+}
+
+static int query_memtable(SearchMemtable *memtable, const QueryTerm *terms, int terms_count, uint64_t *out_sequences, int results_count, int max_results) {
+	PostingList lists[PPCHAT_SEARCH_MAX_QUERY_TERMS + 1];
+	for (int i = 0; i < terms_count; i += 1) {
+		SearchTerm *term = find_term(memtable, terms[i].term, terms[i].term_size, false);
+		if (!term || term->postings_count == 0)
+			return results_count;
+
+		lists[i].postings = term->postings;
+		lists[i].postings_size = term->postings_size;
+		lists[i].postings_count = term->postings_count;
+	}
+
+	return intersect_postings(lists, terms_count, out_sequences, results_count, max_results);
+}
+
+static int query_run(SearchRun *run, const QueryTerm *terms, int terms_count, uint64_t *out_sequences, int results_count, int max_results) {
+	if (!map_run(run))
+		return results_count;
+
+	PostingList lists[PPCHAT_SEARCH_MAX_QUERY_TERMS + 1];
+	for (int i = 0; i < terms_count; i += 1) {
+		SearchRunTerm term;
+		if (!find_run_term(run, terms[i].term, terms[i].term_size, &term) || term.postings_count == 0)
+			return results_count;
+
+		lists[i].postings = (const uint8_t *) run->view + term.postings_offset;
+		lists[i].postings_size = term.postings_size;
+		lists[i].postings_count = term.postings_count;
+	}
+
+	return intersect_postings(lists, terms_count, out_sequences, results_count, max_results);
+}
+
+int ppchat_search_query(SearchIndex *index, const char *room, const char *query, int query_size, uint64_t *out_sequences, int max_results) {
+	max_results = min(max_results, PPCHAT_SEARCH_MAX_RESULTS);
+	if (max_results <= 0)
+		return 0;
+
+	QueryTerm terms[PPCHAT_SEARCH_MAX_QUERY_TERMS + 1];
+	int terms_count = 0;
+	int offset = 0;
+	char word[PPCHAT_SEARCH_MAX_TERM_SIZE];
+	int word_size;
+	while (terms_count < PPCHAT_SEARCH_MAX_QUERY_TERMS && (word_size = next_word(query, query_size, &offset, word)) > 0) {
+		bool repeated = false;
+		for (int i = 0; i < terms_count && !repeated; i += 1)
+			repeated = compare_terms(terms[i].term, terms[i].term_size, word, word_size) == 0;
+
+		if (repeated)
+			continue;
+
+		memcpy(terms[terms_count].term, word, word_size);
+		terms[terms_count].term_size = word_size;
+		terms_count += 1;
+	}
+
+	if (terms_count == 0)
+		return 0;
+
+	if (room) {
+		terms[terms_count].term_size = make_room_term(room, (int) strlen(room), terms[terms_count].term);
+		terms_count += 1;
+	}
+
+	uint64_t start_timestamp = ppchat_get_timestamp();
+
+	AcquireSRWLockShared(&index->lock);
+
+	// Newest messages are in the memtable, then in the runs from the last one back.
+	int results_count = query_memtable(index->memtable, terms, terms_count, out_sequences, 0, max_results);
+	for (int i = index->runs_count - 1; i >= 0 && results_count < max_results; i -= 1)
+		results_count = query_run(index->runs[i], terms, terms_count, out_sequences, results_count, max_results);
+
+	ReleaseSRWLockShared(&index->lock);
+
+	LONG64 duration_ns = (LONG64) ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp);
+	InterlockedIncrement64(&index->queries_count);
+
+	LONG64 observed = ReadNoFence64(&index->max_query_duration_ns);
+	while (observed < duration_ns) {
+		LONG64 previous = InterlockedCompareExchange64(&index->max_query_duration_ns, duration_ns, observed);
+		if (previous == observed)
+			break;
+
+		observed = previous;
+	}
+
+	return results_count;
+}
+
+bool ppchat_search_wait(SearchIndex *index, uint64_t sequence, int timeout_ms) {
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	for (;;) {
+		AcquireSRWLockShared(&index->lock);
+		bool indexed = index->indexed_sequence >= sequence;
+		ReleaseSRWLockShared(&index->lock);
+
+		if (indexed)
+			return true;
+
+		uint64_t waited_ns = ppchat_timestamp_to_nanoseconds(ppchat_get_timestamp() - start_timestamp);
+		if (waited_ns >= (uint64_t) timeout_ms * 1000000)
+			return false;
+
+		Sleep(1);
+	}
+}
+
+void ppchat_search_get_stats(SearchIndex *index, SearchStats *out_stats) {
+	memset(out_stats, 0, sizeof(*out_stats));
+
+	AcquireSRWLockShared(&index->lock);
+
+	out_stats->indexed_sequence = index->indexed_sequence;
+	out_stats->indexed_count = index->indexed_count;
+	out_stats->memtable_terms_count = index->memtable->terms_count;
+	out_stats->memtable_size = index->memtable->size;
+	out_stats->runs_count = index->runs_count;
+	for (int i = 0; i < index->runs_count; i += 1)
+		out_stats->runs_size += index->runs[i]->file_size;
+
+	ReleaseSRWLockShared(&index->lock);
+
+	// Written by the indexing thread, read without synchronization.
+	out_stats->persisted_runs_count = index->persisted_runs_count;
+	out_stats->merges_count = index->merges_count;
+	out_stats->max_merge_duration_ns = index->max_merge_duration_ns;
+
+	out_stats->queries_count = (uint64_t) ReadNoFence64(&index->queries_count);
+	out_stats->max_query_duration_ns = (uint64_t) ReadNoFence64(&index->max_query_duration_ns);
+}
@@ -1,6 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "../include/ppchat_shared.h"
+#include "../include/ppchat_byte_order.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -12,57 +13,6 @@
 
 static char g_error_message[PPCHAT_ERROR_MESSAGE_BUFFER_SIZE] = { };
 
-InputQueue create_input_queue(size_t max_items, size_t item_size) {
-	InputQueue queue;
-
-	// MSDN: "This function always succeeds and returns a nonzero value."
-	(void) InitializeCriticalSectionAndSpinCount(&queue.critical_section, 500);
-
-	queue.max_items = max_items;
-	queue.item_size = item_size;
-	queue.items_count = 0;
-	queue.front_item_index = 0;
-	queue.buffer = (char *) calloc(max_items * item_size, sizeof(char));
-	return queue;
-}
-
-bool get_next_queue(InputQueue *queue, char **out_queue) {
-	if (queue->items_count < 1)
-		return false;
-
-	if (out_queue)
-		*out_queue = &(queue->buffer[queue->front_item_index * queue->item_size]);
-
-	queue->items_count -= 1;
-	queue->front_item_index += 1;
-	if (queue->front_item_index >= queue->max_items)
-		queue->front_item_index = 0;
-
-	memset(&(queue->buffer[queue->front_item_index * queue->item_size]), 0, queue->item_size);
-
-	return true;
-}
-
-bool queue_input(InputQueue *queue, char *input) {
-	if (queue->items_count >= queue->max_items)
-		return false;
-
-	memcpy(
-		&(queue->buffer[queue->front_item_index * queue->item_size]),
-		input,
-		min(queue->item_size, strlen(input) * sizeof(*input))
-	);
-
-	queue->items_count += 1;
-	return true;
-}
-
-void destroy_input_queue(InputQueue *queue) {
-	DeleteCriticalSection(&queue->critical_section);
-	free(queue->buffer);
-	memset(queue, 0, sizeof(*queue));
-}
-
 tm get_current_local_time() {
 	time_t current_time = time(NULL);
 	tm local_time = { };
@@ -74,8 +24,6 @@ void log_message(FILE *stream, const char *format, ...) {
 	va_list arguments;
 	va_start(arguments, format);
 
-	tm local_time = get_current_local_time();
-
 	char message[2048];
 	size_t message_size = sizeof(message);
 	int written = vsnprintf(message, message_size, format, arguments);
@@ -113,9 +61,62 @@ char *get_error_description(int error, char *out_message, size_t message_length)
 }
 
 void exit_process_with_error() {
+	// ExitProcess doesn't wait for the logging thread, let the last lines out first.
+	ppchat_log_flush();
 	ExitProcess(EXIT_FAILURE);
 }
 
+uint64_t ppchat_get_timestamp() {
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) counter.QuadPart;
+}
+
+uint64_t ppchat_get_timestamp_frequency() {
+	// Fixed at system boot, so it's fine to look it up once.
+	static uint64_t frequency = 0;
+	if (frequency == 0) {
+		LARGE_INTEGER counter_frequency;
+		QueryPerformanceFrequency(&counter_frequency);
+		frequency = (uint64_t) counter_frequency.QuadPart;
+	}
+
+	return frequency;
+}
+
+uint64_t ppchat_timestamp_to_nanoseconds(uint64_t ticks) {
+	uint64_t frequency = ppchat_get_timestamp_frequency();
+
+	// Split to not overflow the multiplication.
+	return (ticks / frequency) * 1000000000ull + (ticks % frequency) * 1000000000ull / frequency;
+}
+
+uint64_t ppchat_timestamp_to_milliseconds(uint64_t ticks) {
+	uint64_t frequency = ppchat_get_timestamp_frequency();
+	return (ticks / frequency) * 1000ull + (ticks % frequency) * 1000ull / frequency;
+}
+
+static uint64_t filetime_to_nanoseconds(FILETIME time) {
+	uint64_t intervals = ((uint64_t) time.dwHighDateTime << 32) | time.dwLowDateTime;
+	return intervals * 100;
+}
+
+uint64_t ppchat_get_process_cpu_time() {
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+
+	return filetime_to_nanoseconds(kernel_time) + filetime_to_nanoseconds(user_time);
+}
+
+uint64_t ppchat_get_thread_cpu_time() {
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+
+	return filetime_to_nanoseconds(kernel_time) + filetime_to_nanoseconds(user_time);
+}
+
 Socket ppchat_create_socket(int address_family, int socket_type, int protocol) {
 	Socket result_socket;
 	result_socket.handle = socket(address_family, socket_type, protocol);
@@ -136,6 +137,161 @@ Socket ppchat_accept(Socket socket, sockaddr *address, int *address_length) {
 	return result_socket;
 }
 
+Socket ppchat_create_listen_socket(const char *port, int *out_error) {
+	Socket listen_socket;
+	listen_socket.handle = INVALID_SOCKET;
+
+	addrinfo hints = { };
+
+	// ai - address info.
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	// MSDN: "Setting the AI_PASSIVE flag indicates the caller intends to
+	// use the returned socket address structure in a call to the bind function."
+	hints.ai_flags = AI_PASSIVE;
+
+	addrinfo *server = NULL;
+	int server_address_info_result = getaddrinfo(
+		/* Node name (IP)      */ NULL,
+		/* Service name (port) */ port,
+		/* Address info hints  */ &hints,
+		/* Result array        */ &server  // Iteration through array of results is done by result->ai_next.
+	);
+	if (server_address_info_result != 0) {
+		if (out_error)
+			*out_error = server_address_info_result;
+
+		return listen_socket;
+	}
+
+	listen_socket = ppchat_create_socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+	if (listen_socket.handle == INVALID_SOCKET) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		freeaddrinfo(server);
+		return listen_socket;
+	}
+
+	// MSDN: "IPV6_V6ONLY - When this value is zero, a socket created for the AF_INET6 address family
+	// can be used to send and receive packets to and from an IPv6 address or an IPv4 address.
+	// Note that the ability to interact with an IPv4 address requires the use of IPv4 mapped addresses."
+	DWORD ipv6_only = 0;
+	int ipv6_only_set_result = ppchat_set_socket_option(listen_socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &ipv6_only, sizeof(ipv6_only));
+	if (ipv6_only_set_result == SOCKET_ERROR) {
+		int error = get_last_socket_error();
+		log_error("Couldn't turn off IPV6_V6ONLY. This means that no connection to IPv4 address can be made. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+	}
+
+	int bind_result = ppchat_bind(listen_socket, server->ai_addr, (int) server->ai_addrlen);
+	freeaddrinfo(server);
+	if (bind_result == SOCKET_ERROR) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		ppchat_close_socket(&listen_socket);
+		return listen_socket;
+	}
+
+	int listen_result = ppchat_listen(listen_socket, SOMAXCONN);
+	if (listen_result == SOCKET_ERROR) {
+		if (out_error)
+			*out_error = get_last_socket_error();
+
+		ppchat_close_socket(&listen_socket);
+		return listen_socket;
+	}
+
+	if (out_error)
+		*out_error = 0;
+
+	return listen_socket;
+}
+
+typedef struct ConnectAttempt {
+	Socket   socket;
+	uint64_t start_timestamp;
+} ConnectAttempt;
+
+// Takes turns between address families, starting with the one `getaddrinfo` preferred,
+// and keeps its order within each family (RFC 8305, section 4).
+int order_connect_addresses(addrinfo *addresses, addrinfo **out_ordered, int max_count) {
+	int first_family = (addresses) ? addresses->ai_family : AF_UNSPEC;
+	addrinfo *first = addresses;
+	addrinfo *other = addresses;
+
+	int count = 0;
+	bool first_turn = true;
+	while (count < max_count) {
+		addrinfo **next = (first_turn) ? &first : &other;
+		while (*next && ((*next)->ai_family == first_family) != first_turn)
+			*next = (*next)->ai_next;
+
+		if (*next) {
+			out_ordered[count] = *next;
+			count += 1;
+			*next = (*next)->ai_next;
+		} else if (!first && !other) {
+			break;
+		}
+
+		first_turn = !first_turn;
+	}
+
+	return count;
+}
+
+// Starts a non-blocking connect. Returns false and sets `out_error` if it failed right away.
+bool start_connect_attempt(addrinfo *address, uint64_t now, ConnectAttempt *out_attempt, int *out_error) {
+	Socket socket;
+	socket.handle = WSASocketW(
+		/* Address family */ address->ai_family,
+		/* Socket type    */ address->ai_socktype,
+		/* Protocol       */ address->ai_protocol,
+		/* Protocol info  */ NULL,
+		/* Socket group   */ NULL,
+		/* Flags          */ WSA_FLAG_OVERLAPPED
+	);
+	if (socket.handle == INVALID_SOCKET) {
+		*out_error = get_last_socket_error();
+		log_error("Couldn't create socket. Error: %d - %s", *out_error, get_error_description(*out_error, g_error_message, sizeof(g_error_message)));
+		return false;
+	}
+
+	// MSDN: "IPV6_V6ONLY - When this value is zero, a socket created for the AF_INET6 address family
+	// can be used to send and receive packets to and from an IPv6 address or an IPv4 address.
+	// Note that the ability to interact with an IPv4 address requires the use of IPv4 mapped addresses."
+	if (address->ai_family == AF_INET6) {
+		DWORD ipv6_only = 0;
+		int ipv6_only_set_result = ppchat_set_socket_option(socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &ipv6_only, sizeof(ipv6_only));
+		if (ipv6_only_set_result == SOCKET_ERROR) {
+			int error = get_last_socket_error();
+			log_error("Couldn't turn off IPV6_V6ONLY. This means that no connection to an IPv4 address can be made. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
+		}
+	}
+
+	u_long non_blocking = 1;
+	if (ioctlsocket(socket.handle, FIONBIO, &non_blocking) == SOCKET_ERROR) {
+		*out_error = get_last_socket_error();
+		ppchat_close_socket(&socket);
+		return false;
+	}
+
+	int connection_result = connect(socket.handle, address->ai_addr, (int) address->ai_addrlen);
+	if (connection_result == SOCKET_ERROR && get_last_socket_error() != WSAEWOULDBLOCK) {
+		*out_error = get_last_socket_error();
+		ppchat_close_socket(&socket);
+		return false;
+	}
+
+	out_attempt->socket = socket;
+	out_attempt->start_timestamp = now;
+	return true;
+}
+
+// Races the addresses the Happy Eyeballs way, see `ppchat_connect`.
 Socket ppchat_connect_with_hints(const char *server_ip, const char *server_port, int *out_error, addrinfo *hints) {
 	Socket socket;
 	socket.handle = INVALID_SOCKET;
@@ -154,38 +310,124 @@ Socket ppchat_connect_with_hints(const char *server_ip, const char *server_port,
 		return socket;
 	}
 
-	addrinfo *server = NULL;
+	addrinfo *candidates[PPCHAT_CONNECT_MAX_ADDRESSES];
+	int candidates_count = order_connect_addresses(available_server_addresses, candidates, PPCHAT_CONNECT_MAX_ADDRESSES);
+	int next_candidate = 0;
+
+	ConnectAttempt attempts[PPCHAT_CONNECT_MAX_ATTEMPTS];
+	int attempts_count = 0;
+
+	uint64_t frequency = ppchat_get_timestamp_frequency();
+	uint64_t attempt_delay = PPCHAT_CONNECT_ATTEMPT_DELAY_MS * frequency / 1000;
+	uint64_t attempt_timeout = PPCHAT_CONNECT_ATTEMPT_TIMEOUT_MS * frequency / 1000;
+	uint64_t start_timestamp = ppchat_get_timestamp();
+	uint64_t stop_timestamp = start_timestamp + PPCHAT_CONNECT_TIMEOUT_MS * frequency / 1000;
+	uint64_t next_attempt_timestamp = start_timestamp;
+
 	int error = 0;
-	for (server = available_server_addresses; server != NULL; server = server->ai_next) {
-		socket.handle = WSASocketW(
-			/* Address family */ server->ai_family,
-			/* Socket type    */ server->ai_socktype,
-			/* Protocol       */ server->ai_protocol,
-			/* Protocol info  */ NULL,
-			/* Socket group   */ NULL,
-			/* Flags          */ WSA_FLAG_OVERLAPPED
-		);
-		if (socket.handle == INVALID_SOCKET) {
-			error = get_last_socket_error();
-			log_error("Couldn't create socket. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-			if (out_error)
-				*out_error = error;
+	while (socket.handle == INVALID_SOCKET) {
+		uint64_t now = ppchat_get_timestamp();
+		if (now >= stop_timestamp) {
+			error = WSAETIMEDOUT;
+			break;
+		}
+
+		// Next address gets its turn once the one before has had its head start, or
+		// right away when an attempt fails.
+		bool can_start = next_candidate < candidates_count && attempts_count < PPCHAT_CONNECT_MAX_ATTEMPTS;
+		if (can_start && now >= next_attempt_timestamp) {
+			if (start_connect_attempt(candidates[next_candidate], now, &attempts[attempts_count], &error)) {
+				attempts_count += 1;
+				next_attempt_timestamp = now + attempt_delay;
+			} else {
+				next_attempt_timestamp = now;
+			}
+
+			next_candidate += 1;
+			continue;
+		}
+
+		if (attempts_count == 0)
+			break;
 
-			return socket;
+		// Sleeps until an attempt is done, the next one is due, or one of them times out.
+		uint64_t wake_timestamp = stop_timestamp;
+		if (can_start)
+			wake_timestamp = min(wake_timestamp, next_attempt_timestamp);
+
+		fd_set connected;
+		fd_set failed;
+		FD_ZERO(&connected);
+		FD_ZERO(&failed);
+		for (int i = 0; i < attempts_count; i += 1) {
+			FD_SET(attempts[i].socket.handle, &connected);
+			FD_SET(attempts[i].socket.handle, &failed);
+			wake_timestamp = min(wake_timestamp, attempts[i].start_timestamp + attempt_timeout);
 		}
 
-		int connection_result = connect(socket.handle, server->ai_addr, (int) server->ai_addrlen);
-		if (connection_result == SOCKET_ERROR) {
+		uint64_t wait_us = (wake_timestamp > now) ? (wake_timestamp - now) * 1000000 / frequency + 1 : 0;
+		timeval timeout;
+		timeout.tv_sec = (long) (wait_us / 1000000);
+		timeout.tv_usec = (long) (wait_us % 1000000);
+
+		// Connects that succeed show up as writable, and the ones that fail in the
+		// exception set. The socket error tells for sure either way.
+		int ready_count = select(0, NULL, &connected, &failed, &timeout);
+		if (ready_count == SOCKET_ERROR) {
 			error = get_last_socket_error();
-			ppchat_close_socket(&socket);
-			continue;
+			break;
 		}
 
-		break;
+		now = ppchat_get_timestamp();
+		for (int i = 0; i < attempts_count && socket.handle == INVALID_SOCKET; ) {
+			ConnectAttempt *attempt = &attempts[i];
+			int attempt_error = 0;
+			bool done = FD_ISSET(attempt->socket.handle, &connected) || FD_ISSET(attempt->socket.handle, &failed);
+			if (done) {
+				int option_length = sizeof(attempt_error);
+				if (ppchat_get_socket_option(attempt->socket, SOL_SOCKET, SO_ERROR, (char *) &attempt_error, &option_length) == SOCKET_ERROR)
+					attempt_error = get_last_socket_error();
+			}
+
+			if (done && attempt_error == 0) {
+				socket = attempt->socket;
+				attempts[i] = attempts[attempts_count - 1];
+				attempts_count -= 1;
+				break;
+			}
+
+			if (done) {
+				error = attempt_error;
+			} else if (now - attempt->start_timestamp >= attempt_timeout) {
+				error = WSAETIMEDOUT;
+			} else {
+				i += 1;
+				continue;
+			}
+
+			ppchat_close_socket(&attempt->socket);
+			attempts[i] = attempts[attempts_count - 1];
+			attempts_count -= 1;
+			next_attempt_timestamp = now;
+		}
 	}
 
+	for (int i = 0; i < attempts_count; i += 1)
+		ppchat_close_socket(&attempts[i].socket);
+
 	freeaddrinfo(available_server_addresses);
 
+	// Sends expect a blocking socket, like they'd get from a plain connect.
+	if (socket.handle != INVALID_SOCKET) {
+		u_long non_blocking = 0;
+		if (ioctlsocket(socket.handle, FIONBIO, &non_blocking) == SOCKET_ERROR) {
+			error = get_last_socket_error();
+			ppchat_close_socket(&socket);
+		} else {
+			error = 0;
+		}
+	}
+
 	if (out_error)
 		*out_error = error;
 
@@ -211,120 +453,33 @@ char *ppchat_ipv4_binary_to_string(uint32_t ipv4_binary, char *out_ipv4_string,
 }
 
 void *ppchat_hton_bytes(void *host_bytes, size_t host_bytes_count, void *out_network_bytes, size_t out_network_bytes_count) {
-	int host_byte_index = host_bytes_count - 1;
-	int network_byte_index = 0;
-
-	char *host_bytes_array = (char *) host_bytes;
-	char *out_network_bytes_array = (char *) out_network_bytes;
-	
-	while (host_byte_index >= 0 && network_byte_index < out_network_bytes_count) {
-		out_network_bytes_array[network_byte_index] = host_bytes_array[host_byte_index];
-
-		host_byte_index -= 1;
-		network_byte_index += 1;
-	}
-	
+	// Most significant bytes come first on the wire, so a shorter output keeps the high end of the value.
+	size_t size = min(host_bytes_count, out_network_bytes_count);
+	ppchat_reverse_bytes((char *) host_bytes + host_bytes_count - size, out_network_bytes, size);
 	return out_network_bytes;
 }
 
 void *ppchat_ntoh_bytes(void *network_bytes, size_t network_bytes_count, void *out_host_bytes, size_t out_host_bytes_count) {
-	int network_byte_index = 0; 
-	int host_byte_index = out_host_bytes_count - 1;
-
-	char *network_bytes_array = (char *) network_bytes;
-	char *out_host_bytes_array = (char *) out_host_bytes;
-
-	while (network_byte_index < network_bytes_count && host_byte_index >= 0) {
-		out_host_bytes_array[host_byte_index] = network_bytes_array[network_byte_index];
-
-		network_byte_index += 1;
-		host_byte_index -= 1;
-	}
-
+	size_t size = min(network_bytes_count, out_host_bytes_count);
+	ppchat_reverse_bytes(network_bytes, (char *) out_host_bytes + out_host_bytes_count - size, size);
 	return out_host_bytes;
 }
 
 Socket ppchat_connect(const char *server_ip, const char *server_port, int *out_error) {
-	Socket socket;
-	socket.handle = INVALID_SOCKET;
-
 	addrinfo hints = { };
 
 	// ai - address info.
-	hints.ai_family = AF_INET6;
+	// Both families, so that IPv6 and IPv4 addresses of a name can race each other.
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	// MSDN: "If the AI_V4MAPPED bit is set and a request for IPv6 addresses fails,
-	// a name service request is made for IPv4 addresses and these addresses are
-	// converted to IPv4-mapped IPv6 address format."
-	hints.ai_flags |= AI_V4MAPPED;
-
 	// MSDN: "When the AI_CANONNAME bit is set and the getaddrinfo function returns success,
 	// the ai_canonname member in the ppResult parameter points to a NULL-terminated string
 	// that contains the canonical name of the specified node."
 	hints.ai_flags |= AI_CANONNAME;
 
-	addrinfo *available_server_addresses = NULL;
-	int server_address_info_result = getaddrinfo(
-		/* Node name (IP)      */ server_ip,
-		/* Service name (port) */ server_port,
-		/* Address info hints  */ &hints,
-		/* Result array        */ &available_server_addresses // Iteration through array of results is done by result->ai_next.
-	);
-	if (server_address_info_result != 0) {
-		if (out_error)
-			*out_error = server_address_info_result;
-
-		return socket;
-	}
-
-	addrinfo *server = NULL;
-	int error = 0;
-	for (server = available_server_addresses; server != NULL; server = server->ai_next) {
-		socket.handle = WSASocketW(
-			/* Address family */ server->ai_family,
-			/* Socket type    */ server->ai_socktype,
-			/* Protocol       */ server->ai_protocol,
-			/* Protocol info  */ NULL,
-			/* Socket group   */ NULL,
-			/* Flags          */ WSA_FLAG_OVERLAPPED
-		);
-		if (socket.handle == INVALID_SOCKET) {
-			error = get_last_socket_error();
-			log_error("Couldn't create socket. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-			if (out_error)
-				*out_error = error;
-
-			return socket;
-		}
-
-		// MSDN: "IPV6_V6ONLY - When this value is zero, a socket created for the AF_INET6 address family
-		// can be used to send and receive packets to and from an IPv6 address or an IPv4 address.
-		// Note that the ability to interact with an IPv4 address requires the use of IPv4 mapped addresses."
-		DWORD ipv6_only = 0;
-		int ipv6_only_set_result = ppchat_set_socket_option(socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &ipv6_only, sizeof(ipv6_only));
-		if (ipv6_only_set_result == SOCKET_ERROR) {
-			int error = get_last_socket_error();
-			log_error("Couldn't turn off IPV6_V6ONLY. This means that no connection to an IPv4 address can be made. Error: %d - %s", error, get_error_description(error, g_error_message, sizeof(g_error_message)));
-		}
-
-		int connection_result = connect(socket.handle, server->ai_addr, (int) server->ai_addrlen);
-		if (connection_result == SOCKET_ERROR) {
-			error = get_last_socket_error();
-			ppchat_close_socket(&socket);
-			continue;
-		}
-
-		break;
-	}
-
-	freeaddrinfo(available_server_addresses);
-
-	if (out_error)
-		*out_error = error;
-
-	return socket;
+	return ppchat_connect_with_hints(server_ip, server_port, out_error, &hints);
 }
 
 int ppchat_set_socket_option(Socket socket, int level, int option, const char *option_value, int option_length) {
@@ -350,8 +505,9 @@ int ppchat_receive(Socket socket, char *receive_buffer, int receive_buffer_size,
 }
 
 int ppchat_close_socket(Socket *socket) {
+	SOCKET handle = (SOCKET) socket->handle;
 	socket->handle = INVALID_SOCKET;
-	return closesocket(socket->handle);
+	return closesocket(handle);
 }
 
 int ppchat_send(Socket socket, char *send_buffer, int send_buffer_size, int flags) {
@@ -0,0 +1,201 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_stats.h"
+
+#include <stdlib.h>
+#include <intrin.h>
+#include <assert.h>
+
+static struct {
+	SRWLOCK       shards_lock;
+	StatsShard   *shards[PPCHAT_STATS_MAX_THREADS];
+	volatile LONG shards_count;
+
+	// For threads that came after all shards were taken.
+	StatsShard   *shared_shard;
+} g_stats = { SRWLOCK_INIT };
+
+static thread_local StatsShard *g_thread_stats_shard;
+
+// Single writer: a plain read-modify-write, but done so readers never see a torn value.
+static void add_to_slot(uint64_t *slot, uint64_t value, bool shared) {
+	volatile LONG64 *volatile_slot = (volatile LONG64 *) slot;
+	if (shared)
+		InterlockedAdd64(volatile_slot, (LONG64) value);
+	else
+		WriteNoFence64(volatile_slot, ReadNoFence64(volatile_slot) + (LONG64) value);
+}
+
+static uint64_t read_slot(uint64_t *slot) {
+	return (uint64_t) ReadNoFence64((volatile LONG64 *) slot);
+}
+
+int ppchat_histogram_get_bucket(uint64_t value) {
+	const uint64_t exact_values_count = 2 * PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT;
+	if (value < exact_values_count)
+		return (int) value;
+
+	unsigned long most_significant_bit;
+	_BitScanReverse64(&most_significant_bit, value);
+
+	// Keep the top bits of the value: the highest set bit and the ones that pick the sub-bucket.
+	int shift = (int) most_significant_bit - PPCHAT_HISTOGRAM_SUB_BUCKETS_BITS;
+	int sub_bucket = (int) (value >> shift);
+	return shift * PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT + sub_bucket;
+}
+
+uint64_t ppchat_histogram_get_bucket_max_value(int bucket) {
+	if (bucket < 2 * PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT)
+		return (uint64_t) bucket;
+
+	int shift = bucket / PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT - 1;
+	uint64_t sub_bucket = (uint64_t) (bucket - shift * PPCHAT_HISTOGRAM_SUB_BUCKETS_COUNT);
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void ppchat_histogram_reset(Histogram *histogram) {
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+static void record_into_histogram(Histogram *histogram, uint64_t value, bool shared) {
+	add_to_slot(&histogram->counts[ppchat_histogram_get_bucket(value)], 1, shared);
+	add_to_slot(&histogram->total_count, 1, shared);
+
+	volatile LONG64 *max_value = (volatile LONG64 *) &histogram->max_value;
+	if (shared) {
+		LONG64 observed = ReadNoFence64(max_value);
+		while ((uint64_t) observed < value) {
+			LONG64 previous = InterlockedCompareExchange64(max_value, (LONG64) value, observed);
+			if (previous == observed)
+				break;
+
+			observed = previous;
+		}
+	} else if (value > histogram->max_value) {
+		WriteNoFence64(max_value, (LONG64) value);
+	}
+}
+
+void ppchat_histogram_record(Histogram *histogram, uint64_t value) {
+	record_into_histogram(histogram, value, false);
+}
+
+void ppchat_histogram_record_corrected(Histogram *histogram, uint64_t value, uint64_t expected_interval) {
+	record_into_histogram(histogram, value, false);
+	if (expected_interval == 0 || value <= expected_interval)
+		return;
+
+	for (uint64_t missing_value = value - expected_interval; missing_value >= expected_interval; missing_value -= expected_interval)
+		record_into_histogram(histogram, missing_value, false);
+}
+
+void ppchat_histogram_merge(Histogram *out_histogram, Histogram *histogram) {
+	for (int i = 0; i < PPCHAT_HISTOGRAM_BUCKETS_COUNT; i += 1)
+		out_histogram->counts[i] += read_slot(&histogram->counts[i]);
+
+	out_histogram->total_count += read_slot(&histogram->total_count);
+	out_histogram->max_value = max(out_histogram->max_value, read_slot(&histogram->max_value));
+}
+
+uint64_t ppchat_histogram_get_percentile(Histogram *histogram, double percentile) {
+	// Buckets are read one by one while the writer may still be going, so go by
+	// their sum rather than `total_count`.
+	uint64_t total_count = 0;
+	for (int i = 0; i < PPCHAT_HISTOGRAM_BUCKETS_COUNT; i += 1)
+		total_count += histogram->counts[i];
+
+	if (total_count == 0)
+		return 0;
+
+	percentile = min(max(percentile, 0.0), 100.0);
+	uint64_t target_count = (uint64_t) ((percentile / 100.0) * (double) total_count + 0.5);
+	target_count = max(target_count, (uint64_t) 1);
+
+	uint64_t seen_count = 0;
+	for (int i = 0; i < PPCHAT_HISTOGRAM_BUCKETS_COUNT; i += 1) {
+		seen_count += histogram->counts[i];
+		if (seen_count >= target_count)
+			return min(ppchat_histogram_get_bucket_max_value(i), histogram->max_value);
+	}
+
+	return histogram->max_value;
+}
+
+static StatsShard *create_stats_shard(bool shared) {
+	StatsShard *shard = (StatsShard *) _aligned_malloc(sizeof(StatsShard), PPCHAT_CACHE_LINE_SIZE);
+	if (shard) {
+		memset(shard, 0, sizeof(*shard));
+		shard->shared = shared;
+	}
+
+	return shard;
+}
+
+static StatsShard *get_thread_stats_shard() {
+	StatsShard *shard = g_thread_stats_shard;
+	if (shard)
+		return shard;
+
+	AcquireSRWLockExclusive(&g_stats.shards_lock);
+	if (g_stats.shards_count < PPCHAT_STATS_MAX_THREADS) {
+		shard = create_stats_shard(false);
+		if (shard) {
+			g_stats.shards[g_stats.shards_count] = shard;
+			WriteRelease(&g_stats.shards_count, g_stats.shards_count + 1);
+		}
+	}
+
+	if (!shard) {
+		if (!g_stats.shared_shard)
+			g_stats.shared_shard = create_stats_shard(true);
+
+		shard = g_stats.shared_shard;
+	}
+	ReleaseSRWLockExclusive(&g_stats.shards_lock);
+
+	// Shards outlive their threads, their numbers still count.
+	g_thread_stats_shard = shard;
+	return shard;
+}
+
+void ppchat_stats_add(int counter, uint64_t value) {
+	assert(counter >= 0 && counter < PPCHAT_STATS_MAX_COUNTERS);
+
+	StatsShard *shard = get_thread_stats_shard();
+	if (shard)
+		add_to_slot(&shard->counters[counter], value, shard->shared);
+}
+
+void ppchat_stats_record(int histogram, uint64_t value) {
+	assert(histogram >= 0 && histogram < PPCHAT_STATS_MAX_HISTOGRAMS);
+
+	StatsShard *shard = get_thread_stats_shard();
+	if (shard)
+		record_into_histogram(&shard->histograms[histogram], value, shard->shared);
+}
+
+uint64_t ppchat_stats_get_counter(int counter) {
+	uint64_t sum = 0;
+
+	AcquireSRWLockShared(&g_stats.shards_lock);
+	for (LONG i = 0; i < g_stats.shards_count; i += 1)
+		sum += read_slot(&g_stats.shards[i]->counters[counter]);
+
+	if (g_stats.shared_shard)
+		sum += read_slot(&g_stats.shared_shard->counters[counter]);
+	ReleaseSRWLockShared(&g_stats.shards_lock);
+
+	return sum;
+}
+
+void ppchat_stats_get_histogram(int histogram, Histogram *out_histogram) {
+	ppchat_histogram_reset(out_histogram);
+
+	AcquireSRWLockShared(&g_stats.shards_lock);
+	for (LONG i = 0; i < g_stats.shards_count; i += 1)
+		ppchat_histogram_merge(out_histogram, &g_stats.shards[i]->histograms[histogram]);
+
+	if (g_stats.shared_shard)
+		ppchat_histogram_merge(out_histogram, &g_stats.shared_shard->histograms[histogram]);
+	ReleaseSRWLockShared(&g_stats.shards_lock);
+}
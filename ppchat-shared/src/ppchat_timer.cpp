@@ -0,0 +1,191 @@
+#include "../include/ppchat_timer.h"
+
+#include <intrin.h>
+
+static const uint64_t TIMER_SLOT_MASK = PPCHAT_TIMER_WHEEL_SLOTS - 1;
+
+// Furthest a timer can be placed, further ones are placed this far and moved again.
+static const uint64_t TIMER_MAX_DELTA = (1ull << (PPCHAT_TIMER_WHEEL_LEVELS * PPCHAT_TIMER_WHEEL_SLOT_BITS)) - 1;
+
+static void link_timer(TimerWheel *wheel, Timer *timer) {
+	uint64_t delta = (timer->expiry_tick > wheel->current_tick) ? timer->expiry_tick - wheel->current_tick : 0;
+	if (delta > TIMER_MAX_DELTA)
+		delta = TIMER_MAX_DELTA;
+
+	int level = 0;
+	while (level < PPCHAT_TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << ((level + 1) * PPCHAT_TIMER_WHEEL_SLOT_BITS)))
+		level += 1;
+
+	uint64_t slot_tick = wheel->current_tick + delta;
+	int slot_index = (int) ((slot_tick >> (level * PPCHAT_TIMER_WHEEL_SLOT_BITS)) & TIMER_SLOT_MASK);
+
+	Timer **slot = &wheel->slots[level][slot_index];
+	timer->slot = slot;
+	timer->previous = NULL;
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->previous = timer;
+
+	*slot = timer;
+	wheel->occupied_slots[level] |= 1ull << slot_index;
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+	if (timer->previous)
+		timer->previous->next = timer->next;
+	else
+		*timer->slot = timer->next;
+
+	if (timer->next)
+		timer->next->previous = timer->previous;
+
+	if (*timer->slot == NULL) {
+		// Slot pointers are laid out level by level, so the index tells both.
+		ptrdiff_t index = timer->slot - &wheel->slots[0][0];
+		wheel->occupied_slots[index / PPCHAT_TIMER_WHEEL_SLOTS] &= ~(1ull << (index % PPCHAT_TIMER_WHEEL_SLOTS));
+	}
+
+	timer->slot = NULL;
+	timer->previous = NULL;
+	timer->next = NULL;
+}
+
+// Moves every timer of the current slot of `level` to the levels below.
+static void cascade(TimerWheel *wheel, int level) {
+	int slot_index = (int) ((wheel->current_tick >> (level * PPCHAT_TIMER_WHEEL_SLOT_BITS)) & TIMER_SLOT_MASK);
+
+	Timer *timer = wheel->slots[level][slot_index];
+	wheel->slots[level][slot_index] = NULL;
+	wheel->occupied_slots[level] &= ~(1ull << slot_index);
+
+	while (timer) {
+		Timer *next = timer->next;
+		link_timer(wheel, timer);
+		wheel->cascaded_count += 1;
+		timer = next;
+	}
+}
+
+static int process_tick(TimerWheel *wheel) {
+	uint64_t tick = wheel->current_tick;
+
+	if ((tick & TIMER_SLOT_MASK) == 0) {
+		// Highest level whose slot changes at this tick, upper levels first so that
+		// what they hand down is moved on in the same tick if it has to be.
+		int top_level = 1;
+		while (top_level < PPCHAT_TIMER_WHEEL_LEVELS - 1 && ((tick >> (top_level * PPCHAT_TIMER_WHEEL_SLOT_BITS)) & TIMER_SLOT_MASK) == 0)
+			top_level += 1;
+
+		for (int level = top_level; level >= 1; level -= 1)
+			cascade(wheel, level);
+	}
+
+	// Callbacks can arm and cancel any timer, this one included. Whatever they arm is at
+	// least a tick ahead and lands in another slot, so taking the first timer until the
+	// slot is empty sees every timer that is due and nothing else.
+	int fired_count = 0;
+	Timer **slot = &wheel->slots[0][tick & TIMER_SLOT_MASK];
+	while (*slot) {
+		Timer *timer = *slot;
+		unlink_timer(wheel, timer);
+		wheel->armed_count -= 1;
+		wheel->fired_count += 1;
+		fired_count += 1;
+
+		timer->callback(timer, timer->argument);
+	}
+
+	return fired_count;
+}
+
+void ppchat_timer_wheel_init(TimerWheel *wheel, uint32_t tick_ms, uint64_t now_ms) {
+	memset(wheel, 0, sizeof(TimerWheel));
+	wheel->tick_ms = (tick_ms > 0) ? tick_ms : 1;
+	wheel->start_ms = now_ms;
+}
+
+void ppchat_timer_init(Timer *timer, TimerCallback callback, void *argument) {
+	memset(timer, 0, sizeof(Timer));
+	timer->callback = callback;
+	timer->argument = argument;
+}
+
+void ppchat_timer_arm(TimerWheel *wheel, Timer *timer, uint32_t delay_ms) {
+	if (timer->slot)
+		unlink_timer(wheel, timer);
+	else
+		wheel->armed_count += 1;
+
+	// The wheel may have been advanced up to a tick ago, hence the extra one.
+	uint64_t delay_ticks = ((uint64_t) delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	timer->expiry_tick = wheel->current_tick + 1 + delay_ticks;
+	link_timer(wheel, timer);
+}
+
+void ppchat_timer_cancel(TimerWheel *wheel, Timer *timer) {
+	if (!timer->slot)
+		return;
+
+	unlink_timer(wheel, timer);
+	wheel->armed_count -= 1;
+}
+
+bool ppchat_timer_is_armed(Timer *timer) {
+	return timer->slot != NULL;
+}
+
+int ppchat_timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms) {
+	if (now_ms < wheel->start_ms)
+		return 0;
+
+	uint64_t target_tick = (now_ms - wheel->start_ms) / wheel->tick_ms;
+
+	int fired_count = 0;
+	while (wheel->current_tick < target_tick) {
+		if (wheel->armed_count == 0) {
+			wheel->current_tick = target_tick;
+			break;
+		}
+
+		if (wheel->occupied_slots[0] == 0) {
+			// Nothing happens until the lowest level wraps around and the levels
+			// above hand something down.
+			uint64_t next_cascade_tick = (wheel->current_tick | TIMER_SLOT_MASK) + 1;
+			if (next_cascade_tick > target_tick) {
+				wheel->current_tick = target_tick;
+				break;
+			}
+
+			wheel->current_tick = next_cascade_tick - 1;
+		}
+
+		wheel->current_tick += 1;
+		fired_count += process_tick(wheel);
+	}
+
+	return fired_count;
+}
+
+DWORD ppchat_timer_wheel_get_timeout(TimerWheel *wheel, uint64_t now_ms) {
+	if (wheel->armed_count == 0)
+		return INFINITE;
+
+	// Ticks until the lowest level wraps around, upper levels can hand something down then.
+	uint64_t ticks = PPCHAT_TIMER_WHEEL_SLOTS - (wheel->current_tick & TIMER_SLOT_MASK);
+
+	// Rotate so that bit 0 is the slot of the next tick.
+	int next_slot = (int) ((wheel->current_tick + 1) & TIMER_SLOT_MASK);
+	uint64_t occupied = wheel->occupied_slots[0];
+	occupied = (occupied >> next_slot) | (occupied << ((PPCHAT_TIMER_WHEEL_SLOTS - next_slot) & TIMER_SLOT_MASK));
+
+	unsigned long first_occupied;
+	if (_BitScanForward64(&first_occupied, occupied) && first_occupied + 1 < ticks)
+		ticks = first_occupied + 1;
+
+	uint64_t due_ms = wheel->start_ms + (wheel->current_tick + ticks) * wheel->tick_ms;
+	if (due_ms <= now_ms)
+		return 0;
+
+	uint64_t timeout = due_ms - now_ms;
+	return (timeout < INFINITE) ? (DWORD) timeout : INFINITE - 1;
+}
@@ -0,0 +1,478 @@
+#include "../include/ppchat_topics.h"
+
+// Levels a pattern can have at most, with every one of them a single character.
+static const int TOPIC_MAX_LEVELS = PPCHAT_TOPIC_MAX_SIZE / 2 + 1;
+
+// End of the level that starts at `position`: the dot after it or the end of the text.
+static int get_level_end(const char *text, int size, int position) {
+	const char *dot = (const char *) memchr(text + position, '.', size - position);
+	return (dot) ? (int) (dot - text) : size;
+}
+
+static bool is_wildcard_level(const char *text, int position, int end, char wildcard) {
+	return end - position == 1 && text[position] == wildcard;
+}
+
+static bool is_valid(const char *text, int size, bool pattern) {
+	if (size <= 0 || size > PPCHAT_TOPIC_MAX_SIZE)
+		return false;
+
+	for (int position = 0; position <= size; ) {
+		int end = get_level_end(text, size, position);
+		if (end == position)
+			return false;
+
+		bool wildcard = pattern && (is_wildcard_level(text, position, end, '*') || (is_wildcard_level(text, position, end, '#') && end == size));
+		for (int i = position; i < end && !wildcard; i += 1) {
+			unsigned char character = (unsigned char) text[i];
+			if (character <= ' ' || character == 0x7F || character == '*' || character == '#')
+				return false;
+		}
+
+		position = end + 1;
+	}
+
+	return true;
+}
+
+bool ppchat_topic_is_valid(const char *topic, int topic_size) {
+	return is_valid(topic, topic_size, false);
+}
+
+bool ppchat_topic_pattern_is_valid(const char *pattern, int pattern_size) {
+	return is_valid(pattern, pattern_size, true);
+}
+
+static bool add_subscriber(TopicSubscribers *subscribers, uint32_t subscriber) {
+	if (subscribers->count == subscribers->capacity) {
+		int new_capacity = max(subscribers->capacity * 2, 4);
+		uint32_t *new_items = (uint32_t *) realloc(subscribers->items, (size_t) new_capacity * sizeof(uint32_t));
+		if (!new_items)
+			return false;
+
+		subscribers->items = new_items;
+		subscribers->capacity = new_capacity;
+	}
+
+	subscribers->items[subscribers->count] = subscriber;
+	subscribers->count += 1;
+	return true;
+}
+
+static bool remove_subscriber(TopicSubscribers *subscribers, uint32_t subscriber) {
+	for (int i = 0; i < subscribers->count; i += 1) {
+		if (subscribers->items[i] == subscriber) {
+			subscribers->items[i] = subscribers->items[subscribers->count - 1];
+			subscribers->count -= 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static TopicNode *create_node(TopicRouter *router, const char *label, int label_size) {
+	TopicNode *node = (TopicNode *) calloc(1, sizeof(TopicNode));
+	if (!node)
+		return NULL;
+
+	if (label_size > 0) {
+		node->label = (char *) malloc(label_size);
+		if (!node->label) {
+			free(node);
+			return NULL;
+		}
+
+		memcpy(node->label, label, label_size);
+		node->label_size = label_size;
+		node->first_level_size = get_level_end(label, label_size, 0);
+	}
+
+	router->nodes_count += 1;
+	return node;
+}
+
+// Frees everything below the node and what it holds, but not the node itself.
+static void destroy_subtree(TopicRouter *router, TopicNode *node) {
+	for (int i = 0; i < node->children_count; i += 1) {
+		destroy_subtree(router, node->children[i]);
+		free(node->children[i]);
+		router->nodes_count -= 1;
+	}
+
+	if (node->any_child) {
+		destroy_subtree(router, node->any_child);
+		free(node->any_child);
+		router->nodes_count -= 1;
+	}
+
+	free(node->children);
+	free(node->label);
+	free(node->subscribers.items);
+	free(node->rest_subscribers.items);
+}
+
+void ppchat_topic_router_init(TopicRouter *router) {
+	memset(router, 0, sizeof(*router));
+	router->nodes_count = 1;
+}
+
+void ppchat_topic_router_destroy(TopicRouter *router) {
+	destroy_subtree(router, &router->root);
+	ppchat_topic_router_init(router);
+}
+
+// Index of the literal edge whose first level is `level`, or where it would go.
+static int find_child(TopicNode *node, const char *level, int level_size, bool *out_found) {
+	int low = 0;
+	int high = node->children_count;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		TopicNode *child = node->children[middle];
+		int order = memcmp(child->label, level, min(child->first_level_size, level_size));
+		if (order == 0)
+			order = child->first_level_size - level_size;
+
+		if (order == 0) {
+			*out_found = true;
+			return middle;
+		}
+
+		if (order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	*out_found = false;
+	return low;
+}
+
+static bool insert_child(TopicNode *node, int index, TopicNode *child) {
+	if (node->children_count == node->children_capacity) {
+		int new_capacity = max(node->children_capacity * 2, 2);
+		TopicNode **new_children = (TopicNode **) realloc(node->children, (size_t) new_capacity * sizeof(TopicNode *));
+		if (!new_children)
+			return false;
+
+		node->children = new_children;
+		node->children_capacity = new_capacity;
+	}
+
+	memmove(&node->children[index + 1], &node->children[index], (size_t) (node->children_count - index) * sizeof(TopicNode *));
+	node->children[index] = child;
+	node->children_count += 1;
+	return true;
+}
+
+// Bytes of the whole levels the label and the text start with alike.
+static int get_common_levels_size(const char *label, int label_size, const char *text, int text_size) {
+	int common_size = 0;
+	for (int i = 0; ; i += 1) {
+		bool label_ends = (i == label_size || label[i] == '.');
+		bool text_ends = (i == text_size || text[i] == '.');
+		if (label_ends != text_ends)
+			break;
+
+		if (label_ends) {
+			common_size = i;
+			if (i == label_size || i == text_size)
+				break;
+		} else if (label[i] != text[i]) {
+			break;
+		}
+	}
+
+	return common_size;
+}
+
+bool ppchat_topic_router_subscribe(TopicRouter *router, const char *pattern, int pattern_size, uint32_t subscriber) {
+	TopicNode *node = &router->root;
+	int position = 0;
+	while (position <= pattern_size) {
+		int end = get_level_end(pattern, pattern_size, position);
+
+		if (is_wildcard_level(pattern, position, end, '#')) {
+			if (!add_subscriber(&node->rest_subscribers, subscriber))
+				return false;
+
+			router->subscriptions_count += 1;
+			return true;
+		}
+
+		if (is_wildcard_level(pattern, position, end, '*')) {
+			if (!node->any_child) {
+				node->any_child = create_node(router, NULL, 0);
+				if (!node->any_child)
+					return false;
+			}
+
+			node = node->any_child;
+			position = end + 1;
+			continue;
+		}
+
+		bool found = false;
+		int index = find_child(node, pattern + position, end - position, &found);
+		if (!found) {
+			// Literal levels up to the next wildcard go on a single edge.
+			int label_end = end;
+			while (label_end < pattern_size) {
+				int next_end = get_level_end(pattern, pattern_size, label_end + 1);
+				if (is_wildcard_level(pattern, label_end + 1, next_end, '*') || is_wildcard_level(pattern, label_end + 1, next_end, '#'))
+					break;
+
+				label_end = next_end;
+			}
+
+			TopicNode *child = create_node(router, pattern + position, label_end - position);
+			if (!child)
+				return false;
+
+			if (!insert_child(node, index, child)) {
+				destroy_subtree(router, child);
+				free(child);
+				router->nodes_count -= 1;
+				return false;
+			}
+
+			node = child;
+			position = label_end + 1;
+			continue;
+		}
+
+		TopicNode *child = node->children[index];
+		int common_size = get_common_levels_size(child->label, child->label_size, pattern + position, pattern_size - position);
+		if (common_size < child->label_size) {
+			// Pattern branches off in the middle of the edge, which is split there.
+			TopicNode *middle = create_node(router, child->label, common_size);
+			if (!middle)
+				return false;
+
+			if (!insert_child(middle, 0, child)) {
+				destroy_subtree(router, middle);
+				free(middle);
+				router->nodes_count -= 1;
+				return false;
+			}
+
+			child->label_size -= common_size + 1;
+			memmove(child->label, child->label + common_size + 1, child->label_size);
+			child->first_level_size = get_level_end(child->label, child->label_size, 0);
+
+			node->children[index] = middle;
+			child = middle;
+		}
+
+		node = child;
+		position += common_size + 1;
+	}
+
+	if (!add_subscriber(&node->subscribers, subscriber))
+		return false;
+
+	router->subscriptions_count += 1;
+	return true;
+}
+
+static bool is_unused(TopicNode *node) {
+	return node->subscribers.count == 0 && node->rest_subscribers.count == 0 && node->children_count == 0 && !node->any_child;
+}
+
+// Joins the node with its only child, if nothing but that child hangs off it.
+static void merge_with_only_child(TopicRouter *router, TopicNode *node) {
+	if (node->label_size == 0 || node->children_count != 1 || node->any_child || node->subscribers.count > 0 || node->rest_subscribers.count > 0)
+		return;
+
+	TopicNode *child = node->children[0];
+	char *label = (char *) realloc(node->label, node->label_size + 1 + child->label_size);
+	if (!label)
+		return;
+
+	label[node->label_size] = '.';
+	memcpy(label + node->label_size + 1, child->label, child->label_size);
+	node->label = label;
+	node->label_size += 1 + child->label_size;
+
+	free(node->children);
+	free(node->subscribers.items);
+	free(node->rest_subscribers.items);
+	node->children = child->children;
+	node->children_count = child->children_count;
+	node->children_capacity = child->children_capacity;
+	node->any_child = child->any_child;
+	node->subscribers = child->subscribers;
+	node->rest_subscribers = child->rest_subscribers;
+
+	free(child->label);
+	free(child);
+	router->nodes_count -= 1;
+}
+
+bool ppchat_topic_router_unsubscribe(TopicRouter *router, const char *pattern, int pattern_size, uint32_t subscriber) {
+	TopicNode *path[TOPIC_MAX_LEVELS + 1];
+	path[0] = &router->root;
+	int depth = 1;
+
+	TopicSubscribers *subscribers = NULL;
+	int position = 0;
+	while (position <= pattern_size && !subscribers) {
+		TopicNode *node = path[depth - 1];
+		int end = get_level_end(pattern, pattern_size, position);
+
+		if (is_wildcard_level(pattern, position, end, '#')) {
+			subscribers = &node->rest_subscribers;
+			continue;
+		}
+
+		if (is_wildcard_level(pattern, position, end, '*')) {
+			if (!node->any_child)
+				return false;
+
+			path[depth] = node->any_child;
+			depth += 1;
+			position = end + 1;
+			continue;
+		}
+
+		bool found = false;
+		int index = find_child(node, pattern + position, end - position, &found);
+		if (!found)
+			return false;
+
+		TopicNode *child = node->children[index];
+		int label_end = position + child->label_size;
+		if (label_end > pattern_size || (label_end < pattern_size && pattern[label_end] != '.') || memcmp(child->label, pattern + position, child->label_size) != 0)
+			return false;
+
+		path[depth] = child;
+		depth += 1;
+		position = label_end + 1;
+	}
+
+	if (!subscribers)
+		subscribers = &path[depth - 1]->subscribers;
+
+	if (!remove_subscriber(subscribers, subscriber))
+		return false;
+
+	router->subscriptions_count -= 1;
+
+	// Nodes left with nothing go away, and the ones left with a single edge are joined
+	// with it again. Nodes above the first one that stays don't change.
+	for (int i = depth - 1; i > 0; i -= 1) {
+		TopicNode *node = path[i];
+		TopicNode *parent = path[i - 1];
+		if (!is_unused(node)) {
+			merge_with_only_child(router, node);
+			break;
+		}
+
+		if (parent->any_child == node) {
+			parent->any_child = NULL;
+		} else {
+			bool found = false;
+			int index = find_child(parent, node->label, node->first_level_size, &found);
+			parent->children_count -= 1;
+			memmove(&parent->children[index], &parent->children[index + 1], (size_t) (parent->children_count - index) * sizeof(TopicNode *));
+		}
+
+		destroy_subtree(router, node);
+		free(node);
+		router->nodes_count -= 1;
+
+		if (i == 1)
+			break;
+
+		// Parent could be down to a single edge now.
+		if (!is_unused(parent)) {
+			merge_with_only_child(router, parent);
+			break;
+		}
+	}
+
+	return true;
+}
+
+static bool collect_subscribers(TopicRecipients *recipients, TopicSubscribers *subscribers) {
+	for (int i = 0; i < subscribers->count; i += 1) {
+		uint32_t subscriber = subscribers->items[i];
+		int word = (int) (subscriber >> 6);
+		uint64_t bit = (uint64_t) 1 << (subscriber & 63);
+
+		if (word >= recipients->seen_words_count) {
+			int new_words_count = max(word + 1, recipients->seen_words_count * 2);
+			uint64_t *new_seen = (uint64_t *) realloc(recipients->seen, (size_t) new_words_count * sizeof(uint64_t));
+			if (!new_seen)
+				return false;
+
+			memset(new_seen + recipients->seen_words_count, 0, (size_t) (new_words_count - recipients->seen_words_count) * sizeof(uint64_t));
+			recipients->seen = new_seen;
+			recipients->seen_words_count = new_words_count;
+		}
+
+		if (recipients->seen[word] & bit)
+			continue;
+
+		if (recipients->count == recipients->capacity) {
+			int new_capacity = max(recipients->capacity * 2, 64);
+			uint32_t *new_subscribers = (uint32_t *) realloc(recipients->subscribers, (size_t) new_capacity * sizeof(uint32_t));
+			if (!new_subscribers)
+				return false;
+
+			recipients->subscribers = new_subscribers;
+			recipients->capacity = new_capacity;
+		}
+
+		recipients->seen[word] |= bit;
+		recipients->subscribers[recipients->count] = subscriber;
+		recipients->count += 1;
+	}
+
+	return true;
+}
+
+// Collects the subscribers of the node and below it that match the rest of the topic,
+// which starts at `position`, or is all matched once that's past its end.
+static bool match_node(TopicNode *node, const char *topic, int topic_size, int position, TopicRecipients *recipients) {
+	bool collected = collect_subscribers(recipients, &node->rest_subscribers);
+	if (position > topic_size)
+		return collect_subscribers(recipients, &node->subscribers) && collected;
+
+	int end = get_level_end(topic, topic_size, position);
+
+	bool found = false;
+	int index = find_child(node, topic + position, end - position, &found);
+	if (found) {
+		TopicNode *child = node->children[index];
+		int label_end = position + child->label_size;
+		if (label_end <= topic_size && (label_end == topic_size || topic[label_end] == '.') && memcmp(child->label, topic + position, child->label_size) == 0)
+			collected = match_node(child, topic, topic_size, label_end + 1, recipients) && collected;
+	}
+
+	if (node->any_child)
+		collected = match_node(node->any_child, topic, topic_size, end + 1, recipients) && collected;
+
+	return collected;
+}
+
+bool ppchat_topic_router_match(TopicRouter *router, const char *topic, int topic_size, TopicRecipients *recipients) {
+	// Only the bits of the last match are set, clearing them costs what collecting them did.
+	for (int i = 0; i < recipients->count; i += 1) {
+		uint32_t subscriber = recipients->subscribers[i];
+		recipients->seen[subscriber >> 6] &= ~((uint64_t) 1 << (subscriber & 63));
+	}
+
+	recipients->count = 0;
+	return match_node(&router->root, topic, topic_size, 0, recipients);
+}
+
+void ppchat_topic_recipients_init(TopicRecipients *recipients) {
+	memset(recipients, 0, sizeof(*recipients));
+}
+
+void ppchat_topic_recipients_destroy(TopicRecipients *recipients) {
+	free(recipients->subscribers);
+	free(recipients->seen);
+	memset(recipients, 0, sizeof(*recipients));
+}
@@ -0,0 +1,730 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../include/ppchat_transfer.h"
+#include "../include/ppchat_checksum.h"
+#include "../include/ppchat_compression.h"
+
+#include <stdlib.h>
+#include <mswsock.h>
+
+static const uint32_t TRANSFER_STATE_MAGIC = 0x54484350; // "PCHT"
+static const uint32_t TRANSFER_STATE_VERSION = 1;
+
+typedef struct TransferStateHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t file_size;
+	uint64_t file_id;
+	uint32_t chunk_size;
+	uint32_t chunks_count;
+} TransferStateHeader;
+
+uint32_t ppchat_get_file_chunks_count(uint64_t file_size) {
+	return (uint32_t) ((file_size + PPCHAT_FILE_CHUNK_SIZE - 1) / PPCHAT_FILE_CHUNK_SIZE);
+}
+
+uint32_t ppchat_get_file_chunk_size(uint64_t file_size, uint32_t chunk_index) {
+	uint64_t offset = (uint64_t) chunk_index * PPCHAT_FILE_CHUNK_SIZE;
+	if (offset >= file_size)
+		return 0;
+
+	return (uint32_t) min(file_size - offset, (uint64_t) PPCHAT_FILE_CHUNK_SIZE);
+}
+
+int ppchat_encode_file_begin(char *out_payload, uint64_t file_size, uint64_t file_id, const char *name) {
+	size_t name_size = strlen(name);
+	if (name_size == 0 || name_size > (size_t) PPCHAT_FILE_NAME_MAX_SIZE)
+		return -1;
+
+	FileBeginHeader header;
+	header.file_size = file_size;
+	header.file_id = file_id;
+	char *out_name = FileBeginHeaderSchema::encode(header, out_payload);
+	memcpy(out_name, name, name_size);
+	return (int) (FileBeginHeaderSchema::size + name_size);
+}
+
+bool ppchat_decode_file_begin(const char *payload, int payload_size, uint64_t *out_file_size, uint64_t *out_file_id, char *out_name) {
+	int name_size = payload_size - FileBeginHeaderSchema::size;
+	if (name_size <= 0 || name_size > PPCHAT_FILE_NAME_MAX_SIZE)
+		return false;
+
+	const char *name = payload + FileBeginHeaderSchema::size;
+	for (int i = 0; i < name_size; i += 1) {
+		unsigned char character = (unsigned char) name[i];
+		if (character < 0x20 || strchr("<>:\"/\\|?*", character))
+			return false;
+	}
+
+	if ((name_size == 1 && name[0] == '.') || (name_size == 2 && name[0] == '.' && name[1] == '.'))
+		return false;
+
+	FileBeginHeader header = FileBeginHeaderSchema::decode(payload);
+	*out_file_size = header.file_size;
+	*out_file_id = header.file_id;
+
+	memcpy(out_name, name, name_size);
+	out_name[name_size] = '\0';
+	return true;
+}
+
+void ppchat_encode_file_chunk_header(char *out_buffer, FileChunkHeader header) {
+	FileChunkHeaderSchema::encode(header, out_buffer);
+}
+
+FileChunkHeader ppchat_decode_file_chunk_header(const char *buffer) {
+	return FileChunkHeaderSchema::decode(buffer);
+}
+
+// Maps the window of PPCHAT_FILE_WINDOW_SIZE that `offset` falls into.
+static bool map_file_window(HANDLE mapping, DWORD access, uint64_t file_size, uint64_t offset, char **window, uint64_t *window_offset, int *window_size, int *out_error) {
+	if (*window) {
+		UnmapViewOfFile(*window);
+		*window = NULL;
+	}
+
+	// Offset has to be a multiple of the allocation granularity, and the window size is.
+	*window_offset = offset - offset % PPCHAT_FILE_WINDOW_SIZE;
+	*window_size = (int) min(file_size - *window_offset, (uint64_t) PPCHAT_FILE_WINDOW_SIZE);
+
+	*window = (char *) MapViewOfFile(
+		/* Mapping                */ mapping,
+		/* Access                 */ access,
+		/* Offset high            */ (DWORD) (*window_offset >> 32),
+		/* Offset low             */ (DWORD) *window_offset,
+		/* Bytes to map           */ (SIZE_T) *window_size
+	);
+	if (!*window) {
+		*out_error = GetLastError();
+		*window_size = 0;
+		return false;
+	}
+
+	return true;
+}
+
+bool ppchat_file_source_open(FileSource *source, const char *path, int *out_error) {
+	memset(source, 0, sizeof(*source));
+
+	source->name = path;
+	for (const char *character = path; *character; character += 1) {
+		if (*character == '/' || *character == '\\')
+			source->name = character + 1;
+	}
+
+	source->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (source->file == INVALID_HANDLE_VALUE) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	FILETIME last_write_time;
+	if (!GetFileSizeEx(source->file, &size) || !GetFileTime(source->file, NULL, NULL, &last_write_time)) {
+		*out_error = GetLastError();
+		ppchat_file_source_close(source);
+		return false;
+	}
+
+	source->size = (uint64_t) size.QuadPart;
+	source->id = ((uint64_t) last_write_time.dwHighDateTime << 32) | last_write_time.dwLowDateTime;
+	source->chunks_count = ppchat_get_file_chunks_count(source->size);
+
+	// Empty files can't be mapped, and have no chunks anyway.
+	if (source->size > 0) {
+		source->mapping = CreateFileMappingA(source->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!source->mapping) {
+			*out_error = GetLastError();
+			ppchat_file_source_close(source);
+			return false;
+		}
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+void ppchat_file_source_close(FileSource *source) {
+	if (source->window)
+		UnmapViewOfFile(source->window);
+
+	if (source->mapping)
+		CloseHandle(source->mapping);
+
+	if (source->file != INVALID_HANDLE_VALUE && source->file != NULL)
+		CloseHandle(source->file);
+
+	memset(source, 0, sizeof(*source));
+}
+
+bool ppchat_send_file_begin(Socket socket, FileSource *source, int *out_error) {
+	char payload[PPCHAT_FILE_BEGIN_MAX_SIZE];
+	int payload_size = ppchat_encode_file_begin(payload, source->size, source->id, source->name);
+	if (payload_size < 0) {
+		*out_error = ERROR_INVALID_NAME;
+		return false;
+	}
+
+	return ppchat_send_frame(socket, FRAME_TYPE_FILE_BEGIN, 0, payload, payload_size, out_error);
+}
+
+// Reads the chunk through the mapping, which also brings it into the file cache
+// that TransmitFile is about to send it from.
+static bool compute_chunk_crc(FileSource *source, uint32_t chunk_index, uint32_t *out_crc, int *out_error) {
+	uint64_t offset = (uint64_t) chunk_index * PPCHAT_FILE_CHUNK_SIZE;
+	bool in_window = source->window && offset >= source->window_offset && offset < source->window_offset + (uint64_t) source->window_size;
+	if (!in_window && !map_file_window(source->mapping, FILE_MAP_READ, source->size, offset, &source->window, &source->window_offset, &source->window_size, out_error))
+		return false;
+
+	// Reading a mapped file that shrank in the meantime raises an exception instead of failing.
+	__try {
+		*out_crc = ppchat_crc32c(0, source->window + (offset - source->window_offset), ppchat_get_file_chunk_size(source->size, chunk_index));
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		*out_error = ERROR_READ_FAULT;
+		return false;
+	}
+
+	return true;
+}
+
+static bool transmit_chunk(Socket socket, FileSource *source, OVERLAPPED *overlapped, uint32_t chunk_index, uint32_t crc, int *out_error) {
+	uint32_t chunk_size = ppchat_get_file_chunk_size(source->size, chunk_index);
+
+	FileChunkHeader chunk_header;
+	chunk_header.index = chunk_index;
+	chunk_header.crc = crc;
+
+	char head[PPCHAT_FRAME_HEADER_SIZE + PPCHAT_FILE_CHUNK_HEADER_SIZE];
+	ppchat_encode_frame_header(head, FRAME_TYPE_FILE_DATA, FRAME_FLAG_STREAMED, PPCHAT_FILE_CHUNK_HEADER_SIZE + chunk_size);
+	ppchat_encode_file_chunk_header(head + PPCHAT_FRAME_HEADER_SIZE, chunk_header);
+
+	TRANSMIT_FILE_BUFFERS buffers = { };
+	buffers.Head = head;
+	buffers.HeadLength = sizeof(head);
+
+	// The file is read at the offset in `overlapped`, not at its file pointer.
+	uint64_t offset = (uint64_t) chunk_index * PPCHAT_FILE_CHUNK_SIZE;
+	overlapped->Offset = (DWORD) offset;
+	overlapped->OffsetHigh = (DWORD) (offset >> 32);
+	ResetEvent(overlapped->hEvent);
+
+	BOOL transmitted = TransmitFile(
+		/* Socket                 */ socket.handle,
+		/* File                   */ source->file,
+		/* Bytes to write         */ chunk_size,
+		/* Bytes per send         */ 0, // Let the system decide.
+		/* Overlapped             */ overlapped,
+		/* Head and tail buffers  */ &buffers,
+		/* Flags                  */ 0
+	);
+	if (!transmitted) {
+		int error = get_last_socket_error();
+		if (error != WSA_IO_PENDING) {
+			*out_error = error;
+			return false;
+		}
+
+		DWORD bytes_sent = 0;
+		DWORD flags = 0;
+		if (!WSAGetOverlappedResult(socket.handle, overlapped, &bytes_sent, TRUE, &flags)) {
+			*out_error = get_last_socket_error();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Chunk compressed by a worker thread, waiting to be sent.
+typedef struct CompressedChunk {
+	HANDLE   ready_event;       // Set once the chunk is in.
+	uint32_t index;
+	uint32_t crc;
+	int      payload_size;      // Zero if the chunk didn't compress and is sent from the file.
+	int      error;
+	char    *payload;           // Chunk header, then the compressed chunk.
+} CompressedChunk;
+
+// Worker threads take chunks in order and compress each into slot `chunk % slots_count`.
+// A thread only takes a chunk once it holds a free slot, and the sender frees one per
+// chunk it has sent, so threads never get more than `slots_count` chunks ahead.
+typedef struct ChunkCompressor {
+	FileSource     *source;
+	uint32_t        first_chunk;
+	volatile LONG   next_chunk;
+	volatile LONG   cancelled;
+	HANDLE          free_slots;   // Semaphore.
+	CompressedChunk slots[2 * PPCHAT_FILE_MAX_COMPRESSION_THREADS];
+	int             slots_count;
+	HANDLE          threads[PPCHAT_FILE_MAX_COMPRESSION_THREADS];
+	int             threads_count;
+} ChunkCompressor;
+
+// Maps the chunk on its own, so that threads don't share a window.
+static void compress_chunk(FileSource *source, CompressedChunk *chunk) {
+	uint64_t offset = (uint64_t) chunk->index * PPCHAT_FILE_CHUNK_SIZE;
+	int size = (int) ppchat_get_file_chunk_size(source->size, chunk->index);
+
+	chunk->payload_size = 0;
+	chunk->error = 0;
+
+	char *view = (char *) MapViewOfFile(
+		/* Mapping                */ source->mapping,
+		/* Access                 */ FILE_MAP_READ,
+		/* Offset high            */ (DWORD) (offset >> 32),
+		/* Offset low             */ (DWORD) offset,
+		/* Bytes to map           */ (SIZE_T) size
+	);
+	if (!view) {
+		chunk->error = GetLastError();
+		return;
+	}
+
+	// Reading a mapped file that shrank in the meantime raises an exception instead of failing.
+	__try {
+		chunk->crc = ppchat_crc32c(0, view, size);
+		int compressed_size = ppchat_compress_payload(view, size, chunk->payload + PPCHAT_FILE_CHUNK_HEADER_SIZE);
+		if (compressed_size > 0)
+			chunk->payload_size = PPCHAT_FILE_CHUNK_HEADER_SIZE + compressed_size;
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		chunk->error = ERROR_READ_FAULT;
+	}
+
+	UnmapViewOfFile(view);
+}
+
+static DWORD CALLBACK run_chunk_compressor(void *context) {
+	ChunkCompressor *compressor = static_cast<ChunkCompressor *>(context);
+
+	while (true) {
+		WaitForSingleObject(compressor->free_slots, INFINITE);
+		if (ReadAcquire(&compressor->cancelled))
+			break;
+
+		uint32_t chunk_index = (uint32_t) (InterlockedIncrement(&compressor->next_chunk) - 1);
+		if (chunk_index >= compressor->source->chunks_count)
+			break;
+
+		CompressedChunk *chunk = &compressor->slots[(chunk_index - compressor->first_chunk) % compressor->slots_count];
+		chunk->index = chunk_index;
+		compress_chunk(compressor->source, chunk);
+		SetEvent(chunk->ready_event);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Stops the threads wherever they are and frees the slots.
+static void stop_chunk_compressor(ChunkCompressor *compressor) {
+	InterlockedExchange(&compressor->cancelled, 1);
+	if (compressor->free_slots) {
+		// Every thread takes at most one more slot before it sees that it has to stop.
+		ReleaseSemaphore(compressor->free_slots, compressor->threads_count, NULL);
+	}
+
+	if (compressor->threads_count > 0)
+		WaitForMultipleObjects(compressor->threads_count, compressor->threads, TRUE, INFINITE);
+
+	for (int i = 0; i < compressor->threads_count; i += 1)
+		CloseHandle(compressor->threads[i]);
+
+	for (int i = 0; i < compressor->slots_count; i += 1) {
+		CompressedChunk *chunk = &compressor->slots[i];
+		if (chunk->ready_event)
+			CloseHandle(chunk->ready_event);
+
+		free(chunk->payload);
+	}
+
+	if (compressor->free_slots)
+		CloseHandle(compressor->free_slots);
+
+	memset(compressor, 0, sizeof(*compressor));
+}
+
+// A thread per core but the one that sends, two slots per thread so that
+// every thread has a chunk to go on with while the one before is being sent.
+static bool start_chunk_compressor(ChunkCompressor *compressor, FileSource *source, uint32_t first_chunk, int *out_error) {
+	memset(compressor, 0, sizeof(*compressor));
+	compressor->source = source;
+	compressor->first_chunk = first_chunk;
+	compressor->next_chunk = (LONG) first_chunk;
+
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int threads_count = clamp(1, PPCHAT_FILE_MAX_COMPRESSION_THREADS, (int) system_info.dwNumberOfProcessors - 1);
+	int slots_count = 2 * threads_count;
+
+	for (int i = 0; i < slots_count; i += 1) {
+		CompressedChunk *chunk = &compressor->slots[i];
+		chunk->ready_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+		chunk->payload = (char *) malloc(PPCHAT_FILE_DATA_MAX_PAYLOAD_SIZE);
+		compressor->slots_count += 1;
+		if (!chunk->ready_event || !chunk->payload) {
+			*out_error = (chunk->ready_event) ? ERROR_NOT_ENOUGH_MEMORY : GetLastError();
+			stop_chunk_compressor(compressor);
+			return false;
+		}
+	}
+
+	compressor->free_slots = CreateSemaphoreA(NULL, slots_count, slots_count + threads_count, NULL);
+	if (!compressor->free_slots) {
+		*out_error = GetLastError();
+		stop_chunk_compressor(compressor);
+		return false;
+	}
+
+	for (int i = 0; i < threads_count; i += 1) {
+		HANDLE thread = CreateThread(NULL, 0, run_chunk_compressor, compressor, 0, NULL);
+		if (!thread) {
+			*out_error = GetLastError();
+			stop_chunk_compressor(compressor);
+			return false;
+		}
+
+		compressor->threads[i] = thread;
+		compressor->threads_count += 1;
+	}
+
+	return true;
+}
+
+static bool send_compressed_chunks(Socket socket, FileSource *source, OVERLAPPED *overlapped, uint32_t first_chunk, int *out_error) {
+	ChunkCompressor *compressor = (ChunkCompressor *) malloc(sizeof(ChunkCompressor));
+	if (!compressor) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+
+	if (!start_chunk_compressor(compressor, source, first_chunk, out_error)) {
+		free(compressor);
+		return false;
+	}
+
+	bool sent = true;
+	for (uint32_t chunk_index = first_chunk; sent && chunk_index < source->chunks_count; chunk_index += 1) {
+		CompressedChunk *chunk = &compressor->slots[(chunk_index - first_chunk) % compressor->slots_count];
+		WaitForSingleObject(chunk->ready_event, INFINITE);
+
+		if (chunk->error != 0) {
+			*out_error = chunk->error;
+			sent = false;
+		} else if (chunk->payload_size > 0) {
+			FileChunkHeader chunk_header;
+			chunk_header.index = chunk->index;
+			chunk_header.crc = chunk->crc;
+			ppchat_encode_file_chunk_header(chunk->payload, chunk_header);
+
+			sent = ppchat_send_frame(socket, FRAME_TYPE_FILE_DATA, FRAME_FLAG_COMPRESSED, chunk->payload, chunk->payload_size, out_error);
+			source->sent_size += chunk->payload_size - PPCHAT_FILE_CHUNK_HEADER_SIZE;
+			source->compressed_chunks_count += 1;
+		} else {
+			sent = transmit_chunk(socket, source, overlapped, chunk->index, chunk->crc, out_error);
+			source->sent_size += ppchat_get_file_chunk_size(source->size, chunk->index);
+		}
+
+		ReleaseSemaphore(compressor->free_slots, 1, NULL);
+	}
+
+	stop_chunk_compressor(compressor);
+	free(compressor);
+	return sent;
+}
+
+bool ppchat_send_file_chunks(Socket socket, FileSource *source, uint32_t first_chunk, bool compress, int *out_error) {
+	source->sent_size = 0;
+	source->compressed_chunks_count = 0;
+
+	OVERLAPPED overlapped = { };
+	overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!overlapped.hEvent) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	bool sent = true;
+	if (compress && first_chunk < source->chunks_count) {
+		sent = send_compressed_chunks(socket, source, &overlapped, first_chunk, out_error);
+	} else {
+		for (uint32_t chunk_index = first_chunk; sent && chunk_index < source->chunks_count; chunk_index += 1) {
+			uint32_t crc = 0;
+			sent = compute_chunk_crc(source, chunk_index, &crc, out_error) &&
+			       transmit_chunk(socket, source, &overlapped, chunk_index, crc, out_error);
+			if (sent)
+				source->sent_size += ppchat_get_file_chunk_size(source->size, chunk_index);
+		}
+	}
+
+	CloseHandle(overlapped.hEvent);
+
+	if (sent)
+		*out_error = 0;
+
+	return sent;
+}
+
+bool ppchat_file_sink_open(FileSink *sink, const char *path, uint64_t size, bool keep_contents, int *out_error) {
+	memset(sink, 0, sizeof(*sink));
+	sink->size = size;
+
+	DWORD disposition = (keep_contents) ? OPEN_ALWAYS : CREATE_ALWAYS;
+	sink->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (sink->file == INVALID_HANDLE_VALUE) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	// Reserve the whole file up front, so the disk can't run out half way through.
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG) size;
+	if (!SetFilePointerEx(sink->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(sink->file)) {
+		*out_error = GetLastError();
+		ppchat_file_sink_close(sink);
+		return false;
+	}
+
+	// Empty files can't be mapped, and have nothing to receive anyway.
+	if (size > 0) {
+		sink->mapping = CreateFileMappingA(sink->file, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL);
+		if (!sink->mapping) {
+			*out_error = GetLastError();
+			ppchat_file_sink_close(sink);
+			return false;
+		}
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+void ppchat_file_sink_seek(FileSink *sink, uint64_t position) {
+	sink->position = min(position, sink->size);
+}
+
+static bool is_in_sink_window(FileSink *sink, uint64_t offset, int size) {
+	return sink->window && offset >= sink->window_offset && offset + (uint64_t) size <= sink->window_offset + (uint64_t) sink->window_size;
+}
+
+char *ppchat_file_sink_get_destination(FileSink *sink, int *out_size, int *out_error) {
+	*out_size = 0;
+	*out_error = 0;
+
+	uint64_t offset = sink->position;
+	if (offset >= sink->size)
+		return NULL;
+
+	if (!is_in_sink_window(sink, offset, 1) && !map_file_window(sink->mapping, FILE_MAP_WRITE, sink->size, offset, &sink->window, &sink->window_offset, &sink->window_size, out_error))
+		return NULL;
+
+	int window_position = (int) (offset - sink->window_offset);
+	*out_size = sink->window_size - window_position;
+	return sink->window + window_position;
+}
+
+bool ppchat_file_sink_write(FileSink *sink, const char *data, int size, int *out_error) {
+	if ((uint64_t) size > sink->size - sink->position) {
+		*out_error = ERROR_INVALID_DATA;
+		return false;
+	}
+
+	while (size > 0) {
+		int destination_size;
+		char *destination = ppchat_file_sink_get_destination(sink, &destination_size, out_error);
+		if (!destination)
+			return false;
+
+		int written = min(size, destination_size);
+		if (destination != data) {
+			memcpy(destination, data, written);
+			sink->copied_size += written;
+		}
+
+		sink->position += written;
+		data += written;
+		size -= written;
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+char *ppchat_file_sink_view(FileSink *sink, uint64_t offset, int size, int *out_error) {
+	if (offset + (uint64_t) size > sink->size || offset / PPCHAT_FILE_WINDOW_SIZE != (offset + size - 1) / PPCHAT_FILE_WINDOW_SIZE) {
+		*out_error = ERROR_INVALID_PARAMETER;
+		return NULL;
+	}
+
+	if (!is_in_sink_window(sink, offset, size) && !map_file_window(sink->mapping, FILE_MAP_WRITE, sink->size, offset, &sink->window, &sink->window_offset, &sink->window_size, out_error))
+		return NULL;
+
+	*out_error = 0;
+	return sink->window + (offset - sink->window_offset);
+}
+
+void ppchat_file_sink_close(FileSink *sink) {
+	if (sink->window)
+		UnmapViewOfFile(sink->window);
+
+	if (sink->mapping)
+		CloseHandle(sink->mapping);
+
+	if (sink->file != INVALID_HANDLE_VALUE && sink->file != NULL)
+		CloseHandle(sink->file);
+
+	memset(sink, 0, sizeof(*sink));
+}
+
+static bool write_state_at(TransferState *state, uint64_t offset, const void *data, DWORD size, int *out_error) {
+	OVERLAPPED overlapped = { };
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+	DWORD written = 0;
+	if (!WriteFile(state->file, data, size, &written, &overlapped) || written != size) {
+		*out_error = GetLastError();
+		return false;
+	}
+
+	return true;
+}
+
+// Reads the existing state and checks that it describes the same file.
+static bool load_transfer_state(TransferState *state, uint32_t bitmap_size) {
+	TransferStateHeader header;
+	DWORD read = 0;
+	if (!ReadFile(state->file, &header, sizeof(header), &read, NULL) || read != sizeof(header))
+		return false;
+
+	bool same_file = header.magic == TRANSFER_STATE_MAGIC &&
+	                 header.version == TRANSFER_STATE_VERSION &&
+	                 header.file_size == state->file_size &&
+	                 header.file_id == state->file_id &&
+	                 header.chunk_size == (uint32_t) PPCHAT_FILE_CHUNK_SIZE &&
+	                 header.chunks_count == state->chunks_count;
+	if (!same_file)
+		return false;
+
+	if (bitmap_size > 0 && (!ReadFile(state->file, state->bitmap, bitmap_size, &read, NULL) || read != bitmap_size))
+		return false;
+
+	for (uint32_t chunk_index = 0; chunk_index < state->chunks_count; chunk_index += 1) {
+		if (ppchat_transfer_state_has_chunk(state, chunk_index))
+			state->received_chunks_count += 1;
+	}
+
+	return true;
+}
+
+bool ppchat_transfer_state_open(TransferState *state, const char *path, uint64_t file_size, uint64_t file_id, bool *out_resumed, int *out_error) {
+	memset(state, 0, sizeof(*state));
+	*out_resumed = false;
+
+	if (strlen(path) >= sizeof(state->path)) {
+		*out_error = ERROR_FILENAME_EXCED_RANGE;
+		return false;
+	}
+
+	strcpy(state->path, path);
+	state->file_size = file_size;
+	state->file_id = file_id;
+	state->chunks_count = ppchat_get_file_chunks_count(file_size);
+
+	uint32_t bitmap_size = (state->chunks_count + 7) / 8;
+	state->bitmap = (uint8_t *) calloc(max(bitmap_size, 1u), 1);
+	if (!state->bitmap) {
+		*out_error = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+
+	state->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (state->file == INVALID_HANDLE_VALUE) {
+		*out_error = GetLastError();
+		ppchat_transfer_state_close(state, false);
+		return false;
+	}
+
+	if (load_transfer_state(state, bitmap_size)) {
+		*out_resumed = true;
+		*out_error = 0;
+		return true;
+	}
+
+	// Nothing usable there, start over.
+	memset(state->bitmap, 0, max(bitmap_size, 1u));
+	state->received_chunks_count = 0;
+
+	TransferStateHeader header = { };
+	header.magic = TRANSFER_STATE_MAGIC;
+	header.version = TRANSFER_STATE_VERSION;
+	header.file_size = file_size;
+	header.file_id = file_id;
+	header.chunk_size = PPCHAT_FILE_CHUNK_SIZE;
+	header.chunks_count = state->chunks_count;
+
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG) (sizeof(header) + bitmap_size);
+	bool written = write_state_at(state, 0, &header, sizeof(header), out_error) &&
+	               (bitmap_size == 0 || write_state_at(state, sizeof(header), state->bitmap, bitmap_size, out_error));
+	if (!written || !SetFilePointerEx(state->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(state->file)) {
+		if (written)
+			*out_error = GetLastError();
+
+		ppchat_transfer_state_close(state, true);
+		return false;
+	}
+
+	*out_error = 0;
+	return true;
+}
+
+bool ppchat_transfer_state_has_chunk(TransferState *state, uint32_t chunk_index) {
+	return chunk_index < state->chunks_count && (state->bitmap[chunk_index / 8] & (1 << (chunk_index % 8)));
+}
+
+bool ppchat_transfer_state_mark_chunk(TransferState *state, uint32_t chunk_index, int *out_error) {
+	if (chunk_index >= state->chunks_count) {
+		*out_error = ERROR_INVALID_PARAMETER;
+		return false;
+	}
+
+	*out_error = 0;
+	if (ppchat_transfer_state_has_chunk(state, chunk_index))
+		return true;
+
+	// One byte is all that changes. If the process dies before it gets to the disk,
+	// the chunk is just sent once more.
+	uint8_t *byte = &state->bitmap[chunk_index / 8];
+	*byte |= (uint8_t) (1 << (chunk_index % 8));
+	if (!write_state_at(state, sizeof(TransferStateHeader) + chunk_index / 8, byte, 1, out_error)) {
+		*byte &= (uint8_t) ~(1 << (chunk_index % 8));
+		return false;
+	}
+
+	state->received_chunks_count += 1;
+	return true;
+}
+
+uint32_t ppchat_transfer_state_get_first_missing_chunk(TransferState *state) {
+	for (uint32_t byte_index = 0; byte_index < (state->chunks_count + 7) / 8; byte_index += 1) {
+		if (state->bitmap[byte_index] == 0xFF)
+			continue;
+
+		for (uint32_t chunk_index = byte_index * 8; chunk_index < state->chunks_count; chunk_index += 1) {
+			if (!ppchat_transfer_state_has_chunk(state, chunk_index))
+				return chunk_index;
+		}
+	}
+
+	return state->chunks_count;
+}
+
+void ppchat_transfer_state_close(TransferState *state, bool delete_file) {
+	if (state->file != INVALID_HANDLE_VALUE && state->file != NULL) {
+		CloseHandle(state->file);
+		if (delete_file)
+			DeleteFileA(state->path);
+	}
+
+	free(state->bitmap);
+	memset(state, 0, sizeof(*state));
+}